@@ -6,26 +6,41 @@ const port = 5000;
 // 解析JSON请求体
 app.use(express.json());
 
+const rawData = () => ({
+  acc: { 
+    // time: new Date().toLocaleTimeString(), 
+    x: (Math.random() * 2 - 1).toFixed(2), 
+    y: (Math.random() * 2 - 1).toFixed(2), 
+    z: (Math.random() * 2 - 1).toFixed(2) 
+  },
+  angle: { 
+    // time: new Date().toLocaleTimeString(), 
+    x: (Math.random() * 360).toFixed(2), 
+    y: (Math.random() * 360).toFixed(2), 
+    z: (Math.random() * 360).toFixed(2) 
+  }
+});
+
 app.get('/v1/temp/raw', (req, res) => {
-  const data = {
-    acc: { 
-      // time: new Date().toLocaleTimeString(), 
-      x: (Math.random() * 2 - 1).toFixed(2), 
-      y: (Math.random() * 2 - 1).toFixed(2), 
-      z: (Math.random() * 2 - 1).toFixed(2) 
-    },
-    angle: { 
-      // time: new Date().toLocaleTimeString(), 
-      x: (Math.random() * 360).toFixed(2), 
-      y: (Math.random() * 360).toFixed(2), 
-      z: (Math.random() * 360).toFixed(2) 
-    }
-  };
+  const data = rawData();
   res.json(data);
   console.log('Sent raw data', data);
 });
 
 
+// 模拟 Server-Sent Events
+app.get('/v1/events', (req, res) => {
+  const interval = Math.max(Number(req.query.interval) || 250, 100);
+  res.set({ 'Content-Type': 'text/event-stream', 'Cache-Control': 'no-cache' });
+  res.flushHeaders();
+  res.write('retry: 3000\n\n');
+  let id = 0;
+  const timer = setInterval(() => {
+    res.write(`id: ${++id}\ndata: ${JSON.stringify(rawData())}\n\n`);
+  }, interval);
+  req.on('close', () => clearInterval(timer));
+});
+
 var __data = {
   pid: {
     pos: {
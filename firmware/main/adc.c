@@ -3,73 +3,354 @@
  *
  * SPDX-License-Identifier: Apache-2.0
  */
+/*
+ * Continuous ADC service.
+ *
+ * ADC1 converts the configured channels round robin into DMA buffers at
+ * CONFIG_ADC_SAMPLE_RATE_HZ. A low priority task drains the buffers, and
+ * per channel it
+ *   1. averages blocks of raw samples down to CONFIG_ADC_OUTPUT_RATE_HZ,
+ *   2. runs a windowed-sinc FIR low pass at the output rate,
+ *   3. converts to millivolts with the eFuse calibration and applies the
+ *      per signal scale and offset from the settings.
+ * Results go to a history ring and to a snapshot published with a sequence
+ * lock, so readers in the control path never block and never see a torn
+ * update.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <stdatomic.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "soc/soc_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
-#include "driver/gpio.h"
-
-#include "soc/soc_caps.h"
-#include "esp_adc/adc_oneshot.h"
+#include "esp_adc/adc_continuous.h"
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 
 #include "adc.h"
 
-#define POWER_ADC_CHANNEL ADC_CHANNEL_0
-#define VOLT_FILTER_ALPHA   0.6f
+#define ADC_ATTEN               ADC_ATTEN_DB_12
+#define ADC_FRAME_BYTES         256
+#define ADC_POOL_BYTES          2048
+#define ADC_FIR_TAPS            16
+#define ADC_HISTORY_LEN         256
+#define ADC_TASK_PRIORITY       4
+
 static const char *TAG = "adc";
 
-static adc_oneshot_unit_handle_t power_adc_handle = NULL;
-static adc_cali_handle_t power_adc_cali_handle = NULL;
+static const int s_channel_cfg[ADC_SIG_COUNT] = {
+    [ADC_SIG_SUPPLY] = CONFIG_ADC_SUPPLY_CHANNEL,
+    [ADC_SIG_YAW_CURRENT] = CONFIG_ADC_YAW_CURRENT_CHANNEL,
+    [ADC_SIG_PITCH_CURRENT] = CONFIG_ADC_PITCH_CURRENT_CHANNEL,
+    [ADC_SIG_SUPPLY_CURRENT] = CONFIG_ADC_SUPPLY_CURRENT_CHANNEL,
+    [ADC_SIG_LIGHT] = CONFIG_ADC_LIGHT_CHANNEL,
+    [ADC_SIG_QUAD_A] = CONFIG_ADC_QUAD_A_CHANNEL,
+    [ADC_SIG_QUAD_B] = CONFIG_ADC_QUAD_B_CHANNEL,
+    [ADC_SIG_QUAD_C] = CONFIG_ADC_QUAD_C_CHANNEL,
+    [ADC_SIG_QUAD_D] = CONFIG_ADC_QUAD_D_CHANNEL,
+};
+
+typedef struct {
+    int channel;                    // ADC1 channel, -1 if not wired
+    uint32_t acc;                   // decimation accumulator
+    uint32_t acc_count;
+    float fir_delay[ADC_FIR_TAPS];
+    int fir_pos;
+    adc_cal_t cal;
+    float history[ADC_HISTORY_LEN];
+    int history_head;
+    int history_count;
+} adc_signal_state_t;
+
+static adc_continuous_handle_t s_handle = NULL;
+static adc_cali_handle_t s_cali_handle = NULL;
+static TaskHandle_t s_task = NULL;
+static adc_signal_state_t s_signals[ADC_SIG_COUNT];
+static float s_fir_coeff[ADC_FIR_TAPS];
+static uint32_t s_decimation = 1;
+static uint32_t s_overflows = 0;
+
+// sequence lock, odd while the writer updates the snapshot
+static atomic_uint s_seq;
+static adc_snapshot_t s_snapshot;
+
+static esp_err_t adc_calibration_init(adc_unit_t unit, adc_atten_t atten, adc_cali_handle_t *out_handle);
+
+/* Windowed sinc low pass with unity DC gain */
+static void fir_design(float cutoff_hz, float rate_hz)
+{
+    float fc = cutoff_hz / rate_hz;
+    float sum = 0;
+    for (int i = 0; i < ADC_FIR_TAPS; i++) {
+        float m = i - (ADC_FIR_TAPS - 1) / 2.0f;
+        float sinc = m == 0 ? 2 * fc : sinf(2 * M_PI * fc * m) / (M_PI * m);
+        float window = 0.54f - 0.46f * cosf(2 * M_PI * i / (ADC_FIR_TAPS - 1));
+        s_fir_coeff[i] = sinc * window;
+        sum += s_fir_coeff[i];
+    }
+    for (int i = 0; i < ADC_FIR_TAPS; i++) {
+        s_fir_coeff[i] /= sum;
+    }
+}
+
+static float fir_run(adc_signal_state_t *sig, float input)
+{
+    if (sig->history_count == 0 && sig->fir_pos == 0) {
+        // prime the delay line so the output starts at the first value
+        for (int i = 0; i < ADC_FIR_TAPS; i++) {
+            sig->fir_delay[i] = input;
+        }
+    }
+    sig->fir_delay[sig->fir_pos] = input;
+    float out = 0;
+    int idx = sig->fir_pos;
+    for (int i = 0; i < ADC_FIR_TAPS; i++) {
+        out += s_fir_coeff[i] * sig->fir_delay[idx];
+        idx = idx == 0 ? ADC_FIR_TAPS - 1 : idx - 1;
+    }
+    sig->fir_pos = (sig->fir_pos + 1) % ADC_FIR_TAPS;
+    return out;
+}
+
+/* eFuse calibration works on integer codes, interpolate for the fraction left by averaging */
+static float raw_to_mv(float raw)
+{
+    int code = (int)raw;
+    int mv0 = 0, mv1 = 0;
+    if (s_cali_handle == NULL) {
+        return raw * 3100.0f / 4095.0f; // nominal 12dB range
+    }
+    adc_cali_raw_to_voltage(s_cali_handle, code, &mv0);
+    adc_cali_raw_to_voltage(s_cali_handle, code + 1, &mv1);
+    return mv0 + (mv1 - mv0) * (raw - code);
+}
+
+static void publish(void)
+{
+    unsigned seq = atomic_load_explicit(&s_seq, memory_order_relaxed);
+    atomic_store_explicit(&s_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        adc_signal_state_t *sig = &s_signals[i];
+        s_snapshot.value[i] = sig->history_count ? sig->history[(sig->history_head + ADC_HISTORY_LEN - 1) % ADC_HISTORY_LEN] : NAN;
+    }
+    s_snapshot.timestamp_us = esp_timer_get_time();
+    s_snapshot.sequence++;
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&s_seq, seq + 2, memory_order_relaxed);
+}
+
+static void process_sample(uint32_t channel, uint32_t data)
+{
+    bool output = false;
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        adc_signal_state_t *sig = &s_signals[i];
+        if (sig->channel != (int)channel) {
+            continue;
+        }
+        sig->acc += data;
+        if (++sig->acc_count < s_decimation) {
+            continue;
+        }
+        float raw = fir_run(sig, (float)sig->acc / sig->acc_count);
+        sig->acc = 0;
+        sig->acc_count = 0;
+        sig->history[sig->history_head] = raw_to_mv(raw) * sig->cal.scale + sig->cal.offset;
+        sig->history_head = (sig->history_head + 1) % ADC_HISTORY_LEN;
+        if (sig->history_count < ADC_HISTORY_LEN) {
+            sig->history_count++;
+        }
+        output = true;
+    }
+    if (output) {
+        publish();
+    }
+}
+
+static void adc_task(void *arg)
+{
+    static uint8_t frame[ADC_FRAME_BYTES];
+    uint32_t len = 0;
+    uint32_t overflows = 0;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (overflows != s_overflows) {
+            overflows = s_overflows;
+            ESP_LOGW(TAG, "DMA pool overflow, %u so far", (unsigned)overflows);
+        }
+        while (adc_continuous_read(s_handle, frame, sizeof(frame), &len, 0) == ESP_OK) {
+            for (uint32_t i = 0; i < len; i += SOC_ADC_DIGI_RESULT_BYTES) {
+                adc_digi_output_data_t *p = (adc_digi_output_data_t *)&frame[i];
+                if (p->type2.unit == ADC_UNIT_1 && p->type2.channel < SOC_ADC_CHANNEL_NUM(ADC_UNIT_1)) {
+                    process_sample(p->type2.channel, p->type2.data);
+                }
+            }
+        }
+    }
+}
+
+static bool IRAM_ATTR on_conv_done(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
+{
+    BaseType_t must_yield = pdFALSE;
+    vTaskNotifyGiveFromISR(s_task, &must_yield);
+    return must_yield == pdTRUE;
+}
 
-static int adc_raw = 0;
-static esp_err_t adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_cali_handle_t *out_handle);
-static void adc_calibration_deinit(adc_cali_handle_t handle);
-static int filtered_voltage = 0;
+static bool IRAM_ATTR on_pool_ovf(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
+{
+    s_overflows++;
+    return false;
+}
 
 void adc_init(void)
 {
-    //-------------ADC Init---------------//
+    adc_digi_pattern_config_t pattern[SOC_ADC_PATT_LEN_MAX] = {0};
+    int pattern_num = 0;
+
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        adc_signal_state_t *sig = &s_signals[i];
+        sig->channel = s_channel_cfg[i];
+        if (sig->cal.scale == 0) {
+            // uncalibrated: raw millivolts
+            sig->cal.scale = 1.0f;
+        }
+        if (sig->channel < 0) {
+            continue;
+        }
+        pattern[pattern_num].atten = ADC_ATTEN;
+        pattern[pattern_num].channel = sig->channel;
+        pattern[pattern_num].unit = ADC_UNIT_1;
+        pattern[pattern_num].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+        pattern_num++;
+    }
+    if (pattern_num == 0) {
+        ESP_LOGE(TAG, "no ADC channel configured");
+        return;
+    }
+
+    // every channel gets an equal share of the conversion rate
+    uint32_t per_channel = CONFIG_ADC_SAMPLE_RATE_HZ / pattern_num;
+    s_decimation = per_channel / CONFIG_ADC_OUTPUT_RATE_HZ;
+    if (s_decimation == 0) {
+        s_decimation = 1;
+    }
+    fir_design(CONFIG_ADC_FILTER_CUTOFF_HZ, CONFIG_ADC_OUTPUT_RATE_HZ);
 
-    adc_oneshot_unit_init_cfg_t init_config1 = {
-        .unit_id = ADC_UNIT_1,
+    //-------------ADC Init---------------//
+    adc_continuous_handle_cfg_t handle_config = {
+        .max_store_buf_size = ADC_POOL_BYTES,
+        .conv_frame_size = ADC_FRAME_BYTES,
     };
-    ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config1, &power_adc_handle));
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_config, &s_handle));
 
     //-------------ADC Config---------------//
-    adc_oneshot_chan_cfg_t config = {
-        .bitwidth = SOC_ADC_RTC_MAX_BITWIDTH,
-        .atten = ADC_ATTEN_DB_12,
+    adc_continuous_config_t dig_cfg = {
+        .pattern_num = pattern_num,
+        .adc_pattern = pattern,
+        .sample_freq_hz = CONFIG_ADC_SAMPLE_RATE_HZ,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
     };
-    ESP_ERROR_CHECK(adc_oneshot_config_channel(power_adc_handle, POWER_ADC_CHANNEL, &config));
+    ESP_ERROR_CHECK(adc_continuous_config(s_handle, &dig_cfg));
 
     //-------------ADC Calibration Init---------------//
+    if (adc_calibration_init(ADC_UNIT_1, ADC_ATTEN, &s_cali_handle) != ESP_OK) {
+        s_cali_handle = NULL;
+    }
 
-    ESP_ERROR_CHECK(adc_calibration_init(ADC_UNIT_1, POWER_ADC_CHANNEL, ADC_ATTEN_DB_12, &power_adc_cali_handle));
+    xTaskCreate(adc_task, "adc", 3072, NULL, ADC_TASK_PRIORITY, &s_task);
+    adc_continuous_evt_cbs_t cbs = {
+        .on_conv_done = on_conv_done,
+        .on_pool_ovf = on_pool_ovf,
+    };
+    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(s_handle, &cbs, NULL));
+    ESP_ERROR_CHECK(adc_continuous_start(s_handle));
+    ESP_LOGI(TAG, "%d channels at %dHz, decimation %u, output %dHz, FIR %d taps fc %dHz",
+             pattern_num, CONFIG_ADC_SAMPLE_RATE_HZ, (unsigned)s_decimation,
+             CONFIG_ADC_OUTPUT_RATE_HZ, ADC_FIR_TAPS, CONFIG_ADC_FILTER_CUTOFF_HZ);
+}
 
+void adc_get_snapshot(adc_snapshot_t *snapshot)
+{
+    unsigned seq;
+    do {
+        seq = atomic_load_explicit(&s_seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+        *snapshot = s_snapshot;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&s_seq, memory_order_relaxed));
+}
+
+float adc_read(adc_signal_t signal)
+{
+    if (signal >= ADC_SIG_COUNT || s_signals[signal].channel < 0) {
+        return NAN;
+    }
+    adc_snapshot_t snapshot;
+    adc_get_snapshot(&snapshot);
+    return snapshot.value[signal];
 }
 
 float adc_read_voltage(void)
 {
-    adc_oneshot_read(power_adc_handle, POWER_ADC_CHANNEL, &adc_raw);
-    int voltage = 0;
-    adc_cali_raw_to_voltage(power_adc_cali_handle, adc_raw, &voltage);
-    if (filtered_voltage == 0) {
-        filtered_voltage = voltage;
+    float voltage = adc_read(ADC_SIG_SUPPLY);
+    return isnan(voltage) ? 0.0f : voltage;
+}
+
+int adc_get_history(adc_signal_t signal, float *dst, int max_count)
+{
+    if (signal >= ADC_SIG_COUNT || dst == NULL) {
+        return 0;
+    }
+    // the ring is only written by the adc task, copy and drop what it overwrote meanwhile
+    adc_signal_state_t *sig = &s_signals[signal];
+    int count = sig->history_count < max_count ? sig->history_count : max_count;
+    int head = sig->history_head;
+    for (int i = 0; i < count; i++) {
+        dst[i] = sig->history[(head - count + i + ADC_HISTORY_LEN) % ADC_HISTORY_LEN];
+    }
+    return count;
+}
+
+int adc_get_output_rate(void)
+{
+    return CONFIG_ADC_OUTPUT_RATE_HZ;
+}
+
+void adc_set_calibration(adc_signal_t signal, const adc_cal_t *cal)
+{
+    if (signal < ADC_SIG_COUNT && cal != NULL) {
+        s_signals[signal].cal = *cal; // two floats, a reader may mix old and new for one sample
     }
-    filtered_voltage = VOLT_FILTER_ALPHA * voltage + (1.0f - VOLT_FILTER_ALPHA) * filtered_voltage;
-    return filtered_voltage* 4.17f * 11.0f / 4096.0f ;
 }
 
+void adc_pause(bool pause)
+{
+    if (s_handle == NULL) {
+        return;
+    }
+    if (pause) {
+        ESP_ERROR_CHECK(adc_continuous_stop(s_handle));
+    } else {
+        ESP_ERROR_CHECK(adc_continuous_start(s_handle));
+    }
+}
 
-static esp_err_t adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_cali_handle_t *out_handle)
+bool adc_is_wired(adc_signal_t signal)
+{
+    return signal < ADC_SIG_COUNT && s_channel_cfg[signal] >= 0;
+}
+
+static esp_err_t adc_calibration_init(adc_unit_t unit, adc_atten_t atten, adc_cali_handle_t *out_handle)
 {
     adc_cali_handle_t handle = NULL;
     esp_err_t ret = ESP_FAIL;
@@ -81,7 +362,7 @@ static esp_err_t adc_calibration_init(adc_unit_t unit, adc_channel_t channel, ad
         adc_cali_curve_fitting_config_t cali_config = {
             .unit_id = unit,
             .atten = atten,
-            .bitwidth = SOC_ADC_RTC_MAX_BITWIDTH,
+            .bitwidth = SOC_ADC_DIGI_MAX_BITWIDTH,
         };
         ret = adc_cali_create_scheme_curve_fitting(&cali_config, &handle);
         if (ret == ESP_OK) {
@@ -96,7 +377,7 @@ static esp_err_t adc_calibration_init(adc_unit_t unit, adc_channel_t channel, ad
         adc_cali_line_fitting_config_t cali_config = {
             .unit_id = unit,
             .atten = atten,
-            .bitwidth = SOC_ADC_RTC_MAX_BITWIDTH,
+            .bitwidth = SOC_ADC_DIGI_MAX_BITWIDTH,
         };
         ret = adc_cali_create_scheme_line_fitting(&cali_config, &handle);
         if (ret == ESP_OK) {
@@ -116,9 +397,3 @@ static esp_err_t adc_calibration_init(adc_unit_t unit, adc_channel_t channel, ad
 
     return calibrated ? ESP_OK : ESP_FAIL;
 }
-
-__attribute__((unused)) static void adc_calibration_deinit(adc_cali_handle_t handle)
-{
-    ESP_LOGI(TAG, "deregister %s calibration scheme", "Curve Fitting");
-    ESP_ERROR_CHECK(adc_cali_delete_scheme_curve_fitting(handle));
-}
@@ -1,9 +1,45 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief Analog signals, each one is mapped to an ADC1 channel in Kconfig
+ */
+typedef enum {
+    ADC_SIG_SUPPLY = 0,         // supply voltage, V
+    ADC_SIG_YAW_CURRENT,        // yaw motor current, A
+    ADC_SIG_PITCH_CURRENT,      // pitch motor current, A
+    ADC_SIG_SUPPLY_CURRENT,     // board supply current, A
+    ADC_SIG_LIGHT,              // global horizontal irradiance, W/m2
+    ADC_SIG_QUAD_A,             // sun sensor quadrants, V, see fine_tracker.h
+    ADC_SIG_QUAD_B,
+    ADC_SIG_QUAD_C,
+    ADC_SIG_QUAD_D,
+    ADC_SIG_COUNT
+} adc_signal_t;
+
+/**
+ * @brief Linear calibration from calibrated ADC millivolts to the signal unit
+ */
+typedef struct {
+    float scale;
+    float offset;
+} adc_cal_t;
+
+/**
+ * @brief Filtered values of all signals at one instant
+ */
+typedef struct {
+    float value[ADC_SIG_COUNT];     // NAN for signals that are not wired
+    int64_t timestamp_us;
+    uint32_t sequence;              // increments with every published output
+} adc_snapshot_t;
+
 /**
  * @brief Initialize ADC in continuous mode
  */
@@ -11,10 +47,41 @@ void adc_init(void);
 
 /**
  * @brief Read voltage from ADC
- * @return Voltage in mV, or -1.0 if error
+ * @return Filtered supply voltage in V
  */
 float adc_read_voltage(void);
 
+/**
+ * @brief Read one filtered signal, never blocks
+ * @return value in the signal unit, NAN if the signal is not wired
+ */
+float adc_read(adc_signal_t signal);
+
+/**
+ * @brief Copy a consistent snapshot of all signals, never blocks
+ */
+void adc_get_snapshot(adc_snapshot_t *snapshot);
+
+/**
+ * @brief Copy the most recent filtered samples of a signal, oldest first
+ * @return number of samples copied
+ */
+int adc_get_history(adc_signal_t signal, float *dst, int max_count);
+
+/**
+ * @brief Sample rate of the filtered output in Hz
+ */
+int adc_get_output_rate(void);
+
+void adc_set_calibration(adc_signal_t signal, const adc_cal_t *cal);
+
+/**
+ * @brief Stop / restart the conversions, a running ADC keeps the chip out of light sleep
+ */
+void adc_pause(bool pause);
+
+bool adc_is_wired(adc_signal_t signal);
+
 #ifdef __cplusplus
 }
 #endif
@@ -13,6 +13,11 @@
 #include "adc.h"
 #include "web.h"
 #include "led.h"
+#include "power.h"
+#include "light_sensor.h"
+#include "tslog.h"
+#include "recorder.h"
+#include "profiler.h"
 
 static const char *TAG = "app_main";
 
@@ -31,9 +36,15 @@ extern "C" void app_main()
 
     led_init();
     g_settings.load();
+    recorder_init();
+    power_init();
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        adc_set_calibration((adc_signal_t)i, g_settings.adcCal(i));
+    }
     adc_init();
     vTaskDelay(pdMS_TO_TICKS(100));
     bsp_i2c_init();
+    light_sensor_init();
 
     /** Determine whether to restore the settings by reading the restart count */
     int restart_cnt = restart_count_get();
@@ -65,4 +76,7 @@ extern "C" void app_main()
     }
 
     gimbal.init();
+    power_start();
+    tslog_init();
+    profiler_init();
 }
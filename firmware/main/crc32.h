@@ -0,0 +1,33 @@
+/*
+   Reflected CRC-32, polynomial 0xedb88320, the crc of zlib, the ephemeris
+   table, fleet datagrams and the tslog blocks. The chip has it in ROM;
+   the host tools and tests use the bitwise loop, which is as fast as they
+   need.
+
+   crc32_le(0, data, size) is zlib's crc32 of the data, passing the result
+   back in continues it over the next buffer, as esp_rom_crc32_le.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __linux__
+#include "esp_rom_crc.h"
+#endif
+
+static inline uint32_t crc32_le(uint32_t crc, const uint8_t *data, size_t size)
+{
+#ifdef __linux__
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+#else
+    return esp_rom_crc32_le(crc, data, size);
+#endif
+}
@@ -0,0 +1,227 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "energy.h"
+
+static const char *TAG = "energy";
+
+#define ENERGY_MAGIC            0x454e4731  // "ENG1"
+#define ENERGY_FLUSH_S          1.0f        // pending sums are folded into the buckets once a second
+#define ENERGY_POWER_TAU_S      1.0f
+
+typedef struct {
+    uint32_t magic;
+    uint16_t hour_head;     // index of the open bucket
+    uint16_t hour_count;
+    uint16_t day_head;
+    uint16_t day_count;
+    energy_bucket_t hours[ENERGY_HOURS];
+    energy_bucket_t days[ENERGY_DAYS];
+    energy_bucket_t total;
+    uint32_t crc;
+} energy_store_t;
+
+static RTC_NOINIT_ATTR energy_store_t s_store;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Control cycles add a few mJ each, summing them straight into a day total
+// of tens of kJ would lose them to float rounding. They are collected here
+// and folded in once a second.
+static energy_bucket_t s_pending;
+static float s_pending_time = 0.0f;
+static float s_power[ENERGY_AXIS_COUNT];
+static float s_budget_wh = 0.0f;
+static bool s_over_budget = false;
+
+static const char *s_mode_names[] = {
+#define X(name, desc) desc,
+    ENERGY_MODE_LIST
+#undef X
+};
+
+static uint32_t store_crc(void)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&s_store, offsetof(energy_store_t, crc));
+}
+
+static bool store_valid(void)
+{
+    return s_store.magic == ENERGY_MAGIC && s_store.crc == store_crc() &&
+           s_store.hour_head < ENERGY_HOURS && s_store.hour_count <= ENERGY_HOURS &&
+           s_store.day_head < ENERGY_DAYS && s_store.day_count <= ENERGY_DAYS;
+}
+
+static void store_reset(uint32_t now)
+{
+    memset(&s_store, 0, sizeof(s_store));
+    s_store.magic = ENERGY_MAGIC;
+    s_store.total.start = now;
+    s_store.crc = store_crc();
+}
+
+static void bucket_add(energy_bucket_t *dst, const energy_bucket_t *src)
+{
+    for (int a = 0; a < ENERGY_AXIS_COUNT; a++) {
+        for (int m = 0; m < ENERGY_MODE_COUNT; m++) {
+            dst->joule[a][m] += src->joule[a][m];
+            dst->seconds[a][m] += src->seconds[a][m];
+        }
+    }
+}
+
+/**
+ * @brief Open a new bucket in the ring unless the open one starts at `start`
+ */
+static energy_bucket_t *ring_select(energy_bucket_t *ring, int size, uint16_t *head, uint16_t *count, uint32_t start)
+{
+    if (*count > 0 && ring[*head].start == start) {
+        return &ring[*head];
+    }
+    if (*count > 0) {
+        *head = (*head + 1) % size;
+    }
+    if (*count < size) {
+        (*count)++;
+    }
+    memset(&ring[*head], 0, sizeof(energy_bucket_t));
+    ring[*head].start = start;
+    return &ring[*head];
+}
+
+static int ring_copy(const energy_bucket_t *ring, int size, uint16_t head, uint16_t count,
+                     energy_bucket_t *dst, int max_count)
+{
+    int n = count < max_count ? count : max_count;
+    // the newest n buckets, oldest first
+    for (int i = 0; i < n; i++) {
+        dst[i] = ring[(head + size - (n - 1 - i)) % size];
+    }
+    return n;
+}
+
+static void flush(void)
+{
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    uint32_t hour_start = (uint32_t)(now - now % 3600);
+    uint32_t day_start = (uint32_t)(now - (local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec));
+
+    portENTER_CRITICAL(&s_lock);
+    energy_bucket_t *hour = ring_select(s_store.hours, ENERGY_HOURS, &s_store.hour_head, &s_store.hour_count, hour_start);
+    energy_bucket_t *day = ring_select(s_store.days, ENERGY_DAYS, &s_store.day_head, &s_store.day_count, day_start);
+    bucket_add(hour, &s_pending);
+    bucket_add(day, &s_pending);
+    bucket_add(&s_store.total, &s_pending);
+    s_store.crc = store_crc();
+    float day_wh = energy_bucket_wh(day);
+    portEXIT_CRITICAL(&s_lock);
+
+    memset(&s_pending, 0, sizeof(s_pending));
+    s_pending_time = 0.0f;
+
+    bool over = s_budget_wh > 0 && day_wh > s_budget_wh;
+    if (over && !s_over_budget) {
+        ESP_LOGW(TAG, "daily budget exceeded: %.2fWh of %.2fWh", day_wh, s_budget_wh);
+    }
+    s_over_budget = over;
+}
+
+void energy_init(void)
+{
+    if (store_valid()) {
+        ESP_LOGI(TAG, "restored %u hours, %u days, %.2fWh in total",
+                 s_store.hour_count, s_store.day_count, energy_bucket_wh(&s_store.total));
+    } else {
+        ESP_LOGI(TAG, "no energy history, starting empty");
+        store_reset((uint32_t)time(NULL));
+    }
+    memset(&s_pending, 0, sizeof(s_pending));
+    s_pending_time = 0.0f;
+}
+
+void energy_add(energy_axis_t axis, energy_mode_t mode, float power_w, float dt)
+{
+    if (axis >= ENERGY_AXIS_COUNT || mode >= ENERGY_MODE_COUNT || !(dt > 0) || !isfinite(power_w)) {
+        return;
+    }
+    s_pending.joule[axis][mode] += power_w * dt;
+    s_pending.seconds[axis][mode] += dt;
+    float alpha = dt < ENERGY_POWER_TAU_S ? dt / ENERGY_POWER_TAU_S : 1.0f;
+    s_power[axis] += (power_w - s_power[axis]) * alpha;
+
+    // every axis reports each cycle, the yaw time stands for the cycle time
+    if (axis == ENERGY_AXIS_YAW) {
+        s_pending_time += dt;
+        if (s_pending_time >= ENERGY_FLUSH_S) {
+            flush();
+        }
+    }
+}
+
+float energy_get_power(energy_axis_t axis)
+{
+    return axis < ENERGY_AXIS_COUNT ? s_power[axis] : 0.0f;
+}
+
+int energy_get_hours(energy_bucket_t *dst, int max_count)
+{
+    portENTER_CRITICAL(&s_lock);
+    int n = ring_copy(s_store.hours, ENERGY_HOURS, s_store.hour_head, s_store.hour_count, dst, max_count);
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
+
+int energy_get_days(energy_bucket_t *dst, int max_count)
+{
+    portENTER_CRITICAL(&s_lock);
+    int n = ring_copy(s_store.days, ENERGY_DAYS, s_store.day_head, s_store.day_count, dst, max_count);
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
+
+void energy_get_total(energy_bucket_t *dst)
+{
+    portENTER_CRITICAL(&s_lock);
+    *dst = s_store.total;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+float energy_bucket_wh(const energy_bucket_t *bucket)
+{
+    float joule = 0.0f;
+    for (int a = 0; a < ENERGY_AXIS_COUNT; a++) {
+        for (int m = 0; m < ENERGY_MODE_COUNT; m++) {
+            joule += bucket->joule[a][m];
+        }
+    }
+    return joule / 3600.0f;
+}
+
+void energy_set_daily_budget(float wh)
+{
+    s_budget_wh = wh;
+}
+
+bool energy_over_budget(void)
+{
+    return s_over_budget;
+}
+
+void energy_clear(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    store_reset((uint32_t)time(NULL));
+    portEXIT_CRITICAL(&s_lock);
+    ESP_LOGI(TAG, "energy history cleared");
+}
+
+const char *energy_mode_name(energy_mode_t mode)
+{
+    return mode < ENERGY_MODE_COUNT ? s_mode_names[mode] : "unknown";
+}
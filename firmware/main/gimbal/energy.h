@@ -0,0 +1,94 @@
+/*
+   Motor energy accounting.
+
+   Gimbal reports the electrical power of each axis every control cycle
+   together with what the axis is doing. The power comes from the measured
+   current when there is current sense, otherwise from the motor model, see
+   Motor::get_power().
+
+   Energy and time are summed per axis and mode into rolling hourly and
+   daily buckets plus a running total. The buckets live in RTC memory, so
+   they survive software resets, panics and deep sleep; a power cycle
+   starts from zero. Hours are aligned to UTC, days to local midnight. The
+   wall clock jumps when GPS time arrives, a jump simply opens a new bucket.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ENERGY_HOURS    24
+#define ENERGY_DAYS     14
+
+#define ENERGY_MODE_LIST \
+X(ENERGY_IDLE, "idle") \
+X(ENERGY_TRACKING, "tracking") \
+X(ENERGY_SLEW, "slew") \
+X(ENERGY_HOMING, "homing") \
+
+typedef enum {
+#define X(name, desc) name,
+    ENERGY_MODE_LIST
+#undef X
+    ENERGY_MODE_COUNT
+} energy_mode_t;
+
+typedef enum {
+    ENERGY_AXIS_YAW = 0,
+    ENERGY_AXIS_PITCH,
+    ENERGY_AXIS_COUNT
+} energy_axis_t;
+
+typedef struct {
+    uint32_t start;     // unix time of the first second of the bucket
+    float joule[ENERGY_AXIS_COUNT][ENERGY_MODE_COUNT];
+    float seconds[ENERGY_AXIS_COUNT][ENERGY_MODE_COUNT];
+} energy_bucket_t;
+
+/**
+ * @brief Restore the buckets kept in RTC memory, or start empty
+ */
+void energy_init(void);
+
+/**
+ * @brief Account one control period of an axis, called from the control task only
+ * @param power_w electrical power drawn during the period
+ * @param dt period in s
+ */
+void energy_add(energy_axis_t axis, energy_mode_t mode, float power_w, float dt);
+
+/**
+ * @brief Power of an axis averaged over about one second, W
+ */
+float energy_get_power(energy_axis_t axis);
+
+/**
+ * @brief Copy the hourly / daily buckets, oldest first, the last one is still open
+ * @return number of buckets copied
+ */
+int energy_get_hours(energy_bucket_t *dst, int max_count);
+int energy_get_days(energy_bucket_t *dst, int max_count);
+
+/**
+ * @brief Everything since the buckets were last cleared, start is the clear time
+ */
+void energy_get_total(energy_bucket_t *dst);
+
+/**
+ * @brief Sum of a bucket over axes and modes in Wh
+ */
+float energy_bucket_wh(const energy_bucket_t *bucket);
+
+/**
+ * @brief Daily motor energy budget in Wh, 0 disables it
+ */
+void energy_set_daily_budget(float wh);
+
+/**
+ * @brief True once the open day has used more than the budget
+ */
+bool energy_over_budget(void);
+
+void energy_clear(void);
+
+const char *energy_mode_name(energy_mode_t mode);
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "ephemeris_table.h"
+
+static const char *TAG = "ephemeris";
+
+static ephemeris_table_header_t s_header;
+static ephemeris_day_t *s_days = NULL;
+
+bool ephemeris_table_load(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        ESP_LOGI(TAG, "no table at %s", path);
+        return false;
+    }
+    ephemeris_table_header_t header;
+    ephemeris_day_t *days = NULL;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == EPHEMERIS_TABLE_MAGIC &&
+              header.version == EPHEMERIS_TABLE_VERSION && header.days > 0;
+    if (ok) {
+        days = (ephemeris_day_t *)malloc(header.days * sizeof(ephemeris_day_t));
+        ok = days != NULL && fread(days, sizeof(ephemeris_day_t), header.days, f) == header.days &&
+             esp_rom_crc32_le(0, (const uint8_t *)days, header.days * sizeof(ephemeris_day_t)) == header.crc;
+    }
+    fclose(f);
+    if (!ok) {
+        ESP_LOGW(TAG, "%s is not a valid table", path);
+        free(days);
+        return false;
+    }
+    free(s_days);
+    s_header = header;
+    s_days = days;
+    ESP_LOGI(TAG, "%u days from %lld for %.3f, %.3f, azimuth %.1f..%.1f", header.days, (long long)header.start,
+             header.latitude, header.longitude, header.min_azimuth, header.max_azimuth);
+    return true;
+}
+
+bool ephemeris_table_day(time_t t, float latitude, float longitude, ephemeris_day_t *day, time_t *day_start)
+{
+    if (s_days == NULL || fabsf(latitude - s_header.latitude) > EPHEMERIS_MATCH_DEG ||
+            fabsf(longitude - s_header.longitude) > EPHEMERIS_MATCH_DEG || t < s_header.start) {
+        return false;
+    }
+    int64_t index = (t - s_header.start) / 86400;
+    if (index >= s_header.days) {
+        return false;
+    }
+    *day = s_days[index];
+    *day_start = s_header.start + index * 86400;
+    return true;
+}
+
+const ephemeris_table_header_t *ephemeris_table_header()
+{
+    return s_days != NULL ? &s_header : NULL;
+}
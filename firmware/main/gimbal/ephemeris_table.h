@@ -0,0 +1,74 @@
+/*
+   Ephemeris table, a year of the sun summarized per day.
+
+   Written by tools/ephemeris for one location and put into the www
+   partition as ephemeris.bin, next to the web page. The firmware looks up
+   the day instead of sampling the sun for travel limits and sunrise.
+
+   Layout, little endian: the header, then `days` entries. Day i starts at
+   start + i * 86400, at local mean midnight rounded to the hour, so a day
+   holds one whole daylight period anywhere on earth. Minutes count from
+   the start of the day, angles are in tenths of a degree, azimuth
+   clockwise from north. The crc is esp_rom_crc32_le(0, ...) of the
+   entries, the same as zlib's crc32.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#define EPHEMERIS_TABLE_MAGIC       0x45485045  // "EPHE"
+#define EPHEMERIS_TABLE_VERSION     1
+#define EPHEMERIS_TABLE_FILE        "ephemeris.bin"
+#define EPHEMERIS_NO_CROSSING       0xffff      // polar day or night
+#define EPHEMERIS_MATCH_DEG         0.5f        // location tolerance to use a table
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t days;
+    int64_t start;              // unix time of the start of the first day
+    float latitude;
+    float longitude;
+    float park_elevation;       // rise and set are taken at this elevation
+    float threshold_deg;        // re-aim threshold the moves are counted for
+    float min_azimuth;          // over the year, with the sun above park_elevation
+    float max_azimuth;
+    float max_elevation;
+    uint32_t crc;
+} ephemeris_table_header_t;
+
+typedef struct {
+    uint16_t rise_min;          // sun above park_elevation
+    uint16_t set_min;
+    int16_t min_azimuth;        // above park_elevation, may be negative or above 360
+    int16_t max_azimuth;        // with the azimuth unwrapped around the equator
+    int16_t max_elevation;
+    uint16_t yaw_travel;        // degrees of axis travel for dual axis tracking, parking included
+    uint16_t pitch_travel;
+    uint16_t moves;             // re-aims at threshold_deg
+    uint16_t yield_wh[3];       // clear sky Wh/m2 for fixed, single axis and dual axis
+    uint16_t reserved;
+} ephemeris_day_t;
+
+#ifdef __cplusplus
+static_assert(sizeof(ephemeris_table_header_t) == 48, "ephemeris table header layout");
+static_assert(sizeof(ephemeris_day_t) == 24, "ephemeris day layout");
+
+/**
+ * @brief Load the table, replacing the one loaded before
+ * @return false if the file is missing or broken
+ */
+bool ephemeris_table_load(const char *path);
+
+/**
+ * @brief The day containing t, if the table is for this location
+ * @param day_start start of that day, rise_min and set_min count from it
+ */
+bool ephemeris_table_day(time_t t, float latitude, float longitude, ephemeris_day_t *day, time_t *day_start);
+
+/**
+ * @brief Header of the loaded table, nullptr if there is none
+ */
+const ephemeris_table_header_t *ephemeris_table_header();
+#endif
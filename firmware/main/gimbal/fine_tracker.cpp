@@ -0,0 +1,287 @@
+#include <math.h>
+#include "fine_tracker.h"
+
+#define FINE_MAX_DT_S       1.0f    // longer gaps restart the filter step
+#define FINE_FIELD          0.9f    // beyond it the spot leaves the linear range
+#define FINE_MIN_SIN_PITCH  0.17f   // near the zenith the yaw is undefined, 10 degrees
+
+static const float DEG = (float)M_PI / 180.0f;
+
+static float wrap180(float deg)
+{
+    deg = fmodf(deg + 180.0f, 360.0f);
+    return deg < 0 ? deg + 180.0f : deg - 180.0f;
+}
+
+static float clampf(float v, float limit)
+{
+    return fminf(fmaxf(v, -limit), limit);
+}
+
+void FineTracker::init(const struct fine_param *param)
+{
+    this->param = param;
+    correction = {0, 0};
+    has_reference = false;
+    locked = false;
+    lost_s = 0;
+    last_us = 0;
+}
+
+void FineTracker::set_reference(const aim_t &sun, const aim_t &next, float period, int64_t t_us)
+{
+    reference = sun;
+    reference_rate = {0, 0};
+    if (period > 0) {
+        reference_rate = {(next.pitch - sun.pitch) / period, wrap180(next.yaw - sun.yaw) / period};
+    }
+    reference_us = t_us;
+    has_reference = true;
+}
+
+bool FineTracker::quad_error(const float quad[4], float *x, float *y, float *sum)
+{
+    *sum = quad[0] + quad[1] + quad[2] + quad[3];
+    if (!(*sum > 0)) {
+        *x = *y = 0;
+        return false;
+    }
+    *x = (quad[1] + quad[3] - quad[0] - quad[2]) / *sum;
+    *y = (quad[0] + quad[1] - quad[2] - quad[3]) / *sum;
+    return true;
+}
+
+aim_t FineTracker::correct(const aim_t &aim) const
+{
+    if (param == nullptr || !param->enable) {
+        return aim;
+    }
+    return {aim.pitch + correction.pitch, aim.yaw + correction.yaw};
+}
+
+bool FineTracker::update(const float quad[4], const aim_t &actual, int64_t t_us)
+{
+    float dt = last_us ? (t_us - last_us) / 1e6f : 0.0f;
+    last_us = t_us;
+    if (!(dt > 0) || dt > FINE_MAX_DT_S) {
+        dt = 0;
+    }
+
+    float x, y;
+    bool valid = quad_error(quad, &x, &y, &signal);
+    valid = valid && param != nullptr && param->enable && has_reference && signal >= param->min_signal &&
+            fabsf(x) < FINE_FIELD && fabsf(y) < FINE_FIELD && actual.pitch > 0;
+    if (!valid) {
+        locked = false;
+        lost_s += dt;
+        if (param != nullptr && lost_s > param->hold_s && param->tau_s > 0) {
+            // fall back to the ephemeris
+            float fade = fminf(dt / param->tau_s, 1.0f);
+            correction.pitch -= correction.pitch * fade;
+            correction.yaw -= correction.yaw * fade;
+        }
+        return false;
+    }
+    error_x = x * param->gain_x_deg;
+    error_y = y * param->gain_y_deg;
+    locked = true;
+    lost_s = 0;
+
+    // the sun seen by the sensor, in axis coordinates; y up lowers the zenith angle
+    float sin_pitch = sinf(actual.pitch * DEG);
+    aim_t seen = {actual.pitch - error_y, actual.yaw + error_x / fmaxf(sin_pitch, FINE_MIN_SIN_PITCH)};
+    float since = (t_us - reference_us) / 1e6f;
+    aim_t sun = {reference.pitch + reference_rate.pitch * since, reference.yaw + reference_rate.yaw * since};
+
+    // a weak signal is trusted less, full weight at twice the threshold
+    float weight = param->min_signal > 0 ? fminf(signal / param->min_signal - 1.0f, 1.0f) : 1.0f;
+    float alpha = param->tau_s > 0 ? fminf(dt * weight / param->tau_s, 1.0f) : 1.0f;
+    correction.pitch += (seen.pitch - sun.pitch - correction.pitch) * alpha;
+    if (sin_pitch >= FINE_MIN_SIN_PITCH) {
+        correction.yaw += (wrap180(seen.yaw - sun.yaw) - correction.yaw) * alpha;
+    }
+    correction.pitch = clampf(correction.pitch, param->max_correction_deg);
+    correction.yaw = clampf(correction.yaw, param->max_correction_deg);
+    return true;
+}
+
+// simulate a misaligned mount on linux
+#if defined(__linux__) && !defined(FINE_TRACKER_NO_MAIN)
+
+#include <stdio.h>
+
+/*
+ * The mount points 1.5 degrees low and 2.5 degrees east of where the axes
+ * say, plus a slow wobble standing in for a tilted base. The sun runs at
+ * 35N on the equinox. The axes follow the command with a 1s lag, the
+ * tracking loop re-aims every 10s when the aim is off by more than
+ * SIM_THRESHOLD_DEG, the photodiode is sampled at 10Hz with noise. A cloud
+ * hides the sun from 13:00 for SIM_CLOUD_S.
+ */
+
+#define SIM_DT_S            0.1f
+#define SIM_PERIOD_S        10.0f
+#define SIM_THRESHOLD_DEG   0.05f
+#define SIM_SERVO_TAU_S     1.0f
+#define SIM_CLOUD_START_H   13.0f
+#define SIM_CLOUD_S         2400.0f
+
+static uint32_t s_rand = 2024;
+
+static float sim_noise()
+{
+    s_rand = s_rand * 1664525u + 1013904223u;
+    return (s_rand >> 8) / 16777216.0f - 0.5f;
+}
+
+// TrackingPolicy::angle_between, tracking_policy.cpp has its own main on linux
+static float angle_between(const aim_t &a, const aim_t &b)
+{
+    float ax = sinf(a.pitch * DEG) * cosf(a.yaw * DEG), ay = sinf(a.pitch * DEG) * sinf(a.yaw * DEG), az = cosf(a.pitch * DEG);
+    float bx = sinf(b.pitch * DEG) * cosf(b.yaw * DEG), by = sinf(b.pitch * DEG) * sinf(b.yaw * DEG), bz = cosf(b.pitch * DEG);
+    float cx = ay * bz - az * by, cy = az * bx - ax * bz, cz = ax * by - ay * bx;
+    return atan2f(sqrtf(cx * cx + cy * cy + cz * cz), ax * bx + ay * by + az * bz) / DEG;
+}
+
+static aim_t sun_at(float hours)
+{
+    const float lat = 35.0f * DEG;
+    float h = (hours - 12.0f) * 15.0f * DEG;
+    float el = asinf(cosf(lat) * cosf(h));
+    float az = atan2f(sinf(h), cosf(h) * sinf(lat)) / DEG + 180.0f;
+    return {90.0f - el / DEG, az};
+}
+
+// true sun in axis coordinates
+static aim_t mount_error(float hours)
+{
+    return {1.5f + 0.3f * sinf(hours * 0.5f), 2.5f + 0.2f * cosf(hours * 0.5f)};
+}
+
+/*
+ * Photodiode looking along the aim at the true sun. The spot of the mask
+ * moves linearly with the angle and saturates at the edge of the field.
+ */
+static void sensor(const aim_t &aim, const aim_t &sun, float light, float gain, float quad[4])
+{
+    float ey = aim.pitch - sun.pitch;
+    float ex = wrap180(sun.yaw - aim.yaw) * sinf(aim.pitch * DEG);
+    float x = clampf(ex / gain, 1.0f), y = clampf(ey / gain, 1.0f);
+    float q = light / 4.0f;
+    quad[0] = q * (1 - x) * (1 + y) + 0.002f * sim_noise();
+    quad[1] = q * (1 + x) * (1 + y) + 0.002f * sim_noise();
+    quad[2] = q * (1 - x) * (1 - y) + 0.002f * sim_noise();
+    quad[3] = q * (1 + x) * (1 - y) + 0.002f * sim_noise();
+}
+
+struct sim_result {
+    float settle_s;         // from sunrise until the error stays below 0.1 degrees
+    float steady_max;       // 10:00-12:00
+    float steady_mean;
+    float cloud_max;        // while the correction is held
+    float fallback_error;   // mean after the correction faded
+};
+
+static sim_result simulate(const fine_param &param)
+{
+    FineTracker fine;
+    fine.init(&param);
+    sim_result r = {-1, 0, 0, 0, 0};
+    aim_t command = {0, 180}, actual = {0, 180};
+    float last_bad = 0;
+    double mean = 0, fallback = 0;
+    int mean_n = 0, fallback_n = 0;
+    bool started = false;
+    float start_s = 0;
+
+    const int period_steps = (int)lroundf(SIM_PERIOD_S / SIM_DT_S);
+    for (int step = (int)(5 * 3600 / SIM_DT_S); step < (int)(17 * 3600 / SIM_DT_S); step++) {
+        float t = step * SIM_DT_S;
+        float hours = t / 3600.0f;
+        aim_t ephemeris = sun_at(hours);
+        if (ephemeris.pitch > 80.0f) {
+            continue;
+        }
+        if (!started) {
+            started = true;
+            start_s = t;
+        }
+        aim_t err = mount_error(hours);
+        aim_t truth = {ephemeris.pitch + err.pitch, ephemeris.yaw + err.yaw};
+
+        int64_t t_us = (int64_t)step * (int64_t)(SIM_DT_S * 1e6f);
+        if (step % period_steps == 0) {
+            fine.set_reference(ephemeris, sun_at(hours + SIM_PERIOD_S / 3600.0f), SIM_PERIOD_S, t_us);
+            aim_t want = fine.correct(ephemeris);
+            if (angle_between(command, want) > SIM_THRESHOLD_DEG) {
+                command = want;
+            }
+        }
+        float a = SIM_DT_S / SIM_SERVO_TAU_S;
+        actual.pitch += (command.pitch - actual.pitch) * a;
+        actual.yaw += wrap180(command.yaw - actual.yaw) * a;
+
+        bool cloud = hours >= SIM_CLOUD_START_H && hours < SIM_CLOUD_START_H + SIM_CLOUD_S / 3600.0f;
+        float quad[4];
+        sensor(actual, truth, cloud ? 0.02f : 1.0f, param.gain_x_deg, quad);
+        fine.update(quad, actual, t_us);
+
+        float error = angle_between(actual, truth);
+        if (error > 0.1f && hours < 10.0f) {
+            last_bad = t;
+        }
+        if (hours >= 10.0f && hours < 12.0f) {
+            r.steady_max = fmaxf(r.steady_max, error);
+            mean += error;
+            mean_n++;
+        }
+        if (cloud && t - SIM_CLOUD_START_H * 3600 < param.hold_s) {
+            r.cloud_max = fmaxf(r.cloud_max, error);
+        }
+        if (cloud && t - SIM_CLOUD_START_H * 3600 > param.hold_s + 5 * param.tau_s) {
+            fallback += error;
+            fallback_n++;
+        }
+    }
+    r.settle_s = last_bad - start_s;
+    r.steady_mean = mean_n ? mean / mean_n : 0;
+    r.fallback_error = fallback_n ? fallback / fallback_n : 0;
+    return r;
+}
+
+int main()
+{
+    int failures = 0;
+    fine_param off = {5.0f, 5.0f, 20.0f, 0.05f, 5.0f, 600.0f, 0};
+    sim_result open_loop = simulate(off);
+    printf("  %6s %7s %9s %10s %10s %9s %9s\n", "tau", "hold", "settle s", "steady max", "steady avg", "cloud max", "fallback");
+    const float taus[] = {5.0f, 20.0f, 60.0f};
+    for (float tau : taus) {
+        fine_param p = {5.0f, 5.0f, tau, 0.05f, 5.0f, 600.0f, 1};
+        sim_result r = simulate(p);
+        printf("  %6.0f %7.0f %9.0f %10.3f %10.3f %9.3f %9.3f\n", tau, p.hold_s, r.settle_s,
+               r.steady_max, r.steady_mean, r.cloud_max, r.fallback_error);
+        if (r.settle_s > 20 * tau + 60) {
+            printf("    settles too slowly\n");
+            failures++;
+        }
+        if (r.steady_max > 0.15f) {
+            printf("    steady state error too large\n");
+            failures++;
+        }
+        if (r.cloud_max > 0.3f) {
+            printf("    correction not held under cloud\n");
+            failures++;
+        }
+        // without the sun the aim is plain ephemeris again, off by the mount error
+        if (fabsf(r.fallback_error - open_loop.fallback_error) > 0.1f) {
+            printf("    no fallback to the ephemeris\n");
+            failures++;
+        }
+    }
+    printf("  open loop ephemeris: steady max %.3f mean %.3f\n", open_loop.steady_max, open_loop.steady_mean);
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
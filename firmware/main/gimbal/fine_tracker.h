@@ -0,0 +1,112 @@
+/*
+   Optical fine tracking with a quadrant photodiode.
+
+   The ephemeris gives the sun exactly, but the axes only point where the
+   mount thinks they do: leveling, yaw_offset and the compass all add up to
+   degrees of error. A four quadrant photodiode behind a shadow mask,
+   mounted along the panel normal, sees how far off the sun is. With the
+   quadrants
+       A | B
+       --+--      (as seen from the panel, up towards the zenith)
+       C | D
+   the normalized differences
+       x = (B + D - A - C) / sum,  y = (A + B - C - D) / sum
+   are about linear in the angle within the field of the mask, gain_x_deg
+   and gain_y_deg degrees at full scale.
+
+   The tracker does not steer the axes itself. It adds the measured sun
+   direction to the actual axis positions and compares that with the
+   ephemeris; the difference is the mount error in axis coordinates. It is
+   low pass filtered into a correction which is added to every ephemeris
+   aim, so the tracking policy, the weather policy and the energy saving
+   keep working as before, only on a better aim.
+
+   Under cloud the sum drops below min_signal. The correction is then kept
+   for hold_s and afterwards fades out with tau_s, back to plain ephemeris
+   tracking.
+
+   The tracker does not depend on ESP-IDF, see the __linux__ section of
+   fine_tracker.cpp for a simulated mount.
+*/
+#pragma once
+
+#include <stdint.h>
+#include "tracking_policy.h"
+
+struct fine_param {
+    float gain_x_deg;           // angle at full scale of the x difference, the sign flips the quadrants
+    float gain_y_deg;
+    float tau_s;                // time constant of the correction
+    float min_signal;           // sum of the quadrants in V, below it the sun is hidden
+    float max_correction_deg;
+    float hold_s;               // keep the correction this long without the sun
+    uint8_t enable;
+};
+
+class FineTracker {
+public:
+    FineTracker() = default;
+
+    void init(const struct fine_param *param);
+
+    /**
+     * @brief Where the ephemeris puts the sun, refreshed every tracking period
+     * @param sun aim at the sun at t_us
+     * @param next aim at the sun period s later, for interpolation
+     */
+    void set_reference(const aim_t &sun, const aim_t &next, float period, int64_t t_us);
+
+    /**
+     * @brief Feed one sample of the photodiode
+     * @param quad quadrants A-D in V
+     * @param actual aim of the axes, measured and not commanded
+     * @return true if the sun was in the field and the correction updated
+     */
+    bool update(const float quad[4], const aim_t &actual, int64_t t_us);
+
+    /**
+     * @brief Ephemeris aim with the correction applied
+     */
+    aim_t correct(const aim_t &aim) const;
+
+    aim_t get_correction() const
+    {
+        return correction;
+    }
+    // sun direction seen by the sensor, x and y in degrees
+    float get_error_x() const
+    {
+        return error_x;
+    }
+    float get_error_y() const
+    {
+        return error_y;
+    }
+    float get_signal() const
+    {
+        return signal;
+    }
+    bool is_locked() const
+    {
+        return locked;
+    }
+
+    /**
+     * @brief Normalized differences of the quadrants
+     * @return false if the sum is not positive
+     */
+    static bool quad_error(const float quad[4], float *x, float *y, float *sum);
+
+private:
+    const struct fine_param *param = nullptr;
+    aim_t reference = {0, 0};
+    aim_t reference_rate = {0, 0};  // deg/s
+    int64_t reference_us = 0;
+    bool has_reference = false;
+    aim_t correction = {0, 0};
+    float error_x = 0, error_y = 0;
+    float signal = 0;
+    float lost_s = 0;
+    int64_t last_us = 0;
+    bool locked = false;
+};
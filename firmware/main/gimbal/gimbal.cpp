@@ -10,6 +10,10 @@
 #include "led.h"
 #include "adc.h"
 #include "board.h"
+#include "position_store.h"
+#include "light_sensor.h"
+#include "ephemeris_table.h"
+#include "loop_bench.h"
 
 static const char *TAG = "gimbal";
 
@@ -33,44 +37,178 @@ Gimbal::~Gimbal()
 
 }
 
-void Gimbal::check_home(float homing_speed)
+/*
+ * End stop detection: the controller saturates while the axis does not
+ * follow. There is no current sensor, at stall the current is proportional
+ * to the PWM output, so a high output with the speed far below the command
+ * for HOMING_STALL_MS is an end stop. This reacts within ~100ms where the
+ * motor stall counter needs the output fully saturated.
+ */
+#define HOMING_POLL_MS          10
+#define HOMING_ARM_MS           300     // ignore the acceleration phase
+#define HOMING_STALL_MS         80
+#define HOMING_STALL_OUTPUT     0.6f    // of max_out
+#define HOMING_STALL_SPEED      0.25f   // of the commanded speed
+#define HOMING_SLOW_RATIO       0.2f    // re-approach speed
+#define HOMING_BACKOFF          3.0f    // degrees
+#define HOMING_SPAN_MARGIN      1.1f    // accepted travel before the stored span is distrusted
+#define HOMING_FULL_TRAVEL      (2 * 720.0f)
+
+bool Gimbal::seek_end_stop(float direction, float speed, float max_travel, float *stop_pos)
 {
-    // check yaw motor home
-    float pos_max, pos_min;
-    float old_speed = this->yawMotor->get_max_speed();
-    this->yawMotor->set_max_speed(homing_speed);
-    this->yawMotor->set_position(2 * 360); // set to 360 to make sure it is reach positive limit
+    float start = this->yawMotor->get_position();
+    float max_out = this->yawMotor->velocityPID.param->max_out;
+    // generous timeout, three times the travel at the requested speed
+    float deg_per_s = speed * 360.0f / this->yawMotor->get_gear_ratio();
+    int64_t timeout_us = (int64_t)(3.0f * max_travel / deg_per_s * 1e6f) + 2000000;
+    int64_t t0 = esp_timer_get_time();
+    int64_t stall_since = 0;
+    bool armed = false;
+
+    this->yawMotor->set_max_speed(speed);
+    this->yawMotor->set_position(start + direction * (max_travel + HOMING_BACKOFF));
     while (1) {
-        vTaskDelay(pdMS_TO_TICKS(50));
-        if (MOT_STATE_WARNING == this->yawMotor->get_state()) {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            pos_max = this->yawMotor->get_position(); // get positive limit
-            break;
+        vTaskDelay(pdMS_TO_TICKS(HOMING_POLL_MS));
+        int64_t now = esp_timer_get_time();
+        float pos = this->yawMotor->get_position();
+        float vel = std::fabs(this->yawMotor->get_velocity());
+        float out = std::fabs(this->yawMotor->get_output());
+
+        if (!armed && (vel > speed * 0.5f || now - t0 > HOMING_ARM_MS * 1000)) {
+            armed = true;
+        }
+        bool stalled = MOT_STATE_WARNING == this->yawMotor->get_state();
+        if (armed && vel < speed * HOMING_STALL_SPEED && out > max_out * HOMING_STALL_OUTPUT) {
+            if (stall_since == 0) {
+                stall_since = now;
+            }
+            stalled |= now - stall_since >= HOMING_STALL_MS * 1000;
+        } else {
+            stall_since = 0;
+        }
+
+        if (stalled) {
+            this->yawMotor->hold();
+            *stop_pos = pos;
+            ESP_LOGI(TAG, "End stop at %.2f after %.2f deg", pos, std::fabs(pos - start));
+            return true;
+        }
+        if (std::fabs(pos - start) > max_travel || now - t0 > timeout_us) {
+            this->yawMotor->hold();
+            ESP_LOGW(TAG, "No end stop within %.2f deg", max_travel);
+            return false;
         }
     }
-    this->yawMotor->set_position(-2 * 360); // set to -360 to make sure it is reach negative limit
-    while (1) {
-        vTaskDelay(pdMS_TO_TICKS(50));
-        if (MOT_STATE_WARNING == this->yawMotor->get_state()) {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            pos_min = this->yawMotor->get_position(); // get negative limit
-            break;
+}
+
+// back off and approach the end stop again slowly, the fast approach overshoots
+bool Gimbal::refine_end_stop(float direction, float speed, float *stop_pos)
+{
+    if (!move_to(*stop_pos - direction * HOMING_BACKOFF)) {
+        return false;
+    }
+    return seek_end_stop(direction, speed * HOMING_SLOW_RATIO, HOMING_BACKOFF * 2, stop_pos);
+}
+
+bool Gimbal::move_to(float position)
+{
+    this->yawMotor->set_position(position);
+    int64_t t0 = esp_timer_get_time();
+    while (esp_timer_get_time() - t0 < 60 * 1000000LL) {
+        vTaskDelay(pdMS_TO_TICKS(HOMING_POLL_MS));
+        if (std::fabs(this->yawMotor->get_position() - position) < 0.1) {
+            return true;
         }
     }
-    // set motor to midpoint
-    this->yawMotor->set_max_speed(old_speed);
-    this->yawMotor->set_position((pos_max + pos_min) / 2);
-    // wait motor done
-    while (1) {
-        vTaskDelay(pdMS_TO_TICKS(100));
-        float pos = this->yawMotor->get_position();
-        if (std::fabs(pos - (pos_max + pos_min) / 2) < 0.1) {
-            break;
+    ESP_LOGW(TAG, "Move to %.2f timed out at %.2f", position, this->yawMotor->get_position());
+    return false;
+}
+
+// seek only the positive end stop, the stored span gives the midpoint
+bool Gimbal::home_fast(float homing_speed, float span)
+{
+    float pos_max;
+    if (!seek_end_stop(1, homing_speed, span * HOMING_SPAN_MARGIN, &pos_max)) {
+        return false;
+    }
+    if (!refine_end_stop(1, homing_speed, &pos_max)) {
+        return false;
+    }
+    yaw_limit_max = span / 2;
+    yaw_limit_min = -span / 2;
+    return move_to(pos_max - span / 2);
+}
+
+bool Gimbal::home_full_sweep(float homing_speed)
+{
+    float pos_max, pos_min;
+    if (!seek_end_stop(1, homing_speed, HOMING_FULL_TRAVEL, &pos_max) ||
+            !refine_end_stop(1, homing_speed, &pos_max)) {
+        return false;
+    }
+    if (!seek_end_stop(-1, homing_speed, HOMING_FULL_TRAVEL, &pos_min) ||
+            !refine_end_stop(-1, homing_speed, &pos_min)) {
+        return false;
+    }
+    yaw_limit_max = (pos_max - pos_min) / 2;
+    yaw_limit_min = -yaw_limit_max;
+    return move_to((pos_max + pos_min) / 2);
+}
+
+void Gimbal::check_home(float homing_speed)
+{
+    int64_t t0 = esp_timer_get_time();
+    float old_speed = this->yawMotor->get_max_speed();
+    float span_min, span_max;
+    position_checkpoint_invalidate();
+    this->yawMotor->set_travel_limits(0, 0); // unknown until homed
+    this->yawMotor->clear_position();
+
+    bool fast = ESP_OK == position_travel_load(&span_min, &span_max) &&
+                home_fast(homing_speed, span_max - span_min);
+    homing_mode = fast ? "fast" : "full";
+    if (!fast) {
+        ESP_LOGW(TAG, "Fast homing not possible, sweeping the full travel");
+        if (!home_full_sweep(homing_speed)) {
+            ESP_LOGE(TAG, "Homing failed, keeping the current position as home");
+        } else {
+            position_travel_save(yaw_limit_min, yaw_limit_max);
         }
     }
+
+    this->yawMotor->set_max_speed(old_speed);
     vTaskDelay(pdMS_TO_TICKS(1000));
     this->yawMotor->clear_position();
     this->pitchMotor->clear_position();
+    this->yawMotor->set_travel_limits(yaw_limit_min, yaw_limit_max);
+    homing_ms = (uint32_t)((esp_timer_get_time() - t0) / 1000);
+    ESP_LOGI(TAG, "Homing (%s) done in %.1fs, travel %.2f..%.2f", homing_mode,
+             homing_ms / 1000.0f, yaw_limit_min, yaw_limit_max);
+}
+
+bool Gimbal::restore_position()
+{
+    gimbal_position_t pos;
+    if (!position_checkpoint_restore(&pos)) {
+        return false;
+    }
+    yawEncoder->set_count(pos.yaw_count);
+    yawEncoder->set_home(pos.yaw_home);
+    yaw_limit_max = pos.yaw_max;
+    yaw_limit_min = pos.yaw_min;
+    this->yawMotor->set_travel_limits(yaw_limit_min, yaw_limit_max);
+    return true;
+}
+
+void Gimbal::checkpoint_position()
+{
+    gimbal_position_t pos = {
+        .yaw_count = yawEncoder->get_count(),
+        .yaw_home = yawEncoder->get_home(),
+        .yaw_max = yaw_limit_max,
+        .yaw_min = yaw_limit_min,
+    };
+    position_checkpoint_save(&pos);
 }
 
 
@@ -95,6 +233,7 @@ void Gimbal::init()
     this->yawMotor = std::make_shared<Motor>("yaw", 3000.0f + 29.0f);
     static EncoderSensor encoderx;
     encoderx.init(BOARD_IO_MOTX_ENC_A, BOARD_IO_MOTX_ENC_B, 4 * 11);
+    this->yawEncoder = &encoderx;
     static IMUMotSensor imusensory;
     imusensory.init(this->imu.get()); // TODO save the params first
 
@@ -112,6 +251,22 @@ void Gimbal::init()
     pid_struct_init(&this->yawMotor->velocityPID, &g_settings.vel_pid);
 
     pid_struct_init(&this->pitchPID, &g_settings.pitch_pid);
+    this->policy.init(&g_settings.track);
+    this->weather.init(&g_settings.weather);
+    this->fine.init(&g_settings.fine);
+    this->mount.init(&g_settings.mount);
+    this->sun_engine.init(&g_settings.sun);
+    this->calibration_sem = xSemaphoreCreateMutex();
+    this->heliostat_sem = xSemaphoreCreateMutex();
+    this->heliostat.init(&g_settings.heliostat, g_settings.helio_targets, heliostat_fallback);
+    this->fine_wired = adc_is_wired(ADC_SIG_QUAD_A) && adc_is_wired(ADC_SIG_QUAD_B) &&
+                       adc_is_wired(ADC_SIG_QUAD_C) && adc_is_wired(ADC_SIG_QUAD_D);
+    this->yawMotor->set_stall_param(&g_settings.yaw_stall);
+    this->pitchMotor->set_stall_param(&g_settings.pitch_stall);
+    this->yawMotor->set_winding_resistance(g_settings.winding_ohm[0]);
+    this->pitchMotor->set_winding_resistance(g_settings.winding_ohm[1]);
+    energy_init();
+    energy_set_daily_budget(g_settings.energy_budget_wh);
 
     auto gimbal = std::shared_ptr<Gimbal>(this);
     auto logger = std::make_shared<SensorLogger>();
@@ -127,12 +282,18 @@ void Gimbal::init()
     this->yawMotor->set_max_speed(100);
 
     set_time(2025, 3, 28, 12, 0, 0, 0);
+    ephemeris_table_load(CONFIG_EXAMPLE_WEB_MOUNT_POINT "/" EPHEMERIS_TABLE_FILE);
     search_azimuth(&max_azimuth, &min_azimuth, &max_elevation, &min_elevation);
 
-    led_start_state(LED_GREEN, BLINK_FAST);
-    state = STATE_HOMING;
-    check_home(70);
-    led_stop_state(LED_GREEN, BLINK_FAST);
+    if (restore_position()) {
+        ESP_LOGI(TAG, "Position restored after warm reset, skip homing");
+        setTarget(0, 0, 0);
+    } else {
+        led_start_state(LED_GREEN, BLINK_FAST);
+        state = STATE_HOMING;
+        check_home(70);
+        led_stop_state(LED_GREEN, BLINK_FAST);
+    }
     state = STATE_RUNNING;
 
     if (g_settings.mode == MODE_MANUAL) {
@@ -147,6 +308,9 @@ void Gimbal::init()
 void Gimbal::check_voltage()
 {
     voltage = adc_read_voltage();
+    recorder_tap(REC_VOLTAGE, &voltage, sizeof(voltage));
+    this->yawMotor->set_supply_voltage(voltage);
+    this->pitchMotor->set_supply_voltage(voltage);
     if (state <= STATE_RUNNING) { // only check voltage when not in error state
         if (voltage < g_settings.vol_min) {
             ESP_LOGW(TAG, "Voltage too low: %.2fV", voltage);
@@ -172,17 +336,46 @@ void Gimbal::check_voltage()
     }
 }
 
+#define ENERGY_SLEW_DEG     2.0f    // position error above which an axis is slewing
+#define FINE_DECIMATION     10      // sun sensor at a tenth of the IMU rate, 10Hz
+
+/*
+ * What the energy of an axis is spent on. Idle covers a disabled or faulted
+ * motor as well as holding torque below the friction deadband.
+ */
+energy_mode_t Gimbal::energy_mode(Motor *motor)
+{
+    if (state == STATE_HOMING) {
+        return ENERGY_HOMING;
+    }
+    const struct stall_param *model = motor == this->yawMotor.get() ? &g_settings.yaw_stall : &g_settings.pitch_stall;
+    if (motor->get_state() != MOT_STATE_RUNNING || std::fabs(motor->get_duty()) <= model->deadband) {
+        return ENERGY_IDLE;
+    }
+    if (std::fabs(motor->get_target_position() - motor->get_position()) > ENERGY_SLEW_DEG) {
+        return ENERGY_SLEW;
+    }
+    return ENERGY_TRACKING;
+}
+
 void Gimbal::update(const imu_data_t &data)
 {
-    static int count = 0;
-    if (count++ % 10 == 0) {
+    LOOP_BENCH_BEGIN(bench_start);
+    if (ticks++ % 10 == 0) {
         check_voltage();
     }
+    // the ADC service filters in the background, reading the snapshot never blocks
+    adc_snapshot_t analog;
+    adc_get_snapshot(&analog);
+    recorder_tap(REC_ANALOG, &analog, sizeof(analog));
+    this->yawMotor->set_current(analog.value[ADC_SIG_YAW_CURRENT]);
+    this->pitchMotor->set_current(analog.value[ADC_SIG_PITCH_CURRENT]);
 
-    static uint64_t last_time = 0;
-    uint64_t _time = esp_timer_get_time(); // 获取开始时间（微秒级）
-    float dt = (float)(_time - last_time) / 1000000.0f;
-    last_time = _time;
+    int64_t _time = esp_timer_get_time(); // 获取开始时间（微秒级）
+    recorder_tap(REC_TICK, &_time, sizeof(_time));
+    float dt = (float)(_time - last_tick_us) / 1000000.0f;
+    LOOP_BENCH_PERIOD(_time - last_tick_us);
+    last_tick_us = _time;
 
     // printf("angle: %f %f %f\n", data.angle.x, data.angle.y, data.angle.z);
     // printf("gyro: %f %f %f\n", data.gyro.x, data.gyro.y, data.gyro.z);
@@ -191,6 +384,251 @@ void Gimbal::update(const imu_data_t &data)
 
     this->pitchMotor->run(dt);
     this->yawMotor->run(dt);
+    energy_add(ENERGY_AXIS_YAW, energy_mode(this->yawMotor.get()), this->yawMotor->get_power(), dt);
+    energy_add(ENERGY_AXIS_PITCH, energy_mode(this->pitchMotor.get()), this->pitchMotor->get_power(), dt);
+    if (fine_wired && ++fine_count >= FINE_DECIMATION) {
+        fine_count = 0;
+        fine_update(analog);
+    }
+
+    // the position is only meaningful once homed
+    if (state >= STATE_RUNNING) {
+        checkpoint_position();
+    }
+    if (state == STATE_RUNNING && g_settings.track.enable) {
+        release_when_settled(this->yawMotor.get(), 0, g_settings.track.yaw_self_lock, dt);
+        release_when_settled(this->pitchMotor.get(), 1, g_settings.track.pitch_self_lock, dt);
+    }
+    record(data);
+    LOOP_BENCH_END(LOOP_GIMBAL, bench_start);
+}
+
+/*
+ * What the tick put out, and once every RECORDER_KEYFRAME_TICKS the state
+ * a replay can start from. The keyframe follows the outputs of its tick.
+ */
+void Gimbal::record(const imu_data_t &data)
+{
+    if (!recorder_active()) {
+        return;
+    }
+    Motor *motors[2] = {this->yawMotor.get(), this->pitchMotor.get()};
+    rec_output_t out = {};
+    for (int i = 0; i < 3; i++) {
+        out.angle[i] = data.angle.data[i];
+    }
+    for (int axis = 0; axis < 2; axis++) {
+        out.position[axis] = motors[axis]->get_position();
+        out.target[axis] = motors[axis]->get_target_position();
+        out.velocity[axis] = motors[axis]->get_velocity();
+        out.output[axis] = motors[axis]->get_output();
+        out.power[axis] = motors[axis]->get_power();
+        out.motor_state[axis] = motors[axis]->get_state();
+    }
+    out.state = state;
+    recorder_tap(REC_OUTPUT, &out, sizeof(out));
+
+    if (ticks % RECORDER_KEYFRAME_TICKS == 0) {
+        gimbal_keyframe_t key;
+        getLoopState(&key);
+        recorder_tap(REC_KEYFRAME, &key, sizeof(key));
+    }
+}
+
+void Gimbal::getLoopState(gimbal_keyframe_t *key)
+{
+    *key = {};
+    datafusion_get_state(key->fusion);
+    this->yawMotor->get_state(&key->motor[0]);
+    this->pitchMotor->get_state(&key->motor[1]);
+    key->yaw_velocity = yawEncoder->get_estimator();
+    key->field = this->imu->getCompass()->getField();
+    key->yaw_home = yawEncoder->get_home();
+    key->last_tick_us = last_tick_us;
+    key->imu_cycles = this->imu->getCycles();
+    key->ticks = ticks;
+    key->fine_count = fine_count;
+    key->settled_s[0] = settled_s[0];
+    key->settled_s[1] = settled_s[1];
+    key->voltage = voltage;
+    key->gyro_cross_sens = this->imu->getGyroCrossSens();
+    key->state = state;
+    key->released[0] = released[0];
+    key->released[1] = released[1];
+}
+
+void Gimbal::setLoopState(const gimbal_keyframe_t &key)
+{
+    datafusion_set_state(key.fusion);
+    this->yawMotor->set_state(key.motor[0]);
+    this->pitchMotor->set_state(key.motor[1]);
+    yawEncoder->set_estimator(key.yaw_velocity);
+    this->imu->getCompass()->setField(key.field);
+    yawEncoder->set_home(key.yaw_home);
+    last_tick_us = key.last_tick_us;
+    this->imu->setCycles(key.imu_cycles);
+    ticks = key.ticks;
+    fine_count = key.fine_count;
+    settled_s[0] = key.settled_s[0];
+    settled_s[1] = key.settled_s[1];
+    voltage = key.voltage;
+    this->imu->setGyroCrossSens(key.gyro_cross_sens);
+    state = (SysState)key.state;
+    released[0] = key.released[0];
+    released[1] = key.released[1];
+}
+
+#define TRACK_PERIOD_S      10
+#define TRACK_SETTLE_S      0.5f    // time on target before a self-locking axis is released
+#define MOUNT_SAMPLE_S      600     // one observation per 10 min fills a day, see mount_model.cpp
+
+/*
+ * Nominal aim of the axes, the inverse of setTarget() without the mount
+ * model.
+ */
+aim_t Gimbal::axes_position()
+{
+    return {this->pitchMotor->get_position(), this->yawMotor->get_position() + 180 - g_settings.yaw_offset};
+}
+
+/*
+ * Feed the sun sensor to the fine tracker with the actual axis positions,
+ * it only applies when facing the sun.
+ */
+void Gimbal::fine_update(const adc_snapshot_t &analog)
+{
+    if (state != STATE_RUNNING || g_settings.mode != MODE_TOWARD) {
+        return;
+    }
+    float quad[4] = {analog.value[ADC_SIG_QUAD_A], analog.value[ADC_SIG_QUAD_B],
+                     analog.value[ADC_SIG_QUAD_C], analog.value[ADC_SIG_QUAD_D]};
+    // what is left after the mount model
+    mount.set_home(180 - g_settings.yaw_offset);
+    aim_t actual = mount.pointing(axes_position());
+    portENTER_CRITICAL(&fine_lock);
+    fine.update(quad, actual, analog.timestamp_us);
+    portEXIT_CRITICAL(&fine_lock);
+}
+
+aim_t Gimbal::fine_correct(const aim_t &aim)
+{
+    portENTER_CRITICAL(&fine_lock);
+    aim_t corrected = fine.correct(aim);
+    portEXIT_CRITICAL(&fine_lock);
+    return corrected;
+}
+
+/*
+ * With the sun sensor locked and the axes settled, the sun is where the
+ * axes are plus what the sensor sees. That is an observation for the mount
+ * calibration, taken every MOUNT_SAMPLE_S.
+ */
+void Gimbal::mount_observe(time_t now)
+{
+    if (!fine_wired || g_settings.mode != MODE_TOWARD || now - calibration_last < MOUNT_SAMPLE_S || !isOnTarget()) {
+        return;
+    }
+    portENTER_CRITICAL(&fine_lock);
+    bool locked = fine.is_locked();
+    float error_x = fine.get_error_x(), error_y = fine.get_error_y();
+    portEXIT_CRITICAL(&fine_lock);
+    aim_t axes = axes_position();
+    if (!locked || sunPosition.dElevation <= GIMBAL_PARK_ELEVATION || axes.pitch < 10) {
+        return;
+    }
+    mount_sample sample = {
+        .axes = {axes.pitch - error_y, axes.yaw + error_x / std::sin(axes.pitch * (float)M_PI / 180)},
+        .sun = {(float)sunPosition.dZenithAngle, (float)sunPosition.dAzimuth},
+    };
+    xSemaphoreTake(calibration_sem, portMAX_DELAY);
+    calibration.add(sample);
+    xSemaphoreGive(calibration_sem);
+    calibration_last = now;
+}
+
+bool Gimbal::sampleMount()
+{
+    if (state != STATE_RUNNING || suspended) {
+        return false;
+    }
+    time_t now;
+    time(&now);
+    cSunCoordinates sun;
+    getSunPositionAt(now, &sun);
+    if (sun.dElevation <= GIMBAL_PARK_ELEVATION) {
+        return false;
+    }
+    mount_sample sample = {
+        .axes = axes_position(),
+        .sun = {(float)sun.dZenithAngle, (float)sun.dAzimuth},
+    };
+    // a mirror is centered when the spot is on the target
+    if (g_settings.mode == MODE_REFLECT) {
+        aim_at(now, &sample.sun);
+    }
+    xSemaphoreTake(calibration_sem, portMAX_DELAY);
+    calibration.add(sample);
+    xSemaphoreGive(calibration_sem);
+    return true;
+}
+
+bool Gimbal::solveMount(struct mount_param *result, struct mount_fit *fit)
+{
+    *result = g_settings.mount;
+    xSemaphoreTake(calibration_sem, portMAX_DELAY);
+    bool ok = calibration.solve(180 - g_settings.yaw_offset, result, fit);
+    xSemaphoreGive(calibration_sem);
+    return ok;
+}
+
+void Gimbal::applyMount(const struct mount_param &param)
+{
+    g_settings.mount = param;
+    // the correction was for the old model
+    portENTER_CRITICAL(&fine_lock);
+    fine.init(&g_settings.fine);
+    portEXIT_CRITICAL(&fine_lock);
+    triger_task_immediate();
+}
+
+void Gimbal::clearMount()
+{
+    xSemaphoreTake(calibration_sem, portMAX_DELAY);
+    calibration.clear();
+    xSemaphoreGive(calibration_sem);
+}
+
+int Gimbal::getMountSamples()
+{
+    xSemaphoreTake(calibration_sem, portMAX_DELAY);
+    int count = calibration.get_count();
+    xSemaphoreGive(calibration_sem);
+    return count;
+}
+
+/*
+ * A self-locking axis keeps its position without power, once it has been
+ * on target for TRACK_SETTLE_S the driver is switched off until the next
+ * move. The flag is dropped when anything else enabled the motor again,
+ * e.g. the voltage check after an error.
+ */
+void Gimbal::release_when_settled(Motor *motor, int axis, bool self_lock, float dt)
+{
+    if (released[axis] && motor->get_state() == MOT_STATE_RUNNING) {
+        released[axis] = false;
+    }
+    if (!self_lock || released[axis] || motor->get_state() != MOT_STATE_RUNNING) {
+        settled_s[axis] = 0;
+        return;
+    }
+    bool on_target = std::fabs(motor->get_target_position() - motor->get_position()) < g_settings.track.settle_deg;
+    settled_s[axis] = on_target ? settled_s[axis] + dt : 0;
+    if (settled_s[axis] > TRACK_SETTLE_S) {
+        motor->hold();
+        motor->enable(0);
+        released[axis] = true;
+        settled_s[axis] = 0;
+    }
 }
 
 void Gimbal::update(const gps_t &data)
@@ -201,6 +639,26 @@ void Gimbal::update(const gps_t &data)
     }
 }
 
+/*
+ * The air for refraction: the IMU sits in the enclosure, temp_offset is how
+ * much warmer it runs than outside; the pressure is that of the standard
+ * atmosphere at the GPS altitude.
+ */
+void Gimbal::getSunPositionAt(time_t t, cSunCoordinates *sunCoordinates)
+{
+    const gps_t &fix = gps->getData();
+    float temperature = imu->getData().temperature - g_settings.sun.temp_offset;
+    sun_observer observer = {
+        .latitude = fix.latitude,
+        .longitude = fix.longitude,
+        .altitude = fix.altitude,
+        .pressure = SunEngine::pressure_at(fix.altitude),
+        .temperature = fminf(fmaxf(temperature, -40.0f), 60.0f),
+    };
+    sun_engine.set_resolution(g_settings.track.settle_deg);
+    sun_engine.compute((double)t, observer, sunCoordinates);
+}
+
 void Gimbal::getSunPosition(cSunCoordinates *sunCoordinates)
 {
     if (nullptr == sunCoordinates) {
@@ -213,59 +671,213 @@ void Gimbal::getSunPosition(cSunCoordinates *sunCoordinates)
     struct tm localtime;
     localtime_r(&now, &localtime);
 
-    cTime time = {
-        .iYear = timeinfo.tm_year + 1900,
-        .iMonth = timeinfo.tm_mon + 1,
-        .iDay = timeinfo.tm_mday,
-        .dHours = (double)(timeinfo.tm_hour),
-        .dMinutes = (double)timeinfo.tm_min,
-        .dSeconds = (double)timeinfo.tm_sec,
-    };
+    getSunPositionAt(now, sunCoordinates);
     cLocation location = {
         .dLongitude = gps->getData().longitude,
         .dLatitude = gps->getData().latitude,
     };
-    sunpos(time, location, sunCoordinates);
     printf("LocalTime:%d-%d-%d %d:%d:%d UTCTime:%d-%d-%d %d:%d:%d Elevation:%.2f°, Azimuth:%.2f°, Zenith:%.2f°\n", timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec,
            localtime.tm_year + 1900, localtime.tm_mon + 1, localtime.tm_mday, localtime.tm_hour, localtime.tm_min, localtime.tm_sec,
            sunCoordinates->dElevation, sunCoordinates->dAzimuth, sunCoordinates->dZenithAngle);
     printf("Longitude:%.2f, Latitude:%.2f\n", location.dLongitude, location.dLatitude);
 }
 
+static int minute_of_day(time_t t)
+{
+    struct tm local;
+    localtime_r(&t, &local);
+    return local.tm_hour * 60 + local.tm_min;
+}
+
+bool Gimbal::heliostat_sun(time_t t, aim_t *sun, void *ctx)
+{
+    cSunCoordinates coordinates;
+    ((Gimbal *)ctx)->getSunPositionAt(t, &coordinates);
+    *sun = {(float)coordinates.dZenithAngle, (float)coordinates.dAzimuth};
+    return coordinates.dElevation > GIMBAL_PARK_ELEVATION;
+}
+
+/*
+ * Plan the heliostat for the local day of now, again when the day, the
+ * targets or the fallback direction changed.
+ */
+void Gimbal::heliostat_plan(time_t now)
+{
+    if (g_settings.mode != MODE_REFLECT || !g_settings.heliostat.enable) {
+        return;
+    }
+    // target_pitch is the elevation of the reflection
+    aim_t fallback = {90 - g_settings.target_pitch, g_settings.target_yaw};
+    if (!heliostat_dirty && heliostat.is_planned(now) && fallback.pitch == heliostat_fallback.pitch &&
+            fallback.yaw == heliostat_fallback.yaw) {
+        return;
+    }
+    heliostat_dirty = false;
+    heliostat_fallback = fallback;
+    struct tm local;
+    localtime_r(&now, &local);
+    local.tm_hour = local.tm_min = local.tm_sec = 0;
+    int64_t start = esp_timer_get_time();
+    // a lookup meanwhile waits, it would find the plan half written
+    xSemaphoreTake(heliostat_sem, portMAX_DELAY);
+    heliostat.init(&g_settings.heliostat, g_settings.helio_targets, heliostat_fallback);
+    heliostat.plan(mktime(&local), heliostat_sun, this);
+    xSemaphoreGive(heliostat_sem);
+    ESP_LOGI(TAG, "Heliostat planned in %u ms", (uint32_t)((esp_timer_get_time() - start) / 1000));
+}
+
+void Gimbal::replanHeliostat()
+{
+    heliostat_dirty = true;
+    triger_task_immediate();
+}
+
+void Gimbal::reloadEphemeris()
+{
+    ephemeris_dirty = true;
+    triger_task_immediate();
+}
+
+bool Gimbal::getHeliostatSpot(const char **target, float *miss)
+{
+    if (g_settings.mode != MODE_REFLECT || !g_settings.heliostat.enable) {
+        return false;
+    }
+    time_t now;
+    time(&now);
+    aim_t sun = {(float)sunPosition.dZenithAngle, (float)sunPosition.dAzimuth};
+    mount.set_home(180 - g_settings.yaw_offset);
+    aim_t normal = mount.pointing(axes_position());
+    xSemaphoreTake(heliostat_sem, portMAX_DELAY);
+    int served = heliostat.target_at(minute_of_day(now));
+    *miss = served < HELIOSTAT_MAX_TARGETS ? heliostat.spot_error(normal, sun, served) : NAN;
+    xSemaphoreGive(heliostat_sem);
+    *target = Heliostat::target_name(g_settings.helio_targets, served);
+    return true;
+}
+
+/*
+ * Aim for the current mode at time t, parked facing south while the sun
+ * is down. Returns false when parked.
+ */
+bool Gimbal::aim_at(time_t t, aim_t *aim)
+{
+    // the plan has the sun position already
+    if (g_settings.mode == MODE_REFLECT && g_settings.heliostat.enable) {
+        xSemaphoreTake(heliostat_sem, portMAX_DELAY);
+        bool planned = heliostat.lookup(t, aim);
+        xSemaphoreGive(heliostat_sem);
+        if (planned) {
+            return true;
+        }
+    }
+    cSunCoordinates sun;
+    getSunPositionAt(t, &sun);
+    if (sun.dElevation <= GIMBAL_PARK_ELEVATION) {
+        *aim = {0, 180};
+        return false;
+    }
+    switch (g_settings.mode) {
+    case MODE_REFLECT: {
+        if (g_settings.heliostat.enable) {
+            aim_t sun_aim = {(float)sun.dZenithAngle, (float)sun.dAzimuth};
+            xSemaphoreTake(heliostat_sem, portMAX_DELAY);
+            *aim = heliostat.normal_for(sun_aim, heliostat.target_at(minute_of_day(t)));
+            xSemaphoreGive(heliostat_sem);
+            break;
+        }
+        // calculate normal vector of mirror surface
+        auto incident = light.angle_to_vector(sun.dAzimuth, sun.dElevation);
+        auto reflection_vector = light.angle_to_vector(g_settings.target_yaw, g_settings.target_pitch);
+        auto calculated_normal = light.calculate_normal(incident, reflection_vector);
+        auto [normal_azimuth, normal_elevation] = light.vector_to_angle(calculated_normal);
+        *aim = {(float)(90 - normal_elevation), (float)normal_azimuth};
+    } break;
+
+    case MODE_TOWARD:
+        *aim = fine_correct({(float)sun.dZenithAngle, (float)sun.dAzimuth});
+        break;
+
+    case MODE_MANUAL:
+        *aim = {g_settings.target_pitch, g_settings.target_yaw};
+        break;
+
+    default:
+        *aim = {pitchTarget, yawTarget};
+        break;
+    }
+    return true;
+}
+
 void Gimbal::update_task(void *pvParameters)
 {
     auto pgimbal = (Gimbal *)pvParameters;
     while (1) {
+        if (pgimbal->suspended) {
+            xSemaphoreTake(pgimbal->task_sem, portMAX_DELAY);
+            continue;
+        }
         pgimbal->getSunPosition(&pgimbal->sunPosition);
-        if (pgimbal->sunPosition.dElevation <= 3) {
-            ESP_LOGI(TAG, "Sun is below horizon, setting target to 0");
-            pgimbal->setTarget(0, 0, 180);
-        } else {
-            ESP_LOGI(TAG, "Sun is above horizon setting target");
-            switch (g_settings.mode) {
-            case MODE_REFLECT: {
-                // calculate normal vector of mirror surface
-                auto incident = pgimbal->light.angle_to_vector(pgimbal->sunPosition.dAzimuth, pgimbal->sunPosition.dElevation);
-                auto reflection_vector = pgimbal->light.angle_to_vector(g_settings.target_yaw, g_settings.target_pitch);
-                auto calculated_normal = pgimbal->light.calculate_normal(incident, reflection_vector);
-                auto [normal_azimuth, normal_elevation] = pgimbal->light.vector_to_angle(calculated_normal);
-                ESP_LOGI(TAG, "Normal Vector Azimuth: %f, Elevation: %f", normal_azimuth, normal_elevation);
-                pgimbal->setTarget(90 - normal_elevation, 0, normal_azimuth);
-            } break;
-
-            case MODE_TOWARD: {
-                pgimbal->setTarget(pgimbal->sunPosition.dZenithAngle, 0, pgimbal->sunPosition.dAzimuth);
-            } break;
-
-            case MODE_MANUAL:
-                pgimbal->setTarget(g_settings.target_pitch, 0, g_settings.target_yaw);
-                break;
-
-            default:
-                break;
+        time_t now;
+        time(&now);
+        aim_t current = {pgimbal->pitchTarget, pgimbal->yawTarget};
+        aim_t desired, next;
+        if (pgimbal->fine_wired && g_settings.mode == MODE_TOWARD) {
+            // the sun sensor is compared with the plain ephemeris
+            cSunCoordinates later;
+            pgimbal->getSunPositionAt(now + TRACK_PERIOD_S, &later);
+            aim_t sun = {(float)pgimbal->sunPosition.dZenithAngle, (float)pgimbal->sunPosition.dAzimuth};
+            aim_t sun_next = {(float)later.dZenithAngle, (float)later.dAzimuth};
+            portENTER_CRITICAL(&pgimbal->fine_lock);
+            pgimbal->fine.set_reference(sun, sun_next, TRACK_PERIOD_S, esp_timer_get_time());
+            portEXIT_CRITICAL(&pgimbal->fine_lock);
+        }
+        if (pgimbal->ephemeris_dirty) {
+            pgimbal->ephemeris_dirty = false;
+            ephemeris_table_load(CONFIG_EXAMPLE_WEB_MOUNT_POINT "/" EPHEMERIS_TABLE_FILE);
+            pgimbal->search_azimuth(&pgimbal->max_azimuth, &pgimbal->min_azimuth, &pgimbal->max_elevation,
+                                    &pgimbal->min_elevation);
+        }
+        pgimbal->mount_observe(now);
+        pgimbal->heliostat_plan(now);
+        bool day = pgimbal->aim_at(now, &desired);
+        pgimbal->aim_at(now + TRACK_PERIOD_S, &next);
+
+        int64_t now_us = esp_timer_get_time();
+        float dt = pgimbal->weather_us ? (now_us - pgimbal->weather_us) / 1e6f : TRACK_PERIOD_S;
+        pgimbal->weather_us = now_us;
+        pgimbal->irradiance = light_sensor_read();
+        weather_mode_t weather = pgimbal->weather.update(pgimbal->irradiance, pgimbal->sunPosition.dElevation, dt);
+        bool hold = false;
+        if (day && g_settings.mode != MODE_MANUAL && weather != WEATHER_TRACK) {
+            if (weather == WEATHER_DIFFUSE && g_settings.mode == MODE_TOWARD) {
+                // face the whole sky, the yaw does not matter there
+                desired = next = {0, current.yaw};
+            } else {
+                // partly cloudy, or overcast with a mirror, which has no use
+                // for diffuse light: keep the aim unless it is far off
+                hold = TrackingPolicy::angle_between(current, desired) < g_settings.weather.hold_deg;
+            }
+        }
+
+        // the policy moves a panel only when the error would exceed its
+        // threshold, a mirror every cycle and a manual target when it changes
+        track_target_t kind = g_settings.mode == MODE_TOWARD    ? TRACK_SUN
+                              : g_settings.mode == MODE_REFLECT ? TRACK_MIRROR
+                                                                : TRACK_FIXED;
+        float lead_s;
+        if (!hold && pgimbal->policy.decide(kind, current, desired, next, TRACK_PERIOD_S, &lead_s)) {
+            aim_t target = desired;
+            // aim ahead, unless that is already past sunset
+            if (lead_s > 0 && day && !pgimbal->aim_at(now + (time_t)lead_s, &target)) {
+                target = desired;
             }
+            ESP_LOGI(TAG, "Sun is %s horizon, aim pitch %.2f yaw %.2f, error was %.2f",
+                     day ? "above" : "below", target.pitch, target.yaw, pgimbal->policy.get_error());
+            pgimbal->setTarget(target.pitch, 0, target.yaw);
+            pgimbal->sun_up = day;
         }
-        xSemaphoreTake(pgimbal->task_sem, pdMS_TO_TICKS(10000));
+        xSemaphoreTake(pgimbal->task_sem, pdMS_TO_TICKS(TRACK_PERIOD_S * 1000));
     }
 }
 
@@ -274,14 +886,74 @@ void Gimbal::triger_task_immediate()
     xSemaphoreGive(task_sem);
 }
 
+void Gimbal::suspend()
+{
+    if (suspended) {
+        return;
+    }
+    suspended = true;
+    this->yawMotor->enable(0);
+    this->pitchMotor->enable(0);
+    // let one control cycle drive the bridges to zero before the IMU stops
+    vTaskDelay(pdMS_TO_TICKS(50));
+    this->imu->suspend();
+    ESP_LOGI(TAG, "suspended");
+}
+
+void Gimbal::resume()
+{
+    if (!suspended) {
+        return;
+    }
+    this->imu->resume();
+    released[0] = released[1] = false;
+    if (state == STATE_RUNNING) {
+        this->yawMotor->enable(1);
+        this->pitchMotor->enable(1);
+    }
+    suspended = false;
+    triger_task_immediate();
+    ESP_LOGI(TAG, "resumed");
+}
+
+bool Gimbal::isTracking()
+{
+    return sun_up && isOnTarget();
+}
+
+bool Gimbal::isOnTarget()
+{
+    if (suspended || state != STATE_RUNNING) {
+        return false;
+    }
+    float tolerance = g_settings.track.settle_deg;
+    return std::fabs(this->yawMotor->get_target_position() - this->yawMotor->get_position()) < tolerance &&
+           std::fabs(this->pitchMotor->get_target_position() - this->pitchMotor->get_position()) < tolerance;
+}
+
 void Gimbal::setTarget(float pitch, float roll, float yaw)
 {
     // unit: degree 0 - 360
     const float Aziimuth_mid = 180;
-    this->pitchTarget = pitch;
-    this->yawTarget = yaw;
-    this->yawMotor->set_position((yawTarget + g_settings.yaw_offset) - Aziimuth_mid);
-    this->pitchMotor->set_position(pitchTarget);
+    rec_target_t aim = {pitch, yaw};
+    recorder_tap(REC_TARGET, &aim, sizeof(aim));
+    this->pitchTarget = aim.pitch;
+    this->yawTarget = aim.yaw;
+    // the axes that point there on the real mount
+    mount.set_home(Aziimuth_mid - g_settings.yaw_offset);
+    aim_t axes = mount.axes_for({pitchTarget, yawTarget});
+    this->yawMotor->set_position((axes.yaw + g_settings.yaw_offset) - Aziimuth_mid);
+    this->pitchMotor->set_position(axes.pitch);
+
+    // axes released between moves are powered again, not those stopped by an error
+    if (state == STATE_RUNNING) {
+        if (released[0]) {
+            this->yawMotor->enable(1);
+        }
+        if (released[1]) {
+            this->pitchMotor->enable(1);
+        }
+    }
 }
 
 void Gimbal::search_azimuth(float *max_azimuth, float *min_azimuth, float *max_elevation, float *min_elevation)
@@ -297,6 +969,19 @@ void Gimbal::search_azimuth(float *max_azimuth, float *min_azimuth, float *max_e
     localtime_r(&now, &local_time);
     printf("Searching for Local Time: %d-%02d-%02d %02d:%02d:%02d\n", local_time.tm_year + 1900, local_time.tm_mon + 1, local_time.tm_mday, local_time.tm_hour, local_time.tm_min, local_time.tm_sec);
 
+    // the table from tools/ephemeris has the day at minute resolution
+    ephemeris_day_t day;
+    time_t day_start;
+    if (ephemeris_table_day(now, gps->getData().latitude, gps->getData().longitude, &day, &day_start)) {
+        *max_azimuth = day.max_azimuth / 10.0f;
+        *min_azimuth = day.min_azimuth / 10.0f;
+        *max_elevation = day.max_elevation / 10.0f;
+        *min_elevation = ephemeris_table_header()->park_elevation;
+        ESP_LOGI(TAG, "Ephemeris table: azimuth %.1f..%.1f, elevation up to %.1f, %u moves, %u Wh/m2 tracked",
+                 *min_azimuth, *max_azimuth, *max_elevation, day.moves, day.yield_wh[2]);
+        return;
+    }
+
     local_time.tm_hour = 6;
     local_time.tm_min = 0;
     local_time.tm_sec = 0;
@@ -18,6 +18,16 @@
 #include "gps.h"
 #include "light_reflection.hpp"
 #include "sun_pos.h"
+#include "sun_engine.h"
+#include "energy.h"
+#include "tracking_policy.h"
+#include "weather_policy.h"
+#include "fine_tracker.h"
+#include "mount_model.h"
+#include "heliostat.h"
+#include "adc.h"
+#include "app_datafusion.h"
+#include "recorder.h"
 
 #define SYS_STATE_LIST \
 X(STATE_INIT, "Initial")   \
@@ -26,6 +36,8 @@ X(STATE_RUNNING, "Running")     \
 X(STATE_LOW_VOLTAGE, "Error Low voltage") \
 X(STATE_HIGH_VOLTAGE, "Error High voltage") \
 
+#define GIMBAL_PARK_ELEVATION   3   // degrees, below it the gimbal parks facing south
+
 enum SysState {
 #define X(name, desc) name,
     SYS_STATE_LIST
@@ -33,6 +45,24 @@ enum SysState {
     SYS_STATE_COUNT
 };
 
+// REC_KEYFRAME, what the control loop carries from one tick to the next
+typedef struct {
+    float fusion[DATAFUSION_STATE_SIZE];
+    motor_state_t motor[2];     // yaw, pitch
+    VelocityEstimator yaw_velocity;
+    axis_t field;               // compass, read every 10th cycle
+    int64_t yaw_home;           // encoder count of home
+    int64_t last_tick_us;
+    uint32_t imu_cycles;
+    uint32_t ticks;
+    int32_t fine_count;
+    float settled_s[2];
+    float voltage;
+    int16_t gyro_cross_sens;    // of the BMI270 in use
+    uint8_t state;              // SysState
+    uint8_t released[2];
+} gimbal_keyframe_t;
+
 class SensorLogger : public Observer<imu_data_t> {
 public:
     void update(const imu_data_t &data) override
@@ -59,29 +89,157 @@ public:
     void update(const imu_data_t &data) override;
     void search_azimuth(float *max_azimuth, float *min_azimuth, float *max_elevation, float *min_elevation);
     void getSunPosition(cSunCoordinates *sunCoordinates);
+    void getSunPositionAt(time_t t, cSunCoordinates *sunCoordinates);
     void triger_task_immediate();
+    // park is done by the caller: stop the motors, IMU polling and re-aiming
+    void suspend();
+    void resume();
+    bool isSuspended() const
+    {
+        return suspended;
+    }
+    // both axes within the settle tolerance of their targets
+    bool isOnTarget();
+    // on target and the target follows the sun
+    bool isTracking();
     std::shared_ptr<IMUBmi270> imu;
     std::shared_ptr<GPS> gps;
     float voltage = 0.0f; // 电压
     struct pid pitchPID;
     std::shared_ptr<Motor> pitchMotor;
     std::shared_ptr<Motor> yawMotor;
+    EncoderSensor *yawEncoder = nullptr;
     cSunCoordinates sunPosition;
+    SysState getState() const
+    {
+        return state;
+    }
+    bool isSunUp() const
+    {
+        return sun_up;
+    }
     const char *getStateDescription() const
     {
         return SysStateDescriptions[state];
     }
+    // duration of the last homing in ms, 0 if the position was restored
+    uint32_t getHomingTime() const
+    {
+        return homing_ms;
+    }
+    // "fast", "full", or "restored" when homing was skipped
+    const char *getHomingMode() const
+    {
+        return homing_mode;
+    }
+    const TrackingPolicy &getTrackingPolicy() const
+    {
+        return policy;
+    }
+    const WeatherPolicy &getWeatherPolicy() const
+    {
+        return weather;
+    }
+    const FineTracker &getFineTracker() const
+    {
+        return fine;
+    }
+    const SunEngine &getSunEngine() const
+    {
+        return sun_engine;
+    }
+    // all four quadrants of the sun sensor are wired
+    bool hasSunSensor() const
+    {
+        return fine_wired;
+    }
+    // last reading of the light sensor, W/m2, NAN without one
+    float getIrradiance() const
+    {
+        return irradiance;
+    }
+    /**
+     * @brief Record the axes as centered on the sun, or for MODE_REFLECT on
+     * the target, for the mount calibration
+     * @return false if there is nothing to center on right now
+     */
+    bool sampleMount();
+    /**
+     * @brief Fit the mount model to the recorded observations
+     */
+    bool solveMount(struct mount_param *result, struct mount_fit *fit);
+    // use param from now on, the fine tracker starts over
+    void applyMount(const struct mount_param &param);
+    void clearMount();
+    int getMountSamples();
+    // plan the heliostat again, its targets changed
+    void replanHeliostat();
+    // load the ephemeris table again, a new one was written
+    void reloadEphemeris();
+    /**
+     * @brief Heliostat target served now and by how far the spot of the
+     * actual axes misses it
+     * @return false unless the heliostat is on
+     */
+    bool getHeliostatSpot(const char **target, float *miss);
+    // state of the control loop, tools/replay starts from a recorded one
+    void getLoopState(gimbal_keyframe_t *key);
+    void setLoopState(const gimbal_keyframe_t &key);
 
 private:
     static const char* SysStateDescriptions[];
     SysState state = STATE_INIT;
     static void update_task(void *pvParameters);
     void check_voltage();
+    void record(const imu_data_t &data);
+    bool restore_position();
+    void checkpoint_position();
+    energy_mode_t energy_mode(Motor *motor);
+    bool aim_at(time_t t, aim_t *aim);
+    void release_when_settled(Motor *motor, int axis, bool self_lock, float dt);
+    void fine_update(const adc_snapshot_t &analog);
+    aim_t fine_correct(const aim_t &aim);
+    aim_t axes_position();
+    void mount_observe(time_t now);
+    void heliostat_plan(time_t now);
+    static bool heliostat_sun(time_t t, aim_t *sun, void *ctx);
+    bool seek_end_stop(float direction, float speed, float max_travel, float *stop_pos);
+    bool refine_end_stop(float direction, float speed, float *stop_pos);
+    bool move_to(float position);
+    bool home_fast(float homing_speed, float span);
+    bool home_full_sweep(float homing_speed);
     SemaphoreHandle_t task_sem;
     LightReflection light;
     float pitchTarget;
     float yawTarget;
     float max_azimuth, min_azimuth, max_elevation, min_elevation;
+    float yaw_limit_max = 0, yaw_limit_min = 0; // end stops relative to home, degrees
+    uint32_t homing_ms = 0;
+    const char *homing_mode = "restored";
+    TrackingPolicy policy;
+    WeatherPolicy weather;
+    float irradiance = NAN;
+    int64_t weather_us = 0;     // time of the last weather update
+    FineTracker fine;
+    bool fine_wired = false;
+    int fine_count = 0;
+    portMUX_TYPE fine_lock = portMUX_INITIALIZER_UNLOCKED;  // IMU task vs update task
+    MountModel mount;
+    MountCalibration calibration;
+    SemaphoreHandle_t calibration_sem;
+    time_t calibration_last = 0;    // time of the last automatic observation
+    Heliostat heliostat;
+    SemaphoreHandle_t heliostat_sem;    // the update task plans while REST workers aim and measure the spot
+    aim_t heliostat_fallback = {0, 0};
+    SunEngine sun_engine;
+    volatile bool heliostat_dirty = true;
+    volatile bool ephemeris_dirty = false;
+    bool released[2] = {false, false};  // yaw, pitch de-energized between moves
+    float settled_s[2] = {0, 0};
+    volatile bool suspended = false;
+    bool sun_up = false;    // the last aim followed the sun, not the park position
+    uint32_t ticks = 0;     // control ticks, the voltage is checked every 10th
+    int64_t last_tick_us = 0;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,407 @@
+#include <math.h>
+#include <string.h>
+#include "heliostat.h"
+
+#define HELIOSTAT_PARALLAX_STEPS    3       // the offset is ~1% of the distance, 1e-6 after three
+#define HELIOSTAT_CHUNK             48      // plan steps per pass over the arrays
+#define HELIOSTAT_FAR_M             1e6f    // the fallback direction as a point
+
+static const float DEG = (float)M_PI / 180.0f;
+
+static float wrap180(float deg)
+{
+    deg = fmodf(deg + 180.0f, 360.0f);
+    return deg < 0 ? deg + 180.0f : deg - 180.0f;
+}
+
+static void unit_of(const aim_t &aim, float v[3])
+{
+    float s = sinf(aim.pitch * DEG);
+    v[0] = s * sinf(aim.yaw * DEG);
+    v[1] = s * cosf(aim.yaw * DEG);
+    v[2] = cosf(aim.pitch * DEG);
+}
+
+static aim_t aim_of(float x, float y, float z)
+{
+    float yaw = atan2f(x, y) / DEG;
+    return {acosf(fminf(fmaxf(z, -1.0f), 1.0f)) / DEG, yaw < 0 ? yaw + 360.0f : yaw};
+}
+
+static void normalize(float *x, float *y, float *z)
+{
+    float n = sqrtf(*x * *x + *y * *y + *z * *z);
+    if (n > 0) {
+        *x /= n;
+        *y /= n;
+        *z /= n;
+    }
+}
+
+void Heliostat::init(const struct heliostat_param *param, const struct heliostat_target *targets, const aim_t &fallback)
+{
+    this->param = param;
+    this->targets = targets;
+    this->fallback = fallback;
+    planned = false;
+}
+
+int Heliostat::target_at(int minute) const
+{
+    for (int i = 0; targets != nullptr && i < HELIOSTAT_MAX_TARGETS; i++) {
+        const heliostat_target &target = targets[i];
+        if (!target.enable) {
+            continue;
+        }
+        bool inside = target.from_min <= target.to_min ? minute >= target.from_min && minute < target.to_min
+                                                       : minute >= target.from_min || minute < target.to_min;
+        if (inside) {
+            return i;
+        }
+    }
+    return HELIOSTAT_MAX_TARGETS;
+}
+
+void Heliostat::target_point(int target, float p[3]) const
+{
+    if (targets != nullptr && target >= 0 && target < HELIOSTAT_MAX_TARGETS) {
+        p[0] = targets[target].east;
+        p[1] = targets[target].north;
+        p[2] = targets[target].up;
+        return;
+    }
+    unit_of(fallback, p);
+    p[0] *= HELIOSTAT_FAR_M;
+    p[1] *= HELIOSTAT_FAR_M;
+    p[2] *= HELIOSTAT_FAR_M;
+}
+
+aim_t Heliostat::normal_for(const aim_t &sun, int target) const
+{
+    float s[3], t[3];
+    unit_of(sun, s);
+    target_point(target, t);
+    float offset = param != nullptr ? param->mirror_offset_m : 0.0f;
+
+    float rx = t[0], ry = t[1], rz = t[2];
+    normalize(&rx, &ry, &rz);
+    float nx = s[0] + rx, ny = s[1] + ry, nz = s[2] + rz;
+    normalize(&nx, &ny, &nz);
+    // the ray leaves from the mirror, offset along the normal
+    for (int k = 0; k < HELIOSTAT_PARALLAX_STEPS && offset != 0; k++) {
+        rx = t[0] - nx * offset;
+        ry = t[1] - ny * offset;
+        rz = t[2] - nz * offset;
+        normalize(&rx, &ry, &rz);
+        nx = s[0] + rx;
+        ny = s[1] + ry;
+        nz = s[2] + rz;
+        normalize(&nx, &ny, &nz);
+    }
+    return aim_of(nx, ny, nz);
+}
+
+float Heliostat::spot_error(const aim_t &normal, const aim_t &sun, int target) const
+{
+    float n[3], s[3], t[3];
+    unit_of(normal, n);
+    unit_of(sun, s);
+    target_point(target, t);
+    float offset = param != nullptr ? param->mirror_offset_m : 0.0f;
+
+    // reflected ray from the mirror, and the target seen from there
+    float sn = s[0] * n[0] + s[1] * n[1] + s[2] * n[2];
+    float d[3], m[3];
+    float along = 0;
+    for (int i = 0; i < 3; i++) {
+        d[i] = 2 * sn * n[i] - s[i];
+        m[i] = t[i] - n[i] * offset;
+        along += m[i] * d[i];
+    }
+    along = fmaxf(along, 0.0f);
+    float miss = 0;
+    for (int i = 0; i < 3; i++) {
+        float e = m[i] - d[i] * along;
+        miss += e * e;
+    }
+    return sqrtf(miss);
+}
+
+/*
+ * The same bisection as normal_for(), a chunk of steps at a time: first
+ * the sun and the target of every step, then each stage over all of them.
+ */
+void Heliostat::plan(time_t midnight, heliostat_sun_fn sun_at, void *ctx)
+{
+    float offset = param != nullptr ? param->mirror_offset_m : 0.0f;
+    for (int base = 0; base <= HELIOSTAT_PLAN_SIZE; base += HELIOSTAT_CHUNK) {
+        int count = HELIOSTAT_PLAN_SIZE + 1 - base;
+        if (count > HELIOSTAT_CHUNK) {
+            count = HELIOSTAT_CHUNK;
+        }
+        float sx[HELIOSTAT_CHUNK], sy[HELIOSTAT_CHUNK], sz[HELIOSTAT_CHUNK];
+        float tx[HELIOSTAT_CHUNK], ty[HELIOSTAT_CHUNK], tz[HELIOSTAT_CHUNK];
+        float nx[HELIOSTAT_CHUNK], ny[HELIOSTAT_CHUNK], nz[HELIOSTAT_CHUNK];
+
+        for (int i = 0; i < count; i++) {
+            int step = base + i;
+            aim_t sun;
+            float s[3] = {0, 0, 1}, t[3] = {0, 0, 1};
+            if (sun_at(midnight + (time_t)step * HELIOSTAT_STEP_S, &sun, ctx)) {
+                served[step] = target_at(step * HELIOSTAT_STEP_S / 60 % (24 * 60));
+                unit_of(sun, s);
+                target_point(served[step], t);
+            } else {
+                served[step] = HELIOSTAT_NONE;
+            }
+            sx[i] = s[0];
+            sy[i] = s[1];
+            sz[i] = s[2];
+            tx[i] = t[0];
+            ty[i] = t[1];
+            tz[i] = t[2];
+        }
+
+        for (int i = 0; i < count; i++) {
+            float rx = tx[i], ry = ty[i], rz = tz[i];
+            normalize(&rx, &ry, &rz);
+            nx[i] = sx[i] + rx;
+            ny[i] = sy[i] + ry;
+            nz[i] = sz[i] + rz;
+            normalize(&nx[i], &ny[i], &nz[i]);
+        }
+        for (int k = 0; k < HELIOSTAT_PARALLAX_STEPS && offset != 0; k++) {
+            for (int i = 0; i < count; i++) {
+                float rx = tx[i] - nx[i] * offset, ry = ty[i] - ny[i] * offset, rz = tz[i] - nz[i] * offset;
+                normalize(&rx, &ry, &rz);
+                nx[i] = sx[i] + rx;
+                ny[i] = sy[i] + ry;
+                nz[i] = sz[i] + rz;
+                normalize(&nx[i], &ny[i], &nz[i]);
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            normals[base + i] = aim_of(nx[i], ny[i], nz[i]);
+        }
+    }
+    plan_start = midnight;
+    planned = true;
+}
+
+bool Heliostat::lookup(time_t t, aim_t *normal) const
+{
+    if (!is_planned(t)) {
+        return false;
+    }
+    int since = (int)(t - plan_start);
+    int step = since / HELIOSTAT_STEP_S;
+    if (served[step] == HELIOSTAT_NONE || served[step] != served[step + 1]) {
+        return false;
+    }
+    float frac = (since - step * HELIOSTAT_STEP_S) / (float)HELIOSTAT_STEP_S;
+    const aim_t &a = normals[step], &b = normals[step + 1];
+    float yaw = a.yaw + wrap180(b.yaw - a.yaw) * frac;
+    *normal = {a.pitch + (b.pitch - a.pitch) * frac, yaw < 0 ? yaw + 360.0f : (yaw >= 360.0f ? yaw - 360.0f : yaw)};
+    return true;
+}
+
+const char *Heliostat::target_name(const struct heliostat_target *targets, int target)
+{
+    if (target == HELIOSTAT_NONE) {
+        return "none";
+    }
+    if (targets == nullptr || target < 0 || target >= HELIOSTAT_MAX_TARGETS) {
+        return "fallback";
+    }
+    return targets[target].name;
+}
+
+// benchmark the plan against the per cycle computation on linux
+#if defined(__linux__) && !defined(HELIOSTAT_NO_MAIN)
+
+#include <stdio.h>
+#include <chrono>
+#include "light_reflection.hpp"
+
+/*
+ * A mirror at 35N in June throws the sun into a window 6m south-east and
+ * 3m up in the morning and onto a collector 8m north in the afternoon,
+ * otherwise towards a fallback direction. The tracking loop wants the
+ * normal three times per 10s cycle: now, at the next cycle and at the lead.
+ */
+
+#define SIM_CYCLE_S     10
+#define SIM_REPEAT      20
+#define SIM_OFFSET_M    0.05f
+
+static const double SIM_LATITUDE = 35.0, SIM_DECLINATION = 23.0;
+
+static bool sim_sun(time_t t, aim_t *sun, void *ctx)
+{
+    (void)ctx;
+    double lat = SIM_LATITUDE * M_PI / 180, d = SIM_DECLINATION * M_PI / 180;
+    double h = ((t % 86400) / 3600.0 - 12.0) * 15.0 * M_PI / 180;
+    double el = asin(sin(lat) * sin(d) + cos(lat) * cos(d) * cos(h));
+    double az = atan2(sin(h), cos(h) * sin(lat) - tan(d) * cos(lat)) * 180 / M_PI + 180.0;
+    *sun = {(float)(90.0 - el * 180 / M_PI), (float)az};
+    return el > 3 * M_PI / 180;
+}
+
+static float angle_between(const aim_t &a, const aim_t &b)
+{
+    float u[3], v[3];
+    unit_of(a, u);
+    unit_of(b, v);
+    float cx = u[1] * v[2] - u[2] * v[1], cy = u[2] * v[0] - u[0] * v[2], cz = u[0] * v[1] - u[1] * v[0];
+    return atan2f(sqrtf(cx * cx + cy * cy + cz * cz), u[0] * v[0] + u[1] * v[1] + u[2] * v[2]) / DEG;
+}
+
+// what MODE_REFLECT computes every cycle, the target as a direction from the pivot
+static aim_t legacy_normal(LightReflection &light, const aim_t &sun, float target_az, float target_el)
+{
+    auto incident = light.angle_to_vector(sun.yaw, 90 - sun.pitch);
+    auto reflection = light.angle_to_vector(target_az, target_el);
+    auto [azimuth, elevation] = light.vector_to_angle(light.calculate_normal(incident, reflection));
+    return {(float)(90 - elevation), (float)azimuth};
+}
+
+template <typename F>
+static double time_us(F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < SIM_REPEAT; i++) {
+        f();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / SIM_REPEAT;
+}
+
+int main()
+{
+    int failures = 0;
+    heliostat_target targets[HELIOSTAT_MAX_TARGETS] = {
+        {"window", 4.0f, -4.5f, 3.0f, 7 * 60, 12 * 60, 1},
+        {"collector", 0.5f, 8.0f, 1.0f, 12 * 60, 17 * 60 + 30, 1},
+    };
+    heliostat_param param = {SIM_OFFSET_M, 1};
+    const aim_t fallback = {80, 0};
+    Heliostat helio;
+    helio.init(&param, targets, fallback);
+    LightReflection light;
+    const time_t midnight = 10 * 86400;
+
+    // every lookup against the direct computation
+    helio.plan(midnight, sim_sun, nullptr);
+    float worst_angle = 0, worst_spot = 0, worst_direct_spot = 0, worst_legacy_spot = 0;
+    int cycles = 0, planned = 0;
+    for (time_t t = midnight; t < midnight + 86400; t += SIM_CYCLE_S) {
+        aim_t sun;
+        if (!sim_sun(t, &sun, nullptr)) {
+            continue;
+        }
+        cycles++;
+        int target = helio.target_at((t - midnight) / 60);
+        aim_t direct = helio.normal_for(sun, target);
+        // the fallback is a direction, the spot of it is nowhere
+        bool point = target < HELIOSTAT_MAX_TARGETS;
+        if (point) {
+            worst_direct_spot = fmaxf(worst_direct_spot, helio.spot_error(direct, sun, target));
+            // the same point taken as a direction from the pivot, no parallax
+            const heliostat_target &p = targets[target];
+            float az = atan2f(p.east, p.north) / DEG;
+            float el = atan2f(p.up, sqrtf(p.east * p.east + p.north * p.north)) / DEG;
+            aim_t legacy = legacy_normal(light, sun, az < 0 ? az + 360 : az, el);
+            worst_legacy_spot = fmaxf(worst_legacy_spot, helio.spot_error(legacy, sun, target));
+        }
+        aim_t normal;
+        if (helio.lookup(t, &normal)) {
+            planned++;
+            worst_angle = fmaxf(worst_angle, angle_between(normal, direct));
+            if (point) {
+                worst_spot = fmaxf(worst_spot, helio.spot_error(normal, sun, target));
+            }
+        }
+    }
+    printf("  %d cycles in daylight, %d (%.1f%%) from the plan\n", cycles, planned, 100.0f * planned / cycles);
+    printf("  plan vs direct: worst %.5f deg, spot miss %.2f mm\n", worst_angle, worst_spot * 1000);
+    printf("  spot miss: direct %.3f mm, without parallax %.1f mm\n", worst_direct_spot * 1000, worst_legacy_spot * 1000);
+    if (worst_angle > 0.01f) {
+        printf("    plan too coarse\n");
+        failures++;
+    }
+    if (worst_direct_spot > 0.001f) {
+        printf("    parallax not removed\n");
+        failures++;
+    }
+    if (planned < cycles * 95 / 100) {
+        printf("    plan covers too little of the day\n");
+        failures++;
+    }
+
+    // a far target without offset is the old bisection
+    heliostat_param flat = {0, 1};
+    Heliostat far;
+    far.init(&flat, nullptr, fallback);
+    float worst_legacy = 0;
+    for (time_t t = midnight + 6 * 3600; t < midnight + 18 * 3600; t += 600) {
+        aim_t sun;
+        if (sim_sun(t, &sun, nullptr)) {
+            worst_legacy = fmaxf(worst_legacy, angle_between(far.normal_for(sun, HELIOSTAT_MAX_TARGETS),
+                                                             legacy_normal(light, sun, fallback.yaw, 90 - fallback.pitch)));
+        }
+    }
+    printf("  far target vs LightReflection: worst %.6f deg\n", worst_legacy);
+    if (worst_legacy > 1e-3f) {
+        printf("    differs from the old bisection\n");
+        failures++;
+    }
+
+    // a day of cycles, three normals per cycle
+    volatile float sink = 0;
+    double legacy_us = time_us([&] {
+        for (time_t t = midnight; t < midnight + 86400; t += SIM_CYCLE_S) {
+            for (int k = 0; k < 3; k++) {
+                aim_t sun;
+                if (sim_sun(t + k * SIM_CYCLE_S, &sun, nullptr)) {
+                    sink = sink + legacy_normal(light, sun, fallback.yaw, 90 - fallback.pitch).pitch;
+                }
+            }
+        }
+    });
+    double direct_us = time_us([&] {
+        for (time_t t = midnight; t < midnight + 86400; t += SIM_CYCLE_S) {
+            for (int k = 0; k < 3; k++) {
+                aim_t sun;
+                if (sim_sun(t + k * SIM_CYCLE_S, &sun, nullptr)) {
+                    sink = sink + helio.normal_for(sun, helio.target_at((t - midnight) / 60)).pitch;
+                }
+            }
+        }
+    });
+    double plan_us = time_us([&] { helio.plan(midnight, sim_sun, nullptr); });
+    double lookup_us = time_us([&] {
+        for (time_t t = midnight; t < midnight + 86400; t += SIM_CYCLE_S) {
+            for (int k = 0; k < 3; k++) {
+                aim_t normal;
+                if (helio.lookup(t + k * SIM_CYCLE_S, &normal)) {
+                    sink = sink + normal.pitch;
+                }
+            }
+        }
+    });
+    printf("  %-32s %10s\n", "per day", "us");
+    printf("  %-32s %10.0f\n", "per cycle, LightReflection", legacy_us);
+    printf("  %-32s %10.0f\n", "per cycle, with parallax", direct_us);
+    printf("  %-32s %10.0f\n", "plan", plan_us);
+    printf("  %-32s %10.0f\n", "lookups", lookup_us);
+    printf("  %-32s %10.0f\n", "plan and lookups", plan_us + lookup_us);
+    if (plan_us + lookup_us > direct_us) {
+        printf("    the plan is slower than computing every cycle\n");
+        failures++;
+    }
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
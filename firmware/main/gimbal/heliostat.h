@@ -0,0 +1,108 @@
+/*
+   Heliostat, reflecting the sun onto scheduled targets.
+
+   MODE_REFLECT used to bisect the sun and one fixed direction. A heliostat
+   target is a point: east, north and up in metres from the pivot of the
+   mirror. The mirror surface sits mirror_offset_m in front of the pivot
+   along its normal, so the ray leaves from a point that moves with the
+   normal. For a target a few metres away that parallax is worth a
+   fraction of a degree, it is removed by iterating the bisection.
+
+   Each target has a window in local minutes of the day, the first enabled
+   target whose window contains the time is served. Outside every window
+   the fallback direction, the old target_yaw / target_pitch, is used.
+
+   The normals of a whole day are planned in one pass every HELIOSTAT_STEP_S
+   over arrays, and the tracking loop interpolates in the plan instead of
+   bisecting every cycle. Where the plan switches targets, and outside it,
+   the normal is computed directly.
+
+   The heliostat does not depend on ESP-IDF, see the __linux__ section of
+   heliostat.cpp for a benchmark against the per cycle computation.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include "tracking_policy.h"
+
+#define HELIOSTAT_MAX_TARGETS   4
+#define HELIOSTAT_NAME_LEN      16
+#define HELIOSTAT_STEP_S        120
+#define HELIOSTAT_PLAN_SIZE     (24 * 3600 / HELIOSTAT_STEP_S)
+#define HELIOSTAT_NONE          0xff    // no target, the sun is down
+
+struct heliostat_target {
+    char name[HELIOSTAT_NAME_LEN];
+    float east, north, up;      // metres from the pivot
+    uint16_t from_min, to_min;  // local time window, minutes of the day
+    uint8_t enable;
+};
+
+struct heliostat_param {
+    float mirror_offset_m;      // mirror surface in front of the pivot
+    uint8_t enable;             // off is the plain bisection of MODE_REFLECT
+};
+
+// aim at the sun at t, false while it is below the horizon
+typedef bool (*heliostat_sun_fn)(time_t t, aim_t *sun, void *ctx);
+
+class Heliostat {
+public:
+    Heliostat() = default;
+
+    /**
+     * @param fallback direction served outside the windows of the targets
+     */
+    void init(const struct heliostat_param *param, const struct heliostat_target *targets, const aim_t &fallback);
+
+    /**
+     * @brief Target served at a time of day
+     * @return index into targets, or HELIOSTAT_MAX_TARGETS for the fallback
+     */
+    int target_at(int minute) const;
+
+    /**
+     * @brief Mirror normal reflecting the sun onto a target, computed directly
+     */
+    aim_t normal_for(const aim_t &sun, int target) const;
+
+    /**
+     * @brief Distance in metres by which the reflected ray misses the target
+     */
+    float spot_error(const aim_t &normal, const aim_t &sun, int target) const;
+
+    /**
+     * @brief Plan the normals of the day starting at midnight
+     */
+    void plan(time_t midnight, heliostat_sun_fn sun, void *ctx);
+
+    /**
+     * @brief Normal at t from the plan
+     * @return false if t is not covered or a target switch falls in the step
+     */
+    bool lookup(time_t t, aim_t *normal) const;
+
+    bool is_planned(time_t t) const
+    {
+        return planned && t >= plan_start && t < plan_start + 24 * 3600;
+    }
+    // the next lookup() falls back until plan() runs again
+    void invalidate()
+    {
+        planned = false;
+    }
+
+    static const char *target_name(const struct heliostat_target *targets, int target);
+
+private:
+    const struct heliostat_param *param = nullptr;
+    const struct heliostat_target *targets = nullptr;
+    aim_t fallback = {0, 0};
+    bool planned = false;
+    time_t plan_start = 0;
+    aim_t normals[HELIOSTAT_PLAN_SIZE + 1];
+    uint8_t served[HELIOSTAT_PLAN_SIZE + 1];   // target index, HELIOSTAT_NONE at night
+
+    void target_point(int target, float p[3]) const;
+};
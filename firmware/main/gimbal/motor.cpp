@@ -12,20 +12,22 @@
 #include "freertos/task.h"
 #include "freertos/timers.h"
 #include "driver/ledc.h"
+#include "driver/gpio.h"
 #include "esp_timer.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "board.h"
 #include "motor.h"
 #include "pid.h"
+#include "loop_bench.h"
 #include "led.h"
 
 static const char *TAG = "motor";
 
 
 
-#define STALL_SPEED_THRESHOLD   0.1f    // Speed threshold for stall detection
 #define RECOVERY_OUTPUT_RATIO   0.8f    // Output ratio threshold for recovery
+#define LIMIT_MARGIN_DEG        2.0f    // stalls this close to a limit are end stops
 
 
 const char* Motor::motStateDescriptions[] = {
@@ -37,12 +39,14 @@ const char* Motor::motStateDescriptions[] = {
 bool EncoderSensor::init(int gpio_enca, int gpio_encb, float cpr)
 {
     ESP_LOGI(TAG, "install pcnt unit");
+    // the hardware counter is only 16 bit, it is reset on every limit and
+    // overflow_cb() extends it to 64 bit
     pcnt_unit_config_t unit_config = {
         .low_limit = -3000,
         .high_limit = 3000,
         .intr_priority = 0,
         .flags = {
-            .accum_count = true,
+            .accum_count = false,
         }
     };
     ESP_ERROR_CHECK(pcnt_new_unit(&unit_config, &pcnt_unit));
@@ -77,14 +81,46 @@ bool EncoderSensor::init(int gpio_enca, int gpio_encb, float cpr)
     for (size_t i = 0; i < sizeof(watch_points) / sizeof(watch_points[0]); i++) {
         ESP_ERROR_CHECK(pcnt_unit_add_watch_point(pcnt_unit, watch_points[i]));
     }
+    pcnt_event_callbacks_t cbs = {
+        .on_reach = EncoderSensor::overflow_cb,
+    };
+    ESP_ERROR_CHECK(pcnt_unit_register_event_callbacks(pcnt_unit, &cbs, this));
 
     ESP_ERROR_CHECK(pcnt_unit_enable(pcnt_unit));
     ESP_ERROR_CHECK(pcnt_unit_clear_count(pcnt_unit));
     ESP_ERROR_CHECK(pcnt_unit_start(pcnt_unit));
+
+    ESP_LOGI(TAG, "install edge timestamp interrupts");
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) { // already installed is fine
+        ESP_ERROR_CHECK(err);
+    }
+    ESP_ERROR_CHECK(gpio_set_intr_type((gpio_num_t)gpio_enca, GPIO_INTR_ANYEDGE));
+    ESP_ERROR_CHECK(gpio_set_intr_type((gpio_num_t)gpio_encb, GPIO_INTR_ANYEDGE));
+    ESP_ERROR_CHECK(gpio_isr_handler_add((gpio_num_t)gpio_enca, EncoderSensor::edge_isr, this));
+    ESP_ERROR_CHECK(gpio_isr_handler_add((gpio_num_t)gpio_encb, EncoderSensor::edge_isr, this));
+
+    estimator.init();
     counts_per_rev = cpr;
     return 0;
 }
 
+bool IRAM_ATTR EncoderSensor::overflow_cb(pcnt_unit_handle_t unit, const pcnt_watch_event_data_t *edata, void *user_ctx)
+{
+    EncoderSensor *self = (EncoderSensor *)user_ctx;
+    portENTER_CRITICAL_ISR(&self->lock);
+    self->overflow += edata->watch_point_value;
+    portEXIT_CRITICAL_ISR(&self->lock);
+    return false;
+}
+
+void IRAM_ATTR EncoderSensor::edge_isr(void *arg)
+{
+    EncoderSensor *self = (EncoderSensor *)arg;
+    self->edge_us = esp_timer_get_time();
+    self->edge_seq = self->edge_seq + 1;
+}
+
 float EncoderSensor::get_position()
 {
     return current_revolutions;
@@ -94,18 +130,54 @@ float EncoderSensor::get_velocity()
     return cur_velocity;
 }
 
-void EncoderSensor::update_velocity(float dt)
+int64_t EncoderSensor::get_count()
 {
     int pulse_count;
+    portENTER_CRITICAL(&lock);
     pcnt_unit_get_count(pcnt_unit, &pulse_count);
-    current_revolutions = (float)pulse_count / counts_per_rev;
-    cur_velocity = (current_revolutions - last_revolutions) / dt;
-    last_revolutions = current_revolutions;
+    int64_t count = overflow + pulse_count;
+    portEXIT_CRITICAL(&lock);
+    return count;
+}
+
+void EncoderSensor::set_count(int64_t count)
+{
+    int pulse_count;
+    portENTER_CRITICAL(&lock);
+    pcnt_unit_get_count(pcnt_unit, &pulse_count);
+    overflow = count - pulse_count;
+    portEXIT_CRITICAL(&lock);
+    estimator.reset();
+    current_revolutions = (float)((double)(count - home_count) / counts_per_rev);
+}
+
+void EncoderSensor::set_home(int64_t count)
+{
+    home_count = count;
+    current_revolutions = (float)((double)(get_count() - home_count) / counts_per_rev);
+}
+
+void EncoderSensor::update_velocity(float dt)
+{
+    rec_encoder_t read;
+    uint32_t seq;
+    // make sure no edge slipped in between reading the count and its timestamp
+    do {
+        seq = edge_seq;
+        read.edge_us = edge_us;
+        read.count = get_count();
+    } while (seq != edge_seq);
+    read.now_us = esp_timer_get_time();
+    recorder_tap(REC_ENCODER, &read, sizeof(read));
+
+    // subtract in integer first, the float only holds the distance from home
+    current_revolutions = (float)((double)(read.count - home_count) / counts_per_rev);
+    cur_velocity = estimator.update(read.count, read.edge_us, read.now_us) / counts_per_rev;
 }
 
 void EncoderSensor::clear_position()
 {
-    pcnt_unit_clear_count(pcnt_unit);
+    set_home(get_count());
 }
 
 /* ======================================================= */
@@ -214,10 +286,40 @@ Motor::Motor(const char *name)
 {
     state = MOT_STATE_IDLE;
     max_speed = 100;
-    stall_cnt = 0;
     this->name = name;
 }
 
+void Motor::set_travel_limits(float min, float max)
+{
+    float scale = gearRatio / 360.0f;
+    detector.set_limits(min * scale, max * scale, LIMIT_MARGIN_DEG * scale);
+}
+
+/*
+ * The average winding voltage is duty * V. With current sense the power is
+ * taken from the measured current, otherwise the current follows from the
+ * voltage left after the back EMF, which the stall model gives as speed / k.
+ */
+float Motor::estimate_power(float speed) const
+{
+    float volt = applied_duty * supply_voltage;
+    if (!isnan(current)) {
+        return fabsf(volt * current);
+    }
+    if (model == nullptr || model->k <= 0 || winding_ohm <= 0) {
+        return 0.0f;
+    }
+    float amp = (volt - speed / model->k) / winding_ohm;
+    // a braking motor feeds the bridge, not the supply
+    return fmaxf(0.0f, volt * amp);
+}
+
+void Motor::drive(float output)
+{
+    pwm->set_pwm(output);
+    applied_duty = output > 1000 ? 1.0f : output < -1000 ? -1.0f : output / 1000.0f;
+}
+
 void Motor::attach_sensor(MotorSensor *sensor)
 {
     if (sensor) {
@@ -241,10 +343,44 @@ void Motor::enable(bool is_enable)
     state = is_enable ? MOT_STATE_RUNNING : MOT_STATE_IDLE;
 }
 
+void Motor::get_state(motor_state_t *state) const
+{
+    state->target_position = target_position;
+    state->max_speed = max_speed;
+    state->position_iout = positionPID.iout;
+    state->velocity_iout = velocityPID.iout;
+    state->output = output;
+    state->applied_duty = applied_duty;
+    state->power = power;
+    state->supply_voltage = supply_voltage;
+    state->current = current;
+    detector.get_state(&state->stall);
+    state->state = (uint8_t)this->state;
+    state->fault = (uint8_t)fault;
+}
+
+void Motor::set_state(const motor_state_t &state)
+{
+    target_position = state.target_position;
+    max_speed = state.max_speed;
+    positionPID.iout = state.position_iout;
+    velocityPID.iout = state.velocity_iout;
+    output = state.output;
+    applied_duty = state.applied_duty;
+    power = state.power;
+    supply_voltage = state.supply_voltage;
+    current = state.current;
+    detector.set_state(state.stall);
+    this->state = (mot_state_t)state.state;
+    fault = (stall_event_t)state.fault;
+}
+
 void Motor::run(float dt)
 {
     if (state == MOT_STATE_IDLE) {
-        pwm->set_pwm(0);
+        drive(0);
+        this->output = 0;
+        this->power = 0;
         return;
     }
 
@@ -252,57 +388,66 @@ void Motor::run(float dt)
     if (dt < 0.001f) {
         return;
     }
+    LOOP_BENCH_BEGIN(bench_start);
 
     sensor->update_velocity(dt);
     float current_speed = sensor->get_velocity();
     float revolutions = sensor->get_position();
+    this->power = estimate_power(current_speed);
     float output;
     // Always calculate PID even in WARNING state
     if(name[0] == 'p') {
+        LOOP_BENCH_BEGIN(pid_start);
         output = pid_calculate(&velocityPID, revolutions, target_position, dt);
+        LOOP_BENCH_END(LOOP_PID, pid_start);
     } else {
+        LOOP_BENCH_BEGIN(position_start);
         float _speed = pid_calculate(&positionPID, revolutions, target_position, dt);
+        LOOP_BENCH_END(LOOP_PID, position_start);
         abs_limit(&_speed, max_speed, -max_speed);
+        LOOP_BENCH_BEGIN(velocity_start);
         output = pid_calculate(&velocityPID, current_speed, _speed, dt);
+        LOOP_BENCH_END(LOOP_PID, velocity_start);
     }
+    this->output = output;
     // printf("pos:%.3f,%.3f,%.2f,%.2f,%.2f,%d\n", revolutions, target_position, current_speed, output, max_speed, state);
     // ESP_LOGI(TAG, "id:%d, pos:%.3f, tar:%.3f spd:%.2f out:%.2f state:%d",
     //  revolutions, target_position, current_speed, output, state);
 
     // Check state and handle accordingly
     switch (state) {
-    case MOT_STATE_RUNNING:
-        // Check for stall condition with hysteresis
-        if (fabs(current_speed) < STALL_SPEED_THRESHOLD &&
-                fabs(output) >= velocityPID.param->max_out * 0.95f) {
-            if ((++ stall_cnt) > 10) {
-                stall_cnt = 0;
-                state = MOT_STATE_WARNING;
-                led_start_state(LED_RED, BLINK_DOUBLE);
-                pwm->set_pwm(0);
-                ESP_LOGW(TAG, "Motor%s stalled! pos:%.2f spd:%.2f out:%.2f",
-                         name, revolutions, current_speed, output);
-            } else {
-                pwm->set_pwm(output);
-            }
-        } else {
-            stall_cnt = 0;
-            pwm->set_pwm(output);
+    case MOT_STATE_RUNNING: {
+        // compare the motion with what the duty of the last period should give
+        stall_event_t event = detector.update(applied_duty, supply_voltage, current_speed, revolutions, dt, current);
+        if (event == STALL_NONE) {
+            drive(output);
+            break;
         }
-        break;
+        fault = event;
+        // a broken encoder makes the loop unsafe, it stays off until reboot
+        state = event == STALL_ENCODER_FAULT ? MOT_STATE_FAULT : MOT_STATE_WARNING;
+        led_start_state(LED_RED, BLINK_DOUBLE);
+        recorder_trigger();
+        drive(0);
+        ESP_LOGW(TAG, "Motor%s %s! pos:%.2f spd:%.2f expected:%.2f out:%.2f",
+                 name, StallDetector::get_description(event), revolutions, current_speed,
+                 detector.get_expected(), output);
+    } break;
 
     case MOT_STATE_WARNING:
         // Add hysteresis for recovery to prevent oscillation
         if (fabs(output) < velocityPID.param->max_out * RECOVERY_OUTPUT_RATIO) {
             state = MOT_STATE_RUNNING;
             led_stop_state(LED_RED, BLINK_DOUBLE);
-            pwm->set_pwm(output);
-            ESP_LOGI(TAG, "Motor%s recovered from stall", name);
+            detector.reset();
+            drive(output);
+            ESP_LOGI(TAG, "Motor%s recovered from %s", name, StallDetector::get_description(fault));
         }
         break;
 
     default:
-        pwm->set_pwm(0);
+        drive(0);
         break;
     }
+    LOOP_BENCH_END(LOOP_MOTOR_RUN, bench_start);
 }
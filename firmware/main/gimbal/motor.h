@@ -7,15 +7,20 @@
 */
 #pragma once
 #include <stdint.h>
+#include "freertos/FreeRTOS.h"
 #include "driver/pulse_cnt.h"
 #include "pid.h"
+#include "velocity_estimator.h"
+#include "stall_detector.h"
 #include "imu_base.h"
 #include "setting.h"
+#include "recorder.h"
 
 #define MOT_STATE_LIST \
 X(MOT_STATE_IDLE, "Idle") \
 X(MOT_STATE_RUNNING, "Running") \
 X(MOT_STATE_WARNING, "Warning") \
+X(MOT_STATE_FAULT, "Fault") \
 
 typedef enum {
 #define X(name, desc) name,
@@ -25,6 +30,18 @@ typedef enum {
 } mot_state_t;
 
 
+// what run() carries from one period to the next, for the recorder keyframes
+typedef struct {
+    float target_position;      // sensor units
+    float max_speed;
+    float position_iout, velocity_iout;
+    float output, applied_duty, power;
+    float supply_voltage, current;
+    struct stall_state stall;
+    uint8_t state, fault;
+} motor_state_t;
+
+
 class PWM {
 public:
     PWM() = default;
@@ -87,11 +104,40 @@ public:
     void clear_position() override;
     void update_velocity(float dt) override;
 
+    // absolute encoder count, never wraps
+    int64_t get_count();
+    // restore the absolute count, e.g. from a checkpoint after a reboot
+    void set_count(int64_t count);
+
+    // count at position zero, clear_position() moves it to the current count
+    int64_t get_home() const
+    {
+        return home_count;
+    }
+    void set_home(int64_t count);
+    // the edge history behind the velocity, for the recorder keyframes
+    const VelocityEstimator &get_estimator() const
+    {
+        return estimator;
+    }
+    void set_estimator(const VelocityEstimator &estimator)
+    {
+        this->estimator = estimator;
+    }
+
 private:
+    static void edge_isr(void *arg);
+    static bool overflow_cb(pcnt_unit_handle_t unit, const pcnt_watch_event_data_t *edata, void *user_ctx);
+
     pcnt_unit_handle_t pcnt_unit;
-    float last_revolutions = 0.0f;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    int64_t overflow = 0;               // counts accumulated by the watch point callback
+    int64_t home_count = 0;
     float cur_velocity = 0.0f;
     float current_revolutions = 0.0f;
+    VelocityEstimator estimator;
+    volatile int64_t edge_us = 0;       // time of the latest encoder edge
+    volatile uint32_t edge_seq = 0;     // incremented on every edge
 };
 
 class IMUMotSensor : public MotorSensor {
@@ -127,8 +173,54 @@ public:
 
     void attach_sensor(MotorSensor *sensor);
     void attach_driver(PWM *pwm);
+    void set_stall_param(const struct stall_param *param)
+    {
+        this->model = param;
+        this->detector.init(param);
+    }
+    // winding resistance in ohm, estimates the power without current sense
+    void set_winding_resistance(float ohm)
+    {
+        this->winding_ohm = ohm;
+    }
+    // electrical power drawn during the last period, W
+    float get_power() const
+    {
+        return this->power;
+    }
+    // duty on the motor, -1 to 1
+    float get_duty() const
+    {
+        return this->applied_duty;
+    }
+    void set_supply_voltage(float voltage)
+    {
+        this->supply_voltage = voltage;
+    }
+    // measured motor current in A, NAN without current sense
+    void set_current(float current)
+    {
+        this->current = current;
+    }
+    float get_current() const
+    {
+        return this->current;
+    }
+    // end stops in degrees, a stall near them is reported as end stop
+    void set_travel_limits(float min, float max);
+    // reason of the last WARNING or FAULT state
+    stall_event_t get_fault() const
+    {
+        return this->fault;
+    }
+    const char *get_fault_description() const
+    {
+        return StallDetector::get_description(this->fault);
+    }
 
     void run(float dt); // 运行电机，周期调用
+    void get_state(motor_state_t *state) const;
+    void set_state(const motor_state_t &state);
     void enable(bool is_enable);
     void set_position(float position)
     {
@@ -139,6 +231,10 @@ public:
     {
         return this->sensor->get_position() * 360.0f / gearRatio;
     }
+    float get_target_position() const
+    {
+        return this->target_position * 360.0f / gearRatio;
+    }
     void set_max_speed(float max_speed)
     {
         this->max_speed = max_speed;
@@ -160,21 +256,47 @@ public:
     {
         return this->sensor->get_velocity();
     }
+    // last controller output, -1000 to 1000
+    float get_output()
+    {
+        return this->output;
+    }
+    float get_gear_ratio() const
+    {
+        return this->gearRatio;
+    }
     void clear_position()
     {
         this->sensor->clear_position();
     }
+    // hold the current position and drop the wound up integrators
+    void hold()
+    {
+        this->target_position = this->sensor->get_position();
+        this->positionPID.iout = 0;
+        this->velocityPID.iout = 0;
+    }
 
     struct pid positionPID;
     struct pid velocityPID;
 private:
     static const char *motStateDescriptions[];
+    void drive(float output);
+    float estimate_power(float speed) const;
     const char *name;
     MotorSensor *sensor;
     PWM *pwm;
     float target_speed;
     float target_position;
-    uint32_t stall_cnt = 0;
+    float output = 0.0f;
+    float applied_duty = 0.0f;  // duty on the motor since the last run(), -1 to 1
+    float supply_voltage = 12.0f;
+    float current = NAN;
+    float winding_ohm = 0.0f;
+    float power = 0.0f;
+    const struct stall_param *model = nullptr;
+    StallDetector detector;
+    stall_event_t fault = STALL_NONE;
     mot_state_t state; // 电机状态
     float max_speed; // 最大速度
     float gearRatio = 1.0f; // 齿轮比, default 1
@@ -0,0 +1,470 @@
+#include <math.h>
+#include <string.h>
+#include "mount_model.h"
+
+#define MOUNT_MIN_SAMPLES       12
+#define MOUNT_MAX_ITERATIONS    50
+#define MOUNT_MAX_ANGLE         20.0    // a fit beyond it is not a misalignment
+#define MOUNT_MAX_SCALE         0.1
+
+static const double RAD = M_PI / 180.0;
+
+enum {
+    P_AZ_OFFSET,
+    P_PITCH_OFFSET,
+    P_TILT_N,
+    P_TILT_E,
+    P_NON_PERP,
+    P_YAW_SCALE,
+};
+
+// finite difference steps for the jacobian
+static const double STEP[MOUNT_PARAM_COUNT] = {1e-4, 1e-4, 1e-4, 1e-4, 1e-4, 1e-6};
+
+static double wrap180(double deg)
+{
+    deg = fmod(deg + 180.0, 360.0);
+    return deg < 0 ? deg + 180.0 : deg - 180.0;
+}
+
+static void to_array(const struct mount_param *m, double p[MOUNT_PARAM_COUNT])
+{
+    p[P_AZ_OFFSET] = m->az_offset;
+    p[P_PITCH_OFFSET] = m->pitch_offset;
+    p[P_TILT_N] = m->tilt_n;
+    p[P_TILT_E] = m->tilt_e;
+    p[P_NON_PERP] = m->non_perp;
+    p[P_YAW_SCALE] = m->yaw_scale;
+}
+
+/*
+ * Panel normal for the nominal axes, as zenith angle and azimuth. The yaw
+ * keeps the turn of the input, the result is not wrapped to 0-360.
+ */
+static void point(const double p[MOUNT_PARAM_COUNT], double home, double pitch, double yaw,
+                  double *zenith, double *azimuth)
+{
+    double psi = (home + (yaw - home) * (1.0 + p[P_YAW_SCALE]) + p[P_AZ_OFFSET]) * RAD;
+    double theta = (pitch + p[P_PITCH_OFFSET]) * RAD;
+    double c = p[P_NON_PERP] * RAD;
+
+    // in the frame of the yaw axis, x right, y forward, z up, the pitch axis
+    // (cos c, 0, sin c) turns the normal forward from z by theta
+    double cc = cos(c), sc = sin(c), ct = cos(theta), st = sin(theta);
+    double x = cc * sc * (1 - ct);
+    double y = cc * st;
+    double z = ct + sc * sc * (1 - ct);
+
+    // yaw, clockwise from north
+    double e = x * cos(psi) + y * sin(psi);
+    double n = -x * sin(psi) + y * cos(psi);
+
+    // base leaning north, then east
+    double tn = p[P_TILT_N] * RAD, te = p[P_TILT_E] * RAD;
+    double n1 = n * cos(tn) + z * sin(tn);
+    double u1 = -n * sin(tn) + z * cos(tn);
+    double e2 = e * cos(te) + u1 * sin(te);
+    double u2 = -e * sin(te) + u1 * cos(te);
+
+    double horizontal = sqrt(e2 * e2 + n1 * n1);
+    *zenith = atan2(horizontal, u2) / RAD;
+    *azimuth = horizontal > 1e-9 ? yaw + wrap180(atan2(e2, n1) / RAD - yaw) : yaw;
+}
+
+// pointing error towards aim, zenith angle and across
+static void residual(const double p[MOUNT_PARAM_COUNT], double home, const mount_sample &s, double r[2])
+{
+    double zenith, azimuth;
+    point(p, home, s.axes.pitch, s.axes.yaw, &zenith, &azimuth);
+    r[0] = zenith - s.sun.pitch;
+    r[1] = wrap180(azimuth - s.sun.yaw) * sin(s.sun.pitch * RAD);
+}
+
+// gaussian elimination with partial pivoting, a and b are destroyed
+static bool solve_linear(double a[MOUNT_PARAM_COUNT][MOUNT_PARAM_COUNT], double b[MOUNT_PARAM_COUNT],
+                         double x[MOUNT_PARAM_COUNT])
+{
+    const int n = MOUNT_PARAM_COUNT;
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < n; row++) {
+            if (fabs(a[row][col]) > fabs(a[pivot][col])) {
+                pivot = row;
+            }
+        }
+        if (fabs(a[pivot][col]) < 1e-30) {
+            return false;
+        }
+        if (pivot != col) {
+            for (int k = 0; k < n; k++) {
+                double t = a[col][k];
+                a[col][k] = a[pivot][k];
+                a[pivot][k] = t;
+            }
+            double t = b[col];
+            b[col] = b[pivot];
+            b[pivot] = t;
+        }
+        for (int row = col + 1; row < n; row++) {
+            double f = a[row][col] / a[col][col];
+            for (int k = col; k < n; k++) {
+                a[row][k] -= f * a[col][k];
+            }
+            b[row] -= f * b[col];
+        }
+    }
+    for (int row = n - 1; row >= 0; row--) {
+        double sum = b[row];
+        for (int k = row + 1; k < n; k++) {
+            sum -= a[row][k] * x[k];
+        }
+        x[row] = sum / a[row][row];
+    }
+    return true;
+}
+
+aim_t MountModel::pointing(const double p[MOUNT_PARAM_COUNT], float home, const aim_t &axes)
+{
+    double zenith, azimuth;
+    point(p, home, axes.pitch, axes.yaw, &zenith, &azimuth);
+    return {(float)zenith, (float)azimuth};
+}
+
+aim_t MountModel::pointing(const aim_t &axes) const
+{
+    if (!enabled()) {
+        return axes;
+    }
+    double p[MOUNT_PARAM_COUNT];
+    to_array(param, p);
+    return pointing(p, home, axes);
+}
+
+aim_t MountModel::axes_for(const aim_t &aim) const
+{
+    if (!enabled()) {
+        return aim;
+    }
+    double p[MOUNT_PARAM_COUNT];
+    to_array(param, p);
+
+    // the aim in the frame of the base, point() backwards
+    double zenith = aim.pitch * RAD, azimuth = aim.yaw * RAD;
+    double e2 = sin(zenith) * sin(azimuth), n1 = sin(zenith) * cos(azimuth), u2 = cos(zenith);
+    double tn = p[P_TILT_N] * RAD, te = p[P_TILT_E] * RAD;
+    double e = e2 * cos(te) - u2 * sin(te);
+    double u1 = e2 * sin(te) + u2 * cos(te);
+    double n = n1 * cos(tn) - u1 * sin(tn);
+    double z = n1 * sin(tn) + u1 * cos(tn);
+
+    // the pitch fixes the height of the normal over the base
+    double c = p[P_NON_PERP] * RAD;
+    double cc = cos(c), sc = sin(c);
+    double ct = fmin(fmax((z - sc * sc) / (cc * cc), -1.0), 1.0);
+    double theta = acos(ct);
+    double pitch = theta / RAD - p[P_PITCH_OFFSET];
+
+    // and the yaw turns it to the azimuth; at the zenith any yaw will do
+    double x = cc * sc * (1 - ct), y = cc * sin(theta);
+    if (sqrt(e * e + n * n) < 1e-9 || sqrt(x * x + y * y) < 1e-9) {
+        return {(float)pitch, aim.yaw};
+    }
+    double psi = (atan2(e, n) - atan2(x, y)) / RAD - p[P_AZ_OFFSET];
+    psi = aim.yaw + wrap180(psi - aim.yaw);
+    double yaw = home + (psi - home) / (1.0 + p[P_YAW_SCALE]);
+    return {(float)pitch, (float)yaw};
+}
+
+void MountCalibration::add(const mount_sample &sample)
+{
+    samples[head] = sample;
+    head = (head + 1) % MOUNT_MAX_SAMPLES;
+    if (count < MOUNT_MAX_SAMPLES) {
+        count++;
+    }
+}
+
+/*
+ * Normal equations of the linearized problem, accumulated sample by sample
+ * so no jacobian has to be kept. Returns the sum of squared residuals.
+ */
+static double normal_equations(const mount_sample *samples, int count, double home,
+                               const double p[MOUNT_PARAM_COUNT],
+                               double jtj[MOUNT_PARAM_COUNT][MOUNT_PARAM_COUNT], double jtr[MOUNT_PARAM_COUNT])
+{
+    memset(jtj, 0, sizeof(double) * MOUNT_PARAM_COUNT * MOUNT_PARAM_COUNT);
+    memset(jtr, 0, sizeof(double) * MOUNT_PARAM_COUNT);
+    double cost = 0;
+    for (int i = 0; i < count; i++) {
+        double r[2], j[MOUNT_PARAM_COUNT][2];
+        residual(p, home, samples[i], r);
+        for (int k = 0; k < MOUNT_PARAM_COUNT; k++) {
+            double q[MOUNT_PARAM_COUNT], rk[2];
+            memcpy(q, p, sizeof(q));
+            q[k] += STEP[k];
+            residual(q, home, samples[i], rk);
+            j[k][0] = (rk[0] - r[0]) / STEP[k];
+            j[k][1] = (rk[1] - r[1]) / STEP[k];
+        }
+        for (int a = 0; a < MOUNT_PARAM_COUNT; a++) {
+            for (int b = 0; b < MOUNT_PARAM_COUNT; b++) {
+                jtj[a][b] += j[a][0] * j[b][0] + j[a][1] * j[b][1];
+            }
+            jtr[a] += j[a][0] * r[0] + j[a][1] * r[1];
+        }
+        cost += r[0] * r[0] + r[1] * r[1];
+    }
+    return cost;
+}
+
+static double cost_of(const mount_sample *samples, int count, double home, const double p[MOUNT_PARAM_COUNT])
+{
+    double cost = 0;
+    for (int i = 0; i < count; i++) {
+        double r[2];
+        residual(p, home, samples[i], r);
+        cost += r[0] * r[0] + r[1] * r[1];
+    }
+    return cost;
+}
+
+bool MountCalibration::solve(float home, struct mount_param *result, struct mount_fit *fit) const
+{
+    memset(fit, 0, sizeof(*fit));
+    fit->samples = count;
+    if (count < MOUNT_MIN_SAMPLES) {
+        return false;
+    }
+
+    // levenberg-marquardt from the nominal mount
+    double p[MOUNT_PARAM_COUNT] = {0};
+    double jtj[MOUNT_PARAM_COUNT][MOUNT_PARAM_COUNT], jtr[MOUNT_PARAM_COUNT];
+    double cost = normal_equations(samples, count, home, p, jtj, jtr);
+    fit->rms_before = sqrt(cost / count);
+    double lambda = 1e-3;
+    int iter;
+    for (iter = 0; iter < MOUNT_MAX_ITERATIONS; iter++) {
+        bool accepted = false;
+        double step = 0;
+        while (lambda < 1e9) {
+            double a[MOUNT_PARAM_COUNT][MOUNT_PARAM_COUNT], b[MOUNT_PARAM_COUNT], d[MOUNT_PARAM_COUNT];
+            for (int i = 0; i < MOUNT_PARAM_COUNT; i++) {
+                for (int k = 0; k < MOUNT_PARAM_COUNT; k++) {
+                    a[i][k] = jtj[i][k];
+                }
+                a[i][i] += lambda * jtj[i][i] + 1e-12;
+                b[i] = -jtr[i];
+            }
+            if (!solve_linear(a, b, d)) {
+                lambda *= 10;
+                continue;
+            }
+            double q[MOUNT_PARAM_COUNT];
+            step = 0;
+            for (int i = 0; i < MOUNT_PARAM_COUNT; i++) {
+                q[i] = p[i] + d[i];
+                step = fmax(step, fabs(d[i] / STEP[i]));
+            }
+            double c = cost_of(samples, count, home, q);
+            if (c < cost) {
+                memcpy(p, q, sizeof(p));
+                lambda = fmax(lambda / 10, 1e-9);
+                accepted = true;
+                break;
+            }
+            lambda *= 10;
+        }
+        if (!accepted) {
+            break;
+        }
+        cost = normal_equations(samples, count, home, p, jtj, jtr);
+        // steps below a tenth of the difference step are noise
+        if (step < 0.1) {
+            iter++;
+            break;
+        }
+    }
+    fit->iterations = iter;
+    fit->rms_after = sqrt(cost / count);
+
+    // covariance, the residual variance times the inverse of jtj
+    int dof = 2 * count - MOUNT_PARAM_COUNT;
+    double variance = cost / (dof > 0 ? dof : 1);
+    for (int k = 0; k < MOUNT_PARAM_COUNT; k++) {
+        double a[MOUNT_PARAM_COUNT][MOUNT_PARAM_COUNT], b[MOUNT_PARAM_COUNT] = {0}, x[MOUNT_PARAM_COUNT];
+        memcpy(a, jtj, sizeof(a));
+        b[k] = 1;
+        if (!solve_linear(a, b, x) || !(x[k] >= 0)) {
+            return false;
+        }
+        fit->sigma[k] = sqrt(variance * x[k]);
+    }
+
+    for (int k = 0; k < MOUNT_PARAM_COUNT; k++) {
+        double limit = k == P_YAW_SCALE ? MOUNT_MAX_SCALE : MOUNT_MAX_ANGLE;
+        if (!isfinite(p[k]) || fabs(p[k]) > limit) {
+            return false;
+        }
+    }
+    result->az_offset = p[P_AZ_OFFSET];
+    result->pitch_offset = p[P_PITCH_OFFSET];
+    result->tilt_n = p[P_TILT_N];
+    result->tilt_e = p[P_TILT_E];
+    result->non_perp = p[P_NON_PERP];
+    result->yaw_scale = p[P_YAW_SCALE];
+    return true;
+}
+
+// fit synthetic observations on linux
+#if defined(__linux__) && !defined(MOUNT_MODEL_NO_MAIN)
+
+#include <stdio.h>
+
+/*
+ * A mount with known errors is pointed at the sun by its own model, the
+ * nominal axes are recorded with noise as the observations. The fit has to
+ * find the errors back and, applied on another day, point within
+ * SIM_MAX_ERROR_DEG. The morning only day is reported for comparison, half
+ * a day does not separate the azimuth offset from the yaw scale well.
+ */
+
+#define SIM_NOISE_DEG       0.02
+#define SIM_MAX_ERROR_DEG   0.1
+#define SIM_HOME            150.0f
+
+static uint32_t s_rand = 2024;
+
+static double sim_noise()
+{
+    s_rand = s_rand * 1664525u + 1013904223u;
+    return (s_rand >> 8) / 16777216.0 - 0.5;
+}
+
+static aim_t sun_at(double hours, double latitude, double declination)
+{
+    double lat = latitude * RAD, d = declination * RAD;
+    double h = (hours - 12.0) * 15.0 * RAD;
+    double el = asin(sin(lat) * sin(d) + cos(lat) * cos(d) * cos(h));
+    double az = atan2(sin(h), cos(h) * sin(lat) - tan(d) * cos(lat)) / RAD + 180.0;
+    return {(float)(90.0 - el / RAD), (float)az};
+}
+
+static double angle_between(const aim_t &a, const aim_t &b)
+{
+    double ax = sin(a.pitch * RAD) * cos(a.yaw * RAD), ay = sin(a.pitch * RAD) * sin(a.yaw * RAD), az = cos(a.pitch * RAD);
+    double bx = sin(b.pitch * RAD) * cos(b.yaw * RAD), by = sin(b.pitch * RAD) * sin(b.yaw * RAD), bz = cos(b.pitch * RAD);
+    double cx = ay * bz - az * by, cy = az * bx - ax * bz, cz = ax * by - ay * bx;
+    return atan2(sqrt(cx * cx + cy * cy + cz * cz), ax * bx + ay * by + az * bz) / RAD;
+}
+
+struct sim_day {
+    const char *name;
+    double latitude;
+    double declination;
+    double from_h, to_h;
+    bool checked;
+};
+
+// worst pointing error over a day with elevation above 10 degrees
+static double day_error(const MountModel &truth, const MountModel &model, double latitude, double declination)
+{
+    double worst = 0;
+    for (double hours = 4; hours <= 20; hours += 0.25) {
+        aim_t sun = sun_at(hours, latitude, declination);
+        if (sun.pitch > 80) {
+            continue;
+        }
+        worst = fmax(worst, angle_between(truth.pointing(model.axes_for(sun)), sun));
+    }
+    return worst;
+}
+
+int main()
+{
+    int failures = 0;
+    const mount_param truth_param = {3.0f, -1.2f, 1.5f, -0.8f, 0.5f, 0.004f, 1};
+    MountModel truth;
+    truth.init(&truth_param);
+    truth.set_home(SIM_HOME);
+
+    // the inverse has to hit the aim over the whole sky
+    double worst_inverse = 0;
+    for (float pitch = 1; pitch <= 89; pitch += 4) {
+        for (float yaw = 0; yaw < 360; yaw += 15) {
+            aim_t aim = {pitch, yaw};
+            worst_inverse = fmax(worst_inverse, angle_between(truth.pointing(truth.axes_for(aim)), aim));
+        }
+    }
+    printf("  inverse: worst error %.6f deg\n", worst_inverse);
+    if (worst_inverse > 1e-3) {
+        printf("    inverse does not converge\n");
+        failures++;
+    }
+
+    const sim_day days[] = {
+        {"35N summer", 35, 20, 0, 24, true},
+        {"35N equinox", 35, 0, 0, 24, true},
+        {"50N winter", 50, -20, 0, 24, true},
+        {"35N morning", 35, 20, 0, 11, false},
+    };
+    printf("  %-12s %4s %4s %8s %8s %7s %7s %7s %7s %7s %8s %9s\n", "day", "n", "iter", "rms pre", "rms post",
+           "az", "pitch", "tilt n", "tilt e", "perp", "scale", "worst");
+    for (const sim_day &day : days) {
+        MountCalibration cal;
+        for (double hours = day.from_h; hours < day.to_h; hours += 1.0 / 6) {
+            aim_t sun = sun_at(hours, day.latitude, day.declination);
+            if (sun.pitch > 80) {
+                continue;
+            }
+            aim_t axes = truth.axes_for(sun);
+            axes.pitch += SIM_NOISE_DEG * 2 * sim_noise();
+            axes.yaw += SIM_NOISE_DEG * 2 * sim_noise() / sin(sun.pitch * RAD);
+            cal.add({axes, sun});
+        }
+        mount_param fitted = {0, 0, 0, 0, 0, 0, 1};
+        mount_fit fit;
+        bool ok = cal.solve(SIM_HOME, &fitted, &fit);
+        MountModel model;
+        model.init(&fitted);
+        model.set_home(SIM_HOME);
+        // applied on a day other than the one it was fitted on
+        double worst = day_error(truth, model, day.latitude, day.declination > 0 ? -day.declination : 20);
+        printf("  %-12s %4d %4d %8.3f %8.3f %7.3f %7.3f %7.3f %7.3f %7.3f %8.5f %9.3f\n", day.name, fit.samples,
+               fit.iterations, fit.rms_before, fit.rms_after, fitted.az_offset, fitted.pitch_offset, fitted.tilt_n,
+               fitted.tilt_e, fitted.non_perp, fitted.yaw_scale, worst);
+        printf("  %-12s %4s %4s %8s %8s %7.3f %7.3f %7.3f %7.3f %7.3f %8.5f\n", "  sigma", "", "", "", "",
+               fit.sigma[0], fit.sigma[1], fit.sigma[2], fit.sigma[3], fit.sigma[4], fit.sigma[5]);
+        if (!day.checked) {
+            continue;
+        }
+        if (!ok) {
+            printf("    fit failed\n");
+            failures++;
+            continue;
+        }
+        if (fit.rms_after > SIM_NOISE_DEG * 2) {
+            printf("    residual above the noise\n");
+            failures++;
+        }
+        if (worst > SIM_MAX_ERROR_DEG) {
+            printf("    pointing error after calibration too large\n");
+            failures++;
+        }
+    }
+
+    MountCalibration few;
+    mount_param unused;
+    mount_fit fit;
+    few.add({{45, 180}, {45, 180}});
+    if (few.solve(SIM_HOME, &unused, &fit)) {
+        printf("    solved from a single observation\n");
+        failures++;
+    }
+    printf("  truth: az %.3f pitch %.3f tilt n %.3f tilt e %.3f perp %.3f scale %.5f\n", truth_param.az_offset,
+           truth_param.pitch_offset, truth_param.tilt_n, truth_param.tilt_e, truth_param.non_perp,
+           truth_param.yaw_scale);
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
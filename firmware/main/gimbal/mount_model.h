@@ -0,0 +1,125 @@
+/*
+   Mount model and its calibration from solar observations.
+
+   The axes are driven as if the mount were perfect: the yaw axis vertical,
+   yaw_offset the only azimuth error, the pitch axis square to the yaw axis
+   and the yaw gear exactly 3029:1. A real mount is off in all of that. The
+   model maps the nominal aim of the axes (what setTarget() would have
+   commanded for it) to where the panel normal really points:
+   - az_offset, what is left of yaw_offset and the magnetic declination,
+   - pitch_offset, the zero of the pitch reading,
+   - tilt_n, tilt_e, the base leaning north / east,
+   - non_perp, the pitch axis deviating from square to the yaw axis,
+   - yaw_scale, the relative error of the yaw gear ratio, around home.
+   All angles are in degrees.
+
+   Calibration pairs the nominal aim of the axes at which the sun was seen
+   centered, by the quadrant sun sensor or by hand, with the ephemeris. A
+   Levenberg-Marquardt fit of the six parameters to a day of such pairs
+   gives the model, which setTarget() then inverts for every aim.
+
+   Neither class depends on ESP-IDF, see the __linux__ section of
+   mount_model.cpp for a test against synthetic observations.
+*/
+#pragma once
+
+#include <stdint.h>
+#include "tracking_policy.h"
+
+#define MOUNT_MAX_SAMPLES   192
+#define MOUNT_PARAM_COUNT   6
+
+struct mount_param {
+    float az_offset;
+    float pitch_offset;
+    float tilt_n;
+    float tilt_e;
+    float non_perp;
+    float yaw_scale;        // real / nominal yaw angle - 1
+    uint8_t enable;
+};
+
+// nominal aim of the axes and the true aim they pointed at
+struct mount_sample {
+    aim_t axes;
+    aim_t sun;
+};
+
+struct mount_fit {
+    int samples;
+    int iterations;
+    float rms_before;       // degrees, pointing error of the nominal mount
+    float rms_after;
+    float sigma[MOUNT_PARAM_COUNT];  // standard error of each parameter
+};
+
+class MountModel {
+public:
+    MountModel() = default;
+
+    void init(const struct mount_param *param)
+    {
+        this->param = param;
+    }
+
+    /**
+     * @brief World yaw of the yaw axis at its home position, 180 - yaw_offset
+     */
+    void set_home(float yaw)
+    {
+        home = yaw;
+    }
+
+    /**
+     * @brief Where the panel normal points for a nominal aim of the axes
+     */
+    aim_t pointing(const aim_t &axes) const;
+
+    /**
+     * @brief Nominal aim of the axes that points the panel normal at aim
+     */
+    aim_t axes_for(const aim_t &aim) const;
+
+    bool enabled() const
+    {
+        return param != nullptr && param->enable;
+    }
+
+    static aim_t pointing(const double p[MOUNT_PARAM_COUNT], float home, const aim_t &axes);
+
+private:
+    const struct mount_param *param = nullptr;
+    float home = 180.0f;
+};
+
+class MountCalibration {
+public:
+    MountCalibration() = default;
+
+    /**
+     * @brief Record an observation, the oldest one is dropped when full
+     */
+    void add(const mount_sample &sample);
+    void clear()
+    {
+        count = 0;
+        head = 0;
+    }
+    int get_count() const
+    {
+        return count;
+    }
+
+    /**
+     * @brief Fit the model to the recorded observations
+     * @param home world yaw of the yaw axis home, as for MountModel::set_home()
+     * @param result parameters, enable is left as it is
+     * @return false with too few observations or if the fit failed
+     */
+    bool solve(float home, struct mount_param *result, struct mount_fit *fit) const;
+
+private:
+    mount_sample samples[MOUNT_MAX_SAMPLES];
+    int count = 0;
+    int head = 0;       // next slot to write
+};
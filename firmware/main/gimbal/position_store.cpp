@@ -0,0 +1,113 @@
+#include <stddef.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_rom_crc.h"
+#include "helper.h"
+#include "position_store.h"
+
+static const char *TAG = "position";
+
+#define POSITION_MAGIC          0x504f5331  // "POS1"
+#define POSITION_NAMESPACE      "gimbal"
+#define POSITION_TRAVEL_KEY     "travel"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    gimbal_position_t pos;
+    uint32_t crc;
+} checkpoint_t;
+
+typedef struct {
+    float yaw_min;
+    float yaw_max;
+} travel_t;
+
+// Two slots written alternately, a reset in the middle of a write leaves the
+// other one intact.
+static RTC_NOINIT_ATTR checkpoint_t s_checkpoint[2];
+static uint32_t s_seq = 0;
+
+static uint32_t checkpoint_crc(const checkpoint_t *cp)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)cp, offsetof(checkpoint_t, crc));
+}
+
+static bool checkpoint_valid(const checkpoint_t *cp)
+{
+    return cp->magic == POSITION_MAGIC && cp->crc == checkpoint_crc(cp);
+}
+
+void position_checkpoint_save(const gimbal_position_t *pos)
+{
+    checkpoint_t *cp = &s_checkpoint[++s_seq & 1];
+    cp->magic = POSITION_MAGIC;
+    cp->seq = s_seq;
+    cp->pos = *pos;
+    cp->crc = checkpoint_crc(cp);
+}
+
+void position_checkpoint_invalidate(void)
+{
+    memset(s_checkpoint, 0, sizeof(s_checkpoint));
+}
+
+bool position_checkpoint_restore(gimbal_position_t *pos)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool kept;
+    switch (reason) {
+    case ESP_RST_SW:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_DEEPSLEEP:
+        kept = true;
+        break;
+    default: // power on, brownout, external reset: the axis may have moved
+        kept = false;
+        break;
+    }
+
+    const checkpoint_t *best = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (checkpoint_valid(&s_checkpoint[i]) && (!best || (int32_t)(s_checkpoint[i].seq - best->seq) > 0)) {
+            best = &s_checkpoint[i];
+        }
+    }
+
+    if (!kept || !best) {
+        ESP_LOGI(TAG, "no usable checkpoint, reset reason %d", reason);
+        position_checkpoint_invalidate();
+        return false;
+    }
+    *pos = best->pos;
+    s_seq = best->seq;
+    ESP_LOGI(TAG, "restored yaw count %lld home %lld, limits %.2f..%.2f",
+             (long long)pos->yaw_count, (long long)pos->yaw_home, pos->yaw_min, pos->yaw_max);
+    return true;
+}
+
+esp_err_t position_travel_save(float yaw_min, float yaw_max)
+{
+    travel_t travel = {yaw_min, yaw_max};
+    return iot_param_save(POSITION_NAMESPACE, POSITION_TRAVEL_KEY, &travel, sizeof(travel));
+}
+
+esp_err_t position_travel_load(float *yaw_min, float *yaw_max)
+{
+    travel_t travel;
+    esp_err_t ret = iot_param_load(POSITION_NAMESPACE, POSITION_TRAVEL_KEY, &travel);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (!(travel.yaw_max > travel.yaw_min)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    *yaw_min = travel.yaw_min;
+    *yaw_max = travel.yaw_max;
+    return ESP_OK;
+}
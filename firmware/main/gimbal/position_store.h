@@ -0,0 +1,46 @@
+/*
+   Persistence of the yaw position across reboots.
+
+   The yaw axis has only an incremental encoder, so its absolute position is
+   known after homing only. Two copies keep it alive:
+
+   - a checkpoint in RTC memory, rewritten every control cycle. It survives
+     software resets, panics, watchdogs and deep sleep, but not a power
+     cycle or brownout, after which the motor may have been moved by hand;
+   - the travel limits in NVS, written once after homing. They do not
+     change between boots and let a later homing skip the full sweep.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef struct {
+    int64_t yaw_count;      // absolute encoder count
+    int64_t yaw_home;       // encoder count at the middle of the travel
+    float yaw_max;          // positive end stop relative to home, degrees
+    float yaw_min;          // negative end stop relative to home, degrees
+} gimbal_position_t;
+
+/**
+ * @brief Store the current position in RTC memory, cheap enough for every cycle
+ */
+void position_checkpoint_save(const gimbal_position_t *pos);
+
+/**
+ * @brief Restore the position written before the last reset
+ * @return true if the checkpoint is intact and the reset kept the axis in place
+ */
+bool position_checkpoint_restore(gimbal_position_t *pos);
+
+/**
+ * @brief Drop the checkpoint, e.g. while homing when the position is unknown
+ */
+void position_checkpoint_invalidate(void);
+
+/**
+ * @brief Save / load the yaw travel limits relative to home (NVS)
+ */
+esp_err_t position_travel_save(float yaw_min, float yaw_max);
+esp_err_t position_travel_load(float *yaw_min, float *yaw_max);
@@ -0,0 +1,297 @@
+#include <math.h>
+#include "stall_detector.h"
+
+#define STALL_MIN_SPEED_RATIO   0.05f   // below 5% of full speed the model is not trusted
+#define STALL_REVERSE_RATIO     0.2f    // reverse motion counted from 20% of the model speed
+
+const char *StallDetector::eventDescriptions[] = {
+#define X(name, desc) desc,
+    STALL_EVENT_LIST
+#undef X
+};
+
+void StallDetector::init(const struct stall_param *param)
+{
+    this->param = param;
+    reset();
+}
+
+void StallDetector::set_limits(float min, float max, float margin)
+{
+    limit_min = min;
+    limit_max = max;
+    limit_margin = margin;
+    has_limits = max > min;
+}
+
+void StallDetector::clear_limits()
+{
+    has_limits = false;
+}
+
+void StallDetector::reset()
+{
+    expected = 0.0f;
+    stall_score = 0.0f;
+    reverse_score = 0.0f;
+    overspeed_time = 0.0f;
+}
+
+void StallDetector::get_state(struct stall_state *state) const
+{
+    *state = {expected, stall_score, reverse_score, overspeed_time, limit_min, limit_max, limit_margin, has_limits};
+}
+
+void StallDetector::set_state(const struct stall_state &state)
+{
+    expected = state.expected;
+    stall_score = state.stall_score;
+    reverse_score = state.reverse_score;
+    overspeed_time = state.overspeed_time;
+    limit_min = state.limit_min;
+    limit_max = state.limit_max;
+    limit_margin = state.limit_margin;
+    has_limits = state.has_limits;
+}
+
+stall_event_t StallDetector::update(float duty, float supply_v, float velocity, float position, float dt, float current)
+{
+    if (param == nullptr || !param->enable || dt <= 0.0f) {
+        return STALL_NONE;
+    }
+
+    // first order model, nothing moves inside the deadband
+    float full_speed = param->k * supply_v;
+    float effective = fabsf(duty) - param->deadband;
+    float target = effective > 0.0f ? copysignf(effective * full_speed, duty) : 0.0f;
+    float alpha = param->tau > dt ? dt / param->tau : 1.0f;
+    expected += (target - expected) * alpha;
+
+    float floor = full_speed * STALL_MIN_SPEED_RATIO;
+    float dir = expected >= 0.0f ? 1.0f : -1.0f;
+    float model_speed = fabsf(expected);
+    float measured = velocity * dir; // positive when moving as commanded
+
+    // sustained motion against the command
+    bool reverse = model_speed > floor && measured < -STALL_REVERSE_RATIO * model_speed;
+    reverse_score = fmaxf(0.0f, reverse_score + ((reverse ? 1.0f : 0.0f) - 0.5f) * dt);
+
+    // speed deficit relative to the model, small model speeds are scaled
+    // down by the floor so slow tracking near the deadband never accumulates.
+    // Reverse motion is left to the encoder check above.
+    float deficit = 0.0f;
+    if (!reverse) {
+        deficit = (model_speed - measured) / fmaxf(model_speed, floor);
+        deficit = fminf(deficit, 1.0f) * fminf(model_speed / floor, 1.0f);
+    }
+    stall_score = fmaxf(0.0f, stall_score + (deficit - param->drift) * dt);
+
+    // faster than the motor can turn at this voltage, decays slowly so that
+    // intermittent garbage adds up while a single glitch does not
+    if (fabsf(velocity) > full_speed * param->fault_ratio + floor) {
+        overspeed_time += dt;
+    } else {
+        overspeed_time = fmaxf(0.0f, overspeed_time - 0.25f * dt);
+    }
+
+    if (reverse_score > param->threshold || overspeed_time > 2 * param->threshold) {
+        reset();
+        return STALL_ENCODER_FAULT;
+    }
+
+    if (stall_score > param->threshold) {
+        // with current sense a stall needs stall current, otherwise the
+        // deficit is more likely an open motor lead than a blocked axis
+        if (!isnan(current) && param->stall_current > 0.0f && fabsf(current) < 0.5f * param->stall_current) {
+            stall_score = param->threshold;
+            return STALL_NONE;
+        }
+        bool at_limit = has_limits && ((dir > 0 && position >= limit_max - limit_margin) ||
+                                       (dir < 0 && position <= limit_min + limit_margin));
+        reset();
+        return at_limit ? STALL_END_STOP : STALL_OBSTRUCTION;
+    }
+    return STALL_NONE;
+}
+
+// run fault injection on linux
+#if defined(__linux__) && !defined(STALL_DETECTOR_NO_MAIN)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Closed loop simulation of the yaw axis: a position P and speed PI cascade
+ * like Motor::run drives a plant whose parameters differ from the detector
+ * model (+15% k, 1.5x tau, larger deadband). Faults are injected into the
+ * plant or the sensor and both the new detector and the old fixed counter
+ * (|speed| < 0.1 && |output| >= 0.95 for more than 10 ticks) are scored.
+ */
+
+enum fault_t {
+    FAULT_NONE,
+    FAULT_END_STOP,     // hard stop at +2 rev, travel limits known
+    FAULT_OBSTRUCTION,  // blocked at +1 rev, mid travel
+    FAULT_ENC_SWAP,     // A/B swapped, measured speed is inverted
+    FAULT_ENC_NOISE,    // interference, every other sample is garbage
+};
+
+struct sim_case {
+    const char *name;
+    fault_t fault;
+    stall_event_t expect;
+    float step;             // rev, initial jump of the position target
+    float target_speed;     // rev/s of the position target
+    float duration;
+    float sag_v;            // supply after the sag at half time
+};
+
+struct sim_result {
+    stall_event_t event;
+    float latency;          // s from fault onset, -1 if no fault onset
+    float event_t;
+    bool old_fired;
+    float old_t;
+};
+
+static uint32_t lcg = 1;
+static float noise()
+{
+    lcg = lcg * 1664525u + 1013904223u;
+    return ((lcg >> 8) / 16777216.0f) * 2.0f - 1.0f;
+}
+
+static sim_result simulate(const sim_case &c, float dt, const stall_param &model)
+{
+    // plant
+    const float k = model.k * 1.15f, tau = model.tau * 1.5f, deadband = model.deadband + 0.03f;
+    float w = 0, pos = 0, v = 12.0f;
+    // controller
+    float target = c.step, integ = 0, duty = 0;
+    const float max_speed = 100.0f, kp_pos = 20.0f, kp_vel = 0.02f, ki_vel = 0.4f;
+
+    StallDetector det;
+    det.init(&model);
+    det.set_limits(-2.0f, 2.0f, 0.1f);
+
+    sim_result r = {STALL_NONE, -1, -1, false, -1};
+    float onset = -1;
+    int old_cnt = 0;
+    lcg = 1;
+    const float sub = 1e-4f;
+
+    for (float t = 0; t < c.duration; t += dt) {
+        if (c.sag_v > 0 && t > c.duration / 2) {
+            v = c.sag_v;
+        }
+        // plant, integrated finer than the control period
+        for (float s = 0; s < dt; s += sub) {
+            float eff = fabsf(duty) - deadband;
+            float ws = eff > 0 ? copysignf(eff * k * v, duty) : 0;
+            w += (ws - w) * sub / tau;
+            pos += w * sub;
+            float stop = c.fault == FAULT_END_STOP ? 2.0f : c.fault == FAULT_OBSTRUCTION ? 1.0f : 1e9f;
+            if (pos >= stop) {
+                pos = stop;
+                w = fminf(w, 0);
+                if (onset < 0) {
+                    onset = t;
+                }
+            }
+        }
+        float meas_w = w * (1.0f + 0.02f * noise());
+        float meas_pos = pos;
+        if (c.fault == FAULT_ENC_SWAP && t > 1.0f) {
+            if (onset < 0) {
+                onset = 1.0f;
+            }
+            meas_w = -meas_w;
+            meas_pos = 2.0f - meas_pos;
+        }
+        if (c.fault == FAULT_ENC_NOISE && t > 1.0f) {
+            if (onset < 0) {
+                onset = 1.0f;
+            }
+            if (((int)(t / dt)) & 1) {
+                meas_w = 4000.0f * noise();
+            }
+        }
+
+        // detectors see the duty applied during the last period
+        stall_event_t ev = det.update(duty, v, meas_w, meas_pos, dt);
+        if (ev != STALL_NONE && r.event == STALL_NONE) {
+            r.event = ev;
+            r.event_t = t;
+            r.latency = onset >= 0 ? t - onset : -1;
+        }
+
+        // controller, same structure as Motor::run
+        target += c.target_speed * dt;
+        float spd = (target - meas_pos) * kp_pos;
+        spd = fmaxf(-max_speed, fminf(max_speed, spd));
+        float err = spd - meas_w;
+        integ = fmaxf(-1.0f, fminf(1.0f, integ + err * ki_vel * dt));
+        duty = fmaxf(-1.0f, fminf(1.0f, err * kp_vel + integ));
+
+        if (fabsf(meas_w) < 0.1f && fabsf(duty) >= 0.95f) {
+            if (++old_cnt > 10 && !r.old_fired) {
+                r.old_fired = true;
+                r.old_t = onset >= 0 ? t - onset : t;
+            }
+        } else {
+            old_cnt = 0;
+        }
+    }
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    // yaw defaults from Setting::restortDefault
+    stall_param model = {
+        .k = 12.5f,
+        .tau = 0.05f,
+        .deadband = 0.1f,
+        .drift = 0.5f,
+        .threshold = 0.05f,
+        .fault_ratio = 1.5f,
+        .stall_current = 0.0f,
+        .enable = 1,
+    };
+    sim_case cases[] = {
+        {"tracking 0.03 rev/s", FAULT_NONE, STALL_NONE, 0, 0.03f, 60.0f, 10.5f},
+        {"slew 10 rev/s + sag", FAULT_NONE, STALL_NONE, 0, 10.0f, 1.5f, 9.0f},
+        {"step to 1.5 rev", FAULT_NONE, STALL_NONE, 1.5f, 0, 3.0f, 0},
+        {"end stop", FAULT_END_STOP, STALL_END_STOP, 0, 5.0f, 3.0f, 0},
+        {"obstruction", FAULT_OBSTRUCTION, STALL_OBSTRUCTION, 0, 5.0f, 3.0f, 0},
+        {"encoder A/B swapped", FAULT_ENC_SWAP, STALL_ENCODER_FAULT, 0, 1.0f, 3.0f, 0},
+        {"encoder interference", FAULT_ENC_NOISE, STALL_ENCODER_FAULT, 0, 1.0f, 3.0f, 0},
+    };
+    int failures = 0;
+    const float rates[] = {0.01f, 0.001f};
+    for (float dt : rates) {
+        printf("control rate %.0fHz\n", 1.0f / dt);
+        printf("  %-24s %-14s %-14s %9s   %s\n", "case", "expected", "detected", "latency", "old counter");
+        for (auto &c : cases) {
+            sim_result r = simulate(c, dt, model);
+            bool ok = r.event == c.expect;
+            failures += !ok;
+            printf("  %-24s %-14s %-14s", c.name, StallDetector::get_description(c.expect), StallDetector::get_description(r.event));
+            if (r.latency >= 0) {
+                printf(" %8.0fms", r.latency * 1000);
+            } else {
+                printf(" %10s", "-");
+            }
+            if (r.old_fired) {
+                printf("   stall at %.0fms\n", r.old_t * 1000);
+            } else {
+                printf("   -\n");
+            }
+        }
+    }
+    printf("%s\n", failures ? "FAILED" : "all cases classified correctly");
+    return failures ? 1 : 0;
+}
+
+#endif
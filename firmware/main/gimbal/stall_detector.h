@@ -0,0 +1,109 @@
+/*
+   Model-based stall, end stop and encoder fault detection.
+
+   A first order DC motor model predicts the speed the axis should reach
+   for the applied duty and supply voltage:
+
+       tau * dw/dt = k * (duty - deadband) * V - w
+
+   The relative speed deficit between model and measurement is fed to a
+   CUSUM whose increments are scaled by dt. The alarm therefore fires after
+   a fixed time of sustained deficit whatever the control rate, and the
+   drift term absorbs model error, so slow tracking close to the deadband
+   does not trip it. A second CUSUM on motion against the commanded
+   direction, and a check for speeds the motor cannot reach, flag the
+   encoder instead of the mechanics.
+
+   A stall within `margin` of a known travel limit is reported as an end
+   stop, anywhere else as an obstruction.
+
+   The detector does not depend on ESP-IDF, see the __linux__ section of
+   stall_detector.cpp for the fault injection harness.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+#define STALL_EVENT_LIST \
+X(STALL_NONE, "None") \
+X(STALL_END_STOP, "End stop") \
+X(STALL_OBSTRUCTION, "Obstruction") \
+X(STALL_ENCODER_FAULT, "Encoder fault") \
+
+typedef enum {
+#define X(name, desc) name,
+    STALL_EVENT_LIST
+#undef X
+    STALL_EVENT_COUNT
+} stall_event_t;
+
+struct stall_param {
+    float k;            // steady state speed per volt, sensor units/s/V
+    float tau;          // mechanical time constant, s
+    float deadband;     // duty (0-1) needed to overcome static friction
+    float drift;        // tolerated relative speed deficit (0-1)
+    float threshold;    // CUSUM alarm level, s of full deficit
+    float fault_ratio;  // speeds above k*V*fault_ratio are encoder faults
+    float stall_current; // stall current in A, 0 if there is no current sense
+    uint8_t enable;
+};
+
+// what the detector carries from one step to the next, for the recorder keyframes
+struct stall_state {
+    float expected, stall_score, reverse_score, overspeed_time;
+    float limit_min, limit_max, limit_margin;
+    uint8_t has_limits;
+};
+
+class StallDetector {
+public:
+    StallDetector() = default;
+
+    void init(const struct stall_param *param);
+
+    /**
+     * @brief Travel limits in sensor units, a stall near them is an end stop
+     */
+    void set_limits(float min, float max, float margin);
+    void clear_limits();
+
+    /**
+     * @brief Run one detection step
+     * @param duty duty applied during the last period, -1 to 1
+     * @param supply_v supply voltage
+     * @param velocity measured speed, sensor units/s
+     * @param position measured position, sensor units
+     * @param dt period in s
+     * @param current motor current in A, NAN if not measured
+     */
+    stall_event_t update(float duty, float supply_v, float velocity, float position, float dt, float current = NAN);
+
+    void reset();
+
+    void get_state(struct stall_state *state) const;
+    void set_state(const struct stall_state &state);
+
+    float get_expected() const
+    {
+        return expected;
+    }
+    float get_score() const
+    {
+        return stall_score;
+    }
+    static const char *get_description(stall_event_t event)
+    {
+        return eventDescriptions[event];
+    }
+
+private:
+    static const char *eventDescriptions[];
+    const struct stall_param *param = nullptr;
+    float expected = 0.0f;      // model speed
+    float stall_score = 0.0f;   // CUSUM of the speed deficit
+    float reverse_score = 0.0f; // CUSUM of motion against the command
+    float overspeed_time = 0.0f;
+    bool has_limits = false;
+    float limit_min = 0.0f, limit_max = 0.0f, limit_margin = 0.0f;
+};
@@ -0,0 +1,577 @@
+#include <math.h>
+#include <stdlib.h>
+#include "sun_engine.h"
+
+static const double DEG = M_PI / 180.0;
+static const double UNIX_JD = 2440587.5;    // julian day of the unix epoch
+static const double J2000 = 2451545.0;
+
+static double limit360(double deg)
+{
+    deg = fmod(deg, 360.0);
+    return deg < 0 ? deg + 360.0 : deg;
+}
+
+static int year_of(double t)
+{
+    return 1970 + (int)floor(t / (365.2425 * 86400));
+}
+
+/*
+ * sun_pos.cpp from unix time, the julian day needs no calendar then.
+ */
+static void psa(double t, const sun_observer &o, cSunCoordinates *sun)
+{
+    double days = t / 86400.0 + UNIX_JD - J2000;
+    double hours = fmod(t, 86400.0) / 3600.0;
+    double omega = 2.1429 - 0.0010394594 * days;
+    double mean_longitude = 4.8950630 + 0.017202791698 * days;
+    double mean_anomaly = 6.2400600 + 0.0172019699 * days;
+    double ecliptic_longitude = mean_longitude + 0.03341607 * sin(mean_anomaly) + 0.00034894 * sin(2 * mean_anomaly) -
+                                0.0001134 - 0.0000203 * sin(omega);
+    double obliquity = 0.4090928 - 6.2140e-9 * days + 0.0000396 * cos(omega);
+
+    double sin_longitude = sin(ecliptic_longitude);
+    double right_ascension = atan2(cos(obliquity) * sin_longitude, cos(ecliptic_longitude));
+    double declination = asin(sin(obliquity) * sin_longitude);
+
+    double sidereal = 6.6974243242 + 0.0657098283 * days + hours;
+    double hour_angle = (sidereal * 15 + o.longitude) * DEG - right_ascension;
+    double sin_lat = sin(o.latitude * DEG), cos_lat = cos(o.latitude * DEG);
+    double cos_hour = cos(hour_angle);
+    double zenith = acos(cos_lat * cos_hour * cos(declination) + sin(declination) * sin_lat);
+    double azimuth = atan2(-sin(hour_angle), tan(declination) * cos_lat - sin_lat * cos_hour);
+    zenith += dEarthMeanRadius / dAstronomicalUnit * sin(zenith);
+    sun->dZenithAngle = zenith / DEG;
+    sun->dAzimuth = limit360(azimuth / DEG);
+    sun->dElevation = 90 - sun->dZenithAngle;
+}
+
+/*
+ * Grena, "Five new algorithms for the computation of sun position from
+ * 2010 to 2110", Solar Energy 86 (2012), algorithm 4 without refraction.
+ */
+static void grena(double t, double delta_t, const sun_observer &o, cSunCoordinates *sun)
+{
+    // days since 2060-01-01 0h UT, and in terrestrial time
+    double days = t / 86400.0 - 32872.0;
+    double te = days + delta_t / 86400.0;
+    double wte = 0.0172019715 * te;
+
+    double lambda = -1.388803 + 1.720279216e-2 * te + 3.3366e-2 * sin(wte - 0.06172) + 3.53e-4 * sin(2 * wte - 0.1163);
+    double nu = 9.282e-4 * te - 0.8;
+    double dlambda = 8.34e-5 * sin(nu);
+    lambda += dlambda;
+    double epsilon = 4.089567e-1 - 6.19e-9 * te + 4.46e-5 * cos(nu);
+
+    double sl = sin(lambda), cl = cos(lambda), se = sin(epsilon), ce = sqrt(1 - se * se);
+    double right_ascension = atan2(sl * ce, cl);
+    double declination = asin(sl * se);
+    double hour_angle = 1.7528311 + 6.300388099 * days + o.longitude * DEG - right_ascension + 0.92 * dlambda;
+    hour_angle = remainder(hour_angle, 2 * M_PI);
+
+    double sp = sin(o.latitude * DEG), cp = sqrt(1 - sp * sp);
+    double sd = sin(declination), cd = sqrt(1 - sd * sd);
+    double sh = sin(hour_angle), ch = cos(hour_angle);
+    double se0 = sp * sd + cp * cd * ch;
+    double elevation = asin(se0) - 4.26e-5 * sqrt(1 - se0 * se0);
+    double azimuth = atan2(sh, ch * sp - sd * cp / cd);     // from south, west positive
+    sun->dElevation = elevation / DEG;
+    sun->dZenithAngle = 90 - sun->dElevation;
+    sun->dAzimuth = limit360(azimuth / DEG + 180);
+}
+
+/*
+ * NREL SPA, Reda and Andreas, "Solar Position Algorithm for Solar Radiation
+ * Applications" (2008). The periodic terms of the earth (VSOP87) and of the
+ * nutation are those of the paper, A * cos(B + C * JME).
+ */
+struct spa_term {
+    double a, b, c;
+};
+
+static const spa_term L0[] = {
+    {175347046.0, 0, 0}, {3341656.0, 4.6692568, 6283.07585}, {34894.0, 4.6261, 12566.1517},
+    {3497.0, 2.7441, 5753.3849}, {3418.0, 2.8289, 3.5231}, {3136.0, 3.6277, 77713.7715},
+    {2676.0, 4.4181, 7860.4194}, {2343.0, 6.1352, 3930.2097}, {1324.0, 0.7425, 11506.7698},
+    {1273.0, 2.0371, 529.691}, {1199.0, 1.1096, 1577.3435}, {990, 5.233, 5884.927},
+    {902, 2.045, 26.298}, {857, 3.508, 398.149}, {780, 1.179, 5223.694},
+    {753, 2.533, 5507.553}, {505, 4.583, 18849.228}, {492, 4.205, 775.523},
+    {357, 2.92, 0.067}, {317, 5.849, 11790.629}, {284, 1.899, 796.298},
+    {271, 0.315, 10977.079}, {243, 0.345, 5486.778}, {206, 4.806, 2544.314},
+    {205, 1.869, 5573.143}, {202, 2.458, 6069.777}, {156, 0.833, 213.299},
+    {132, 3.411, 2942.463}, {126, 1.083, 20.775}, {115, 0.645, 0.98},
+    {103, 0.636, 4694.003}, {102, 0.976, 15720.839}, {102, 4.267, 7.114},
+    {99, 6.21, 2146.17}, {98, 0.68, 155.42}, {86, 5.98, 161000.69},
+    {85, 1.3, 6275.96}, {85, 3.67, 71430.7}, {80, 1.81, 17260.15},
+    {79, 3.04, 12036.46}, {75, 1.76, 5088.63}, {74, 3.5, 3154.69},
+    {74, 4.68, 801.82}, {70, 0.83, 9437.76}, {62, 3.98, 8827.39},
+    {61, 1.82, 7084.9}, {57, 2.78, 6286.6}, {56, 4.39, 14143.5},
+    {56, 3.47, 6279.55}, {52, 0.19, 12139.55}, {52, 1.33, 1748.02},
+    {51, 0.28, 5856.48}, {49, 0.49, 1194.45}, {41, 5.37, 8429.24},
+    {41, 2.4, 19651.05}, {39, 6.17, 10447.39}, {37, 6.04, 10213.29},
+    {37, 2.57, 1059.38}, {36, 1.71, 2352.87}, {36, 1.78, 6812.77},
+    {33, 0.59, 17789.85}, {30, 0.44, 83996.85}, {30, 2.74, 1349.87},
+    {25, 3.16, 4690.48},
+};
+static const spa_term L1[] = {
+    {628331966747.0, 0, 0}, {206059.0, 2.678235, 6283.07585}, {4303.0, 2.6351, 12566.1517},
+    {425.0, 1.59, 3.523}, {119.0, 5.796, 26.298}, {109.0, 2.966, 1577.344},
+    {93, 2.59, 18849.23}, {72, 1.14, 529.69}, {68, 1.87, 398.15},
+    {67, 4.41, 5507.55}, {59, 2.89, 5223.69}, {56, 2.17, 155.42},
+    {45, 0.4, 796.3}, {36, 0.47, 775.52}, {29, 2.65, 7.11},
+    {21, 5.34, 0.98}, {19, 1.85, 5486.78}, {19, 4.97, 213.3},
+    {17, 2.99, 6275.96}, {16, 0.03, 2544.31}, {16, 1.43, 2146.17},
+    {15, 1.21, 10977.08}, {12, 2.83, 1748.02}, {12, 3.26, 5088.63},
+    {12, 5.27, 1194.45}, {12, 2.08, 4694}, {11, 0.77, 553.57},
+    {10, 1.3, 6286.6}, {10, 4.24, 1349.87}, {9, 2.7, 242.73},
+    {9, 5.64, 951.72}, {8, 5.3, 2352.87}, {6, 2.65, 9437.76},
+    {6, 4.67, 4690.48},
+};
+static const spa_term L2[] = {
+    {52919.0, 0, 0}, {8720.0, 1.0721, 6283.0758}, {309.0, 0.867, 12566.152},
+    {27, 0.05, 3.52}, {16, 5.19, 26.3}, {16, 3.68, 155.42},
+    {10, 0.76, 18849.23}, {9, 2.06, 77713.77}, {7, 0.83, 775.52},
+    {5, 4.66, 1577.34}, {4, 1.03, 7.11}, {4, 3.44, 5573.14},
+    {3, 5.14, 796.3}, {3, 6.05, 5507.55}, {3, 1.19, 242.73},
+    {3, 6.12, 529.69}, {3, 0.31, 398.15}, {3, 2.28, 553.57},
+    {2, 4.38, 5223.69}, {2, 3.75, 0.98},
+};
+static const spa_term L3[] = {
+    {289.0, 5.844, 6283.076}, {35, 0, 0}, {17, 5.49, 12566.15},
+    {3, 5.2, 155.42}, {1, 4.72, 3.52}, {1, 5.3, 18849.23},
+    {1, 5.97, 242.73},
+};
+static const spa_term L4[] = {
+    {114.0, 3.142, 0}, {8, 4.13, 6283.08}, {1, 3.84, 12566.15},
+};
+static const spa_term L5[] = {
+    {1, 3.14, 0},
+};
+static const spa_term B0[] = {
+    {280.0, 3.199, 84334.662}, {102.0, 5.422, 5507.553}, {80, 3.88, 5223.69},
+    {44, 3.7, 2352.87}, {32, 4, 1577.34},
+};
+static const spa_term B1[] = {
+    {9, 3.9, 5507.55}, {6, 1.73, 5223.69},
+};
+static const spa_term R0[] = {
+    {100013989.0, 0, 0}, {1670700.0, 3.0984635, 6283.07585}, {13956.0, 3.05525, 12566.1517},
+    {3084.0, 5.1985, 77713.7715}, {1628.0, 1.1739, 5753.3849}, {1576.0, 2.8469, 7860.4194},
+    {925.0, 5.453, 11506.77}, {542.0, 4.564, 3930.21}, {472.0, 3.661, 5884.927},
+    {346.0, 0.964, 5507.553}, {329.0, 5.9, 5223.694}, {307.0, 0.299, 5573.143},
+    {243.0, 4.273, 11790.629}, {212.0, 5.847, 1577.344}, {186.0, 5.022, 10977.079},
+    {175.0, 3.012, 18849.228}, {110.0, 5.055, 5486.778}, {98, 0.89, 6069.78},
+    {86, 5.69, 15720.84}, {86, 1.27, 161000.69}, {65, 0.27, 17260.15},
+    {63, 0.92, 529.69}, {57, 2.01, 83996.85}, {56, 5.24, 71430.7},
+    {49, 3.25, 2544.31}, {47, 2.58, 775.52}, {45, 5.54, 9437.76},
+    {43, 6.01, 6275.96}, {39, 5.36, 4694}, {38, 2.39, 8827.39},
+    {37, 0.83, 19651.05}, {37, 4.9, 12139.55}, {36, 1.67, 12036.46},
+    {35, 1.84, 2942.46}, {33, 0.24, 7084.9}, {32, 0.18, 5088.63},
+    {32, 1.78, 398.15}, {28, 1.21, 6286.6}, {28, 1.9, 6279.55},
+    {26, 4.59, 10447.39},
+};
+static const spa_term R1[] = {
+    {103019.0, 1.10749, 6283.07585}, {1721.0, 1.0644, 12566.1517}, {702.0, 3.142, 0},
+    {32, 1.02, 18849.23}, {31, 2.84, 5507.55}, {25, 1.32, 5223.69},
+    {18, 1.42, 1577.34}, {10, 5.91, 10977.08}, {9, 1.42, 6275.96},
+    {9, 0.27, 5486.78},
+};
+static const spa_term R2[] = {
+    {4359.0, 5.7846, 6283.0758}, {124.0, 5.579, 12566.152}, {12, 3.14, 0},
+    {9, 3.63, 77713.77}, {6, 1.87, 5573.14}, {3, 5.47, 18849.23},
+};
+static const spa_term R3[] = {
+    {145.0, 4.273, 6283.076}, {7, 3.92, 12566.15},
+};
+static const spa_term R4[] = {
+    {4, 2.56, 6283.08},
+};
+
+struct spa_series {
+    const spa_term *terms;
+    int count;
+};
+
+#define SPA_SERIES(x) {x, (int)(sizeof(x) / sizeof(x[0]))}
+
+static const spa_series L_SERIES[] = {SPA_SERIES(L0), SPA_SERIES(L1), SPA_SERIES(L2),
+                                      SPA_SERIES(L3), SPA_SERIES(L4), SPA_SERIES(L5)};
+static const spa_series B_SERIES[] = {SPA_SERIES(B0), SPA_SERIES(B1)};
+static const spa_series R_SERIES[] = {SPA_SERIES(R0), SPA_SERIES(R1), SPA_SERIES(R2), SPA_SERIES(R3), SPA_SERIES(R4)};
+
+// multiples of D, M, M', F and omega, then psi a + b T, epsilon c + d T in 0.0001"
+static const int8_t NUTATION_Y[][5] = {
+    {0, 0, 0, 0, 1}, {-2, 0, 0, 2, 2}, {0, 0, 0, 2, 2}, {0, 0, 0, 0, 2}, {0, 1, 0, 0, 0},
+    {0, 0, 1, 0, 0}, {-2, 1, 0, 2, 2}, {0, 0, 0, 2, 1}, {0, 0, 1, 2, 2}, {-2, -1, 0, 2, 2},
+    {-2, 0, 1, 0, 0}, {-2, 0, 0, 2, 1}, {0, 0, -1, 2, 2}, {2, 0, 0, 0, 0}, {0, 0, 1, 0, 1},
+    {2, 0, -1, 2, 2}, {0, 0, -1, 0, 1}, {0, 0, 1, 2, 1}, {-2, 0, 2, 0, 0}, {0, 0, -2, 2, 1},
+    {2, 0, 0, 2, 2}, {0, 0, 2, 2, 2}, {0, 0, 2, 0, 0}, {-2, 0, 1, 2, 2}, {0, 0, 0, 2, 0},
+    {-2, 0, 0, 2, 0}, {0, 0, -1, 2, 1}, {0, 2, 0, 0, 0}, {2, 0, -1, 0, 1}, {-2, 2, 0, 2, 2},
+    {0, 1, 0, 0, 1}, {-2, 0, 1, 0, 1}, {0, -1, 0, 0, 1}, {0, 0, 2, -2, 0}, {2, 0, -1, 2, 1},
+    {2, 0, 1, 2, 2}, {0, 1, 0, 2, 2}, {-2, 1, 1, 0, 0}, {0, -1, 0, 2, 2}, {2, 0, 0, 2, 1},
+    {2, 0, 1, 0, 0}, {-2, 0, 2, 2, 2}, {-2, 0, 1, 2, 1}, {2, 0, -2, 0, 1}, {2, 0, 0, 0, 1},
+    {0, -1, 1, 0, 0}, {-2, -1, 0, 2, 1}, {-2, 0, 0, 0, 1}, {0, 0, 2, 2, 1}, {-2, 0, 2, 0, 1},
+    {-2, 1, 0, 2, 1}, {0, 0, 1, -2, 0}, {-1, 0, 1, 0, 0}, {-2, 1, 0, 0, 0}, {1, 0, 0, 0, 0},
+    {0, 0, 1, 2, 0}, {0, 0, -2, 2, 2}, {-1, -1, 1, 0, 0}, {0, 1, 1, 0, 0}, {0, -1, 1, 2, 2},
+    {2, -1, -1, 2, 2}, {0, 0, 3, 2, 2}, {2, -1, 0, 2, 2},
+};
+static const float NUTATION_PE[][4] = {
+    {-171996, -174.2f, 92025, 8.9f}, {-13187, -1.6f, 5736, -3.1f}, {-2274, -0.2f, 977, -0.5f},
+    {2062, 0.2f, -895, 0.5f}, {1426, -3.4f, 54, -0.1f}, {712, 0.1f, -7, 0},
+    {-517, 1.2f, 224, -0.6f}, {-386, -0.4f, 200, 0}, {-301, 0, 129, -0.1f},
+    {217, -0.5f, -95, 0.3f}, {-158, 0, 0, 0}, {129, 0.1f, -70, 0},
+    {123, 0, -53, 0}, {63, 0, 0, 0}, {63, 0.1f, -33, 0},
+    {-59, 0, 26, 0}, {-58, -0.1f, 32, 0}, {-51, 0, 27, 0},
+    {48, 0, 0, 0}, {46, 0, -24, 0}, {-38, 0, 16, 0},
+    {-31, 0, 13, 0}, {29, 0, 0, 0}, {29, 0, -12, 0},
+    {26, 0, 0, 0}, {-22, 0, 0, 0}, {21, 0, -10, 0},
+    {17, -0.1f, 0, 0}, {16, 0, -8, 0}, {-16, 0.1f, 7, 0},
+    {-15, 0, 9, 0}, {-13, 0, 7, 0}, {-12, 0, 6, 0},
+    {11, 0, 0, 0}, {-10, 0, 5, 0}, {-8, 0, 3, 0},
+    {7, 0, -3, 0}, {-7, 0, 0, 0}, {-7, 0, 3, 0},
+    {-7, 0, 3, 0}, {6, 0, 0, 0}, {6, 0, -3, 0},
+    {6, 0, -3, 0}, {-6, 0, 3, 0}, {-6, 0, 3, 0},
+    {5, 0, 0, 0}, {-5, 0, 3, 0}, {-5, 0, 3, 0},
+    {-5, 0, 3, 0}, {4, 0, 0, 0}, {4, 0, 0, 0},
+    {4, 0, 0, 0}, {-4, 0, 0, 0}, {-4, 0, 0, 0},
+    {-4, 0, 0, 0}, {3, 0, 0, 0}, {-3, 0, 0, 0},
+    {-3, 0, 0, 0}, {-3, 0, 0, 0}, {-3, 0, 0, 0},
+    {-3, 0, 0, 0}, {-3, 0, 0, 0}, {-3, 0, 0, 0},
+};
+
+// sum over the series of sum over the terms, times JME^i, in 1e-8 rad or AU
+static double earth_value(const spa_series *series, int count, double jme)
+{
+    double value = 0, power = 1;
+    for (int i = 0; i < count; i++) {
+        double sum = 0;
+        for (int k = 0; k < series[i].count; k++) {
+            const spa_term &term = series[i].terms[k];
+            sum += term.a * cos(term.b + term.c * jme);
+        }
+        value += sum * power;
+        power *= jme;
+    }
+    return value / 1e8;
+}
+
+static void spa(double t, double delta_t, const sun_observer &o, cSunCoordinates *sun)
+{
+    double jd = t / 86400.0 + UNIX_JD;
+    double jde = jd + delta_t / 86400.0;
+    double jc = (jd - J2000) / 36525.0;
+    double jce = (jde - J2000) / 36525.0;
+    double jme = jce / 10.0;
+
+    // heliocentric earth, then geocentric sun
+    double l = limit360(earth_value(L_SERIES, 6, jme) / DEG);
+    double b = earth_value(B_SERIES, 2, jme) / DEG;
+    double r = earth_value(R_SERIES, 5, jme);
+    double theta = limit360(l + 180.0);
+    double beta = -b;
+
+    // nutation in longitude and obliquity
+    double x[5] = {
+        297.85036 + 445267.111480 * jce - 0.0019142 * jce * jce + jce * jce * jce / 189474.0,
+        357.52772 + 35999.050340 * jce - 0.0001603 * jce * jce - jce * jce * jce / 300000.0,
+        134.96298 + 477198.867398 * jce + 0.0086972 * jce * jce + jce * jce * jce / 56250.0,
+        93.27191 + 483202.017538 * jce - 0.0036825 * jce * jce + jce * jce * jce / 327270.0,
+        125.04452 - 1934.136261 * jce + 0.0020708 * jce * jce + jce * jce * jce / 450000.0,
+    };
+    double psi = 0, eps = 0;
+    for (size_t i = 0; i < sizeof(NUTATION_Y) / sizeof(NUTATION_Y[0]); i++) {
+        double arg = 0;
+        for (int j = 0; j < 5; j++) {
+            arg += x[j] * NUTATION_Y[i][j];
+        }
+        arg *= DEG;
+        psi += (NUTATION_PE[i][0] + NUTATION_PE[i][1] * jce) * sin(arg);
+        eps += (NUTATION_PE[i][2] + NUTATION_PE[i][3] * jce) * cos(arg);
+    }
+    psi /= 36000000.0;
+    eps /= 36000000.0;
+
+    double u = jme / 10.0;
+    double eps0 = 84381.448 +
+                  u * (-4680.93 + u * (-1.55 + u * (1999.25 + u * (-51.38 + u * (-249.67 + u * (-39.05 + u * (7.12 +
+                  u * (27.87 + u * (5.79 + u * 2.45)))))))));
+    double epsilon = (eps0 / 3600.0 + eps) * DEG;
+    double lambda = (theta + psi - 20.4898 / (3600.0 * r)) * DEG;
+
+    // apparent sidereal time, right ascension and declination
+    double nu0 = limit360(280.46061837 + 360.98564736629 * (jd - J2000) + jc * jc * (0.000387933 - jc / 38710000.0));
+    double nu = nu0 + psi * cos(epsilon);
+    double beta_r = beta * DEG;
+    double alpha = atan2(sin(lambda) * cos(epsilon) - tan(beta_r) * sin(epsilon), cos(lambda)) / DEG;
+    double delta = asin(sin(beta_r) * cos(epsilon) + cos(beta_r) * sin(epsilon) * sin(lambda));
+    double h = limit360(nu + o.longitude - alpha) * DEG;
+
+    // parallax of the observer on the ellipsoid
+    double xi = 8.794 / (3600.0 * r) * DEG;
+    double phi = o.latitude * DEG;
+    double uu = atan(0.99664719 * tan(phi));
+    double xx = cos(uu) + o.altitude / 6378140.0 * cos(phi);
+    double yy = 0.99664719 * sin(uu) + o.altitude / 6378140.0 * sin(phi);
+    double denominator = cos(delta) - xx * sin(xi) * cos(h);
+    double delta_alpha = atan2(-xx * sin(xi) * sin(h), denominator);
+    double delta_prime = atan2((sin(delta) - yy * sin(xi)) * cos(delta_alpha), denominator);
+    double h_prime = h - delta_alpha;
+
+    double e0 = asin(sin(phi) * sin(delta_prime) + cos(phi) * cos(delta_prime) * cos(h_prime));
+    double gamma = atan2(sin(h_prime), cos(h_prime) * sin(phi) - tan(delta_prime) * cos(phi));
+    sun->dElevation = e0 / DEG;
+    sun->dZenithAngle = 90 - sun->dElevation;
+    sun->dAzimuth = limit360(gamma / DEG + 180.0);
+}
+
+void SunEngine::position(sun_algo_t algo, double t, double delta_t, const sun_observer &observer,
+                         cSunCoordinates *sun)
+{
+    switch (algo) {
+    case SUN_ALGO_GRENA:
+        grena(t, delta_t, observer, sun);
+        break;
+    case SUN_ALGO_SPA:
+        spa(t, delta_t, observer, sun);
+        break;
+    default:
+        psa(t, observer, sun);
+        break;
+    }
+}
+
+float SunEngine::error_bound(sun_algo_t algo, int year)
+{
+    switch (algo) {
+    case SUN_ALGO_PSA:
+        // grows away from its fitting window, not measured beyond 1950..2150
+        return year >= 1950 && year <= 2150 ? 0.009f + 0.00006f * abs(year - 2005) : 1.0f;
+    case SUN_ALGO_GRENA:
+        return year >= 2010 && year <= 2110 ? 0.01f : 1.0f;
+    default:
+        return 0.0003f;
+    }
+}
+
+double SunEngine::refraction(double elevation, double pressure, double temperature)
+{
+    if (pressure <= 0 || elevation < -(SUN_SUN_RADIUS + SUN_HORIZON_REFRACT)) {
+        return 0;
+    }
+    return pressure / 1010.0 * 283.0 / (273.0 + temperature) * 1.02 /
+           (60.0 * tan((elevation + 10.3 / (elevation + 5.11)) * DEG));
+}
+
+double SunEngine::pressure_at(double altitude)
+{
+    // the troposphere, where the formula holds
+    altitude = fmin(fmax(altitude, -500.0), 11000.0);
+    return 1013.25 * pow(1 - 2.25577e-5 * altitude, 5.25588);
+}
+
+const char *SunEngine::algo_name(sun_algo_t algo)
+{
+    static const char *const names[SUN_ALGO_COUNT] = {"auto", "psa", "grena", "spa"};
+    return algo < SUN_ALGO_COUNT ? names[algo] : "?";
+}
+
+sun_algo_t SunEngine::select(double t) const
+{
+    sun_algo_t algo = param != nullptr ? (sun_algo_t)param->algo : SUN_ALGO_AUTO;
+    if (algo != SUN_ALGO_AUTO && algo < SUN_ALGO_COUNT) {
+        return algo;
+    }
+    // cheapest first
+    static const sun_algo_t by_cost[] = {SUN_ALGO_GRENA, SUN_ALGO_PSA};
+    int year = year_of(t);
+    for (sun_algo_t candidate : by_cost) {
+        if (error_bound(candidate, year) <= resolution * SUN_ERROR_SHARE) {
+            return candidate;
+        }
+    }
+    return SUN_ALGO_SPA;
+}
+
+void SunEngine::compute(double t, const sun_observer &observer, cSunCoordinates *sun)
+{
+    last_algo = select(t);
+    position(last_algo, t, param != nullptr ? param->delta_t : 0, observer, sun);
+    last_refraction = 0;
+    if (param != nullptr && param->refraction) {
+        last_refraction = (float)refraction(sun->dElevation, observer.pressure, observer.temperature);
+        sun->dElevation += last_refraction;
+        sun->dZenithAngle = 90 - sun->dElevation;
+    }
+}
+
+#if defined(__linux__) && !defined(SUN_ENGINE_NO_MAIN)
+
+#include <stdio.h>
+#include <time.h>
+#include <chrono>
+#include <initializer_list>
+
+/*
+ * SPA against the example of its paper, then PSA and Grena against SPA over
+ * SIM_YEARS, sampled at SIM_SAMPLES times of each year at latitudes from
+ * -60 to 60 in every third year, with the sun above the horizon. The worst error of a decade
+ * has to stay within error_bound(). The cost of a position is timed on the
+ * host, the ESP32-S3 with its software doubles is much slower but in the
+ * same order.
+ */
+
+#define SIM_FIRST_YEAR  1990
+#define SIM_LAST_YEAR   2120
+#define SIM_SAMPLES     1000
+#define SIM_CALLS       200000
+
+static double angle_between(const cSunCoordinates &a, const cSunCoordinates &b)
+{
+    double ua[3] = {sin(a.dZenithAngle * DEG) * sin(a.dAzimuth * DEG), sin(a.dZenithAngle * DEG) * cos(a.dAzimuth * DEG),
+                    cos(a.dZenithAngle * DEG)};
+    double ub[3] = {sin(b.dZenithAngle * DEG) * sin(b.dAzimuth * DEG), sin(b.dZenithAngle * DEG) * cos(b.dAzimuth * DEG),
+                    cos(b.dZenithAngle * DEG)};
+    double cx = ua[1] * ub[2] - ua[2] * ub[1], cy = ua[2] * ub[0] - ua[0] * ub[2], cz = ua[0] * ub[1] - ua[1] * ub[0];
+    return atan2(sqrt(cx * cx + cy * cy + cz * cz), ua[0] * ub[0] + ua[1] * ub[1] + ua[2] * ub[2]) / DEG;
+}
+
+static double unix_of(int year, int month, int day, int hour, int minute, int second)
+{
+    struct tm utc = {};
+    utc.tm_year = year - 1900;
+    utc.tm_mon = month - 1;
+    utc.tm_mday = day;
+    utc.tm_hour = hour;
+    utc.tm_min = minute;
+    utc.tm_sec = second;
+    return (double)timegm(&utc);
+}
+
+// worst error against SPA over the years [first, last]
+static double worst_error(sun_algo_t algo, int first, int last)
+{
+    double worst = 0;
+    for (int year = first; year <= last; year += 3) {
+        double t0 = unix_of(year, 1, 1, 0, 0, 0);
+        for (int i = 0; i < SIM_SAMPLES; i++) {
+            // a prime step in hours walks through the times of the day
+            double t = t0 + i * 5.83 * 3600;
+            for (double latitude = -60; latitude <= 60; latitude += 20) {
+                sun_observer observer = {latitude, 100 - 2 * latitude, 0, 0, 0};
+                cSunCoordinates exact, sun;
+                SunEngine::position(SUN_ALGO_SPA, t, 69, observer, &exact);
+                if (exact.dElevation < 0) {
+                    continue;
+                }
+                SunEngine::position(algo, t, 69, observer, &sun);
+                worst = fmax(worst, angle_between(sun, exact));
+            }
+        }
+    }
+    return worst;
+}
+
+static double cost_ns(sun_algo_t algo)
+{
+    sun_observer observer = {28.18, 112.93, 60, 0, 0};
+    cSunCoordinates sun;
+    volatile double sink = 0;
+    double t0 = unix_of(2025, 3, 28, 0, 0, 0);
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < SIM_CALLS; i++) {
+        SunEngine::position(algo, t0 + i * 61.0, 69, observer, &sun);
+        sink = sink + sun.dAzimuth;
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / SIM_CALLS;
+}
+
+int main()
+{
+    int failures = 0;
+
+    // Reda and Andreas, table A4.1: 2003-10-17 12:30:30 at -7h, delta T 67s
+    sun_observer golden = {39.742476, -105.1786, 1830.14, 820, 11};
+    cSunCoordinates sun;
+    SunEngine::position(SUN_ALGO_SPA, unix_of(2003, 10, 17, 19, 30, 30), 67, golden, &sun);
+    double zenith = sun.dZenithAngle - SunEngine::refraction(sun.dElevation, golden.pressure, golden.temperature);
+    bool ok = fabs(zenith - 50.11162) < 1e-5 && fabs(sun.dAzimuth - 194.34024) < 1e-5;
+    printf("spa example: zenith %.5f (50.11162) azimuth %.5f (194.34024) %s\n", zenith, sun.dAzimuth, ok ? "ok" : "FAIL");
+    failures += !ok;
+
+    printf("\nworst error against spa, degrees\n%-11s %8s %6s %8s %6s\n", "years", "psa", "bound", "grena", "bound");
+    for (int first = SIM_FIRST_YEAR; first < SIM_LAST_YEAR; first += 10) {
+        int last = first + 9;
+        double psa_error = worst_error(SUN_ALGO_PSA, first, last);
+        double grena_error = worst_error(SUN_ALGO_GRENA, first, last);
+        float psa_bound = fminf(SunEngine::error_bound(SUN_ALGO_PSA, first), SunEngine::error_bound(SUN_ALGO_PSA, last));
+        float grena_bound = fminf(SunEngine::error_bound(SUN_ALGO_GRENA, first), SunEngine::error_bound(SUN_ALGO_GRENA, last));
+        bool within = psa_error <= psa_bound && grena_error <= grena_bound;
+        printf("%d-%d %8.4f %6.3f %8.4f %6.3f %s\n", first, last, psa_error, psa_bound, grena_error, grena_bound,
+               within ? "" : "FAIL");
+        failures += !within;
+    }
+
+    printf("\n%-6s %10s %12s\n", "algo", "ns/call", "error 2025");
+    double cost[SUN_ALGO_COUNT] = {};
+    for (int algo = SUN_ALGO_PSA; algo < SUN_ALGO_COUNT; algo++) {
+        cost[algo] = cost_ns((sun_algo_t)algo);
+        printf("%-6s %10.0f %12.4f\n", SunEngine::algo_name((sun_algo_t)algo), cost[algo],
+               SunEngine::error_bound((sun_algo_t)algo, 2025));
+    }
+    // auto goes through the backends cheapest first, grena is a bit cheaper than psa
+    if (cost[SUN_ALGO_SPA] < 5 * fmax(cost[SUN_ALGO_PSA], cost[SUN_ALGO_GRENA])) {
+        printf("spa not worth tiering FAIL\n");
+        failures++;
+    }
+
+    // the backend auto mode takes for a pointing resolution
+    sun_param param = {SUN_ALGO_AUTO, 1, 69, 0};
+    SunEngine engine;
+    engine.init(&param);
+    struct {
+        float resolution;
+        int year;
+        sun_algo_t expect;
+    } tiers[] = {
+        {0.2f, 2025, SUN_ALGO_GRENA},
+        {0.005f, 2025, SUN_ALGO_SPA},
+        {0.2f, 2150, SUN_ALGO_PSA},
+        {0.2f, 2300, SUN_ALGO_SPA},
+        {0.01f, 2025, SUN_ALGO_SPA},
+    };
+    printf("\n%-10s %6s %6s\n", "resolution", "year", "algo");
+    for (const auto &tier : tiers) {
+        engine.set_resolution(tier.resolution);
+        sun_algo_t algo = engine.select(unix_of(tier.year, 6, 1, 0, 0, 0));
+        printf("%-10.3f %6d %6s %s\n", tier.resolution, tier.year, SunEngine::algo_name(algo),
+               algo == tier.expect ? "" : "FAIL");
+        failures += algo != tier.expect;
+    }
+
+    // refraction near the park elevation, where it decides about sunrise
+    printf("\n%-9s %10s %10s\n", "elevation", "0C 1013", "40C 900");
+    for (double elevation : {-0.5, 0.0, 3.0, 10.0, 45.0}) {
+        printf("%-9.1f %10.4f %10.4f\n", elevation, SunEngine::refraction(elevation, 1013.25, 0),
+               SunEngine::refraction(elevation, 900, 40));
+    }
+    // sunrise over the park elevation, geometric and apparent
+    sun_observer site = {28.183, 112.933, 60, SunEngine::pressure_at(60), 15};
+    double rise[2] = {0, 0};
+    for (double t = unix_of(2025, 3, 27, 20, 0, 0); t < unix_of(2025, 3, 28, 4, 0, 0); t += 1) {
+        SunEngine::position(SUN_ALGO_GRENA, t, 69, site, &sun);
+        double apparent = sun.dElevation + SunEngine::refraction(sun.dElevation, site.pressure, site.temperature);
+        if (rise[0] == 0 && sun.dElevation > 3) {
+            rise[0] = t;
+        }
+        if (rise[1] == 0 && apparent > 3) {
+            rise[1] = t;
+        }
+    }
+    printf("3 degrees at sunrise: apparent %.0f s before geometric\n", rise[0] - rise[1]);
+
+    printf(failures == 0 ? "all checks passed\n" : "FAILED\n");
+    return failures != 0;
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+   Solar position with a choice of algorithm and refraction.
+
+   Three backends:
+   - PSA, the algorithm of sun_pos.cpp, 0.5' from 1999 to 2015 and slowly
+     worse outside of that,
+   - Grena (2012, algorithm 4), 0.01 degrees from 2010 to 2110,
+   - NREL SPA (Reda and Andreas 2008), 0.0003 degrees from -2000 to 6000.
+   The positions are topocentric and geometric, refraction is a separate
+   correction with the pressure and temperature of the air. The firmware
+   takes the temperature from the IMU and the pressure from the GPS
+   altitude.
+
+   In auto mode the engine takes the cheapest backend whose error in the
+   year of the request is within SUN_ERROR_SHARE of the resolution the
+   pointing can use: a tracker that settles to 0.2 degrees gains nothing
+   from SPA, and the ESP32-S3 does its doubles in software. The error
+   bounds are measured against SPA by the __linux__ section of
+   sun_engine.cpp, which also reports the cost of each backend.
+
+   Nothing here depends on ESP-IDF.
+*/
+#pragma once
+
+#include <stdint.h>
+#include "sun_pos.h"
+
+#define SUN_ERROR_SHARE     0.25f   // of the resolution the ephemeris may take
+#define SUN_SUN_RADIUS      0.26667 // degrees
+#define SUN_HORIZON_REFRACT 0.5667  // degrees, refraction at the horizon
+
+typedef enum {
+    SUN_ALGO_AUTO,
+    SUN_ALGO_PSA,
+    SUN_ALGO_GRENA,
+    SUN_ALGO_SPA,
+    SUN_ALGO_COUNT,
+} sun_algo_t;
+
+struct sun_param {
+    uint8_t algo;           // sun_algo_t
+    uint8_t refraction;     // apparent position, with the IMU temperature
+    float delta_t;          // TT - UT, seconds
+    float temp_offset;      // IMU temperature above the air, degrees C
+};
+
+struct sun_observer {
+    double latitude;        // degrees, north positive
+    double longitude;       // degrees, east positive
+    double altitude;        // m
+    double pressure;        // hPa, 0 for none
+    double temperature;     // degrees C
+};
+
+class SunEngine {
+public:
+    SunEngine() = default;
+
+    void init(const struct sun_param *param)
+    {
+        this->param = param;
+    }
+
+    // pointing resolution in degrees, errors well below it are not seen
+    void set_resolution(float deg)
+    {
+        resolution = deg;
+    }
+
+    // the backend a request at unix time t gets
+    sun_algo_t select(double t) const;
+
+    /**
+     * @brief Sun position as seen by the observer, refracted if enabled
+     * @param t unix time in seconds
+     */
+    void compute(double t, const struct sun_observer &observer, cSunCoordinates *sun);
+
+    sun_algo_t get_last_algo() const
+    {
+        return last_algo;
+    }
+    // refraction applied to the last position, degrees
+    float get_last_refraction() const
+    {
+        return last_refraction;
+    }
+
+    // topocentric position without refraction
+    static void position(sun_algo_t algo, double t, double delta_t, const struct sun_observer &observer,
+                         cSunCoordinates *sun);
+    // largest error against SPA in the year, degrees
+    static float error_bound(sun_algo_t algo, int year);
+    // elevation gained by refraction at the true elevation, degrees
+    static double refraction(double elevation, double pressure, double temperature);
+    // standard atmosphere, hPa
+    static double pressure_at(double altitude);
+    static const char *algo_name(sun_algo_t algo);
+
+private:
+    const struct sun_param *param = nullptr;
+    float resolution = 0;
+    sun_algo_t last_algo = SUN_ALGO_PSA;
+    float last_refraction = 0;
+};
@@ -5,6 +5,7 @@
 
 #ifdef __linux__
 #include <cstdio>
+#include <cstdlib>
 #endif
 
 void sunpos(cTime udtTime,cLocation udtLocation, cSunCoordinates *udtSunCoordinates)
@@ -110,37 +111,46 @@ void sunpos(cTime udtTime,cLocation udtLocation, cSunCoordinates *udtSunCoordina
 }
 
 // run test on linux
-#ifdef __linux__
-
-#include <time.h>
-
+#if defined(__linux__) && !defined(SUN_POS_NO_MAIN)
 
-int main(int argc, char **argv)
+static void print_sunpos(int year, int month, int day, int hour, int minute)
 {
-	if (argc != 6)
-	{
-		printf("Usage: sun_pos <year> <month> <day> <hour> <minute>\n");
-		return 1;
-	}
-
 	struct cTime time;
-	time.iYear = atoi(argv[1]);
-	time.iMonth = atoi(argv[2]);
-	time.iDay = atoi(argv[3]);
-	time.dHours = atoi(argv[4]);
-	time.dMinutes = atoi(argv[5]);
+	time.iYear = year;
+	time.iMonth = month;
+	time.iDay = day;
+	time.dHours = hour;
+	time.dMinutes = minute;
 	time.dSeconds = 0;
 
 	struct cLocation location;
 	location.dLongitude = 112.933333;
-    location.dLatitude = 28.183333;
+	location.dLatitude = 28.183333;
 
 	struct cSunCoordinates sunCoordinates;
 	sunpos(time, location, &sunCoordinates);
 	printf("%f\t%f\t%f\n", sunCoordinates.dAzimuth, sunCoordinates.dZenithAngle, sunCoordinates.dElevation);
-	
-	float max_azimuth, min_azimuth;
-	search_azimuth(&max_azimuth, &min_azimuth);
+}
+
+// one time from the arguments, or "year month day hour minute" lines from stdin
+int main(int argc, char **argv)
+{
+	if (argc == 6)
+	{
+		print_sunpos(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+		return 0;
+	}
+	if (argc != 1)
+	{
+		printf("Usage: sun_pos <year> <month> <day> <hour> <minute>\n       sun_pos < times\n");
+		return 1;
+	}
+	int year, month, day, hour, minute;
+	while (scanf("%d %d %d %d %d", &year, &month, &day, &hour, &minute) == 5)
+	{
+		print_sunpos(year, month, day, hour, minute);
+		fflush(stdout);
+	}
 	return 0;
 }
 
@@ -0,0 +1,90 @@
+/*
+   Energy aware re-aim policy.
+
+   Re-aiming on every cycle moves the axes by a few hundredths of a degree
+   each time, and every move pays for breaking static friction and for the
+   controller settling again. The policy instead keeps the aim until the
+   pointing error predicted for the next decision would exceed a threshold.
+   The cosine loss of an error e is 1 - cos(e), 1.5e-4 at 1 degree.
+
+   That only holds for a panel facing the sun. A mirror turns an error of
+   its normal into twice that on the spot, half a metre at 15 m for 1 degree,
+   so mirrors are re-aimed every cycle. A manual target is moved to as
+   soon as it changes, however little.
+
+   When it moves, it aims ahead of the sun by `lead` of the time the sun
+   needs to cross the threshold. The error then sweeps from -threshold
+   through zero to +threshold, and with lead = 1 moves are close to twice
+   as far apart as when aiming at the current position. The caller
+   computes the aim at that time, extrapolating az/el is poor near the
+   zenith.
+
+   Between moves self-locking axes are released by Gimbal, so that no
+   holding current flows. The policy itself does not depend on ESP-IDF, see
+   the __linux__ section of tracking_policy.cpp for a simulated day.
+*/
+#pragma once
+
+#include <stdint.h>
+
+struct track_param {
+    float threshold_deg;    // re-aim when the predicted pointing error exceeds it, 0 re-aims every cycle
+    float lead;             // aim ahead by this fraction (0-1) of the re-aim interval
+    float settle_deg;       // an axis within this of its target has arrived
+    uint8_t yaw_self_lock;  // the mechanics hold the axis without power
+    uint8_t pitch_self_lock;
+    uint8_t enable;
+};
+
+// pitch is the zenith angle of the aim, yaw its azimuth, degrees
+struct aim_t {
+    float pitch;
+    float yaw;
+};
+
+// what the aim points, which decides what an error costs
+typedef enum {
+    TRACK_SUN,          // a panel facing the sun, the threshold applies
+    TRACK_MIRROR,       // a mirror reflecting to a target, every cycle
+    TRACK_FIXED,        // a manual target, whenever it changes
+} track_target_t;
+
+class TrackingPolicy {
+public:
+    TrackingPolicy() = default;
+
+    void init(const struct track_param *param);
+
+    /**
+     * @brief Decide whether to move
+     * @param target what the aim points
+     * @param current aim the axes are commanded to
+     * @param desired aim wanted now
+     * @param next aim wanted at the next decision
+     * @param period s until the next decision
+     * @param lead_s move to the aim wanted this many s from now
+     * @return true if the axes have to move
+     */
+    bool decide(track_target_t target, const aim_t &current, const aim_t &desired, const aim_t &next, float period, float *lead_s);
+
+    // error and cosine loss of the current aim at the last decision
+    float get_error() const
+    {
+        return error;
+    }
+    float get_cosine_loss() const;
+    uint32_t get_moves() const
+    {
+        return moves;
+    }
+
+    /**
+     * @brief Angle between two aims in degrees
+     */
+    static float angle_between(const aim_t &a, const aim_t &b);
+
+private:
+    const struct track_param *param = nullptr;
+    float error = 0.0f;
+    uint32_t moves = 0;
+};
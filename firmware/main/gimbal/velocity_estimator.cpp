@@ -0,0 +1,212 @@
+#include <math.h>
+#include <stdlib.h>
+#include "velocity_estimator.h"
+
+void VelocityEstimator::init(int min_counts, float max_window_s)
+{
+    this->min_counts = min_counts > 0 ? min_counts : 1;
+    this->max_window_us = (int64_t)(max_window_s * 1e6f);
+    reset();
+}
+
+void VelocityEstimator::reset()
+{
+    head = 0;
+    size = 0;
+    started = false;
+    velocity = 0.0f;
+}
+
+float VelocityEstimator::update(int64_t count, int64_t edge_us, int64_t now_us)
+{
+    if (!started) {
+        started = true;
+        last_count = count;
+        last_edge_us = now_us;
+        history[0] = {count, now_us};
+        head = 1;
+        size = 1;
+        return velocity;
+    }
+
+    if (count != last_count) {
+        // new edges since the last call, count was reached at edge_us
+        history[head] = {count, edge_us};
+        head = (head + 1) % VEL_EST_HISTORY;
+        if (size < VEL_EST_HISTORY) {
+            size++;
+        }
+        last_count = count;
+        last_edge_us = edge_us;
+
+        // walk back to the newest sample which is at least min_counts away,
+        // or the oldest one still inside the window
+        const Sample *ref = nullptr;
+        for (int i = 2; i <= size; i++) {
+            const Sample &s = history[(head - i + VEL_EST_HISTORY) % VEL_EST_HISTORY];
+            if (edge_us - s.us > max_window_us) {
+                break;
+            }
+            ref = &s;
+            if (llabs(count - s.count) >= min_counts) {
+                break;
+            }
+        }
+        if (ref && edge_us > ref->us) {
+            velocity = (float)(count - ref->count) * 1e6f / (float)(edge_us - ref->us);
+        } else if (!ref) {
+            // first edge after a standstill: one count over the idle time is
+            // the best we know, it is refined as soon as more edges arrive
+            const Sample &prev = history[(head - 2 + VEL_EST_HISTORY) % VEL_EST_HISTORY];
+            if (edge_us > prev.us) {
+                velocity = (float)(count - prev.count) * 1e6f / (float)(edge_us - prev.us);
+            }
+        }
+    } else {
+        int64_t idle = now_us - last_edge_us;
+        if (idle >= max_window_us) {
+            velocity = 0.0f;
+        } else if (idle > 0) {
+            // 1.5 counts rather than 1 leaves room for uneven edge spacing
+            float bound = 1.5e6f / (float)idle;
+            if (fabsf(velocity) > bound) {
+                velocity = copysignf(bound, velocity);
+            }
+        }
+    }
+    return velocity;
+}
+
+// run simulation on linux
+#if defined(__linux__) && !defined(VELOCITY_ESTIMATOR_NO_MAIN)
+
+#include <stdio.h>
+#include <vector>
+
+/*
+ * Compare the estimator with the current method (count difference over the
+ * control period) on the yaw axis: 44 counts/rev on the motor shaft and a
+ * 100Hz control tick.
+ */
+
+#define SIM_CPR      44.0
+#define SIM_TICK_US  10000
+#define SIM_STEP_US  10
+
+typedef double (*profile_fn)(double t); // motor speed in rev/s at time t
+
+static double prof_tracking(double t)
+{
+    // sun rate through a 3029:1 gear: 15deg/h at the output
+    (void)t;
+    return 15.0 / 3600.0 / 360.0 * 3029.0;
+}
+static double prof_slew(double t)
+{
+    (void)t;
+    return 5.0;
+}
+static double prof_step(double t)
+{
+    return t < 2.0 ? 0.0 : 2.0;
+}
+static double prof_ramp(double t)
+{
+    return 0.5 * sin(t * 2.0);
+}
+
+struct Result {
+    double rms_naive, rms_est;
+    double max_naive, max_est;
+    double lat_naive, lat_est; // time to settle within 10% after t=2s, step only
+};
+
+static Result simulate(profile_fn speed, double duration, bool step)
+{
+    VelocityEstimator est;
+    est.init();
+    double pos = 0;
+    int64_t count = 0, last_tick_count = 0, edge_us = 0;
+    double se_naive = 0, se_est = 0, max_naive = 0, max_est = 0;
+    int n = 0;
+    double lat_naive = -1, lat_est = -1;
+    // deterministic jitter on the edge spacing, quadrature channels are never perfect
+    const double phase_err[4] = {0.12, -0.08, 0.05, -0.09};
+
+    for (int64_t t = 0; t < (int64_t)(duration * 1e6); t += SIM_STEP_US) {
+        double v = speed(t * 1e-6);
+        pos += v * SIM_STEP_US * 1e-6;
+        // edge k sits at (k + phase_err[k % 4]) / cpr, count is the last edge passed
+        int64_t k = (int64_t)floor(pos * SIM_CPR) + 1;
+        while ((k + phase_err[((k % 4) + 4) % 4]) / SIM_CPR > pos) {
+            k--;
+        }
+        if (k != count) {
+            count = k;
+            edge_us = t;
+        }
+        if (t % SIM_TICK_US == 0 && t > 0) {
+            double naive = (double)(count - last_tick_count) / SIM_CPR / (SIM_TICK_US * 1e-6);
+            last_tick_count = count;
+            double e = est.update(count, edge_us, t) / SIM_CPR;
+            double tt = t * 1e-6;
+            if (tt < 1.0) {
+                continue; // let both settle
+            }
+            double en = naive - v, ee = e - v;
+            se_naive += en * en;
+            se_est += ee * ee;
+            max_naive = fmax(max_naive, fabs(en));
+            max_est = fmax(max_est, fabs(ee));
+            n++;
+            if (step && tt >= 2.0) {
+                if (lat_naive < 0 && fabs(en) < 0.1 * v) {
+                    lat_naive = tt - 2.0;
+                } else if (lat_naive >= 0 && fabs(en) >= 0.1 * v) {
+                    lat_naive = -1;
+                }
+                if (lat_est < 0 && fabs(ee) < 0.1 * v) {
+                    lat_est = tt - 2.0;
+                } else if (lat_est >= 0 && fabs(ee) >= 0.1 * v) {
+                    lat_est = -1;
+                }
+            }
+        }
+    }
+    Result r = {sqrt(se_naive / n), sqrt(se_est / n), max_naive, max_est, lat_naive, lat_est};
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    struct {
+        const char *name;
+        profile_fn fn;
+        double duration;
+        bool step;
+    } cases[] = {
+        {"tracking (0.029 rev/s)", prof_tracking, 120.0, false},
+        {"slew (5 rev/s)", prof_slew, 10.0, false},
+        {"sine (0.5 rev/s)", prof_ramp, 20.0, false},
+        {"step 0 -> 2 rev/s", prof_step, 6.0, true},
+    };
+    printf("%-24s %12s %12s %12s %12s %10s %10s\n", "case", "rms naive", "rms est", "max naive", "max est", "lat naive", "lat est");
+    for (auto &c : cases) {
+        Result r = simulate(c.fn, c.duration, c.step);
+        printf("%-24s %12.4f %12.4f %12.4f %12.4f", c.name, r.rms_naive, r.rms_est, r.max_naive, r.max_est);
+        if (c.step) {
+            for (double lat : {r.lat_naive, r.lat_est}) {
+                if (lat < 0) {
+                    printf(" %10s", "never");
+                } else {
+                    printf(" %9.3fs", lat);
+                }
+            }
+        }
+        printf("\n");
+    }
+    printf("errors in motor rev/s, latency = time until the error stays below 10%%\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,414 @@
+#include <math.h>
+#include "weather_policy.h"
+
+static const float DEG = (float)M_PI / 180.0f;
+
+static const char *s_mode_names[] = {
+#define X(name, desc) desc,
+    WEATHER_MODE_LIST
+#undef X
+};
+
+void WeatherPolicy::init(const struct weather_param *param)
+{
+    this->param = param;
+    switches = 0;
+    reset();
+}
+
+void WeatherPolicy::reset()
+{
+    mode = WEATHER_TRACK;
+    candidate = WEATHER_TRACK;
+    pending_s = 0.0f;
+    index = NAN;
+}
+
+float WeatherPolicy::clear_sky_ghi(float elevation)
+{
+    float cosz = sinf(elevation * DEG);
+    return cosz > 0.0f ? 1098.0f * cosz * expf(-0.057f / cosz) : 0.0f;
+}
+
+const char *WeatherPolicy::mode_name(weather_mode_t mode)
+{
+    return mode < WEATHER_MODE_COUNT ? s_mode_names[mode] : "Unknown";
+}
+
+weather_mode_t WeatherPolicy::update(float ghi, float elevation, float dt)
+{
+    clear_sky = clear_sky_ghi(elevation);
+    if (param == nullptr || !param->enable || !isfinite(ghi) || elevation <= 0.0f) {
+        reset();
+        return mode;
+    }
+    if (elevation < param->min_elevation) {
+        // low sun, the index mostly shows the horizon around the sensor
+        return mode;
+    }
+
+    // cloud edges focus light and push the index above 1 for a moment
+    float kt = fminf(fmaxf(ghi, 0.0f) / clear_sky, 1.5f);
+    if (isnan(index)) {
+        index = kt;
+    } else {
+        float alpha = param->tau_s > dt ? dt / param->tau_s : 1.0f;
+        index += (kt - index) * alpha;
+    }
+
+    weather_mode_t want = mode;
+    if (index >= param->clear_kt) {
+        want = WEATHER_TRACK;
+    } else if (index <= param->overcast_kt) {
+        want = WEATHER_DIFFUSE;
+    } else if (mode == WEATHER_TRACK) {
+        want = WEATHER_HOLD;
+    }
+
+    if (want == mode) {
+        candidate = mode;
+        pending_s = 0.0f;
+        return mode;
+    }
+    if (want != candidate) {
+        candidate = want;
+        pending_s = 0.0f;
+    }
+    pending_s += dt;
+    if (pending_s >= param->dwell_s) {
+        mode = want;
+        pending_s = 0.0f;
+        switches++;
+    }
+    return mode;
+}
+
+// replay irradiance traces on linux
+#if defined(__linux__) && !defined(WEATHER_POLICY_NO_MAIN)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/*
+ * Usage: weather_policy [trace.csv ...]
+ *
+ * A trace has one sample per line, `t,ghi,elevation,azimuth`: unix time or
+ * seconds, GHI in W/m2 from the level sensor, sun elevation and azimuth in
+ * degrees. Lines that do not start with a number are skipped. Without
+ * arguments synthetic days at 35N on the equinox are replayed.
+ *
+ * Each sample is one decision of Gimbal::update_task. The direct beam and
+ * the diffuse part are split from the GHI with the Erbs correlation; the
+ * panel gets the beam by the cosine of its pointing error and the diffuse
+ * light of the sky it sees. Moves cost like in the tracking policy
+ * simulation, axes are self-locking. The parameters with the most panel
+ * minus motor energy over all traces are printed.
+ */
+
+#define SIM_PANEL_M2        0.05f   // 10W panel
+#define SIM_PANEL_EFF       0.2f
+#define SIM_THRESHOLD_DEG   1.0f    // tracking policy threshold
+#define SIM_PARK_ELEVATION  3.0f
+#define SIM_STEP_S          10
+
+struct sample {
+    double t;
+    float ghi;
+    float elevation;
+    float azimuth;
+};
+
+struct trace {
+    char name[64];
+    std::vector<sample> samples;
+};
+
+struct replay_result {
+    double capture_wh;
+    double motor_wh;
+    uint32_t moves;
+    uint32_t switches;
+    double net_wh() const
+    {
+        return capture_wh - motor_wh;
+    }
+};
+
+struct axis_model {
+    float speed;        // deg/s
+    float move_w;
+    float start_j;
+};
+
+static const axis_model yaw_model = {10.0f, 2.5f, 0.4f};
+static const axis_model pitch_model = {8.0f, 3.0f, 0.5f};
+
+// pitch is the zenith angle of the panel normal, yaw its azimuth
+struct aim {
+    float pitch;
+    float yaw;
+};
+
+static float angle_between(const aim &a, const aim &b)
+{
+    float ax = sinf(a.pitch * DEG) * cosf(a.yaw * DEG), ay = sinf(a.pitch * DEG) * sinf(a.yaw * DEG), az = cosf(a.pitch * DEG);
+    float bx = sinf(b.pitch * DEG) * cosf(b.yaw * DEG), by = sinf(b.pitch * DEG) * sinf(b.yaw * DEG), bz = cosf(b.pitch * DEG);
+    float cx = ay * bz - az * by, cy = az * bx - ax * bz, cz = ax * by - ay * bx;
+    return atan2f(sqrtf(cx * cx + cy * cy + cz * cz), ax * bx + ay * by + az * bz) / DEG;
+}
+
+static float wrap180(float deg)
+{
+    deg = fmodf(deg + 180.0f, 360.0f);
+    return deg < 0 ? deg + 180.0f : deg - 180.0f;
+}
+
+static float move_energy(const axis_model &m, float deg)
+{
+    deg = fabsf(deg);
+    return deg > 0 ? m.start_j + m.move_w * deg / m.speed : 0.0f;
+}
+
+// diffuse fraction of the GHI after Erbs et al.
+static float erbs_diffuse_fraction(float ghi, float elevation)
+{
+    float kt = ghi / (1361.0f * sinf(elevation * DEG));
+    if (kt <= 0.22f) {
+        return 1.0f - 0.09f * kt;
+    }
+    if (kt <= 0.8f) {
+        return 0.9511f - 0.1604f * kt + 4.388f * kt * kt - 16.638f * kt * kt * kt + 12.336f * kt * kt * kt * kt;
+    }
+    return 0.165f;
+}
+
+static float plane_irradiance(const aim &panel, const sample &s)
+{
+    if (s.elevation <= 0 || s.ghi <= 0) {
+        return 0.0f;
+    }
+    float dhi = s.ghi * erbs_diffuse_fraction(s.ghi, s.elevation);
+    float dni = fminf((s.ghi - dhi) / sinf(s.elevation * DEG), 1100.0f);
+    aim sun = {90.0f - s.elevation, s.azimuth};
+    float beam = dni * fmaxf(cosf(angle_between(panel, sun) * DEG), 0.0f);
+    // isotropic sky, the ground reflection is left out
+    return beam + dhi * (1.0f + cosf(panel.pitch * DEG)) / 2.0f;
+}
+
+static replay_result replay(const trace &tr, const weather_param &param)
+{
+    WeatherPolicy policy;
+    policy.init(&param);
+    replay_result r = {0, 0, 0, 0};
+    aim current = {0, 180};
+    double joule = 0, capture = 0;
+
+    for (size_t i = 0; i < tr.samples.size(); i++) {
+        const sample &s = tr.samples[i];
+        float dt = i > 0 ? (float)(s.t - tr.samples[i - 1].t) : SIM_STEP_S;
+        if (!(dt > 0 && dt < 3600)) {
+            dt = SIM_STEP_S;    // gap in the log
+        }
+        weather_mode_t mode = policy.update(s.ghi, s.elevation, dt);
+
+        aim desired = {0, 180};
+        if (s.elevation > SIM_PARK_ELEVATION) {
+            desired = {90.0f - s.elevation, s.azimuth};
+            if (mode == WEATHER_DIFFUSE) {
+                desired = {0, current.yaw};
+            }
+        }
+        float threshold = mode == WEATHER_HOLD ? param.hold_deg : SIM_THRESHOLD_DEG;
+        if (angle_between(current, desired) > threshold) {
+            joule += move_energy(pitch_model, desired.pitch - current.pitch);
+            joule += move_energy(yaw_model, wrap180(desired.yaw - current.yaw));
+            current = desired;
+            r.moves++;
+        }
+        capture += plane_irradiance(current, s) * SIM_PANEL_M2 * SIM_PANEL_EFF * dt;
+    }
+    r.capture_wh = capture / 3600.0;
+    r.motor_wh = joule / 3600.0;
+    r.switches = policy.get_switches();
+    return r;
+}
+
+static bool load_trace(const char *path, trace *tr)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    snprintf(tr->name, sizeof(tr->name), "%s", strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        sample s;
+        if ((line[0] >= '0' && line[0] <= '9') || line[0] == '-') {
+            if (sscanf(line, "%lf,%f,%f,%f", &s.t, &s.ghi, &s.elevation, &s.azimuth) == 4) {
+                tr->samples.push_back(s);
+            }
+        }
+    }
+    fclose(f);
+    return !tr->samples.empty();
+}
+
+static float wrap360(float deg)
+{
+    deg = fmodf(deg, 360.0f);
+    return deg < 0 ? deg + 360.0f : deg;
+}
+
+static uint32_t s_rand = 12345;
+
+// uniform in [0, 1), fixed seed so every run replays the same days
+static float sim_rand()
+{
+    s_rand = s_rand * 1664525u + 1013904223u;
+    return (s_rand >> 8) / 16777216.0f;
+}
+
+enum sky { SKY_CLEAR, SKY_OVERCAST, SKY_BROKEN, SKY_FRONT };
+
+static void synthetic_day(trace *tr, const char *name, sky kind)
+{
+    const float lat = 35.0f * DEG, decl = 0.0f;
+    snprintf(tr->name, sizeof(tr->name), "%s", name);
+    bool cloud = false;
+    for (int t = 0; t < 24 * 3600; t += SIM_STEP_S) {
+        float h = (t / 3600.0f - 12.0f) * 15.0f * DEG;
+        float el = asinf(sinf(lat) * sinf(decl) + cosf(lat) * cosf(decl) * cosf(h));
+        float az = atan2f(sinf(h), cosf(h) * sinf(lat) - tanf(decl) * cosf(lat)) / DEG + 180.0f;
+
+        float kt = 1.0f;
+        switch (kind) {
+        case SKY_CLEAR:
+            kt = 0.98f + 0.04f * sim_rand();
+            break;
+        case SKY_OVERCAST:
+            kt = 0.22f + 0.06f * sim_rand();
+            break;
+        case SKY_BROKEN:
+            // cumulus, clouds last 3 minutes and gaps 5 minutes on average
+            if (sim_rand() < (cloud ? SIM_STEP_S / 180.0f : SIM_STEP_S / 300.0f)) {
+                cloud = !cloud;
+            }
+            kt = cloud ? 0.3f + 0.1f * sim_rand() : 1.05f + 0.1f * sim_rand();
+            break;
+        case SKY_FRONT:
+            // clear morning, overcast from 13h
+            kt = t < 13 * 3600 ? 0.98f + 0.04f * sim_rand() : 0.22f + 0.06f * sim_rand();
+            break;
+        }
+        sample s = {(double)t, kt * WeatherPolicy::clear_sky_ghi(el / DEG), el / DEG, wrap360(az)};
+        tr->samples.push_back(s);
+    }
+}
+
+static void print_row(const char *trace_name, const char *policy, const replay_result &r)
+{
+    printf("  %-14s %-8s %9.2f %8.3f %6u %8u %9.2f\n", trace_name, policy,
+           r.capture_wh, r.motor_wh, r.moves, r.switches, r.net_wh());
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<trace> traces;
+    for (int i = 1; i < argc; i++) {
+        trace tr;
+        if (!load_trace(argv[i], &tr)) {
+            return 2;
+        }
+        traces.push_back(tr);
+    }
+    bool synthetic = traces.empty();
+    if (synthetic) {
+        const char *names[] = {"clear", "overcast", "broken", "front"};
+        const sky kinds[] = {SKY_CLEAR, SKY_OVERCAST, SKY_BROKEN, SKY_FRONT};
+        for (int i = 0; i < 4; i++) {
+            trace tr;
+            synthetic_day(&tr, names[i], kinds[i]);
+            traces.push_back(tr);
+        }
+    }
+
+    // same defaults as Setting::upgrade()
+    const weather_param track_only = {0.6f, 0.3f, 120.0f, 300.0f, 10.0f, 5.0f, 0};
+    const weather_param defaults = {0.6f, 0.3f, 120.0f, 300.0f, 10.0f, 5.0f, 1};
+
+    int failures = 0;
+    double base_net = 0, default_net = 0;
+    printf("  %-14s %-8s %9s %8s %6s %8s %9s\n", "trace", "policy", "panel Wh", "motor Wh", "moves", "switches", "net Wh");
+    for (size_t i = 0; i < traces.size(); i++) {
+        replay_result base = replay(traces[i], track_only);
+        replay_result def = replay(traces[i], defaults);
+        print_row(traces[i].name, "track", base);
+        print_row(traces[i].name, "weather", def);
+        base_net += base.net_wh();
+        default_net += def.net_wh();
+
+        if (!synthetic) {
+            continue;
+        }
+        const char *name = traces[i].name;
+        if (strcmp(name, "clear") == 0 && (def.switches != 0 || def.net_wh() < base.net_wh() * 0.999)) {
+            printf("    a clear sky has to be tracked\n");
+            failures++;
+        }
+        if ((strcmp(name, "overcast") == 0 || strcmp(name, "front") == 0) && def.net_wh() <= base.net_wh()) {
+            printf("    no gain under overcast\n");
+            failures++;
+        }
+        // switching between Track and Hold is free, flapping into Diffuse is not
+        if (strcmp(name, "broken") == 0 && (def.moves > base.moves || def.net_wh() < base.net_wh() * 0.995)) {
+            printf("    broken clouds cost energy\n");
+            failures++;
+        }
+    }
+
+    // search the hysteresis on all traces together
+    const float clear_kts[] = {0.5f, 0.6f, 0.7f, 0.8f};
+    const float overcast_kts[] = {0.2f, 0.3f, 0.4f, 0.5f};
+    const float taus[] = {30.0f, 120.0f, 300.0f};
+    const float dwells[] = {0.0f, 120.0f, 300.0f, 600.0f, 1200.0f};
+    const float holds[] = {2.0f, 5.0f, 10.0f};
+    weather_param best = defaults;
+    double best_net = default_net;
+    for (float clear_kt : clear_kts) {
+        for (float overcast_kt : overcast_kts) {
+            if (overcast_kt >= clear_kt) {
+                continue;
+            }
+            for (float tau : taus) {
+                for (float dwell : dwells) {
+                    for (float hold : holds) {
+                        weather_param p = {clear_kt, overcast_kt, tau, dwell, 10.0f, hold, 1};
+                        double net = 0;
+                        for (size_t i = 0; i < traces.size(); i++) {
+                            net += replay(traces[i], p).net_wh();
+                        }
+                        if (net > best_net) {
+                            best_net = net;
+                            best = p;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    printf("net over all traces: track %.2fWh, defaults %.2fWh, best %.2fWh\n", base_net, default_net, best_net);
+    printf("best: clear %.2f overcast %.2f tau %.0fs dwell %.0fs hold %.1fdeg\n",
+           best.clear_kt, best.overcast_kt, best.tau_s, best.dwell_s, best.hold_deg);
+
+    if (synthetic && default_net <= base_net) {
+        printf("the defaults lose energy over tracking\n");
+        failures++;
+    }
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+   Weather aware tracking.
+
+   Tracking pays off for the direct beam only. Under an overcast sky the
+   light is diffuse, a tracking panel tilted towards the hidden sun sees
+   less of the sky than a level one and the motors run for nothing.
+
+   A level light sensor measures the global horizontal irradiance (GHI).
+   Divided by the clear sky GHI for the sun elevation it gives the clear sky
+   index, about 1 in sunshine and 0.2-0.4 under overcast. The index is low
+   pass filtered and the policy picks one of
+   - Track: follow the ephemeris,
+   - Diffuse: face the zenith, where the panel sees the whole sky,
+   - Hold: partly cloudy, keep the aim until it is off by hold_deg.
+   Going up from Diffuse needs clear_kt and going down from Track needs
+   overcast_kt, so a sky in between does not make the gimbal flap. A new
+   mode also has to be wanted for dwell_s before it is taken.
+
+   The policy does not depend on ESP-IDF. The __linux__ section of
+   weather_policy.cpp replays irradiance traces, logged ones given as CSV
+   files or synthetic days, and searches the thresholds and the dwell time
+   for the most net energy.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define WEATHER_MODE_LIST \
+X(WEATHER_TRACK, "Track") \
+X(WEATHER_DIFFUSE, "Diffuse") \
+X(WEATHER_HOLD, "Hold") \
+
+typedef enum {
+#define X(name, desc) name,
+    WEATHER_MODE_LIST
+#undef X
+    WEATHER_MODE_COUNT
+} weather_mode_t;
+
+struct weather_param {
+    float clear_kt;         // clear sky index to resume tracking
+    float overcast_kt;      // clear sky index to go diffuse, below clear_kt
+    float tau_s;            // low pass of the index
+    float dwell_s;          // a new mode has to be wanted this long
+    float min_elevation;    // degrees, below it the index is unreliable and the mode is kept
+    float hold_deg;         // in Hold re-aim only when the error exceeds it
+    uint8_t enable;
+};
+
+class WeatherPolicy {
+public:
+    WeatherPolicy() = default;
+
+    void init(const struct weather_param *param);
+
+    /**
+     * @brief Feed one irradiance sample
+     * @param ghi W/m2 on a level sensor, NAN without a sensor
+     * @param elevation sun elevation in degrees
+     * @param dt s since the last update
+     * @return mode to follow
+     */
+    weather_mode_t update(float ghi, float elevation, float dt);
+
+    weather_mode_t get_mode() const
+    {
+        return mode;
+    }
+    // filtered clear sky index, NAN if there is none
+    float get_index() const
+    {
+        return index;
+    }
+    float get_clear_sky() const
+    {
+        return clear_sky;
+    }
+    uint32_t get_switches() const
+    {
+        return switches;
+    }
+
+    /**
+     * @brief Clear sky GHI after Haurwitz, W/m2
+     */
+    static float clear_sky_ghi(float elevation);
+
+    static const char *mode_name(weather_mode_t mode);
+
+private:
+    const struct weather_param *param = nullptr;
+    weather_mode_t mode = WEATHER_TRACK;
+    weather_mode_t candidate = WEATHER_TRACK;
+    float pending_s = 0.0f;
+    float index = 0.0f;
+    float clear_sky = 0.0f;
+    uint32_t switches = 0;
+    void reset();
+};
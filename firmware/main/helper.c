@@ -82,6 +82,28 @@ OPEN_FAIL:
     return ret;
 }
 
+esp_err_t iot_param_load_size(const char *space_name, const char *key, void *dest, size_t *length)
+{
+    esp_err_t ret = ESP_ERR_INVALID_ARG;
+    HELPER_CHECK_GT(NULL != space_name, "Pointer of space_name is invalid", OPEN_FAIL);
+    HELPER_CHECK_GT(NULL != key, "Pointer of key is invalid", OPEN_FAIL);
+    HELPER_CHECK_GT(NULL != dest, "Pointer of dest is invalid", OPEN_FAIL);
+    HELPER_CHECK_GT(NULL != length, "Pointer of length is invalid", OPEN_FAIL);
+    nvs_handle_t my_handle;
+    ret = nvs_open(space_name, NVS_READWRITE, &my_handle);
+    HELPER_CHECK_GT(ESP_OK == ret, "nvs open failed", OPEN_FAIL);
+    // fails with ESP_ERR_NVS_INVALID_LENGTH for a blob larger than dest
+    ret = nvs_get_blob(my_handle, key, dest, length);
+    if (ESP_OK == ret && *length == 0) {
+        ESP_LOGW(TAG, "the target you want to load has never been saved");
+        ret = ESP_FAIL;
+    }
+    nvs_close(my_handle);
+
+OPEN_FAIL:
+    return ret;
+}
+
 esp_err_t iot_param_erase(const char *space_name, const char *key)
 {
     esp_err_t ret = ESP_ERR_INVALID_ARG;
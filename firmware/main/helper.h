@@ -16,6 +16,12 @@ esp_err_t iot_param_save(const char* space_name, const char* key, void *param, u
 
 esp_err_t iot_param_load(const char* space_name, const char* key, void* dest);
 
+/**
+ * @brief Load a blob of at most *length bytes
+ * @param length size of dest, the size of the blob on return
+ */
+esp_err_t iot_param_load_size(const char* space_name, const char* key, void* dest, size_t *length);
+
 esp_err_t iot_param_erase(const char* space_name, const char* key);
 
 int restart_count_get();
@@ -0,0 +1,611 @@
+#include <string.h>
+#include <math.h>
+#include "history.h"
+
+HistoryDownsampler::HistoryDownsampler(uint32_t from, uint32_t to, int points, history_emit_t emit, void *ctx)
+    : from(from), emit(emit), ctx(ctx)
+{
+    points = points < HISTORY_MIN_POINTS ? HISTORY_MIN_POINTS : points > HISTORY_MAX_POINTS ? HISTORY_MAX_POINTS : points;
+    // the first and the last point have a record of their own
+    buckets = points - 2;
+    width = ((double)to - from + 1) / buckets;
+    clear(*current, -1);
+    clear(*next, -1);
+}
+
+void HistoryDownsampler::clear(bucket_t &bucket, int64_t index)
+{
+    bucket.index = index;
+    for (hull_t &hull : bucket.hull) {
+        hull.upper_count = 0;
+        hull.lower_count = 0;
+        hull.sum_t = 0;
+        hull.sum_v = 0;
+        hull.count = 0;
+    }
+}
+
+bool HistoryDownsampler::visit(const tslog_point_t *point, int, void *ctx)
+{
+    return ((HistoryDownsampler *)ctx)->add(*point);
+}
+
+bool HistoryDownsampler::add(const tslog_point_t &point)
+{
+    if (stopped) {
+        return false;
+    }
+    if (!started) {
+        started = true;
+        emit_point(point);
+        for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+            if (!isnan(point.value[c])) {
+                kept[c] = {point.time, point.value[c]};
+                has_kept[c] = true;
+            }
+        }
+        return !stopped;
+    }
+    // the one before goes into a bucket, this one may be the last
+    if (has_pending) {
+        insert(pending);
+    }
+    pending = point;
+    has_pending = true;
+    return !stopped;
+}
+
+void HistoryDownsampler::insert(const tslog_point_t &point)
+{
+    int64_t index = (int64_t)((point.time - from) / width);
+    index = index < 0 ? 0 : index >= buckets ? buckets - 1 : index;
+    if (current->index < 0) {
+        current->index = index;
+    }
+    bucket_t *bucket = current;
+    if (index != current->index) {
+        if (next->index >= 0 && index != next->index) {
+            // a third bucket: the one after the current is complete
+            decide(*current, next);
+            bucket_t *done = current;
+            current = next;
+            next = done;
+            clear(*next, -1);
+        }
+        next->index = index;
+        bucket = next;
+    }
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        if (isnan(point.value[c])) {
+            continue;
+        }
+        hull_t &hull = bucket->hull[c];
+        vertex_t p = {point.time, point.value[c]};
+        push(hull.upper, &hull.upper_count, p, true);
+        push(hull.lower, &hull.lower_count, p, false);
+        hull.sum_t += (double)(point.time - from);
+        hull.sum_v += point.value[c];
+        hull.count++;
+    }
+}
+
+// z of (a - o) x (b - o)
+static double cross(uint32_t ot, float ov, uint32_t at, float av, uint32_t bt, float bv)
+{
+    return ((double)at - ot) * ((double)bv - ov) - ((double)av - ov) * ((double)bt - ot);
+}
+
+void HistoryDownsampler::push(vertex_t *chain, uint8_t *count, const vertex_t &p, bool upper)
+{
+    int n = *count;
+    while (n >= 2) {
+        double turn = cross(chain[n - 2].time, chain[n - 2].v, chain[n - 1].time, chain[n - 1].v, p.time, p.v);
+        if (upper ? turn < 0 : turn > 0) {
+            break;
+        }
+        n--;
+    }
+    if (n == HISTORY_HULL_MAX) {
+        // the vertex making the smallest triangle with its neighbours goes
+        int flattest = 1;
+        double smallest = INFINITY;
+        for (int i = 1; i < n - 1; i++) {
+            double area = fabs(cross(chain[i - 1].time, chain[i - 1].v, chain[i].time, chain[i].v,
+                                     chain[i + 1].time, chain[i + 1].v));
+            if (area < smallest) {
+                smallest = area;
+                flattest = i;
+            }
+        }
+        memmove(&chain[flattest], &chain[flattest + 1], (n - flattest - 1) * sizeof(vertex_t));
+        n--;
+    }
+    chain[n++] = p;
+    *count = n;
+    hull_peak = n > hull_peak ? n : hull_peak;
+}
+
+// the triangle of a kept point, a candidate and the mean of the bucket after
+void HistoryDownsampler::decide(const bucket_t &bucket, const bucket_t *after)
+{
+    history_record_t record;
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        const hull_t &hull = bucket.hull[c];
+        record.time[c] = 0;
+        record.value[c] = NAN;
+        if (hull.count == 0) {
+            continue;
+        }
+        // the mean after: of the next bucket, the last point after the last bucket, else its own
+        double ct = hull.sum_t / hull.count, cv = hull.sum_v / hull.count;
+        if (after != nullptr && after->hull[c].count > 0) {
+            ct = after->hull[c].sum_t / after->hull[c].count;
+            cv = after->hull[c].sum_v / after->hull[c].count;
+        } else if (after == nullptr && has_pending && !isnan(pending.value[c])) {
+            ct = (double)(pending.time - from);
+            cv = pending.value[c];
+        }
+        const vertex_t &a = has_kept[c] ? kept[c] : hull.upper[0];
+        double at = (double)a.time - from;
+        double best = -1;
+        vertex_t pick = hull.upper[0];
+        for (int side = 0; side < 2; side++) {
+            const vertex_t *chain = side == 0 ? hull.upper : hull.lower;
+            int n = side == 0 ? hull.upper_count : hull.lower_count;
+            for (int i = 0; i < n; i++) {
+                double bt = (double)chain[i].time - from;
+                double area = fabs((at - ct) * ((double)chain[i].v - a.v) - (at - bt) * (cv - a.v));
+                if (area > best || (area == best && chain[i].time < pick.time)) {
+                    best = area;
+                    pick = chain[i];
+                }
+            }
+        }
+        record.time[c] = pick.time;
+        record.value[c] = pick.v;
+        kept[c] = pick;
+        has_kept[c] = true;
+    }
+    emit_record(record);
+}
+
+void HistoryDownsampler::emit_point(const tslog_point_t &point)
+{
+    history_record_t record;
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        record.time[c] = isnan(point.value[c]) ? 0 : point.time;
+        record.value[c] = point.value[c];
+    }
+    emit_record(record);
+}
+
+void HistoryDownsampler::emit_record(const history_record_t &record)
+{
+    if (stopped) {
+        return;
+    }
+    records++;
+    stopped = !emit(&record, ctx);
+}
+
+void HistoryDownsampler::finish()
+{
+    if (!started) {
+        return;
+    }
+    if (current->index >= 0) {
+        if (next->index >= 0) {
+            decide(*current, next);
+            decide(*next, nullptr);
+        } else {
+            decide(*current, nullptr);
+        }
+    }
+    if (has_pending) {
+        emit_point(pending);
+    }
+    clear(*current, -1);
+    clear(*next, -1);
+    started = false;
+    has_pending = false;
+}
+
+#ifndef __linux__
+
+bool history_range(uint32_t *from, uint32_t *to)
+{
+    tslog_stats_t stats;
+    if (!tslog_get_stats(&stats)) {
+        return false;
+    }
+    uint32_t oldest = UINT32_MAX, newest = 0;
+    for (const tslog_tier_stats_t &tier : stats.tier) {
+        if (tier.oldest != 0 && tier.oldest < oldest) {
+            oldest = tier.oldest;
+        }
+        newest = tier.newest > newest ? tier.newest : newest;
+    }
+    *from = *from > oldest ? *from : oldest;
+    *to = *to < newest ? *to : newest;
+    return *from <= *to;
+}
+
+int history_downsample(uint32_t from, uint32_t to, int points, history_emit_t emit, void *ctx)
+{
+    // 4 KB of hulls, more than the stack of a worker should hold
+    HistoryDownsampler *down = new HistoryDownsampler(from, to, points, emit, ctx);
+    tslog_query(from, to, HistoryDownsampler::visit, down);
+    down->finish();
+    int records = down->get_records();
+    delete down;
+    return records;
+}
+
+#endif
+
+// run test on linux, HISTORY_NO_MAIN when linked into another program
+#if defined(__linux__) && !defined(HISTORY_NO_MAIN)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+/*
+ * Test and benchmark over a TsLog on a RAM flash. The streaming pass is
+ * compared with LTTB over the same buckets with every point in memory,
+ * the response with the JSON of GET /api/v1/log for the same range.
+ *
+ *   g++ -std=c++17 -O2 -DTSLOG_NO_MAIN history.cpp tslog.cpp
+ */
+
+#define TEST_START          1735689600  // 2025-01-01 00:00 UTC
+#define TEST_PERIOD_S       10
+#define TEST_DAYS           90
+#define TEST_SPIKE          (TEST_START + 80 * 86400 + 12 * 3600 + 70)
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("  %s\n", what);
+        failures++;
+    }
+}
+
+struct ram_flash {
+    std::vector<uint8_t> data = std::vector<uint8_t>(1024 * 1024, 0xff);
+    long read_bytes = 0;
+};
+
+static bool ram_read(void *ctx, size_t offset, void *dst, size_t size)
+{
+    ram_flash *f = (ram_flash *)ctx;
+    f->read_bytes += size;
+    memcpy(dst, f->data.data() + offset, size);
+    return true;
+}
+
+static bool ram_write(void *ctx, size_t offset, const void *src, size_t size)
+{
+    ram_flash *f = (ram_flash *)ctx;
+    for (size_t i = 0; i < size; i++) {
+        f->data[offset + i] &= ((const uint8_t *)src)[i];
+    }
+    return true;
+}
+
+static bool ram_erase(void *ctx, size_t offset, size_t size)
+{
+    memset(((ram_flash *)ctx)->data.data() + offset, 0xff, size);
+    return true;
+}
+
+static float noise(uint32_t t, int channel)
+{
+    uint32_t x = t * 2654435761u ^ (channel + 1) * 40503u;
+    x ^= x >> 15;
+    x *= 2246822519u;
+    x ^= x >> 13;
+    return (x & 0xffff) / 65536.0f - 0.5f;
+}
+
+// a tracker over a day, with a brownout and the IMU missing an hour a day
+static tslog_point_t signal(uint32_t t)
+{
+    float day = (t % 86400) / 86400.0f;
+    bool sun = day > 0.25f && day < 0.75f;
+    float sine = sinf(2 * (float)M_PI * (day - 0.25f));
+    tslog_point_t p;
+    p.time = t;
+    p.value[TSLOG_VOLTAGE] = t == TEST_SPIKE ? 9.8f : 12.4f + 0.4f * sine + 0.03f * noise(t, 0);
+    p.value[TSLOG_POINTING_ERROR] = sun ? 0.1f * ((t / TEST_PERIOD_S) % 12) / 12.0f + 0.004f * noise(t, 1) : 0;
+    p.value[TSLOG_MOTOR_POWER] = sun && (t / TEST_PERIOD_S) % 12 == 0 ? 0.6f + 0.1f * noise(t, 2) : 0;
+    p.value[TSLOG_TEMPERATURE] = t % 86400 >= 7200 && t % 86400 < 10800 ? NAN : 18 + 9 * sine + 0.2f * noise(t, 3);
+    return p;
+}
+
+static bool collect_point(const tslog_point_t *point, int, void *ctx)
+{
+    ((std::vector<tslog_point_t> *)ctx)->push_back(*point);
+    return true;
+}
+
+static bool collect_record(const history_record_t *record, void *ctx)
+{
+    ((std::vector<history_record_t> *)ctx)->push_back(*record);
+    return true;
+}
+
+// LTTB over the same buckets with every point at hand
+static std::vector<history_record_t> reference(const std::vector<tslog_point_t> &pts, uint32_t from, uint32_t to,
+        int points)
+{
+    std::vector<history_record_t> out;
+    auto whole = [&](const tslog_point_t & p) {
+        history_record_t r;
+        for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+            r.time[c] = isnan(p.value[c]) ? 0 : p.time;
+            r.value[c] = p.value[c];
+        }
+        out.push_back(r);
+    };
+    if (pts.empty()) {
+        return out;
+    }
+    whole(pts.front());
+    if (pts.size() == 1) {
+        return out;
+    }
+    int buckets = points - 2;
+    double width = ((double)to - from + 1) / buckets;
+    std::vector<std::vector<tslog_point_t>> groups;
+    int64_t last_index = -1;
+    for (size_t i = 1; i + 1 < pts.size(); i++) {
+        int64_t index = (int64_t)((pts[i].time - from) / width);
+        index = index < 0 ? 0 : index >= buckets ? buckets - 1 : index;
+        if (index != last_index) {
+            groups.emplace_back();
+            last_index = index;
+        }
+        groups.back().push_back(pts[i]);
+    }
+    const tslog_point_t &last = pts.back();
+    bool has_a[TSLOG_CHANNEL_COUNT] = {};
+    uint32_t a_time[TSLOG_CHANNEL_COUNT] = {};
+    float a_value[TSLOG_CHANNEL_COUNT] = {};
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        if (!isnan(pts.front().value[c])) {
+            has_a[c] = true;
+            a_time[c] = pts.front().time;
+            a_value[c] = pts.front().value[c];
+        }
+    }
+    auto mean = [&](const std::vector<tslog_point_t> &g, int c, double * t, double * v) {
+        double st = 0, sv = 0;
+        int n = 0;
+        for (const tslog_point_t &p : g) {
+            if (!isnan(p.value[c])) {
+                st += (double)(p.time - from);
+                sv += p.value[c];
+                n++;
+            }
+        }
+        *t = st / n;
+        *v = sv / n;
+        return n;
+    };
+    for (size_t g = 0; g < groups.size(); g++) {
+        history_record_t r;
+        for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+            r.time[c] = 0;
+            r.value[c] = NAN;
+            double ct, cv;
+            if (mean(groups[g], c, &ct, &cv) == 0) {
+                continue;
+            }
+            double nt, nv;
+            if (g + 1 < groups.size()) {
+                if (mean(groups[g + 1], c, &nt, &nv) > 0) {
+                    ct = nt;
+                    cv = nv;
+                }
+            } else if (!isnan(last.value[c])) {
+                ct = (double)(last.time - from);
+                cv = last.value[c];
+            }
+            const tslog_point_t *first = nullptr;
+            for (const tslog_point_t &p : groups[g]) {
+                if (!isnan(p.value[c])) {
+                    first = first == nullptr ? &p : first;
+                }
+            }
+            uint32_t at_time = has_a[c] ? a_time[c] : first->time;
+            float av = has_a[c] ? a_value[c] : first->value[c];
+            double at = (double)at_time - from;
+            double best = -1;
+            const tslog_point_t *pick = nullptr;
+            for (const tslog_point_t &p : groups[g]) {
+                if (isnan(p.value[c])) {
+                    continue;
+                }
+                double bt = (double)p.time - from;
+                double area = fabs((at - ct) * ((double)p.value[c] - av) - (at - bt) * (cv - av));
+                if (area > best) {
+                    best = area;
+                    pick = &p;
+                }
+            }
+            r.time[c] = pick->time;
+            r.value[c] = pick->value[c];
+            has_a[c] = true;
+            a_time[c] = pick->time;
+            a_value[c] = pick->value[c];
+        }
+        out.push_back(r);
+    }
+    whole(last);
+    return out;
+}
+
+static bool same_records(const std::vector<history_record_t> &a, const std::vector<history_record_t> &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+            if (a[i].time[c] != b[i].time[c]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static std::vector<history_record_t> downsample(TsLog &log, uint32_t from, uint32_t to, int points, int *hull_peak)
+{
+    std::vector<history_record_t> out;
+    HistoryDownsampler down(from, to, points, collect_record, &out);
+    log.query(from, to, HistoryDownsampler::visit, &down);
+    down.finish();
+    *hull_peak = down.get_hull_peak();
+    return out;
+}
+
+// the JSON of GET /api/v1/log for a point
+static bool json_size(const tslog_point_t *point, int tier, void *ctx)
+{
+    char text[96];
+    int n = snprintf(text, sizeof(text), ",[%lu,%d", (unsigned long)point->time, tier);
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        n += isnan(point->value[c]) ? snprintf(text + n, sizeof(text) - n, ",null")
+             : snprintf(text + n, sizeof(text) - n, ",%g", point->value[c]);
+    }
+    *(size_t *)ctx += n + 1;
+    return true;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    ram_flash f;
+    TsLog log;
+    check(log.open({f.data.size(), ram_read, ram_write, ram_erase, &f}, TEST_PERIOD_S), "open");
+    uint32_t end = TEST_START + TEST_DAYS * 86400;
+    for (uint32_t t = TEST_START; t < end; t += TEST_PERIOD_S) {
+        log.add(signal(t));
+    }
+    log.flush();
+    uint32_t now = end - TEST_PERIOD_S;
+
+    static const struct {
+        const char *name;
+        uint32_t span;
+    } ranges[] = {
+        {"hour", 3600}, {"day", 86400}, {"week", 7 * 86400}, {"30 days", 30 * 86400}, {"everything", 0},
+    };
+    static const int budgets[] = {3, 100, 800, 2000};
+    int peak = 0;
+    for (const auto &r : ranges) {
+        uint32_t from = r.span == 0 ? TEST_START : now - r.span + 1;
+        std::vector<tslog_point_t> pts;
+        log.query(from, now, collect_point, &pts);
+        for (int points : budgets) {
+            int hull_peak;
+            std::vector<history_record_t> got = downsample(log, from, now, points, &hull_peak);
+            peak = hull_peak > peak ? hull_peak : peak;
+            char what[96];
+            snprintf(what, sizeof(what), "%s in %d points as LTTB with every point at hand", r.name, points);
+            check(same_records(got, reference(pts, from, now, points)), what);
+            snprintf(what, sizeof(what), "%s in %d points: within the budget, in order", r.name, points);
+            bool ordered = (int)got.size() <= points;
+            for (size_t i = 1; i < got.size(); i++) {
+                for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+                    ordered &= got[i].time[c] == 0 || got[i].time[c] > got[i - 1].time[c] || got[i - 1].time[c] == 0;
+                }
+            }
+            check(ordered, what);
+        }
+    }
+
+    // fewer points than the budget come back as they are
+    std::vector<tslog_point_t> hour;
+    log.query(now - 3599, now, collect_point, &hour);
+    int hull_peak;
+    std::vector<history_record_t> all = downsample(log, now - 3599, now, 2000, &hull_peak);
+    check(all.size() == hour.size() && all[17].time[0] == hour[17].time, "a short range is not thinned");
+
+    // the brownout is one sample in a month
+    std::vector<history_record_t> month = downsample(log, now - 30 * 86400 + 1, now, 300, &hull_peak);
+    bool spike = false;
+    for (const history_record_t &r : month) {
+        spike |= r.time[TSLOG_VOLTAGE] == TEST_SPIKE && r.value[TSLOG_VOLTAGE] < 10;
+    }
+    check(spike, "a single sample brownout survives 30 days in 300 points");
+
+    std::vector<history_record_t> few;
+    HistoryDownsampler down(now - 86399, now, 800, [](const history_record_t *, void *ctx) {
+        return ++*(int *)ctx < 5;
+    }, &(hull_peak = 0));
+    log.query(now - 86399, now, HistoryDownsampler::visit, &down);
+    down.finish();
+    check(down.get_records() == 5, "the emitter stops the pass");
+
+    // a smooth curve puts every point on the hull, the cap keeps the pick close
+    {
+        const int n = 20000;
+        std::vector<tslog_point_t> curve(n);
+        for (int i = 0; i < n; i++) {
+            curve[i].time = TEST_START + i;
+            for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+                float x = (float)i / n;
+                curve[i].value[c] = c % 2 ? x * x : sinf(3 * x * (float)M_PI);
+            }
+        }
+        std::vector<history_record_t> got;
+        HistoryDownsampler smooth(TEST_START, TEST_START + n - 1, 12, collect_record, &got);
+        for (const tslog_point_t &p : curve) {
+            smooth.add(p);
+        }
+        smooth.finish();
+        std::vector<history_record_t> want = reference(curve, TEST_START, TEST_START + n - 1, 12);
+        bool close = got.size() == want.size() && smooth.get_hull_peak() == HISTORY_HULL_MAX;
+        for (size_t i = 0; close && i < got.size(); i++) {
+            for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+                // of the span of the channel
+                close &= fabsf(got[i].value[c] - want[i].value[c]) < (c % 2 ? 0.01f : 0.02f);
+            }
+        }
+        check(close, "capped hulls of a smooth curve pick within 1% of the exact LTTB");
+    }
+
+    printf("%d days at %ds, hulls peaked at %d of %d vertices\n", TEST_DAYS, TEST_PERIOD_S, peak, HISTORY_HULL_MAX);
+    printf("range        points in  records  binary    JSON of /log  flash read  host time\n");
+    for (const auto &r : ranges) {
+        uint32_t from = r.span == 0 ? TEST_START : now - r.span + 1;
+        size_t json = 0;
+        int raw = log.query(from, now, json_size, &json);
+        const int repeat = 10;
+        f.read_bytes = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<history_record_t> got;
+        for (int i = 0; i < repeat; i++) {
+            got = downsample(log, from, now, 800, &hull_peak);
+        }
+        double us = seconds_since(t0) * 1e6 / repeat;
+        size_t binary = sizeof(history_header_t) + got.size() * sizeof(history_record_t);
+        printf("%-11s  %9d  %7zu  %5.1f KB  %9.1f KB  %7.1f KB  %7.0f us\n", r.name, raw, got.size(), binary / 1024.0,
+               json / 1024.0, f.read_bytes / repeat / 1024.0, us);
+    }
+
+    printf(failures ? "FAILED\n" : "all checks passed\n");
+    return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+   Downsampling of the tslog.h history for charts.
+
+   A chart of a day or a week shows a few hundred points, the store holds
+   tens of thousands for it. The range is cut into buckets of equal time,
+   and largest-triangle-three-buckets (LTTB) keeps for every channel the
+   point of each bucket that makes the largest triangle with the point kept
+   in the bucket before and the mean of the bucket after, plus the first
+   and the last point of the range. Spikes and turns survive, flat stretches
+   cost nothing.
+
+   The points come in a single pass of tslog_query() and are not kept. The
+   area of the triangle is, for a given point before and mean after, a
+   linear function of the candidate, so its largest value is at a vertex of
+   the convex hull of the bucket: each bucket keeps only its upper and lower
+   hull, built as the points arrive (monotone chain), and is decided once
+   the next bucket is complete. A hull longer than HISTORY_HULL_MAX, a
+   smooth curve rather than noise, drops its flattest vertex.
+
+   The result is binary for the dashboard to map as typed arrays: a
+   history_header_t, then one history_record_t per bucket, little endian.
+   Channels without a value in a bucket have time 0 and NAN.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tslog.h"
+
+#define HISTORY_MAGIC           0x31485354  // "TSH1"
+#define HISTORY_VERSION         1
+#define HISTORY_HULL_MAX        32          // vertices of one side of a bucket's hull
+#define HISTORY_MIN_POINTS      3
+#define HISTORY_MAX_POINTS      2000
+
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t channels;           // TSLOG_CHANNEL_COUNT, in the order of TSLOG_CHANNEL_LIST
+    uint16_t record_size;       // sizeof(history_record_t)
+    uint32_t from, to;          // the range asked for
+} history_header_t;
+
+typedef struct {
+    uint32_t time[TSLOG_CHANNEL_COUNT];     // of the point kept for each channel
+    float value[TSLOG_CHANNEL_COUNT];
+} history_record_t;
+
+// called with each record in time order, return false to stop
+typedef bool (*history_emit_t)(const history_record_t *record, void *ctx);
+
+class HistoryDownsampler {
+public:
+    /**
+     * @param points most records to emit, first and last point included
+     */
+    HistoryDownsampler(uint32_t from, uint32_t to, int points, history_emit_t emit, void *ctx);
+    bool add(const tslog_point_t &point);
+    /**
+     * @brief Decide the buckets still open and emit the last point
+     */
+    void finish();
+    int get_records() const
+    {
+        return records;
+    }
+    int get_hull_peak() const
+    {
+        return hull_peak;
+    }
+
+    /**
+     * @brief The visitor of tslog_query(), ctx being a HistoryDownsampler
+     */
+    static bool visit(const tslog_point_t *point, int tier, void *ctx);
+
+private:
+    struct vertex_t {
+        uint32_t time;
+        float v;
+    };
+    struct hull_t {
+        vertex_t upper[HISTORY_HULL_MAX];
+        vertex_t lower[HISTORY_HULL_MAX];
+        uint8_t upper_count, lower_count;
+        double sum_t, sum_v;    // for the mean, time from the start of the range
+        uint32_t count;
+    };
+    struct bucket_t {
+        int64_t index;          // -1 for none
+        hull_t hull[TSLOG_CHANNEL_COUNT];
+    };
+
+    void insert(const tslog_point_t &point);
+    void push(vertex_t *chain, uint8_t *count, const vertex_t &p, bool upper);
+    void decide(const bucket_t &bucket, const bucket_t *after);
+    void emit_point(const tslog_point_t &point);
+    void emit_record(const history_record_t &record);
+    static void clear(bucket_t &bucket, int64_t index);
+
+    uint32_t from;
+    double width;               // of a bucket, s
+    int buckets;
+    history_emit_t emit;
+    void *ctx;
+    bool started = false;
+    bool stopped = false;
+    tslog_point_t pending = {};             // the last point so far, kept out of the buckets
+    bool has_pending = false;
+    vertex_t kept[TSLOG_CHANNEL_COUNT];     // the point kept in the bucket before, the 'A' of the triangle
+    bool has_kept[TSLOG_CHANNEL_COUNT] = {};
+    bucket_t pair[2];
+    bucket_t *current = &pair[0];           // the bucket to decide
+    bucket_t *next = &pair[1];              // the bucket after it, being filled
+    int records = 0;
+    int hull_peak = 0;
+};
+
+/**
+ * @brief Narrow a range to the history held, false when nothing is left
+ */
+bool history_range(uint32_t *from, uint32_t *to);
+
+/**
+ * @brief Downsample a range of the history in one pass over the store
+ * @return records emitted
+ */
+int history_downsample(uint32_t from, uint32_t to, int points, history_emit_t emit, void *ctx);
@@ -53,6 +53,29 @@ Mahony::Mahony()
 	invSampleFreq = 1.0f / DEFAULT_SAMPLE_FREQ;
 }
 
+void Mahony::getState(float *state) const
+{
+	state[0] = q0;
+	state[1] = q1;
+	state[2] = q2;
+	state[3] = q3;
+	state[4] = integralFBx;
+	state[5] = integralFBy;
+	state[6] = integralFBz;
+}
+
+void Mahony::setState(const float *state)
+{
+	q0 = state[0];
+	q1 = state[1];
+	q2 = state[2];
+	q3 = state[3];
+	integralFBx = state[4];
+	integralFBy = state[5];
+	integralFBz = state[6];
+	anglesComputed = 0;
+}
+
 void Mahony::update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
 {
 	float recipNorm;
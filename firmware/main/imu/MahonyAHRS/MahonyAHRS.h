@@ -37,6 +37,9 @@ public:
 	void begin(float sampleFrequency) { invSampleFreq = 1.0f / sampleFrequency; }
 	void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
 	void updateIMU(float gx, float gy, float gz, float ax, float ay, float az);
+	// quaternion and integral terms, what carries from one update to the next
+	void getState(float *state) const;
+	void setState(const float *state);
 
 	void getAngle(float *rpy) {
 		if (!anglesComputed) computeAngles();
@@ -3,6 +3,12 @@
 #include "vqf/basicvqf.h"
 #include "MahonyAHRS/MahonyAHRS.h"
 
+#define METHOD 1
+
+#if METHOD==1
+static Mahony filter;
+#endif
+
 // Kalman Filter
 typedef struct {
     float angle;      // The calculated angle
@@ -69,10 +75,8 @@ static float KalmanFilter_Update(KalmanFilter *kf, float newAngle, float newRate
 void datafusion_update(imu_data_t * imu_data, float dt)
 {
     static int initialized = 0;
-#define METHOD 1
 
 #if METHOD==1
-    static Mahony filter;
     if (!initialized) {
         filter.begin(1.0f / dt);
         initialized = 1;
@@ -116,3 +120,17 @@ void datafusion_update(imu_data_t * imu_data, float dt)
     // Default method: Use Mahony filter
 #endif
 }
+
+void datafusion_get_state(float state[DATAFUSION_STATE_SIZE])
+{
+#if METHOD==1
+    filter.getState(state);
+#endif
+}
+
+void datafusion_set_state(const float state[DATAFUSION_STATE_SIZE])
+{
+#if METHOD==1
+    filter.setState(state);
+#endif
+}
@@ -7,8 +7,16 @@
 extern "C" {
 #endif
 
+#define DATAFUSION_STATE_SIZE   7
+
 void datafusion_update(imu_data_t * imu_data, float dt);
 
+/**
+ * @brief State of the filter, for the recorder keyframes
+ */
+void datafusion_get_state(float state[DATAFUSION_STATE_SIZE]);
+void datafusion_set_state(const float state[DATAFUSION_STATE_SIZE]);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,446 @@
+#include <string.h>
+#include <stdio.h>
+#include "i2c_scheduler.h"
+
+#ifndef __linux__
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "board.h"
+
+static const char *TAG = "i2c-sched";
+#endif
+
+I2CScheduler::I2CScheduler(I2CBusIO *io): io(io)
+{
+    stats_start = io->now_us();
+}
+
+I2CScheduler::~I2CScheduler()
+{
+
+}
+
+int I2CScheduler::submit_read(uint8_t addr, uint8_t reg, uint8_t *dst, size_t len, i2c_sched_cb_t cb, void *arg)
+{
+    if (dst == nullptr || len == 0 || len > 255) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (pending_count >= I2C_SCHED_MAX_REQUESTS) {
+        return -1;
+    }
+    Request &r = pending[pending_count++];
+    r.addr = addr;
+    r.reg = reg;
+    r.is_write = 0;
+    r.len = len;
+    r.dst = dst;
+    r.cb = cb;
+    r.arg = arg;
+    return 0;
+}
+
+int I2CScheduler::submit_write(uint8_t addr, uint8_t reg, const uint8_t *data, size_t len, i2c_sched_cb_t cb, void *arg)
+{
+    if (data == nullptr || len == 0 || len > sizeof(Request::data)) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (pending_count >= I2C_SCHED_MAX_REQUESTS) {
+        return -1;
+    }
+    Request &r = pending[pending_count++];
+    r.addr = addr;
+    r.reg = reg;
+    r.is_write = 1;
+    r.len = len;
+    r.dst = nullptr;
+    memcpy(r.data, data, len);
+    r.cb = cb;
+    r.arg = arg;
+    return 0;
+}
+
+void I2CScheduler::finish(Request &r, int status)
+{
+    stats.requests++;
+    if (r.cb) {
+        r.cb(status, r.arg);
+    }
+}
+
+/* Merge and execute a run of reads which is not interrupted by a write */
+int I2CScheduler::run_reads(Request *reads, int count)
+{
+    // sort by device and register so that mergeable ranges are neighbours,
+    // the lists are tiny so insertion sort is enough
+    for (int i = 1; i < count; i++) {
+        Request key = reads[i];
+        int j = i - 1;
+        while (j >= 0 && (reads[j].addr > key.addr || (reads[j].addr == key.addr && reads[j].reg > key.reg))) {
+            reads[j + 1] = reads[j];
+            j--;
+        }
+        reads[j + 1] = key;
+    }
+
+    int transactions = 0;
+    int i = 0;
+    while (i < count) {
+        const uint8_t addr = reads[i].addr;
+        const int start = reads[i].reg;
+        int end = start + reads[i].len;
+        int j = i + 1;
+        while (j < count && reads[j].addr == addr && reads[j].reg <= end + I2C_SCHED_MAX_GAP) {
+            int new_end = reads[j].reg + reads[j].len;
+            if (new_end < end) {
+                new_end = end;
+            }
+            if (new_end - start > I2C_SCHED_MAX_BURST) {
+                break;
+            }
+            end = new_end;
+            j++;
+        }
+
+        int64_t t0 = io->now_us();
+        int status;
+        if (j == i + 1) {
+            // nothing to merge, read straight into the destination
+            status = io->read(addr, start, reads[i].dst, reads[i].len);
+        } else {
+            status = io->read(addr, start, burst, end - start);
+            if (status == 0) {
+                for (int k = i; k < j; k++) {
+                    memcpy(reads[k].dst, &burst[reads[k].reg - start], reads[k].len);
+                }
+            }
+        }
+        stats.busy_us += io->now_us() - t0;
+        stats.transactions++;
+        stats.bytes += end - start;
+        if (status) {
+            stats.errors++;
+        }
+        transactions++;
+
+        for (int k = i; k < j; k++) {
+            finish(reads[k], status);
+        }
+        i = j;
+    }
+    return transactions;
+}
+
+int I2CScheduler::run_batch(Request *batch, int count)
+{
+    int transactions = 0;
+    int seg_start = 0;
+    for (int i = 0; i <= count; i++) {
+        if (i < count && !batch[i].is_write) {
+            continue;
+        }
+        if (i > seg_start) {
+            transactions += run_reads(&batch[seg_start], i - seg_start);
+        }
+        if (i < count) {
+            Request &w = batch[i];
+            int64_t t0 = io->now_us();
+            int status = io->write(w.addr, w.reg, w.data, w.len);
+            stats.busy_us += io->now_us() - t0;
+            stats.transactions++;
+            stats.bytes += w.len;
+            if (status) {
+                stats.errors++;
+            }
+            transactions++;
+            finish(w, status);
+        }
+        seg_start = i + 1;
+    }
+    return transactions;
+}
+
+int I2CScheduler::process()
+{
+    Request batch[I2C_SCHED_MAX_REQUESTS];
+    int count;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        count = pending_count;
+        memcpy(batch, pending, sizeof(Request) * count);
+        pending_count = 0;
+    }
+    // callbacks run without the lock held so they may submit again
+    return run_batch(batch, count);
+}
+
+void I2CScheduler::get_stats(i2c_sched_stats_t *out)
+{
+    *out = stats;
+    out->window_us = io->now_us() - stats_start;
+}
+
+void I2CScheduler::reset_stats()
+{
+    stats = {};
+    stats_start = io->now_us();
+}
+
+float I2CScheduler::get_utilization()
+{
+    int64_t window = io->now_us() - stats_start;
+    if (window <= 0) {
+        return 0.0f;
+    }
+    return (float)stats.busy_us / (float)window;
+}
+
+#ifndef __linux__
+
+static void i2c_sched_task(void *arg)
+{
+    I2CScheduler *sched = (I2CScheduler *)arg;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        sched->process();
+    }
+}
+
+int I2CScheduler::start(const char *name, int priority)
+{
+    if (task) {
+        return 0;
+    }
+    TaskHandle_t handle = NULL;
+    if (xTaskCreate(i2c_sched_task, name, 3072, this, priority, &handle) != pdPASS) {
+        ESP_LOGE(TAG, "Create %s task fail!", name);
+        return -1;
+    }
+    task = handle;
+    return 0;
+}
+
+void I2CScheduler::kick()
+{
+    if (task) {
+        xTaskNotifyGive((TaskHandle_t)task);
+    } else {
+        process();
+    }
+}
+
+/* Bus access through the i2c_bus component, one device handle per address */
+class I2CBusDeviceIO : public I2CBusIO {
+public:
+    explicit I2CBusDeviceIO(i2c_bus_handle_t bus): bus(bus) {}
+
+    int read(uint8_t addr, uint8_t reg, uint8_t *buf, size_t len) override
+    {
+        i2c_bus_device_handle_t dev = device(addr);
+        if (!dev) {
+            return -1;
+        }
+        return i2c_bus_read_bytes(dev, reg, len, buf) == ESP_OK ? 0 : -1;
+    }
+
+    int write(uint8_t addr, uint8_t reg, const uint8_t *buf, size_t len) override
+    {
+        i2c_bus_device_handle_t dev = device(addr);
+        if (!dev) {
+            return -1;
+        }
+        return i2c_bus_write_bytes(dev, reg, len, buf) == ESP_OK ? 0 : -1;
+    }
+
+    int64_t now_us() override
+    {
+        return esp_timer_get_time();
+    }
+
+private:
+    i2c_bus_device_handle_t device(uint8_t addr)
+    {
+        for (int i = 0; i < dev_count; i++) {
+            if (addrs[i] == addr) {
+                return devs[i];
+            }
+        }
+        if (dev_count >= 4) {
+            return nullptr;
+        }
+        i2c_bus_device_handle_t dev = i2c_bus_device_create(bus, addr, 0);
+        if (dev) {
+            addrs[dev_count] = addr;
+            devs[dev_count++] = dev;
+        }
+        return dev;
+    }
+
+    i2c_bus_handle_t bus;
+    uint8_t addrs[4];
+    i2c_bus_device_handle_t devs[4];
+    int dev_count = 0;
+};
+
+I2CScheduler *i2c_scheduler_get(int index)
+{
+    static I2CScheduler *schedulers[2] = {nullptr, nullptr};
+    index = index ? 1 : 0;
+    if (schedulers[index] == nullptr) {
+        i2c_bus_handle_t bus = bsp_i2c_get_handle(index);
+        if (!bus) {
+            ESP_LOGE(TAG, "Failed to get i2c bus handle");
+            return nullptr;
+        }
+        schedulers[index] = new I2CScheduler(new I2CBusDeviceIO(bus));
+        schedulers[index]->start(index ? "i2c1_sched" : "i2c0_sched", configMAX_PRIORITIES - 1);
+    }
+    return schedulers[index];
+}
+
+#endif
+
+// run test on linux
+#if defined(__linux__) && !defined(I2C_SCHEDULER_NO_MAIN)
+
+#include <time.h>
+
+class MockBus : public I2CBusIO {
+public:
+    uint8_t regs[2][256];
+    int reads = 0;
+    int writes = 0;
+    int fail_addr = -1;
+    int64_t t = 0;
+
+    MockBus()
+    {
+        for (int d = 0; d < 2; d++) {
+            for (int r = 0; r < 256; r++) {
+                regs[d][r] = (uint8_t)(r ^ (d * 0x55));
+            }
+        }
+    }
+    int read(uint8_t addr, uint8_t reg, uint8_t *buf, size_t len) override
+    {
+        reads++;
+        t += 190 + len * 22; // transaction setup plus ~22.5us per byte at 400kHz
+        if (addr == fail_addr) {
+            return -1;
+        }
+        memcpy(buf, &regs[addr & 1][reg], len);
+        return 0;
+    }
+    int write(uint8_t addr, uint8_t reg, const uint8_t *buf, size_t len) override
+    {
+        writes++;
+        t += 190 + len * 22;
+        memcpy(&regs[addr & 1][reg], buf, len);
+        return 0;
+    }
+    int64_t now_us() override
+    {
+        return t;
+    }
+};
+
+static int g_done = 0;
+static void count_cb(int status, void *arg)
+{
+    if (status == 0) {
+        g_done++;
+    }
+    (void)arg;
+}
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+int main(int argc, char **argv)
+{
+    MockBus bus;
+    I2CScheduler sched(&bus);
+
+    // BMI270 style cycle: status (0x03), data (0x0C..0x17) and temperature (0x22..0x23)
+    uint8_t data[21], temp[2];
+    CHECK(sched.submit_read(0x68, 0x22, temp, sizeof(temp), count_cb, NULL) == 0);
+    CHECK(sched.submit_read(0x68, 0x0C, &data[9], 12, count_cb, NULL) == 0);
+    CHECK(sched.submit_read(0x68, 0x03, data, 1, count_cb, NULL) == 0);
+    // compass style cycle: status (0x09) and data (0x01..0x06)
+    uint8_t status, mag[6];
+    CHECK(sched.submit_read(0x2d, 0x09, &status, 1, count_cb, NULL) == 0);
+    CHECK(sched.submit_read(0x2d, 0x01, mag, sizeof(mag), count_cb, NULL) == 0);
+    CHECK(sched.process() == 3);
+    CHECK(g_done == 5);
+    CHECK(bus.reads == 3);
+    CHECK(data[0] == 0x03 && data[9] == 0x0C && data[20] == 0x17 && temp[0] == 0x22 && temp[1] == 0x23);
+    CHECK(status == (0x09 ^ 0x55) && mag[0] == (0x01 ^ 0x55));
+
+    // ranges too far apart stay separate transactions
+    g_done = 0;
+    bus.reads = 0;
+    uint8_t a[2], b[2];
+    sched.submit_read(0x68, 0x00, a, 2, count_cb, NULL);
+    sched.submit_read(0x68, 0x40, b, 2, count_cb, NULL);
+    CHECK(sched.process() == 2);
+    CHECK(bus.reads == 2 && g_done == 2);
+
+    // a write is a barrier, the read after it must see the new value
+    g_done = 0;
+    uint8_t before, after, v = 0xAA;
+    sched.submit_read(0x68, 0x10, &before, 1, count_cb, NULL);
+    sched.submit_write(0x68, 0x10, &v, 1, count_cb, NULL);
+    sched.submit_read(0x68, 0x10, &after, 1, count_cb, NULL);
+    CHECK(sched.process() == 3);
+    CHECK(before == 0x10 && after == 0xAA && g_done == 3);
+
+    // failures are reported to every request of the merged burst
+    g_done = 0;
+    bus.fail_addr = 0x68;
+    sched.submit_read(0x68, 0x03, data, 4, count_cb, NULL);
+    sched.submit_read(0x68, 0x08, data, 4, count_cb, NULL);
+    sched.process();
+    CHECK(g_done == 0);
+    bus.fail_addr = -1;
+
+    // queue overflow
+    for (int i = 0; i < I2C_SCHED_MAX_REQUESTS; i++) {
+        CHECK(sched.submit_read(0x68, i, a, 1, NULL, NULL) == 0);
+    }
+    CHECK(sched.submit_read(0x68, 0x20, a, 1, NULL, NULL) == -1);
+    CHECK(sched.process() == 1);
+
+    // utilization: compare one IMU cycle issued naively against the merged one
+    sched.reset_stats();
+    MockBus naive;
+    for (int cycle = 0; cycle < 100; cycle++) {
+        naive.read(0x68, 0x03, data, 1);
+        naive.read(0x68, 0x0C, &data[9], 12);
+        naive.read(0x68, 0x22, temp, 2);
+        naive.read(0x2d, 0x09, &status, 1);
+        naive.read(0x2d, 0x01, mag, 6);
+        naive.t += 10000;
+
+        sched.submit_read(0x68, 0x03, data, 1, NULL, NULL);
+        sched.submit_read(0x68, 0x0C, &data[9], 12, NULL, NULL);
+        sched.submit_read(0x68, 0x22, temp, 2, NULL, NULL);
+        sched.submit_read(0x2d, 0x09, &status, 1, NULL, NULL);
+        sched.submit_read(0x2d, 0x01, mag, 6, NULL, NULL);
+        sched.process();
+        bus.t += 10000;
+    }
+    i2c_sched_stats_t st;
+    sched.get_stats(&st);
+    int64_t naive_busy = naive.t - 100 * 10000;
+    printf("naive:  %d transactions, busy %lld us\n", naive.reads, (long long)naive_busy);
+    printf("merged: %u transactions, busy %lld us, %u bytes, utilization %.2f%%\n",
+           st.transactions, (long long)st.busy_us, st.bytes, sched.get_utilization() * 100);
+    CHECK(st.transactions == 300);
+    CHECK(st.busy_us < naive_busy);
+    printf("all tests passed\n");
+    return 0;
+}
+
+#endif
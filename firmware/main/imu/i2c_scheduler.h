@@ -0,0 +1,128 @@
+/*
+   Batched I2C transaction scheduler.
+
+   Drivers queue register reads instead of issuing blocking transactions one
+   by one. Reads addressed to the same device whose register ranges are
+   adjacent (or separated by a small gap) are merged into a single burst, so
+   a cycle that used to cost several start/stop sequences costs one. Writes
+   act as barriers and are never reordered with respect to reads.
+
+   The queueing and merging logic does not depend on ESP-IDF and can be
+   built on the host against a mocked I2CBusIO (see the __linux__ section of
+   i2c_scheduler.cpp).
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+#define I2C_SCHED_MAX_REQUESTS  16  // pending requests per bus
+#define I2C_SCHED_MAX_BURST     48  // largest merged read in bytes
+// Unused registers we accept to read in order to merge two ranges. At 400kHz
+// a byte costs ~22.5us while a separate transaction costs address/register
+// bytes plus driver setup (~190us), so the break-even gap is about 8 bytes.
+#define I2C_SCHED_MAX_GAP       8
+
+/**
+ * @brief Completion callback
+ * @param status 0 on success, non-zero if the bus transaction failed
+ * @param arg user argument given at submit time
+ */
+typedef void (*i2c_sched_cb_t)(int status, void *arg);
+
+typedef struct {
+    uint32_t requests;      // requests completed
+    uint32_t transactions;  // bus transactions issued
+    uint32_t bytes;         // payload bytes moved, including merge gaps
+    uint32_t errors;        // failed transactions
+    int64_t busy_us;        // time spent inside bus transactions
+    int64_t window_us;      // time since the statistics were reset
+} i2c_sched_stats_t;
+
+/**
+ * @brief Physical bus access used by the scheduler
+ */
+class I2CBusIO {
+public:
+    virtual ~I2CBusIO() = default;
+    virtual int read(uint8_t addr, uint8_t reg, uint8_t *buf, size_t len) = 0;
+    virtual int write(uint8_t addr, uint8_t reg, const uint8_t *buf, size_t len) = 0;
+    virtual int64_t now_us() = 0;
+};
+
+class I2CScheduler {
+public:
+    explicit I2CScheduler(I2CBusIO *io);
+    ~I2CScheduler();
+
+    I2CScheduler(const I2CScheduler &) = delete;
+    I2CScheduler &operator=(const I2CScheduler &) = delete;
+
+    /**
+     * @brief Queue a register read, dst must stay valid until cb is called
+     * @return 0 on success, -1 if the queue is full
+     */
+    int submit_read(uint8_t addr, uint8_t reg, uint8_t *dst, size_t len, i2c_sched_cb_t cb, void *arg);
+
+    /**
+     * @brief Queue a register write, the data is copied
+     * @return 0 on success, -1 if the queue is full or len is too large
+     */
+    int submit_write(uint8_t addr, uint8_t reg, const uint8_t *data, size_t len, i2c_sched_cb_t cb, void *arg);
+
+    /**
+     * @brief Execute everything pending in the caller context
+     * @return number of bus transactions issued
+     */
+    int process();
+
+    /**
+     * @brief Start a worker task which runs process() whenever kick() is called
+     */
+    int start(const char *name, int priority);
+
+    /**
+     * @brief Wake the worker task, or process synchronously if there is none
+     */
+    void kick();
+
+    void get_stats(i2c_sched_stats_t *stats);
+    void reset_stats();
+
+    /**
+     * @brief Fraction of the statistics window the bus spent in transactions (0-1)
+     */
+    float get_utilization();
+
+private:
+    struct Request {
+        uint8_t addr;
+        uint8_t reg;
+        uint8_t is_write;
+        uint8_t len;
+        uint8_t *dst;
+        uint8_t data[8];    // write payload
+        i2c_sched_cb_t cb;
+        void *arg;
+    };
+
+    int run_batch(Request *batch, int count);
+    int run_reads(Request *reads, int count);
+    void finish(Request &r, int status);
+
+    I2CBusIO *io;
+    std::mutex lock;
+    Request pending[I2C_SCHED_MAX_REQUESTS];
+    int pending_count = 0;
+    uint8_t burst[I2C_SCHED_MAX_BURST];
+    i2c_sched_stats_t stats = {};
+    int64_t stats_start = 0;
+    void *task = nullptr;
+};
+
+/**
+ * @brief Get the scheduler of an on-board I2C bus, created on first use
+ * @param index bus index as used by bsp_i2c_get_handle()
+ */
+I2CScheduler *i2c_scheduler_get(int index);
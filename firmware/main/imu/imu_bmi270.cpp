@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <atomic>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
@@ -11,6 +12,7 @@
 #include "setting.h"
 
 #include "app_datafusion.h"
+#include "loop_bench.h"
 #include "common/common.h"
 
 static const char *TAG = "imu-bmi270";
@@ -19,6 +21,14 @@ static const char *TAG = "imu-bmi270";
 #define ACCEL               UINT8_C(0x00)
 #define GYRO                UINT8_C(0x01)
 
+#define BMI270_I2C_ADDR         0x69
+#define BMI270_REG_STATUS       0x03
+#define BMI270_REG_DATA_8       0x0C    // first accelerometer byte
+#define BMI270_REG_TEMPERATURE  0x22
+
+#define IMU_CYCLE_TIMEOUT_MS    20
+#define IMU_STATS_INTERVAL      1000    // cycles between bus utilization reports
+
 static IMUBmi270 *globalInstance = nullptr;
 
 
@@ -119,48 +129,204 @@ float IMUBmi270::readTemperature()
     return temperature_value;
 }
 
+typedef struct {
+    TaskHandle_t waiter;
+    std::atomic<int> pending;   // reads submitted and not completed
+    std::atomic<int> errors;
+} imu_cycle_t;
+
+static void imu_cycle_done(int status, void *arg)
+{
+    imu_cycle_t *cycle = (imu_cycle_t *)arg;
+    if (status) {
+        cycle->errors++;
+    }
+    cycle->pending--;
+    xTaskNotifyGive(cycle->waiter);
+}
+
+/*
+ * Wait until every read of the cycle completed, the scheduler writes into
+ * their buffers until then. The count is what is waited for, a notification
+ * only wakes the waiter to check it.
+ */
+static bool imu_cycle_wait(imu_cycle_t *cycle, TickType_t timeout)
+{
+    while (cycle->pending > 0) {
+        if (ulTaskNotifyTake(pdTRUE, timeout) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline int16_t le16(const uint8_t *p)
+{
+    return (int16_t)((uint16_t)p[0] | ((uint16_t)p[1] << 8));
+}
+
 void IMUBmi270::readData()
 {
+    LOOP_BENCH_BEGIN(bench_start);
     struct bmi2_dev *bmi2_dev = globalInstance->bmi_handle;
     imu_data_t &_data = globalInstance->imu_data;
-    int8_t rslt;
-    struct bmi2_sens_data sensor_data;
-    rslt = bmi2_get_sensor_data(&sensor_data, bmi2_dev);
-    bmi2_error_codes_print_result(rslt);
-    _data.temperature = readTemperature();
-    static uint32_t compass_cnt = 0;
-    if (compass_cnt++ % 10 == 0) {
-        globalInstance->compass->read();
+    static imu_cycle_t cycle;
+    cycle.waiter = xTaskGetCurrentTaskHandle();
+    /* The reads of a cycle that timed out may still be queued or on the
+     * bus, they complete into raw and count errors. Let them finish before
+     * the buffers are reused and drop their notifications. */
+    if (!imu_cycle_wait(&cycle, pdMS_TO_TICKS(IMU_CYCLE_TIMEOUT_MS))) {
+        ESP_LOGW(TAG, "I2C reads of the last cycle still pending");
+        LOOP_BENCH_END(LOOP_IMU_CYCLE, bench_start);
+        return;
+    }
+    ulTaskNotifyValueClear(NULL, UINT32_MAX);
+    cycle.errors = 0;
+
+    /* Queue the whole cycle first: status and sensor data merge into one
+     * burst, the temperature follows on the same bus and the compass runs
+     * in parallel on the other bus. */
+    int expected = 0;
+    if (bmi_sched->submit_read(BMI270_I2C_ADDR, BMI270_REG_STATUS, &raw.status, 1, imu_cycle_done, &cycle) == 0) {
+        expected++;
+    }
+    if (bmi_sched->submit_read(BMI270_I2C_ADDR, BMI270_REG_DATA_8, raw.data, sizeof(raw.data), imu_cycle_done, &cycle) == 0) {
+        expected++;
+    }
+    if (bmi_sched->submit_read(BMI270_I2C_ADDR, BMI270_REG_TEMPERATURE, raw.temp, sizeof(raw.temp), imu_cycle_done, &cycle) == 0) {
+        expected++;
     }
+    // counted before any kick, the callbacks run from then on
+    cycle.pending = expected;
+    bool read_compass = (cycles % 10 == 0) && compass_sched;
+    if (read_compass) {
+        cycle.pending += compass->submitRead(compass_sched, imu_cycle_done, &cycle);
+        compass_sched->kick();
+    }
+    bmi_sched->kick();
 
-    if ((rslt == BMI2_OK) && (sensor_data.status & BMI2_DRDY_ACC) && (sensor_data.status & BMI2_DRDY_GYR)) {
+    raw.result = IMU_CYCLE_OK;
+    if (!imu_cycle_wait(&cycle, pdMS_TO_TICKS(IMU_CYCLE_TIMEOUT_MS))) {
+        raw.result = IMU_CYCLE_TIMEOUT;
+    }
+    if (raw.result == IMU_CYCLE_OK && cycle.errors) {
+        raw.result = IMU_CYCLE_ERROR;
+    }
+    recorder_tap(REC_IMU, &raw, sizeof(raw));
+    if (raw.result == IMU_CYCLE_TIMEOUT) {
+        ESP_LOGW(TAG, "I2C cycle timeout");
+        LOOP_BENCH_END(LOOP_IMU_CYCLE, bench_start);
+        return;
+    }
+
+    if (++cycles % IMU_STATS_INTERVAL == 0) {
+        ESP_LOGI(TAG, "i2c utilization bmi:%.1f%% compass:%.1f%%", bmi_sched->get_utilization() * 100,
+                 compass_sched ? compass_sched->get_utilization() * 100 : 0.0f);
+        bmi_sched->reset_stats();
+        if (compass_sched) {
+            compass_sched->reset_stats();
+        }
+    }
+
+    if (raw.result == IMU_CYCLE_ERROR) {
+        ESP_LOGW(TAG, "I2C read failed");
+        LOOP_BENCH_END(LOOP_IMU_CYCLE, bench_start);
+        return;
+    }
+
+    _data.temperature = (float)le16(raw.temp) / 512.0f + 23.0f;
+    if (read_compass) {
+        compass->parseRead();
+    }
+
+    if ((raw.status & BMI2_DRDY_ACC) && (raw.status & BMI2_DRDY_GYR)) {
+        int16_t gx = le16(&raw.data[6]);
+        int16_t gy = le16(&raw.data[8]);
+        int16_t gz = le16(&raw.data[10]);
+#ifdef BMI2_GYRO_CROSS_SENS_ENABLE
+        /* same cross-axis compensation bmi2_get_sensor_data() applies */
+        if (bmi2_dev->variant_feature & BMI2_GYRO_CROSS_SENS_ENABLE) {
+            gx = gx - (int16_t)(((int32_t)bmi2_dev->gyr_cross_sens_zx * (int32_t)gz) / 512);
+        }
+#endif
         /* Converting lsb to meter per second squared for 16 bit accelerometer at 2G range. */
-        _data.acc.x = lsb_to_mps2(sensor_data.acc.x, (float)2, bmi2_dev->resolution);
-        _data.acc.y = lsb_to_mps2(sensor_data.acc.y, (float)2, bmi2_dev->resolution);
-        _data.acc.z = lsb_to_mps2(sensor_data.acc.z, (float)2, bmi2_dev->resolution);
+        _data.acc.x = lsb_to_mps2(le16(&raw.data[0]), (float)2, bmi2_dev->resolution);
+        _data.acc.y = lsb_to_mps2(le16(&raw.data[2]), (float)2, bmi2_dev->resolution);
+        _data.acc.z = lsb_to_mps2(le16(&raw.data[4]), (float)2, bmi2_dev->resolution);
 
         /* Converting lsb to degree per second for 16 bit gyro at 2000dps range. */
-        _data.gyro.x = lsb_to_dps(sensor_data.gyr.x, (float)2000, bmi2_dev->resolution);
-        _data.gyro.y = lsb_to_dps(sensor_data.gyr.y, (float)2000, bmi2_dev->resolution);
-        _data.gyro.z = lsb_to_dps(sensor_data.gyr.z, (float)2000, bmi2_dev->resolution);
+        _data.gyro.x = lsb_to_dps(gx, (float)2000, bmi2_dev->resolution);
+        _data.gyro.y = lsb_to_dps(gy, (float)2000, bmi2_dev->resolution);
+        _data.gyro.z = lsb_to_dps(gz, (float)2000, bmi2_dev->resolution);
+        LOOP_BENCH_BEGIN(fusion_start);
         datafusion_update(&_data, 0.01f);
+        LOOP_BENCH_END(LOOP_DATAFUSION, fusion_start);
         _data.angle.z = compass->getAzimuth();
         notifyObservers(_data);
     } else {
         ESP_LOGW(TAG, "Sensor data not ready");
     }
+    LOOP_BENCH_END(LOOP_IMU_CYCLE, bench_start);
+}
 
+int16_t IMUBmi270::getGyroCrossSens() const
+{
+#ifdef BMI2_GYRO_CROSS_SENS_ENABLE
+    if (bmi_handle->variant_feature & BMI2_GYRO_CROSS_SENS_ENABLE) {
+        return bmi_handle->gyr_cross_sens_zx;
+    }
+#endif
+    return 0;
 }
 
-static void imu_task(void *arg)
+void IMUBmi270::setGyroCrossSens(int16_t factor)
+{
+#ifdef BMI2_GYRO_CROSS_SENS_ENABLE
+    bmi_handle->gyr_cross_sens_zx = factor;
+    if (factor) {
+        bmi_handle->variant_feature |= BMI2_GYRO_CROSS_SENS_ENABLE;
+    } else {
+        bmi_handle->variant_feature &= ~BMI2_GYRO_CROSS_SENS_ENABLE;
+    }
+#endif
+}
+
+/*
+ * Suspension is handled by the IMU task itself between two cycles, so no
+ * transfer is in flight on the bus when the sensor is reconfigured.
+ */
+void imu_task(void *arg)
 {
     vTaskDelay(pdMS_TO_TICKS(500));
     while (1) {
+        if (globalInstance->suspendRequest) {
+            uint8_t sensor_list[2] = { BMI2_ACCEL, BMI2_GYRO };
+            bmi2_error_codes_print_result(bmi2_sensor_disable(sensor_list, 2, globalInstance->bmi_handle));
+            globalInstance->suspended = true;
+            ESP_LOGI(TAG, "suspended");
+            while (globalInstance->suspendRequest) {
+                xSemaphoreTake(globalInstance->resumeSem, portMAX_DELAY);
+            }
+            bmi270_enable_accel_gyro(globalInstance->bmi_handle);
+            globalInstance->suspended = false;
+            ESP_LOGI(TAG, "resumed");
+        }
         globalInstance->readData();
         vTaskDelay(pdMS_TO_TICKS(10));
     }
 }
 
+void IMUBmi270::suspend()
+{
+    suspendRequest = true;
+}
+
+void IMUBmi270::resume()
+{
+    suspendRequest = false;
+    xSemaphoreGive(resumeSem);
+}
+
 int IMUBmi270::init()
 {
 
@@ -172,7 +338,7 @@ int IMUBmi270::init()
 
     bmi270_i2c_config_t i2c_bmi270_conf = {
         .i2c_handle = i2c_bus_handle,
-        .i2c_addr = 0x69,
+        .i2c_addr = BMI270_I2C_ADDR,
     };
 
     esp_err_t ret = bmi270_sensor_create(&i2c_bmi270_conf, &bmi_handle);
@@ -186,6 +352,15 @@ int IMUBmi270::init()
     this->compass = std::make_shared<AP_Compass_QMC5883P>();
     this->compass->setMagneticDeclination(g_settings.magnetic_declination_degrees);
 
+    this->bmi_sched = i2c_scheduler_get(0);
+    this->compass_sched = i2c_scheduler_get(1);
+    if (!this->bmi_sched) {
+        ESP_LOGE(TAG, "Failed to get i2c scheduler");
+        return -1;
+    }
+
+    this->resumeSem = xSemaphoreCreateBinary();
+
     BaseType_t res;
     res = xTaskCreate(imu_task, "imu_task", 4096, NULL, configMAX_PRIORITIES - 1, &imuTaskHandle);
     if (res != pdPASS) {
@@ -195,7 +370,7 @@ int IMUBmi270::init()
     return 0;
 }
 
-IMUBmi270::IMUBmi270(): bmi_handle(nullptr)
+IMUBmi270::IMUBmi270(): bmi_handle(nullptr), bmi_sched(nullptr), compass_sched(nullptr)
 {
 
 }
@@ -9,8 +9,11 @@
 #include "imu_base.h"
 #include "bmi270.h"
 #include "qmc5883p.h"
+#include "i2c_scheduler.h"
+#include "recorder.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,6 +23,11 @@ extern "C" {
 }
 #endif
 
+// result of a read cycle, see rec_imu_t
+#define IMU_CYCLE_OK        0
+#define IMU_CYCLE_TIMEOUT   1
+#define IMU_CYCLE_ERROR     2
+
 
 class IMUBmi270 : public IMUBase {
 public:
@@ -30,11 +38,42 @@ public:
     float readTemperature();
 
     void readData();
+    // stop polling and put the sensor into suspend mode, e.g. at night
+    void suspend();
+    void resume();
+    bool isSuspended() const
+    {
+        return suspended;
+    }
+    // read cycles so far, the compass is read every 10th
+    uint32_t getCycles() const
+    {
+        return cycles;
+    }
+    void setCycles(uint32_t count)
+    {
+        cycles = count;
+    }
+    AP_Compass_QMC5883P *getCompass()
+    {
+        return compass.get();
+    }
+    // gyro cross-axis factor of this chip, 0 when it is not compensated
+    int16_t getGyroCrossSens() const;
+    void setGyroCrossSens(int16_t factor);
 private:
+    friend void imu_task(void *arg);
     bmi270_handle_t bmi_handle;
     std::shared_ptr<AP_Compass_QMC5883P> compass;
+    I2CScheduler *bmi_sched;
+    I2CScheduler *compass_sched;
+    rec_imu_t raw;          // the registers of a cycle, recorded as they are
+    uint32_t cycles = 0;
 
     TaskHandle_t imuTaskHandle;
+    SemaphoreHandle_t resumeSem = nullptr;
+    volatile bool suspendRequest = false;
+    volatile bool suspended = false;
 
     // IMUBmi270(const IMUBmi270 &) = delete;
     // IMUBmi270 &operator=(const IMUBmi270 &) = delete;
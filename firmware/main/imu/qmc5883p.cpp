@@ -20,6 +20,7 @@
 #include "esp_timer.h"
 #include "qmc5883p.h"
 #include "board.h"
+#include "recorder.h"
 
 static const char *TAG = "qmc5883p";
 
@@ -258,11 +259,47 @@ void AP_Compass_QMC5883P::read()
     if (read_registers(QMC5883P_REG_DATA_OUTPUT_X, (uint8_t *)&buffer, sizeof(buffer))) {
         return ;
     }
+    _convert((const int16_t *)&buffer);
+}
+
+int AP_Compass_QMC5883P::submitRead(I2CScheduler *sched, i2c_sched_cb_t cb, void *arg)
+{
+    // data and status are read in one burst, status is checked in parseRead()
+    int n = 0;
+    if (sched->submit_read(HAL_COMPASS_QMC5883P_I2C_ADDR, QMC5883P_REG_DATA_OUTPUT_X, _rawBuf, 6, cb, arg) == 0) {
+        n++;
+    }
+    const int status_offset = QMC5883P_REG_STATUS - QMC5883P_REG_DATA_OUTPUT_X;
+    if (sched->submit_read(HAL_COMPASS_QMC5883P_I2C_ADDR, QMC5883P_REG_STATUS, &_rawBuf[status_offset], 1, cb, arg) == 0) {
+        n++;
+    }
+    return n;
+}
+
+void AP_Compass_QMC5883P::parseRead()
+{
+    recorder_tap(REC_COMPASS, _rawBuf, sizeof(_rawBuf));
+    uint8_t status = _rawBuf[QMC5883P_REG_STATUS - QMC5883P_REG_DATA_OUTPUT_X];
+    if (!(status & QMC5883P_STATUS_DATA_READY)) {
+        ESP_LOGW(TAG, "no data ready");
+        return;
+    }
+    if (status & QMC5883P_STATUS_DATA_OVFL) {
+        ESP_LOGW(TAG, "data overflow");
+    }
+    int16_t raw[3];
+    for (int i = 0; i < 3; i++) {
+        raw[i] = (int16_t)((uint16_t)_rawBuf[i * 2] | ((uint16_t)_rawBuf[i * 2 + 1] << 8));
+    }
+    _convert(raw);
+}
 
+void AP_Compass_QMC5883P::_convert(const int16_t *raw)
+{
     #define FACTOR 24 / 600 // convert to uT in ±12G range
-    _vRaw.x  = (float)buffer.rx * FACTOR;
-    _vRaw.y = (float)buffer.ry * FACTOR;
-    _vRaw.z = (float)buffer.rz * FACTOR;
+    _vRaw.x  = (float)raw[0] * FACTOR;
+    _vRaw.y = (float)raw[1] * FACTOR;
+    _vRaw.z = (float)raw[2] * FACTOR;
     _applyCalibration();
     #undef FACTOR
 
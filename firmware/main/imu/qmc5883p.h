@@ -18,6 +18,7 @@
 
 #include "i2c_bus.h"
 #include "imu_base.h"
+#include "i2c_scheduler.h"
 
 #ifndef HAL_COMPASS_QMC5883P_I2C_ADDR
 #define HAL_COMPASS_QMC5883P_I2C_ADDR 0x2C
@@ -29,7 +30,23 @@ public:
 
     AP_Compass_QMC5883P();
     void read();
+    /**
+     * @brief Queue a data read on the scheduler, call parseRead() once it completed
+     * @return number of requests queued
+     */
+    int submitRead(I2CScheduler *sched, i2c_sched_cb_t cb, void *arg);
+    void parseRead();
     int getAzimuth();
+    // last field read, uT, for the recorder keyframes
+    axis_t getField() const
+    {
+        return _vRaw;
+    }
+    void setField(const axis_t &field)
+    {
+        _vRaw = field;
+        _applyCalibration();
+    }
     void setMagneticDeclination(int degrees, uint8_t minutes);
     void setMagneticDeclination(float degrees)
     {
@@ -63,6 +80,8 @@ private:
 
     void _dump_registers();
     bool _check_whoami();
+    void _convert(const int16_t *raw);
+    uint8_t _rawBuf[9];  // DATA_OUTPUT_X(0x01) .. STATUS(0x09)
 	axis_t _vRaw, _vCalibrated;
 	axis_t _offset = {0, 0, 0};
     axis_t _scale = {1.0f, 1.0f, 1.0f};
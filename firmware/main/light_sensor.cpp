@@ -0,0 +1,70 @@
+#include <math.h>
+#include "esp_log.h"
+#include "board.h"
+#include "adc.h"
+#include "light_sensor.h"
+
+static const char *TAG = "light";
+
+#if CONFIG_LIGHT_SENSOR_BH1750
+#define BH1750_POWER_ON         0x01
+#define BH1750_CONT_H_RES       0x10
+#define BH1750_MTREG_HIGH       0x40    // | MTreg[7:5]
+#define BH1750_MTREG_LOW        0x60    // | MTreg[4:0]
+// The default MTreg of 69 saturates at 54600lx, full sun is around 100klx.
+// The smallest one doubles the range and shortens a conversion to 54ms.
+#define BH1750_MTREG            31
+// Luminous efficacy of daylight. The weather policy only uses the ratio to
+// the clear sky irradiance, an error here shifts its thresholds a little.
+#define BH1750_LUX_PER_WM2      110.0f
+
+static i2c_bus_device_handle_t s_device = NULL;
+
+static esp_err_t bh1750_command(uint8_t cmd)
+{
+    return i2c_bus_write_bytes(s_device, NULL_I2C_MEM_ADDR, 1, &cmd);
+}
+#endif
+
+void light_sensor_init(void)
+{
+#if CONFIG_LIGHT_SENSOR_BH1750
+    i2c_bus_handle_t bus = bsp_i2c_get_handle(CONFIG_LIGHT_SENSOR_I2C_BUS);
+    if (!bus) {
+        ESP_LOGE(TAG, "Failed to get i2c bus handle");
+        return;
+    }
+    s_device = i2c_bus_device_create(bus, CONFIG_LIGHT_SENSOR_I2C_ADDR, 0);
+    esp_err_t ret = bh1750_command(BH1750_POWER_ON);
+    ret |= bh1750_command(BH1750_MTREG_HIGH | (BH1750_MTREG >> 5));
+    ret |= bh1750_command(BH1750_MTREG_LOW | (BH1750_MTREG & 0x1f));
+    ret |= bh1750_command(BH1750_CONT_H_RES);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "BH1750 not found");
+        i2c_bus_device_delete(&s_device);
+        s_device = NULL;
+        return;
+    }
+    ESP_LOGI(TAG, "BH1750 at 0x%02x", CONFIG_LIGHT_SENSOR_I2C_ADDR);
+#elif CONFIG_LIGHT_SENSOR_ADC
+    if (!adc_is_wired(ADC_SIG_LIGHT)) {
+        ESP_LOGE(TAG, "analog light sensor selected, but no ADC channel");
+    }
+#endif
+}
+
+float light_sensor_read(void)
+{
+#if CONFIG_LIGHT_SENSOR_BH1750
+    uint8_t buf[2];
+    if (s_device == NULL || i2c_bus_read_bytes(s_device, NULL_I2C_MEM_ADDR, 2, buf) != ESP_OK) {
+        return NAN;
+    }
+    float lux = ((buf[0] << 8) | buf[1]) / 1.2f * 69.0f / BH1750_MTREG;
+    return lux / BH1750_LUX_PER_WM2;
+#elif CONFIG_LIGHT_SENSOR_ADC
+    return adc_read(ADC_SIG_LIGHT);
+#else
+    return NAN;
+#endif
+}
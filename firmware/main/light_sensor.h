@@ -0,0 +1,24 @@
+/*
+   Irradiance input of the weather policy, selected in Kconfig: an analog
+   sensor on the light ADC channel or a BH1750 on I2C, see CONFIG_LIGHT_SENSOR.
+*/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Probe the configured sensor, after bsp_i2c_init() and adc_init()
+ */
+void light_sensor_init(void);
+
+/**
+ * @brief Global horizontal irradiance
+ * @return W/m2, NAN without a working sensor
+ */
+float light_sensor_read(void);
+
+#ifdef __cplusplus
+}
+#endif
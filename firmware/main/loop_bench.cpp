@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "loop_bench.h"
+
+#if defined(CONFIG_LOOP_BENCH) || defined(__linux__)
+
+// clock ticks per us, durations are counted in those and converted for the report
+#ifdef __linux__
+#define TICKS_PER_US    1000
+#define CLOCK_NAME      "host"
+#else
+#define TICKS_PER_US    CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define CLOCK_NAME      "cycles"
+#endif
+
+#define SUB_COUNT       (1 << LOOP_BENCH_SUB_BITS)
+
+static const char *NAMES[LOOP_STAGE_COUNT] = {
+#define X(name, desc, budget) desc,
+    LOOP_STAGE_LIST
+#undef X
+};
+
+struct stage_histogram {
+    uint32_t bucket[LOOP_BENCH_BUCKETS];
+    uint32_t count;
+    uint32_t over;
+    uint32_t max;
+    uint32_t budget_us;
+    uint32_t budget;            // in ticks
+};
+
+/*
+ * Only the IMU task counts, a report or a reset racing with a tick is off
+ * by that tick's samples, which is not worth a lock in the loop.
+ */
+static stage_histogram stages[LOOP_STAGE_COUNT] = {
+#define X(name, desc, budget) {{}, 0, 0, 0, budget, (uint32_t)(budget) * TICKS_PER_US},
+    LOOP_STAGE_LIST
+#undef X
+};
+
+/*
+ * Values below 8 have a bucket each, above that an octave is split into
+ * 8 buckets of the 3 bits after the leading one.
+ */
+static int bucket_of(uint32_t value)
+{
+    if (value < SUB_COUNT) {
+        return (int)value;
+    }
+    int e = 31 - __builtin_clz(value);
+    return ((e - LOOP_BENCH_SUB_BITS + 1) << LOOP_BENCH_SUB_BITS) +
+           (int)((value >> (e - LOOP_BENCH_SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+static uint32_t bucket_lower(int bucket)
+{
+    if (bucket < SUB_COUNT) {
+        return (uint32_t)bucket;
+    }
+    int e = (bucket >> LOOP_BENCH_SUB_BITS) + LOOP_BENCH_SUB_BITS - 1;
+    return (uint32_t)(SUB_COUNT + (bucket & (SUB_COUNT - 1))) << (e - LOOP_BENCH_SUB_BITS);
+}
+
+static uint32_t bucket_upper(int bucket)
+{
+    return bucket + 1 < LOOP_BENCH_BUCKETS ? bucket_lower(bucket + 1) - 1 : UINT32_MAX;
+}
+
+static void count(loop_stage_t stage, uint32_t ticks)
+{
+    stage_histogram &h = stages[stage];
+    h.bucket[bucket_of(ticks)]++;
+    h.count++;
+    if (ticks > h.budget) {
+        h.over++;
+    }
+    if (ticks > h.max) {
+        h.max = ticks;
+    }
+}
+
+void loop_bench_end(loop_stage_t stage, uint32_t start)
+{
+    count(stage, loop_bench_now() - start);
+}
+
+void loop_bench_sample(loop_stage_t stage, uint32_t us)
+{
+    uint64_t ticks = (uint64_t)us * TICKS_PER_US;
+    count(stage, ticks < UINT32_MAX ? (uint32_t)ticks : UINT32_MAX);
+}
+
+static int64_t last_period = -1;
+
+void loop_bench_period(int64_t us)
+{
+    if (us < 0 || us >= 1000000) {
+        last_period = -1;
+        return;
+    }
+    loop_bench_sample(LOOP_PERIOD, (uint32_t)us);
+    if (last_period >= 0) {
+        loop_bench_sample(LOOP_JITTER, (uint32_t)(us > last_period ? us - last_period : last_period - us));
+    }
+    last_period = us;
+}
+
+void loop_bench_reset(void)
+{
+    for (auto &h : stages) {
+        memset(h.bucket, 0, sizeof(h.bucket));
+        h.count = 0;
+        h.over = 0;
+        h.max = 0;
+    }
+    last_period = -1;
+}
+
+void loop_bench_set_budget(loop_stage_t stage, uint32_t us)
+{
+    uint64_t ticks = (uint64_t)us * TICKS_PER_US;
+    stages[stage].budget_us = us;
+    stages[stage].budget = ticks < UINT32_MAX ? (uint32_t)ticks : UINT32_MAX;
+}
+
+// the upper bound of the bucket holding the q quantile, no more than the maximum
+static uint32_t quantile(const stage_histogram &h, double q)
+{
+    if (h.count == 0) {
+        return 0;
+    }
+    uint32_t rank = (uint32_t)(q * h.count + 0.999999);
+    rank = rank < 1 ? 1 : rank;
+    uint32_t seen = 0;
+    for (int b = 0; b < LOOP_BENCH_BUCKETS; b++) {
+        seen += h.bucket[b];
+        if (seen >= rank) {
+            uint32_t upper = bucket_upper(b);
+            return upper < h.max ? upper : h.max;
+        }
+    }
+    return h.max;
+}
+
+static uint32_t to_ns(uint32_t ticks)
+{
+    uint64_t ns = (uint64_t)ticks * 1000 / TICKS_PER_US;
+    return ns < UINT32_MAX ? (uint32_t)ns : UINT32_MAX;
+}
+
+void loop_bench_stats(loop_stage_t stage, loop_stats_t *stats)
+{
+    const stage_histogram &h = stages[stage];
+    stats->count = h.count;
+    stats->over = h.over;
+    stats->p50_ns = to_ns(quantile(h, 0.50));
+    stats->p99_ns = to_ns(quantile(h, 0.99));
+    stats->max_ns = to_ns(h.max);
+    stats->budget_us = h.budget_us;
+}
+
+static bool stage_pass(const stage_histogram &h)
+{
+    return h.count == 0 || quantile(h, 0.99) <= h.budget;
+}
+
+bool loop_bench_pass(void)
+{
+    for (const auto &h : stages) {
+        if (!stage_pass(h)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const char *loop_bench_stage_name(int stage)
+{
+    return stage >= 0 && stage < LOOP_STAGE_COUNT ? NAMES[stage] : "unknown";
+}
+
+struct json_out {
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+static void put(json_out *out, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    char *at = out->buf && out->len < out->size ? out->buf + out->len : NULL;
+    int n = vsnprintf(at, at ? out->size - out->len : 0, fmt, args);
+    va_end(args);
+    out->len += n > 0 ? (size_t)n : 0;
+}
+
+size_t loop_bench_report(char *buf, size_t size)
+{
+    json_out out = {buf, size, 0};
+    if (buf && size) {
+        buf[0] = '\0';
+    }
+    put(&out, "{\"clock\":\"%s\",\"ticks_per_us\":%d,\"pass\":%s,\"stages\":[", CLOCK_NAME, TICKS_PER_US,
+        loop_bench_pass() ? "true" : "false");
+    for (int s = 0; s < LOOP_STAGE_COUNT; s++) {
+        const stage_histogram &h = stages[s];
+        loop_stats_t st;
+        loop_bench_stats((loop_stage_t)s, &st);
+        put(&out, "%s{\"name\":\"%s\",\"count\":%u,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,"
+            "\"budget_us\":%u,\"over\":%u,\"pass\":%s,\"histogram\":[", s ? "," : "", NAMES[s],
+            (unsigned)st.count, st.p50_ns / 1e3, st.p99_ns / 1e3, st.max_ns / 1e3, (unsigned)st.budget_us,
+            (unsigned)st.over, stage_pass(h) ? "true" : "false");
+        // [upper bound, count] of the buckets with samples
+        bool first = true;
+        for (int b = 0; b < LOOP_BENCH_BUCKETS; b++) {
+            if (h.bucket[b]) {
+                put(&out, "%s[%.3f,%u]", first ? "" : ",", to_ns(bucket_upper(b)) / 1e3, (unsigned)h.bucket[b]);
+                first = false;
+            }
+        }
+        put(&out, "]}");
+    }
+    put(&out, "]}");
+    return out.len;
+}
+
+#endif
+
+#if defined(__linux__) && !defined(LOOP_BENCH_NO_MAIN)
+
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * The histogram against an exact sort of the same samples, and the cost
+ * of timing a stage on the host.
+ *
+ *   g++ -std=c++17 -O2 loop_bench.cpp
+ */
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    printf("%-56s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+static uint32_t lcg = 1;
+
+static double uniform()
+{
+    lcg = lcg * 1664525u + 1013904223u;
+    return (lcg >> 8) / (double)(1u << 24);
+}
+
+static uint32_t exact(std::vector<uint32_t> sorted, double q)
+{
+    std::sort(sorted.begin(), sorted.end());
+    size_t rank = (size_t)(q * sorted.size() + 0.999999);
+    return sorted[(rank < 1 ? 1 : rank) - 1];
+}
+
+static bool close_above(uint32_t estimate, uint32_t exact)
+{
+    return estimate >= exact && estimate <= exact + exact / SUB_COUNT;
+}
+
+int main()
+{
+    bool ok = true;
+    for (int b = 1; b < LOOP_BENCH_BUCKETS; b++) {
+        ok &= bucket_lower(b) == bucket_upper(b - 1) + 1 && bucket_of(bucket_lower(b)) == b &&
+              bucket_of(bucket_upper(b)) == b;
+    }
+    check(ok && bucket_of(0) == 0 && bucket_of(UINT32_MAX) == LOOP_BENCH_BUCKETS - 1,
+          "buckets cover 32 bits without gaps");
+
+    // a pid_calculate of about 3 us with a tail of interrupted calls
+    std::vector<uint32_t> samples;
+    for (int i = 0; i < 100000; i++) {
+        uint32_t ns = 2500 + (uint32_t)(uniform() * 1000);
+        if (uniform() < 0.02) {
+            ns += (uint32_t)(uniform() * 40000);
+        }
+        samples.push_back(ns);
+        count(LOOP_PID, ns);
+    }
+    loop_stats_t st;
+    loop_bench_stats(LOOP_PID, &st);
+    check(st.count == samples.size(), "every sample counted");
+    check(close_above(st.p50_ns, exact(samples, 0.50)), "p50 within 12.5% above the exact one");
+    check(close_above(st.p99_ns, exact(samples, 0.99)), "p99 within 12.5% above the exact one");
+    check(st.max_ns == *std::max_element(samples.begin(), samples.end()), "max exact");
+    uint32_t over = (uint32_t)std::count_if(samples.begin(), samples.end(),
+                                            [](uint32_t ns) { return ns > CONFIG_LOOP_BENCH_PID_US * 1000; });
+    check(st.over == over, "samples over budget counted");
+    check(!loop_bench_pass(), "a p99 over budget fails");
+    loop_bench_set_budget(LOOP_PID, st.p99_ns / 1000 + 1);
+    check(loop_bench_pass(), "and passes with a larger budget");
+
+    loop_bench_period(10000);
+    loop_bench_period(10300);
+    loop_bench_period(3600000000LL);
+    loop_bench_period(10100);
+    loop_bench_stats(LOOP_PERIOD, &st);
+    check(st.count == 3 && st.max_ns == 10300000 && close_above(st.p50_ns, 10100000), "periods in us");
+    loop_bench_stats(LOOP_JITTER, &st);
+    check(st.count == 1 && st.max_ns == 300000, "jitter of two periods in a row, not across a suspension");
+
+    size_t need = loop_bench_report(NULL, 0);
+    std::string json(need + 1, '\0');
+    size_t len = loop_bench_report(&json[0], json.size());
+    json.resize(strlen(json.c_str()));
+    int depth = 0;
+    bool balanced = true;
+    for (char c : json) {
+        depth += c == '{' || c == '[' ? 1 : c == '}' || c == ']' ? -1 : 0;
+        balanced &= depth >= 0;
+    }
+    check(len == need && json.size() == need && balanced && depth == 0, "report sized and balanced");
+    check(json.find("\"name\":\"motor_run\",\"count\":0,") != std::string::npos &&
+          json.find("\"name\":\"pid_calculate\",\"count\":100000,") != std::string::npos, "report has every stage");
+    char small[64];
+    check(loop_bench_report(small, sizeof(small)) == need && strlen(small) == sizeof(small) - 1,
+          "a short buffer is truncated");
+
+    loop_bench_reset();
+    loop_bench_stats(LOOP_PID, &st);
+    check(st.count == 0 && st.max_ns == 0 && st.p99_ns == 0 && loop_bench_pass(), "reset");
+
+    const int n = 1000000;
+    uint32_t t0 = loop_bench_now();
+    for (int i = 0; i < n; i++) {
+        uint32_t start = loop_bench_now();
+        loop_bench_end(LOOP_MOTOR_RUN, start);
+    }
+    uint32_t cost = loop_bench_now() - t0;
+    printf("timing a stage costs %.1f ns on the host\n", (double)cost / n);
+    loop_bench_stats(LOOP_MOTOR_RUN, &st);
+    printf("%-20s %8s %10s %10s %10s\n", "stage", "count", "p50 ns", "p99 ns", "max ns");
+    printf("%-20s %8u %10u %10u %10u\n", "empty stage", (unsigned)st.count, (unsigned)st.p50_ns,
+           (unsigned)st.p99_ns, (unsigned)st.max_ns);
+
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
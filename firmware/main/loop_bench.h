@@ -0,0 +1,158 @@
+/*
+   Timing of the control loop, stage by stage.
+
+   With CONFIG_LOOP_BENCH each stage of the IMU task's tick is timed with
+   the CPU cycle counter and counted into a histogram of 8 buckets per
+   octave, so p50 and p99 are upper bounds at most 12.5% above the exact
+   ones and the maximum is exact. The period is the time between two
+   ticks on esp_timer and the jitter the difference between two periods
+   in a row, what the BMI270 cycle and the FreeRTOS scheduling of the IMU
+   task add to its 10 ms delay.
+
+   The stages nest: imu_cycle holds datafusion_update and gimbal_update,
+   which holds two motor_run, which hold the pid_calculate calls. Cycles
+   are counted at CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, the frequency power.cpp
+   keeps while tracking; at night the CPU may run slower and the figures
+   of the ticks then are too high.
+
+   GET /api/v1/bench serves loop_bench_report(), DELETE starts over. The
+   budgets are p99 limits in us; a stage over its budget fails the
+   report. tools/bench builds this file on the host, where the clock is
+   the host's in ns, replays a synthetic recording and fails when a
+   budget is exceeded. Without CONFIG_LOOP_BENCH the macros compile to
+   nothing.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __linux__
+#include <time.h>
+#else
+#include "sdkconfig.h"
+#include "esp_cpu.h"
+#endif
+
+#ifndef CONFIG_LOOP_BENCH_PERIOD_US
+#define CONFIG_LOOP_BENCH_PERIOD_US     12000
+#endif
+#ifndef CONFIG_LOOP_BENCH_JITTER_US
+#define CONFIG_LOOP_BENCH_JITTER_US     1000
+#endif
+#ifndef CONFIG_LOOP_BENCH_IMU_CYCLE_US
+#define CONFIG_LOOP_BENCH_IMU_CYCLE_US  4000
+#endif
+#ifndef CONFIG_LOOP_BENCH_FUSION_US
+#define CONFIG_LOOP_BENCH_FUSION_US     100
+#endif
+#ifndef CONFIG_LOOP_BENCH_GIMBAL_US
+#define CONFIG_LOOP_BENCH_GIMBAL_US     1000
+#endif
+#ifndef CONFIG_LOOP_BENCH_MOTOR_US
+#define CONFIG_LOOP_BENCH_MOTOR_US      200
+#endif
+#ifndef CONFIG_LOOP_BENCH_PID_US
+#define CONFIG_LOOP_BENCH_PID_US        20
+#endif
+
+#define LOOP_STAGE_LIST \
+X(LOOP_PERIOD, "period", CONFIG_LOOP_BENCH_PERIOD_US) \
+X(LOOP_JITTER, "jitter", CONFIG_LOOP_BENCH_JITTER_US) \
+X(LOOP_IMU_CYCLE, "imu_cycle", CONFIG_LOOP_BENCH_IMU_CYCLE_US) \
+X(LOOP_DATAFUSION, "datafusion_update", CONFIG_LOOP_BENCH_FUSION_US) \
+X(LOOP_GIMBAL, "gimbal_update", CONFIG_LOOP_BENCH_GIMBAL_US) \
+X(LOOP_MOTOR_RUN, "motor_run", CONFIG_LOOP_BENCH_MOTOR_US) \
+X(LOOP_PID, "pid_calculate", CONFIG_LOOP_BENCH_PID_US) \
+
+typedef enum {
+#define X(name, desc, budget) name,
+    LOOP_STAGE_LIST
+#undef X
+    LOOP_STAGE_COUNT
+} loop_stage_t;
+
+#define LOOP_BENCH_SUB_BITS     3                           // 8 buckets per octave
+#define LOOP_BENCH_BUCKETS      ((32 - LOOP_BENCH_SUB_BITS + 1) << LOOP_BENCH_SUB_BITS)
+
+typedef struct {
+    uint32_t count;
+    uint32_t over;              // samples above the budget
+    uint32_t p50_ns, p99_ns, max_ns;
+    uint32_t budget_us;         // of the p99
+} loop_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __linux__
+// ns on the host
+static inline uint32_t loop_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec);
+}
+#else
+// CPU cycles on the target
+static inline uint32_t loop_bench_now(void)
+{
+    return esp_cpu_get_cycle_count();
+}
+#endif
+
+/**
+ * @brief Count the time since start, a loop_bench_now() of the same task
+ */
+void loop_bench_end(loop_stage_t stage, uint32_t start);
+
+/**
+ * @brief Count a duration measured otherwise
+ */
+void loop_bench_sample(loop_stage_t stage, uint32_t us);
+
+/**
+ * @brief Count the time since the last tick and its change, a gap of a second or more is a suspension
+ */
+void loop_bench_period(int64_t us);
+
+/**
+ * @brief Drop what was counted
+ */
+void loop_bench_reset(void);
+
+/**
+ * @brief Change the p99 budget of a stage
+ */
+void loop_bench_set_budget(loop_stage_t stage, uint32_t us);
+
+void loop_bench_stats(loop_stage_t stage, loop_stats_t *stats);
+
+/**
+ * @brief Whether every stage with samples has its p99 within budget
+ */
+bool loop_bench_pass(void);
+
+/**
+ * @brief The stats and non empty buckets of every stage as JSON, times in us
+ * @return length of the whole report, as snprintf; buf may be NULL
+ */
+size_t loop_bench_report(char *buf, size_t size);
+
+const char *loop_bench_stage_name(int stage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef CONFIG_LOOP_BENCH
+#define LOOP_BENCH_BEGIN(var)           uint32_t var = loop_bench_now()
+#define LOOP_BENCH_END(stage, var)      loop_bench_end(stage, var)
+#define LOOP_BENCH_PERIOD(us)           loop_bench_period(us)
+#else
+#define LOOP_BENCH_BEGIN(var)
+#define LOOP_BENCH_END(stage, var)
+#define LOOP_BENCH_PERIOD(us)
+#endif
@@ -12,6 +12,7 @@
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "nmea_parser.h"
+#include "recorder.h"
 
 /**
  * @brief NMEA Parser runtime buffer size
@@ -572,6 +573,9 @@ static void esp_handle_uart_pattern(esp_gps_t *esp_gps)
         int read_len = uart_read_bytes(esp_gps->uart_port, esp_gps->buffer, pos + 1, 100 / portTICK_PERIOD_MS);
         /* make sure the line is a standard string */
         esp_gps->buffer[read_len] = '\0';
+        if (read_len > 0) {
+            recorder_tap(REC_NMEA, esp_gps->buffer, read_len);
+        }
         /* Send new line to handle */
         if (gps_decode(esp_gps, read_len + 1) != ESP_OK) {
             ESP_LOGW(GPS_TAG, "GPS decode line failed");
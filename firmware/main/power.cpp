@@ -0,0 +1,303 @@
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "board.h"
+#include "adc.h"
+#include "gimbal.h"
+#include "setting.h"
+#include "web.h"
+#include "power.h"
+#include "tslog.h"
+
+static const char *TAG = "power";
+
+#define POWER_POLL_MS           60000   // day and night checks
+#define POWER_WAKING_POLL_MS    100     // resolution of the time to track
+#define POWER_PARK_TIMEOUT_MS   60000
+#define POWER_TRACK_TIMEOUT_S   600     // give up measuring the time to track
+#define POWER_SUNRISE_STEP_S    600
+#define POWER_SUNRISE_SEARCH_S  (36 * 3600)
+
+extern Gimbal gimbal;
+
+static const char *s_state_names[] = {
+#define X(name, desc) desc,
+    POWER_STATE_LIST
+#undef X
+};
+
+// RTC_DATA survives deep sleep and is initialized on power on
+static RTC_DATA_ATTR power_status_t s_status = {
+    .state = POWER_ACTIVE,
+    .sunrise = 0,
+    .next_wake = 0,
+    .active_current = NAN,
+    .idle_current = NAN,
+    .idle_voltage = NAN,
+    .time_to_track_ms = 0,
+    .slept_s = 0,
+    .nights = 0,
+};
+static RTC_DATA_ATTR int64_t s_sleep_start = 0;
+
+static int64_t s_wake_us = 0;   // esp_timer time of the wake up, 0 is boot
+static const gpio_num_t s_motor_pins[] = {
+    (gpio_num_t)BOARD_IO_MOTX_IN1, (gpio_num_t)BOARD_IO_MOTX_IN2,
+    (gpio_num_t)BOARD_IO_MOTY_IN1, (gpio_num_t)BOARD_IO_MOTY_IN2,
+};
+
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t s_cpu_lock = NULL;
+static esp_pm_lock_handle_t s_awake_lock = NULL;
+#endif
+
+// the control loop runs at full speed and without sleeping during the day
+static void hold_locks(bool hold)
+{
+#if CONFIG_PM_ENABLE
+    if (hold) {
+        esp_pm_lock_acquire(s_cpu_lock);
+        esp_pm_lock_acquire(s_awake_lock);
+    } else {
+        esp_pm_lock_release(s_awake_lock);
+        esp_pm_lock_release(s_cpu_lock);
+    }
+#endif
+}
+
+static double sun_elevation(time_t t)
+{
+    cSunCoordinates sun;
+    gimbal.getSunPositionAt(t, &sun);
+    return sun.dElevation;
+}
+
+/**
+ * @brief First time after `from` the sun rises above the park elevation
+ * @return unix time to a second, 0 if there is none within 36h
+ */
+static time_t next_sunrise(time_t from)
+{
+    for (time_t t = from; t < from + POWER_SUNRISE_SEARCH_S; t += POWER_SUNRISE_STEP_S) {
+        if (sun_elevation(t + POWER_SUNRISE_STEP_S) <= GIMBAL_PARK_ELEVATION) {
+            continue;
+        }
+        time_t lo = t, hi = t + POWER_SUNRISE_STEP_S;
+        while (hi - lo > 1) {
+            time_t mid = lo + (hi - lo) / 2;
+            if (sun_elevation(mid) > GIMBAL_PARK_ELEVATION) {
+                hi = mid;
+            } else {
+                lo = mid;
+            }
+        }
+        return hi;
+    }
+    return 0;
+}
+
+/**
+ * @brief Average of the latest supply current samples, NAN if not wired
+ */
+static float supply_current(int ms)
+{
+    if (!adc_is_wired(ADC_SIG_SUPPLY_CURRENT)) {
+        return NAN;
+    }
+    float samples[128];
+    int count = adc_get_output_rate() * ms / 1000;
+    count = adc_get_history(ADC_SIG_SUPPLY_CURRENT, samples, count < 128 ? count : 128);
+    if (count == 0) {
+        return NAN;
+    }
+    float sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    return sum / count;
+}
+
+static void enter_night(time_t now, time_t wake)
+{
+    s_status.state = POWER_PARKING;
+    s_status.active_current = supply_current(200);
+
+    // the update task aims at the park position once the sun is down
+    gimbal.triger_task_immediate();
+    int64_t t0 = esp_timer_get_time();
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    while (!gimbal.isOnTarget() && esp_timer_get_time() - t0 < POWER_PARK_TIMEOUT_MS * 1000LL) {
+        vTaskDelay(pdMS_TO_TICKS(200));
+    }
+    gimbal.suspend();
+
+    // the ADC still runs, the board is now as idle as it gets while awake
+    vTaskDelay(pdMS_TO_TICKS(500));
+    s_status.idle_current = supply_current(200);
+    s_status.idle_voltage = adc_read_voltage();
+    s_status.next_wake = wake;
+    s_status.nights++;
+    s_sleep_start = now;
+    ESP_LOGI(TAG, "parked, idle %.3fA at %.2fV (tracking %.3fA), sleeping %llds until sunrise -%dmin",
+             s_status.idle_current, s_status.idle_voltage, s_status.active_current,
+             (long long)(wake - now), CONFIG_POWER_WAKE_MARGIN_MIN);
+
+#if CONFIG_POWER_NIGHT_AWAKE
+    s_status.state = POWER_NIGHT;
+#else
+    wifi_set_night(true);
+    adc_pause(true);
+    s_status.state = POWER_NIGHT;
+#if CONFIG_POWER_NIGHT_DEEP_SLEEP
+    // keep the bridge inputs low, the LEDC stops with the chip
+    for (size_t i = 0; i < sizeof(s_motor_pins) / sizeof(s_motor_pins[0]); i++) {
+        gpio_hold_en(s_motor_pins[i]);
+    }
+    gpio_deep_sleep_hold_en();
+    esp_sleep_enable_timer_wakeup((uint64_t)(wake - now) * 1000000ULL);
+    tslog_flush();
+    esp_deep_sleep_start();
+#else
+    hold_locks(false);
+#endif
+#endif
+}
+
+static void leave_night(time_t now)
+{
+#if !CONFIG_POWER_NIGHT_AWAKE
+    hold_locks(true);
+    adc_pause(false);
+    wifi_set_night(false);
+#endif
+    gimbal.resume();
+    s_status.slept_s = (uint32_t)(now - s_sleep_start);
+    s_status.state = POWER_WAKING;
+    s_wake_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "awake after %us", (unsigned)s_status.slept_s);
+}
+
+static void check_tracking(time_t now)
+{
+    if (gimbal.isTracking()) {
+        // tracking cannot start before sunrise, count from the later of both
+        int64_t start_us = s_wake_us;
+        if (s_status.sunrise > s_status.next_wake) {
+            start_us += (s_status.sunrise - s_status.next_wake) * 1000000LL;
+        }
+        int64_t ready_us = esp_timer_get_time();
+        s_status.time_to_track_ms = ready_us > start_us ? (uint32_t)((ready_us - start_us) / 1000) : 0;
+        s_status.state = POWER_ACTIVE;
+        s_status.next_wake = 0;
+        ESP_LOGI(TAG, "tracking %ums after wake up", (unsigned)s_status.time_to_track_ms);
+    } else if (now > s_status.sunrise + POWER_TRACK_TIMEOUT_S && now > s_status.next_wake + POWER_TRACK_TIMEOUT_S) {
+        ESP_LOGW(TAG, "not on target %ds after sunrise", POWER_TRACK_TIMEOUT_S);
+        s_status.state = POWER_ACTIVE;
+        s_status.next_wake = 0;
+    }
+}
+
+static void power_task(void *arg)
+{
+    while (1) {
+        time_t now;
+        time(&now);
+        uint32_t delay_ms = POWER_POLL_MS;
+
+        switch (s_status.state) {
+        case POWER_ACTIVE:
+            if (g_settings.mode != MODE_MANUAL && sun_elevation(now) <= GIMBAL_PARK_ELEVATION) {
+                time_t sunrise = next_sunrise(now);
+                time_t wake = sunrise - CONFIG_POWER_WAKE_MARGIN_MIN * 60;
+                if (sunrise != 0 && wake - now >= CONFIG_POWER_MIN_NIGHT_MIN * 60) {
+                    s_status.sunrise = sunrise;
+                    enter_night(now, wake);
+                }
+            }
+            break;
+
+        case POWER_NIGHT: {
+            // manual mode, set by a client during the access point window, wants the gimbal to move
+            if (now >= s_status.next_wake || g_settings.mode == MODE_MANUAL) {
+                leave_night(now);
+                delay_ms = POWER_WAKING_POLL_MS;
+                break;
+            }
+            if ((s_status.next_wake - now) * 1000 < POWER_POLL_MS) {
+                delay_ms = (uint32_t)(s_status.next_wake - now) * 1000;
+            }
+            uint32_t wifi_ms = wifi_night_poll();
+            delay_ms = wifi_ms < delay_ms ? wifi_ms : delay_ms;
+        } break;
+
+        case POWER_WAKING:
+            check_tracking(now);
+            delay_ms = POWER_WAKING_POLL_MS;
+            break;
+
+        default:
+            s_status.state = POWER_ACTIVE;
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    }
+}
+
+void power_init(void)
+{
+    // release the bridge inputs held through deep sleep
+    gpio_deep_sleep_hold_dis();
+    for (size_t i = 0; i < sizeof(s_motor_pins) / sizeof(s_motor_pins[0]); i++) {
+        gpio_hold_dis(s_motor_pins[i]);
+    }
+
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = 40,
+#if CONFIG_POWER_NIGHT_LIGHT_SLEEP
+        .light_sleep_enable = true,
+#else
+        .light_sleep_enable = false,
+#endif
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "track", &s_cpu_lock);
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "track", &s_awake_lock);
+    hold_locks(true);
+#endif
+
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER && s_status.state == POWER_NIGHT) {
+        // woken from deep sleep, the boot is part of the time to track
+        time_t now;
+        time(&now);
+        s_status.slept_s = (uint32_t)(now - s_sleep_start);
+        s_status.state = POWER_WAKING;
+        s_wake_us = 0;
+        ESP_LOGI(TAG, "woke from deep sleep after %us", (unsigned)s_status.slept_s);
+    } else {
+        s_status.state = POWER_ACTIVE;
+        s_status.next_wake = 0;
+    }
+}
+
+void power_start(void)
+{
+    xTaskCreate(power_task, "power", 3072, NULL, 2, NULL);
+}
+
+void power_get_status(power_status_t *status)
+{
+    *status = s_status;
+}
+
+const char *power_state_name(power_state_t state)
+{
+    return state < POWER_STATE_COUNT ? s_state_names[state] : "Unknown";
+}
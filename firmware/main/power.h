@@ -0,0 +1,63 @@
+/*
+   Power state manager.
+
+   After sunset the gimbal is parked facing south, the motor drivers and
+   IMU polling are stopped and the chip sleeps until CONFIG_POWER_WAKE_MARGIN_MIN
+   before the next sunrise, which is found from the ephemeris:
+
+   - light sleep: FreeRTOS tickless idle sleeps whenever no task is ready.
+     A station stays associated and wakes for every
+     CONFIG_WIFI_STA_LISTEN_INTERVAL-th beacon. An access point cannot
+     sleep, it is on for CONFIG_WIFI_AP_NIGHT_ON_MIN of every
+     CONFIG_WIFI_AP_NIGHT_PERIOD_MIN and as long as a client is connected;
+   - deep sleep: a timer wakes the chip, it boots and restores the yaw
+     position from RTC memory without homing. Wi-Fi is off all night.
+
+   Manual mode, set by a client while Wi-Fi is up, keeps the gimbal awake
+   and wakes it from light sleep. The supply current measured before
+   the chip goes to sleep and the time from wake up to tracking again are
+   reported, if the supply current is wired to the ADC.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#define POWER_STATE_LIST \
+X(POWER_ACTIVE, "Active") \
+X(POWER_PARKING, "Parking") \
+X(POWER_NIGHT, "Night") \
+X(POWER_WAKING, "Waking") \
+
+typedef enum {
+#define X(name, desc) name,
+    POWER_STATE_LIST
+#undef X
+    POWER_STATE_COUNT
+} power_state_t;
+
+typedef struct {
+    power_state_t state;
+    int64_t sunrise;            // unix time of the next / last sunrise, 0 if unknown
+    int64_t next_wake;          // unix time the night ends, 0 if not sleeping
+    float active_current;       // A, supply current while tracking, NAN if not measured
+    float idle_current;         // A, parked with motors and IMU stopped, NAN if not measured
+    float idle_voltage;         // V, supply at the idle current measurement
+    uint32_t time_to_track_ms;  // from wake up, or sunrise if later, to on target
+    uint32_t slept_s;           // length of the last night
+    uint32_t nights;
+} power_status_t;
+
+/**
+ * @brief Early init, before the motor drivers are configured
+ */
+void power_init(void);
+
+/**
+ * @brief Start the power state task, after the gimbal is running
+ */
+void power_start(void);
+
+void power_get_status(power_status_t *status);
+
+const char *power_state_name(power_state_t state);
@@ -0,0 +1,457 @@
+#include <string.h>
+#include "profiler.h"
+
+#ifndef __linux__
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_freertos_hooks.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "profiler";
+#endif
+
+uint16_t TaskProfiler::fragmentation(const profile_heap_t &heap)
+{
+    if (heap.free == 0) {
+        return 0;
+    }
+    return (uint16_t)(1000 - (uint64_t)heap.largest * 1000 / heap.free);
+}
+
+int TaskProfiler::slot_of(const void *handle) const
+{
+    for (int i = 0; i < used; i++) {
+        if (slot_task[i].handle == handle) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * A free slot, or the first one of a deleted task. Its column of the
+ * history belonged to the deleted task and is cleared.
+ */
+int TaskProfiler::assign(const profile_sample_t &task)
+{
+    int s = -1;
+    if (used < PROFILER_MAX_TASKS) {
+        s = used++;
+    } else {
+        for (int i = 0; i < PROFILER_MAX_TASKS && s < 0; i++) {
+            if (!info[i].alive && !slot_task[i].seen) {
+                s = i;
+            }
+        }
+        if (s < 0) {
+            dropped++;
+            return -1;
+        }
+        for (auto &point : history) {
+            point.cpu[s] = 0;
+        }
+    }
+    slot_task[s] = {task.handle, task.run_time, true};
+    profile_task_t &t = info[s];
+    memset(&t, 0, sizeof(t));
+    strncpy(t.name, task.name, PROFILER_NAME_LEN - 1);
+    return s;
+}
+
+void TaskProfiler::sample(uint32_t uptime_s, uint32_t total_run_time, int cores, const profile_sample_t *tasks,
+                          int count, const profile_heap_t &heap, const profile_heap_t &psram)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->cores = cores;
+    this->heap = heap;
+    this->psram = psram;
+    // run time of all cores in the period
+    uint64_t total = (uint64_t)(total_run_time - last_total) * cores;
+    last_total = total_run_time;
+    for (auto &s : slot_task) {
+        s.seen = false;
+    }
+
+    profile_point_t point = {};
+    uint32_t idle = 0, switches = 0;
+    point.stack_min = UINT32_MAX;
+    for (int i = 0; i < count; i++) {
+        const profile_sample_t &task = tasks[i];
+        int s = slot_of(task.handle);
+        if (s >= 0 && strncmp(info[s].name, task.name, PROFILER_NAME_LEN - 1) != 0) {
+            // a new task in the memory of a deleted one
+            slot_task[s].handle = nullptr;
+            s = -1;
+        }
+        bool fresh = s < 0;
+        if (fresh && (s = assign(task)) < 0) {
+            continue;
+        }
+        slot &st = slot_task[s];
+        profile_task_t &t = info[s];
+        uint32_t run = task.run_time - st.run_time;
+        st.run_time = task.run_time;
+        st.seen = true;
+        t.alive = true;
+        t.priority = task.priority;
+        t.stack_free = task.stack_free;
+        t.switches = task.switches;
+        uint64_t per_mille = fresh || total == 0 ? 0 : run * 1000ull / total;
+        t.cpu = (uint16_t)(per_mille < 1000 ? per_mille : 1000);
+        t.cpu_peak = t.cpu > t.cpu_peak ? t.cpu : t.cpu_peak;
+        if (!fresh && samples > 0 && task.ready && run == 0) {
+            t.starved++;
+        }
+        if (task.idle) {
+            idle += t.cpu;
+        }
+        switches += task.switches;
+        point.stack_min = task.stack_free < point.stack_min ? task.stack_free : point.stack_min;
+        point.cpu[s] = (uint8_t)((t.cpu + 5) / 10);
+    }
+    for (int s = 0; s < used; s++) {
+        if (!slot_task[s].seen && info[s].alive) {
+            info[s].alive = false;
+            info[s].cpu = 0;
+            info[s].switches = 0;
+            slot_task[s].handle = nullptr;
+        }
+    }
+
+    uint32_t elapsed = uptime_s - last_uptime;
+    last_uptime = uptime_s;
+    if (samples++ == 0) {
+        return;
+    }
+    point.uptime_s = uptime_s;
+    point.busy = (uint16_t)(idle < 1000 ? 1000 - idle : 0);
+    uint32_t rate = elapsed > 0 ? switches / elapsed : switches;
+    point.switches = (uint16_t)(rate < UINT16_MAX ? rate : UINT16_MAX);
+    point.heap_free = heap.free;
+    point.heap_largest = heap.largest;
+    point.psram_free = psram.free;
+    point.psram_largest = psram.largest;
+    point.stack_min = point.stack_min == UINT32_MAX ? 0 : point.stack_min;
+    history[head] = point;
+    head = (head + 1) % CONFIG_PROFILER_HISTORY;
+    points += points < CONFIG_PROFILER_HISTORY;
+}
+
+void TaskProfiler::get_status(profile_status_t *status)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    status->period_s = CONFIG_PROFILER_PERIOD_S;
+    status->cores = cores;
+    status->samples = samples;
+    status->tasks = used;
+    status->dropped = dropped;
+    status->heap = heap;
+    status->psram = psram;
+    if (points > 0) {
+        status->last = history[(head + CONFIG_PROFILER_HISTORY - 1) % CONFIG_PROFILER_HISTORY];
+    } else {
+        memset(&status->last, 0, sizeof(status->last));
+    }
+}
+
+int TaskProfiler::get_tasks(profile_task_t *dst, int max_count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int n = used < max_count ? used : max_count;
+    memcpy(dst, info, n * sizeof(profile_task_t));
+    return n;
+}
+
+int TaskProfiler::get_history(profile_point_t *dst, int max_count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int n = points < max_count ? points : max_count;
+    int first = (head + CONFIG_PROFILER_HISTORY - n) % CONFIG_PROFILER_HISTORY;
+    for (int i = 0; i < n; i++) {
+        dst[i] = history[(first + i) % CONFIG_PROFILER_HISTORY];
+    }
+    return n;
+}
+
+#ifndef __linux__
+
+#define PROFILER_STATUS_MAX     (PROFILER_MAX_TASKS + 8)
+
+static TaskProfiler s_profiler;
+static bool s_running = false;
+
+// the slots the tick hooks count switches for, copied from s_profiler after each sample
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t s_slots[PROFILER_MAX_TASKS];
+static uint32_t s_switches[PROFILER_MAX_TASKS];
+static TaskHandle_t s_last[portNUM_PROCESSORS];
+
+static void IRAM_ATTR profiler_tick(void)
+{
+    int core = xPortGetCoreID();
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    if (task == s_last[core]) {
+        return;
+    }
+    s_last[core] = task;
+    portENTER_CRITICAL_ISR(&s_lock);
+    for (int i = 0; i < PROFILER_MAX_TASKS; i++) {
+        if (s_slots[i] == task) {
+            s_switches[i]++;
+            break;
+        }
+    }
+    portEXIT_CRITICAL_ISR(&s_lock);
+}
+
+static void heap_info(uint32_t caps, profile_heap_t *heap)
+{
+    memset(heap, 0, sizeof(*heap));
+    heap->total = heap_caps_get_total_size(caps);
+    if (heap->total == 0) {
+        return;
+    }
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, caps);
+    heap->free = info.total_free_bytes;
+    heap->largest = info.largest_free_block;
+    heap->min_free = info.minimum_free_bytes;
+}
+
+static void profiler_sample(void)
+{
+    static TaskStatus_t status[PROFILER_STATUS_MAX];
+    static profile_sample_t tasks[PROFILER_STATUS_MAX];
+    uint32_t switches[PROFILER_MAX_TASKS];
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    UBaseType_t count = uxTaskGetSystemState(status, PROFILER_STATUS_MAX, &total);
+    if (count == 0) {
+        ESP_LOGW(TAG, "more than %d tasks", PROFILER_STATUS_MAX);
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    memcpy(switches, s_switches, sizeof(switches));
+    memset(s_switches, 0, sizeof(s_switches));
+    portEXIT_CRITICAL(&s_lock);
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        const TaskStatus_t &st = status[i];
+        profile_sample_t &task = tasks[i];
+        task.handle = st.xHandle;
+        task.name = st.pcTaskName;
+        task.run_time = (uint32_t)st.ulRunTimeCounter;
+        task.stack_free = st.usStackHighWaterMark;
+        task.priority = (uint8_t)st.uxCurrentPriority;
+        task.ready = st.eCurrentState == eReady;
+        task.idle = false;
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            task.idle |= st.xHandle == xTaskGetIdleTaskHandleForCore(core);
+        }
+        int slot = s_profiler.slot_of(st.xHandle);
+        task.switches = slot >= 0 ? switches[slot] : 0;
+    }
+    profile_heap_t heap, psram;
+    heap_info(MALLOC_CAP_INTERNAL, &heap);
+    heap_info(MALLOC_CAP_SPIRAM, &psram);
+    s_profiler.sample((uint32_t)(esp_timer_get_time() / 1000000), (uint32_t)total, portNUM_PROCESSORS, tasks,
+                      (int)count, heap, psram);
+
+    // a slot taken by another task counts from zero
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < PROFILER_MAX_TASKS; i++) {
+        TaskHandle_t handle = (TaskHandle_t)s_profiler.slot_handle(i);
+        if (handle != s_slots[i]) {
+            s_slots[i] = handle;
+            s_switches[i] = 0;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void profiler_task(void *arg)
+{
+    TickType_t wake = xTaskGetTickCount();
+    while (true) {
+        profiler_sample();
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(CONFIG_PROFILER_PERIOD_S * 1000));
+    }
+}
+
+void profiler_init(void)
+{
+    if (CONFIG_PROFILER_PERIOD_S == 0) {
+        return;
+    }
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        esp_register_freertos_tick_hook_for_cpu(profiler_tick, core);
+    }
+    s_running = true;
+    xTaskCreate(profiler_task, "profiler", 3072, NULL, 1, NULL);
+}
+
+bool profiler_get_status(profile_status_t *status)
+{
+    if (!s_running) {
+        return false;
+    }
+    s_profiler.get_status(status);
+    return true;
+}
+
+int profiler_get_tasks(profile_task_t *dst, int max_count)
+{
+    return s_profiler.get_tasks(dst, max_count);
+}
+
+int profiler_get_history(profile_point_t *dst, int max_count)
+{
+    return s_profiler.get_history(dst, max_count);
+}
+
+#endif
+
+// run test on linux, PROFILER_NO_MAIN when linked into another program
+#if defined(__linux__) && !defined(PROFILER_NO_MAIN)
+
+#include <stdio.h>
+
+/*
+ * Two cores of a tracker over a few periods: the control loop, an httpd
+ * that comes and goes, a task starved by a busy one above it, the run
+ * time counter wrapping and more tasks than slots.
+ *
+ *   g++ -std=c++17 -O2 profiler.cpp
+ */
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    printf("%-56s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+struct sim_task {
+    int id;
+    const char *name;
+    uint32_t run_time;
+    uint8_t priority;
+    bool idle;
+};
+
+static int slot_named(TaskProfiler &p, const char *name)
+{
+    profile_task_t tasks[PROFILER_MAX_TASKS];
+    int n = p.get_tasks(tasks, PROFILER_MAX_TASKS);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(tasks[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main()
+{
+    static TaskProfiler p;
+    const uint32_t period_us = 10000000;
+    // starts 1 s before the counter wraps
+    uint32_t clock = UINT32_MAX - 1000000;
+    sim_task sim[] = {
+        {1, "IDLE0", clock, 0, true},
+        {2, "IDLE1", clock, 0, true},
+        {3, "imu_task", 0, 24, false},
+        {4, "gimbal_update", 0, 5, false},
+        {5, "low", 0, 1, false},
+        {6, "httpd", 0, 5, false},
+    };
+    profile_heap_t heap = {300000, 120000, 30000, 90000}, none = {};
+    const int cores = 2;
+
+    // per period of 10 s and 2 cores: imu 5%, gimbal 2%, low 0 and ready
+    auto run = [&](int periods, bool with_httpd, uint32_t uptime) {
+        for (int k = 0; k < periods; k++) {
+            clock += period_us;
+            sim[2].run_time += period_us * cores / 20;
+            sim[3].run_time += period_us * cores / 50;
+            uint32_t busy = period_us * cores / 20 + period_us * cores / 50;
+            if (with_httpd) {
+                sim[5].run_time += period_us * cores / 10;
+                busy += period_us * cores / 10;
+            }
+            sim[0].run_time += (period_us * cores - busy) / 2;
+            sim[1].run_time += (period_us * cores - busy) / 2;
+            profile_sample_t samples[6];
+            int n = 0;
+            for (int i = 0; i < 6; i++) {
+                if (i == 5 && !with_httpd) {
+                    continue;
+                }
+                samples[n++] = {(const void *)(intptr_t)sim[i].id, sim[i].name, sim[i].run_time,
+                                (uint32_t)(1000 + 100 * i), sim[i].priority, i == 4, sim[i].idle, (uint32_t)(i * 10)};
+            }
+            p.sample(uptime + k * 10, clock, cores, samples, n, heap, none);
+        }
+    };
+    run(1, true, 100);
+    profile_status_t status;
+    p.get_status(&status);
+    check(status.samples == 1 && status.tasks == 6, "the first sample sets the counters");
+    run(3, true, 110);
+    p.get_status(&status);
+    profile_task_t tasks[PROFILER_MAX_TASKS];
+    int n = p.get_tasks(tasks, PROFILER_MAX_TASKS);
+    int imu = slot_named(p, "imu_task"), httpd = slot_named(p, "httpd"), low = slot_named(p, "low");
+    check(n == 6 && tasks[imu].cpu == 50 && tasks[slot_named(p, "gimbal_update")].cpu == 20,
+          "CPU per mille of both cores, across the counter wrap");
+    check(status.last.busy == 170, "busy is all but the idle tasks");
+    check(tasks[low].starved == 3, "a ready task without CPU is starved");
+    check(tasks[imu].stack_free == 1200 && status.last.stack_min == 1000, "stack high water marks");
+    check(status.last.switches == (0 + 10 + 20 + 30 + 40 + 50) / 10, "switches per second");
+    check(TaskProfiler::fragmentation(heap) == 750, "fragmentation of the heap");
+
+    run(2, false, 140);
+    n = p.get_tasks(tasks, PROFILER_MAX_TASKS);
+    p.get_status(&status);
+    check(!tasks[httpd].alive && tasks[httpd].cpu == 0 && tasks[httpd].cpu_peak == 100,
+          "a deleted task keeps its slot and its peak");
+    check(status.last.cpu[httpd] == 0 && status.last.cpu[imu] == 5, "history in percent by slot");
+
+    profile_point_t history[CONFIG_PROFILER_HISTORY];
+    int points = p.get_history(history, CONFIG_PROFILER_HISTORY);
+    check(points == 5 && history[0].uptime_s == 110 && history[4].uptime_s == 150 && history[0].cpu[httpd] == 10,
+          "history oldest first");
+    run(CONFIG_PROFILER_HISTORY, false, 160);
+    points = p.get_history(history, CONFIG_PROFILER_HISTORY);
+    check(points == CONFIG_PROFILER_HISTORY && history[points - 1].uptime_s == 160 + (CONFIG_PROFILER_HISTORY - 1) * 10,
+          "the history is a ring");
+
+    // more tasks than slots, the dead httpd slot is reused first
+    profile_sample_t many[PROFILER_MAX_TASKS + 2];
+    char names[PROFILER_MAX_TASKS + 2][PROFILER_NAME_LEN];
+    for (int i = 0; i < PROFILER_MAX_TASKS + 2; i++) {
+        snprintf(names[i], sizeof(names[i]), "t%d", i);
+        many[i] = {(const void *)(intptr_t)(100 + i), names[i], 0, 500, 1, false, false, 0};
+    }
+    clock += period_us;
+    p.sample(1000, clock, cores, many, PROFILER_MAX_TASKS + 2, heap, none);
+    p.get_status(&status);
+    check(status.tasks == PROFILER_MAX_TASKS && status.dropped > 0, "tasks without a slot are dropped");
+    n = p.get_tasks(tasks, PROFILER_MAX_TASKS);
+    check(strcmp(tasks[httpd].name, "httpd") != 0 && tasks[httpd].alive, "a new task takes a dead slot");
+    points = p.get_history(history, CONFIG_PROFILER_HISTORY);
+    bool cleared = true;
+    for (int i = 0; i < points; i++) {
+        cleared &= history[i].cpu[httpd] == 0;
+    }
+    check(cleared, "and the column of the dead one is cleared");
+
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
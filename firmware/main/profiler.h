@@ -0,0 +1,157 @@
+/*
+   Runtime profile of the FreeRTOS tasks and the heap.
+
+   Every CONFIG_PROFILER_PERIOD_S a low priority task reads
+   uxTaskGetSystemState() and the heap of each capability and works out
+   over the last period:
+     - the CPU of each task, per mille of all cores, from the run time
+       counters, and the busy share of the cores (all but the idle tasks);
+     - the stack high water mark of each task, the bytes its stack never
+       used: the size given to xTaskCreate() less it is the peak use;
+     - the free bytes, largest free block and lowest free bytes ever of
+       the internal heap and of PSRAM if there is one; the fragmentation
+       is 1 - largest / free;
+     - the context switches, seen by a tick hook on each core: a task
+       running on a core at a tick that did not run there at the previous
+       tick. A task that blocks within a tick is not seen, the count is a
+       lower bound to compare between periods;
+     - the periods a task was ready to run at the sample and got no CPU in
+       the whole period, starved by the tasks above it.
+
+   Tasks get a slot the first time they are seen and keep it, a deleted
+   task leaves its slot to the next new one when all are taken. The last
+   CONFIG_PROFILER_HISTORY periods are kept in RAM, each with the CPU of
+   every slot in percent. GET /api/v1/profile serves them.
+
+   Run time counters need CONFIG_FREERTOS_USE_TRACE_FACILITY and
+   CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS, see sdkconfig.defaults. The
+   arithmetic does not depend on ESP-IDF, the host test feeds it samples.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <mutex>
+
+#ifndef CONFIG_PROFILER_PERIOD_S
+#define CONFIG_PROFILER_PERIOD_S    10
+#endif
+#ifndef CONFIG_PROFILER_HISTORY
+#define CONFIG_PROFILER_HISTORY     60
+#endif
+
+#define PROFILER_MAX_TASKS          24
+#define PROFILER_NAME_LEN           16      // configMAX_TASK_NAME_LEN
+
+// what the sampler reads of a task, a TaskStatus_t without FreeRTOS
+typedef struct {
+    const void *handle;
+    const char *name;
+    uint32_t run_time;          // run time counter, wraps
+    uint32_t stack_free;        // high water mark, bytes
+    uint8_t priority;
+    bool ready;                 // eReady at the sample
+    bool idle;                  // an idle task of a core
+    uint32_t switches;          // switched in since the last sample
+} profile_sample_t;
+
+typedef struct {
+    uint32_t total;             // 0 for none
+    uint32_t free;
+    uint32_t largest;           // free block
+    uint32_t min_free;          // since boot
+} profile_heap_t;
+
+typedef struct {
+    char name[PROFILER_NAME_LEN];
+    bool alive;
+    uint8_t priority;
+    uint16_t cpu;               // per mille of all cores over the last period
+    uint16_t cpu_peak;          // of any period
+    uint32_t stack_free;        // bytes, the high water mark
+    uint32_t switches;          // in the last period
+    uint32_t starved;           // periods ready without running
+} profile_task_t;
+
+typedef struct {
+    uint32_t uptime_s;
+    uint16_t busy;              // per mille of all cores
+    uint16_t switches;          // per second, all cores
+    uint32_t heap_free, heap_largest;
+    uint32_t psram_free, psram_largest;
+    uint32_t stack_min;         // lowest high water mark of the tasks
+    uint8_t cpu[PROFILER_MAX_TASKS];    // percent, by slot
+} profile_point_t;
+
+typedef struct {
+    uint32_t period_s;
+    int cores;
+    int samples;                // periods profiled
+    int tasks;                  // slots in use
+    int dropped;                // tasks seen without a free slot
+    profile_heap_t heap, psram;
+    profile_point_t last;
+} profile_status_t;
+
+class TaskProfiler {
+public:
+    /**
+     * @brief Account a sample; the first one only sets the counters
+     * @param total_run_time run time counter of the clock, per core
+     */
+    void sample(uint32_t uptime_s, uint32_t total_run_time, int cores, const profile_sample_t *tasks, int count,
+                const profile_heap_t &heap, const profile_heap_t &psram);
+    void get_status(profile_status_t *status);
+    int get_tasks(profile_task_t *dst, int max_count);
+
+    /**
+     * @brief Copy the history, oldest first
+     * @return points copied
+     */
+    int get_history(profile_point_t *dst, int max_count);
+
+    /**
+     * @brief Slot of a task, -1 for none; from the task calling sample()
+     */
+    int slot_of(const void *handle) const;
+    const void *slot_handle(int slot) const
+    {
+        return slot_task[slot].handle;
+    }
+
+    static uint16_t fragmentation(const profile_heap_t &heap);
+
+private:
+    struct slot {
+        const void *handle;
+        uint32_t run_time;
+        bool seen;              // in the current sample
+    };
+    int assign(const profile_sample_t &task);
+
+    mutable std::mutex mutex;
+    slot slot_task[PROFILER_MAX_TASKS] = {};
+    profile_task_t info[PROFILER_MAX_TASKS] = {};
+    int used = 0;
+    int dropped = 0;
+    int samples = 0;
+    int cores = 1;
+    uint32_t last_total = 0;
+    uint32_t last_uptime = 0;
+    profile_heap_t heap = {}, psram = {};
+    profile_point_t history[CONFIG_PROFILER_HISTORY] = {};
+    int head = 0;               // next point
+    int points = 0;
+};
+
+/**
+ * @brief Start the sampling task and the tick hooks, a period of 0 disables the profiler
+ */
+void profiler_init(void);
+
+/**
+ * @brief Whether the profiler runs
+ */
+bool profiler_get_status(profile_status_t *status);
+int profiler_get_tasks(profile_task_t *dst, int max_count);
+int profiler_get_history(profile_point_t *dst, int max_count);
@@ -0,0 +1,196 @@
+#include <string.h>
+#include <new>
+#include "recorder.h"
+
+#ifndef __linux__
+#include <time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "recorder";
+#endif
+
+static const char *NAMES[REC_TYPE_COUNT] = {
+#define X(name, desc) desc,
+    REC_TYPE_LIST
+#undef X
+};
+
+const char *recorder_type_name(int type)
+{
+    return type >= 0 && type < REC_TYPE_COUNT ? NAMES[type] : "unknown";
+}
+
+bool Recorder::init(size_t size, int64_t hold_us)
+{
+    ring = new (std::nothrow) uint8_t[size];
+    capacity = ring ? size : 0;
+    this->hold_us = hold_us;
+    return ring != nullptr;
+}
+
+void Recorder::copy_in(size_t pos, const void *src, size_t size)
+{
+    size_t first = size < capacity - pos ? size : capacity - pos;
+    memcpy(ring + pos, src, first);
+    memcpy(ring, (const uint8_t *)src + first, size - first);
+}
+
+void Recorder::copy_out(size_t pos, void *dst, size_t size) const
+{
+    size_t first = size < capacity - pos ? size : capacity - pos;
+    memcpy(dst, ring + pos, first);
+    memcpy((uint8_t *)dst + first, ring, size - first);
+}
+
+/*
+ * Frames are contiguous modulo the end of the ring, a new one drops the
+ * oldest until it fits. After a fault the ring keeps recording for
+ * hold_us, then freezes.
+ */
+void Recorder::write(int type, int64_t now_us, const void *data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ring == nullptr) {
+        return;
+    }
+    if (trigger_us != 0 && now_us - trigger_us > hold_us) {
+        frozen = true;
+    }
+    size_t need = sizeof(rec_frame_t) + size;
+    if (paused > 0 || frozen || size > UINT16_MAX || need > capacity) {
+        dropped++;
+        return;
+    }
+    while (capacity - used < need) {
+        rec_frame_t oldest;
+        copy_out(tail, &oldest, sizeof(oldest));
+        size_t skip = sizeof(oldest) + oldest.size;
+        tail = (tail + skip) % capacity;
+        used -= skip;
+        frames--;
+        overwritten++;
+    }
+    rec_frame_t frame = {(uint16_t)type, (uint16_t)size, (uint32_t)now_us};
+    size_t head = (tail + used) % capacity;
+    copy_in(head, &frame, sizeof(frame));
+    copy_in((head + sizeof(frame)) % capacity, data, size);
+    used += need;
+    frames++;
+}
+
+void Recorder::trigger(int64_t now_us)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // the first fault is the incident, what follows is its consequence
+    if (trigger_us == 0 && !frozen) {
+        trigger_us = now_us;
+    }
+}
+
+void Recorder::pause(rec_header_t *header, int64_t now_us)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    paused++;
+    memset(header, 0, sizeof(*header));
+    header->magic = RECORDER_MAGIC;
+    header->version = RECORDER_VERSION;
+    header->frame_size = sizeof(rec_frame_t);
+    header->bytes = used;
+    header->frames = frames;
+    header->overwritten = overwritten;
+    header->dropped = dropped;
+    header->now_us = now_us;
+    header->trigger_us = trigger_us;
+}
+
+size_t Recorder::read(size_t offset, void *dst, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (offset >= used) {
+        return 0;
+    }
+    size = size < used - offset ? size : used - offset;
+    copy_out((tail + offset) % capacity, dst, size);
+    return size;
+}
+
+void Recorder::resume()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (paused > 0) {
+        paused--;
+    }
+}
+
+void Recorder::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    tail = used = 0;
+    frames = overwritten = dropped = 0;
+    trigger_us = 0;
+    // a download still running keeps its pause, it reads an empty ring
+    frozen = false;
+}
+
+#ifndef __linux__
+
+static Recorder s_recorder;
+static bool s_enabled = false;
+
+bool recorder_init(void)
+{
+    if (CONFIG_RECORDER_KB == 0) {
+        return false;
+    }
+    s_enabled = s_recorder.init(CONFIG_RECORDER_KB * 1024, CONFIG_RECORDER_HOLD_S * 1000000LL);
+    if (!s_enabled) {
+        ESP_LOGW(TAG, "no room for %u KB", CONFIG_RECORDER_KB);
+        return false;
+    }
+    ESP_LOGI(TAG, "%u KB, keyframe every %d ticks", CONFIG_RECORDER_KB, RECORDER_KEYFRAME_TICKS);
+    return s_enabled;
+}
+
+bool recorder_active(void)
+{
+    return s_enabled && s_recorder.is_recording();
+}
+
+void recorder_tap(rec_type_t type, void *data, size_t size)
+{
+    if (s_enabled) {
+        s_recorder.write(type, esp_timer_get_time(), data, size);
+    }
+}
+
+void recorder_trigger(void)
+{
+    if (s_enabled) {
+        s_recorder.trigger(esp_timer_get_time());
+        ESP_LOGW(TAG, "fault, freezing in %d s", CONFIG_RECORDER_HOLD_S);
+    }
+}
+
+void recorder_pause(rec_header_t *header)
+{
+    s_recorder.pause(header, esp_timer_get_time());
+    header->time = (uint32_t)time(NULL);
+}
+
+size_t recorder_read(size_t offset, void *dst, size_t size)
+{
+    return s_recorder.read(offset, dst, size);
+}
+
+void recorder_resume(void)
+{
+    s_recorder.resume();
+}
+
+void recorder_clear(void)
+{
+    s_recorder.clear();
+}
+
+#endif
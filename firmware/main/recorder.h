@@ -0,0 +1,213 @@
+/*
+   Flight recorder of the control loop, for replay on the host.
+
+   Every input the loop reads from the hardware passes through
+   recorder_tap() right where it is read: the BMI270 and compass register
+   bursts, the analog snapshot and supply voltage, the tick time, the
+   encoder count with the time of its last edge. So do the NMEA lines and
+   the aim changes, which come from other tasks, and at the end of each
+   tick what the loop put out. On the target a tap appends a frame to a
+   ring in RAM, overwriting the oldest ones. tools/replay implements the
+   taps the other way round: it fills the variable from a recording and
+   compares the outputs with the recorded ones, so the real code path runs
+   on the host from IMUBmi270::readData() to Motor::run().
+
+   Once every RECORDER_KEYFRAME_TICKS the loop writes a keyframe with the
+   state the next ticks depend on (attitude filter, PID integrators, stall
+   detector, counters). A replay starts from the oldest keyframe left.
+
+   A motor fault freezes the ring CONFIG_RECORDER_HOLD_S later, so the
+   incident is kept until it is downloaded from GET /api/v1/record and
+   dropped with DELETE. The download is a rec_header_t, the Setting blob
+   and the frames oldest first, each a rec_frame_t and its payload, little
+   endian. Payloads are the structs below and those of the code that taps
+   them; a firmware whose structs differ makes a recording the replay of
+   another build refuses.
+
+   The ring does not depend on ESP-IDF, tools/replay records its synthetic
+   runs with it.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef CONFIG_RECORDER_KB
+#define CONFIG_RECORDER_KB      64
+#endif
+#ifndef CONFIG_RECORDER_HOLD_S
+#define CONFIG_RECORDER_HOLD_S  1
+#endif
+
+#define RECORDER_MAGIC          0x31434552  // "REC1"
+#define RECORDER_VERSION        1
+#define RECORDER_KEYFRAME_TICKS 100         // 1 s of control ticks
+
+#define REC_TYPE_LIST \
+X(REC_KEYFRAME, "keyframe") \
+X(REC_IMU, "imu") \
+X(REC_COMPASS, "compass") \
+X(REC_ANALOG, "analog") \
+X(REC_VOLTAGE, "voltage") \
+X(REC_TICK, "tick") \
+X(REC_ENCODER, "encoder") \
+X(REC_OUTPUT, "output") \
+X(REC_TARGET, "target") \
+X(REC_NMEA, "nmea") \
+
+typedef enum {
+#define X(name, desc) name,
+    REC_TYPE_LIST
+#undef X
+    REC_TYPE_COUNT
+} rec_type_t;
+
+typedef struct {
+    uint16_t type;
+    uint16_t size;              // of the payload
+    uint32_t time_us;           // low 32 bits of esp_timer_get_time()
+} rec_frame_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t frame_size;        // sizeof(rec_frame_t)
+    uint32_t settings_size;     // sizeof(Setting), the settings follow the header
+    uint32_t bytes;             // of frames after the settings
+    uint32_t frames;
+    uint32_t overwritten;       // frames the ring dropped for newer ones
+    uint32_t dropped;           // frames not recorded, frozen or too large
+    uint32_t time;              // unix time of the download
+    int64_t now_us;             // esp_timer_get_time() of the download
+    int64_t trigger_us;         // of the fault that froze the ring, 0 for none
+} rec_header_t;
+
+// REC_IMU, the BMI270 burst of one cycle
+typedef struct {
+    uint8_t result;             // IMU_CYCLE_OK, or why the cycle was dropped
+    uint8_t status;             // STATUS register
+    uint8_t data[12];           // accelerometer and gyro, DATA_8 .. DATA_19
+    uint8_t temp[2];            // TEMPERATURE_0/1
+} rec_imu_t;
+
+// REC_ENCODER
+typedef struct {
+    int64_t count;              // absolute encoder count
+    int64_t edge_us;            // time of the edge which produced it
+    int64_t now_us;
+} rec_encoder_t;
+
+// REC_TARGET, the aim given to Gimbal::setTarget()
+typedef struct {
+    float pitch, yaw;
+} rec_target_t;
+
+// REC_OUTPUT, at the end of a tick; axes are yaw, pitch
+typedef struct {
+    float angle[3];             // fused attitude, yaw from the compass
+    float position[2];          // degrees
+    float target[2];
+    float velocity[2];          // sensor units/s
+    float output[2];            // controller output, -1000 to 1000
+    float power[2];             // W
+    uint8_t motor_state[2];     // mot_state_t
+    uint8_t state;              // SysState
+    uint8_t reserved;
+} rec_output_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Allocate the ring, CONFIG_RECORDER_KB of 0 disables the recorder
+ */
+bool recorder_init(void);
+
+/**
+ * @brief Whether taps are recorded, the keyframes are only built then
+ */
+bool recorder_active(void);
+
+/**
+ * @brief An input the control loop just read, or one of its outputs
+ *
+ * The variable is recorded as it is; in a replay it is overwritten with
+ * the recorded value, so pass the variable the code goes on with.
+ */
+void recorder_tap(rec_type_t type, void *data, size_t size);
+
+/**
+ * @brief A fault, the ring freezes CONFIG_RECORDER_HOLD_S later
+ */
+void recorder_trigger(void);
+
+/**
+ * @brief Stop recording for a download and describe what the ring holds
+ *
+ * Pauses are counted, two downloads can run at once.
+ */
+void recorder_pause(rec_header_t *header);
+
+/**
+ * @brief Copy the frames held, from offset bytes after the oldest one
+ * @return bytes copied
+ */
+size_t recorder_read(size_t offset, void *dst, size_t size);
+
+/**
+ * @brief End a download's pause, the last one records again unless a
+ * fault froze the ring
+ */
+void recorder_resume(void);
+
+/**
+ * @brief Drop the frames and the fault, and record again
+ */
+void recorder_clear(void);
+
+const char *recorder_type_name(int type);
+
+#ifdef __cplusplus
+}
+
+#include <mutex>
+
+class Recorder {
+public:
+    ~Recorder()
+    {
+        delete[] ring;
+    }
+    bool init(size_t size, int64_t hold_us);
+    void write(int type, int64_t now_us, const void *data, size_t size);
+    void trigger(int64_t now_us);
+    void pause(rec_header_t *header, int64_t now_us);
+    size_t read(size_t offset, void *dst, size_t size);
+    void resume();
+    void clear();
+    bool is_recording() const
+    {
+        return ring != nullptr && paused == 0 && !frozen;
+    }
+
+private:
+    void copy_in(size_t pos, const void *src, size_t size);
+    void copy_out(size_t pos, void *dst, size_t size) const;
+
+    uint8_t *ring = nullptr;
+    size_t capacity = 0;
+    size_t tail = 0;            // oldest frame
+    size_t used = 0;
+    uint32_t frames = 0;
+    uint32_t overwritten = 0;
+    uint32_t dropped = 0;
+    int64_t hold_us = 0;
+    int64_t trigger_us = 0;
+    int paused = 0;             // downloads running
+    bool frozen = false;
+    std::mutex mutex;
+};
+
+#endif
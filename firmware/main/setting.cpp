@@ -1,4 +1,5 @@
 #include <string.h>
+#include <cmath>
 #include "esp_log.h"
 #include "setting.h"
 #include "helper.h"
@@ -51,6 +52,136 @@ void Setting::restortDefault()
     pitch_pid.d = 0.0;
     pitch_pid.integral_limit = 700;
     pitch_pid.max_out = 1000;
+
+    // fields appended later take their defaults from upgrade(), none is in an empty blob
+    upgrade(0);
+}
+
+static void stall_default(struct stall_param *param, float k, float deadband, float drift)
+{
+    param->k = k;
+    param->tau = 0.05f;
+    param->deadband = deadband;
+    param->drift = drift;
+    param->threshold = 0.05f;
+    param->fault_ratio = 1.5f;
+    param->stall_current = 0.0f;
+    param->enable = 1;
+}
+
+static bool stall_valid(const struct stall_param *param)
+{
+    return param->k > 0 && param->k < 1000 && param->tau > 0 && param->tau < 10 &&
+           param->deadband >= 0 && param->deadband < 1 && param->drift > 0 && param->drift < 1 &&
+           param->threshold > 0 && param->fault_ratio > 1 && param->stall_current >= 0 && param->enable <= 1;
+}
+
+/*
+ * Whether a field is beyond a blob of size bytes. The blob of an older
+ * firmware ends with its checksum, where the first field appended after it
+ * now is, so a field is only in it when it ends before that checksum.
+ */
+bool Setting::missing(const void *field, size_t length, size_t size) const
+{
+    size_t end = (const uint8_t *)field - (const uint8_t *)this + length;
+    return end + sizeof(checksum) > size;
+}
+
+#define MISSING(field, size)    missing(&(field), sizeof(field), size)
+
+/**
+ * @brief Default the fields appended after the first release that are not in the blob, or are invalid
+ * @param size of the blob loaded, 0 to default them all
+ * @return true if anything was changed
+ */
+bool Setting::upgrade(size_t size)
+{
+    bool changed = false;
+    if (MISSING(yaw_stall, size) || !stall_valid(&yaw_stall)) {
+        // ~9000rpm at 12V no load
+        stall_default(&yaw_stall, 12.5f, 0.1f, 0.5f);
+        changed = true;
+    }
+    if (MISSING(pitch_stall, size) || !stall_valid(&pitch_stall)) {
+        // pitch speed is in deg/s, gravity load is larger than on yaw
+        stall_default(&pitch_stall, 2.5f, 0.15f, 0.6f);
+        changed = true;
+    }
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        adc_cal_t *cal = adcCal(i);
+        float max_scale = i == ADC_SIG_LIGHT ? 10.0f : 1.0f;
+        if (MISSING(*cal, size) || !(std::fabs(cal->scale) > 0 && std::fabs(cal->scale) < max_scale) || !std::isfinite(cal->offset)) {
+            // supply through a 1:11 divider, currents through a 1V/A sense
+            // amplifier, light through an amplifier giving 1V at 1000W/m2,
+            // the sun sensor quadrants in V
+            cal->scale = i == ADC_SIG_SUPPLY ? 4.17f * 11.0f / 4096.0f : i == ADC_SIG_LIGHT ? 1.0f : 0.001f;
+            cal->offset = 0;
+            changed = true;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (MISSING(winding_ohm[i], size) || !(winding_ohm[i] > 0 && winding_ohm[i] < 1000)) {
+            // small 12V gear motors
+            winding_ohm[i] = 10.0f;
+            changed = true;
+        }
+    }
+    if (MISSING(energy_budget_wh, size) || !(energy_budget_wh >= 0 && energy_budget_wh < 1e6f)) {
+        energy_budget_wh = 0;
+        changed = true;
+    }
+    if (MISSING(track, size) || !(track.threshold_deg >= 0 && track.threshold_deg < 20 && track.lead >= 0 && track.lead <= 1 &&
+          track.settle_deg > 0 && track.settle_deg < 5 && track.yaw_self_lock <= 1 &&
+          track.pitch_self_lock <= 1 && track.enable <= 1)) {
+        // 1 degree costs a panel 0.015% cosine loss, mirrors re-aim every
+        // cycle regardless; whether the gears self-lock is up to the
+        // mechanics, so no axis is released by default
+        track = {1.0f, 1.0f, 0.2f, 0, 0, 1};
+        changed = true;
+    }
+    if (MISSING(weather, size) || !(weather.overcast_kt > 0 && weather.overcast_kt < weather.clear_kt && weather.clear_kt < 1.5f &&
+          weather.tau_s > 0 && weather.tau_s < 3600 && weather.dwell_s >= 0 && weather.dwell_s < 7200 &&
+          weather.min_elevation >= 0 && weather.min_elevation < 45 && weather.hold_deg > 0 &&
+          weather.hold_deg < 45 && weather.enable <= 1)) {
+        // replayed on synthetic days, see weather_policy.cpp; without a
+        // light sensor the policy always tracks
+        weather = {0.6f, 0.3f, 120.0f, 300.0f, 10.0f, 5.0f, 1};
+        changed = true;
+    }
+    if (MISSING(fine, size) || !(std::fabs(fine.gain_x_deg) > 0.1f && std::fabs(fine.gain_x_deg) < 45 && std::fabs(fine.gain_y_deg) > 0.1f &&
+          std::fabs(fine.gain_y_deg) < 45 && fine.tau_s > 0 && fine.tau_s < 3600 && fine.min_signal >= 0 &&
+          fine.max_correction_deg > 0 && fine.max_correction_deg < 30 && fine.hold_s >= 0 && fine.enable <= 1)) {
+        // a mask with a +-5 degree field; only used once the quadrants are wired
+        fine = {5.0f, 5.0f, 20.0f, 0.05f, 5.0f, 1800.0f, 1};
+        changed = true;
+    }
+    if (MISSING(mount, size) || !(std::fabs(mount.az_offset) <= 20 && std::fabs(mount.pitch_offset) <= 20 && std::fabs(mount.tilt_n) <= 20 &&
+          std::fabs(mount.tilt_e) <= 20 && std::fabs(mount.non_perp) <= 20 && std::fabs(mount.yaw_scale) <= 0.1f &&
+          mount.enable <= 1)) {
+        // the nominal mount until a calibration is applied
+        mount = {0, 0, 0, 0, 0, 0, 0};
+        changed = true;
+    }
+    if (MISSING(heliostat, size) || !(heliostat.mirror_offset_m >= 0 && heliostat.mirror_offset_m < 1 && heliostat.enable <= 1)) {
+        // MODE_REFLECT bisects towards target_yaw / target_pitch as before
+        heliostat = {0, 0};
+        changed = true;
+    }
+    for (auto &target : helio_targets) {
+        if (MISSING(target, size) || !(std::fabs(target.east) < 10000 && std::fabs(target.north) < 10000 && std::fabs(target.up) < 10000 &&
+              target.from_min <= 24 * 60 && target.to_min <= 24 * 60 && target.enable <= 1 &&
+              memchr(target.name, 0, sizeof(target.name)))) {
+            memset(&target, 0, sizeof(target));
+            changed = true;
+        }
+    }
+    if (MISSING(sun, size) || !(sun.algo < SUN_ALGO_COUNT && sun.refraction <= 1 && sun.delta_t > -100 && sun.delta_t < 300 &&
+          std::fabs(sun.temp_offset) < 40)) {
+        // the cheapest algorithm good enough for the settle tolerance, delta T of 2025
+        sun = {SUN_ALGO_AUTO, 1, 69.0f, 0};
+        changed = true;
+    }
+    return changed;
 }
 
 void Setting::print()
@@ -84,18 +215,49 @@ void Setting::print()
     ESP_LOGI(TAG, "pitch_pid.max_out: %f", pitch_pid.max_out);
     ESP_LOGI(TAG, "pitch_pid.input_max_err: %f", pitch_pid.input_max_err);
     ESP_LOGI(TAG, "pitch_pid.Kc: %f", pitch_pid.Kc);
+    ESP_LOGI(TAG, "yaw_stall: k %f tau %f deadband %f drift %f threshold %f enable %d",
+             yaw_stall.k, yaw_stall.tau, yaw_stall.deadband, yaw_stall.drift, yaw_stall.threshold, yaw_stall.enable);
+    ESP_LOGI(TAG, "pitch_stall: k %f tau %f deadband %f drift %f threshold %f enable %d",
+             pitch_stall.k, pitch_stall.tau, pitch_stall.deadband, pitch_stall.drift, pitch_stall.threshold, pitch_stall.enable);
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        ESP_LOGI(TAG, "adc_cal[%d]: scale %f offset %f", i, adcCal(i)->scale, adcCal(i)->offset);
+    }
+    ESP_LOGI(TAG, "winding_ohm: yaw %f pitch %f", winding_ohm[0], winding_ohm[1]);
+    ESP_LOGI(TAG, "energy_budget_wh: %f", energy_budget_wh);
+    ESP_LOGI(TAG, "track: threshold %f lead %f settle %f self lock yaw %d pitch %d enable %d",
+             track.threshold_deg, track.lead, track.settle_deg, track.yaw_self_lock, track.pitch_self_lock, track.enable);
+    ESP_LOGI(TAG, "weather: clear %f overcast %f tau %f dwell %f min elevation %f hold %f enable %d",
+             weather.clear_kt, weather.overcast_kt, weather.tau_s, weather.dwell_s, weather.min_elevation,
+             weather.hold_deg, weather.enable);
+    ESP_LOGI(TAG, "fine: gain x %f y %f tau %f min signal %f max %f hold %f enable %d",
+             fine.gain_x_deg, fine.gain_y_deg, fine.tau_s, fine.min_signal, fine.max_correction_deg,
+             fine.hold_s, fine.enable);
+    ESP_LOGI(TAG, "mount: az %f pitch %f tilt n %f e %f non perp %f yaw scale %f enable %d",
+             mount.az_offset, mount.pitch_offset, mount.tilt_n, mount.tilt_e, mount.non_perp, mount.yaw_scale,
+             mount.enable);
+    ESP_LOGI(TAG, "heliostat: mirror offset %f enable %d", heliostat.mirror_offset_m, heliostat.enable);
+    for (const auto &target : helio_targets) {
+        ESP_LOGI(TAG, "heliostat target %s: east %f north %f up %f from %u to %u enable %d", target.name,
+                 target.east, target.north, target.up, target.from_min, target.to_min, target.enable);
+    }
+    ESP_LOGI(TAG, "sun: algo %s refraction %d delta t %f temp offset %f", SunEngine::algo_name((sun_algo_t)sun.algo),
+             sun.refraction, sun.delta_t, sun.temp_offset);
     ESP_LOGI(TAG, "checksum: %u", checksum);
 }
 
 esp_err_t Setting::load()
 {
-    esp_err_t ret = iot_param_load(SETTINGS_NAMESPACE, SETTINGS_KEY, this);
+    size_t size = sizeof(Setting);
+    esp_err_t ret = iot_param_load_size(SETTINGS_NAMESPACE, SETTINGS_KEY, this, &size);
     if (ret != ESP_OK || !validateChecksum() || !validateRanges()) {
         ESP_LOGW(TAG, "Failed to load settings or validation failed, error: %s", esp_err_to_name(ret));
         // Initialize with default values
         restortDefault();
         updateChecksum();
         save();
+    } else if (upgrade(size)) {
+        ESP_LOGI(TAG, "Settings of %u bytes upgraded with new defaults", (unsigned)size);
+        save();
     }
     print();
 
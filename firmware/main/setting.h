@@ -9,6 +9,14 @@
 #include <limits.h>
 #include <unordered_map>
 #include "pid.h"
+#include "stall_detector.h"
+#include "tracking_policy.h"
+#include "weather_policy.h"
+#include "fine_tracker.h"
+#include "mount_model.h"
+#include "heliostat.h"
+#include "sun_engine.h"
+#include "adc.h"
 #include "esp_err.h"
 
 #define SETTINGS_NAMESPACE "settings"
@@ -107,10 +115,42 @@ public:
     float yaw_offset; // degrees
     float magnetic_declination_degrees;
 
+    // Fields below were added after the first release, each one at the end.
+    // Blobs saved by older firmware are shorter, upgrade() fills in the
+    // defaults of the fields they do not hold.
+    struct stall_param yaw_stall;   // motor revolutions
+    struct stall_param pitch_stall; // degrees
+    adc_cal_t adc_cal[ADC_SIG_SUPPLY_CURRENT];  // ADC millivolts to V or A, use adcCal()
+    float winding_ohm[2];           // yaw, pitch motor resistance, estimates power without current sense
+    float energy_budget_wh;         // daily motor energy budget, 0 for none
+    struct track_param track;       // re-aim policy, the threshold is on the aim of the axes
+    adc_cal_t supply_current_cal;   // signals added after adc_cal are stored from here on
+    adc_cal_t light_cal;
+    struct weather_param weather;
+    adc_cal_t quad_cal[4];          // sun sensor quadrants A-D
+    struct fine_param fine;         // optical fine tracking
+    struct mount_param mount;       // mount misalignment, fitted from observations of the sun
+    struct heliostat_param heliostat;
+    struct heliostat_target helio_targets[HELIOSTAT_MAX_TARGETS];
+    struct sun_param sun;           // solar position algorithm and refraction
+
+    adc_cal_t *adcCal(int signal)
+    {
+        if (signal < ADC_SIG_SUPPLY_CURRENT) {
+            return &adc_cal[signal];
+        }
+        if (signal >= ADC_SIG_QUAD_A) {
+            return &quad_cal[signal - ADC_SIG_QUAD_A];
+        }
+        return signal == ADC_SIG_SUPPLY_CURRENT ? &supply_current_cal : &light_cal;
+    }
+
 private:
     // std::unordered_map<std::string, Parameter> parameters; // 存储所有参数
     uint32_t checksum;  // Must be the first member for checksum calculation
     void restortDefault();
+    bool upgrade(size_t size);
+    bool missing(const void *field, size_t length, size_t size) const;
     void print();
     bool validateChecksum();
     void updateChecksum();
@@ -0,0 +1,1044 @@
+#include <string.h>
+#include <math.h>
+#include "tslog.h"
+#include "crc32.h"
+
+#ifndef __linux__
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "gimbal.h"
+#include "energy.h"
+
+extern Gimbal gimbal;
+static const char *TAG = "tslog";
+#endif
+
+#define TSLOG_MAGIC             0x314c5354  // "TSL1"
+#define TSLOG_VERSION           1
+#define TSLOG_LIMIT             (1 << 29)   // quantized values, deltas fit in 31 bits
+#define TSLOG_MISSING           (-TSLOG_LIMIT - 1)
+#define TSLOG_SAMPLE_BITS_MAX   (36 * (TSLOG_CHANNEL_COUNT + 1))
+
+static const uint32_t TIER_STEPS[TSLOG_TIERS] = {0, 300, 3600};     // tier 0 samples at the period
+static const uint8_t TIME_WIDTHS[4] = {7, 9, 12, 32};
+static const uint8_t VALUE_WIDTHS[4] = {4, 8, 16, 32};
+
+static const float SCALES[TSLOG_CHANNEL_COUNT] = {
+#define X(name, desc, scale) scale,
+    TSLOG_CHANNEL_LIST
+#undef X
+};
+
+static const char *NAMES[TSLOG_CHANNEL_COUNT] = {
+#define X(name, desc, scale) desc,
+    TSLOG_CHANNEL_LIST
+#undef X
+};
+
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t tier;
+    uint16_t step_s;
+    uint32_t seq;
+    uint32_t erases;
+} sector_header_t;
+
+typedef struct {
+    uint16_t bytes;             // compressed samples following the header, 0xffff past the last block
+    uint16_t count;
+    uint32_t start, end;        // unix time of the first and last sample
+    uint32_t crc;               // of the header up to here and the samples
+} block_header_t;
+
+static uint32_t block_crc(const block_header_t &header, const uint8_t *data)
+{
+    return crc32_le(crc32_le(0, (const uint8_t *)&header, offsetof(block_header_t, crc)), data, header.bytes);
+}
+
+static constexpr size_t block_size(size_t bytes)
+{
+    return (sizeof(block_header_t) + bytes + 3) & ~(size_t)3;
+}
+
+static int32_t quantize(float value, int channel)
+{
+    if (!isfinite(value)) {
+        return TSLOG_MISSING;
+    }
+    float q = roundf(value * SCALES[channel]);
+    return q > TSLOG_LIMIT ? TSLOG_LIMIT : q < -TSLOG_LIMIT ? -TSLOG_LIMIT : (int32_t)q;
+}
+
+static float dequantize(int32_t q, int channel)
+{
+    return q == TSLOG_MISSING ? NAN : q / SCALES[channel];
+}
+
+static uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// MSB first into a zeroed buffer
+static void put_bits(uint8_t *data, uint32_t *bits, uint32_t value, int count)
+{
+    for (int i = count - 1; i >= 0; i--) {
+        if (value >> i & 1) {
+            data[*bits >> 3] |= 0x80 >> (*bits & 7);
+        }
+        (*bits)++;
+    }
+}
+
+// '0' for zero, else '10', '110', '1110' or '1111' and the value in the matching width
+static void put_varying(uint8_t *data, uint32_t *bits, int32_t value, const uint8_t widths[4])
+{
+    uint32_t z = zigzag(value);
+    if (z == 0) {
+        put_bits(data, bits, 0, 1);
+        return;
+    }
+    int k = 0;
+    while (k < 3 && z >> widths[k] != 0) {
+        k++;
+    }
+    put_bits(data, bits, k < 3 ? (1u << (k + 2)) - 2 : 0xf, k < 3 ? k + 2 : 4);
+    put_bits(data, bits, z, widths[k]);
+}
+
+struct block_reader {
+    const uint8_t *data;
+    uint32_t bytes;
+    uint32_t byte;              // next one to load
+    uint64_t cache;             // bits not read yet, MSB first
+    int avail;
+    uint32_t time;
+    int32_t dt;
+    int32_t last[TSLOG_CHANNEL_COUNT];
+    bool failed;
+
+    block_reader(const uint8_t *data, size_t bytes, uint32_t start)
+        : data(data), bytes(bytes), byte(0), cache(0), avail(0), time(start), dt(0), last(), failed(false) {}
+
+    void refill()
+    {
+        while (avail <= 56 && byte < bytes) {
+            cache |= (uint64_t)data[byte++] << (56 - avail);
+            avail += 8;
+        }
+    }
+    void skip(int count)
+    {
+        cache <<= count;
+        avail -= count;
+    }
+    uint32_t bits(int count)
+    {
+        refill();
+        if (count > avail) {
+            failed = true;
+            return 0;
+        }
+        uint32_t value = (uint32_t)(cache >> (64 - count));
+        skip(count);
+        return value;
+    }
+    int32_t varying(const uint8_t widths[4])
+    {
+        refill();
+        // count the ones of the prefix, at most 4
+        int k = 0;
+        while (k < 4 && (cache >> (63 - k) & 1)) {
+            k++;
+        }
+        int length = k < 4 ? k + 1 : 4;
+        if (length > avail) {
+            failed = true;
+            return 0;
+        }
+        skip(length);
+        return k == 0 ? 0 : unzigzag(bits(widths[k - 1]));
+    }
+    bool next(tslog_point_t *point)
+    {
+        dt += varying(TIME_WIDTHS);
+        time += dt;
+        point->time = time;
+        for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+            last[c] += varying(VALUE_WIDTHS);
+            point->value[c] = dequantize(last[c], c);
+        }
+        return !failed;
+    }
+};
+
+const char *TsLog::channel_name(int channel)
+{
+    return channel >= 0 && channel < TSLOG_CHANNEL_COUNT ? NAMES[channel] : "";
+}
+
+bool TsLog::open(const tslog_flash_t &flash, uint32_t period_s)
+{
+    this->flash = flash;
+    sector_count = flash.size / TSLOG_SECTOR_SIZE;
+    // 3/4 raw, 3/16 5 minutes, the rest hourly
+    int split[TSLOG_TIERS] = {sector_count * 3 / 4, sector_count * 3 / 16, 0};
+    split[2] = sector_count - split[0] - split[1];
+    if (split[1] < 2 || split[2] < 2) {
+        return false;
+    }
+    delete[] table;
+    table = new sector_t[sector_count]();
+    int first = 0;
+    for (int t = 0; t < TSLOG_TIERS; t++) {
+        tier_t &tier = tiers[t];
+        tier = tier_t();
+        tier.first = first;
+        tier.sectors = split[t];
+        tier.head = -1;
+        tier.step_s = t == 0 ? period_s : TIER_STEPS[t];
+        first += split[t];
+    }
+
+    seq = 0;
+    newest = 0;
+    for (int t = 0; t < TSLOG_TIERS; t++) {
+        tier_t &tier = tiers[t];
+        for (int i = tier.first; i < tier.first + tier.sectors; i++) {
+            sector_header_t header;
+            if (!flash.read(flash.ctx, offset(i), &header, sizeof(header))) {
+                stats.flash_errors++;
+                continue;
+            }
+            if (header.magic != TSLOG_MAGIC) {
+                continue;
+            }
+            // a sector of another layout is reused, its erase count is still good
+            table[i].erases = header.erases;
+            if (header.version != TSLOG_VERSION || header.tier != t || header.step_s != tier.step_s) {
+                continue;
+            }
+            table[i].seq = header.seq;
+            seq = header.seq > seq ? header.seq : seq;
+            if (tier.head < 0 || header.seq > table[tier.head].seq) {
+                tier.head = i;
+            }
+        }
+        for (int i = tier.first; i < tier.first + tier.sectors; i++) {
+            if (table[i].seq != 0) {
+                scan_sector(i, i == tier.head);
+                newest = table[i].end > newest ? table[i].end : newest;
+            }
+        }
+    }
+    return true;
+}
+
+// the blocks of a sector, checked in full for the head only, where a reset can tear one
+void TsLog::scan_sector(int index, bool head)
+{
+    sector_t &sector = table[index];
+    size_t pos = sizeof(sector_header_t);
+    while (pos + sizeof(block_header_t) <= TSLOG_SECTOR_SIZE) {
+        block_header_t header;
+        if (!flash.read(flash.ctx, offset(index) + pos, &header, sizeof(header))) {
+            stats.flash_errors++;
+            pos = TSLOG_SECTOR_SIZE;
+            break;
+        }
+        if (header.bytes == 0xffff) {
+            break;
+        }
+        bool ok = header.bytes <= TSLOG_BLOCK_BYTES && header.count > 0 &&
+                  pos + block_size(header.bytes) <= TSLOG_SECTOR_SIZE;
+        if (ok && head) {
+            uint8_t data[TSLOG_BLOCK_BYTES];
+            ok = flash.read(flash.ctx, offset(index) + pos + sizeof(header), data, header.bytes) &&
+                 block_crc(header, data) == header.crc;
+        }
+        if (!ok) {
+            // torn or garbage, nothing more is written to this sector
+            stats.bad_blocks++;
+            pos = TSLOG_SECTOR_SIZE;
+            break;
+        }
+        if (sector.points == 0) {
+            sector.start = header.start;
+        }
+        sector.end = header.end;
+        sector.points += header.count;
+        pos += block_size(header.bytes);
+    }
+    sector.used = pos > TSLOG_SECTOR_SIZE - sizeof(block_header_t) ? TSLOG_SECTOR_SIZE : pos;
+}
+
+void TsLog::add(const tslog_point_t &point)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (table == nullptr) {
+        return;
+    }
+    stats.samples++;
+    if (point.time < TSLOG_MIN_TIME || point.time <= newest) {
+        stats.dropped++;
+        return;
+    }
+    newest = point.time;
+    append(0, point);
+}
+
+void TsLog::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (table == nullptr) {
+        return;
+    }
+    for (int t = 0; t < TSLOG_TIERS; t++) {
+        write_block(t);
+    }
+}
+
+void TsLog::append(int tier, const tslog_point_t &point)
+{
+    block_t &block = tiers[tier].block;
+    if (block.count == TSLOG_BLOCK_SAMPLES || block.bits + TSLOG_SAMPLE_BITS_MAX > TSLOG_BLOCK_BYTES * 8) {
+        write_block(tier);
+    }
+    if (block.count == 0) {
+        memset(&block, 0, sizeof(block));
+        block.start = point.time;
+        block.end = point.time;
+    }
+    int32_t dt = point.time - block.end;
+    put_varying(block.data, &block.bits, dt - block.last_dt, TIME_WIDTHS);
+    block.last_dt = dt;
+    block.end = point.time;
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        int32_t q = quantize(point.value[c], c);
+        put_varying(block.data, &block.bits, q - block.last[c], VALUE_WIDTHS);
+        block.last[c] = q;
+    }
+    block.count++;
+}
+
+void TsLog::write_block(int tier)
+{
+    tier_t &t = tiers[tier];
+    block_t &block = t.block;
+    if (block.count == 0) {
+        return;
+    }
+    block_header_t header = {(uint16_t)((block.bits + 7) / 8), block.count, block.start, block.end, 0};
+    header.crc = block_crc(header, block.data);
+    size_t size = block_size(header.bytes);
+    uint8_t buf[block_size(TSLOG_BLOCK_BYTES)];
+    memset(buf, 0xff, sizeof(buf));
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), block.data, header.bytes);
+
+    // a failed write closes the sector, the block gets one more try in the next
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if ((t.head < 0 || table[t.head].used + size > TSLOG_SECTOR_SIZE) && !next_sector(tier)) {
+            break;
+        }
+        sector_t &sector = table[t.head];
+        if (!flash.write(flash.ctx, offset(t.head) + sector.used, buf, size)) {
+            stats.flash_errors++;
+            sector.used = TSLOG_SECTOR_SIZE;
+            continue;
+        }
+        if (sector.points == 0) {
+            sector.start = block.start;
+        }
+        sector.end = block.end;
+        sector.points += block.count;
+        sector.used += size;
+        break;
+    }
+    block.count = 0;
+}
+
+// erase the sector after the head and make it the head, the oldest one is compacted first
+bool TsLog::next_sector(int tier)
+{
+    tier_t &t = tiers[tier];
+    int next = t.head < 0 ? t.first : t.first + (t.head - t.first + 1) % t.sectors;
+    sector_t &sector = table[next];
+    if (sector.seq != 0 && tier + 1 < TSLOG_TIERS) {
+        compact(tier, next);
+    }
+    uint32_t erases = sector.erases + 1;
+    sector = sector_t();
+    sector.erases = erases;
+    if (!flash.erase(flash.ctx, offset(next), TSLOG_SECTOR_SIZE)) {
+        stats.flash_errors++;
+        return false;
+    }
+    sector_header_t header = {TSLOG_MAGIC, TSLOG_VERSION, (uint8_t)tier, (uint16_t)t.step_s, ++seq, erases};
+    if (!flash.write(flash.ctx, offset(next), &header, sizeof(header))) {
+        stats.flash_errors++;
+        return false;
+    }
+    sector.seq = header.seq;
+    sector.used = sizeof(header);
+    t.head = next;
+    return true;
+}
+
+void TsLog::compact(int tier, int index)
+{
+    stats.compactions++;
+    size_t pos = sizeof(sector_header_t);
+    while (pos + sizeof(block_header_t) <= table[index].used) {
+        block_header_t header;
+        uint8_t data[TSLOG_BLOCK_BYTES];
+        if (!flash.read(flash.ctx, offset(index) + pos, &header, sizeof(header)) || header.bytes == 0xffff ||
+                header.bytes > TSLOG_BLOCK_BYTES) {
+            break;
+        }
+        size_t at = offset(index) + pos + sizeof(header);
+        pos += block_size(header.bytes);
+        if (!flash.read(flash.ctx, at, data, header.bytes) || block_crc(header, data) != header.crc) {
+            stats.bad_blocks++;
+            continue;
+        }
+        block_reader reader(data, header.bytes, header.start);
+        tslog_point_t point;
+        for (int i = 0; i < header.count && reader.next(&point); i++) {
+            accumulate(tier + 1, point);
+        }
+    }
+    // the means are in flash before the samples they come from are erased
+    write_block(tier + 1);
+}
+
+void TsLog::accumulate(int tier, const tslog_point_t &point)
+{
+    tier_t &t = tiers[tier];
+    bucket_t &bucket = t.bucket;
+    uint32_t start = point.time - point.time % t.step_s;
+    if (bucket.open && bucket.start != start) {
+        tslog_point_t mean;
+        mean.time = bucket.start;
+        for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+            mean.value[c] = bucket.count[c] > 0 ? bucket.sum[c] / bucket.count[c] : NAN;
+        }
+        bucket.open = false;
+        // after a reboot lost the bucket the first one can repeat a start
+        uint32_t last = t.block.count > 0 ? t.block.end : t.head >= 0 ? table[t.head].end : 0;
+        if (mean.time > last) {
+            append(tier, mean);
+        }
+    }
+    if (!bucket.open) {
+        memset(&bucket, 0, sizeof(bucket));
+        bucket.start = start;
+        bucket.open = true;
+    }
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        if (isfinite(point.value[c])) {
+            bucket.sum[c] += point.value[c];
+            bucket.count[c]++;
+        }
+    }
+}
+
+int TsLog::oldest_sector(int tier) const
+{
+    const tier_t &t = tiers[tier];
+    if (t.head < 0) {
+        return -1;
+    }
+    for (int k = 1; k <= t.sectors; k++) {
+        int i = t.first + (t.head - t.first + k) % t.sectors;
+        if (table[i].seq != 0 && table[i].points > 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// UINT32_MAX when the tier is empty
+uint32_t TsLog::oldest_time(int tier) const
+{
+    int i = oldest_sector(tier);
+    if (i >= 0) {
+        return table[i].start;
+    }
+    const block_t &block = tiers[tier].block;
+    return block.count > 0 ? block.start : UINT32_MAX;
+}
+
+int TsLog::query(uint32_t from, uint32_t to, tslog_visit_t visit, void *ctx)
+{
+    int visited = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    if (table == nullptr) {
+        return 0;
+    }
+    for (int tier = TSLOG_TIERS - 1; tier >= 0; tier--) {
+        const tier_t &t = tiers[tier];
+        // up to where the finer tier starts
+        uint32_t until = to;
+        if (tier > 0) {
+            uint32_t finer = oldest_time(tier - 1);
+            until = finer != UINT32_MAX && finer - 1 < until ? finer - 1 : until;
+        }
+        if (from > until) {
+            continue;
+        }
+
+        bool past = false;
+        int first = oldest_sector(tier);
+        for (int k = 0; first >= 0 && k < t.sectors && !past; k++) {
+            int i = t.first + (first - t.first + k) % t.sectors;
+            uint32_t sector_seq = table[i].seq;
+            if (sector_seq == 0 || table[i].points == 0 || table[i].end < from) {
+                continue;
+            }
+            if (table[i].start > until) {
+                past = true;
+                break;
+            }
+            size_t pos = sizeof(sector_header_t);
+            // the lock is let go around the decoding, a sector recycled meanwhile is left
+            while (!past && table[i].seq == sector_seq && pos + sizeof(block_header_t) <= table[i].used) {
+                block_header_t header;
+                uint8_t data[TSLOG_BLOCK_BYTES];
+                if (!flash.read(flash.ctx, offset(i) + pos, &header, sizeof(header)) || header.bytes == 0xffff ||
+                        header.bytes > TSLOG_BLOCK_BYTES) {
+                    break;
+                }
+                size_t at = offset(i) + pos + sizeof(header);
+                pos += block_size(header.bytes);
+                if (header.end < from) {
+                    continue;
+                }
+                if (header.start > until) {
+                    past = true;
+                    break;
+                }
+                if (!flash.read(flash.ctx, at, data, header.bytes) || block_crc(header, data) != header.crc) {
+                    stats.bad_blocks++;
+                    continue;
+                }
+                lock.unlock();
+                block_reader reader(data, header.bytes, header.start);
+                tslog_point_t point;
+                bool more = true;
+                for (int n = 0; n < header.count && more && !past && reader.next(&point); n++) {
+                    if (point.time > until) {
+                        past = true;
+                    } else if (point.time >= from) {
+                        visited++;
+                        more = visit(&point, tier, ctx);
+                    }
+                }
+                lock.lock();
+                if (!more) {
+                    return visited;
+                }
+            }
+        }
+        if (past) {
+            continue;
+        }
+
+        // then what is still in RAM: the open block, and the mean being filled
+        block_t block = t.block;
+        bucket_t bucket = t.bucket;
+        lock.unlock();
+        block_reader reader(block.data, (block.bits + 7) / 8, block.start);
+        tslog_point_t point;
+        for (int n = 0; n < block.count && reader.next(&point) && point.time <= until; n++) {
+            if (point.time >= from) {
+                visited++;
+                if (!visit(&point, tier, ctx)) {
+                    return visited;
+                }
+            }
+        }
+        if (bucket.open && bucket.start >= from && bucket.start <= until &&
+                (block.count == 0 || bucket.start > block.end)) {
+            point.time = bucket.start;
+            for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+                point.value[c] = bucket.count[c] > 0 ? bucket.sum[c] / bucket.count[c] : NAN;
+            }
+            visited++;
+            if (!visit(&point, tier, ctx)) {
+                return visited;
+            }
+        }
+        lock.lock();
+    }
+    return visited;
+}
+
+void TsLog::get_stats(tslog_stats_t *out)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    *out = stats;
+    if (table == nullptr) {
+        return;
+    }
+    for (int tier = 0; tier < TSLOG_TIERS; tier++) {
+        const tier_t &t = tiers[tier];
+        tslog_tier_stats_t &s = out->tier[tier];
+        s = tslog_tier_stats_t();
+        s.step_s = t.step_s;
+        s.sectors = t.sectors;
+        s.erases_min = UINT32_MAX;
+        for (int i = t.first; i < t.first + t.sectors; i++) {
+            if (table[i].seq != 0) {
+                s.used++;
+                s.points += table[i].points;
+                s.bytes += table[i].used;
+            }
+            s.erases_min = table[i].erases < s.erases_min ? table[i].erases : s.erases_min;
+            s.erases_max = table[i].erases > s.erases_max ? table[i].erases : s.erases_max;
+        }
+        uint32_t oldest = oldest_time(tier);
+        s.oldest = oldest != UINT32_MAX ? oldest : 0;
+        s.newest = t.block.count > 0 ? t.block.end : t.head >= 0 ? table[t.head].end : 0;
+    }
+}
+
+#ifndef __linux__
+
+static TsLog s_log;
+static bool s_open = false;
+
+static bool partition_read(void *ctx, size_t offset, void *dst, size_t size)
+{
+    return esp_partition_read((const esp_partition_t *)ctx, offset, dst, size) == ESP_OK;
+}
+
+static bool partition_write(void *ctx, size_t offset, const void *src, size_t size)
+{
+    return esp_partition_write((const esp_partition_t *)ctx, offset, src, size) == ESP_OK;
+}
+
+static bool partition_erase(void *ctx, size_t offset, size_t size)
+{
+    return esp_partition_erase_range((const esp_partition_t *)ctx, offset, size) == ESP_OK;
+}
+
+static float motor_joules(void)
+{
+    energy_bucket_t total;
+    energy_get_total(&total);
+    return energy_bucket_wh(&total) * 3600.0f;
+}
+
+static void tslog_task(void *arg)
+{
+    TickType_t wake = xTaskGetTickCount();
+    float joules = motor_joules();
+    while (true) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(CONFIG_TSLOG_PERIOD_S * 1000));
+        float now_joules = motor_joules();
+        tslog_point_t point;
+        point.time = (uint32_t)time(NULL);
+        point.value[TSLOG_VOLTAGE] = gimbal.voltage;
+        point.value[TSLOG_POINTING_ERROR] = gimbal.getTrackingPolicy().get_error();
+        // the mean over the period, the instant power after the buckets were cleared
+        point.value[TSLOG_MOTOR_POWER] = now_joules >= joules ? (now_joules - joules) / CONFIG_TSLOG_PERIOD_S
+                                         : energy_get_power(ENERGY_AXIS_YAW) + energy_get_power(ENERGY_AXIS_PITCH);
+        point.value[TSLOG_TEMPERATURE] = gimbal.imu ? gimbal.imu->getData().temperature : NAN;
+        joules = now_joules;
+        s_log.add(point);
+    }
+}
+
+void tslog_init(void)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                       (esp_partition_subtype_t)TSLOG_PARTITION_SUBTYPE, "tslog");
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "no tslog partition, history is not kept");
+        return;
+    }
+    tslog_flash_t flash = {partition->size, partition_read, partition_write, partition_erase, (void *)partition};
+    if (!s_log.open(flash, CONFIG_TSLOG_PERIOD_S)) {
+        ESP_LOGE(TAG, "tslog partition of %lu bytes is too small", (unsigned long)partition->size);
+        return;
+    }
+    s_open = true;
+    tslog_stats_t stats;
+    s_log.get_stats(&stats);
+    ESP_LOGI(TAG, "%u raw, %u 5 minute and %u hourly sectors in use", stats.tier[0].used, stats.tier[1].used,
+             stats.tier[2].used);
+    esp_register_shutdown_handler(tslog_flush);
+    xTaskCreate(tslog_task, "tslog", 4096, NULL, 1, NULL);
+}
+
+void tslog_flush(void)
+{
+    if (s_open) {
+        s_log.flush();
+    }
+}
+
+int tslog_query(uint32_t from, uint32_t to, tslog_visit_t visit, void *ctx)
+{
+    return s_open ? s_log.query(from, to, visit, ctx) : 0;
+}
+
+bool tslog_get_stats(tslog_stats_t *stats)
+{
+    if (!s_open) {
+        return false;
+    }
+    s_log.get_stats(stats);
+    return true;
+}
+
+#endif
+
+// run test on linux, TSLOG_NO_MAIN when linked into another program
+#if defined(__linux__) && !defined(TSLOG_NO_MAIN)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+/*
+ * Test and benchmark on a RAM flash the size of the partition. Like NOR
+ * flash a write only clears bits, one that would set a bit not erased is
+ * counted as a fault. Compression is measured against the 20 bytes of a
+ * sample as a time and four floats; the query latency is the host's, the
+ * flash bytes each query reads tell what it costs on the chip.
+ *
+ *   g++ -std=c++17 -O2 tslog.cpp
+ */
+
+#define TEST_FLASH_SIZE     (1024 * 1024)
+#define TEST_START          1735689600  // 2025-01-01 00:00 UTC
+#define TEST_PERIOD_S       10
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("  %s\n", what);
+        failures++;
+    }
+}
+
+struct ram_flash {
+    std::vector<uint8_t> data = std::vector<uint8_t>(TEST_FLASH_SIZE, 0xff);
+    long faults = 0;
+    long read_bytes = 0;
+    long tear = -1;             // bytes the next write keeps, a reset in the middle of it
+};
+
+static bool ram_read(void *ctx, size_t offset, void *dst, size_t size)
+{
+    ram_flash *f = (ram_flash *)ctx;
+    f->read_bytes += size;
+    memcpy(dst, f->data.data() + offset, size);
+    return true;
+}
+
+static bool ram_write(void *ctx, size_t offset, const void *src, size_t size)
+{
+    ram_flash *f = (ram_flash *)ctx;
+    if (f->tear >= 0) {
+        size = (size_t)f->tear < size ? f->tear : size;
+        f->tear = -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        uint8_t value = ((const uint8_t *)src)[i];
+        f->faults += (value & ~f->data[offset + i]) != 0;
+        f->data[offset + i] &= value;
+    }
+    return true;
+}
+
+static bool ram_erase(void *ctx, size_t offset, size_t size)
+{
+    ram_flash *f = (ram_flash *)ctx;
+    memset(f->data.data() + offset, 0xff, size);
+    return true;
+}
+
+static tslog_flash_t ram_flash_ops(ram_flash *f)
+{
+    return {f->data.size(), ram_read, ram_write, ram_erase, f};
+}
+
+static float noise(uint32_t t, int channel)
+{
+    uint32_t x = t * 2654435761u ^ (channel + 1) * 40503u;
+    x ^= x >> 15;
+    x *= 2246822519u;
+    x ^= x >> 13;
+    return (x & 0xffff) / 65536.0f - 0.5f;
+}
+
+// a tracker over a day, a pure function of the time so a test can compare the means
+static tslog_point_t signal(uint32_t t)
+{
+    float day = (t % 86400) / 86400.0f;
+    bool sun = day > 0.25f && day < 0.75f;
+    float sine = sinf(2 * (float)M_PI * (day - 0.25f));
+    tslog_point_t p;
+    p.time = t;
+    p.value[TSLOG_VOLTAGE] = 12.4f + 0.4f * sine + 0.03f * noise(t, 0);
+    // the tracking policy lets the error sweep up to its threshold, then re-aims
+    p.value[TSLOG_POINTING_ERROR] = sun ? 0.1f * ((t / TEST_PERIOD_S) % 12) / 12.0f + 0.004f * noise(t, 1) : 0;
+    p.value[TSLOG_MOTOR_POWER] = sun && (t / TEST_PERIOD_S) % 12 == 0 ? 0.6f + 0.1f * noise(t, 2) : 0;
+    p.value[TSLOG_TEMPERATURE] = 18 + 9 * sine + 0.2f * noise(t, 3);
+    // an hour a day without the IMU
+    if (t % 86400 >= 7200 && t % 86400 < 10800) {
+        p.value[TSLOG_TEMPERATURE] = NAN;
+    }
+    return p;
+}
+
+struct collected {
+    std::vector<tslog_point_t> points;
+    std::vector<int> tiers;
+    size_t limit = SIZE_MAX;
+};
+
+static bool collect(const tslog_point_t *point, int tier, void *ctx)
+{
+    collected *c = (collected *)ctx;
+    c->points.push_back(*point);
+    c->tiers.push_back(tier);
+    return c->points.size() < c->limit;
+}
+
+static bool ordered(const collected &c)
+{
+    for (size_t i = 1; i < c.points.size(); i++) {
+        if (c.points[i].time <= c.points[i - 1].time || c.tiers[i] > c.tiers[i - 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool same_value(float a, float b, float tolerance)
+{
+    return isnan(a) ? isnan(b) : fabsf(a - b) <= tolerance;
+}
+
+static float tolerance(int channel)
+{
+    return 0.5f / SCALES[channel] + 1e-4f;
+}
+
+// what a few hours of samples give back, at the resolution of each channel
+static void test_round_trip()
+{
+    ram_flash f;
+    TsLog log;
+    check(log.open(ram_flash_ops(&f), TEST_PERIOD_S), "open");
+    uint32_t end = TEST_START + 6 * 3600;
+    for (uint32_t t = TEST_START; t < end; t += TEST_PERIOD_S) {
+        // a late and an early sample
+        log.add(signal(t == TEST_START + 600 ? t + 3 : t == TEST_START + 1200 ? t - 2 : t));
+    }
+    collected c;
+    log.query(0, UINT32_MAX, collect, &c);
+    check(c.points.size() == (end - TEST_START) / TEST_PERIOD_S, "all samples of the open blocks");
+    log.flush();
+    collected d;
+    log.query(TEST_START, end, collect, &d);
+    check(d.points.size() == c.points.size() && ordered(d), "all samples after a flush, in order");
+    bool exact = true;
+    for (const tslog_point_t &p : d.points) {
+        tslog_point_t want = signal(p.time);
+        for (int ch = 0; ch < TSLOG_CHANNEL_COUNT; ch++) {
+            exact &= same_value(p.value[ch], want.value[ch], tolerance(ch));
+        }
+    }
+    check(exact, "values within the resolution, NAN kept");
+
+    collected hour;
+    log.query(TEST_START + 3600, TEST_START + 7199, collect, &hour);
+    check(hour.points.size() == 360 && hour.points.front().time == TEST_START + 3600, "one hour");
+    collected some;
+    some.limit = 5;
+    check(log.query(0, UINT32_MAX, collect, &some) == 5, "the visitor stops the query");
+
+    tslog_stats_t stats;
+    log.get_stats(&stats);
+    tslog_point_t p = signal(TEST_START);
+    p.time = 1000;
+    log.add(p);
+    p.time = end - TEST_PERIOD_S;
+    log.add(p);
+    tslog_stats_t after;
+    log.get_stats(&after);
+    check(after.dropped == stats.dropped + 2 && after.tier[0].points == stats.tier[0].points,
+          "no clock and repeated times are dropped");
+    check(f.faults == 0, "no write over programmed bits");
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// months of samples: compaction, wear, reboots and a torn write
+static void test_months()
+{
+    const int days = 400;
+    ram_flash f;
+    TsLog *log = new TsLog();
+    check(log->open(ram_flash_ops(&f), TEST_PERIOD_S), "open");
+    uint32_t end = TEST_START + days * 86400;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t t = TEST_START; t < end; t += TEST_PERIOD_S) {
+        log->add(signal(t));
+    }
+    double append_s = seconds_since(start);
+    log->flush();
+
+    tslog_stats_t stats;
+    log->get_stats(&stats);
+    check(stats.compactions > 0 && stats.tier[1].points > 0 && stats.tier[2].points > 0, "compacted into both tiers");
+    check(stats.tier[0].newest == end - TEST_PERIOD_S, "newest sample");
+    for (int t = 0; t < TSLOG_TIERS; t++) {
+        char what[64];
+        snprintf(what, sizeof(what), "tier %d wear within one erase", t);
+        check(stats.tier[t].erases_max - stats.tier[t].erases_min <= 1, what);
+    }
+    check(stats.tier[2].oldest <= TEST_START + 86400, "hourly means back to the first day");
+
+    collected all;
+    log->query(0, UINT32_MAX, collect, &all);
+    check(ordered(all), "one series, coarse to fine");
+    size_t held = stats.tier[0].points + stats.tier[1].points + stats.tier[2].points;
+    check(all.points.size() >= held && all.points.size() <= held + 2, "every point once, and the open means");
+
+    // a mean against the samples it comes from
+    bool means = true;
+    int checked[TSLOG_TIERS] = {};
+    for (size_t i = 0; i < all.points.size(); i += 97) {
+        const tslog_point_t &p = all.points[i];
+        int tier = all.tiers[i];
+        uint32_t step = tier == 0 ? 0 : TIER_STEPS[tier];
+        double sum[TSLOG_CHANNEL_COUNT] = {};
+        int count[TSLOG_CHANNEL_COUNT] = {};
+        for (uint32_t t = p.time; t <= p.time + step - (step > 0 ? TEST_PERIOD_S : 0); t += TEST_PERIOD_S) {
+            tslog_point_t s = signal(t);
+            for (int ch = 0; ch < TSLOG_CHANNEL_COUNT; ch++) {
+                if (!isnan(s.value[ch])) {
+                    sum[ch] += s.value[ch];
+                    count[ch]++;
+                }
+            }
+        }
+        for (int ch = 0; ch < TSLOG_CHANNEL_COUNT; ch++) {
+            // the 5 minute means are averaged again for the hourly ones
+            float want = count[ch] > 0 ? sum[ch] / count[ch] : NAN;
+            means &= same_value(p.value[ch], want, tolerance(ch) * (tier + 1));
+        }
+        checked[tier]++;
+    }
+    check(means && checked[1] > 0 && checked[2] > 0, "means of every tier match their samples");
+    check(f.faults == 0, "no write over programmed bits");
+
+    // a reset: flushed samples are all found again, the open block is lost
+    for (uint32_t t = end; t < end + 300; t += TEST_PERIOD_S) {
+        log->add(signal(t));
+    }
+    delete log;
+    log = new TsLog();
+    log->open(ram_flash_ops(&f), TEST_PERIOD_S);
+    collected again;
+    log->query(0, end - 1, collect, &again);
+    tslog_stats_t reopened;
+    log->get_stats(&reopened);
+    check(again.points.size() + 2 >= all.points.size() && again.points.size() <= all.points.size() &&
+          reopened.tier[0].newest == end - TEST_PERIOD_S, "reopened at the last flushed sample");
+    check(reopened.tier[0].points == stats.tier[0].points, "raw points found again");
+
+    // a reset in the middle of a block write
+    for (uint32_t t = end; t < end + 640 * TEST_PERIOD_S; t += TEST_PERIOD_S) {
+        log->add(signal(t));
+    }
+    f.tear = 9;
+    log->add(signal(end + 640 * TEST_PERIOD_S));
+    log->flush();
+    delete log;
+    log = new TsLog();
+    log->open(ram_flash_ops(&f), TEST_PERIOD_S);
+    log->get_stats(&reopened);
+    check(reopened.bad_blocks == 1, "torn block found");
+    uint32_t resume = end + 640 * TEST_PERIOD_S + 3600;
+    for (uint32_t t = resume; t < resume + 7200; t += TEST_PERIOD_S) {
+        log->add(signal(t));
+    }
+    log->flush();
+    collected torn;
+    log->query(end, UINT32_MAX, collect, &torn);
+    check(ordered(torn) && torn.points.back().time == resume + 7200 - TEST_PERIOD_S && torn.points.size() >= 720,
+          "written on after the torn block");
+    check(f.faults == 0, "no write over programmed bits after the reset");
+
+    printf("%d days at %ds, %zu samples, append %.2f us per sample with compaction\n", days, TEST_PERIOD_S,
+           (size_t)days * 86400 / TEST_PERIOD_S, append_s * 1e6 / (days * 86400 / TEST_PERIOD_S));
+    printf("tier    step  sectors  points    bytes/point  ratio  holds    erases\n");
+    for (int t = 0; t < TSLOG_TIERS; t++) {
+        const tslog_tier_stats_t &s = stats.tier[t];
+        double per_point = (double)s.bytes / s.points;
+        printf("%-6d  %4us  %3u/%-3u  %-8u  %-11.2f  %-5.1f  %5.1fd  %u-%u\n", t, (unsigned)s.step_s, s.used,
+               s.sectors, (unsigned)s.points, per_point, 20 / per_point,
+               (s.newest - s.oldest) / 86400.0, (unsigned)s.erases_min, (unsigned)s.erases_max);
+    }
+
+    // queries of what a chart asks for, ending now
+    static const struct {
+        const char *name;
+        uint32_t span;
+        uint32_t ago;
+    } ranges[] = {
+        {"last hour", 3600, 0}, {"last day", 86400, 0}, {"last week", 7 * 86400, 0},
+        {"a day 60 days ago", 86400, 60 * 86400}, {"an hour 120 days ago", 3600, 120 * 86400},
+        {"everything", UINT32_MAX, 0},
+    };
+    printf("query                 points  flash read  host time\n");
+    uint32_t now = resume + 7200;
+    for (const auto &r : ranges) {
+        uint32_t to = now - r.ago;
+        uint32_t from = r.span == UINT32_MAX ? 0 : to - r.span;
+        const int repeat = 20;
+        collected c;
+        f.read_bytes = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeat; i++) {
+            c.points.clear();
+            c.tiers.clear();
+            log->query(from, to, collect, &c);
+        }
+        double us = seconds_since(t0) * 1e6 / repeat;
+        printf("%-20s  %6zu  %7.1f KB  %7.0f us\n", r.name, c.points.size(), f.read_bytes / repeat / 1024.0, us);
+    }
+    delete log;
+}
+
+int main()
+{
+    test_round_trip();
+    test_months();
+    printf(failures ? "FAILED\n" : "all checks passed\n");
+    return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+   History of the supply voltage, pointing error, motor power and
+   temperature in the "tslog" flash partition.
+
+   A sample is taken every CONFIG_TSLOG_PERIOD_S. Samples are collected in
+   RAM into blocks of up to TSLOG_BLOCK_SAMPLES, each block is compressed
+   and appended to flash in one write:
+     - values are quantized to the resolution of their channel, see
+       TSLOG_CHANNEL_LIST, and stored as deltas;
+     - times are stored as the change of their interval (delta of delta),
+       one bit for a sample on time;
+   each with the variable length prefixes of Gorilla, so a quiet sample
+   takes 5 bits.
+
+   The partition is split into three tiers, each a ring of 4 KB sectors:
+   raw samples, 5 minute means and hourly means. Appending only moves
+   forward through a ring and a sector is erased once per turn of its
+   ring, which spreads the wear over all of them. Before the oldest sector
+   of a tier is erased its samples are averaged into the next tier, so old
+   data is kept at a lower resolution instead of dropped (rolling
+   compaction). A sector header carries a sequence number, the head of each
+   ring is found again at boot; a block torn by a reset fails its CRC and
+   closes its sector.
+
+   The time range of every sector is kept in RAM and the header of every
+   block has its own, so a range query skips the sectors outside of it and
+   decodes only the blocks it returns. It walks the tiers from the
+   coarsest to the finest, each one up to where the next finer one starts,
+   so it returns a single series. GET /api/v1/log serves it.
+
+   The store does not depend on ESP-IDF, the host test runs it on a RAM
+   flash. Samples are dropped until the wall clock is set and when they are
+   not newer than the last one. A crash loses the samples of the open
+   block, a restart or deep sleep flushes them first.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+#define TSLOG_PARTITION_SUBTYPE 0x40    // data partition "tslog" in partitions.csv
+#define TSLOG_SECTOR_SIZE       4096
+#define TSLOG_TIERS             3
+#define TSLOG_BLOCK_SAMPLES     64
+#define TSLOG_BLOCK_BYTES       512     // compressed samples of a block, at most
+#define TSLOG_MIN_TIME          1577836800  // 2020-01-01, wall clock not set before it
+
+#ifndef CONFIG_TSLOG_PERIOD_S
+#define CONFIG_TSLOG_PERIOD_S   10
+#endif
+
+// name, resolution as steps per unit
+#define TSLOG_CHANNEL_LIST \
+X(TSLOG_VOLTAGE, "voltage", 100) \
+X(TSLOG_POINTING_ERROR, "pointingError", 1000) \
+X(TSLOG_MOTOR_POWER, "motorPower", 100) \
+X(TSLOG_TEMPERATURE, "temperature", 10) \
+
+typedef enum {
+#define X(name, desc, scale) name,
+    TSLOG_CHANNEL_LIST
+#undef X
+    TSLOG_CHANNEL_COUNT
+} tslog_channel_t;
+
+typedef struct {
+    uint32_t time;                          // unix time, of the start of the interval for the means
+    float value[TSLOG_CHANNEL_COUNT];       // NAN when not measured
+} tslog_point_t;
+
+typedef struct {
+    uint32_t step_s;            // interval of the points, the sample period for tier 0
+    uint16_t sectors;
+    uint16_t used;              // sectors holding data
+    uint32_t oldest, newest;    // unix time, 0 when empty
+    uint32_t points;            // in flash
+    uint32_t bytes;             // in flash, with the headers
+    uint32_t erases_min, erases_max;
+} tslog_tier_stats_t;
+
+typedef struct {
+    tslog_tier_stats_t tier[TSLOG_TIERS];
+    uint32_t samples;           // added since boot
+    uint32_t dropped;           // not newer than the last one
+    uint32_t compactions;       // sectors averaged into the next tier
+    uint32_t bad_blocks;        // failed their CRC
+    uint32_t flash_errors;
+} tslog_stats_t;
+
+/**
+ * @brief Called for each point of a query in time order, return false to stop
+ */
+typedef bool (*tslog_visit_t)(const tslog_point_t *point, int tier, void *ctx);
+
+// the partition, or RAM on the host
+typedef struct {
+    size_t size;
+    bool (*read)(void *ctx, size_t offset, void *dst, size_t size);
+    bool (*write)(void *ctx, size_t offset, const void *src, size_t size);
+    bool (*erase)(void *ctx, size_t offset, size_t size);
+    void *ctx;
+} tslog_flash_t;
+
+class TsLog {
+public:
+    ~TsLog()
+    {
+        delete[] table;
+    }
+    /**
+     * @brief Find the head of each ring, at least 2 sectors per tier are needed
+     */
+    bool open(const tslog_flash_t &flash, uint32_t period_s);
+    void add(const tslog_point_t &point);
+    /**
+     * @brief Write the open blocks of every tier
+     */
+    void flush();
+    /**
+     * @brief Points between from and to included
+     * @return number of points visited
+     */
+    int query(uint32_t from, uint32_t to, tslog_visit_t visit, void *ctx);
+    void get_stats(tslog_stats_t *stats);
+
+    static const char *channel_name(int channel);
+
+private:
+    // what RAM keeps of a sector, seq 0 for an erased one
+    struct sector_t {
+        uint32_t seq;
+        uint32_t start, end;
+        uint32_t erases;
+        uint16_t used;          // bytes written, TSLOG_SECTOR_SIZE once closed
+        uint16_t points;
+    };
+    // the open block of a tier
+    struct block_t {
+        uint32_t start, end;
+        uint16_t count;
+        uint32_t bits;
+        int32_t last_dt;
+        int32_t last[TSLOG_CHANNEL_COUNT];
+        uint8_t data[TSLOG_BLOCK_BYTES];
+    };
+    // the mean of the tier being filled by a compaction
+    struct bucket_t {
+        uint32_t start;
+        float sum[TSLOG_CHANNEL_COUNT];
+        uint16_t count[TSLOG_CHANNEL_COUNT];
+        bool open;
+    };
+    struct tier_t {
+        int first, sectors;
+        int head;               // -1 before the first write
+        uint32_t step_s;
+        block_t block;
+        bucket_t bucket;
+    };
+
+    void scan_sector(int index, bool head);
+    void append(int tier, const tslog_point_t &point);
+    void write_block(int tier);
+    bool next_sector(int tier);
+    void compact(int tier, int index);
+    void accumulate(int tier, const tslog_point_t &point);
+    int oldest_sector(int tier) const;
+    uint32_t oldest_time(int tier) const;
+    size_t offset(int index) const
+    {
+        return (size_t)index * TSLOG_SECTOR_SIZE;
+    }
+
+    tslog_flash_t flash = {};
+    sector_t *table = nullptr;
+    int sector_count = 0;
+    tier_t tiers[TSLOG_TIERS] = {};
+    uint32_t seq = 0;
+    uint32_t newest = 0;
+    tslog_stats_t stats = {};
+    std::mutex mutex;
+};
+
+/**
+ * @brief Open the partition and start sampling, after the gimbal is running
+ */
+void tslog_init(void);
+
+void tslog_flush(void);
+
+int tslog_query(uint32_t from, uint32_t to, tslog_visit_t visit, void *ctx);
+
+/**
+ * @brief false when there is no partition
+ */
+bool tslog_get_stats(tslog_stats_t *stats);
@@ -0,0 +1,791 @@
+#include <string.h>
+#include <math.h>
+#include "cbor.h"
+
+enum {
+    MAJOR_UINT,
+    MAJOR_NINT,
+    MAJOR_BYTES,
+    MAJOR_TEXT,
+    MAJOR_ARRAY,
+    MAJOR_MAP,
+    MAJOR_TAG,
+    MAJOR_SIMPLE,
+};
+
+enum {
+    SIMPLE_FALSE = 20,
+    SIMPLE_TRUE = 21,
+    SIMPLE_NULL = 22,
+    SIMPLE_F16 = 25,
+    SIMPLE_F32 = 26,
+    SIMPLE_F64 = 27,
+};
+
+static double half_to_double(uint16_t half)
+{
+    int exponent = (half >> 10) & 0x1f;
+    double mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0) {
+        value = ldexp(mantissa, -24);
+    } else if (exponent != 31) {
+        value = ldexp(mantissa + 1024, exponent - 25);
+    } else {
+        value = mantissa == 0 ? INFINITY : NAN;
+    }
+    return half & 0x8000 ? -value : value;
+}
+
+int CborReader::peek() const
+{
+    if (failed || pos >= len) {
+        return -1;
+    }
+    return buf[pos] >> 5;
+}
+
+bool CborReader::head_any(int *major, int *info, uint64_t *arg)
+{
+    if (failed || pos >= len) {
+        return fail();
+    }
+    uint8_t initial = buf[pos++];
+    *major = initial >> 5;
+    *info = initial & 0x1f;
+    if (*info < 24) {
+        *arg = *info;
+        return true;
+    }
+    if (*info > 27) {
+        // reserved, or the indefinite lengths this reader does not take
+        return fail();
+    }
+    size_t bytes = (size_t)1 << (*info - 24);
+    if (len - pos < bytes) {
+        return fail();
+    }
+    *arg = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        *arg = *arg << 8 | buf[pos++];
+    }
+    return true;
+}
+
+bool CborReader::head(int major, uint64_t *arg)
+{
+    int got, info;
+    if (!head_any(&got, &info, arg)) {
+        return false;
+    }
+    return got == major || fail();
+}
+
+bool CborReader::map(uint32_t *count)
+{
+    uint64_t arg;
+    // every pair takes at least two bytes, a larger count is a lie
+    if (!head(MAJOR_MAP, &arg) || arg > (len - pos) / 2) {
+        return fail();
+    }
+    *count = (uint32_t)arg;
+    return true;
+}
+
+bool CborReader::array(uint32_t *count)
+{
+    uint64_t arg;
+    if (!head(MAJOR_ARRAY, &arg) || arg > len - pos) {
+        return fail();
+    }
+    *count = (uint32_t)arg;
+    return true;
+}
+
+bool CborReader::uint64(uint64_t *value)
+{
+    return head(MAJOR_UINT, value);
+}
+
+bool CborReader::number(double *value)
+{
+    int major, info;
+    uint64_t arg;
+    if (!head_any(&major, &info, &arg)) {
+        return false;
+    }
+    if (major == MAJOR_UINT) {
+        *value = (double)arg;
+    } else if (major == MAJOR_NINT) {
+        *value = -1.0 - (double)arg;
+    } else if (major == MAJOR_SIMPLE && info == SIMPLE_F16) {
+        *value = half_to_double((uint16_t)arg);
+    } else if (major == MAJOR_SIMPLE && info == SIMPLE_F32) {
+        uint32_t bits = (uint32_t)arg;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        *value = f;
+    } else if (major == MAJOR_SIMPLE && info == SIMPLE_F64) {
+        memcpy(value, &arg, sizeof(*value));
+    } else {
+        return fail();
+    }
+    return true;
+}
+
+bool CborReader::boolean(bool *value)
+{
+    int major, info;
+    uint64_t arg;
+    if (!head_any(&major, &info, &arg)) {
+        return false;
+    }
+    if (major != MAJOR_SIMPLE || (info != SIMPLE_FALSE && info != SIMPLE_TRUE)) {
+        return fail();
+    }
+    *value = info == SIMPLE_TRUE;
+    return true;
+}
+
+bool CborReader::null()
+{
+    int major, info;
+    uint64_t arg;
+    if (!head_any(&major, &info, &arg)) {
+        return false;
+    }
+    return (major == MAJOR_SIMPLE && info == SIMPLE_NULL) || fail();
+}
+
+bool CborReader::text(const char **str, size_t *size)
+{
+    uint64_t arg;
+    if (!head(MAJOR_TEXT, &arg) || arg > len - pos) {
+        return fail();
+    }
+    *str = (const char *)buf + pos;
+    *size = (size_t)arg;
+    pos += (size_t)arg;
+    return true;
+}
+
+bool CborReader::skip_item(int depth)
+{
+    int major, info;
+    uint64_t arg;
+    if (depth > CBOR_MAX_DEPTH || !head_any(&major, &info, &arg)) {
+        return fail();
+    }
+    switch (major) {
+    case MAJOR_BYTES:
+    case MAJOR_TEXT:
+        if (arg > len - pos) {
+            return fail();
+        }
+        pos += (size_t)arg;
+        return true;
+    case MAJOR_MAP:
+        if (arg > (len - pos) / 2) {
+            return fail();
+        }
+        arg *= 2;
+    // fall through
+    case MAJOR_ARRAY:
+        if (arg > len - pos) {
+            return fail();
+        }
+        for (uint64_t i = 0; i < arg; i++) {
+            if (!skip_item(depth + 1)) {
+                return false;
+            }
+        }
+        return true;
+    case MAJOR_TAG:
+        return skip_item(depth + 1);
+    default:
+        // integers, simple values and floats are all in the head
+        return true;
+    }
+}
+
+bool CborReader::skip()
+{
+    return skip_item(0);
+}
+
+void CborWriter::put(const void *data, size_t size)
+{
+    if (size_needed + size <= cap) {
+        memcpy(buf + size_needed, data, size);
+    }
+    size_needed += size;
+}
+
+void CborWriter::head(int major, uint64_t arg)
+{
+    uint8_t out[9];
+    int bytes = arg < 24 ? 0 : arg <= 0xff ? 1 : arg <= 0xffff ? 2 : arg <= 0xffffffff ? 4 : 8;
+    out[0] = (uint8_t)(major << 5 | (bytes == 0 ? arg : bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27));
+    for (int i = 0; i < bytes; i++) {
+        out[1 + i] = (uint8_t)(arg >> (8 * (bytes - 1 - i)));
+    }
+    put(out, 1 + bytes);
+}
+
+void CborWriter::map(uint32_t count)
+{
+    head(MAJOR_MAP, count);
+}
+
+void CborWriter::array(uint32_t count)
+{
+    head(MAJOR_ARRAY, count);
+}
+
+void CborWriter::uint64(uint64_t value)
+{
+    head(MAJOR_UINT, value);
+}
+
+void CborWriter::int64(int64_t value)
+{
+    if (value >= 0) {
+        head(MAJOR_UINT, (uint64_t)value);
+    } else {
+        head(MAJOR_NINT, (uint64_t)(-1 - value));
+    }
+}
+
+void CborWriter::f32(float value)
+{
+    if (value == truncf(value) && fabsf(value) < 1e15f) {
+        int64((int64_t)value);
+        return;
+    }
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t out[5] = {MAJOR_SIMPLE << 5 | SIMPLE_F32, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16),
+                      (uint8_t)(bits >> 8), (uint8_t)bits
+                     };
+    put(out, sizeof(out));
+}
+
+void CborWriter::f64(double value)
+{
+    if (value == trunc(value) && fabs(value) < 1e15) {
+        int64((int64_t)value);
+        return;
+    }
+    if ((double)(float)value == value || isnan(value)) {
+        f32((float)value);
+        return;
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t out[9];
+    out[0] = MAJOR_SIMPLE << 5 | SIMPLE_F64;
+    for (int i = 0; i < 8; i++) {
+        out[1 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    put(out, sizeof(out));
+}
+
+void CborWriter::boolean(bool value)
+{
+    head(MAJOR_SIMPLE, value ? SIMPLE_TRUE : SIMPLE_FALSE);
+}
+
+void CborWriter::text(const char *str, size_t size)
+{
+    head(MAJOR_TEXT, size);
+    put(str, size);
+}
+
+void CborWriter::text(const char *str)
+{
+    text(str, strlen(str));
+}
+
+void CborWriter::null()
+{
+    head(MAJOR_SIMPLE, SIMPLE_NULL);
+}
+
+static bool in_range(const cbor_field_t &field, double value)
+{
+    if (isnan(value)) {
+        return false;
+    }
+    if (field.lo > field.hi) {
+        return true;
+    }
+    double x = field.flags & CBOR_ABS ? fabs(value) : value;
+    if (field.flags & CBOR_LO_OPEN ? x <= field.lo : x < field.lo) {
+        return false;
+    }
+    if (field.flags & CBOR_HI_OPEN ? x >= field.hi : x > field.hi) {
+        return false;
+    }
+    return true;
+}
+
+// a number for the member, false when it does not fit
+static bool store_number(const cbor_field_t &field, char *member, double value)
+{
+    if (!in_range(field, value)) {
+        return false;
+    }
+    if (field.type == CBOR_FIELD_F32) {
+        *(float *)member = (float)value;
+        return true;
+    }
+    if (field.type == CBOR_FIELD_F64) {
+        *(double *)member = value;
+        return true;
+    }
+    double max = field.type == CBOR_FIELD_U8 ? UINT8_MAX : field.type == CBOR_FIELD_U16 ? UINT16_MAX : UINT32_MAX;
+    if (value != trunc(value) || value < 0 || value > max) {
+        return false;
+    }
+    if (field.type == CBOR_FIELD_U8) {
+        *(uint8_t *)member = (uint8_t)value;
+    } else if (field.type == CBOR_FIELD_U16) {
+        *(uint16_t *)member = (uint16_t)value;
+    } else {
+        *(uint32_t *)member = (uint32_t)value;
+    }
+    return true;
+}
+
+static bool decode_map(CborReader &reader, const cbor_map_t *map, char *base, uint32_t section,
+                       uint32_t *sections, int *ignored);
+
+static bool decode_field(CborReader &reader, const cbor_field_t &field, char *base, uint32_t section,
+                         uint32_t *sections, int *ignored)
+{
+    char *member = base + field.offset;
+    double value;
+    uint32_t count;
+    bool set = false;
+    switch (field.type) {
+    case CBOR_FIELD_F32:
+    case CBOR_FIELD_F64:
+    case CBOR_FIELD_U8:
+    case CBOR_FIELD_U16:
+    case CBOR_FIELD_U32:
+        if (!reader.number(&value)) {
+            return false;
+        }
+        set = store_number(field, member, value);
+        *ignored += !set;
+        break;
+    case CBOR_FIELD_BOOL: {
+        bool flag;
+        if (!reader.boolean(&flag)) {
+            return false;
+        }
+        *(uint8_t *)member = flag;
+        set = true;
+        break;
+    }
+    case CBOR_FIELD_TEXT: {
+        const char *str;
+        size_t size;
+        if (!reader.text(&str, &size) || field.size == 0) {
+            return false;
+        }
+        size = size < field.size ? size : field.size - 1u;
+        memcpy(member, str, size);
+        member[size] = '\0';
+        set = true;
+        break;
+    }
+    case CBOR_FIELD_F32_ARRAY:
+        if (!reader.array(&count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (!reader.number(&value)) {
+                return false;
+            }
+            if (i < field.size && in_range(field, value)) {
+                ((float *)member)[i] = (float)value;
+                set = true;
+            } else {
+                (*ignored)++;
+            }
+        }
+        break;
+    case CBOR_FIELD_MAP:
+        return decode_map(reader, field.map, member, section, sections, ignored);
+    case CBOR_FIELD_MAP_ARRAY:
+        if (!reader.array(&count)) {
+            return false;
+        }
+        if (field.flags & CBOR_REPLACE) {
+            memset(member, 0, (size_t)field.size * field.stride);
+            set = true;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            bool ok = i < field.size ? decode_map(reader, field.map, member + i * field.stride, section, sections, ignored)
+                      : reader.skip();
+            if (!ok) {
+                return false;
+            }
+            *ignored += i >= field.size;
+        }
+        break;
+    default:
+        return reader.skip();
+    }
+    if (set) {
+        *sections |= section;
+    }
+    return true;
+}
+
+static bool decode_map(CborReader &reader, const cbor_map_t *map, char *base, uint32_t section,
+                       uint32_t *sections, int *ignored)
+{
+    uint32_t count;
+    if (!reader.map(&count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t key;
+        if (reader.peek() != 0) {
+            // keys are small integers, anything else is skipped with its value
+            if (!reader.skip() || !reader.skip()) {
+                return false;
+            }
+            continue;
+        }
+        reader.uint64(&key);
+        const cbor_field_t *field = NULL;
+        for (int f = 0; f < map->count; f++) {
+            if (map->fields[f].key == key) {
+                field = &map->fields[f];
+                break;
+            }
+        }
+        if (field == NULL) {
+            // from a newer client, or a field that was retired
+            if (!reader.skip()) {
+                return false;
+            }
+            continue;
+        }
+        if (!decode_field(reader, *field, base, field->section ? field->section : section, sections, ignored)) {
+            return false;
+        }
+    }
+    return reader.ok();
+}
+
+bool cbor_decode(CborReader &reader, const cbor_map_t *map, void *base, uint32_t *sections, int *ignored)
+{
+    return decode_map(reader, map, (char *)base, 0, sections, ignored);
+}
+
+void cbor_encode_fields(CborWriter &writer, const cbor_map_t *map, const void *base)
+{
+    for (int f = 0; f < map->count; f++) {
+        const cbor_field_t &field = map->fields[f];
+        const char *member = (const char *)base + field.offset;
+        writer.uint64(field.key);
+        switch (field.type) {
+        case CBOR_FIELD_F32:
+            writer.f32(*(const float *)member);
+            break;
+        case CBOR_FIELD_F64:
+            writer.f64(*(const double *)member);
+            break;
+        case CBOR_FIELD_U8:
+            writer.uint64(*(const uint8_t *)member);
+            break;
+        case CBOR_FIELD_U16:
+            writer.uint64(*(const uint16_t *)member);
+            break;
+        case CBOR_FIELD_U32:
+            writer.uint64(*(const uint32_t *)member);
+            break;
+        case CBOR_FIELD_BOOL:
+            writer.boolean(*(const uint8_t *)member);
+            break;
+        case CBOR_FIELD_TEXT:
+            writer.text(member, strnlen(member, field.size));
+            break;
+        case CBOR_FIELD_F32_ARRAY:
+            writer.array(field.size);
+            for (int i = 0; i < field.size; i++) {
+                writer.f32(((const float *)member)[i]);
+            }
+            break;
+        case CBOR_FIELD_MAP:
+            cbor_encode(writer, field.map, member);
+            break;
+        case CBOR_FIELD_MAP_ARRAY:
+            writer.array(field.size);
+            for (int i = 0; i < field.size; i++) {
+                cbor_encode(writer, field.map, member + i * field.stride);
+            }
+            break;
+        default:
+            writer.null();
+            break;
+        }
+    }
+}
+
+void cbor_encode(CborWriter &writer, const cbor_map_t *map, const void *base)
+{
+    writer.map(map->count);
+    cbor_encode_fields(writer, map, base);
+}
+
+// run test on linux, CBOR_NO_MAIN when linked into another program
+#if defined(__linux__) && !defined(CBOR_NO_MAIN)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("  %s\n", what);
+        failures++;
+    }
+}
+
+static bool hex_eq(const uint8_t *data, size_t size, const char *hex)
+{
+    if (strlen(hex) != 2 * size) {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+        unsigned byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        if (data[i] != byte) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t from_hex(const char *hex, uint8_t *out)
+{
+    size_t size = strlen(hex) / 2;
+    for (size_t i = 0; i < size; i++) {
+        unsigned byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (uint8_t)byte;
+    }
+    return size;
+}
+
+// examples of RFC 8949 appendix A
+static void test_vectors()
+{
+    static const struct {
+        const char *hex;
+        double value;
+    } numbers[] = {
+        {"00", 0}, {"17", 23}, {"1818", 24}, {"1903e8", 1000}, {"1a000f4240", 1000000},
+        {"1b000000e8d4a51000", 1000000000000.0}, {"20", -1}, {"3863", -100}, {"3903e7", -1000},
+        {"f93c00", 1.0}, {"f93e00", 1.5}, {"f97bff", 65504.0}, {"f90001", 5.960464477539063e-8},
+        {"f9c400", -4.0}, {"fa47c35000", 100000.0}, {"fa7f7fffff", 3.4028234663852886e+38},
+        {"fb3ff199999999999a", 1.1}, {"fbc010666666666666", -4.1},
+    };
+    uint8_t buf[32];
+    for (const auto &n : numbers) {
+        CborReader reader(buf, from_hex(n.hex, buf));
+        double value;
+        char what[64];
+        snprintf(what, sizeof(what), "read %s", n.hex);
+        check(reader.number(&value) && value == n.value && reader.done(), what);
+    }
+
+    bool flag;
+    CborReader f(buf, from_hex("f4f5f6", buf));
+    check(f.boolean(&flag) && !flag && f.boolean(&flag) && flag && f.null() && f.done(), "read false true null");
+
+    const char *str;
+    size_t size;
+    CborReader t(buf, from_hex("6449455446", buf));
+    check(t.text(&str, &size) && size == 4 && memcmp(str, "IETF", 4) == 0, "read \"IETF\"");
+
+    uint32_t count;
+    uint64_t a, b;
+    CborReader m(buf, from_hex("a201020304", buf));
+    check(m.map(&count) && count == 2 && m.uint64(&a) && m.uint64(&b) && a == 1 && b == 2, "read {1: 2, 3: 4}");
+
+    CborReader s(buf, from_hex("826161a161626163c11a514b67b001", buf));
+    check(s.skip() && s.skip() && s.uint64(&a) && a == 1 && s.done(), "skip [\"a\", {\"b\": \"c\"}] and a tag");
+
+    // indefinite lengths, a truncated head, a count past the end, a wrong type
+    static const char *bad[] = {"9fff", "5f41014102ff", "19", "1a0001", "83010203", "a3010203", "6449", "f4"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        CborReader r(buf, from_hex(bad[i], buf));
+        uint32_t n;
+        double v;
+        bool ok = i == 4 ? r.array(&n) && r.number(&v) && r.number(&v) && r.number(&v) && r.number(&v)
+                  : i == 5 ? r.map(&n) && r.skip() && r.skip() && r.skip() && r.skip() && r.skip() && r.skip()
+                  : i == 7 ? r.number(&v) : r.skip();
+        char what[64];
+        snprintf(what, sizeof(what), "reject %s", bad[i]);
+        check(!ok && !r.ok(), what);
+    }
+
+    uint8_t out[64];
+    CborWriter w(out, sizeof(out));
+    w.uint64(0);
+    w.uint64(1000);
+    w.int64(-100);
+    w.f32(1.5f);
+    w.f32(100000.0f);
+    w.f64(1.1);
+    w.text("IETF");
+    w.map(1);
+    w.boolean(true);
+    w.null();
+    check(w.ok() && hex_eq(out, w.size(), "001903e83863fa3fc000001a000186a0fb3ff199999999999a6449455446a1f5f6"),
+          "write the examples");
+
+    CborWriter small(out, 4);
+    small.text("too long for it");
+    check(!small.ok() && small.size() == 16, "size of an overflowing write");
+}
+
+struct test_inner {
+    float a;
+    uint8_t on;
+};
+
+struct test_doc {
+    uint8_t version;
+    float f;
+    double d;
+    uint16_t u16;
+    uint32_t u32;
+    uint8_t flag;
+    char name[8];
+    float arr[3];
+    struct test_inner in;
+    struct test_inner list[2];
+};
+
+enum { SEC_TOP = 1, SEC_IN = 2, SEC_LIST = 4 };
+
+static const cbor_field_t inner_fields[] = {
+    {1, CBOR_FIELD_F32, CBOR_ABS | CBOR_LO_OPEN, 0, offsetof(test_inner, a), 0, 0, 0.1, INFINITY, "a", NULL},
+    {2, CBOR_FIELD_BOOL, 0, 0, offsetof(test_inner, on), 0, 0, 1, 0, "on", NULL},
+};
+static const cbor_map_t inner_map = {inner_fields, 2};
+
+static const cbor_field_t doc_fields[] = {
+    {0, CBOR_FIELD_U8, 0, 0, offsetof(test_doc, version), 0, 0, 1, 1, "v", NULL},
+    {1, CBOR_FIELD_F32, CBOR_HI_OPEN, 0, offsetof(test_doc, f), 0, SEC_TOP, 0, 1, "f", NULL},
+    {2, CBOR_FIELD_F64, 0, 0, offsetof(test_doc, d), 0, SEC_TOP, 1, 0, "d", NULL},
+    {3, CBOR_FIELD_U16, 0, 0, offsetof(test_doc, u16), 0, SEC_TOP, 1, 0, "u16", NULL},
+    {4, CBOR_FIELD_U32, 0, 0, offsetof(test_doc, u32), 0, SEC_TOP, 1, 0, "u32", NULL},
+    {5, CBOR_FIELD_BOOL, 0, 0, offsetof(test_doc, flag), 0, SEC_TOP, 1, 0, "flag", NULL},
+    {6, CBOR_FIELD_TEXT, 0, 8, offsetof(test_doc, name), 0, SEC_TOP, 1, 0, "name", NULL},
+    {7, CBOR_FIELD_F32_ARRAY, CBOR_LO_OPEN, 3, offsetof(test_doc, arr), 0, SEC_TOP, 0, INFINITY, "arr", NULL},
+    {8, CBOR_FIELD_MAP, 0, 0, offsetof(test_doc, in), 0, SEC_IN, 1, 0, "in", &inner_map},
+    {9, CBOR_FIELD_MAP_ARRAY, CBOR_REPLACE, 2, offsetof(test_doc, list), sizeof(test_inner), SEC_LIST, 1, 0, "list",
+     &inner_map},
+};
+static const cbor_map_t doc_map = {doc_fields, sizeof(doc_fields) / sizeof(doc_fields[0])};
+
+static void test_fields()
+{
+    test_doc doc = {1, 0.5f, 1.1, 60000, 4000000000u, 1, "heli", {1, 2.5f, 3}, {-0.25f, 1}, {{1, 0}, {2, 1}}};
+    uint8_t buf[256];
+    CborWriter writer(buf, sizeof(buf));
+    cbor_encode(writer, &doc_map, &doc);
+    check(writer.ok(), "encode the test document");
+
+    test_doc back;
+    memset(&back, 0, sizeof(back));
+    uint32_t sections = 0;
+    int ignored = 0;
+    CborReader reader(buf, writer.size());
+    check(cbor_decode(reader, &doc_map, &back, &sections, &ignored) && reader.done(), "decode the test document");
+    uint8_t again[256];
+    CborWriter rewriter(again, sizeof(again));
+    cbor_encode(rewriter, &doc_map, &back);
+    check(rewriter.size() == writer.size() && memcmp(buf, again, writer.size()) == 0 && back.d == doc.d &&
+          sections == (SEC_TOP | SEC_IN | SEC_LIST) && ignored == 0, "round trip");
+
+    // out of range values are kept out, unknown and text keys skipped, the list replaced
+    uint8_t patch[128];
+    CborWriter p(patch, sizeof(patch));
+    p.map(7);
+    p.uint64(1);
+    p.f32(1.0f);                // f < 1
+    p.uint64(3);
+    p.int64(70000);             // above UINT16_MAX
+    p.uint64(7);
+    p.array(4);
+    p.f32(0);                   // not > 0
+    p.f32(7);
+    p.f32(8);
+    p.f32(9);                   // one too many
+    p.uint64(99);
+    p.array(1);
+    p.text("future");
+    p.text("name");
+    p.text("skipped");
+    p.uint64(6);
+    p.text("much too long");
+    p.uint64(9);
+    p.array(1);
+    p.map(1);
+    p.uint64(1);
+    p.f32(0.05f);               // |a| not > 0.1
+    sections = 0;
+    ignored = 0;
+    back = doc;
+    CborReader pr(patch, p.size());
+    check(cbor_decode(pr, &doc_map, &back, &sections, &ignored) && pr.done(), "decode the patch");
+    check(back.f == doc.f && back.u16 == doc.u16 && back.arr[0] == doc.arr[0] && back.arr[1] == 7 && back.arr[2] == 8,
+          "ranges of the patch");
+    check(strcmp(back.name, "much to") == 0, "text cut to its member");
+    check(back.list[0].a == 0 && back.list[1].a == 0 && back.list[1].on == 0, "list replaced");
+    check(ignored == 5 && sections == (SEC_TOP | SEC_LIST), "ignored values and sections of the patch");
+
+    // every truncation fails, no byte changed makes the decoder read outside the buffer
+    int truncated_ok = 0;
+    for (size_t size = 0; size < writer.size(); size++) {
+        uint8_t copy[256];
+        memcpy(copy, buf, size);
+        CborReader r(copy, size);
+        truncated_ok += cbor_decode(r, &doc_map, &back, &sections, &ignored) && r.done();
+    }
+    check(truncated_ok == 0, "a truncated document decodes");
+    srand(42);
+    int decoded = 0;
+    for (int i = 0; i < 200000; i++) {
+        uint8_t copy[256];
+        memcpy(copy, buf, writer.size());
+        for (int flips = 1 + rand() % 3; flips > 0; flips--) {
+            copy[rand() % writer.size()] = (uint8_t)rand();
+        }
+        CborReader r(copy, writer.size());
+        decoded += cbor_decode(r, &doc_map, &back, &sections, &ignored);
+    }
+    printf("  %d of 200000 mutated documents still decode\n", decoded);
+}
+
+int main()
+{
+    test_vectors();
+    test_fields();
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
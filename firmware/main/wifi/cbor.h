@@ -0,0 +1,163 @@
+/*
+   Minimal CBOR (RFC 8949) for the binary control API.
+
+   CborReader walks a buffer item by item and CborWriter appends items to
+   one, neither allocates. Only definite lengths are read, which is what
+   every encoder produces for a document it knows the size of. A reader
+   stays failed after the first error, so a decoder checks once at the end.
+
+   On top of the two, a field table (cbor_map_t) binds small integer keys
+   to the members of a plain struct: cbor_decode() stores what a document
+   carries straight into the struct, with a range per value, and
+   cbor_encode() writes the struct back out. Each field also has the name
+   of its JSON twin, for tools and the benchmark.
+
+   Nothing here depends on ESP-IDF, see the __linux__ section of cbor.cpp.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CBOR_MAX_DEPTH  8       // nesting skip() follows
+
+typedef enum {
+    CBOR_FIELD_F32,
+    CBOR_FIELD_F64,
+    CBOR_FIELD_U8,
+    CBOR_FIELD_U16,
+    CBOR_FIELD_U32,
+    CBOR_FIELD_BOOL,            // uint8_t, CBOR true or false
+    CBOR_FIELD_TEXT,            // char[size], always terminated
+    CBOR_FIELD_F32_ARRAY,       // float[size]
+    CBOR_FIELD_MAP,             // struct of map
+    CBOR_FIELD_MAP_ARRAY,       // size structs of map, stride bytes apart
+} cbor_field_type_t;
+
+// range flags, a value out of range is ignored and counted
+#define CBOR_LO_OPEN    0x01    // value > lo, not >=
+#define CBOR_HI_OPEN    0x02    // value < hi, not <=
+#define CBOR_ABS        0x04    // the range applies to |value|
+#define CBOR_REPLACE    0x08    // arrays: zero the old elements first
+
+struct cbor_map;
+
+typedef struct {
+    uint8_t key;
+    uint8_t type;               // cbor_field_type_t
+    uint8_t flags;
+    uint8_t size;               // text capacity, array length
+    uint16_t offset;            // of the member in the struct
+    uint16_t stride;            // CBOR_FIELD_MAP_ARRAY element size
+    uint32_t section;           // reported when set, 0 to inherit from the enclosing map
+    double lo, hi;              // accepted range of numbers, lo > hi for none
+    const char *name;           // JSON name
+    const struct cbor_map *map; // CBOR_FIELD_MAP, CBOR_FIELD_MAP_ARRAY
+} cbor_field_t;
+
+typedef struct cbor_map {
+    const cbor_field_t *fields;
+    int count;
+} cbor_map_t;
+
+class CborReader {
+public:
+    CborReader(const uint8_t *buf, size_t len): buf(buf), len(len) {}
+
+    bool map(uint32_t *count);
+    bool array(uint32_t *count);
+    bool uint64(uint64_t *value);
+    // unsigned, negative or float of any width
+    bool number(double *value);
+    bool boolean(bool *value);
+    // not terminated, points into the buffer
+    bool text(const char **str, size_t *size);
+    bool null();
+    // the whole next item, whatever it is
+    bool skip();
+
+    // major type of the next item, -1 at the end
+    int peek() const;
+    bool ok() const
+    {
+        return !failed;
+    }
+    bool done() const
+    {
+        return !failed && pos == len;
+    }
+    size_t position() const
+    {
+        return pos;
+    }
+
+private:
+    bool head(int major, uint64_t *arg);
+    bool head_any(int *major, int *info, uint64_t *arg);
+    bool skip_item(int depth);
+    bool fail()
+    {
+        failed = true;
+        return false;
+    }
+
+    const uint8_t *buf;
+    size_t len;
+    size_t pos = 0;
+    bool failed = false;
+};
+
+class CborWriter {
+public:
+    CborWriter(uint8_t *buf, size_t cap): buf(buf), cap(cap) {}
+
+    void map(uint32_t count);
+    void array(uint32_t count);
+    void uint64(uint64_t value);
+    void int64(int64_t value);
+    // integral values go out as integers, else as float32
+    void f32(float value);
+    // integral values go out as integers, float32 when exact, else float64
+    void f64(double value);
+    void boolean(bool value);
+    void text(const char *str, size_t size);
+    void text(const char *str);
+    void null();
+
+    // false when the buffer was too small, size() is then what it needed
+    bool ok() const
+    {
+        return size_needed <= cap;
+    }
+    size_t size() const
+    {
+        return size_needed;
+    }
+
+private:
+    void head(int major, uint64_t arg);
+    void put(const void *data, size_t size);
+
+    uint8_t *buf;
+    size_t cap;
+    size_t size_needed = 0;
+};
+
+/**
+ * @brief Store the fields of the map at reader into base
+ * @param sections or'ed with the section of every field set
+ * @param ignored incremented for every value out of its range
+ * @return false for a malformed document or a value of the wrong type,
+ *         base may then be partly written
+ */
+bool cbor_decode(CborReader &reader, const cbor_map_t *map, void *base, uint32_t *sections, int *ignored);
+
+/**
+ * @brief Write the members of base as the fields of the map, without the map head
+ */
+void cbor_encode_fields(CborWriter &writer, const cbor_map_t *map, const void *base);
+
+/**
+ * @brief Write base as a map of all its fields
+ */
+void cbor_encode(CborWriter &writer, const cbor_map_t *map, const void *base);
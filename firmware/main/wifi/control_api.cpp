@@ -0,0 +1,685 @@
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include "control_api.h"
+
+// lo > hi: any value
+#define ANY                 1, 0
+#define POSITIVE            0, INFINITY
+
+// the arguments after the member are the range and the JSON name
+#define NUM(S, key, type, flags, member, ...) \
+    {key, type, flags, 0, offsetof(S, member), 0, 0, __VA_ARGS__, NULL}
+#define F32(S, key, flags, member, ...)     NUM(S, key, CBOR_FIELD_F32, flags, member, __VA_ARGS__)
+#define BOOL(S, key, member, name) \
+    {key, CBOR_FIELD_BOOL, 0, 0, offsetof(S, member), 0, 0, ANY, name, NULL}
+#define MAP(S, key, section, member, map, name) \
+    {key, CBOR_FIELD_MAP, 0, 0, offsetof(S, member), 0, section, ANY, name, &map}
+
+#define COUNT_OF(fields)    (int)(sizeof(fields) / sizeof(fields[0]))
+
+static const cbor_field_t pid_fields[] = {
+    F32(pid_param, 1, 0, p, POSITIVE, "p"),
+    F32(pid_param, 2, 0, i, POSITIVE, "i"),
+    F32(pid_param, 3, 0, d, POSITIVE, "d"),
+    F32(pid_param, 4, 0, max_out, POSITIVE, "maxout"),
+    F32(pid_param, 5, 0, integral_limit, POSITIVE, "maxitg"),
+};
+static const cbor_map_t pid_map = {pid_fields, COUNT_OF(pid_fields)};
+
+static const cbor_field_t pid_set_fields[] = {
+    {1, CBOR_FIELD_MAP, 0, 0, CONTROL_PID_POS * sizeof(pid_param), 0, 0, ANY, "pos", &pid_map},
+    {2, CBOR_FIELD_MAP, 0, 0, CONTROL_PID_VEL * sizeof(pid_param), 0, 0, ANY, "vel", &pid_map},
+    {3, CBOR_FIELD_MAP, 0, 0, CONTROL_PID_PITCH_POS * sizeof(pid_param), 0, 0, ANY, "pitch_pos", &pid_map},
+    {4, CBOR_FIELD_MAP, 0, 0, CONTROL_PID_PITCH_VEL * sizeof(pid_param), 0, 0, ANY, "pitch_vel", &pid_map},
+};
+static const cbor_map_t pid_set_map = {pid_set_fields, COUNT_OF(pid_set_fields)};
+
+typedef decltype(control_settings_t::th) control_th_t;
+static const cbor_field_t th_fields[] = {
+    F32(control_th_t, 1, 0, vol_max, 0, 24, "maxv"),
+    F32(control_th_t, 2, 0, vol_min, 0, 24, "minv"),
+};
+static const cbor_map_t th_map = {th_fields, COUNT_OF(th_fields)};
+
+typedef decltype(control_settings_t::man) control_man_t;
+static const cbor_field_t man_fields[] = {
+    F32(control_man_t, 1, 0, pitch, ANY, "pitch"),
+    F32(control_man_t, 2, 0, yaw, ANY, "yaw"),
+};
+static const cbor_map_t man_map = {man_fields, COUNT_OF(man_fields)};
+
+static const cbor_field_t adc_fields[] = {
+    F32(adc_cal_t, 1, 0, scale, ANY, "scale"),
+    F32(adc_cal_t, 2, 0, offset, ANY, "offset"),
+};
+static const cbor_map_t adc_map = {adc_fields, COUNT_OF(adc_fields)};
+
+static const cbor_field_t track_fields[] = {
+    F32(track_param, 1, 0, threshold_deg, POSITIVE, "threshold"),
+    F32(track_param, 2, 0, lead, 0, 1, "lead"),
+    F32(track_param, 3, CBOR_LO_OPEN, settle_deg, POSITIVE, "settle"),
+    BOOL(track_param, 4, yaw_self_lock, "yawLock"),
+    BOOL(track_param, 5, pitch_self_lock, "pitchLock"),
+    BOOL(track_param, 6, enable, "enable"),
+};
+static const cbor_map_t track_map = {track_fields, COUNT_OF(track_fields)};
+
+// clear above overcast is checked when the section is applied
+static const cbor_field_t weather_fields[] = {
+    F32(weather_param, 1, 0, clear_kt, ANY, "clear"),
+    F32(weather_param, 2, 0, overcast_kt, ANY, "overcast"),
+    F32(weather_param, 3, CBOR_LO_OPEN, tau_s, POSITIVE, "tau"),
+    F32(weather_param, 4, 0, dwell_s, POSITIVE, "dwell"),
+    F32(weather_param, 5, 0, min_elevation, POSITIVE, "minElevation"),
+    F32(weather_param, 6, CBOR_LO_OPEN, hold_deg, POSITIVE, "hold"),
+    BOOL(weather_param, 7, enable, "enable"),
+};
+static const cbor_map_t weather_map = {weather_fields, COUNT_OF(weather_fields)};
+
+// the sign of a gain flips the quadrants
+static const cbor_field_t fine_fields[] = {
+    F32(fine_param, 1, CBOR_ABS | CBOR_LO_OPEN, gain_x_deg, 0.1, INFINITY, "gainX"),
+    F32(fine_param, 2, CBOR_ABS | CBOR_LO_OPEN, gain_y_deg, 0.1, INFINITY, "gainY"),
+    F32(fine_param, 3, CBOR_LO_OPEN, tau_s, POSITIVE, "tau"),
+    F32(fine_param, 4, 0, min_signal, POSITIVE, "minSignal"),
+    F32(fine_param, 5, CBOR_LO_OPEN, max_correction_deg, POSITIVE, "maxCorrection"),
+    F32(fine_param, 6, 0, hold_s, POSITIVE, "hold"),
+    BOOL(fine_param, 7, enable, "enable"),
+};
+static const cbor_map_t fine_map = {fine_fields, COUNT_OF(fine_fields)};
+
+static const cbor_field_t mount_fields[] = {
+    F32(mount_param, 1, CBOR_ABS, az_offset, 0, 20, "azOffset"),
+    F32(mount_param, 2, CBOR_ABS, pitch_offset, 0, 20, "pitchOffset"),
+    F32(mount_param, 3, CBOR_ABS, tilt_n, 0, 20, "tiltN"),
+    F32(mount_param, 4, CBOR_ABS, tilt_e, 0, 20, "tiltE"),
+    F32(mount_param, 5, CBOR_ABS, non_perp, 0, 20, "nonPerp"),
+    F32(mount_param, 6, CBOR_ABS, yaw_scale, 0, 0.1, "yawScale"),
+    BOOL(mount_param, 7, enable, "enable"),
+};
+static const cbor_map_t mount_map = {mount_fields, COUNT_OF(mount_fields)};
+
+// targets far from the pivot are disabled when the section is applied
+static const cbor_field_t target_fields[] = {
+    {1, CBOR_FIELD_TEXT, 0, HELIOSTAT_NAME_LEN, offsetof(heliostat_target, name), 0, 0, ANY, "name", NULL},
+    F32(heliostat_target, 2, 0, east, ANY, "east"),
+    F32(heliostat_target, 3, 0, north, ANY, "north"),
+    F32(heliostat_target, 4, 0, up, ANY, "up"),
+    NUM(heliostat_target, 5, CBOR_FIELD_U16, 0, from_min, 0, 24 * 60, "from"),
+    NUM(heliostat_target, 6, CBOR_FIELD_U16, 0, to_min, 0, 24 * 60, "to"),
+    BOOL(heliostat_target, 7, enable, "enable"),
+};
+static const cbor_map_t target_map = {target_fields, COUNT_OF(target_fields)};
+
+typedef decltype(control_settings_t::heliostat) control_heliostat_t;
+static const cbor_field_t heliostat_fields[] = {
+    F32(control_heliostat_t, 1, CBOR_HI_OPEN, param.mirror_offset_m, 0, 1, "mirrorOffset"),
+    BOOL(control_heliostat_t, 2, param.enable, "enable"),
+    // the list replaces the old one
+    {3, CBOR_FIELD_MAP_ARRAY, CBOR_REPLACE, HELIOSTAT_MAX_TARGETS, offsetof(control_heliostat_t, targets),
+     sizeof(heliostat_target), 0, ANY, "targets", &target_map},
+};
+static const cbor_map_t heliostat_map = {heliostat_fields, COUNT_OF(heliostat_fields)};
+
+static const cbor_field_t sun_fields[] = {
+    NUM(sun_param, 1, CBOR_FIELD_U8, CBOR_HI_OPEN, algo, 0, SUN_ALGO_COUNT, "algo"),
+    BOOL(sun_param, 2, refraction, "refraction"),
+    F32(sun_param, 3, CBOR_LO_OPEN | CBOR_HI_OPEN, delta_t, -100, 300, "deltaT"),
+    F32(sun_param, 4, CBOR_ABS | CBOR_HI_OPEN, temp_offset, 0, 40, "tempOffset"),
+};
+static const cbor_map_t sun_map = {sun_fields, COUNT_OF(sun_fields)};
+
+static const cbor_field_t settings_fields[] = {
+    NUM(control_settings_t, 0, CBOR_FIELD_U8, 0, version, 1, CONTROL_API_VERSION, "v"),
+    MAP(control_settings_t, 1, CONTROL_SEC_PID, pid, pid_set_map, "pid"),
+    {2, CBOR_FIELD_U8, 0, 0, offsetof(control_settings_t, mode), 0, CONTROL_SEC_MODE, 0, 2, "mode", NULL},
+    {3, CBOR_FIELD_F32, 0, 0, offsetof(control_settings_t, yaw_offset), 0, CONTROL_SEC_MODE, ANY, "yaw_offset", NULL},
+    MAP(control_settings_t, 4, CONTROL_SEC_TH, th, th_map, "th"),
+    MAP(control_settings_t, 5, CONTROL_SEC_MAN, man, man_map, "man"),
+    {6, CBOR_FIELD_MAP_ARRAY, 0, ADC_SIG_COUNT, offsetof(control_settings_t, adc), sizeof(adc_cal_t), CONTROL_SEC_ADC,
+     ANY, "adc", &adc_map},
+    {7, CBOR_FIELD_F32_ARRAY, CBOR_LO_OPEN, 2, offsetof(control_settings_t, winding_ohm), 0, CONTROL_SEC_WINDING,
+     POSITIVE, "winding", NULL},
+    {8, CBOR_FIELD_F32, 0, 0, offsetof(control_settings_t, energy_budget_wh), 0, CONTROL_SEC_ENERGY, POSITIVE,
+     "energyBudget", NULL},
+    MAP(control_settings_t, 9, CONTROL_SEC_TRACK, track, track_map, "track"),
+    MAP(control_settings_t, 10, CONTROL_SEC_WEATHER, weather, weather_map, "weather"),
+    MAP(control_settings_t, 11, CONTROL_SEC_FINE, fine, fine_map, "fine"),
+    MAP(control_settings_t, 12, CONTROL_SEC_MOUNT, mount, mount_map, "mount"),
+    MAP(control_settings_t, 13, CONTROL_SEC_HELIOSTAT, heliostat, heliostat_map, "heliostat"),
+    MAP(control_settings_t, 14, CONTROL_SEC_SUN, sun, sun_map, "sun"),
+};
+const cbor_map_t control_settings_map = {settings_fields, COUNT_OF(settings_fields)};
+
+// the same keys, for a push to the trackers of a site
+static const cbor_field_t site_fields[] = {
+    NUM(control_settings_t, 0, CBOR_FIELD_U8, 0, version, 1, CONTROL_API_VERSION, "v"),
+    MAP(control_settings_t, 9, CONTROL_SEC_TRACK, track, track_map, "track"),
+    MAP(control_settings_t, 10, CONTROL_SEC_WEATHER, weather, weather_map, "weather"),
+    MAP(control_settings_t, 11, CONTROL_SEC_FINE, fine, fine_map, "fine"),
+    MAP(control_settings_t, 14, CONTROL_SEC_SUN, sun, sun_map, "sun"),
+};
+const cbor_map_t control_site_map = {site_fields, COUNT_OF(site_fields)};
+
+static const cbor_field_t location_fields[] = {
+    NUM(control_location_t, 0, CBOR_FIELD_U8, 0, version, 1, CONTROL_API_VERSION, "v"),
+    NUM(control_location_t, 1, CBOR_FIELD_F64, 0, latitude, -90, 90, "latitude"),
+    NUM(control_location_t, 2, CBOR_FIELD_F64, 0, longitude, -180, 180, "longitude"),
+    NUM(control_location_t, 3, CBOR_FIELD_U32, 0, utc, ANY, "utctime"),
+};
+const cbor_map_t control_location_map = {location_fields, COUNT_OF(location_fields)};
+
+static const cbor_field_t sysctrl_fields[] = {
+    NUM(control_sysctrl_t, 0, CBOR_FIELD_U8, 0, version, 1, CONTROL_API_VERSION, "v"),
+    BOOL(control_sysctrl_t, 1, restart, "restart"),
+};
+const cbor_map_t control_sysctrl_map = {sysctrl_fields, COUNT_OF(sysctrl_fields)};
+
+control_status_t control_decode(const cbor_map_t *map, const uint8_t *buf, size_t len, void *doc,
+                                uint32_t *sections, int *ignored)
+{
+    // the version is the first member of every document
+    *(uint8_t *)doc = 0;
+    CborReader reader(buf, len);
+    if (!cbor_decode(reader, map, doc, sections, ignored) || !reader.done()) {
+        return CONTROL_ERR_MALFORMED;
+    }
+    if (*(uint8_t *)doc == 0) {
+        return CONTROL_ERR_VERSION;
+    }
+    return CONTROL_OK;
+}
+
+size_t control_encode(const cbor_map_t *map, void *doc, uint8_t *buf, size_t cap)
+{
+    *(uint8_t *)doc = CONTROL_API_VERSION;
+    CborWriter writer(buf, cap);
+    cbor_encode(writer, map, doc);
+    return writer.size();
+}
+
+size_t control_encode_reply(control_status_t status, const char *message, int ignored, uint8_t *buf, size_t cap)
+{
+    CborWriter writer(buf, cap);
+    writer.map(4);
+    writer.uint64(0);
+    writer.uint64(CONTROL_API_VERSION);
+    writer.uint64(1);
+    writer.uint64(status);
+    writer.uint64(2);
+    writer.text(message);
+    writer.uint64(3);
+    writer.uint64(ignored);
+    return writer.size();
+}
+
+// run test on linux, CONTROL_NO_MAIN when linked into tools/fleet
+#if defined(__linux__) && !defined(CONTROL_NO_MAIN)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <chrono>
+#include <string>
+
+/*
+ * Benchmark of the settings handlers: the CBOR command decoded into the
+ * document against its JSON twin parsed into a tree and looked up field by
+ * field, which is what cJSON_Parse() and the cJSON_GetObjectItem() chains
+ * of rest_server.cpp do. cJSON is an ESP-IDF component and is not on the
+ * host, the tree here allocates like it does: a node per value and a copy
+ * of every key and string, names compared without case.
+ *
+ *   g++ -std=c++17 -O2 -DCBOR_NO_MAIN -I.. -I../gimbal control_api.cpp cbor.cpp
+ */
+
+static int failures = 0;
+static long allocations = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        printf("  %s\n", what);
+        failures++;
+    }
+}
+
+static void *counted_malloc(size_t size)
+{
+    allocations++;
+    return malloc(size);
+}
+
+static char *counted_strndup(const char *str, size_t size)
+{
+    char *copy = (char *)counted_malloc(size + 1);
+    memcpy(copy, str, size);
+    copy[size] = '\0';
+    return copy;
+}
+
+enum { NODE_NULL, NODE_FALSE, NODE_TRUE, NODE_NUMBER, NODE_STRING, NODE_ARRAY, NODE_OBJECT };
+
+struct node {
+    node *next;
+    node *child;
+    int type;
+    char *key;
+    char *str;
+    double number;
+};
+
+static void node_free(node *n)
+{
+    while (n != nullptr) {
+        node *next = n->next;
+        node_free(n->child);
+        free(n->key);
+        free(n->str);
+        free(n);
+        n = next;
+    }
+}
+
+static const char *skip_space(const char *p)
+{
+    while (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    return p;
+}
+
+// escapes are not needed by the documents of the benchmark
+static const char *parse_string(const char *p, char **out)
+{
+    const char *end = strchr(p + 1, '"');
+    if (end == nullptr) {
+        return nullptr;
+    }
+    *out = counted_strndup(p + 1, end - p - 1);
+    return end + 1;
+}
+
+static const char *parse_value(const char *p, node **out);
+
+static const char *parse_members(const char *p, node *parent, bool object, char close)
+{
+    node **tail = &parent->child;
+    p = skip_space(p + 1);
+    if (*p == close) {
+        return p + 1;
+    }
+    while (true) {
+        char *key = nullptr;
+        if (object) {
+            p = parse_string(skip_space(p), &key);
+            if (p == nullptr || *(p = skip_space(p)) != ':') {
+                free(key);
+                return nullptr;
+            }
+            p++;
+        }
+        node *child;
+        p = parse_value(skip_space(p), &child);
+        if (p == nullptr) {
+            free(key);
+            return nullptr;
+        }
+        child->key = key;
+        *tail = child;
+        tail = &child->next;
+        p = skip_space(p);
+        if (*p == ',') {
+            p++;
+        } else if (*p == close) {
+            return p + 1;
+        } else {
+            return nullptr;
+        }
+    }
+}
+
+static const char *parse_value(const char *p, node **out)
+{
+    node *n = (node *)counted_malloc(sizeof(node));
+    memset(n, 0, sizeof(node));
+    *out = n;
+    if (*p == '{' || *p == '[') {
+        n->type = *p == '{' ? NODE_OBJECT : NODE_ARRAY;
+        return parse_members(p, n, *p == '{', *p == '{' ? '}' : ']');
+    }
+    if (*p == '"') {
+        n->type = NODE_STRING;
+        return parse_string(p, &n->str);
+    }
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0 || strncmp(p, "null", 4) == 0) {
+        n->type = *p == 't' ? NODE_TRUE : *p == 'f' ? NODE_FALSE : NODE_NULL;
+        return p + (*p == 'f' ? 5 : 4);
+    }
+    char *end;
+    n->type = NODE_NUMBER;
+    n->number = strtod(p, &end);
+    return end == p ? nullptr : end;
+}
+
+static node *json_parse(const char *text)
+{
+    node *root = nullptr;
+    if (parse_value(skip_space(text), &root) == nullptr) {
+        node_free(root);
+        return nullptr;
+    }
+    return root;
+}
+
+static node *get_item(node *object, const char *name)
+{
+    for (node *n = object ? object->child : nullptr; n != nullptr; n = n->next) {
+        if (n->key != nullptr && strcasecmp(n->key, name) == 0) {
+            return n;
+        }
+    }
+    return nullptr;
+}
+
+static node *get_index(node *array, int index)
+{
+    node *n = array->child;
+    while (n != nullptr && index-- > 0) {
+        n = n->next;
+    }
+    return n;
+}
+
+// the handlers' lookups, one per field of the table
+static void json_to_doc(node *object, const cbor_map_t *map, char *base)
+{
+    for (int f = 0; f < map->count; f++) {
+        const cbor_field_t &field = map->fields[f];
+        node *item = get_item(object, field.name);
+        char *member = base + field.offset;
+        if (item == nullptr) {
+            continue;
+        }
+        switch (field.type) {
+        case CBOR_FIELD_F32:
+            *(float *)member = item->number;
+            break;
+        case CBOR_FIELD_F64:
+            *(double *)member = item->number;
+            break;
+        case CBOR_FIELD_U8:
+            *(uint8_t *)member = item->number;
+            break;
+        case CBOR_FIELD_U16:
+            *(uint16_t *)member = item->number;
+            break;
+        case CBOR_FIELD_U32:
+            *(uint32_t *)member = item->number;
+            break;
+        case CBOR_FIELD_BOOL:
+            *(uint8_t *)member = item->type == NODE_TRUE;
+            break;
+        case CBOR_FIELD_TEXT:
+            strncpy(member, item->str, field.size - 1);
+            member[field.size - 1] = '\0';
+            break;
+        case CBOR_FIELD_F32_ARRAY:
+            for (int i = 0; i < field.size && get_index(item, i); i++) {
+                ((float *)member)[i] = get_index(item, i)->number;
+            }
+            break;
+        case CBOR_FIELD_MAP:
+            json_to_doc(item, field.map, member);
+            break;
+        case CBOR_FIELD_MAP_ARRAY:
+            for (int i = 0; i < field.size && get_index(item, i); i++) {
+                json_to_doc(get_index(item, i), field.map, member + i * field.stride);
+            }
+            break;
+        }
+    }
+}
+
+// the JSON twin of a document, with only the fields that are set in present
+static void doc_to_json(std::string &out, const cbor_map_t *map, const char *base, const uint8_t *present)
+{
+    char number[32];
+    bool first = true;
+    out += '{';
+    for (int f = 0; f < map->count; f++) {
+        const cbor_field_t &field = map->fields[f];
+        const char *member = base + field.offset;
+        if (present != nullptr && !present[f]) {
+            continue;
+        }
+        out += first ? "\"" : ",\"";
+        out += field.name;
+        out += "\":";
+        first = false;
+        switch (field.type) {
+        case CBOR_FIELD_F32:
+            snprintf(number, sizeof(number), "%.9g", *(const float *)member);
+            out += number;
+            break;
+        case CBOR_FIELD_F64:
+            snprintf(number, sizeof(number), "%.17g", *(const double *)member);
+            out += number;
+            break;
+        case CBOR_FIELD_U8:
+        case CBOR_FIELD_BOOL:
+            if (field.type == CBOR_FIELD_BOOL) {
+                out += *(const uint8_t *)member ? "true" : "false";
+            } else {
+                out += std::to_string(*(const uint8_t *)member);
+            }
+            break;
+        case CBOR_FIELD_U16:
+            out += std::to_string(*(const uint16_t *)member);
+            break;
+        case CBOR_FIELD_U32:
+            out += std::to_string(*(const uint32_t *)member);
+            break;
+        case CBOR_FIELD_TEXT:
+            out += '"';
+            out += member;
+            out += '"';
+            break;
+        case CBOR_FIELD_F32_ARRAY:
+            out += '[';
+            for (int i = 0; i < field.size; i++) {
+                snprintf(number, sizeof(number), "%s%.9g", i ? "," : "", ((const float *)member)[i]);
+                out += number;
+            }
+            out += ']';
+            break;
+        case CBOR_FIELD_MAP:
+            doc_to_json(out, field.map, member, nullptr);
+            break;
+        case CBOR_FIELD_MAP_ARRAY:
+            out += '[';
+            for (int i = 0; i < field.size; i++) {
+                if (i) {
+                    out += ',';
+                }
+                doc_to_json(out, field.map, member + i * field.stride, nullptr);
+            }
+            out += ']';
+            break;
+        }
+    }
+    out += '}';
+}
+
+// the CBOR command with only the fields that are set in present
+static size_t doc_to_cbor(uint8_t *buf, size_t cap, const control_settings_t *doc, const uint8_t *present)
+{
+    const cbor_map_t *map = &control_settings_map;
+    int count = 0;
+    for (int f = 0; f < map->count; f++) {
+        count += present[f];
+    }
+    cbor_map_t subset = {nullptr, 0};
+    cbor_field_t fields[32];
+    for (int f = 0; f < map->count; f++) {
+        if (present[f]) {
+            fields[subset.count++] = map->fields[f];
+        }
+    }
+    subset.fields = fields;
+    CborWriter writer(buf, cap);
+    cbor_encode(writer, &subset, doc);
+    return writer.size();
+}
+
+static void example(control_settings_t *doc)
+{
+    memset(doc, 0, sizeof(*doc));
+    doc->version = CONTROL_API_VERSION;
+    doc->mode = 1;
+    doc->yaw_offset = 1.25f;
+    doc->th = {13, 10};
+    doc->man = {20, 30};
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        doc->adc[i] = {0.001f * (i + 1), -0.05f * i};
+    }
+    doc->winding_ohm[0] = 2.4f;
+    doc->winding_ohm[1] = 3.1f;
+    doc->energy_budget_wh = 12.5f;
+    doc->pid[CONTROL_PID_POS] = {112, 700, 0, 0, 0, 220, 500};
+    doc->pid[CONTROL_PID_VEL] = {8, 80, 0, 0, 0, 1000, 1000};
+    doc->pid[CONTROL_PID_PITCH_POS] = {2, 4, 0, 0, 0, 1000, 700};
+    doc->pid[CONTROL_PID_PITCH_VEL] = {98, 30, 0, 0, 0, 1000, 550};
+    doc->track = {0.5f, 0.5f, 0.2f, 1, 0, 1};
+    doc->weather = {0.65f, 0.35f, 60, 300, 10, 2, 1};
+    doc->fine = {2.5f, -2.5f, 20, 0.2f, 2, 120, 1};
+    doc->mount = {0.31f, -0.12f, 0.05f, -0.08f, 0.02f, 0.0012f, 1};
+    doc->heliostat.param = {0.02f, 1};
+    for (int i = 0; i < HELIOSTAT_MAX_TARGETS; i++) {
+        heliostat_target &t = doc->heliostat.targets[i];
+        snprintf(t.name, sizeof(t.name), "window %c", (char)('A' + i));
+        t.east = 12.5f * (i + 1);
+        t.north = -3.75f * i;
+        t.up = 4.5f;
+        t.from_min = 8 * 60 + i * 120;
+        t.to_min = 10 * 60 + i * 120;
+        t.enable = 1;
+    }
+    doc->sun = {SUN_ALGO_AUTO, 1, 69, 8.5f};
+}
+
+template <typename F>
+static double ns_per_call(int loops, F f)
+{
+    double best = 1e30;
+    for (int round = 0; round < 5; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < loops; i++) {
+            f();
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        best = ns / loops < best ? ns / loops : best;
+    }
+    return best;
+}
+
+static bool same_doc(control_settings_t *a, control_settings_t *b)
+{
+    uint8_t ea[1024], eb[1024];
+    size_t na = control_encode(&control_settings_map, a, ea, sizeof(ea));
+    size_t nb = control_encode(&control_settings_map, b, eb, sizeof(eb));
+    return na == nb && na <= sizeof(ea) && memcmp(ea, eb, na) == 0;
+}
+
+int main()
+{
+    control_settings_t doc;
+    example(&doc);
+    const cbor_map_t *map = &control_settings_map;
+
+    static const struct {
+        const char *name;
+        int keys[16];   // of the top level, the version always goes
+    } commands[] = {
+        {"manual aim", {5}},
+        {"track policy", {9}},
+        {"heliostat", {13}},
+        {"all settings", {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14}},
+    };
+
+    printf("%-13s %6s %6s %10s %10s %7s %7s\n", "command", "CBOR B", "JSON B", "CBOR ns", "JSON ns", "speedup",
+           "allocs");
+    double full_speedup = 0;
+    for (const auto &command : commands) {
+        uint8_t present[32] = {1};
+        for (int key : command.keys) {
+            for (int f = 1; key && f < map->count; f++) {
+                present[f] |= map->fields[f].key == key;
+            }
+        }
+        uint8_t cbor[1024];
+        size_t cbor_size = doc_to_cbor(cbor, sizeof(cbor), &doc, present);
+        std::string json;
+        doc_to_json(json, map, (const char *)&doc, present);
+
+        control_settings_t from_cbor, from_json;
+        memset(&from_cbor, 0, sizeof(from_cbor));
+        memset(&from_json, 0, sizeof(from_json));
+        uint32_t sections = 0;
+        int ignored = 0;
+        control_status_t status = control_decode(map, cbor, cbor_size, &from_cbor, &sections, &ignored);
+        node *root = json_parse(json.c_str());
+        json_to_doc(root, map, (char *)&from_json);
+        node_free(root);
+        char what[64];
+        snprintf(what, sizeof(what), "%s: CBOR and JSON decode differently", command.name);
+        check(status == CONTROL_OK && ignored == 0 && same_doc(&from_cbor, &from_json), what);
+
+        int loops = cbor_size > 200 ? 20000 : 200000;
+        double cbor_ns = ns_per_call(loops, [&] {
+            control_settings_t target = doc;
+            uint32_t s = 0;
+            int n = 0;
+            control_decode(map, cbor, cbor_size, &target, &s, &n);
+            asm volatile("" : : "r"(&target) : "memory");
+        });
+        allocations = 0;
+        double json_ns = ns_per_call(loops, [&] {
+            control_settings_t target = doc;
+            node *tree = json_parse(json.c_str());
+            json_to_doc(tree, map, (char *)&target);
+            node_free(tree);
+            asm volatile("" : : "r"(&target) : "memory");
+        });
+        long allocs = allocations / (5L * loops);
+        printf("%-13s %6zu %6zu %10.0f %10.0f %6.1fx %7ld\n", command.name, cbor_size, json.size(), cbor_ns, json_ns,
+               json_ns / cbor_ns, allocs);
+        snprintf(what, sizeof(what), "%s: CBOR not smaller than JSON", command.name);
+        check(cbor_size < json.size(), what);
+        full_speedup = json_ns / cbor_ns;
+    }
+    check(full_speedup > 3, "decoding all settings is not 3x cheaper than the JSON tree");
+
+    // the reply, a command without a version and one from a newer client
+    uint8_t buf[128];
+    size_t size = control_encode_reply(CONTROL_OK, "ok", 2, buf, sizeof(buf));
+    check(size == 11, "size of the reply");
+    control_sysctrl_t sysctrl = {0, 0};
+    uint32_t sections = 0;
+    int ignored = 0;
+    static const uint8_t no_version[] = {0xa1, 0x01, 0xf5};
+    check(control_decode(&control_sysctrl_map, no_version, sizeof(no_version), &sysctrl, &sections, &ignored) ==
+          CONTROL_ERR_VERSION, "a command without a version");
+    static const uint8_t newer[] = {0xa3, 0x00, 0x01, 0x01, 0xf5, 0x18, 0x40, 0x63, 'n', 'e', 'w'};
+    check(control_decode(&control_sysctrl_map, newer, sizeof(newer), &sysctrl, &sections, &ignored) == CONTROL_OK &&
+          sysctrl.restart == 1, "a key from a newer client");
+    static const uint8_t trailing[] = {0xa1, 0x00, 0x01, 0x00};
+    check(control_decode(&control_sysctrl_map, trailing, sizeof(trailing), &sysctrl, &sections, &ignored) ==
+          CONTROL_ERR_MALFORMED, "bytes after the command");
+
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
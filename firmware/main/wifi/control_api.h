@@ -0,0 +1,138 @@
+/*
+   Binary control API, CBOR next to the JSON of the REST endpoints.
+
+   POST /api/v1/setting, /api/v1/location and /api/v1/sysctrl take a CBOR
+   map when sent with Content-Type: application/cbor. Its keys are the
+   small integers of the tables in control_api.cpp, which mirror the JSON
+   documents and keep the JSON name of every field. Key 0 is the protocol
+   version the client speaks, 1 up to CONTROL_API_VERSION.
+
+   The body is decoded straight into a control_settings_t (or the location
+   and sysctrl documents): no tree, no lookups by name, and floats stay
+   floats. Values out of range are ignored as in the JSON handlers and
+   counted, a malformed body changes nothing. Keys are never reused: a
+   retired field keeps its key unused and a new one takes the next free
+   key, and the device skips keys it does not know, so an older firmware
+   takes what it can of a newer client's command.
+
+   The reply to a CBOR request is the map {0: version, 1: control_status_t,
+   2: message, 3: values ignored}. GET /api/v1/setting with
+   Accept: application/cbor returns the same map the POST takes.
+
+   Nothing here depends on ESP-IDF, the __linux__ section of
+   control_api.cpp compares the cost of decoding commands with that of
+   parsing their JSON into a tree.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cbor.h"
+#include "pid.h"
+#include "tracking_policy.h"
+#include "weather_policy.h"
+#include "fine_tracker.h"
+#include "mount_model.h"
+#include "heliostat.h"
+#include "sun_engine.h"
+#include "adc.h"
+
+#define CONTROL_API_VERSION     1
+#define CONTROL_CONTENT_TYPE    "application/cbor"
+
+typedef enum {
+    CONTROL_OK,
+    CONTROL_ERR_MALFORMED,      // not CBOR, or a value of the wrong type
+    CONTROL_ERR_VERSION,        // no version, or one the firmware does not speak
+    CONTROL_ERR_TOO_LONG,
+    CONTROL_ERR_RECEIVE,
+} control_status_t;
+
+// parts of the settings a command set, each with its own side effects
+enum {
+    CONTROL_SEC_MODE        = 1 << 0,   // mode, yaw offset
+    CONTROL_SEC_TH          = 1 << 1,
+    CONTROL_SEC_MAN         = 1 << 2,
+    CONTROL_SEC_ADC         = 1 << 3,
+    CONTROL_SEC_WINDING     = 1 << 4,
+    CONTROL_SEC_ENERGY      = 1 << 5,
+    CONTROL_SEC_PID         = 1 << 6,
+    CONTROL_SEC_TRACK       = 1 << 7,
+    CONTROL_SEC_WEATHER     = 1 << 8,
+    CONTROL_SEC_FINE        = 1 << 9,
+    CONTROL_SEC_MOUNT       = 1 << 10,
+    CONTROL_SEC_HELIOSTAT   = 1 << 11,
+    CONTROL_SEC_SUN         = 1 << 12,
+};
+
+enum {
+    CONTROL_PID_POS,
+    CONTROL_PID_VEL,
+    CONTROL_PID_PITCH_POS,
+    CONTROL_PID_PITCH_VEL,
+    CONTROL_PID_COUNT,
+};
+
+// the settings a client may write, in the shape of the JSON document
+typedef struct {
+    uint8_t version;                // first member of every document
+    uint8_t mode;                   // MODE_MANUAL, MODE_TOWARD, MODE_REFLECT
+    float yaw_offset;
+    struct {
+        float vol_max;
+        float vol_min;
+    } th;
+    struct {
+        float pitch;
+        float yaw;
+    } man;
+    adc_cal_t adc[ADC_SIG_COUNT];
+    float winding_ohm[2];
+    float energy_budget_wh;
+    struct pid_param pid[CONTROL_PID_COUNT];
+    struct track_param track;
+    struct weather_param weather;
+    struct fine_param fine;
+    struct mount_param mount;
+    struct {
+        struct heliostat_param param;
+        struct heliostat_target targets[HELIOSTAT_MAX_TARGETS];
+    } heliostat;
+    struct sun_param sun;
+} control_settings_t;
+
+typedef struct {
+    uint8_t version;
+    double latitude;
+    double longitude;
+    uint32_t utc;                   // unix time
+} control_location_t;
+
+typedef struct {
+    uint8_t version;
+    uint8_t restart;
+} control_sysctrl_t;
+
+extern const cbor_map_t control_settings_map;
+extern const cbor_map_t control_location_map;
+extern const cbor_map_t control_sysctrl_map;
+// the site wide part of the settings (tracking, weather, fine tracking, sun), see fleet.h
+extern const cbor_map_t control_site_map;
+
+/**
+ * @brief Decode a command into doc, which holds the current values
+ *
+ * The version of doc is set from the command. Call it on a copy: doc is
+ * partly written when the command turns out malformed.
+ * @param sections or'ed with the CONTROL_SEC_ of every field set
+ * @param ignored values out of range
+ */
+control_status_t control_decode(const cbor_map_t *map, const uint8_t *buf, size_t len, void *doc,
+                                uint32_t *sections, int *ignored);
+
+/**
+ * @brief Encode doc with the current version, returns the size it takes even when larger than cap
+ */
+size_t control_encode(const cbor_map_t *map, void *doc, uint8_t *buf, size_t cap);
+
+size_t control_encode_reply(control_status_t status, const char *message, int ignored, uint8_t *buf, size_t cap);
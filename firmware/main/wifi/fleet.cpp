@@ -0,0 +1,795 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fleet.h"
+#include "ephemeris_table.h"
+#include "crc32.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#else
+#include <stdio.h>
+#include <math.h>
+#include <mutex>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "mdns.h"
+#include "rest_server.h"
+#include "energy.h"
+#include "setting.h"
+
+static const char *TAG = "fleet";
+#endif
+
+int64_t fleet_now_ms()
+{
+#ifdef __linux__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+#else
+    return esp_timer_get_time() / 1000;
+#endif
+}
+
+size_t fleet_packet(uint8_t *buf, fleet_packet_t type, uint16_t site, uint32_t push, const void *body, size_t size)
+{
+    fleet_header_t header = {FLEET_MAGIC, FLEET_VERSION, (uint8_t)type, site, push};
+    memcpy(buf, &header, sizeof(header));
+    if (size > 0) {
+        memcpy(buf + sizeof(header), body, size);
+    }
+    return sizeof(header) + size;
+}
+
+bool fleet_parse(const uint8_t *buf, size_t len, uint16_t site, fleet_header_t *header)
+{
+    if (len < sizeof(fleet_header_t)) {
+        return false;
+    }
+    memcpy(header, buf, sizeof(*header));
+    return header->magic == FLEET_MAGIC && header->version == FLEET_VERSION && header->site == site;
+}
+
+bool fleet_check_ephemeris(const uint8_t *data, size_t size)
+{
+    ephemeris_table_header_t header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    size_t days = header.days * sizeof(ephemeris_day_t);
+    return header.magic == EPHEMERIS_TABLE_MAGIC && header.version == EPHEMERIS_TABLE_VERSION && header.days > 0 &&
+           size == sizeof(header) + days && crc32_le(0, data + sizeof(header), days) == header.crc;
+}
+
+int fleet_socket(bool join, uint32_t iface)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef __linux__
+    // simulated trackers share the port, and hear the group over loopback
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one));
+#endif
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(join ? FLEET_PORT : 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    struct in_addr local = {};
+    local.s_addr = iface;
+    uint8_t ttl = 1;
+    bool ok = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+              setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == 0 &&
+              setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == 0;
+    if (ok && join) {
+        struct ip_mreq mreq = {};
+        mreq.imr_multiaddr.s_addr = inet_addr(FLEET_GROUP);
+        mreq.imr_interface.s_addr = iface;
+        ok = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+    }
+    if (!ok) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool fleet_send(int sock, const uint8_t *buf, size_t len, uint32_t addr, uint16_t port)
+{
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = addr != 0 ? addr : inet_addr(FLEET_GROUP);
+    to.sin_port = addr != 0 ? port : htons(FLEET_PORT);
+    return sendto(sock, buf, len, 0, (struct sockaddr *)&to, sizeof(to)) == (ssize_t)len;
+}
+
+int fleet_receive(int sock, uint8_t *buf, size_t cap, int wait_ms, uint32_t *addr, uint16_t *port)
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    struct timeval tv = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+    int ready = select(sock + 1, &fds, NULL, NULL, &tv);
+    if (ready <= 0) {
+        return ready;
+    }
+    struct sockaddr_in from = {};
+    socklen_t from_len = sizeof(from);
+    int len = recvfrom(sock, buf, cap, 0, (struct sockaddr *)&from, &from_len);
+    if (len < 0) {
+        return -1;
+    }
+    *addr = from.sin_addr.s_addr;
+    *port = from.sin_port;
+    return len;
+}
+
+FleetPush::~FleetPush()
+{
+    free(blob);
+}
+
+void FleetPush::begin(uint32_t id)
+{
+    free(blob);
+    blob = nullptr;
+    blob_size = 0;
+    push_id = id;
+    crc = 0;
+    chunks = 0;
+}
+
+bool FleetPush::add(fleet_item_t type, const void *data, size_t size)
+{
+    size_t padded = (size + 3) & ~(size_t)3;
+    size_t total = blob_size + sizeof(fleet_item_head_t) + padded;
+    if (total > FLEET_MAX_CHUNKS * FLEET_CHUNK_SIZE) {
+        return false;
+    }
+    uint8_t *grown = (uint8_t *)realloc(blob, total);
+    if (grown == nullptr) {
+        return false;
+    }
+    blob = grown;
+    fleet_item_head_t head = {(uint8_t)type, {0, 0, 0}, (uint32_t)size};
+    uint8_t *p = blob + blob_size;
+    memcpy(p, &head, sizeof(head));
+    memcpy(p + sizeof(head), data, size);
+    memset(p + sizeof(head) + size, 0, padded - size);
+    blob_size = total;
+    return true;
+}
+
+bool FleetPush::finish()
+{
+    chunks = (blob_size + FLEET_CHUNK_SIZE - 1) / FLEET_CHUNK_SIZE;
+    crc = crc32_le(0, blob, blob_size);
+    return chunks > 0;
+}
+
+size_t FleetPush::packet(int index, uint16_t site, uint8_t *buf) const
+{
+    size_t offset = index * FLEET_CHUNK_SIZE;
+    size_t length = blob_size - offset < FLEET_CHUNK_SIZE ? blob_size - offset : FLEET_CHUNK_SIZE;
+    fleet_chunk_t chunk = {(uint32_t)blob_size, crc, (uint8_t)index, (uint8_t)chunks, (uint16_t)length};
+    size_t size = fleet_packet(buf, FLEET_PKT_CHUNK, site, push_id, &chunk, sizeof(chunk));
+    memcpy(buf + size, blob + offset, length);
+    return size + length;
+}
+
+FleetReceiver::~FleetReceiver()
+{
+    free(blob);
+}
+
+FleetReceiver::rx_t FleetReceiver::feed(uint32_t push, const uint8_t *body, size_t len)
+{
+    // repairs for the others of a push already handled
+    if (push == 0 || push == last || len < sizeof(fleet_chunk_t)) {
+        return RX_IGNORED;
+    }
+    fleet_chunk_t chunk;
+    memcpy(&chunk, body, sizeof(chunk));
+    size_t offset = chunk.index * FLEET_CHUNK_SIZE;
+    if (chunk.count == 0 || chunk.count > FLEET_MAX_CHUNKS || chunk.index >= chunk.count ||
+            chunk.size > chunk.count * FLEET_CHUNK_SIZE || chunk.size <= (chunk.count - 1u) * FLEET_CHUNK_SIZE) {
+        return RX_IGNORED;
+    }
+    size_t expect = chunk.size - offset < FLEET_CHUNK_SIZE ? chunk.size - offset : FLEET_CHUNK_SIZE;
+    if (chunk.length != expect || len - sizeof(chunk) < expect) {
+        return RX_IGNORED;
+    }
+    if (blob == nullptr || push != push_id || chunk.size != size || chunk.crc != crc) {
+        // a newer push replaces the one in progress
+        free(blob);
+        blob = (uint8_t *)malloc(chunk.size);
+        if (blob == nullptr) {
+            return RX_IGNORED;
+        }
+        push_id = push;
+        size = chunk.size;
+        crc = chunk.crc;
+        count = chunk.count;
+        have = 0;
+    }
+    if (have & (1u << chunk.index)) {
+        return RX_PROGRESS;
+    }
+    memcpy(blob + offset, body + sizeof(chunk), expect);
+    have |= 1u << chunk.index;
+    if (have != full()) {
+        return RX_PROGRESS;
+    }
+    if (crc32_le(0, blob, size) != crc) {
+        have = 0;
+        return RX_BROKEN;
+    }
+    return RX_COMPLETE;
+}
+
+bool FleetReceiver::item(fleet_item_t type, const uint8_t **data, size_t *item_size) const
+{
+    if (!is_complete()) {
+        return false;
+    }
+    size_t offset = 0;
+    while (offset + sizeof(fleet_item_head_t) <= size) {
+        fleet_item_head_t head;
+        memcpy(&head, blob + offset, sizeof(head));
+        offset += sizeof(head);
+        if (head.size > size - offset) {
+            return false;
+        }
+        if (head.type == type) {
+            *data = blob + offset;
+            *item_size = head.size;
+            return true;
+        }
+        offset += (head.size + 3) & ~(uint32_t)3;
+    }
+    return false;
+}
+
+void FleetReceiver::handled(bool applied)
+{
+    last = push_id;
+    rejected = !applied;
+    free(blob);
+    blob = nullptr;
+}
+
+void FleetTracker::init(const uint8_t tracker_id[6], uint16_t tracker_site, int64_t now_ms)
+{
+    memcpy(id, tracker_id, sizeof(id));
+    site = tracker_site;
+    random = 2166136261u;
+    for (int i = 0; i < 6; i++) {
+        random = (random ^ id[i]) * 16777619u;
+    }
+    random |= 1;
+    next_ms = now_ms;
+}
+
+void FleetTracker::reply_soon(int64_t now_ms)
+{
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    int64_t at = now_ms + random % FLEET_REPLY_JITTER_MS;
+    if (at < next_ms) {
+        next_ms = at;
+    }
+}
+
+FleetReceiver::rx_t FleetTracker::receive(const uint8_t *buf, size_t len, uint32_t addr, uint16_t port,
+                                          int64_t now_ms)
+{
+    fleet_header_t header;
+    if (!fleet_parse(buf, len, site, &header) ||
+            (header.type != FLEET_PKT_BEACON && header.type != FLEET_PKT_CHUNK)) {
+        return FleetReceiver::RX_IGNORED;
+    }
+    coordinator_addr = addr;
+    coordinator_port = port;
+    if (header.type == FLEET_PKT_BEACON) {
+        reply_soon(now_ms);
+        return FleetReceiver::RX_IGNORED;
+    }
+    FleetReceiver::rx_t result = rx.feed(header.push, buf + sizeof(header), len - sizeof(header));
+    if (result == FleetReceiver::RX_PROGRESS) {
+        // the last chunks of a burst may be the ones lost, tell after a while
+        chunk_ms = now_ms;
+        stall_ms = now_ms + FLEET_STALL_MS;
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        stall_ms += random % FLEET_REPLY_JITTER_MS;
+    } else if (result == FleetReceiver::RX_BROKEN) {
+        reply_soon(now_ms);
+    }
+    return result;
+}
+
+void FleetTracker::handled(bool applied, int64_t now_ms)
+{
+    rx.handled(applied);
+    reply_soon(now_ms);
+}
+
+bool FleetTracker::heartbeat_due(int64_t now_ms, int *wait_ms) const
+{
+    if (coordinator_addr == 0) {
+        *wait_ms = FLEET_HEARTBEAT_MS;
+        return false;
+    }
+    int64_t due = next_ms;
+    if (rx.get_receiving() != 0 && stall_ms < due) {
+        due = stall_ms;
+    }
+    if (due <= now_ms) {
+        *wait_ms = 0;
+        return true;
+    }
+    *wait_ms = due - now_ms;
+    return false;
+}
+
+size_t FleetTracker::heartbeat(fleet_heartbeat_t *hb, uint8_t *buf, int64_t now_ms, uint32_t *addr, uint16_t *port)
+{
+    if (coordinator_addr == 0) {
+        return 0;
+    }
+    memcpy(hb->id, id, sizeof(hb->id));
+    hb->flags &= ~FLEET_HB_REJECTED;
+    if (rx.get_rejected()) {
+        hb->flags |= FLEET_HB_REJECTED;
+    }
+    hb->handled = rx.get_handled();
+    hb->receiving = rx.get_receiving();
+    hb->have = rx.get_have();
+    hb->seq = ++seq;
+    next_ms = now_ms + FLEET_HEARTBEAT_MS;
+    // ask again if the repair does not come
+    stall_ms = now_ms + 2 * FLEET_REPAIR_MS;
+    *addr = coordinator_addr;
+    *port = coordinator_port;
+    return fleet_packet(buf, FLEET_PKT_HEARTBEAT, site, hb->receiving, hb, sizeof(*hb));
+}
+
+fleet_member_t *FleetRoster::find(const uint8_t id[6])
+{
+    for (int i = 0; i < members_count; i++) {
+        if (memcmp(members[i].id, id, sizeof(members[i].id)) == 0) {
+            return &members[i];
+        }
+    }
+    if (members_count == FLEET_MAX_TRACKERS) {
+        return nullptr;
+    }
+    fleet_member_t *m = &members[members_count++];
+    memset(m, 0, sizeof(*m));
+    memcpy(m->id, id, sizeof(m->id));
+    return m;
+}
+
+fleet_member_t *FleetRoster::discover(const uint8_t id[6], uint32_t addr)
+{
+    fleet_member_t *m = find(id);
+    if (m != nullptr) {
+        m->discovered = true;
+        m->addr = addr;
+    }
+    return m;
+}
+
+fleet_member_t *FleetRoster::heartbeat(const fleet_heartbeat_t &hb, uint32_t addr, int64_t now_ms)
+{
+    fleet_member_t *m = find(hb.id);
+    if (m != nullptr) {
+        m->addr = addr;
+        m->seen_ms = now_ms;
+        m->heartbeats++;
+        m->last = hb;
+    }
+    return m;
+}
+
+uint32_t FleetRoster::missing(const FleetPush &push, int64_t since_ms, int64_t now_ms) const
+{
+    uint32_t missed = 0;
+    for (int i = 0; i < members_count; i++) {
+        const fleet_member_t &m = members[i];
+        // what the others say of the push is from before it
+        if (!is_online(m, now_ms) || m.seen_ms < since_ms || m.last.handled == push.id()) {
+            continue;
+        }
+        missed |= m.last.receiving == push.id() ? push.all() & ~m.last.have : push.all();
+    }
+    return missed;
+}
+
+void FleetRoster::count(uint32_t push, int64_t now_ms, int *online, int *handled, int *rejected) const
+{
+    *online = *handled = *rejected = 0;
+    for (int i = 0; i < members_count; i++) {
+        const fleet_member_t &m = members[i];
+        if (!is_online(m, now_ms)) {
+            continue;
+        }
+        (*online)++;
+        if (m.last.handled == push) {
+            (*handled)++;
+            if (m.last.flags & FLEET_HB_REJECTED) {
+                (*rejected)++;
+            }
+        }
+    }
+}
+
+void FleetCoordinator::init(uint16_t coordinator_site, int beacon)
+{
+    site = coordinator_site;
+    beacon_period = beacon;
+    beacon_ms = 0;
+}
+
+void FleetCoordinator::start(int64_t now_ms)
+{
+    counters.bursts++;
+    started_ms = now_ms;
+    repair_ms = now_ms + FLEET_REPAIR_MS;
+    sending = current.all();
+}
+
+void FleetCoordinator::receive(const uint8_t *buf, size_t len, uint32_t addr, int64_t now_ms)
+{
+    fleet_header_t header;
+    fleet_heartbeat_t hb;
+    if (!fleet_parse(buf, len, site, &header) || header.type != FLEET_PKT_HEARTBEAT ||
+            len < sizeof(header) + sizeof(hb)) {
+        return;
+    }
+    memcpy(&hb, buf + sizeof(header), sizeof(hb));
+    members.heartbeat(hb, addr, now_ms);
+    counters.heartbeats++;
+}
+
+size_t FleetCoordinator::poll(uint8_t *buf, int64_t now_ms)
+{
+    if (sending == 0 && current.count() > 0 && now_ms >= repair_ms) {
+        repair_ms = now_ms + FLEET_REPAIR_MS;
+        sending = members.missing(current, started_ms, now_ms);
+        if (sending != 0) {
+            counters.repairs++;
+        }
+    }
+    if (sending != 0) {
+        int index = __builtin_ctz(sending);
+        sending &= sending - 1;
+        size_t size = current.packet(index, site, buf);
+        counters.chunks++;
+        counters.bytes += size;
+        return size;
+    }
+    if (now_ms >= beacon_ms) {
+        beacon_ms = now_ms + beacon_period;
+        counters.beacons++;
+        size_t size = fleet_packet(buf, FLEET_PKT_BEACON, site, current.id(), NULL, 0);
+        counters.bytes += size;
+        return size;
+    }
+    return 0;
+}
+
+#ifndef __linux__
+
+#define FLEET_TASK_STACK        4096
+#define FLEET_TASK_PRIORITY     4
+#define FLEET_DISCOVER_MS       3000            // mDNS query
+#define FLEET_REDISCOVER_MS     (10 * 60 * 1000)
+#define FLEET_RETRY_MS          5000            // no address to join the group yet
+
+#define FLEET_TABLE_PATH        CONFIG_EXAMPLE_WEB_MOUNT_POINT "/" EPHEMERIS_TABLE_FILE
+
+#if CONFIG_FLEET_ROLE_COORDINATOR
+#define FLEET_ROLE_NAME         "coordinator"
+#else
+#define FLEET_ROLE_NAME         "tracker"
+#endif
+
+static uint8_t s_id[6];
+static uint8_t s_datagram[FLEET_DATAGRAM_MAX];
+
+#if CONFIG_FLEET_ROLE_TRACKER
+
+static void tracker_status(fleet_heartbeat_t *hb)
+{
+    static energy_bucket_t days[ENERGY_DAYS];
+    time_t now;
+    time(&now);
+    const gps_t &gps = gimbal.gps->getData();
+    ephemeris_day_t day;
+    time_t day_start;
+
+    hb->state = gimbal.getState();
+    hb->flags = 0;
+    if (gps.valid) {
+        hb->flags |= FLEET_HB_GPS;
+    }
+    if (gimbal.isSunUp()) {
+        hb->flags |= FLEET_HB_SUN_UP;
+    }
+    if (gimbal.yawMotor->get_fault() != STALL_NONE || gimbal.pitchMotor->get_fault() != STALL_NONE) {
+        hb->flags |= FLEET_HB_FAULT;
+    }
+    if (ephemeris_table_day(now, gps.latitude, gps.longitude, &day, &day_start)) {
+        hb->flags |= FLEET_HB_TABLE;
+    }
+    if (energy_over_budget()) {
+        hb->flags |= FLEET_HB_BUDGET;
+    }
+    hb->uptime_s = esp_timer_get_time() / 1000000;
+    const ephemeris_table_header_t *table = ephemeris_table_header();
+    hb->table_crc = table != NULL ? table->crc : 0;
+    hb->yaw = fmaxf(-32767, fminf(32767, roundf(gimbal.yawMotor->get_position() * 10)));
+    hb->pitch = fmaxf(-32767, fminf(32767, roundf(gimbal.pitchMotor->get_position() * 10)));
+    hb->error = fminf(65535, roundf(gimbal.getTrackingPolicy().get_error() * 100));
+    hb->supply_mv = fmaxf(0, fminf(65535, roundf(gimbal.voltage * 1000)));
+    int count = energy_get_days(days, ENERGY_DAYS);
+    hb->energy_wh = count > 0 ? fminf(65535, roundf(energy_bucket_wh(&days[count - 1]) * 10)) : 0;
+}
+
+static bool write_table(const uint8_t *data, size_t size)
+{
+    ephemeris_table_header_t header;
+    memcpy(&header, data, sizeof(header));
+    const ephemeris_table_header_t *loaded = ephemeris_table_header();
+    if (loaded != NULL && loaded->crc == header.crc) {
+        return true;
+    }
+    FILE *f = fopen(FLEET_TABLE_PATH ".new", "wb");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = fwrite(data, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+    if (ok) {
+        remove(FLEET_TABLE_PATH);
+        ok = rename(FLEET_TABLE_PATH ".new", FLEET_TABLE_PATH) == 0;
+    }
+    if (ok) {
+        gimbal.reloadEphemeris();
+    }
+    return ok;
+}
+
+static bool tracker_apply(FleetReceiver &rx)
+{
+    const uint8_t *data;
+    size_t size;
+    bool ok = true;
+    if (rx.item(FLEET_ITEM_EPHEMERIS, &data, &size)) {
+        ok = fleet_check_ephemeris(data, size) && write_table(data, size);
+        ESP_LOGI(TAG, "ephemeris table of %u bytes %s", (unsigned)size, ok ? "applied" : "rejected");
+    }
+    if (ok && rx.item(FLEET_ITEM_SETTINGS, &data, &size)) {
+        int ignored = 0;
+        control_status_t status = rest_apply_settings(data, size, &ignored);
+        ok = status == CONTROL_OK;
+        ESP_LOGI(TAG, "settings of %u bytes %s, %d values ignored", (unsigned)size, ok ? "applied" : "rejected", ignored);
+    }
+    return ok;
+}
+
+static void tracker_task(void *pvParameters)
+{
+    FleetTracker tracker;
+    tracker.init(s_id, CONFIG_FLEET_SITE, fleet_now_ms());
+    int sock;
+    while ((sock = fleet_socket(true, htonl(INADDR_ANY))) < 0) {
+        vTaskDelay(pdMS_TO_TICKS(FLEET_RETRY_MS));
+    }
+    ESP_LOGI(TAG, "tracker of site %d, listening on " FLEET_GROUP ":%d", CONFIG_FLEET_SITE, FLEET_PORT);
+    while (1) {
+        int wait_ms;
+        if (tracker.heartbeat_due(fleet_now_ms(), &wait_ms)) {
+            fleet_heartbeat_t hb = {};
+            tracker_status(&hb);
+            uint32_t addr;
+            uint16_t port;
+            size_t size = tracker.heartbeat(&hb, s_datagram, fleet_now_ms(), &addr, &port);
+            fleet_send(sock, s_datagram, size, addr, port);
+            continue;
+        }
+        uint32_t addr;
+        uint16_t port;
+        int len = fleet_receive(sock, s_datagram, sizeof(s_datagram), wait_ms, &addr, &port);
+        if (len <= 0) {
+            continue;
+        }
+        FleetReceiver::rx_t result = tracker.receive(s_datagram, len, addr, port, fleet_now_ms());
+        if (result == FleetReceiver::RX_COMPLETE) {
+            ESP_LOGI(TAG, "push %" PRIu32 " received", tracker.receiver().get_receiving());
+            tracker.handled(tracker_apply(tracker.receiver()), fleet_now_ms());
+        } else if (result == FleetReceiver::RX_BROKEN) {
+            ESP_LOGW(TAG, "push with a wrong crc, collecting it again");
+        }
+    }
+}
+#endif
+
+#if CONFIG_FLEET_ROLE_COORDINATOR
+
+static std::mutex s_lock;
+static FleetCoordinator s_coordinator;
+static volatile bool s_push_pending = true;
+
+static void coordinator_discover()
+{
+    mdns_result_t *results = NULL;
+    if (mdns_query_ptr(FLEET_MDNS_SERVICE, FLEET_MDNS_PROTO, FLEET_DISCOVER_MS, FLEET_MAX_TRACKERS, &results) != ESP_OK) {
+        return;
+    }
+    int found = 0;
+    for (mdns_result_t *r = results; r != NULL; r = r->next) {
+        uint8_t id[6];
+        bool has_id = false;
+        for (size_t i = 0; i < r->txt_count; i++) {
+            if (strcmp(r->txt[i].key, "id") == 0 && r->txt[i].value != NULL &&
+                    sscanf(r->txt[i].value, "%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", &id[0], &id[1], &id[2], &id[3], &id[4],
+                           &id[5]) == 6) {
+                has_id = true;
+            }
+        }
+        uint32_t addr = 0;
+        for (mdns_ip_addr_t *a = r->addr; a != NULL; a = a->next) {
+            if (a->addr.type == ESP_IPADDR_TYPE_V4) {
+                addr = a->addr.u_addr.ip4.addr;
+            }
+        }
+        if (!has_id || memcmp(id, s_id, sizeof(id)) == 0) {
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(s_lock);
+        s_coordinator.roster().discover(id, addr);
+        found++;
+    }
+    mdns_query_results_free(results);
+    ESP_LOGI(TAG, "%d trackers found", found);
+}
+
+static bool coordinator_build(FleetPush &push)
+{
+    static uint32_t last_id = 0;
+    uint32_t id = time(NULL);
+    last_id = id > last_id ? id : last_id + 1;
+    push.begin(last_id);
+
+    // the table of this node, it is on the same site
+    FILE *f = fopen(FLEET_TABLE_PATH, "rb");
+    if (f != NULL) {
+        size_t cap = FLEET_MAX_CHUNKS * FLEET_CHUNK_SIZE;
+        uint8_t *table = (uint8_t *)malloc(cap);
+        size_t size = table != NULL ? fread(table, 1, cap, f) : 0;
+        if (fleet_check_ephemeris(table, size)) {
+            push.add(FLEET_ITEM_EPHEMERIS, table, size);
+        } else {
+            ESP_LOGW(TAG, "%s is not a valid table, pushing the settings only", FLEET_TABLE_PATH);
+        }
+        free(table);
+        fclose(f);
+    }
+    uint8_t settings[512];
+    size_t size = rest_encode_site_settings(settings, sizeof(settings));
+    if (size <= sizeof(settings)) {
+        push.add(FLEET_ITEM_SETTINGS, settings, size);
+    }
+    return push.finish();
+}
+
+static void coordinator_task(void *pvParameters)
+{
+    int sock;
+    while ((sock = fleet_socket(false, htonl(INADDR_ANY))) < 0) {
+        vTaskDelay(pdMS_TO_TICKS(FLEET_RETRY_MS));
+    }
+    s_coordinator.init(CONFIG_FLEET_SITE);
+    int64_t discover_ms = 0;
+    while (1) {
+        int64_t now = fleet_now_ms();
+        if (now >= discover_ms) {
+            coordinator_discover();
+            discover_ms = fleet_now_ms() + FLEET_REDISCOVER_MS;
+        }
+        {
+            std::lock_guard<std::mutex> guard(s_lock);
+            if (s_push_pending) {
+                s_push_pending = false;
+                if (coordinator_build(s_coordinator.push())) {
+                    s_coordinator.start(now);
+                    ESP_LOGI(TAG, "push %" PRIu32 ": %u bytes in %d chunks", s_coordinator.push().id(),
+                             (unsigned)s_coordinator.push().size(), s_coordinator.push().count());
+                }
+            }
+            size_t size;
+            while ((size = s_coordinator.poll(s_datagram, now)) > 0) {
+                fleet_send(sock, s_datagram, size, 0, 0);
+            }
+        }
+        uint32_t addr;
+        uint16_t port;
+        int len = fleet_receive(sock, s_datagram, sizeof(s_datagram), 100, &addr, &port);
+        if (len > 0) {
+            std::lock_guard<std::mutex> guard(s_lock);
+            s_coordinator.receive(s_datagram, len, addr, fleet_now_ms());
+        }
+    }
+}
+#endif
+
+esp_err_t fleet_push(void)
+{
+#if CONFIG_FLEET_ROLE_COORDINATOR
+    s_push_pending = true;
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int fleet_get_roster(fleet_member_t *dst, int max_count, uint32_t *push, fleet_stats_t *stats)
+{
+#if CONFIG_FLEET_ROLE_COORDINATOR
+    std::lock_guard<std::mutex> guard(s_lock);
+    FleetRoster &roster = s_coordinator.roster();
+    int count = roster.size() < max_count ? roster.size() : max_count;
+    for (int i = 0; i < count; i++) {
+        dst[i] = roster.at(i);
+    }
+    *push = s_coordinator.push().id();
+    s_coordinator.get_stats(stats);
+    return count;
+#else
+    *push = 0;
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+#endif
+}
+
+void fleet_init(void)
+{
+#if CONFIG_FLEET_ROLE_TRACKER || CONFIG_FLEET_ROLE_COORDINATOR
+    esp_read_mac(s_id, ESP_MAC_WIFI_STA);
+    char id[13], site[8], instance[24];
+    snprintf(id, sizeof(id), "%02x%02x%02x%02x%02x%02x", s_id[0], s_id[1], s_id[2], s_id[3], s_id[4], s_id[5]);
+    snprintf(site, sizeof(site), "%d", CONFIG_FLEET_SITE);
+    snprintf(instance, sizeof(instance), "tracker-%s", id);
+    mdns_txt_item_t txt[] = {
+        {"id", id},
+        {"site", site},
+        {"role", FLEET_ROLE_NAME},
+    };
+    ESP_ERROR_CHECK(mdns_service_add(instance, FLEET_MDNS_SERVICE, FLEET_MDNS_PROTO, FLEET_PORT, txt,
+                                     sizeof(txt) / sizeof(txt[0])));
+#endif
+#if CONFIG_FLEET_ROLE_TRACKER
+    xTaskCreate(tracker_task, "fleet", FLEET_TASK_STACK, NULL, FLEET_TASK_PRIORITY, NULL);
+#elif CONFIG_FLEET_ROLE_COORDINATOR
+    xTaskCreate(coordinator_task, "fleet", FLEET_TASK_STACK, NULL, FLEET_TASK_PRIORITY, NULL);
+#endif
+}
+#endif
@@ -0,0 +1,409 @@
+/*
+   Fleet mode, one coordinator for the trackers of a site.
+
+   The coordinator is a tracker built with FLEET_ROLE_COORDINATOR or
+   tools/fleet on a host. It finds the trackers by their mDNS service
+   FLEET_MDNS_SERVICE and pushes them the ephemeris table of
+   tools/ephemeris and the site settings at once: one burst of UDP
+   datagrams to the group FLEET_GROUP. A push is a blob of items cut into
+   chunks of FLEET_CHUNK_SIZE. Every chunk carries the size and crc of the
+   whole blob, so a tracker starts collecting from whichever chunk it gets
+   first.
+
+   The trackers learn the address of the coordinator from its datagrams and
+   send it a heartbeat, a fleet_heartbeat_t, every FLEET_HEARTBEAT_MS. They
+   also answer a beacon, a push they have handled, and a push that stalls
+   short of complete, after a random delay of up to FLEET_REPLY_JITTER_MS so
+   that dozens of them do not answer in the same millisecond. A heartbeat
+   has a bit per chunk of the push being collected. Every FLEET_REPAIR_MS
+   the coordinator sends again the chunks some tracker misses, rather than
+   the whole burst. Wi-Fi multicast has no acknowledgement and goes at the
+   lowest rate, a chunk or two lost per tracker is normal. A tracker that
+   joins later is repaired the same way, the coordinator keeps the last
+   push until it makes the next one.
+
+   Datagrams are a fleet_header_t and a body, the structs as they are in
+   memory, little endian. Like the REST API there is no authentication, the
+   site number keeps two fleets on one network apart.
+
+   The protocol classes do not depend on ESP-IDF: tools/fleet runs them on
+   a host, with many trackers simulated on one machine.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLEET_VERSION           1
+#define FLEET_MAGIC             0x54454c46  // "FLET"
+#define FLEET_PORT              47800
+#define FLEET_GROUP             "239.255.47.80"
+#define FLEET_MDNS_SERVICE      "_suntracker"
+#define FLEET_MDNS_PROTO        "_udp"
+
+#define FLEET_CHUNK_SIZE        1024
+#define FLEET_MAX_CHUNKS        32          // bits of a heartbeat, a push is 32 KB at most
+#define FLEET_MAX_TRACKERS      64
+#define FLEET_DATAGRAM_MAX      (sizeof(fleet_header_t) + sizeof(fleet_chunk_t) + FLEET_CHUNK_SIZE)
+
+#define FLEET_HEARTBEAT_MS      10000
+#define FLEET_REPLY_JITTER_MS   500
+#define FLEET_STALL_MS          300         // without a chunk, a push in progress has stalled
+#define FLEET_REPAIR_MS         1000
+#define FLEET_BEACON_MS         30000
+#define FLEET_OFFLINE_MS        (3 * FLEET_HEARTBEAT_MS + FLEET_REPLY_JITTER_MS)
+
+typedef enum {
+    FLEET_PKT_BEACON = 1,       // to the group, no body: heartbeat to the sender
+    FLEET_PKT_CHUNK,            // to the group, a fleet_chunk_t and its data
+    FLEET_PKT_HEARTBEAT,        // to the coordinator, a fleet_heartbeat_t
+} fleet_packet_t;
+
+typedef enum {
+    FLEET_ITEM_EPHEMERIS = 1,   // ephemeris.bin
+    FLEET_ITEM_SETTINGS,        // a settings command of control_api.h
+} fleet_item_t;
+
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;               // fleet_packet_t
+    uint16_t site;
+    uint32_t push;              // id of the push, for beacons the current one, 0 for none
+} fleet_header_t;
+
+typedef struct {
+    uint32_t size;              // of the blob
+    uint32_t crc;               // of the blob, as esp_rom_crc32_le(0, ...)
+    uint8_t index;
+    uint8_t count;
+    uint16_t length;            // of the data of this chunk
+} fleet_chunk_t;
+
+// the blob is a list of items, each a head and size bytes, padded to 4
+typedef struct {
+    uint8_t type;               // fleet_item_t
+    uint8_t reserved[3];
+    uint32_t size;
+} fleet_item_head_t;
+
+#define FLEET_HB_GPS            0x01    // GPS fix
+#define FLEET_HB_SUN_UP         0x02    // following the sun, not parked
+#define FLEET_HB_FAULT          0x04    // a motor stalled or lost its encoder
+#define FLEET_HB_TABLE          0x08    // has an ephemeris table for its location
+#define FLEET_HB_BUDGET         0x10    // over the daily motor energy budget
+#define FLEET_HB_REJECTED       0x20    // the push handled was broken or not applied
+
+typedef struct {
+    uint8_t id[6];              // station MAC
+    uint8_t state;              // SysState
+    uint8_t flags;
+    uint32_t handled;           // last push complete, applied unless FLEET_HB_REJECTED
+    uint32_t receiving;         // push being collected, 0 for none
+    uint32_t have;              // its chunks received, bit i for chunk i
+    uint32_t uptime_s;
+    uint32_t table_crc;         // of the ephemeris table loaded, 0 for none
+    int16_t yaw;                // axis positions, tenths of a degree
+    int16_t pitch;
+    uint16_t error;             // pointing error, hundredths of a degree
+    uint16_t supply_mv;
+    uint16_t energy_wh;         // motor energy today, tenths of a Wh
+    uint16_t seq;
+} fleet_heartbeat_t;
+
+#ifdef __cplusplus
+static_assert(sizeof(fleet_header_t) == 12, "fleet header layout");
+static_assert(sizeof(fleet_chunk_t) == 12, "fleet chunk layout");
+static_assert(sizeof(fleet_item_head_t) == 8, "fleet item layout");
+static_assert(sizeof(fleet_heartbeat_t) == 40, "fleet heartbeat layout");
+
+/**
+ * @brief Milliseconds of a monotonic clock
+ */
+int64_t fleet_now_ms();
+
+size_t fleet_packet(uint8_t *buf, fleet_packet_t type, uint16_t site, uint32_t push, const void *body,
+                    size_t size);
+
+/**
+ * @brief Check a datagram of the site, the body follows the header
+ */
+bool fleet_parse(const uint8_t *buf, size_t len, uint16_t site, fleet_header_t *header);
+
+/**
+ * @brief A UDP socket for the fleet, -1 on failure
+ * @param join bind FLEET_PORT and join FLEET_GROUP, as a tracker
+ * @param iface address of the interface for multicast, network order, 0 for the default
+ */
+int fleet_socket(bool join, uint32_t iface);
+
+/**
+ * @brief Send a datagram, to FLEET_GROUP when addr is 0
+ * @param addr, port network order
+ */
+bool fleet_send(int sock, const uint8_t *buf, size_t len, uint32_t addr, uint16_t port);
+
+/**
+ * @brief Wait up to wait_ms for a datagram
+ * @return its size, 0 on timeout, -1 on error
+ */
+int fleet_receive(int sock, uint8_t *buf, size_t cap, int wait_ms, uint32_t *addr, uint16_t *port);
+
+/**
+ * @brief Whether data is an ephemeris table with a valid crc
+ */
+bool fleet_check_ephemeris(const uint8_t *data, size_t size);
+
+// the blob of a push and its datagrams, on the coordinator
+class FleetPush {
+public:
+    ~FleetPush();
+    void begin(uint32_t id);
+    bool add(fleet_item_t type, const void *data, size_t size);
+    // after the last item, false when it is over FLEET_MAX_CHUNKS
+    bool finish();
+
+    uint32_t id() const
+    {
+        return push_id;
+    }
+    int count() const
+    {
+        return chunks;
+    }
+    size_t size() const
+    {
+        return blob_size;
+    }
+    uint32_t all() const
+    {
+        return chunks < 32 ? (1u << chunks) - 1 : 0xffffffff;
+    }
+    // the datagram of chunk index, buf holds FLEET_DATAGRAM_MAX
+    size_t packet(int index, uint16_t site, uint8_t *buf) const;
+
+private:
+    uint8_t *blob = nullptr;
+    size_t blob_size = 0;
+    uint32_t push_id = 0;
+    uint32_t crc = 0;
+    int chunks = 0;
+};
+
+// the chunks of a push, on a tracker
+class FleetReceiver {
+public:
+    typedef enum {
+        RX_IGNORED,             // handled before, or not a chunk
+        RX_PROGRESS,
+        RX_COMPLETE,            // items() until handled()
+        RX_BROKEN,              // complete with a wrong crc, collected again
+    } rx_t;
+
+    ~FleetReceiver();
+    rx_t feed(uint32_t push, const uint8_t *body, size_t size);
+    /**
+     * @brief Find an item of the complete push
+     */
+    bool item(fleet_item_t type, const uint8_t **data, size_t *size) const;
+    // the complete push is done with, the blob is freed
+    void handled(bool applied);
+
+    uint32_t get_handled() const
+    {
+        return last;
+    }
+    bool get_rejected() const
+    {
+        return rejected;
+    }
+    uint32_t get_receiving() const
+    {
+        return blob != nullptr ? push_id : 0;
+    }
+    uint32_t get_have() const
+    {
+        return blob != nullptr ? have : 0;
+    }
+    bool is_complete() const
+    {
+        return blob != nullptr && count > 0 && have == full();
+    }
+
+private:
+    uint32_t full() const
+    {
+        return count < 32 ? (1u << count) - 1 : 0xffffffff;
+    }
+    uint8_t *blob = nullptr;
+    uint32_t push_id = 0;
+    uint32_t size = 0;
+    uint32_t crc = 0;
+    int count = 0;
+    uint32_t have = 0;
+    uint32_t last = 0;
+    bool rejected = false;
+};
+
+// a tracker's end of the protocol: what it receives, when it heartbeats
+class FleetTracker {
+public:
+    void init(const uint8_t id[6], uint16_t site, int64_t now_ms);
+    /**
+     * @brief A datagram from the group or the coordinator
+     * @return RX_COMPLETE when a push is ready to apply, see receiver()
+     */
+    FleetReceiver::rx_t receive(const uint8_t *buf, size_t len, uint32_t addr, uint16_t port, int64_t now_ms);
+    // the complete push was applied, or not
+    void handled(bool applied, int64_t now_ms);
+    FleetReceiver &receiver()
+    {
+        return rx;
+    }
+    /**
+     * @brief Whether a heartbeat is due, with the coordinator to send it to
+     * @param wait_ms how long until the next one might be
+     */
+    bool heartbeat_due(int64_t now_ms, int *wait_ms) const;
+    /**
+     * @brief The heartbeat datagram, hb carries the state of the tracker
+     * @return its size, 0 when there is no coordinator yet
+     */
+    size_t heartbeat(fleet_heartbeat_t *hb, uint8_t *buf, int64_t now_ms, uint32_t *addr, uint16_t *port);
+
+    uint32_t get_coordinator() const
+    {
+        return coordinator_addr;
+    }
+    uint32_t get_heartbeats() const
+    {
+        return seq;
+    }
+
+private:
+    void reply_soon(int64_t now_ms);
+    FleetReceiver rx;
+    uint8_t id[6] = {0};
+    uint16_t site = 0;
+    uint32_t coordinator_addr = 0;  // network order
+    uint16_t coordinator_port = 0;  // network order
+    int64_t next_ms = 0;
+    int64_t chunk_ms = 0;           // last chunk received
+    int64_t stall_ms = 0;           // last stall reported
+    uint32_t random = 1;
+    uint16_t seq = 0;
+};
+
+typedef struct {
+    uint8_t id[6];
+    bool discovered;            // found by mDNS, heard from or not
+    uint32_t addr;              // network order
+    int64_t seen_ms;            // last heartbeat, 0 for none
+    uint32_t heartbeats;
+    fleet_heartbeat_t last;
+} fleet_member_t;
+
+// what the coordinator knows of each tracker
+class FleetRoster {
+public:
+    // a tracker found by mDNS, nullptr when the roster is full
+    fleet_member_t *discover(const uint8_t id[6], uint32_t addr);
+    fleet_member_t *heartbeat(const fleet_heartbeat_t &hb, uint32_t addr, int64_t now_ms);
+    /**
+     * @brief Chunks of the push still missed by a tracker that spoke since since_ms
+     */
+    uint32_t missing(const FleetPush &push, int64_t since_ms, int64_t now_ms) const;
+    /**
+     * @brief Trackers online, and how many of them handled the push
+     */
+    void count(uint32_t push, int64_t now_ms, int *online, int *handled, int *rejected) const;
+    int size() const
+    {
+        return members_count;
+    }
+    const fleet_member_t &at(int i) const
+    {
+        return members[i];
+    }
+    static bool is_online(const fleet_member_t &m, int64_t now_ms)
+    {
+        return m.seen_ms != 0 && now_ms - m.seen_ms < FLEET_OFFLINE_MS;
+    }
+
+private:
+    fleet_member_t *find(const uint8_t id[6]);
+    fleet_member_t members[FLEET_MAX_TRACKERS] = {};
+    int members_count = 0;
+};
+
+typedef struct {
+    uint32_t bursts;            // pushes started
+    uint32_t repairs;           // rounds of chunks sent again
+    uint32_t chunks;            // chunk datagrams sent
+    uint32_t beacons;
+    uint32_t heartbeats;
+    uint64_t bytes;             // of everything sent
+} fleet_stats_t;
+
+// the coordinator's end: the push, the roster, and what to send when
+class FleetCoordinator {
+public:
+    void init(uint16_t site, int beacon_ms = FLEET_BEACON_MS);
+    // the items of push are added, send all its chunks
+    void start(int64_t now_ms);
+    FleetPush &push()
+    {
+        return current;
+    }
+    FleetRoster &roster()
+    {
+        return members;
+    }
+    void receive(const uint8_t *buf, size_t len, uint32_t addr, int64_t now_ms);
+    /**
+     * @brief The datagrams to send now, call until it returns 0
+     */
+    size_t poll(uint8_t *buf, int64_t now_ms);
+    // a beacon now, to hear from everyone
+    void beacon_now()
+    {
+        beacon_ms = 0;
+    }
+    void get_stats(fleet_stats_t *stats) const
+    {
+        *stats = counters;
+    }
+
+private:
+    FleetPush current;
+    FleetRoster members;
+    fleet_stats_t counters = {};
+    uint16_t site = 0;
+    int beacon_period = FLEET_BEACON_MS;
+    int64_t beacon_ms = 0;          // next beacon
+    int64_t started_ms = 0;
+    int64_t repair_ms = 0;          // next look at what is missing
+    uint32_t sending = 0;           // chunks left of this round
+};
+
+#ifndef __linux__
+#include "esp_err.h"
+
+/**
+ * @brief Advertise the tracker over mDNS and start the role of the menuconfig
+ */
+void fleet_init(void);
+
+/**
+ * @brief Push the ephemeris table and the site settings of this node to the fleet
+ * @return ESP_ERR_NOT_SUPPORTED unless the node is the coordinator
+ */
+esp_err_t fleet_push(void);
+
+/**
+ * @brief Copy the roster of the coordinator
+ * @return number of members copied
+ */
+int fleet_get_roster(fleet_member_t *dst, int max_count, uint32_t *push, fleet_stats_t *stats);
+#endif
+#endif
@@ -0,0 +1,552 @@
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "http_workers.h"
+
+#ifndef __linux__
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "http-workers";
+#endif
+
+BlockPool::BlockPool(size_t block_size, int blocks): size(block_size)
+{
+    this->blocks = blocks < HTTP_POOL_BLOCKS ? blocks : HTTP_POOL_BLOCKS;
+    memory = (char *)malloc(size * this->blocks);
+    if (memory == nullptr) {
+        this->blocks = 0;
+    }
+    for (int i = this->blocks - 1; i >= 0; i--) {
+        free_list[free_count++] = i;
+    }
+}
+
+BlockPool::~BlockPool()
+{
+    free(memory);
+}
+
+char *BlockPool::take(int keep)
+{
+    if (free_count <= keep) {
+        return nullptr;
+    }
+    return memory + free_list[--free_count] * size;
+}
+
+void BlockPool::give(char *block)
+{
+    if (block == nullptr) {
+        return;
+    }
+    free_list[free_count++] = (int)((block - memory) / size);
+}
+
+HttpLanes::HttpLanes(size_t block_size, int blocks, int reserved):
+    pool(block_size, blocks), reserved(reserved)
+{
+
+}
+
+bool HttpLanes::submit(http_lane_t lane, void *job)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    lane_queue &queue = queues[lane];
+    http_lane_stats_t &lane_stats = stats.lane[lane];
+    if (queue.count >= HTTP_QUEUE_DEPTH) {
+        lane_stats.rejected++;
+        return false;
+    }
+    queue.jobs[(queue.head + queue.count++) % HTTP_QUEUE_DEPTH] = job;
+    lane_stats.queued = queue.count;
+    if (queue.count > lane_stats.peak) {
+        lane_stats.peak = queue.count;
+    }
+    queue.ready.notify_one();
+    return true;
+}
+
+void *HttpLanes::next(http_lane_t lane)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    lane_queue &queue = queues[lane];
+    queue.ready.wait(guard, [&queue] { return queue.count > 0; });
+    void *job = queue.jobs[queue.head];
+    queue.head = (queue.head + 1) % HTTP_QUEUE_DEPTH;
+    stats.lane[lane].queued = --queue.count;
+    return job;
+}
+
+char *HttpLanes::take(http_lane_t lane, int timeout_ms)
+{
+    int keep = lane == HTTP_LANE_CONTROL ? 0 : reserved;
+    std::unique_lock<std::mutex> guard(lock);
+    char *block = pool.take(keep);
+    if (block == nullptr) {
+        stats.block_waits++;
+        returned.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+                          [this, keep] { return pool.available() > keep; });
+        block = pool.take(keep);
+    }
+    if (block != nullptr) {
+        stats.blocks_used = pool.capacity() - pool.available();
+        if (stats.blocks_used > stats.blocks_peak) {
+            stats.blocks_peak = stats.blocks_used;
+        }
+    }
+    return block;
+}
+
+void HttpLanes::give(char *block)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    pool.give(block);
+    stats.blocks_used = pool.capacity() - pool.available();
+    // waiters of both lanes check their own share
+    returned.notify_all();
+}
+
+void HttpLanes::finish(http_lane_t lane, bool served, int64_t wait_us, int64_t busy_us)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    http_lane_stats_t &lane_stats = stats.lane[lane];
+    if (served) {
+        lane_stats.served++;
+    } else {
+        lane_stats.rejected++;
+    }
+    lane_stats.wait_us += wait_us;
+    lane_stats.busy_us += busy_us;
+}
+
+void HttpLanes::get_stats(http_stats_t *stats)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    *stats = this->stats;
+}
+
+#ifndef __linux__
+
+typedef struct {
+    esp_err_t (*handler)(httpd_req_t *req);
+    http_lane_t lane;
+    void *user_ctx;
+} http_route_t;
+
+typedef struct {
+    httpd_req_t *req;           // detached from the httpd task
+    const http_route_t *route;
+    int64_t queued_us;
+} http_job_t;
+
+static HttpLanes *s_lanes = NULL;
+
+static void send_busy(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    httpd_resp_sendstr(req, "server busy");
+}
+
+static void http_worker_task(void *arg)
+{
+    http_lane_t lane = (http_lane_t)(intptr_t)arg;
+    while (true) {
+        http_job_t *job = (http_job_t *)s_lanes->next(lane);
+        httpd_req_t *req = job->req;
+        char *scratch = s_lanes->take(lane, HTTP_BLOCK_WAIT_MS);
+        int64_t start = esp_timer_get_time();
+        if (scratch == NULL) {
+            ESP_LOGW(TAG, "no scratch block for %s", req->uri);
+            send_busy(req);
+        } else {
+            http_work_ctx_t ctx = {job->route->user_ctx, scratch};
+            req->user_ctx = &ctx;
+            if (job->route->handler(req) != ESP_OK) {
+                // httpd closes the socket of a failed handler, a detached request has to ask for it
+                httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+            }
+            s_lanes->give(scratch);
+        }
+        int64_t end = esp_timer_get_time();
+        httpd_req_async_handler_complete(req);
+        s_lanes->finish(lane, scratch != NULL, start - job->queued_us, end - start);
+        free(job);
+    }
+}
+
+// runs in the httpd task, which is free again as soon as the request is queued
+static esp_err_t http_dispatch_handler(httpd_req_t *req)
+{
+    const http_route_t *route = (const http_route_t *)req->user_ctx;
+    http_job_t *job = (http_job_t *)malloc(sizeof(http_job_t));
+    httpd_req_t *async_req = NULL;
+    if (job == NULL || httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+        free(job);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no memory for the request");
+        return ESP_FAIL;
+    }
+    job->req = async_req;
+    job->route = route;
+    job->queued_us = esp_timer_get_time();
+    if (!s_lanes->submit(route->lane, job)) {
+        ESP_LOGW(TAG, "lane %d full, %s rejected", route->lane, req->uri);
+        send_busy(async_req);
+        httpd_req_async_handler_complete(async_req);
+        free(job);
+    }
+    return ESP_OK;
+}
+
+esp_err_t http_workers_init(void)
+{
+    if (s_lanes != NULL) {
+        return ESP_OK;
+    }
+    s_lanes = new HttpLanes();
+    static const struct {
+        const char *name;
+        http_lane_t lane;
+        int workers;
+        int priority;
+    } lanes[] = {
+        {"http_ctrl", HTTP_LANE_CONTROL, HTTP_CONTROL_WORKERS, HTTP_CONTROL_PRIORITY},
+        {"http_bulk", HTTP_LANE_BULK, HTTP_BULK_WORKERS, HTTP_BULK_PRIORITY},
+    };
+    for (const auto &lane : lanes) {
+        for (int i = 0; i < lane.workers; i++) {
+            if (xTaskCreate(http_worker_task, lane.name, HTTP_WORKER_STACK, (void *)(intptr_t)lane.lane,
+                            lane.priority, NULL) != pdPASS) {
+                ESP_LOGE(TAG, "failed to start %s worker %d", lane.name, i);
+                return ESP_ERR_NO_MEM;
+            }
+        }
+    }
+    ESP_LOGI(TAG, "%d control and %d bulk workers, %d scratch blocks of %d bytes",
+             HTTP_CONTROL_WORKERS, HTTP_BULK_WORKERS, HTTP_POOL_BLOCKS, HTTP_BLOCK_SIZE);
+    return ESP_OK;
+}
+
+esp_err_t http_workers_register(httpd_handle_t server, const char *uri, httpd_method_t method,
+                                http_lane_t lane, esp_err_t (*handler)(httpd_req_t *req), void *user_ctx)
+{
+    // routes live as long as the server
+    http_route_t *route = (http_route_t *)malloc(sizeof(http_route_t));
+    if (route == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    *route = {handler, lane, user_ctx};
+    httpd_uri_t _uri = {
+        .uri = uri,
+        .method = method,
+        .handler = http_dispatch_handler,
+        .user_ctx = route,
+    };
+    esp_err_t err = httpd_register_uri_handler(server, &_uri);
+    if (err != ESP_OK) {
+        free(route);
+    }
+    return err;
+}
+
+void http_workers_get_stats(http_stats_t *stats)
+{
+    if (s_lanes == NULL) {
+        memset(stats, 0, sizeof(http_stats_t));
+        return;
+    }
+    s_lanes->get_stats(stats);
+}
+
+#endif
+
+// run test on linux
+#ifdef __linux__
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+/*
+ * Host stand-in of the server. The httpd thread replays a schedule of
+ * requests, either running each handler itself with one scratch buffer as
+ * the server did before, or queueing it on the HttpLanes above for worker
+ * threads of the same counts as on the device. Handlers are made of chunks
+ * that stamp the scratch with their request, sleep for the socket and the
+ * flash, and check the stamp is still theirs. Thread priorities are not
+ * modeled: on the device the control workers also preempt the bulk ones
+ * for the CPU, so the figures here are the queueing part of the gain.
+ */
+
+enum { KIND_POLL, KIND_SETTINGS, KIND_UPLOAD, KIND_STATIC, KIND_COUNT };
+
+static const struct {
+    http_lane_t lane;
+    int chunks;
+    int chunk_bytes;
+    int chunk_us;
+} kinds[KIND_COUNT] = {
+    {HTTP_LANE_CONTROL, 1, 1024, 1500},         // build or copy the snapshot, send
+    {HTTP_LANE_CONTROL, 1, 4096, 4000},         // receive, parse, save to NVS
+    {HTTP_LANE_BULK, 240, 2048, 3000},          // 480 kB at ~700 kB/s and its flash writes
+    {HTTP_LANE_BULK, 4, HTTP_BLOCK_SIZE, 4000}, // 48 kB file off SPIFFS
+};
+
+typedef enum { MODE_SINGLE, MODE_SHARED, MODE_LANES } server_mode_t;
+static const char *mode_names[] = {"single", "shared", "lanes"};
+
+struct standin_req {
+    int kind;
+    int id;
+    int64_t arrival_us;
+    int64_t done_us;
+    bool rejected;
+    bool corrupted;
+};
+
+static std::chrono::steady_clock::time_point t0;
+
+static int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static void run_handler(standin_req *req, char *scratch)
+{
+    const auto &kind = kinds[req->kind];
+    uint8_t stamp = (uint8_t)(req->id * 37 + 11);
+    for (int c = 0; c < kind.chunks; c++) {
+        memset(scratch, stamp, kind.chunk_bytes);
+        std::this_thread::sleep_for(std::chrono::microseconds(kind.chunk_us));
+        for (int i = 0; i < kind.chunk_bytes; i += 64) {
+            if ((uint8_t)scratch[i] != stamp) {
+                req->corrupted = true;
+                break;
+            }
+        }
+    }
+}
+
+static std::vector<standin_req> schedule()
+{
+    std::vector<standin_req> reqs;
+    auto add = [&reqs](int kind, int64_t ms) {
+        reqs.push_back({kind, (int)reqs.size(), ms * 1000, 0, false, false});
+    };
+    // three dashboards polling every 150 ms
+    for (int64_t ms = 0; ms < 2000; ms += 150) {
+        for (int d = 0; d < 3; d++) {
+            add(KIND_POLL, ms + d * 50);
+        }
+    }
+    add(KIND_SETTINGS, 400);
+    add(KIND_SETTINGS, 1100);
+    add(KIND_SETTINGS, 1800);
+    add(KIND_UPLOAD, 100);
+    // a browser loading the page while the upload runs
+    for (int f = 0; f < 4; f++) {
+        add(KIND_STATIC, 900);
+    }
+    std::stable_sort(reqs.begin(), reqs.end(),
+                     [](const standin_req &a, const standin_req &b) { return a.arrival_us < b.arrival_us; });
+    return reqs;
+}
+
+struct run_result {
+    std::vector<standin_req> reqs;
+    http_stats_t stats;
+    int bulk_blocks_peak;
+};
+
+static run_result run(server_mode_t mode)
+{
+    run_result result = {schedule(), {}, 0};
+    HttpLanes lanes;
+    static char shared[HTTP_BLOCK_SIZE];
+    std::atomic<int> bulk_blocks(0);
+    std::atomic<int> bulk_peak(0);
+    std::vector<std::thread> workers;
+
+    auto worker = [&](http_lane_t lane) {
+        while (true) {
+            standin_req *req = (standin_req *)lanes.next(lane);
+            if (req == nullptr) {
+                return;
+            }
+            int64_t queued = now_us();
+            char *scratch = lanes.take(lane, HTTP_BLOCK_WAIT_MS);
+            int64_t start = now_us();
+            if (scratch == nullptr) {
+                req->rejected = true;
+            } else {
+                if (lane == HTTP_LANE_BULK) {
+                    int held = ++bulk_blocks;
+                    int peak = bulk_peak;
+                    while (held > peak && !bulk_peak.compare_exchange_weak(peak, held)) {
+                    }
+                }
+                run_handler(req, mode == MODE_SHARED ? shared : scratch);
+                if (lane == HTTP_LANE_BULK) {
+                    bulk_blocks--;
+                }
+                lanes.give(scratch);
+            }
+            req->done_us = now_us();
+            lanes.finish(lane, scratch != nullptr, start - queued, req->done_us - start);
+        }
+    };
+    if (mode != MODE_SINGLE) {
+        for (int i = 0; i < HTTP_CONTROL_WORKERS; i++) {
+            workers.emplace_back(worker, HTTP_LANE_CONTROL);
+        }
+        for (int i = 0; i < HTTP_BULK_WORKERS; i++) {
+            workers.emplace_back(worker, HTTP_LANE_BULK);
+        }
+    }
+
+    t0 = std::chrono::steady_clock::now();
+    for (standin_req &req : result.reqs) {
+        std::this_thread::sleep_until(t0 + std::chrono::microseconds(req.arrival_us));
+        if (mode == MODE_SINGLE) {
+            run_handler(&req, shared);
+            req.done_us = now_us();
+        } else if (!lanes.submit(kinds[req.kind].lane, &req)) {
+            req.rejected = true;
+            req.done_us = now_us();
+        }
+    }
+    // one stop per worker, the queues may be full for a while
+    for (int lane = 0; lane < HTTP_LANE_COUNT; lane++) {
+        int stops = lane == HTTP_LANE_CONTROL ? HTTP_CONTROL_WORKERS : HTTP_BULK_WORKERS;
+        while (mode != MODE_SINGLE && stops > 0) {
+            if (lanes.submit((http_lane_t)lane, nullptr)) {
+                stops--;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+    for (std::thread &thread : workers) {
+        thread.join();
+    }
+    lanes.get_stats(&result.stats);
+    result.bulk_blocks_peak = bulk_peak;
+    return result;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static int test_pool()
+{
+    int failures = 0;
+    BlockPool pool(64, HTTP_POOL_BLOCKS);
+    std::vector<char *> taken;
+    char *block;
+    while ((block = pool.take(1)) != nullptr) {
+        memset(block, (int)taken.size() + 1, 64);
+        taken.push_back(block);
+    }
+    if ((int)taken.size() != HTTP_POOL_BLOCKS - 1 || pool.take(0) == nullptr || pool.take(0) != nullptr) {
+        printf("  pool: wrong number of blocks under the reserve\n");
+        failures++;
+    }
+    for (size_t i = 0; i < taken.size(); i++) {
+        for (int b = 0; b < 64; b++) {
+            if (taken[i][b] != (char)(i + 1)) {
+                printf("  pool: blocks %zu overlaps\n", i);
+                failures++;
+                break;
+            }
+        }
+    }
+    BlockPool none(64, HTTP_POOL_BLOCKS + 5);
+    if (none.capacity() != HTTP_POOL_BLOCKS) {
+        printf("  pool: capacity above HTTP_POOL_BLOCKS\n");
+        failures++;
+    }
+    return failures;
+}
+
+int main()
+{
+    int failures = test_pool();
+    double control_p99[3] = {0};
+    int corrupted[3] = {0};
+
+    printf("%-7s %6s %8s %8s %8s %8s %9s %7s %6s %6s %6s\n", "mode", "ctrl", "p50 ms", "p99 ms", "max ms",
+           "upload s", "static ms", "503", "corrupt", "waits", "blocks");
+    for (int m = MODE_SINGLE; m <= MODE_LANES; m++) {
+        run_result r = run((server_mode_t)m);
+        std::vector<double> control;
+        double upload_s = 0, static_ms = 0;
+        int rejected = 0;
+        for (const standin_req &req : r.reqs) {
+            double ms = (req.done_us - req.arrival_us) / 1000.0;
+            rejected += req.rejected;
+            corrupted[m] += req.corrupted;
+            if (req.rejected) {
+                continue;
+            }
+            if (kinds[req.kind].lane == HTTP_LANE_CONTROL) {
+                control.push_back(ms);
+            } else if (req.kind == KIND_UPLOAD) {
+                upload_s = ms / 1000;
+            } else {
+                static_ms = std::max(static_ms, ms);
+            }
+        }
+        control_p99[m] = percentile(control, 0.99);
+        printf("%-7s %6zu %8.1f %8.1f %8.1f %8.2f %9.1f %7d %6d %6u %6u\n", mode_names[m], control.size(),
+               percentile(control, 0.5), control_p99[m], percentile(control, 1.0), upload_s, static_ms, rejected,
+               corrupted[m], r.stats.block_waits, r.stats.blocks_peak);
+        if (m == MODE_LANES) {
+            if (rejected != 0) {
+                printf("  lanes: %d requests rejected\n", rejected);
+                failures++;
+            }
+            if (r.bulk_blocks_peak > HTTP_POOL_BLOCKS - HTTP_RESERVED_BLOCKS) {
+                printf("  lanes: bulk held %d blocks\n", r.bulk_blocks_peak);
+                failures++;
+            }
+            if (r.stats.blocks_peak > HTTP_POOL_BLOCKS) {
+                printf("  lanes: %u blocks in use\n", r.stats.blocks_peak);
+                failures++;
+            }
+            for (int lane = 0; lane < HTTP_LANE_COUNT; lane++) {
+                const http_lane_stats_t &s = r.stats.lane[lane];
+                printf("  lane %d: served %u, peak queue %u, wait %.2f ms, busy %.2f ms per request\n", lane,
+                       s.served, s.peak, s.wait_us / 1000.0 / std::max(s.served, 1u),
+                       s.busy_us / 1000.0 / std::max(s.served, 1u));
+            }
+        }
+    }
+    if (control_p99[MODE_LANES] > 25 || control_p99[MODE_LANES] * 5 > control_p99[MODE_SINGLE]) {
+        printf("  control p99 %.1f ms on the lanes against %.1f ms on one task\n", control_p99[MODE_LANES],
+               control_p99[MODE_SINGLE]);
+        failures++;
+    }
+    if (corrupted[MODE_LANES] != 0 || corrupted[MODE_SINGLE] != 0) {
+        printf("  scratch overwritten\n");
+        failures++;
+    }
+    if (corrupted[MODE_SHARED] == 0) {
+        printf("  a shared scratch with workers was never overwritten, the stand-in proves nothing\n");
+        failures++;
+    }
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,172 @@
+/*
+   Worker pool of the HTTP server.
+
+   esp_http_server runs every handler in its one task: a firmware upload
+   held the dashboard for the whole transfer, and the handlers shared one
+   scratch buffer that two requests in flight would have overwritten. The
+   httpd task now only parses the request, detaches it
+   (httpd_req_async_handler_begin) and queues it on a lane:
+   - HTTP_LANE_CONTROL: telemetry polls, settings and commands, served by
+     HTTP_CONTROL_WORKERS tasks above the priority of httpd,
+   - HTTP_LANE_BULK: uploads and static files, served by HTTP_BULK_WORKERS
+     tasks below the telemetry task, so they only get the CPU the rest
+     leaves.
+   A request gets its own scratch block of HTTP_BLOCK_SIZE from a fixed
+   pool for as long as its handler runs. Bulk requests never take the last
+   HTTP_RESERVED_BLOCKS, a control request waits at most for another
+   control request. A lane whose queue is full answers 503 at once.
+
+   The lanes and the pool do not depend on ESP-IDF, the __linux__ section
+   of http_workers.cpp runs them in a host stand-in of the server and
+   compares the latency of control requests during an upload with the
+   single task server.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <condition_variable>
+
+#define HTTP_BLOCK_SIZE         (1024*12)   // scratch of one request, largest JSON body
+#define HTTP_POOL_BLOCKS        3
+#define HTTP_RESERVED_BLOCKS    1           // for the control lane
+#define HTTP_QUEUE_DEPTH        4           // waiting requests per lane
+#define HTTP_CONTROL_WORKERS    2
+#define HTTP_BULK_WORKERS       2
+#define HTTP_CONTROL_PRIORITY   6           // httpd runs at 5
+#define HTTP_BULK_PRIORITY      3           // telemetry runs at 4
+#define HTTP_WORKER_STACK       4096
+#define HTTP_BLOCK_WAIT_MS      5000
+
+typedef enum {
+    HTTP_LANE_CONTROL,
+    HTTP_LANE_BULK,
+    HTTP_LANE_COUNT,
+} http_lane_t;
+
+typedef struct {
+    uint32_t served;            // requests run by a worker
+    uint32_t rejected;          // 503, queue full or no block in time
+    uint8_t queued;             // waiting now
+    uint8_t peak;               // most ever waiting
+    uint64_t wait_us;           // from the dispatch to a block
+    uint64_t busy_us;           // in the handlers
+} http_lane_stats_t;
+
+typedef struct {
+    http_lane_stats_t lane[HTTP_LANE_COUNT];
+    uint8_t blocks_used;
+    uint8_t blocks_peak;
+    uint32_t block_waits;       // takes that found no block for their lane
+} http_stats_t;
+
+/**
+ * @brief Fixed size blocks carved out of one allocation, not thread safe
+ */
+class BlockPool {
+public:
+    BlockPool(size_t block_size, int blocks);
+    ~BlockPool();
+
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    // NULL when fewer than keep blocks would be left
+    char *take(int keep = 0);
+    void give(char *block);
+
+    int available() const
+    {
+        return free_count;
+    }
+    int capacity() const
+    {
+        return blocks;
+    }
+    size_t block_size() const
+    {
+        return size;
+    }
+
+private:
+    char *memory = nullptr;
+    size_t size;
+    int blocks;
+    int free_count = 0;
+    int free_list[HTTP_POOL_BLOCKS];
+};
+
+/**
+ * @brief Bounded job queues per lane and the scratch pool they share
+ */
+class HttpLanes {
+public:
+    HttpLanes(size_t block_size = HTTP_BLOCK_SIZE, int blocks = HTTP_POOL_BLOCKS,
+              int reserved = HTTP_RESERVED_BLOCKS);
+
+    // false when the lane already holds HTTP_QUEUE_DEPTH jobs
+    bool submit(http_lane_t lane, void *job);
+    // the oldest job of the lane, waits for one
+    void *next(http_lane_t lane);
+
+    // a scratch block for a job of the lane, NULL after timeout_ms
+    char *take(http_lane_t lane, int timeout_ms);
+    void give(char *block);
+
+    // account a job: waited for its block, then ran; a job that got no block passes served false
+    void finish(http_lane_t lane, bool served, int64_t wait_us, int64_t busy_us);
+
+    void get_stats(http_stats_t *stats);
+
+private:
+    struct lane_queue {
+        void *jobs[HTTP_QUEUE_DEPTH];
+        int head = 0;
+        int count = 0;
+        std::condition_variable ready;
+    };
+
+    std::mutex lock;
+    std::condition_variable returned;   // a block was given back
+    lane_queue queues[HTTP_LANE_COUNT];
+    BlockPool pool;
+    int reserved;
+    http_stats_t stats = {};
+};
+
+#ifndef __linux__
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// what req->user_ctx points to while a handler runs on a worker
+typedef struct {
+    void *user_ctx;             // of the route
+    char *scratch;              // HTTP_BLOCK_SIZE bytes, the request's own
+} http_work_ctx_t;
+
+static inline char *http_scratch(httpd_req_t *req)
+{
+    return ((http_work_ctx_t *)req->user_ctx)->scratch;
+}
+
+static inline void *http_user_ctx(httpd_req_t *req)
+{
+    return ((http_work_ctx_t *)req->user_ctx)->user_ctx;
+}
+
+/**
+ * @brief Start the workers, before the first http_workers_register()
+ */
+esp_err_t http_workers_init(void);
+
+/**
+ * @brief Register a URI whose handler runs on a worker of the lane
+ */
+esp_err_t http_workers_register(httpd_handle_t server, const char *uri, httpd_method_t method,
+                                http_lane_t lane, esp_err_t (*handler)(httpd_req_t *req), void *user_ctx);
+
+void http_workers_get_stats(http_stats_t *stats);
+
+#endif
@@ -7,11 +7,15 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <cmath>
 #include <fcntl.h>
 #include "esp_http_server.h"
 #include "esp_chip_info.h"
 #include "esp_random.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_vfs.h"
 #include "esp_ota_ops.h"
 #include "esp_app_format.h"
@@ -22,6 +26,17 @@
 #include "setting.h"
 #include "build_time.h"
 #include "adc.h"
+#include "energy.h"
+#include "power.h"
+#include "telemetry.h"
+#include "http_workers.h"
+#include "control_api.h"
+#include "fleet.h"
+#include "tslog.h"
+#include "history.h"
+#include "recorder.h"
+#include "loop_bench.h"
+#include "profiler.h"
 
 static const char *TAG = "esp-rest";
 #define REST_CHECK(a, str, goto_tag, ...)                                              \
@@ -35,12 +50,8 @@ static const char *TAG = "esp-rest";
     } while (0)
 
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + 128)
-#define SCRATCH_BUFSIZE (1024*20)
-
-typedef struct rest_server_context {
-    char base_path[ESP_VFS_PATH_MAX + 1];
-    char scratch[SCRATCH_BUFSIZE];
-} rest_server_context_t;
+// each request has its own scratch block from the worker pool, see http_workers.h
+#define SCRATCH_BUFSIZE HTTP_BLOCK_SIZE
 
 #define CHECK_FILE_EXTENSION(filename, ext) (strcasecmp(&filename[strlen(filename) - strlen(ext)], ext) == 0)
 
@@ -69,8 +80,7 @@ static esp_err_t rest_common_get_handler(httpd_req_t *req)
 {
     char filepath[FILE_PATH_MAX];
 
-    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
-    strlcpy(filepath, rest_context->base_path, sizeof(filepath));
+    strlcpy(filepath, (const char *)http_user_ctx(req), sizeof(filepath));
     if (req->uri[strlen(req->uri) - 1] == '/' || strstr(req->uri, "/control") != NULL || strstr(req->uri, "/analysis") != NULL) {
         strlcat(filepath, "/index.html", sizeof(filepath));
     } else {
@@ -86,7 +96,7 @@ static esp_err_t rest_common_get_handler(httpd_req_t *req)
 
     set_content_type_from_file(req, filepath);
 
-    char *chunk = rest_context->scratch;
+    char *chunk = http_scratch(req);
     ssize_t read_bytes;
     do {
         /* Read file in chunks into the scratch buffer */
@@ -121,6 +131,21 @@ static void cjson_add_num_as_str(cJSON *obj, const char *name, double number)
     cJSON_AddStringToObject(obj, name, buffer);
 }
 
+// the yaw scale is also given as the gear ratio it amounts to
+static cJSON *mount_to_json(const struct mount_param &param)
+{
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "azOffset", param.az_offset);
+    cJSON_AddNumberToObject(obj, "pitchOffset", param.pitch_offset);
+    cJSON_AddNumberToObject(obj, "tiltN", param.tilt_n);
+    cJSON_AddNumberToObject(obj, "tiltE", param.tilt_e);
+    cJSON_AddNumberToObject(obj, "nonPerp", param.non_perp);
+    cJSON_AddNumberToObject(obj, "yawScale", param.yaw_scale);
+    cJSON_AddNumberToObject(obj, "gearRatio", gimbal.yawMotor->get_gear_ratio() / (1 + param.yaw_scale));
+    cJSON_AddBoolToObject(obj, "enable", param.enable);
+    return obj;
+}
+
 static double cjson_get_num(cJSON *obj, const char *name)
 {
     cJSON *item = cJSON_GetObjectItem(obj, name);
@@ -145,7 +170,7 @@ static esp_err_t firmware_update_post_handler(httpd_req_t *req)
     const esp_partition_t *update_partition = NULL;
     const esp_partition_t *configured = esp_ota_get_boot_partition();
     const esp_partition_t *running = esp_ota_get_running_partition();
-    char *ota_write_data = ((rest_server_context_t *)(req->user_ctx))->scratch;
+    char *ota_write_data = http_scratch(req);
     int total_len = req->content_len;
     int cur_len = 0;
     const size_t chunk_size = 2048;
@@ -273,7 +298,7 @@ static esp_err_t webdata_update_post_handler(httpd_req_t *req)
 {
     #define ROUND_UP_TO_MULTIPLE(value, multiple) (((value) + (multiple) - 1) / (multiple) * (multiple))
     const char *ret_msg = NULL;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
+    char *buf = http_scratch(req);
     int total_len = req->content_len;
     int cur_len = 0;
     const size_t chunk_size = 2048;
@@ -324,6 +349,174 @@ fail:
     return ESP_FAIL;
 }
  
+/* CBOR requests and replies of the binary control API, see control_api.h */
+static bool request_is_cbor(httpd_req_t *req, const char *header)
+{
+    char value[64];
+    if (httpd_req_get_hdr_value_str(req, header, value, sizeof(value)) != ESP_OK) {
+        return false;
+    }
+    return strcasestr(value, CONTROL_CONTENT_TYPE) != NULL;
+}
+
+static esp_err_t send_control_reply(httpd_req_t *req, control_status_t status, const char *message, int ignored)
+{
+    uint8_t reply[96];
+    size_t size = control_encode_reply(status, message, ignored, reply, sizeof(reply));
+    if (status != CONTROL_OK) {
+        httpd_resp_set_status(req, "400 Bad Request");
+    }
+    httpd_resp_set_type(req, CONTROL_CONTENT_TYPE);
+    return httpd_resp_send(req, (const char *)reply, size <= sizeof(reply) ? size : 0);
+}
+
+static const char *control_status_message(control_status_t status)
+{
+    switch (status) {
+    case CONTROL_OK:
+        return "ok";
+    case CONTROL_ERR_VERSION:
+        return "unsupported version";
+    default:
+        return "malformed command";
+    }
+}
+
+static void settings_to_doc(control_settings_t *doc)
+{
+    doc->mode = g_settings.mode;
+    doc->yaw_offset = g_settings.yaw_offset;
+    doc->th.vol_max = g_settings.vol_max;
+    doc->th.vol_min = g_settings.vol_min;
+    doc->man.pitch = g_settings.target_pitch;
+    doc->man.yaw = g_settings.target_yaw;
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        doc->adc[i] = *g_settings.adcCal(i);
+    }
+    doc->winding_ohm[0] = g_settings.winding_ohm[0];
+    doc->winding_ohm[1] = g_settings.winding_ohm[1];
+    doc->energy_budget_wh = g_settings.energy_budget_wh;
+    doc->pid[CONTROL_PID_POS] = g_settings.pos_pid;
+    doc->pid[CONTROL_PID_VEL] = g_settings.vel_pid;
+    doc->pid[CONTROL_PID_PITCH_POS] = g_settings.pitch_pos_pid;
+    doc->pid[CONTROL_PID_PITCH_VEL] = g_settings.pitch_vel_pid;
+    doc->track = g_settings.track;
+    doc->weather = g_settings.weather;
+    doc->fine = g_settings.fine;
+    doc->mount = g_settings.mount;
+    doc->heliostat.param = g_settings.heliostat;
+    memcpy(doc->heliostat.targets, g_settings.helio_targets, sizeof(doc->heliostat.targets));
+    doc->sun = g_settings.sun;
+}
+
+// the sections a command set, with the side effects of the JSON handler
+static void apply_settings_doc(const control_settings_t *doc, uint32_t sections)
+{
+    if (sections & CONTROL_SEC_MODE) {
+        g_settings.mode = doc->mode;
+        g_settings.yaw_offset = doc->yaw_offset;
+    }
+    if (sections & CONTROL_SEC_TH) {
+        g_settings.vol_max = doc->th.vol_max;
+        g_settings.vol_min = doc->th.vol_min;
+    }
+    if (sections & CONTROL_SEC_MAN) {
+        g_settings.target_pitch = doc->man.pitch;
+        g_settings.target_yaw = doc->man.yaw;
+    }
+    if (sections & CONTROL_SEC_ADC) {
+        for (int i = 0; i < ADC_SIG_COUNT; i++) {
+            *g_settings.adcCal(i) = doc->adc[i];
+            adc_set_calibration((adc_signal_t)i, g_settings.adcCal(i));
+        }
+    }
+    if (sections & CONTROL_SEC_WINDING) {
+        g_settings.winding_ohm[0] = doc->winding_ohm[0];
+        g_settings.winding_ohm[1] = doc->winding_ohm[1];
+        gimbal.yawMotor->set_winding_resistance(g_settings.winding_ohm[0]);
+        gimbal.pitchMotor->set_winding_resistance(g_settings.winding_ohm[1]);
+    }
+    if (sections & CONTROL_SEC_ENERGY) {
+        g_settings.energy_budget_wh = doc->energy_budget_wh;
+        energy_set_daily_budget(g_settings.energy_budget_wh);
+    }
+    if (sections & CONTROL_SEC_PID) {
+        g_settings.pos_pid = doc->pid[CONTROL_PID_POS];
+        g_settings.vel_pid = doc->pid[CONTROL_PID_VEL];
+        g_settings.pitch_pos_pid = doc->pid[CONTROL_PID_PITCH_POS];
+        g_settings.pitch_vel_pid = doc->pid[CONTROL_PID_PITCH_VEL];
+    }
+    if (sections & CONTROL_SEC_TRACK) {
+        g_settings.track = doc->track;
+    }
+    if (sections & CONTROL_SEC_WEATHER) {
+        struct weather_param weather = doc->weather;
+        // overcast 必须小于 clear
+        if (!(weather.overcast_kt > 0 && weather.overcast_kt < weather.clear_kt && weather.clear_kt < 1.5f)) {
+            weather.clear_kt = g_settings.weather.clear_kt;
+            weather.overcast_kt = g_settings.weather.overcast_kt;
+        }
+        g_settings.weather = weather;
+    }
+    if (sections & CONTROL_SEC_FINE) {
+        g_settings.fine = doc->fine;
+    }
+    if (sections & CONTROL_SEC_MOUNT) {
+        gimbal.applyMount(doc->mount);
+    }
+    if (sections & CONTROL_SEC_HELIOSTAT) {
+        g_settings.heliostat = doc->heliostat.param;
+        memcpy(g_settings.helio_targets, doc->heliostat.targets, sizeof(g_settings.helio_targets));
+        for (heliostat_target &t : g_settings.helio_targets) {
+            if (!(std::fabs(t.east) < 10000 && std::fabs(t.north) < 10000 && std::fabs(t.up) < 10000)) {
+                t.enable = 0;
+            }
+        }
+    }
+    if (sections & CONTROL_SEC_SUN) {
+        g_settings.sun = doc->sun;
+    }
+    if (sections & (CONTROL_SEC_HELIOSTAT | CONTROL_SEC_SUN)) {
+        gimbal.replanHeliostat();
+    }
+    if (sections & (CONTROL_SEC_MAN | CONTROL_SEC_TRACK | CONTROL_SEC_WEATHER | CONTROL_SEC_FINE)) {
+        gimbal.triger_task_immediate();
+    }
+}
+
+control_status_t rest_apply_settings(const uint8_t *body, size_t len, int *ignored)
+{
+    // decoded on a copy, a malformed command changes nothing
+    control_settings_t doc;
+    settings_to_doc(&doc);
+    uint32_t sections = 0;
+    control_status_t status = control_decode(&control_settings_map, body, len, &doc, &sections, ignored);
+    if (status == CONTROL_OK) {
+        apply_settings_doc(&doc, sections);
+        g_settings.save();
+    }
+    ESP_LOGI(TAG, "CBOR settings: %s, sections 0x%" PRIx32 ", %d ignored", control_status_message(status), sections,
+             *ignored);
+    return status;
+}
+
+size_t rest_encode_site_settings(uint8_t *buf, size_t cap)
+{
+    control_settings_t doc;
+    settings_to_doc(&doc);
+    return control_encode(&control_site_map, &doc, buf, cap);
+}
+
+static esp_err_t setting_post_cbor(httpd_req_t *req, const uint8_t *body, size_t len)
+{
+    int ignored = 0;
+    control_status_t status = rest_apply_settings(body, len, &ignored);
+    if (status == CONTROL_OK) {
+        fleet_push();
+    }
+    return send_control_reply(req, status, control_status_message(status), ignored);
+}
+
 /* json format of setting */
 /*
 {
@@ -366,7 +559,7 @@ static esp_err_t setting_post_handler(httpd_req_t *req)
 {
     int total_len = req->content_len;
     int cur_len = 0;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
+    char *buf = http_scratch(req);
     int received = 0;
     if (total_len >= SCRATCH_BUFSIZE) {
         /* Respond with 500 Internal Server Error */
@@ -384,6 +577,10 @@ static esp_err_t setting_post_handler(httpd_req_t *req)
     }
     buf[total_len] = '\0';
 
+    if (request_is_cbor(req, "Content-Type")) {
+        return setting_post_cbor(req, (const uint8_t *)buf, total_len);
+    }
+
     cJSON *root = cJSON_Parse(buf);
     if (!root) {
         printf("Error parsing JSON!\n");
@@ -463,14 +660,238 @@ static esp_err_t setting_post_handler(httpd_req_t *req)
 
     }
 
+    // 解析 adc 校准
+    cJSON *adc = cJSON_GetObjectItem(root, "adc");
+    if (cJSON_IsArray(adc)) {
+        for (int i = 0; i < ADC_SIG_COUNT && i < cJSON_GetArraySize(adc); i++) {
+            cJSON *cal = cJSON_GetArrayItem(adc, i);
+            cJSON *scale = cJSON_GetObjectItem(cal, "scale");
+            cJSON *offset = cJSON_GetObjectItem(cal, "offset");
+            if (cJSON_IsNumber(scale) && cJSON_IsNumber(offset)) {
+                g_settings.adcCal(i)->scale = scale->valuedouble;
+                g_settings.adcCal(i)->offset = offset->valuedouble;
+                adc_set_calibration((adc_signal_t)i, g_settings.adcCal(i));
+            }
+        }
+    }
+
+    // 解析电机绕组电阻, 顺序为 yaw, pitch
+    cJSON *winding = cJSON_GetObjectItem(root, "winding");
+    if (cJSON_IsArray(winding)) {
+        for (int i = 0; i < 2 && i < cJSON_GetArraySize(winding); i++) {
+            cJSON *ohm = cJSON_GetArrayItem(winding, i);
+            if (cJSON_IsNumber(ohm) && ohm->valuedouble > 0) {
+                g_settings.winding_ohm[i] = ohm->valuedouble;
+            }
+        }
+        gimbal.yawMotor->set_winding_resistance(g_settings.winding_ohm[0]);
+        gimbal.pitchMotor->set_winding_resistance(g_settings.winding_ohm[1]);
+    }
+
+    // 解析每日能量预算
+    cJSON *budget = cJSON_GetObjectItem(root, "energyBudget");
+    if (cJSON_IsNumber(budget) && budget->valuedouble >= 0) {
+        g_settings.energy_budget_wh = budget->valuedouble;
+        energy_set_daily_budget(g_settings.energy_budget_wh);
+    }
+
+    // 解析跟踪策略
+    cJSON *track = cJSON_GetObjectItem(root, "track");
+    if (track) {
+        cJSON *item;
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(track, "threshold")) && item->valuedouble >= 0) {
+            g_settings.track.threshold_deg = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(track, "lead")) && item->valuedouble >= 0 && item->valuedouble <= 1) {
+            g_settings.track.lead = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(track, "settle")) && item->valuedouble > 0) {
+            g_settings.track.settle_deg = item->valuedouble;
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(track, "yawLock"))) {
+            g_settings.track.yaw_self_lock = cJSON_IsTrue(item);
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(track, "pitchLock"))) {
+            g_settings.track.pitch_self_lock = cJSON_IsTrue(item);
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(track, "enable"))) {
+            g_settings.track.enable = cJSON_IsTrue(item);
+        }
+        gimbal.triger_task_immediate();
+    }
+
+    // 解析天气策略, overcast 必须小于 clear
+    cJSON *weather = cJSON_GetObjectItem(root, "weather");
+    if (weather) {
+        cJSON *item;
+        float clear_kt = g_settings.weather.clear_kt, overcast_kt = g_settings.weather.overcast_kt;
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(weather, "clear"))) {
+            clear_kt = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(weather, "overcast"))) {
+            overcast_kt = item->valuedouble;
+        }
+        if (overcast_kt > 0 && overcast_kt < clear_kt && clear_kt < 1.5f) {
+            g_settings.weather.clear_kt = clear_kt;
+            g_settings.weather.overcast_kt = overcast_kt;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(weather, "tau")) && item->valuedouble > 0) {
+            g_settings.weather.tau_s = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(weather, "dwell")) && item->valuedouble >= 0) {
+            g_settings.weather.dwell_s = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(weather, "minElevation")) && item->valuedouble >= 0) {
+            g_settings.weather.min_elevation = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(weather, "hold")) && item->valuedouble > 0) {
+            g_settings.weather.hold_deg = item->valuedouble;
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(weather, "enable"))) {
+            g_settings.weather.enable = cJSON_IsTrue(item);
+        }
+        gimbal.triger_task_immediate();
+    }
+
+    // 解析光学精跟踪, 增益的符号决定象限方向
+    cJSON *fine = cJSON_GetObjectItem(root, "fine");
+    if (fine) {
+        cJSON *item;
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(fine, "gainX")) && std::fabs(item->valuedouble) > 0.1) {
+            g_settings.fine.gain_x_deg = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(fine, "gainY")) && std::fabs(item->valuedouble) > 0.1) {
+            g_settings.fine.gain_y_deg = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(fine, "tau")) && item->valuedouble > 0) {
+            g_settings.fine.tau_s = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(fine, "minSignal")) && item->valuedouble >= 0) {
+            g_settings.fine.min_signal = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(fine, "maxCorrection")) && item->valuedouble > 0) {
+            g_settings.fine.max_correction_deg = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(fine, "hold")) && item->valuedouble >= 0) {
+            g_settings.fine.hold_s = item->valuedouble;
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(fine, "enable"))) {
+            g_settings.fine.enable = cJSON_IsTrue(item);
+        }
+        gimbal.triger_task_immediate();
+    }
+
+    // 解析安装误差模型, 通常由 /api/v1/calibration 拟合
+    cJSON *mount = cJSON_GetObjectItem(root, "mount");
+    if (mount) {
+        struct mount_param param = g_settings.mount;
+        struct {
+            const char *name;
+            float *value;
+            float limit;
+        } fields[] = {
+            {"azOffset", &param.az_offset, 20},
+            {"pitchOffset", &param.pitch_offset, 20},
+            {"tiltN", &param.tilt_n, 20},
+            {"tiltE", &param.tilt_e, 20},
+            {"nonPerp", &param.non_perp, 20},
+            {"yawScale", &param.yaw_scale, 0.1f},
+        };
+        cJSON *item;
+        for (auto &field : fields) {
+            if (cJSON_IsNumber(item = cJSON_GetObjectItem(mount, field.name)) && std::fabs(item->valuedouble) <= field.limit) {
+                *field.value = item->valuedouble;
+            }
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(mount, "enable"))) {
+            param.enable = cJSON_IsTrue(item);
+        }
+        gimbal.applyMount(param);
+    }
+
+    // 解析定日镜, 目标为相对镜面转轴的东/北/上坐标(米)和当地时间窗口(分钟)
+    cJSON *heliostat = cJSON_GetObjectItem(root, "heliostat");
+    if (heliostat) {
+        cJSON *item;
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(heliostat, "mirrorOffset")) && item->valuedouble >= 0 &&
+                item->valuedouble < 1) {
+            g_settings.heliostat.mirror_offset_m = item->valuedouble;
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(heliostat, "enable"))) {
+            g_settings.heliostat.enable = cJSON_IsTrue(item);
+        }
+        cJSON *targets = cJSON_GetObjectItem(heliostat, "targets");
+        if (cJSON_IsArray(targets)) {
+            // the list replaces the old one
+            memset(g_settings.helio_targets, 0, sizeof(g_settings.helio_targets));
+            for (int i = 0; i < HELIOSTAT_MAX_TARGETS && i < cJSON_GetArraySize(targets); i++) {
+                cJSON *target = cJSON_GetArrayItem(targets, i);
+                heliostat_target &t = g_settings.helio_targets[i];
+                if (cJSON_IsString(item = cJSON_GetObjectItem(target, "name"))) {
+                    strlcpy(t.name, item->valuestring, sizeof(t.name));
+                }
+                t.east = cjson_get_num(target, "east");
+                t.north = cjson_get_num(target, "north");
+                t.up = cjson_get_num(target, "up");
+                t.from_min = std::min(std::max(cjson_get_num(target, "from"), 0.0), 24.0 * 60);
+                t.to_min = std::min(std::max(cjson_get_num(target, "to"), 0.0), 24.0 * 60);
+                t.enable = cJSON_IsTrue(cJSON_GetObjectItem(target, "enable"));
+                if (!(std::fabs(t.east) < 10000 && std::fabs(t.north) < 10000 && std::fabs(t.up) < 10000)) {
+                    t.enable = 0;
+                }
+            }
+        }
+        gimbal.replanHeliostat();
+    }
+
+    // 解析太阳位置算法: auto/psa/grena/spa, 大气折射和 ΔT
+    cJSON *sun = cJSON_GetObjectItem(root, "sun");
+    if (sun) {
+        cJSON *item;
+        if (cJSON_IsString(item = cJSON_GetObjectItem(sun, "algo"))) {
+            for (int algo = 0; algo < SUN_ALGO_COUNT; algo++) {
+                if (strcmp(item->valuestring, SunEngine::algo_name((sun_algo_t)algo)) == 0) {
+                    g_settings.sun.algo = algo;
+                }
+            }
+        }
+        if (cJSON_IsBool(item = cJSON_GetObjectItem(sun, "refraction"))) {
+            g_settings.sun.refraction = cJSON_IsTrue(item);
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(sun, "deltaT")) && item->valuedouble > -100 &&
+                item->valuedouble < 300) {
+            g_settings.sun.delta_t = item->valuedouble;
+        }
+        if (cJSON_IsNumber(item = cJSON_GetObjectItem(sun, "tempOffset")) && std::fabs(item->valuedouble) < 40) {
+            g_settings.sun.temp_offset = item->valuedouble;
+        }
+        // the plan holds positions of the old algorithm
+        gimbal.replanHeliostat();
+    }
+
     cJSON_Delete(root);
     httpd_resp_sendstr(req, "Post control value successfully");
     g_settings.save();
+    // a coordinator passes the site settings on to the trackers
+    fleet_push();
     return ESP_OK;
 }
 
 static esp_err_t setting_get_handler(httpd_req_t *req)
 {
+    if (request_is_cbor(req, "Accept")) {
+        control_settings_t doc;
+        settings_to_doc(&doc);
+        uint8_t *buf = (uint8_t *)http_scratch(req);
+        size_t size = control_encode(&control_settings_map, &doc, buf, SCRATCH_BUFSIZE);
+        if (size > SCRATCH_BUFSIZE) {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "settings too long");
+            return ESP_FAIL;
+        }
+        httpd_resp_set_type(req, CONTROL_CONTENT_TYPE);
+        return httpd_resp_send(req, (const char *)buf, size);
+    }
+
     httpd_resp_set_type(req, "application/json");
 
     // 创建根对象
@@ -535,6 +956,88 @@ static esp_err_t setting_get_handler(httpd_req_t *req)
     cjson_add_num_as_str(man, "yaw", g_settings.target_yaw);
     cJSON_AddItemToObject(root, "man", man);
 
+    // 创建 adc 校准数组, 顺序同 adc_signal_t
+    cJSON *adc = cJSON_CreateArray();
+    for (int i = 0; i < ADC_SIG_COUNT; i++) {
+        cJSON *cal = cJSON_CreateObject();
+        cJSON_AddNumberToObject(cal, "scale", g_settings.adcCal(i)->scale);
+        cJSON_AddNumberToObject(cal, "offset", g_settings.adcCal(i)->offset);
+        cJSON_AddBoolToObject(cal, "wired", adc_is_wired((adc_signal_t)i));
+        cJSON_AddItemToArray(adc, cal);
+    }
+    cJSON_AddItemToObject(root, "adc", adc);
+
+    // 创建电机绕组电阻数组与能量预算
+    cJSON *winding = cJSON_CreateArray();
+    for (int i = 0; i < 2; i++) {
+        cJSON_AddItemToArray(winding, cJSON_CreateNumber(g_settings.winding_ohm[i]));
+    }
+    cJSON_AddItemToObject(root, "winding", winding);
+    cJSON_AddNumberToObject(root, "energyBudget", g_settings.energy_budget_wh);
+
+    // 创建 track 对象
+    cJSON *track = cJSON_CreateObject();
+    cJSON_AddNumberToObject(track, "threshold", g_settings.track.threshold_deg);
+    cJSON_AddNumberToObject(track, "lead", g_settings.track.lead);
+    cJSON_AddNumberToObject(track, "settle", g_settings.track.settle_deg);
+    cJSON_AddBoolToObject(track, "yawLock", g_settings.track.yaw_self_lock);
+    cJSON_AddBoolToObject(track, "pitchLock", g_settings.track.pitch_self_lock);
+    cJSON_AddBoolToObject(track, "enable", g_settings.track.enable);
+    cJSON_AddItemToObject(root, "track", track);
+
+    // 创建 weather 对象
+    cJSON *weather = cJSON_CreateObject();
+    cJSON_AddNumberToObject(weather, "clear", g_settings.weather.clear_kt);
+    cJSON_AddNumberToObject(weather, "overcast", g_settings.weather.overcast_kt);
+    cJSON_AddNumberToObject(weather, "tau", g_settings.weather.tau_s);
+    cJSON_AddNumberToObject(weather, "dwell", g_settings.weather.dwell_s);
+    cJSON_AddNumberToObject(weather, "minElevation", g_settings.weather.min_elevation);
+    cJSON_AddNumberToObject(weather, "hold", g_settings.weather.hold_deg);
+    cJSON_AddBoolToObject(weather, "enable", g_settings.weather.enable);
+    cJSON_AddItemToObject(root, "weather", weather);
+
+    // 创建 fine 对象
+    cJSON *fine = cJSON_CreateObject();
+    cJSON_AddNumberToObject(fine, "gainX", g_settings.fine.gain_x_deg);
+    cJSON_AddNumberToObject(fine, "gainY", g_settings.fine.gain_y_deg);
+    cJSON_AddNumberToObject(fine, "tau", g_settings.fine.tau_s);
+    cJSON_AddNumberToObject(fine, "minSignal", g_settings.fine.min_signal);
+    cJSON_AddNumberToObject(fine, "maxCorrection", g_settings.fine.max_correction_deg);
+    cJSON_AddNumberToObject(fine, "hold", g_settings.fine.hold_s);
+    cJSON_AddBoolToObject(fine, "enable", g_settings.fine.enable);
+    cJSON_AddBoolToObject(fine, "wired", gimbal.hasSunSensor());
+    cJSON_AddItemToObject(root, "fine", fine);
+
+    // 创建 mount 对象
+    cJSON_AddItemToObject(root, "mount", mount_to_json(g_settings.mount));
+
+    // 创建 heliostat 对象
+    cJSON *heliostat = cJSON_CreateObject();
+    cJSON_AddNumberToObject(heliostat, "mirrorOffset", g_settings.heliostat.mirror_offset_m);
+    cJSON_AddBoolToObject(heliostat, "enable", g_settings.heliostat.enable);
+    cJSON *targets = cJSON_CreateArray();
+    for (const auto &t : g_settings.helio_targets) {
+        cJSON *target = cJSON_CreateObject();
+        cJSON_AddStringToObject(target, "name", t.name);
+        cJSON_AddNumberToObject(target, "east", t.east);
+        cJSON_AddNumberToObject(target, "north", t.north);
+        cJSON_AddNumberToObject(target, "up", t.up);
+        cJSON_AddNumberToObject(target, "from", t.from_min);
+        cJSON_AddNumberToObject(target, "to", t.to_min);
+        cJSON_AddBoolToObject(target, "enable", t.enable);
+        cJSON_AddItemToArray(targets, target);
+    }
+    cJSON_AddItemToObject(heliostat, "targets", targets);
+    cJSON_AddItemToObject(root, "heliostat", heliostat);
+
+    // 创建 sun 对象
+    cJSON *sun = cJSON_CreateObject();
+    cJSON_AddStringToObject(sun, "algo", SunEngine::algo_name((sun_algo_t)g_settings.sun.algo));
+    cJSON_AddBoolToObject(sun, "refraction", g_settings.sun.refraction);
+    cJSON_AddNumberToObject(sun, "deltaT", g_settings.sun.delta_t);
+    cJSON_AddNumberToObject(sun, "tempOffset", g_settings.sun.temp_offset);
+    cJSON_AddItemToObject(root, "sun", sun);
+
     // 打印 JSON 字符串
     char *json_string = cJSON_PrintUnformatted(root);
     printf("%s\n", json_string);
@@ -551,7 +1054,7 @@ static esp_err_t location_post_handler(httpd_req_t *req)
 {
     int total_len = req->content_len;
     int cur_len = 0;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
+    char *buf = http_scratch(req);
     int received = 0;
     if (total_len >= SCRATCH_BUFSIZE) {
         /* Respond with 500 Internal Server Error */
@@ -569,6 +1072,31 @@ static esp_err_t location_post_handler(httpd_req_t *req)
     }
     buf[total_len] = '\0';
 
+    if (request_is_cbor(req, "Content-Type")) {
+        control_location_t doc = {};
+        uint32_t sections = 0;
+        int ignored = 0;
+        control_status_t status = control_decode(&control_location_map, (const uint8_t *)buf, total_len, &doc,
+                                                 &sections, &ignored);
+        if (status == CONTROL_OK && doc.utc != 0) {
+            time_t utc = doc.utc;
+            struct tm tm;
+            gmtime_r(&utc, &tm);
+            gps_t gpsData;
+            gpsData.valid = true;
+            gpsData.latitude = doc.latitude;
+            gpsData.longitude = doc.longitude;
+            gpsData.date.year = tm.tm_year + 1900 - 2000;
+            gpsData.date.month = tm.tm_mon + 1;
+            gpsData.date.day = tm.tm_mday;
+            gpsData.tim.hour = tm.tm_hour;
+            gpsData.tim.minute = tm.tm_min;
+            gpsData.tim.second = tm.tm_sec;
+            gimbal.update(gpsData);
+        }
+        return send_control_reply(req, status, control_status_message(status), ignored);
+    }
+
     cJSON *root = cJSON_Parse(buf);
     if (!root) {
         printf("Error parsing JSON!\n");
@@ -601,7 +1129,7 @@ static esp_err_t sysctrl_post_handler(httpd_req_t *req)
 {
     int total_len = req->content_len;
     int cur_len = 0;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
+    char *buf = http_scratch(req);
     int received = 0;
     if (total_len >= SCRATCH_BUFSIZE) {
         /* Respond with 500 Internal Server Error */
@@ -619,6 +1147,20 @@ static esp_err_t sysctrl_post_handler(httpd_req_t *req)
     }
     buf[total_len] = '\0';
 
+    if (request_is_cbor(req, "Content-Type")) {
+        control_sysctrl_t doc = {};
+        uint32_t sections = 0;
+        int ignored = 0;
+        control_status_t status = control_decode(&control_sysctrl_map, (const uint8_t *)buf, total_len, &doc,
+                                                 &sections, &ignored);
+        send_control_reply(req, status, control_status_message(status), ignored);
+        if (status == CONTROL_OK && doc.restart) {
+            printf("Restarting...\n");
+            esp_restart();
+        }
+        return ESP_OK;
+    }
+
     cJSON *root = cJSON_Parse(buf);
     if (!root) {
         printf("Error parsing JSON!\n");
@@ -650,7 +1192,7 @@ static esp_err_t system_info_get_handler(httpd_req_t *req)
     const esp_partition_t *running = esp_ota_get_running_partition();
     esp_app_desc_t running_app_info;
     if (running && esp_ota_get_partition_description(running, &running_app_info) == ESP_OK) {
-        char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
+        char *buf = http_scratch(req);
         snprintf(buf, SCRATCH_BUFSIZE, "%s (at partition %s)", running_app_info.version, running->label);
         cJSON_AddStringToObject(root, "APP version", buf);
     }
@@ -658,6 +1200,39 @@ static esp_err_t system_info_get_handler(httpd_req_t *req)
     cJSON_AddStringToObject(root, "chip", CONFIG_IDF_TARGET);
     cJSON_AddNumberToObject(root, "cores", chip_info.cores);
     cJSON_AddStringToObject(root, "build_time", BUILD_TIMESTAMP);
+    telemetry_stats_t stats;
+    telemetry_get_stats(&stats);
+    cJSON *telemetry = cJSON_CreateObject();
+    cJSON_AddNumberToObject(telemetry, "builds", stats.builds);
+    cJSON_AddNumberToObject(telemetry, "unchanged", stats.unchanged);
+    cJSON_AddNumberToObject(telemetry, "polls", stats.polls);
+    cJSON_AddNumberToObject(telemetry, "pollCached", stats.poll_cached);
+    cJSON_AddNumberToObject(telemetry, "events", stats.events);
+    cJSON_AddNumberToObject(telemetry, "dropped", stats.dropped);
+    cJSON_AddNumberToObject(telemetry, "rejected", stats.rejected);
+    cJSON_AddNumberToObject(telemetry, "clients", stats.clients);
+    cJSON_AddNumberToObject(telemetry, "buildUs", (double)stats.build_us);
+    cJSON_AddNumberToObject(telemetry, "sendUs", (double)stats.send_us);
+    cJSON_AddNumberToObject(telemetry, "uptimeUs", (double)esp_timer_get_time());
+    cJSON_AddItemToObject(root, "telemetry", telemetry);
+    http_stats_t http;
+    http_workers_get_stats(&http);
+    cJSON *workers = cJSON_CreateObject();
+    static const char *lane_names[HTTP_LANE_COUNT] = {"control", "bulk"};
+    for (int i = 0; i < HTTP_LANE_COUNT; i++) {
+        cJSON *lane = cJSON_CreateObject();
+        cJSON_AddNumberToObject(lane, "served", http.lane[i].served);
+        cJSON_AddNumberToObject(lane, "rejected", http.lane[i].rejected);
+        cJSON_AddNumberToObject(lane, "queued", http.lane[i].queued);
+        cJSON_AddNumberToObject(lane, "peak", http.lane[i].peak);
+        cJSON_AddNumberToObject(lane, "waitUs", (double)http.lane[i].wait_us);
+        cJSON_AddNumberToObject(lane, "busyUs", (double)http.lane[i].busy_us);
+        cJSON_AddItemToObject(workers, lane_names[i], lane);
+    }
+    cJSON_AddNumberToObject(workers, "blocksUsed", http.blocks_used);
+    cJSON_AddNumberToObject(workers, "blocksPeak", http.blocks_peak);
+    cJSON_AddNumberToObject(workers, "blockWaits", http.block_waits);
+    cJSON_AddItemToObject(root, "http", workers);
     const char *sys_info = cJSON_PrintUnformatted(root);
     httpd_resp_sendstr(req, sys_info);
     free((void *)sys_info);
@@ -666,11 +1241,9 @@ static esp_err_t system_info_get_handler(httpd_req_t *req)
 }
 
 
-/* Simple handler for getting imu data */
-static esp_err_t realtime_data_get_handler(httpd_req_t *req)
+/* Realtime data document, built by the telemetry for polls and event streams */
+static char *realtime_json(void)
 {
-    httpd_resp_set_type(req, "application/json");
-
     // 创建根对象
     cJSON *root = cJSON_CreateObject();
 
@@ -693,11 +1266,42 @@ static esp_err_t realtime_data_get_handler(httpd_req_t *req)
     cJSON *panel = cJSON_CreateObject();
     cjson_add_num_as_str(panel, "SunAzimuth", gimbal.sunPosition.dAzimuth);
     cjson_add_num_as_str(panel, "SunElevation", gimbal.sunPosition.dElevation);
+    cJSON_AddStringToObject(panel, "sunAlgo", SunEngine::algo_name(gimbal.getSunEngine().get_last_algo()));
+    cjson_add_num_as_str(panel, "refraction", gimbal.getSunEngine().get_last_refraction());
     cjson_add_num_as_str(panel, "voltage", gimbal.voltage);
     cjson_add_num_as_str(panel, "temperature", gimbal.imu->getData().temperature);
     cjson_add_num_as_str(panel, "longtiude", gimbal.gps->getData().longitude);
     cjson_add_num_as_str(panel, "latitude", gimbal.gps->getData().latitude);
     cJSON_AddStringToObject(panel, "State", gimbal.getStateDescription());
+    cjson_add_num_as_str(panel, "homingTime", gimbal.getHomingTime() / 1000.0f);
+    cJSON_AddStringToObject(panel, "homingMode", gimbal.getHomingMode());
+    cjson_add_num_as_str(panel, "pointingError", gimbal.getTrackingPolicy().get_error());
+    cjson_add_num_as_str(panel, "cosineLossPpm", gimbal.getTrackingPolicy().get_cosine_loss() * 1e6f);
+    cJSON_AddNumberToObject(panel, "moves", gimbal.getTrackingPolicy().get_moves());
+    const WeatherPolicy &weather = gimbal.getWeatherPolicy();
+    cJSON_AddStringToObject(panel, "weather", WeatherPolicy::mode_name(weather.get_mode()));
+    if (std::isfinite(gimbal.getIrradiance())) {
+        cjson_add_num_as_str(panel, "irradiance", gimbal.getIrradiance());
+        cjson_add_num_as_str(panel, "clearSky", weather.get_clear_sky());
+        cjson_add_num_as_str(panel, "clearSkyIndex", weather.get_index());
+    }
+    if (gimbal.hasSunSensor()) {
+        const FineTracker &fine = gimbal.getFineTracker();
+        cJSON_AddBoolToObject(panel, "fineLocked", fine.is_locked());
+        cjson_add_num_as_str(panel, "fineSignal", fine.get_signal());
+        cjson_add_num_as_str(panel, "fineErrorX", fine.get_error_x());
+        cjson_add_num_as_str(panel, "fineErrorY", fine.get_error_y());
+        cjson_add_num_as_str(panel, "finePitch", fine.get_correction().pitch);
+        cjson_add_num_as_str(panel, "fineYaw", fine.get_correction().yaw);
+    }
+    const char *helio_target;
+    float spot_miss;
+    if (gimbal.getHeliostatSpot(&helio_target, &spot_miss)) {
+        cJSON_AddStringToObject(panel, "heliostatTarget", helio_target);
+        if (!std::isnan(spot_miss)) {
+            cjson_add_num_as_str(panel, "spotError", spot_miss);
+        }
+    }
     time_t now;
     time(&now);
     cJSON_AddNumberToObject(panel, "time", now);
@@ -706,26 +1310,658 @@ static esp_err_t realtime_data_get_handler(httpd_req_t *req)
 
     cJSON *yawmotor = cJSON_CreateObject();
     cJSON_AddStringToObject(yawmotor, "state", gimbal.yawMotor->get_state_description());
+    cJSON_AddStringToObject(yawmotor, "fault", gimbal.yawMotor->get_fault_description());
     cjson_add_num_as_str(yawmotor, "speed", gimbal.yawMotor->get_velocity());
     cjson_add_num_as_str(yawmotor, "angle", gimbal.yawMotor->get_position());
+    if (adc_is_wired(ADC_SIG_YAW_CURRENT)) {
+        cjson_add_num_as_str(yawmotor, "current", gimbal.yawMotor->get_current());
+    }
+    cjson_add_num_as_str(yawmotor, "power", energy_get_power(ENERGY_AXIS_YAW));
     cJSON_AddItemToObject(root, "YawMotor", yawmotor);
 
     cJSON *pitchmotor = cJSON_CreateObject();
     cJSON_AddStringToObject(pitchmotor, "state", gimbal.pitchMotor->get_state_description());
+    cJSON_AddStringToObject(pitchmotor, "fault", gimbal.pitchMotor->get_fault_description());
     cjson_add_num_as_str(pitchmotor, "speed", gimbal.pitchMotor->get_velocity());
     cjson_add_num_as_str(pitchmotor, "angle", gimbal.pitchMotor->get_position());
+    if (adc_is_wired(ADC_SIG_PITCH_CURRENT)) {
+        cjson_add_num_as_str(pitchmotor, "current", gimbal.pitchMotor->get_current());
+    }
+    cjson_add_num_as_str(pitchmotor, "power", energy_get_power(ENERGY_AXIS_PITCH));
     cJSON_AddItemToObject(root, "PitchMotor", pitchmotor);
 
-    // 打印 JSON 字符串
+    char *json_string = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json_string;
+}
+
+/* Simple handler for getting imu data */
+static esp_err_t realtime_data_get_handler(httpd_req_t *req)
+{
+    return telemetry_send_snapshot(req);
+}
+
+/* Server-Sent Events of the realtime data, ?interval=ms */
+static esp_err_t realtime_events_get_handler(httpd_req_t *req)
+{
+    return telemetry_subscribe(req);
+}
+
+/*
+ * Energy histograms. Each bucket carries Wh and seconds per axis and mode,
+ * indexed as [axis][mode] in the order of the "axes" and "modes" arrays.
+ */
+static cJSON *energy_bucket_to_json(const energy_bucket_t *bucket)
+{
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "start", bucket->start);
+    cJSON *wh = cJSON_CreateArray();
+    cJSON *seconds = cJSON_CreateArray();
+    for (int a = 0; a < ENERGY_AXIS_COUNT; a++) {
+        float axis_wh[ENERGY_MODE_COUNT];
+        for (int m = 0; m < ENERGY_MODE_COUNT; m++) {
+            axis_wh[m] = bucket->joule[a][m] / 3600.0f;
+        }
+        cJSON_AddItemToArray(wh, cJSON_CreateFloatArray(axis_wh, ENERGY_MODE_COUNT));
+        cJSON_AddItemToArray(seconds, cJSON_CreateFloatArray(bucket->seconds[a], ENERGY_MODE_COUNT));
+    }
+    cJSON_AddItemToObject(obj, "wh", wh);
+    cJSON_AddItemToObject(obj, "seconds", seconds);
+    return obj;
+}
+
+static cJSON *energy_ring_to_json(int (*get)(energy_bucket_t *, int), int size)
+{
+    cJSON *array = cJSON_CreateArray();
+    energy_bucket_t *buckets = (energy_bucket_t *)malloc(size * sizeof(energy_bucket_t));
+    if (buckets) {
+        int n = get(buckets, size);
+        for (int i = 0; i < n; i++) {
+            cJSON_AddItemToArray(array, energy_bucket_to_json(&buckets[i]));
+        }
+        free(buckets);
+    }
+    return array;
+}
+
+static esp_err_t energy_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+
+    cJSON *root = cJSON_CreateObject();
+    const char *axes[] = {"yaw", "pitch"};
+    cJSON_AddItemToObject(root, "axes", cJSON_CreateStringArray(axes, ENERGY_AXIS_COUNT));
+    const char *modes[ENERGY_MODE_COUNT];
+    for (int m = 0; m < ENERGY_MODE_COUNT; m++) {
+        modes[m] = energy_mode_name((energy_mode_t)m);
+    }
+    cJSON_AddItemToObject(root, "modes", cJSON_CreateStringArray(modes, ENERGY_MODE_COUNT));
+
+    float power[ENERGY_AXIS_COUNT];
+    for (int a = 0; a < ENERGY_AXIS_COUNT; a++) {
+        power[a] = energy_get_power((energy_axis_t)a);
+    }
+    cJSON_AddItemToObject(root, "power", cJSON_CreateFloatArray(power, ENERGY_AXIS_COUNT));
+    cJSON_AddNumberToObject(root, "voltage", gimbal.voltage);
+    cJSON_AddNumberToObject(root, "budget", g_settings.energy_budget_wh);
+    cJSON_AddBoolToObject(root, "overBudget", energy_over_budget());
+
+    energy_bucket_t total;
+    energy_get_total(&total);
+    cJSON_AddItemToObject(root, "total", energy_bucket_to_json(&total));
+    cJSON_AddItemToObject(root, "hours", energy_ring_to_json(energy_get_hours, ENERGY_HOURS));
+    cJSON_AddItemToObject(root, "days", energy_ring_to_json(energy_get_days, ENERGY_DAYS));
+
+    const char *json_string = cJSON_PrintUnformatted(root);
+    httpd_resp_sendstr(req, json_string);
+
+    free((void *)json_string);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+static esp_err_t energy_delete_handler(httpd_req_t *req)
+{
+    energy_clear();
+    httpd_resp_sendstr(req, "Energy history cleared");
+    return ESP_OK;
+}
+
+/*
+ * Night power state. Currents are null when the supply current is not
+ * wired to the ADC.
+ */
+static esp_err_t power_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+    power_status_t status;
+    power_get_status(&status);
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "state", power_state_name(status.state));
+    cJSON_AddNumberToObject(root, "sunrise", status.sunrise);
+    cJSON_AddNumberToObject(root, "nextWake", status.next_wake);
+    cJSON_AddNumberToObject(root, "activeCurrent", status.active_current);
+    cJSON_AddNumberToObject(root, "idleCurrent", status.idle_current);
+    cJSON_AddNumberToObject(root, "idleVoltage", status.idle_voltage);
+    cJSON_AddNumberToObject(root, "timeToTrack", status.time_to_track_ms);
+    cJSON_AddNumberToObject(root, "sleptS", status.slept_s);
+    cJSON_AddNumberToObject(root, "nights", status.nights);
     const char *json_string = cJSON_PrintUnformatted(root);
     httpd_resp_sendstr(req, json_string);
 
-    // 释放内存
     free((void *)json_string);
     cJSON_Delete(root);
     return ESP_OK;
 }
 
+/*
+ * History of tslog.h between ?from= and ?to= (unix time, included), at
+ * most ?limit= points, oldest first. Each point is [time, tier, values in
+ * the order of "channels"], null for a value not measured; "next" is where
+ * to continue when the limit cut the range. Streamed in chunks of the
+ * scratch block.
+ */
+typedef struct {
+    httpd_req_t *req;
+    char *buf;
+    size_t len;
+    int count, limit;
+    uint32_t next;
+    bool failed;
+} log_stream_t;
+
+static void log_stream_flush(log_stream_t *out)
+{
+    if (out->len > 0 && !out->failed) {
+        out->failed = httpd_resp_send_chunk(out->req, out->buf, out->len) != ESP_OK;
+    }
+    out->len = 0;
+}
+
+static void log_stream_write(log_stream_t *out, const void *data, size_t size)
+{
+    if (out->len + size > SCRATCH_BUFSIZE) {
+        log_stream_flush(out);
+    }
+    memcpy(out->buf + out->len, data, size);
+    out->len += size;
+}
+
+static void log_stream_printf(log_stream_t *out, const char *fmt, ...)
+{
+    char text[192];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    n = n < (int)sizeof(text) ? n : sizeof(text) - 1;
+    log_stream_write(out, text, n);
+}
+
+static bool log_point_visit(const tslog_point_t *point, int tier, void *ctx)
+{
+    log_stream_t *out = (log_stream_t *)ctx;
+    if (out->count == out->limit) {
+        out->next = point->time;
+        return false;
+    }
+    char text[96];
+    int n = snprintf(text, sizeof(text), "%s[%lu,%d", out->count > 0 ? "," : "", (unsigned long)point->time, tier);
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        n += std::isnan(point->value[c]) ? snprintf(text + n, sizeof(text) - n, ",null")
+             : snprintf(text + n, sizeof(text) - n, ",%g", point->value[c]);
+    }
+    log_stream_printf(out, "%s]", text);
+    out->count++;
+    return !out->failed;
+}
+
+static esp_err_t log_get_handler(httpd_req_t *req)
+{
+    tslog_stats_t stats;
+    if (!tslog_get_stats(&stats)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no tslog partition");
+        return ESP_FAIL;
+    }
+    uint32_t from = 0, to = UINT32_MAX;
+    int limit = 2000;
+    char query[64], value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "from", value, sizeof(value)) == ESP_OK) {
+            from = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK) {
+            to = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK) {
+            limit = atoi(value);
+            limit = limit < 1 ? 1 : limit > 10000 ? 10000 : limit;
+        }
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    log_stream_t out = {req, http_scratch(req), 0, 0, limit, 0, false};
+    log_stream_printf(&out, "{\"channels\":[");
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        log_stream_printf(&out, "%s\"%s\"", c > 0 ? "," : "", TsLog::channel_name(c));
+    }
+    log_stream_printf(&out, "],\"tiers\":[");
+    for (int t = 0; t < TSLOG_TIERS; t++) {
+        const tslog_tier_stats_t &tier = stats.tier[t];
+        log_stream_printf(&out, "%s{\"step\":%lu,\"oldest\":%lu,\"newest\":%lu,\"points\":%lu,\"bytes\":%lu,"
+                          "\"sectors\":%u,\"used\":%u,\"erases\":[%lu,%lu]}", t > 0 ? "," : "",
+                          (unsigned long)tier.step_s, (unsigned long)tier.oldest, (unsigned long)tier.newest,
+                          (unsigned long)tier.points, (unsigned long)tier.bytes, tier.sectors, tier.used,
+                          (unsigned long)tier.erases_min, (unsigned long)tier.erases_max);
+    }
+    log_stream_printf(&out, "],\"compactions\":%lu,\"badBlocks\":%lu,\"points\":[",
+                      (unsigned long)stats.compactions, (unsigned long)stats.bad_blocks);
+    if (from <= to) {
+        tslog_query(from, to, log_point_visit, &out);
+    }
+    if (out.next != 0) {
+        log_stream_printf(&out, "],\"next\":%lu}", (unsigned long)out.next);
+    } else {
+        log_stream_printf(&out, "],\"next\":null}");
+    }
+    log_stream_flush(&out);
+    if (out.failed) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/*
+ * The history of ?from= to ?to= (unix time, the last day by default)
+ * downsampled to at most ?points= records, see history.h for the format.
+ * The channels are named in the X-Channels header, in record order. A
+ * range outside of the history held gets the header alone.
+ */
+static bool history_emit(const history_record_t *record, void *ctx)
+{
+    log_stream_t *out = (log_stream_t *)ctx;
+    log_stream_write(out, record, sizeof(*record));
+    out->count++;
+    return !out->failed;
+}
+
+static esp_err_t history_get_handler(httpd_req_t *req)
+{
+    tslog_stats_t stats;
+    if (!tslog_get_stats(&stats)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no tslog partition");
+        return ESP_FAIL;
+    }
+    uint32_t to = (uint32_t)time(NULL);
+    uint32_t from = to - 86400;
+    int points = 500;
+    char query[64], value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "from", value, sizeof(value)) == ESP_OK) {
+            from = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK) {
+            to = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "points", value, sizeof(value)) == ESP_OK) {
+            points = atoi(value);
+        }
+    }
+
+    char channels[96];
+    int n = 0;
+    for (int c = 0; c < TSLOG_CHANNEL_COUNT; c++) {
+        n += snprintf(channels + n, sizeof(channels) - n, "%s%s", c > 0 ? "," : "", TsLog::channel_name(c));
+    }
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "X-Channels", channels);
+
+    history_header_t header = {HISTORY_MAGIC, HISTORY_VERSION, TSLOG_CHANNEL_COUNT, sizeof(history_record_t), from, to};
+    log_stream_t out = {req, http_scratch(req), 0, 0, 0, 0, false};
+    log_stream_write(&out, &header, sizeof(header));
+    if (from <= to && history_range(&from, &to)) {
+        history_downsample(from, to, points, history_emit, &out);
+    }
+    log_stream_flush(&out);
+    if (out.failed) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/*
+ * The flight recorder, see recorder.h for the format; tools/replay runs
+ * it. Recording pauses during the download so the frames stay consistent,
+ * and until the last of two concurrent downloads on the bulk lane ends.
+ * DELETE drops the frames and a fault that froze the ring.
+ */
+static esp_err_t record_get_handler(httpd_req_t *req)
+{
+    if (CONFIG_RECORDER_KB == 0) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "recorder disabled");
+        return ESP_FAIL;
+    }
+    rec_header_t header;
+    recorder_pause(&header);
+    header.settings_size = sizeof(Setting);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"record.bin\"");
+
+    log_stream_t out = {req, http_scratch(req), 0, 0, 0, 0, false};
+    static_assert(sizeof(rec_header_t) + sizeof(Setting) <= SCRATCH_BUFSIZE, "settings span chunks");
+    log_stream_write(&out, &header, sizeof(header));
+    log_stream_write(&out, &g_settings, sizeof(Setting));
+    log_stream_flush(&out);
+    size_t offset = 0;
+    while (!out.failed && (out.len = recorder_read(offset, out.buf, SCRATCH_BUFSIZE)) > 0) {
+        offset += out.len;
+        log_stream_flush(&out);
+    }
+    recorder_resume();
+    if (out.failed) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t record_delete_handler(httpd_req_t *req)
+{
+    recorder_clear();
+    httpd_resp_sendstr(req, "Recording cleared");
+    return ESP_OK;
+}
+
+/*
+ * Timing of the control loop stages, see loop_bench.h; tools/bench --check
+ * applies the budgets to a saved report. DELETE starts over.
+ */
+static esp_err_t bench_get_handler(httpd_req_t *req)
+{
+#ifdef CONFIG_LOOP_BENCH
+    // the ticks in between may fill more buckets, room for a few of them
+    size_t size = loop_bench_report(NULL, 0) + 256;
+    char *json = (char *)malloc(size);
+    if (json == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "out of memory");
+        return ESP_FAIL;
+    }
+    if (loop_bench_report(json, size) >= size) {
+        free(json);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "report changed, try again");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_sendstr(req, json);
+    free(json);
+    return err;
+#else
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "loop benchmark disabled");
+    return ESP_FAIL;
+#endif
+}
+
+static esp_err_t bench_delete_handler(httpd_req_t *req)
+{
+#ifdef CONFIG_LOOP_BENCH
+    loop_bench_reset();
+    httpd_resp_sendstr(req, "Benchmark reset");
+    return ESP_OK;
+#else
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "loop benchmark disabled");
+    return ESP_FAIL;
+#endif
+}
+
+static void profile_heap_printf(log_stream_t *out, const char *key, const profile_heap_t &heap)
+{
+    if (heap.total == 0) {
+        log_stream_printf(out, ",\"%s\":null", key);
+        return;
+    }
+    log_stream_printf(out, ",\"%s\":{\"total\":%lu,\"free\":%lu,\"largest\":%lu,\"minFree\":%lu,"
+                      "\"fragmentation\":%.1f}", key, (unsigned long)heap.total, (unsigned long)heap.free,
+                      (unsigned long)heap.largest, (unsigned long)heap.min_free,
+                      TaskProfiler::fragmentation(heap) / 10.0);
+}
+
+/*
+ * Task and heap profile, see profiler.h. CPU and busy are percent of all
+ * cores over the last period, switches per second. Each point of the
+ * history is [values in the order of "columns", CPU percent by task
+ * slot], oldest first. Streamed in chunks of the scratch block.
+ */
+static esp_err_t profile_get_handler(httpd_req_t *req)
+{
+    profile_status_t status;
+    if (!profiler_get_status(&status)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "profiler disabled");
+        return ESP_FAIL;
+    }
+    profile_task_t *tasks = (profile_task_t *)malloc(PROFILER_MAX_TASKS * sizeof(profile_task_t));
+    profile_point_t *points = (profile_point_t *)malloc(CONFIG_PROFILER_HISTORY * sizeof(profile_point_t));
+    if (tasks == NULL || points == NULL) {
+        free(tasks);
+        free(points);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "out of memory");
+        return ESP_FAIL;
+    }
+    int task_count = profiler_get_tasks(tasks, PROFILER_MAX_TASKS);
+    int point_count = profiler_get_history(points, CONFIG_PROFILER_HISTORY);
+    const profile_point_t &last = status.last;
+
+    httpd_resp_set_type(req, "application/json");
+    log_stream_t out = {req, http_scratch(req), 0, 0, 0, 0, false};
+    log_stream_printf(&out, "{\"period\":%lu,\"cores\":%d,\"samples\":%d,\"dropped\":%d,\"uptime\":%lu,"
+                      "\"busy\":%.1f,\"switches\":%u,\"stackMin\":%lu", (unsigned long)status.period_s,
+                      status.cores, status.samples, status.dropped, (unsigned long)last.uptime_s, last.busy / 10.0,
+                      last.switches, (unsigned long)last.stack_min);
+    profile_heap_printf(&out, "heap", status.heap);
+    profile_heap_printf(&out, "psram", status.psram);
+    log_stream_printf(&out, ",\"tasks\":[");
+    for (int i = 0; i < task_count; i++) {
+        const profile_task_t &t = tasks[i];
+        log_stream_printf(&out, "%s{\"slot\":%d,\"name\":\"%s\",\"alive\":%s,\"priority\":%u,", i > 0 ? "," : "",
+                          i, t.name, t.alive ? "true" : "false", t.priority);
+        log_stream_printf(&out, "\"cpu\":%.1f,\"cpuPeak\":%.1f,\"stackFree\":%lu,\"switches\":%lu,\"starved\":%lu}",
+                          t.cpu / 10.0, t.cpu_peak / 10.0, (unsigned long)t.stack_free, (unsigned long)t.switches,
+                          (unsigned long)t.starved);
+    }
+    log_stream_printf(&out, "],\"columns\":[\"uptime\",\"busy\",\"switches\",\"heapFree\",\"heapLargest\","
+                      "\"psramFree\",\"psramLargest\",\"stackMin\"],\"history\":[");
+    for (int i = 0; i < point_count && !out.failed; i++) {
+        const profile_point_t &p = points[i];
+        log_stream_printf(&out, "%s[%lu,%.1f,%u,%lu,%lu,%lu,%lu,%lu,[", i > 0 ? "," : "", (unsigned long)p.uptime_s,
+                          p.busy / 10.0, p.switches, (unsigned long)p.heap_free, (unsigned long)p.heap_largest,
+                          (unsigned long)p.psram_free, (unsigned long)p.psram_largest, (unsigned long)p.stack_min);
+        char text[4 * PROFILER_MAX_TASKS + 4] = "";
+        int n = 0;
+        for (int s = 0; s < task_count; s++) {
+            n += snprintf(text + n, sizeof(text) - n, "%s%u", s > 0 ? "," : "", p.cpu[s]);
+        }
+        log_stream_printf(&out, "%s]]", text);
+    }
+    log_stream_printf(&out, "]}");
+    log_stream_flush(&out);
+    free(tasks);
+    free(points);
+    if (out.failed) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/*
+ * Fleet roster of a coordinator, see fleet.h. POST pushes the ephemeris
+ * table and the site settings to the trackers again.
+ */
+static esp_err_t fleet_get_handler(httpd_req_t *req)
+{
+    // the control lane runs two of these at once, the roster is copied to the request's own block
+    static_assert(sizeof(fleet_member_t) * FLEET_MAX_TRACKERS <= SCRATCH_BUFSIZE, "roster exceeds the scratch");
+    fleet_member_t *members = (fleet_member_t *)http_scratch(req);
+    uint32_t push;
+    fleet_stats_t stats;
+    int count = fleet_get_roster(members, FLEET_MAX_TRACKERS, &push, &stats);
+    int64_t now = fleet_now_ms();
+
+    httpd_resp_set_type(req, "application/json");
+    cJSON *root = cJSON_CreateObject();
+#if CONFIG_FLEET_ROLE_COORDINATOR
+    cJSON_AddStringToObject(root, "role", "coordinator");
+#elif CONFIG_FLEET_ROLE_TRACKER
+    cJSON_AddStringToObject(root, "role", "tracker");
+#else
+    cJSON_AddStringToObject(root, "role", "none");
+#endif
+    cJSON_AddNumberToObject(root, "push", push);
+    cJSON_AddNumberToObject(root, "bursts", stats.bursts);
+    cJSON_AddNumberToObject(root, "repairs", stats.repairs);
+    cJSON_AddNumberToObject(root, "chunksSent", stats.chunks);
+    cJSON_AddNumberToObject(root, "heartbeats", stats.heartbeats);
+    cJSON_AddNumberToObject(root, "bytes", stats.bytes);
+
+    cJSON *list = cJSON_AddArrayToObject(root, "members");
+    for (int i = 0; i < count; i++) {
+        const fleet_member_t &m = members[i];
+        const fleet_heartbeat_t &hb = m.last;
+        cJSON *member = cJSON_CreateObject();
+        char text[20];
+        snprintf(text, sizeof(text), "%02x%02x%02x%02x%02x%02x", m.id[0], m.id[1], m.id[2], m.id[3], m.id[4],
+                 m.id[5]);
+        cJSON_AddStringToObject(member, "id", text);
+        const uint8_t *ip = (const uint8_t *)&m.addr;
+        snprintf(text, sizeof(text), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+        cJSON_AddStringToObject(member, "ip", text);
+        cJSON_AddBoolToObject(member, "discovered", m.discovered);
+        cJSON_AddBoolToObject(member, "online", FleetRoster::is_online(m, now));
+        if (m.seen_ms == 0) {
+            cJSON_AddItemToArray(list, member);
+            continue;
+        }
+        cJSON_AddNumberToObject(member, "age", (now - m.seen_ms) / 1000);
+        cJSON_AddNumberToObject(member, "state", hb.state);
+        cJSON_AddBoolToObject(member, "current", push != 0 && hb.handled == push);
+        cJSON_AddBoolToObject(member, "rejected", hb.flags & FLEET_HB_REJECTED);
+        // chunks of a push still being collected
+        cJSON_AddNumberToObject(member, "received", hb.receiving != 0 ? __builtin_popcount(hb.have) : 0);
+        cJSON_AddBoolToObject(member, "gps", hb.flags & FLEET_HB_GPS);
+        cJSON_AddBoolToObject(member, "sunUp", hb.flags & FLEET_HB_SUN_UP);
+        cJSON_AddBoolToObject(member, "fault", hb.flags & FLEET_HB_FAULT);
+        cJSON_AddBoolToObject(member, "table", hb.flags & FLEET_HB_TABLE);
+        cJSON_AddBoolToObject(member, "overBudget", hb.flags & FLEET_HB_BUDGET);
+        cJSON_AddNumberToObject(member, "yaw", hb.yaw / 10.0);
+        cJSON_AddNumberToObject(member, "pitch", hb.pitch / 10.0);
+        cJSON_AddNumberToObject(member, "pointingError", hb.error / 100.0);
+        cJSON_AddNumberToObject(member, "voltage", hb.supply_mv / 1000.0);
+        cJSON_AddNumberToObject(member, "energyToday", hb.energy_wh / 10.0);
+        cJSON_AddNumberToObject(member, "uptime", hb.uptime_s);
+        cJSON_AddItemToArray(list, member);
+    }
+    const char *json_string = cJSON_PrintUnformatted(root);
+    httpd_resp_sendstr(req, json_string);
+
+    free((void *)json_string);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+static esp_err_t fleet_post_handler(httpd_req_t *req)
+{
+    if (fleet_push() != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "not the fleet coordinator");
+        return ESP_FAIL;
+    }
+    httpd_resp_sendstr(req, "Push started");
+    return ESP_OK;
+}
+
+/*
+ * Mount calibration. GET tells how many observations there are, POST takes
+ * {"action": "sample" | "solve" | "apply" | "clear"}. "sample" records the
+ * axes as centered by hand, "solve" fits the model and "apply" also makes
+ * it the one in use.
+ */
+static esp_err_t calibration_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "samples", gimbal.getMountSamples());
+    cJSON_AddBoolToObject(root, "sunSensor", gimbal.hasSunSensor());
+    cJSON_AddItemToObject(root, "mount", mount_to_json(g_settings.mount));
+    const char *json_string = cJSON_PrintUnformatted(root);
+    httpd_resp_sendstr(req, json_string);
+
+    free((void *)json_string);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+static esp_err_t calibration_post_handler(httpd_req_t *req)
+{
+    int total_len = req->content_len;
+    int cur_len = 0;
+    char *buf = http_scratch(req);
+    int received = 0;
+    if (total_len >= SCRATCH_BUFSIZE) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "content too long");
+        return ESP_FAIL;
+    }
+    while (cur_len < total_len) {
+        received = httpd_req_recv(req, buf + cur_len, total_len);
+        if (received <= 0) {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to post calibration");
+            return ESP_FAIL;
+        }
+        cur_len += received;
+    }
+    buf[total_len] = '\0';
+
+    cJSON *root = cJSON_Parse(buf);
+    if (!root) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error parsing JSON!");
+        return ESP_FAIL;
+    }
+    cJSON *action = cJSON_GetObjectItem(root, "action");
+    const char *name = cJSON_IsString(action) ? action->valuestring : "";
+    cJSON *reply = cJSON_CreateObject();
+    if (strcmp(name, "sample") == 0) {
+        if (!gimbal.sampleMount()) {
+            cJSON_AddStringToObject(reply, "error", "sun below the horizon or gimbal not running");
+        }
+    } else if (strcmp(name, "solve") == 0 || strcmp(name, "apply") == 0) {
+        struct mount_param param;
+        struct mount_fit fit;
+        bool ok = gimbal.solveMount(&param, &fit);
+        cJSON_AddNumberToObject(reply, "iterations", fit.iterations);
+        cJSON_AddNumberToObject(reply, "rmsBefore", fit.rms_before);
+        cJSON_AddNumberToObject(reply, "rmsAfter", fit.rms_after);
+        cJSON_AddItemToObject(reply, "sigma", cJSON_CreateFloatArray(fit.sigma, MOUNT_PARAM_COUNT));
+        if (ok) {
+            cJSON_AddItemToObject(reply, "fitted", mount_to_json(param));
+            if (strcmp(name, "apply") == 0) {
+                param.enable = 1;
+                gimbal.applyMount(param);
+                g_settings.save();
+            }
+        } else {
+            cJSON_AddStringToObject(reply, "error", "too few observations or no fit");
+        }
+    } else if (strcmp(name, "clear") == 0) {
+        gimbal.clearMount();
+    } else {
+        cJSON_AddStringToObject(reply, "error", "unknown action");
+    }
+    cJSON_AddNumberToObject(reply, "samples", gimbal.getMountSamples());
+    cJSON_Delete(root);
+
+    httpd_resp_set_type(req, "application/json");
+    const char *json_string = cJSON_PrintUnformatted(reply);
+    httpd_resp_sendstr(req, json_string);
+    free((void *)json_string);
+    cJSON_Delete(reply);
+    return ESP_OK;
+}
 
 WebServer::WebServer(const char *base_path)
 {
@@ -745,40 +1981,68 @@ esp_err_t WebServer::on(const char *url, httpd_method_t method, httpd_uri_handle
         .handler = handler,
         .user_ctx = user_ctx,
     };
-    return httpd_register_uri_handler(server, &_uri);
+    esp_err_t err = httpd_register_uri_handler(server, &_uri);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Register %s failed: %s", url, esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t WebServer::on(const char *url, httpd_method_t method, http_lane_t lane, httpd_uri_handler_t handler)
+{
+    esp_err_t err = http_workers_register(server, url, method, lane, handler, (void *)base_path);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Register %s failed: %s", url, esp_err_to_name(err));
+    }
+    return err;
 }
 
 esp_err_t WebServer::start()
 {
-    rest_server_context_t *rest_context = NULL;
     httpd_config_t config;
 
     REST_CHECK(base_path, "wrong base path", err);
-
-    rest_context = (rest_server_context_t *)calloc(1, sizeof(rest_server_context_t));
-    REST_CHECK(rest_context, "No memory for rest context", err);
-    strlcpy(rest_context->base_path, base_path, sizeof(rest_context->base_path));
+    REST_CHECK(http_workers_init() == ESP_OK, "Start workers failed", err);
 
     config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 10; // Increase the number of URI handlers if needed
+    // the routes below and room for more, on() logs a route past the limit
+    config.max_uri_handlers = 32;
     config.uri_match_fn = httpd_uri_match_wildcard;
+    // event streams hold their sockets, idle keep-alive connections make room
+    config.lru_purge_enable = true;
+
+    telemetry_init(realtime_json);
 
     ESP_LOGI(TAG, "Starting HTTP Server");
-    REST_CHECK(httpd_start(&server, &config) == ESP_OK, "Start server failed", err_start);
-
-    on("/api/v1/sysinfo", HTTP_GET, system_info_get_handler, rest_context);
-    on("/api/v1/setting", HTTP_GET, setting_get_handler, rest_context);
-    on("/api/v1/setting", HTTP_POST, setting_post_handler, rest_context);
-    on("/api/v1/firmware/update", HTTP_POST, firmware_update_post_handler, rest_context);
-    on("/api/v1/webdata/update", HTTP_POST, webdata_update_post_handler, rest_context);
-    on("/api/v1/sysctrl", HTTP_POST, sysctrl_post_handler, rest_context);
-    on("/api/v1/location", HTTP_POST, location_post_handler, rest_context);
-    on("/api/v1/temp/raw", HTTP_GET, realtime_data_get_handler, rest_context);
-    on("/*", HTTP_GET, rest_common_get_handler, rest_context);
+    REST_CHECK(httpd_start(&server, &config) == ESP_OK, "Start server failed", err);
+
+    on("/api/v1/sysinfo", HTTP_GET, HTTP_LANE_CONTROL, system_info_get_handler);
+    on("/api/v1/setting", HTTP_GET, HTTP_LANE_CONTROL, setting_get_handler);
+    on("/api/v1/setting", HTTP_POST, HTTP_LANE_CONTROL, setting_post_handler);
+    on("/api/v1/firmware/update", HTTP_POST, HTTP_LANE_BULK, firmware_update_post_handler);
+    on("/api/v1/webdata/update", HTTP_POST, HTTP_LANE_BULK, webdata_update_post_handler);
+    on("/api/v1/sysctrl", HTTP_POST, HTTP_LANE_CONTROL, sysctrl_post_handler);
+    on("/api/v1/location", HTTP_POST, HTTP_LANE_CONTROL, location_post_handler);
+    on("/api/v1/temp/raw", HTTP_GET, HTTP_LANE_CONTROL, realtime_data_get_handler);
+    // detaches itself, runs in the httpd task
+    on("/api/v1/events", HTTP_GET, realtime_events_get_handler, NULL);
+    on("/api/v1/energy", HTTP_GET, HTTP_LANE_CONTROL, energy_get_handler);
+    on("/api/v1/energy", HTTP_DELETE, HTTP_LANE_CONTROL, energy_delete_handler);
+    on("/api/v1/power", HTTP_GET, HTTP_LANE_CONTROL, power_get_handler);
+    on("/api/v1/log", HTTP_GET, HTTP_LANE_BULK, log_get_handler);
+    on("/api/v1/history", HTTP_GET, HTTP_LANE_BULK, history_get_handler);
+    on("/api/v1/record", HTTP_GET, HTTP_LANE_BULK, record_get_handler);
+    on("/api/v1/record", HTTP_DELETE, HTTP_LANE_CONTROL, record_delete_handler);
+    on("/api/v1/bench", HTTP_GET, HTTP_LANE_CONTROL, bench_get_handler);
+    on("/api/v1/bench", HTTP_DELETE, HTTP_LANE_CONTROL, bench_delete_handler);
+    on("/api/v1/profile", HTTP_GET, HTTP_LANE_CONTROL, profile_get_handler);
+    on("/api/v1/calibration", HTTP_GET, HTTP_LANE_CONTROL, calibration_get_handler);
+    on("/api/v1/calibration", HTTP_POST, HTTP_LANE_CONTROL, calibration_post_handler);
+    on("/api/v1/fleet", HTTP_GET, HTTP_LANE_CONTROL, fleet_get_handler);
+    on("/api/v1/fleet", HTTP_POST, HTTP_LANE_CONTROL, fleet_post_handler);
+    on("/*", HTTP_GET, HTTP_LANE_BULK, rest_common_get_handler);
 
     return ESP_OK;
-err_start:
-    free(rest_context);
 err:
     return ESP_FAIL;
 }
@@ -11,6 +11,8 @@
 #include "gimbal.h"
 #include "observer.hpp"
 #include "esp_http_server.h"
+#include "http_workers.h"
+#include "control_api.h"
 
 
 typedef esp_err_t (*httpd_uri_handler_t)(httpd_req_t *r);
@@ -22,6 +24,8 @@ public:
     esp_err_t start();
     esp_err_t stop();
     esp_err_t on(const char*url, httpd_method_t method, httpd_uri_handler_t handler, void* user_ctx);
+    // the handler runs on a worker of the lane, with its own scratch block
+    esp_err_t on(const char*url, httpd_method_t method, http_lane_t lane, httpd_uri_handler_t handler);
 
 private:
     /* data */
@@ -31,6 +35,18 @@ private:
 
 extern Gimbal gimbal;
 
+/**
+ * @brief Apply a CBOR settings command and save the settings, as POST /api/v1/setting does
+ * @param ignored values out of range
+ */
+control_status_t rest_apply_settings(const uint8_t *body, size_t len, int *ignored);
+
+/**
+ * @brief The site wide settings as a CBOR settings command, see control_site_map
+ * @return its size, larger than cap when it did not fit
+ */
+size_t rest_encode_site_settings(uint8_t *buf, size_t cap);
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "lwip/sockets.h"
+#include "telemetry.h"
+
+static const char *TAG = "telemetry";
+
+// the event text "id: <seq>\ndata: <json>\n\n", shared until the last reader lets go
+typedef struct {
+    int refs;
+    uint32_t seq;
+    uint32_t crc;
+    const char *json;
+    size_t json_len;
+    size_t event_len;
+    char text[];
+} snapshot_t;
+
+typedef struct {
+    httpd_req_t *req;           // detached request, NULL for a free slot
+    int64_t interval_us;
+    int64_t next_us;            // earliest time of the next event
+    int64_t last_us;            // time of the last send, for the keepalive
+    uint32_t seq;               // snapshot last sent
+} stream_t;
+
+static telemetry_build_t s_build = NULL;
+static SemaphoreHandle_t s_lock = NULL;
+static TaskHandle_t s_task = NULL;
+static snapshot_t *s_current = NULL;
+static int64_t s_built_us = 0;
+static uint32_t s_seq = 0;
+static stream_t s_streams[TELEMETRY_MAX_CLIENTS];
+static telemetry_stats_t s_stats;
+
+static void release(snapshot_t *snap)
+{
+    if (snap != NULL && --snap->refs == 0) {
+        free(snap);
+    }
+}
+
+// with s_lock held; an unchanged document keeps the old snapshot and its seq
+static void refresh(int64_t now)
+{
+    char *json = s_build();
+    s_built_us = now;
+    s_stats.builds++;
+    s_stats.build_us += esp_timer_get_time() - now;
+    if (json == NULL) {
+        return;
+    }
+    size_t len = strlen(json);
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)json, len);
+    if (s_current != NULL && s_current->crc == crc && s_current->json_len == len) {
+        s_stats.unchanged++;
+        free(json);
+        return;
+    }
+    snapshot_t *snap = (snapshot_t *)malloc(sizeof(snapshot_t) + 24 + len + 3);
+    if (snap == NULL) {
+        free(json);
+        return;
+    }
+    snap->refs = 1;
+    snap->seq = ++s_seq;
+    snap->crc = crc;
+    int head = snprintf(snap->text, 24, "id: %lu\ndata: ", (unsigned long)snap->seq);
+    memcpy(snap->text + head, json, len);
+    memcpy(snap->text + head + len, "\n\n", 3);
+    snap->json = snap->text + head;
+    snap->json_len = len;
+    snap->event_len = head + len + 2;
+    free(json);
+    release(s_current);
+    s_current = snap;
+}
+
+// the latest snapshot, refreshed when stale, to be released by the caller
+static snapshot_t *acquire(int64_t now, bool poll)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_current == NULL || now - s_built_us >= TELEMETRY_PERIOD_MS * 1000LL) {
+        refresh(now);
+    } else if (poll) {
+        s_stats.poll_cached++;
+    }
+    s_stats.polls += poll;
+    snapshot_t *snap = s_current;
+    if (snap != NULL) {
+        snap->refs++;
+    }
+    xSemaphoreGive(s_lock);
+    return snap;
+}
+
+static void telemetry_task(void *arg)
+{
+    while (true) {
+        if (s_stats.clients == 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        vTaskDelay(pdMS_TO_TICKS(TELEMETRY_PERIOD_MS));
+        int64_t now = esp_timer_get_time();
+        snapshot_t *snap = acquire(now, false);
+        for (stream_t &stream : s_streams) {
+            // only this task frees a slot, the request stays valid
+            httpd_req_t *req = stream.req;
+            if (req == NULL) {
+                continue;
+            }
+            bool event = snap != NULL && snap->seq != stream.seq && now >= stream.next_us;
+            if (!event && now - stream.last_us < TELEMETRY_KEEPALIVE_MS * 1000LL) {
+                continue;
+            }
+            int64_t start = esp_timer_get_time();
+            esp_err_t err = event ? httpd_resp_send_chunk(req, snap->text, snap->event_len)
+                                  : httpd_resp_send_chunk(req, ":\n\n", 3);
+            int64_t end = esp_timer_get_time();
+            if (err != ESP_OK) {
+                httpd_req_async_handler_complete(req);
+            }
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            s_stats.send_us += end - start;
+            if (err != ESP_OK) {
+                stream.req = NULL;
+                s_stats.clients--;
+                s_stats.dropped++;
+            } else {
+                stream.last_us = end;
+                if (event) {
+                    stream.seq = snap->seq;
+                    stream.next_us = now + stream.interval_us;
+                    s_stats.events++;
+                }
+            }
+            xSemaphoreGive(s_lock);
+            if (err != ESP_OK) {
+                ESP_LOGI(TAG, "stream closed, %u left", s_stats.clients);
+            }
+        }
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        release(snap);
+        xSemaphoreGive(s_lock);
+    }
+}
+
+void telemetry_init(telemetry_build_t build)
+{
+    s_build = build;
+    s_lock = xSemaphoreCreateMutex();
+    xTaskCreate(telemetry_task, "telemetry", 4096, NULL, 4, &s_task);
+}
+
+esp_err_t telemetry_send_snapshot(httpd_req_t *req)
+{
+    snapshot_t *snap = acquire(esp_timer_get_time(), true);
+    if (snap == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no telemetry");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = httpd_resp_send(req, snap->json, snap->json_len);
+    int64_t end = esp_timer_get_time();
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_stats.send_us += end - start;
+    release(snap);
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+esp_err_t telemetry_subscribe(httpd_req_t *req)
+{
+    int interval_ms = TELEMETRY_DEFAULT_INTERVAL_MS;
+    char query[32], value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "interval", value, sizeof(value)) == ESP_OK) {
+        interval_ms = atoi(value);
+        interval_ms = interval_ms < TELEMETRY_MIN_INTERVAL_MS ? TELEMETRY_MIN_INTERVAL_MS
+                      : interval_ms > TELEMETRY_MAX_INTERVAL_MS ? TELEMETRY_MAX_INTERVAL_MS : interval_ms;
+    }
+
+    // reserve a slot before the request is detached
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool full = s_stats.clients >= TELEMETRY_MAX_CLIENTS;
+    if (full) {
+        s_stats.rejected++;
+    } else {
+        s_stats.clients++;
+    }
+    xSemaphoreGive(s_lock);
+    if (full) {
+        // EventSource gives up on a 503, the dashboard falls back to polling
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "too many event streams");
+        return ESP_OK;
+    }
+
+    httpd_req_t *stream_req = NULL;
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if (httpd_resp_sendstr_chunk(req, "retry: 3000\n\n") != ESP_OK ||
+            httpd_req_async_handler_begin(req, &stream_req) != ESP_OK) {
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        s_stats.clients--;
+        xSemaphoreGive(s_lock);
+        return ESP_FAIL;
+    }
+
+    // the socket is the stream's alone now, a send to a stalled client fails quickly
+    struct timeval timeout = {0, TELEMETRY_SEND_TIMEOUT_MS * 1000};
+    if (setsockopt(httpd_req_to_sockfd(stream_req), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+        ESP_LOGW(TAG, "no send timeout, a stalled client blocks the others");
+    }
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (stream_t &stream : s_streams) {
+        if (stream.req == NULL) {
+            stream = {stream_req, interval_ms * 1000LL, 0, now, 0};
+            break;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    ESP_LOGI(TAG, "stream opened, every %d ms, %u open", interval_ms, s_stats.clients);
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+void telemetry_get_stats(telemetry_stats_t *stats)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_lock);
+}
@@ -0,0 +1,71 @@
+/*
+   Realtime telemetry for the dashboards.
+
+   The JSON of /api/v1/temp/raw is built at most once per
+   TELEMETRY_PERIOD_MS and shared by every reader:
+   - GET /api/v1/temp/raw returns the latest snapshot, built on demand when
+     it is older than the period, so polling dashboards no longer cost a
+     build each;
+   - GET /api/v1/events is a Server-Sent Events stream. The request is
+     detached from the httpd task and the telemetry task pushes a snapshot
+     only when it differs from the last one sent to that client, and not
+     more often than the client's ?interval= (ms, default
+     TELEMETRY_DEFAULT_INTERVAL_MS). Idle streams get a comment every
+     TELEMETRY_KEEPALIVE_MS. One task sends to every stream, so a send
+     times out after TELEMETRY_SEND_TIMEOUT_MS instead of the seconds of
+     httpd: a client that stops reading fills its socket buffer and is
+     dropped, the others keep their rate.
+   The counters of telemetry_get_stats() are what tools/loadtest reads to
+   put a CPU cost on each client.
+*/
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#define TELEMETRY_PERIOD_MS             100
+#define TELEMETRY_MAX_CLIENTS           3       // of the 7 sockets of httpd
+#define TELEMETRY_DEFAULT_INTERVAL_MS   250
+#define TELEMETRY_MIN_INTERVAL_MS       100
+#define TELEMETRY_MAX_INTERVAL_MS       10000
+#define TELEMETRY_KEEPALIVE_MS          15000
+#define TELEMETRY_SEND_TIMEOUT_MS       50
+
+// a JSON document from cJSON_PrintUnformatted(), freed by the telemetry
+typedef char *(*telemetry_build_t)(void);
+
+typedef struct {
+    uint32_t builds;            // snapshots built
+    uint32_t unchanged;         // builds equal to the snapshot before
+    uint32_t polls;             // GET /api/v1/temp/raw
+    uint32_t poll_cached;       // polls answered without a build
+    uint32_t events;            // snapshots pushed to streams
+    uint32_t dropped;           // streams closed on a failed send
+    uint32_t rejected;          // streams refused, all slots taken
+    uint8_t clients;            // open streams
+    uint64_t build_us;          // time spent building snapshots
+    uint64_t send_us;           // time spent sending polls and events
+} telemetry_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void telemetry_init(telemetry_build_t build);
+
+/**
+ * @brief Answer a poll with the latest snapshot
+ */
+esp_err_t telemetry_send_snapshot(httpd_req_t *req);
+
+/**
+ * @brief Turn the request into an event stream, 503 when all slots are taken
+ */
+esp_err_t telemetry_subscribe(httpd_req_t *req);
+
+void telemetry_get_stats(telemetry_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
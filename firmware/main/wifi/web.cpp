@@ -6,6 +6,7 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+#include <atomic>
 #include "sdkconfig.h"
 #include "driver/gpio.h"
 #include "esp_vfs_semihost.h"
@@ -21,10 +22,12 @@
 #include "lwip/inet.h"
 #include "esp_mac.h"
 #include "esp_wifi.h"
+#include "esp_timer.h"
 #if CONFIG_EXAMPLE_WEB_DEPLOY_SD
 #include "driver/sdmmc_host.h"
 #endif
 #include "rest_server.h"
+#include "fleet.h"
 
 #define MDNS_INSTANCE "esp home web server"
 
@@ -128,17 +131,41 @@ esp_err_t init_fs(void)
 #define EXAMPLE_ESP_WIFI_SSID "ESP32"
 #define EXAMPLE_ESP_WIFI_PASS ""
 
+#ifndef CONFIG_WIFI_AP_NIGHT_PERIOD_MIN
+#define CONFIG_WIFI_AP_NIGHT_PERIOD_MIN     30
+#endif
+#ifndef CONFIG_WIFI_AP_NIGHT_ON_MIN
+#define CONFIG_WIFI_AP_NIGHT_ON_MIN         5
+#endif
+
+static std::atomic<int> s_stations{0}; // associated to the access point
+static bool s_night = false;
+static bool s_ap_on = true;
+static int64_t s_night_us = 0;          // esp_timer time the night started
+
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data)
 {
-    if (event_id == WIFI_EVENT_AP_STACONNECTED) {
+    if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+        ESP_LOGI(TAG, "got ip: " IPSTR, IP2STR(&event->ip_info.ip));
+    } else if (event_id == WIFI_EVENT_STA_START) {
+        esp_wifi_connect();
+    } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        ESP_LOGW(TAG, "disconnected from AP, reconnecting");
+        esp_wifi_connect();
+    } else if (event_id == WIFI_EVENT_AP_STACONNECTED) {
         wifi_event_ap_staconnected_t *event = (wifi_event_ap_staconnected_t *)event_data;
         ESP_LOGI(TAG, "station " MACSTR " join, AID=%d",
                  MAC2STR(event->mac), event->aid);
+        s_stations++;
     } else if (event_id == WIFI_EVENT_AP_STADISCONNECTED) {
         wifi_event_ap_stadisconnected_t *event = (wifi_event_ap_stadisconnected_t *)event_data;
         ESP_LOGI(TAG, "station " MACSTR " leave, AID=%d, reason=%d",
                  MAC2STR(event->mac), event->aid, event->reason);
+        if (s_stations > 0) {
+            s_stations--;
+        }
     }
 }
 
@@ -182,6 +209,84 @@ static void wifi_init_softap(void)
              EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
 }
 
+#if CONFIG_WIFI_MODE_STATION
+static void wifi_init_sta(void)
+{
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL));
+
+    wifi_config_t wifi_config = {};
+    strlcpy((char *)wifi_config.sta.ssid, CONFIG_WIFI_STA_SSID, sizeof(wifi_config.sta.ssid));
+    strlcpy((char *)wifi_config.sta.password, CONFIG_WIFI_STA_PASSWORD, sizeof(wifi_config.sta.password));
+    // only used in WIFI_PS_MAX_MODEM, i.e. at night
+    wifi_config.sta.listen_interval = CONFIG_WIFI_STA_LISTEN_INTERVAL;
+
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    ESP_ERROR_CHECK(esp_wifi_start());
+    // wake for every DTIM beacon, the AP buffers frames in between
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+
+    ESP_LOGI(TAG, "wifi_init_sta finished. SSID:'%s'", CONFIG_WIFI_STA_SSID);
+}
+#endif
+
+// the radio is retried at the next switch, a failure is no reason to reboot
+static void wifi_switch_ap(bool on)
+{
+    if (on == s_ap_on) {
+        return;
+    }
+    esp_err_t err = on ? esp_wifi_start() : esp_wifi_stop();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s access point failed: %s", on ? "start" : "stop", esp_err_to_name(err));
+        return;
+    }
+    s_ap_on = on;
+    if (!on) {
+        s_stations = 0;
+    }
+    ESP_LOGI(TAG, "access point %s", on ? "on" : "off");
+}
+
+void wifi_set_night(bool night)
+{
+    s_night = night;
+    s_night_us = esp_timer_get_time();
+#if CONFIG_WIFI_MODE_STATION
+    // the station stays associated, at night it skips beacons
+    esp_err_t err = esp_wifi_set_ps(night ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "set power save failed: %s", esp_err_to_name(err));
+    }
+#else
+    // the night starts with the access point on, wifi_night_poll() takes over
+    wifi_switch_ap(true);
+#endif
+    ESP_LOGI(TAG, "wifi %s", night ? "night mode" : "day mode");
+}
+
+uint32_t wifi_night_poll(void)
+{
+#if CONFIG_WIFI_MODE_STATION
+    return UINT32_MAX;
+#else
+    const int64_t period_us = CONFIG_WIFI_AP_NIGHT_PERIOD_MIN * 60 * 1000000LL;
+    const int64_t on_us = CONFIG_WIFI_AP_NIGHT_ON_MIN * 60 * 1000000LL;
+    if (!s_night || on_us >= period_us) {
+        return UINT32_MAX;
+    }
+    // the window starts each period, a connected client keeps it open
+    int64_t phase = (esp_timer_get_time() - s_night_us) % period_us;
+    bool on = phase < on_us || s_stations > 0;
+    wifi_switch_ap(on);
+    int64_t next_us = phase < on_us ? on_us - phase : period_us - phase;
+    return (uint32_t)(next_us / 1000) + 1;
+#endif
+}
 
 void start_web(void)
 {
@@ -191,11 +296,17 @@ void start_web(void)
     netbiosns_init();
     netbiosns_set_name(CONFIG_EXAMPLE_MDNS_HOST_NAME);
 
+#if CONFIG_WIFI_MODE_STATION
+    esp_netif_create_default_wifi_sta();
+    wifi_init_sta();
+#else
     esp_netif_create_default_wifi_ap();
     wifi_init_softap();
+#endif
 
     // ESP_ERROR_CHECK(example_connect());
     init_fs();
     WebServer *webServer = new WebServer(CONFIG_EXAMPLE_WEB_MOUNT_POINT);
     webServer->start();
+    fleet_init();
 }
@@ -7,9 +7,21 @@
 */
 #pragma once
 
+#include <stdint.h>
 
 void start_web(void);
 
+/**
+ * @brief Switch the radio to its night schedule or back
+ */
+void wifi_set_night(bool night);
+
+/**
+ * @brief At night, switch the access point on and off by its window
+ * @return ms until the window changes, UINT32_MAX if it does not
+ */
+uint32_t wifi_night_poll(void);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
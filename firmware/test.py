@@ -29,19 +29,20 @@ def generate_test_cases():
         ))
     return test_cases
 
-def run_test(test_case):
-    """运行单个测试用例"""
-    year, month, day, hour, minute = test_case
+def run_tests(test_cases):
+    """一次运行全部测试用例, 每行一个时间"""
+    times = ''.join(f"{year} {month} {day} {hour} {minute}\n" for year, month, day, hour, minute in test_cases)
     try:
         result = subprocess.run(
-            ['./sun_pos', str(year), str(month), str(day), str(hour), str(minute)],
+            ['./sun_pos'],
+            input=times,
             capture_output=True,
             text=True,
             check=True
         )
-        return result.stdout
+        return result.stdout.splitlines(keepends=True)
     except subprocess.CalledProcessError as e:
-        return f"测试执行错误: {e}"
+        return [f"测试执行错误: {e}\n"] * len(test_cases)
 
 def main():
     # 1. 编译程序
@@ -56,9 +57,8 @@ def main():
     print("时间\t\t\t方位角\t\t天顶角\t\t高度角")
     print("-" * 50)
     
-    for test_case in test_cases:
+    for test_case, result in zip(test_cases, run_tests(test_cases)):
         year, month, day, hour, minute = test_case
-        result = run_test(test_case)
         print(f"{year}-{month:02d}-{day:02d} {hour+8:02d}:{minute:02d}\t{result}", end='')
 
 if __name__ == "__main__":
@@ -0,0 +1,246 @@
+/*
+   Benchmark of the control loop stages on the host, and the budget gate
+   for them, see loop_bench.h.
+
+   Build from firmware/tools/bench:
+     M=../../main; R=../replay; gcc -O2 -c -I$M/gimbal $M/gimbal/pid.c -o pid.o
+     g++ -std=gnu++17 -O2 -I$R/idf -I$R -I$M -I$M/imu -I$M/imu/MahonyAHRS -I$M/gimbal \
+         -I$M/nmea0183 -DCONFIG_LOOP_BENCH=1 -DLOOP_BENCH_NO_MAIN -DFINE_TRACKER_NO_MAIN \
+         -DMOUNT_MODEL_NO_MAIN -DTRACKING_POLICY_NO_MAIN -DHELIOSTAT_NO_MAIN -DSUN_ENGINE_NO_MAIN \
+         -DSTALL_DETECTOR_NO_MAIN -DVELOCITY_ESTIMATOR_NO_MAIN -DSUN_POS_NO_MAIN -DWEATHER_POLICY_NO_MAIN \
+         -DI2C_SCHEDULER_NO_MAIN \
+         main.cpp $R/replay.cpp $R/plant.cpp $R/idf_host.cpp $M/loop_bench.cpp $M/recorder.cpp \
+         $M/setting.cpp $M/nmea0183/gps.cpp $M/imu/imu_bmi270.cpp $M/imu/qmc5883p.cpp \
+         $M/imu/i2c_scheduler.cpp $M/imu/app_datafusion.cpp $M/imu/MahonyAHRS/MahonyAHRS.cpp \
+         $M/gimbal/gimbal.cpp $M/gimbal/motor.cpp pid.o $M/gimbal/velocity_estimator.cpp \
+         $M/gimbal/stall_detector.cpp $M/gimbal/fine_tracker.cpp $M/gimbal/mount_model.cpp \
+         $M/gimbal/heliostat.cpp $M/gimbal/sun_engine.cpp $M/gimbal/sun_pos.cpp \
+         $M/gimbal/tracking_policy.cpp $M/gimbal/weather_policy.cpp -o bench
+
+   bench [--runs 5] [--seconds 12] [--seed n] [--json file] [--budget stage=us ...]
+   bench --check report.json [--budget stage=us ...]
+
+   The first form records a synthetic run of tools/replay with a fixed
+   seed, replays it once to warm up and then --runs times with every
+   stage timed, so each run executes the same code path on the same
+   inputs. It prints p50/p99/max of each stage, writes the report of
+   GET /api/v1/bench to --json and exits 1 when a p99 is over its budget,
+   which fails the build step running it. The period is the recorded one,
+   the jitter of the scheduling only shows on the target.
+
+   --check applies the budgets to a report saved from a tracker, or from
+   this tool. The budgets default to the Kconfig ones of loop_bench.h,
+   which are for the ESP32-S3 at 240 MHz; a host is several times faster,
+   give a host its own budgets to catch regressions of the code. Exit code
+   0 within budget, 1 over budget, 2 error.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "setting.h"
+#include "loop_bench.h"
+#include "replay.h"
+#include "plant.h"
+
+static void usage()
+{
+    fprintf(stderr, "usage: bench [--runs n] [--seconds s] [--seed n] [--json file] [--budget stage=us ...]\n"
+                    "       bench --check report.json [--budget stage=us ...]\n");
+}
+
+static int stage_index(const std::string &name)
+{
+    for (int s = 0; s < LOOP_STAGE_COUNT; s++) {
+        if (name == loop_bench_stage_name(s)) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+struct budget {
+    int stage;
+    uint32_t us;
+};
+
+static bool parse_budget(const char *arg, std::vector<budget> *budgets)
+{
+    const char *eq = strchr(arg, '=');
+    int stage = eq ? stage_index(std::string(arg, eq - arg)) : -1;
+    char *end;
+    unsigned long us = eq ? strtoul(eq + 1, &end, 10) : 0;
+    if (stage < 0 || end == eq + 1 || *end != '\0') {
+        fprintf(stderr, "bad budget %s, stages are:", arg);
+        for (int s = 0; s < LOOP_STAGE_COUNT; s++) {
+            fprintf(stderr, " %s", loop_bench_stage_name(s));
+        }
+        fprintf(stderr, "\n");
+        return false;
+    }
+    budgets->push_back({stage, (uint32_t)us});
+    return true;
+}
+
+static void print_header()
+{
+    printf("%-18s %8s %10s %10s %10s %10s %8s\n", "stage", "count", "p50 us", "p99 us", "max us", "budget", "over");
+}
+
+static bool print_stage(const char *name, uint32_t count, double p50, double p99, double max, uint32_t budget,
+                        uint32_t over)
+{
+    bool pass = count == 0 || p99 <= budget;
+    printf("%-18s %8u %10.3f %10.3f %10.3f %10u %8u%s\n", name, (unsigned)count, p50, p99, max, (unsigned)budget,
+           (unsigned)over, pass ? "" : "  OVER BUDGET");
+    return pass;
+}
+
+static bool read_file(const char *path, std::string *text)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        text->append(buf, n);
+    }
+    fclose(f);
+    return true;
+}
+
+/*
+ * The report is the one loop_bench_report() writes, the fields of a stage
+ * are read in the order it puts them.
+ */
+static int check_report(const char *path, const std::vector<budget> &budgets)
+{
+    std::string json;
+    if (!read_file(path, &json)) {
+        return 2;
+    }
+    char clock[16] = "";
+    sscanf(json.c_str(), "{\"clock\":\"%15[^\"]\"", clock);
+    printf("%s clock\n", clock[0] ? clock : "unknown");
+    print_header();
+    bool pass = true;
+    for (int s = 0; s < LOOP_STAGE_COUNT; s++) {
+        std::string key = std::string("{\"name\":\"") + loop_bench_stage_name(s) + "\"";
+        size_t at = json.find(key);
+        unsigned count, budget_us, over;
+        double p50, p99, max;
+        if (at == std::string::npos ||
+            sscanf(json.c_str() + at + key.size(), ",\"count\":%u,\"p50_us\":%lf,\"p99_us\":%lf,\"max_us\":%lf,"
+                   "\"budget_us\":%u,\"over\":%u", &count, &p50, &p99, &max, &budget_us, &over) != 6) {
+            fprintf(stderr, "%s: no stage %s\n", path, loop_bench_stage_name(s));
+            return 2;
+        }
+        for (const auto &b : budgets) {
+            if (b.stage == s) {
+                budget_us = b.us;
+            }
+        }
+        // over counts samples above the budget of the report
+        pass &= print_stage(loop_bench_stage_name(s), count, p50, p99, max, budget_us, over);
+    }
+    printf("%s\n", pass ? "within budget" : "over budget");
+    return pass ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    int runs = 5;
+    synth_options synth;
+    synth.ring_kb = 1024;
+    const char *json_path = NULL, *check_path = NULL;
+    std::vector<budget> budgets;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            usage();
+            return 2;
+        }
+        i++;
+        if (strcmp(arg, "--runs") == 0) {
+            runs = atoi(value);
+        } else if (strcmp(arg, "--seconds") == 0) {
+            synth.seconds = atof(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            synth.seed = strtoul(value, NULL, 0);
+        } else if (strcmp(arg, "--json") == 0) {
+            json_path = value;
+        } else if (strcmp(arg, "--check") == 0) {
+            check_path = value;
+        } else if (strcmp(arg, "--budget") == 0) {
+            if (!parse_budget(value, &budgets)) {
+                return 2;
+            }
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (check_path != NULL) {
+        return check_report(check_path, budgets);
+    }
+    if (!(runs > 0 && synth.seconds > 0)) {
+        usage();
+        return 2;
+    }
+    for (const auto &b : budgets) {
+        loop_bench_set_budget((loop_stage_t)b.stage, b.us);
+    }
+
+    // a ring that holds the whole run, the replay starts at its first keyframe
+    recording rec;
+    std::string error;
+    if (!recording_parse(synth_run(synth), &rec, &error)) {
+        fprintf(stderr, "synthetic run: %s\n", error.c_str());
+        return 2;
+    }
+    replay_options options;
+    replay_result result;
+    if (replay_run(rec, options, &result) != 0) {
+        fprintf(stderr, "the synthetic run does not replay: %s\n", result.error.c_str());
+        return 2;
+    }
+    loop_bench_reset();
+    double host_s = 0;
+    for (int i = 0; i < runs; i++) {
+        if (replay_run(rec, options, &result) != 0) {
+            fprintf(stderr, "run %d does not replay: %s\n", i + 1, result.error.c_str());
+            return 2;
+        }
+        host_s += result.host_s;
+    }
+    printf("%d runs of %d ticks, %.1f ms, seed %u\n", runs, result.ticks, host_s * 1e3, (unsigned)synth.seed);
+
+    print_header();
+    for (int s = 0; s < LOOP_STAGE_COUNT; s++) {
+        loop_stats_t st;
+        loop_bench_stats((loop_stage_t)s, &st);
+        print_stage(loop_bench_stage_name(s), st.count, st.p50_ns / 1e3, st.p99_ns / 1e3, st.max_ns / 1e3,
+                    st.budget_us, st.over);
+    }
+    bool pass = loop_bench_pass();
+    printf("%s\n", pass ? "within budget" : "over budget");
+
+    if (json_path != NULL) {
+        std::string json(loop_bench_report(NULL, 0) + 1, '\0');
+        loop_bench_report(&json[0], json.size());
+        json.pop_back();
+        FILE *f = fopen(json_path, "w");
+        if (f == NULL) {
+            perror(json_path);
+            return 2;
+        }
+        fprintf(f, "%s\n", json.c_str());
+        fclose(f);
+    }
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "ephemeris_year.h"
+#include "crc32.h"
+
+static const double RAD = M_PI / 180.0;
+static const double PARALLAX = 6371.01 / 149597890;    // earth radius over the astronomical unit
+
+static double wrap180(double deg)
+{
+    deg = fmod(deg + 180.0, 360.0);
+    return deg < 0 ? deg + 180.0 : deg - 180.0;
+}
+
+/*
+ * sunpos() with the date taken from unix time and no branches in the loop,
+ * so that it vectorizes.
+ */
+void sun_batch(double t0, double step, int n, double latitude, double longitude, double *zenith, double *azimuth)
+{
+    const double sin_lat = sin(latitude * RAD), cos_lat = cos(latitude * RAD);
+    // days since JD 2451545.0 and UT hours of the first position
+    const double days0 = t0 / 86400.0 + 2440587.5 - 2451545.0;
+    const double hours0 = fmod(t0, 86400.0) / 3600.0;
+#pragma omp simd
+    for (int i = 0; i < n; i++) {
+        double days = days0 + i * step / 86400.0;
+        double hours = hours0 + i * step / 3600.0;
+
+        double omega = 2.1429 - 0.0010394594 * days;
+        double mean_longitude = 4.8950630 + 0.017202791698 * days;
+        double mean_anomaly = 6.2400600 + 0.0172019699 * days;
+        double ecliptic_longitude = mean_longitude + 0.03341607 * sin(mean_anomaly) + 0.00034894 * sin(2 * mean_anomaly) -
+                                    0.0001134 - 0.0000203 * sin(omega);
+        double obliquity = 0.4090928 - 6.2140e-9 * days + 0.0000396 * cos(omega);
+
+        double sin_longitude = sin(ecliptic_longitude);
+        double right_ascension = atan2(cos(obliquity) * sin_longitude, cos(ecliptic_longitude));
+        double declination = asin(sin(obliquity) * sin_longitude);
+
+        double sidereal = 6.6974243242 + 0.0657098283 * days + hours;
+        double hour_angle = (sidereal * 15 + longitude) * RAD - right_ascension;
+        double cos_hour = cos(hour_angle);
+        double z = acos(cos_lat * cos_hour * cos(declination) + sin(declination) * sin_lat);
+        double a = atan2(-sin(hour_angle), tan(declination) * cos_lat - sin_lat * cos_hour);
+        zenith[i] = (z + PARALLAX * sin(z)) / RAD;
+        azimuth[i] = (a < 0 ? a + 2 * M_PI : a) / RAD;
+    }
+}
+
+// clear sky beam after Meinel with the Kasten-Young air mass, diffuse a tenth of it
+void clear_sky(double zenith, double *dni, double *dhi)
+{
+    double air_mass = 1.0 / (cos(zenith * RAD) + 0.50572 * pow(96.07995 - zenith, -1.6364));
+    *dni = 1353.0 * pow(0.7, pow(air_mass, 0.678));
+    *dhi = 0.1 * *dni;
+}
+
+// beam on a panel with the cosine of incidence and the tilt, isotropic sky
+static double on_panel(double dni, double dhi, double cos_incidence, double cos_tilt)
+{
+    return dni * std::max(cos_incidence, 0.0) + dhi * (1 + cos_tilt) / 2;
+}
+
+static day_summary summarize_day(const year_config &config, int64_t day_start, double *zenith, double *azimuth)
+{
+    const int n = YEAR_MINUTES_PER_DAY;
+    sun_batch((double)day_start, 60.0, n, config.latitude, config.longitude, zenith, azimuth);
+
+    day_summary day = {};
+    day.rise_min = day.set_min = -1;
+    day.min_azimuth = 1e9;
+    day.max_azimuth = -1e9;
+    day.max_elevation = -90;
+    const double equator = config.latitude >= 0 ? 180.0 : 0.0;
+    const double tilt = fabs(config.latitude) * RAD;
+    const double fixed[3] = {sin(tilt) * sin(equator * RAD), sin(tilt) * cos(equator * RAD), cos(tilt)};
+    const double cos_threshold = cos(config.threshold_deg * RAD);
+
+    bool tracking = false, was_above = false;
+    double last_yaw = 0, last_pitch = 0;
+    double aim[3] = {0, 0, 1};
+    double first_yaw = 0, first_pitch = 0;
+    for (int i = 0; i < n; i++) {
+        double elevation = 90 - zenith[i];
+        day.max_elevation = std::max(day.max_elevation, elevation);
+        bool above = elevation > config.park_elevation;
+        if (above && !was_above && i > 0) {
+            day.rise_min = i;
+        }
+        if (!above && was_above) {
+            day.set_min = i;
+        }
+        was_above = above;
+        if (elevation <= 0) {
+            continue;
+        }
+
+        double sz = sin(zenith[i] * RAD), s[3] = {sz * sin(azimuth[i] * RAD), sz * cos(azimuth[i] * RAD), cos(zenith[i] * RAD)};
+        double dni, dhi;
+        clear_sky(zenith[i], &dni, &dhi);
+        day.yield_wh[YIELD_FIXED] += on_panel(dni, dhi, s[0] * fixed[0] + s[1] * fixed[1] + s[2] * fixed[2], fixed[2]) / 60;
+        if (!above) {
+            // parked facing the zenith
+            day.yield_wh[YIELD_SINGLE] += on_panel(dni, dhi, s[2], 1) / 60;
+            day.yield_wh[YIELD_DUAL] += on_panel(dni, dhi, s[2], 1) / 60;
+            continue;
+        }
+        // the single axis turns the normal within the east-west plane
+        double across = sqrt(s[0] * s[0] + s[2] * s[2]);
+        day.yield_wh[YIELD_SINGLE] += on_panel(dni, dhi, across, s[2] / across) / 60;
+        day.yield_wh[YIELD_DUAL] += on_panel(dni, dhi, 1, s[2]) / 60;
+
+        double yaw = equator + wrap180(azimuth[i] - equator);
+        day.min_azimuth = std::min(day.min_azimuth, yaw);
+        day.max_azimuth = std::max(day.max_azimuth, yaw);
+        if (!tracking) {
+            tracking = true;
+            first_yaw = yaw;
+            first_pitch = zenith[i];
+            memcpy(aim, s, sizeof(aim));
+            day.moves++;
+        } else {
+            day.yaw_travel += fabs(wrap180(yaw - last_yaw));
+            day.pitch_travel += fabs(zenith[i] - last_pitch);
+            if (aim[0] * s[0] + aim[1] * s[1] + aim[2] * s[2] < cos_threshold) {
+                memcpy(aim, s, sizeof(aim));
+                day.moves++;
+            }
+        }
+        last_yaw = yaw;
+        last_pitch = zenith[i];
+    }
+    if (tracking) {
+        // from the park position at sunrise and back at sunset
+        day.yaw_travel += fabs(wrap180(first_yaw - 180)) + fabs(wrap180(last_yaw - 180));
+        day.pitch_travel += first_pitch + last_pitch;
+    } else {
+        day.min_azimuth = day.max_azimuth = 0;
+    }
+    return day;
+}
+
+year_result compute_year(const year_config &config)
+{
+    auto begin = std::chrono::steady_clock::now();
+    year_result result = {};
+    struct tm first = {};
+    first.tm_year = config.year - 1900;
+    first.tm_mday = 1;
+    // local mean midnight, to the hour
+    result.start = (int64_t)timegm(&first) - (int64_t)lround(config.longitude / 15) * 3600;
+    struct tm next = first;
+    next.tm_year++;
+    int count = (int)((timegm(&next) - timegm(&first)) / 86400);
+    result.days.resize(count);
+
+    int threads = config.threads > 0 ? config.threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, count);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; w++) {
+        workers.emplace_back([&, w] {
+            std::vector<double> zenith(YEAR_MINUTES_PER_DAY), azimuth(YEAR_MINUTES_PER_DAY);
+            for (int d = w * count / threads; d < (w + 1) * count / threads; d++) {
+                result.days[d] = summarize_day(config, result.start + (int64_t)d * 86400, zenith.data(), azimuth.data());
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    result.min_azimuth = 1e9;
+    result.max_azimuth = -1e9;
+    result.max_elevation = -90;
+    for (const day_summary &day : result.days) {
+        if (day.moves > 0) {
+            result.min_azimuth = std::min(result.min_azimuth, day.min_azimuth);
+            result.max_azimuth = std::max(result.max_azimuth, day.max_azimuth);
+        }
+        result.max_elevation = std::max(result.max_elevation, day.max_elevation);
+        for (int k = 0; k < YIELD_COUNT; k++) {
+            result.yield_kwh[k] += day.yield_wh[k] / 1000;
+        }
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return result;
+}
+
+static int16_t tenths(double deg)
+{
+    return (int16_t)lround(std::min(std::max(deg * 10, -32768.0), 32767.0));
+}
+
+static uint16_t clamp16(double v)
+{
+    return (uint16_t)lround(std::min(std::max(v, 0.0), 65535.0));
+}
+
+std::vector<uint8_t> build_table(const year_config &config, const year_result &result)
+{
+    std::vector<ephemeris_day_t> days(result.days.size());
+    for (size_t i = 0; i < days.size(); i++) {
+        const day_summary &d = result.days[i];
+        ephemeris_day_t &e = days[i];
+        e.rise_min = d.rise_min >= 0 ? d.rise_min : EPHEMERIS_NO_CROSSING;
+        e.set_min = d.set_min >= 0 ? d.set_min : EPHEMERIS_NO_CROSSING;
+        e.min_azimuth = tenths(d.min_azimuth);
+        e.max_azimuth = tenths(d.max_azimuth);
+        e.max_elevation = tenths(d.max_elevation);
+        e.yaw_travel = clamp16(d.yaw_travel);
+        e.pitch_travel = clamp16(d.pitch_travel);
+        e.moves = clamp16(d.moves);
+        for (int k = 0; k < YIELD_COUNT; k++) {
+            e.yield_wh[k] = clamp16(d.yield_wh[k]);
+        }
+        e.reserved = 0;
+    }
+
+    ephemeris_table_header_t header = {};
+    header.magic = EPHEMERIS_TABLE_MAGIC;
+    header.version = EPHEMERIS_TABLE_VERSION;
+    header.days = (uint16_t)days.size();
+    header.start = result.start;
+    header.latitude = (float)config.latitude;
+    header.longitude = (float)config.longitude;
+    header.park_elevation = config.park_elevation;
+    header.threshold_deg = config.threshold_deg;
+    header.min_azimuth = (float)result.min_azimuth;
+    header.max_azimuth = (float)result.max_azimuth;
+    header.max_elevation = (float)result.max_elevation;
+    header.crc = crc32_le(0, (const uint8_t *)days.data(), days.size() * sizeof(ephemeris_day_t));
+
+    std::vector<uint8_t> table(sizeof(header) + days.size() * sizeof(ephemeris_day_t));
+    memcpy(table.data(), &header, sizeof(header));
+    memcpy(table.data() + sizeof(header), days.data(), days.size() * sizeof(ephemeris_day_t));
+    return table;
+}
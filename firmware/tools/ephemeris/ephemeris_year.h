@@ -0,0 +1,73 @@
+/*
+   A year of sun positions at minute resolution, on the host.
+
+   The PSA algorithm of main/gimbal/sun_pos.cpp is evaluated over arrays,
+   one day of minutes at a time, the days spread over threads. From the
+   positions come the travel limits of the axes, the motion of each day
+   for a dual axis tracker and the clear sky yield of a fixed panel, a
+   single axis and a dual axis tracker. The per day summary is written in
+   the format of main/gimbal/ephemeris_table.h.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "ephemeris_table.h"
+
+#define YEAR_MINUTES_PER_DAY    1440
+
+enum {
+    YIELD_FIXED,        // tilted by the latitude towards the equator
+    YIELD_SINGLE,       // horizontal north-south axis
+    YIELD_DUAL,
+    YIELD_COUNT,
+};
+
+struct year_config {
+    double latitude;
+    double longitude;
+    int year;
+    float park_elevation;   // below it the trackers park facing the zenith
+    float threshold_deg;    // re-aim threshold for counting moves
+    int threads;            // 0 for one per core
+};
+
+struct day_summary {
+    int rise_min, set_min;  // -1 without a crossing
+    double min_azimuth, max_azimuth;    // unwrapped around the equator
+    double max_elevation;
+    double yaw_travel, pitch_travel;
+    int moves;
+    double yield_wh[YIELD_COUNT];
+};
+
+struct year_result {
+    int64_t start;          // unix time of the start of the first day
+    std::vector<day_summary> days;
+    double min_azimuth, max_azimuth, max_elevation;
+    double yield_kwh[YIELD_COUNT];
+    double seconds;         // wall time of the computation
+};
+
+/**
+ * @brief Sun positions at evenly spaced times
+ * @param t0 unix time of the first position
+ * @param step seconds between positions
+ * @param zenith, azimuth degrees, n each
+ */
+void sun_batch(double t0, double step, int n, double latitude, double longitude, double *zenith, double *azimuth);
+
+/**
+ * @brief Clear sky beam and diffuse irradiance, W/m2, for a zenith angle below 90
+ */
+void clear_sky(double zenith, double *dni, double *dhi);
+
+year_result compute_year(const year_config &config);
+
+/**
+ * @brief The table for the firmware, header and days
+ */
+std::vector<uint8_t> build_table(const year_config &config, const year_result &result);
+
+// sunpos() itself, to check sun_batch() against
+void reference_sun(double t, double latitude, double longitude, double *zenith, double *azimuth);
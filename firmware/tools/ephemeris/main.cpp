@@ -0,0 +1,205 @@
+/*
+   Year ephemeris for a location: travel limits, daily motion, clear sky
+   yield, and the table for the firmware.
+
+   Build from firmware/tools/ephemeris:
+     g++ -std=c++17 -O3 -march=native -fopenmp-simd -pthread -I../../main -I../../main/gimbal \
+         main.cpp ephemeris_year.cpp reference.cpp -o ephemeris
+
+   ephemeris --lat 28.183 --lon 112.933 [--year 2025] [--park 3] [--threshold 1]
+             [--gear 3029] [--threads n] [--out ephemeris.bin]
+             [--csv day.csv --date 2025-03-28] [--verify]
+
+   --out writes the table, copy it to front/web-demo/public so it ends up in
+   the www partition. --csv writes the positions of one day, a minute per
+   line. --verify compares the batches with sunpos() and times both.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "ephemeris_year.h"
+
+static void usage()
+{
+    fprintf(stderr, "usage: ephemeris --lat deg --lon deg [--year y] [--park deg] [--threshold deg] [--gear ratio]\n"
+                    "                 [--threads n] [--out file] [--csv file --date yyyy-mm-dd] [--verify]\n");
+}
+
+static int verify(const year_config &config, const year_result &result)
+{
+    // every 97 minutes, which walks through all times of the day
+    const int n = 365 * 1440 / 97;
+    std::vector<double> zenith(1), azimuth(1);
+    double worst_zenith = 0, worst_azimuth = 0;
+    for (int i = 0; i < n; i++) {
+        double t = result.start + i * 97.0 * 60;
+        double z, a;
+        reference_sun(t, config.latitude, config.longitude, &z, &a);
+        sun_batch(t, 60, 1, config.latitude, config.longitude, zenith.data(), azimuth.data());
+        worst_zenith = std::max(worst_zenith, fabs(zenith[0] - z));
+        worst_azimuth = std::max(worst_azimuth, fabs(remainder(azimuth[0] - a, 360.0)));
+    }
+    printf("verify: %d positions against sunpos(), worst zenith %.2e azimuth %.2e deg\n", n, worst_zenith, worst_azimuth);
+
+    // the whole year one sunpos() call per minute, as test.py does per process
+    auto begin = std::chrono::steady_clock::now();
+    volatile double sink = 0;
+    for (size_t d = 0; d < result.days.size(); d++) {
+        for (int m = 0; m < YEAR_MINUTES_PER_DAY; m++) {
+            double z, a;
+            reference_sun(result.start + d * 86400.0 + m * 60.0, config.latitude, config.longitude, &z, &a);
+            sink += z;
+        }
+    }
+    double scalar = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("verify: sunpos() per minute %.3f s, batches with the summaries %.3f s\n", scalar, result.seconds);
+    return worst_zenith < 1e-6 && worst_azimuth < 1e-6 ? 0 : 1;
+}
+
+static int write_csv(const year_config &config, const char *path, const char *date)
+{
+    struct tm day = {};
+    if (sscanf(date, "%d-%d-%d", &day.tm_year, &day.tm_mon, &day.tm_mday) != 3) {
+        fprintf(stderr, "bad date %s\n", date);
+        return 1;
+    }
+    day.tm_year -= 1900;
+    day.tm_mon -= 1;
+    double t0 = (double)timegm(&day);
+    std::vector<double> zenith(YEAR_MINUTES_PER_DAY), azimuth(YEAR_MINUTES_PER_DAY);
+    sun_batch(t0, 60, YEAR_MINUTES_PER_DAY, config.latitude, config.longitude, zenith.data(), azimuth.data());
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    fprintf(f, "utc,azimuth,zenith,elevation\n");
+    for (int m = 0; m < YEAR_MINUTES_PER_DAY; m++) {
+        time_t t = (time_t)t0 + m * 60;
+        struct tm utc;
+        gmtime_r(&t, &utc);
+        fprintf(f, "%04d-%02d-%02d %02d:%02d,%f,%f,%f\n", utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour,
+                utc.tm_min, azimuth[m], zenith[m], 90 - zenith[m]);
+    }
+    fclose(f);
+    printf("wrote %s, %d positions of %s UTC\n", path, YEAR_MINUTES_PER_DAY, date);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    time_t now = time(NULL);
+    struct tm today;
+    gmtime_r(&now, &today);
+    year_config config = {NAN, NAN, today.tm_year + 1900, 3.0f, 1.0f, 0};
+    double gear = 3029;
+    const char *out = NULL, *csv = NULL, *date = NULL;
+    bool check = false;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--verify") == 0) {
+            check = true;
+            continue;
+        }
+        if (value == NULL) {
+            usage();
+            return 2;
+        }
+        i++;
+        if (strcmp(arg, "--lat") == 0) {
+            config.latitude = atof(value);
+        } else if (strcmp(arg, "--lon") == 0) {
+            config.longitude = atof(value);
+        } else if (strcmp(arg, "--year") == 0) {
+            config.year = atoi(value);
+        } else if (strcmp(arg, "--park") == 0) {
+            config.park_elevation = atof(value);
+        } else if (strcmp(arg, "--threshold") == 0) {
+            config.threshold_deg = atof(value);
+        } else if (strcmp(arg, "--gear") == 0) {
+            gear = atof(value);
+        } else if (strcmp(arg, "--threads") == 0) {
+            config.threads = atoi(value);
+        } else if (strcmp(arg, "--out") == 0) {
+            out = value;
+        } else if (strcmp(arg, "--csv") == 0) {
+            csv = value;
+        } else if (strcmp(arg, "--date") == 0) {
+            date = value;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!(fabs(config.latitude) <= 90 && fabs(config.longitude) <= 180) || !(config.threshold_deg > 0)) {
+        usage();
+        return 2;
+    }
+    if (csv != NULL) {
+        return write_csv(config, csv, date != NULL ? date : "2025-03-28");
+    }
+
+    year_result result = compute_year(config);
+    printf("%.3f, %.3f in %d: %zu days at minute resolution in %.3f s\n", config.latitude, config.longitude,
+           config.year, result.days.size(), result.seconds);
+    printf("travel: azimuth %.1f .. %.1f, span %.1f, elevation up to %.1f\n", result.min_azimuth, result.max_azimuth,
+           result.max_azimuth - result.min_azimuth, result.max_elevation);
+
+    double yaw_sum = 0, yaw_max = 0, pitch_sum = 0, pitch_max = 0;
+    int moves_sum = 0, moves_max = 0, tracked = 0;
+    for (const day_summary &day : result.days) {
+        if (day.moves == 0) {
+            continue;
+        }
+        tracked++;
+        yaw_sum += day.yaw_travel;
+        pitch_sum += day.pitch_travel;
+        moves_sum += day.moves;
+        yaw_max = std::max(yaw_max, day.yaw_travel);
+        pitch_max = std::max(pitch_max, day.pitch_travel);
+        moves_max = std::max(moves_max, day.moves);
+    }
+    tracked = std::max(tracked, 1);
+    printf("motion per day, dual axis, parking included:\n");
+    printf("  yaw   %6.1f deg mean %6.1f max, %5.0f motor turns max\n", yaw_sum / tracked, yaw_max, yaw_max * gear / 360);
+    printf("  pitch %6.1f deg mean %6.1f max\n", pitch_sum / tracked, pitch_max);
+    printf("  moves %6.1f mean %6d max at %.2f deg\n", (double)moves_sum / tracked, moves_max, config.threshold_deg);
+
+    printf("clear sky yield, kWh/m2:\n  %5s %8s %8s %8s %8s %8s\n", "month", "fixed", "single", "dual", "single+", "dual+");
+    double month[12][YIELD_COUNT] = {};
+    for (size_t d = 0; d < result.days.size(); d++) {
+        // months by the middle of the day
+        time_t noon = (time_t)(result.start + d * 86400 + 43200);
+        struct tm local;
+        gmtime_r(&noon, &local);
+        for (int k = 0; k < YIELD_COUNT; k++) {
+            month[local.tm_mon][k] += result.days[d].yield_wh[k] / 1000;
+        }
+    }
+    for (int m = 0; m < 12; m++) {
+        printf("  %5d %8.1f %8.1f %8.1f %7.0f%% %7.0f%%\n", m + 1, month[m][YIELD_FIXED], month[m][YIELD_SINGLE],
+               month[m][YIELD_DUAL], 100 * (month[m][YIELD_SINGLE] / month[m][YIELD_FIXED] - 1),
+               100 * (month[m][YIELD_DUAL] / month[m][YIELD_FIXED] - 1));
+    }
+    const double *year = result.yield_kwh;
+    printf("  %5s %8.0f %8.0f %8.0f %7.0f%% %7.0f%%\n", "year", year[YIELD_FIXED], year[YIELD_SINGLE], year[YIELD_DUAL],
+           100 * (year[YIELD_SINGLE] / year[YIELD_FIXED] - 1), 100 * (year[YIELD_DUAL] / year[YIELD_FIXED] - 1));
+
+    if (out != NULL) {
+        std::vector<uint8_t> table = build_table(config, result);
+        FILE *f = fopen(out, "wb");
+        if (f == NULL || fwrite(table.data(), 1, table.size(), f) != table.size()) {
+            perror(out);
+            return 1;
+        }
+        fclose(f);
+        printf("wrote %s, %zu days, %zu bytes\n", out, result.days.size(), table.size());
+    }
+    return check ? verify(config, result) : 0;
+}
@@ -0,0 +1,28 @@
+// sunpos() of the firmware, its __linux__ section is a command line program of its own
+#include <time.h>
+#undef __linux__
+#include "sun_pos.cpp"
+#include "ephemeris_year.h"
+
+void reference_sun(double t, double latitude, double longitude, double *zenith, double *azimuth)
+{
+    time_t seconds = (time_t)floor(t);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    cTime time = {
+        .iYear = utc.tm_year + 1900,
+        .iMonth = utc.tm_mon + 1,
+        .iDay = utc.tm_mday,
+        .dHours = (double)utc.tm_hour,
+        .dMinutes = (double)utc.tm_min,
+        .dSeconds = utc.tm_sec + (t - seconds),
+    };
+    cLocation location = {
+        .dLongitude = longitude,
+        .dLatitude = latitude,
+    };
+    cSunCoordinates sun;
+    sunpos(time, location, &sun);
+    *zenith = sun.dZenithAngle;
+    *azimuth = sun.dAzimuth;
+}
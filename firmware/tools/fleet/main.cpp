@@ -0,0 +1,739 @@
+/*
+   Fleet coordinator on a host, and simulated trackers to try it with.
+
+   Build from firmware/tools/fleet:
+     g++ -std=c++17 -O2 -pthread -DCBOR_NO_MAIN -DCONTROL_NO_MAIN -I../../main -I../../main/wifi \
+         -I../../main/gimbal main.cpp mdns.cpp ../../main/wifi/fleet.cpp ../../main/wifi/control_api.cpp \
+         ../../main/wifi/cbor.cpp -o fleet
+
+   fleet coordinator [--ephemeris ephemeris.bin] [--set section.field=value ...] [--site n]
+                     [--iface addr] [--once] [--timeout s]
+   fleet tracker --id n [--site n] [--iface addr] [--loss p]
+   fleet demo [--trackers 12] [--late 2] [--loss 0.1] [--ephemeris file] [--set ...]
+
+   coordinator finds the trackers of the site over mDNS, pushes them the
+   table of tools/ephemeris and the settings given with --set, repairs
+   until they all have it, and lists them. With --once it stops there and
+   exits 0, else it keeps the roster up until interrupted. The settings
+   are the site wide sections of control_api.h: track, weather, fine and
+   sun, e.g. --set track.threshold=0.5 --set sun.algo=1.
+
+   tracker answers mDNS and speaks the tracker's end of the protocol, the
+   firmware's FleetTracker, dropping the coordinator's datagrams with
+   probability --loss. It checks the table and decodes the settings
+   instead of applying them.
+
+   demo does both on 127.0.0.1: forks the trackers, pushes to them, starts
+   --late more once the first ones have the push, and checks that every
+   tracker ends up with the same table and settings, with fewer datagrams
+   than a unicast copy to each would take.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "fleet.h"
+#include "control_api.h"
+#include "crc32.h"
+#include "ephemeris_table.h"
+#include "mdns.h"
+
+#define SERVICE         FLEET_MDNS_SERVICE "." FLEET_MDNS_PROTO
+#define DISCOVER_MS     1000
+#define DEMO_BEACON_MS  1000    // trackers started late hear of the push within a second
+#define DEMO_TIMEOUT_MS 30000
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void on_signal(int sig)
+{
+    s_stop = 1;
+}
+
+static void catch_signals()
+{
+    struct sigaction sa = {};
+    sa.sa_handler = on_signal;  // no SA_RESTART, poll() returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: fleet coordinator [--ephemeris file] [--set section.field=value ...] [--site n]\n"
+                    "                         [--iface addr] [--once] [--timeout s]\n"
+                    "       fleet tracker --id n [--site n] [--iface addr] [--loss p]\n"
+                    "       fleet demo [--trackers n] [--late n] [--loss p] [--ephemeris file] [--set ...]\n");
+}
+
+struct options {
+    std::string ephemeris;
+    std::vector<std::string> sets;
+    int site = 1;
+    uint32_t iface = 0;         // network order
+    bool once = false;
+    int timeout_s = 0;
+    int id = -1;
+    double loss = -1;           // 0 for a tracker, 0.1 for the demo
+    int trackers = 12;
+    int late = 2;
+};
+
+static void format_id(const uint8_t id[6], char *str)
+{
+    sprintf(str, "%02x%02x%02x%02x%02x%02x", id[0], id[1], id[2], id[3], id[4], id[5]);
+}
+
+static bool parse_id(const char *str, uint8_t id[6])
+{
+    return str != NULL &&
+           sscanf(str, "%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", &id[0], &id[1], &id[2], &id[3], &id[4], &id[5]) == 6;
+}
+
+static const cbor_field_t *find_field(const cbor_map_t *map, const std::string &name)
+{
+    for (int i = 0; i < map->count; i++) {
+        if (name == map->fields[i].name) {
+            return &map->fields[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Encode the --set values as a settings command of control_site_map
+ * @return its size, 0 for an unknown field or a value the firmware would not take
+ */
+static size_t encode_sets(const std::vector<std::string> &sets, uint8_t *buf, size_t cap)
+{
+    struct value {
+        const cbor_field_t *field;
+        std::string text;
+    };
+    std::vector<std::pair<const cbor_field_t *, std::vector<value>>> sections;
+    for (const std::string &set : sets) {
+        size_t dot = set.find('.'), eq = set.find('=');
+        const cbor_field_t *section = NULL, *field = NULL;
+        if (dot != std::string::npos && eq != std::string::npos && dot < eq) {
+            section = find_field(&control_site_map, set.substr(0, dot));
+        }
+        if (section != NULL && section->type == CBOR_FIELD_MAP) {
+            field = find_field(section->map, set.substr(dot + 1, eq - dot - 1));
+        }
+        if (field == NULL || field->type > CBOR_FIELD_BOOL || field->type == CBOR_FIELD_F64) {
+            fprintf(stderr, "--set %s: not a setting of the site\n", set.c_str());
+            return 0;
+        }
+        size_t i = 0;
+        while (i < sections.size() && sections[i].first != section) {
+            i++;
+        }
+        if (i == sections.size()) {
+            sections.push_back({section, {}});
+        }
+        sections[i].second.push_back({field, set.substr(eq + 1)});
+    }
+
+    CborWriter writer(buf, cap);
+    writer.map(1 + sections.size());
+    writer.uint64(0);
+    writer.uint64(CONTROL_API_VERSION);
+    for (const auto &section : sections) {
+        writer.uint64(section.first->key);
+        writer.map(section.second.size());
+        for (const value &v : section.second) {
+            writer.uint64(v.field->key);
+            if (v.field->type == CBOR_FIELD_F32) {
+                writer.f32(strtof(v.text.c_str(), NULL));
+            } else if (v.field->type == CBOR_FIELD_BOOL) {
+                writer.boolean(v.text == "true" || v.text == "1");
+            } else {
+                writer.uint64(strtoul(v.text.c_str(), NULL, 0));
+            }
+        }
+    }
+    if (!writer.ok()) {
+        fprintf(stderr, "--set: the settings take more than %u bytes\n", (unsigned)cap);
+        return 0;
+    }
+
+    // the firmware's own check, values out of range are ignored there
+    control_settings_t doc = {};
+    uint32_t changed = 0;
+    int ignored = 0;
+    if (control_decode(&control_settings_map, buf, writer.size(), &doc, &changed, &ignored) != CONTROL_OK ||
+            ignored != 0) {
+        fprintf(stderr, "--set: %d values out of range\n", ignored);
+        return 0;
+    }
+    return writer.size();
+}
+
+// crc of the site settings a command leaves on a tracker that had none
+static uint32_t settings_digest(const uint8_t *data, size_t size)
+{
+    control_settings_t doc = {};
+    uint32_t changed = 0;
+    int ignored = 0;
+    if (control_decode(&control_settings_map, data, size, &doc, &changed, &ignored) != CONTROL_OK) {
+        return 0;
+    }
+    uint8_t buf[512];
+    size_t len = control_encode(&control_site_map, &doc, buf, sizeof(buf));
+    return len <= sizeof(buf) ? crc32_le(0, buf, len) : 0;
+}
+
+static bool read_file(const char *path, std::vector<uint8_t> *data)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data->insert(data->end(), buf, buf + n);
+    }
+    fclose(f);
+    return true;
+}
+
+// a year of rough sunrise and sunset, when the demo is not given a table of tools/ephemeris
+static void synthetic_table(std::vector<uint8_t> *data)
+{
+    const int days = 366;
+    const double latitude = 28.183, longitude = 112.933;
+    ephemeris_table_header_t header = {};
+    header.magic = EPHEMERIS_TABLE_MAGIC;
+    header.version = EPHEMERIS_TABLE_VERSION;
+    header.days = days;
+    header.start = 1735689600 - (int64_t)round(longitude / 15) * 3600;   // 2025-01-01, local mean midnight
+    header.latitude = latitude;
+    header.longitude = longitude;
+    header.park_elevation = 3;
+    header.threshold_deg = 1;
+    header.min_azimuth = 360;
+    std::vector<ephemeris_day_t> entries(days);
+    for (int d = 0; d < days; d++) {
+        double declination = 23.44 * sin(2 * M_PI * (d + 284) / 365.0);
+        double cos_h = -tan(latitude * M_PI / 180) * tan(declination * M_PI / 180);
+        double half_min = acos(fmax(-1, fmin(1, cos_h))) * 180 / M_PI * 4;
+        double elevation = 90 - latitude + declination;
+        double azimuth = 90 + acos(sin(declination * M_PI / 180) / cos(latitude * M_PI / 180)) * 180 / M_PI - 90;
+        ephemeris_day_t &day = entries[d];
+        day.rise_min = round(720 - half_min);
+        day.set_min = round(720 + half_min);
+        day.min_azimuth = round((180 - azimuth) * 10);
+        day.max_azimuth = round((180 + azimuth) * 10);
+        day.max_elevation = round(elevation * 10);
+        day.yaw_travel = round(2 * azimuth + 10);
+        day.pitch_travel = round(2 * elevation);
+        day.moves = round(half_min / 4);
+        day.yield_wh[0] = round(half_min * 6);
+        day.yield_wh[1] = round(half_min * 8);
+        day.yield_wh[2] = round(half_min * 9);
+        header.min_azimuth = fmin(header.min_azimuth, day.min_azimuth / 10.0);
+        header.max_azimuth = fmax(header.max_azimuth, day.max_azimuth / 10.0);
+        header.max_elevation = fmax(header.max_elevation, elevation);
+    }
+    header.crc = crc32_le(0, (const uint8_t *)entries.data(), days * sizeof(ephemeris_day_t));
+    data->assign((const uint8_t *)&header, (const uint8_t *)(&header + 1));
+    data->insert(data->end(), (const uint8_t *)entries.data(), (const uint8_t *)(entries.data() + days));
+}
+
+/* tracker */
+
+static void tracker_id(int n, uint8_t id[6])
+{
+    const uint8_t base[6] = {0x02, 0, 0, 0, (uint8_t)(n >> 8), (uint8_t)n};   // locally administered
+    memcpy(id, base, 6);
+}
+
+static int run_tracker(const options &opt)
+{
+    uint8_t id[6];
+    char id_str[13];
+    tracker_id(opt.id, id);
+    format_id(id, id_str);
+    int sock = fleet_socket(true, opt.iface);
+    if (sock < 0) {
+        perror("fleet socket");
+        return 1;
+    }
+    mdns_instance self;
+    self.name = std::string("tracker-") + id_str;
+    self.host = self.name + ".local";
+    self.port = FLEET_PORT;
+    self.addr = opt.iface != 0 ? opt.iface : htonl(INADDR_LOOPBACK);
+    self.txt = {{"id", id_str}, {"site", std::to_string(opt.site)}, {"role", "tracker"}};
+    MdnsResponder responder;
+    if (!responder.open(SERVICE, self, opt.iface)) {
+        return 1;
+    }
+
+    FleetTracker tracker;
+    int64_t start = fleet_now_ms();
+    tracker.init(id, opt.site, start);
+    std::mt19937 random(opt.id * 7919 + 1);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    control_settings_t settings = {};
+    uint32_t table_crc = 0, settings_crc = 0, handled = 0, rejected = 0, dropped = 0;
+    uint8_t buf[FLEET_DATAGRAM_MAX];
+
+    while (!s_stop) {
+        int wait_ms;
+        int64_t now = fleet_now_ms();
+        if (tracker.heartbeat_due(now, &wait_ms)) {
+            fleet_heartbeat_t hb = {};
+            hb.state = 2;       // Running
+            hb.flags = FLEET_HB_GPS | FLEET_HB_SUN_UP | (table_crc != 0 ? FLEET_HB_TABLE : 0);
+            hb.uptime_s = (now - start) / 1000;
+            hb.table_crc = table_crc;
+            hb.yaw = 1800 + opt.id;
+            hb.pitch = 450;
+            hb.error = 12;
+            hb.supply_mv = 12100;
+            hb.energy_wh = 35;
+            uint32_t addr;
+            uint16_t port;
+            size_t size = tracker.heartbeat(&hb, buf, now, &addr, &port);
+            fleet_send(sock, buf, size, addr, port);
+            continue;
+        }
+        struct pollfd fds[2] = {{sock, POLLIN, 0}, {responder.fd(), POLLIN, 0}};
+        if (poll(fds, 2, wait_ms) <= 0) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            responder.handle();
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        uint32_t addr;
+        uint16_t port;
+        int len = fleet_receive(sock, buf, sizeof(buf), 0, &addr, &port);
+        if (len <= 0) {
+            continue;
+        }
+        if (opt.loss > 0 && uniform(random) < opt.loss) {
+            dropped++;
+            continue;
+        }
+        if (tracker.receive(buf, len, addr, port, fleet_now_ms()) != FleetReceiver::RX_COMPLETE) {
+            continue;
+        }
+        const uint8_t *data;
+        size_t size;
+        bool ok = true;
+        if (tracker.receiver().item(FLEET_ITEM_EPHEMERIS, &data, &size)) {
+            ok = fleet_check_ephemeris(data, size);
+            if (ok) {
+                table_crc = ((const ephemeris_table_header_t *)data)->crc;
+            }
+        }
+        if (ok && tracker.receiver().item(FLEET_ITEM_SETTINGS, &data, &size)) {
+            control_settings_t doc = settings;
+            uint32_t changed = 0;
+            int ignored = 0;
+            ok = control_decode(&control_settings_map, data, size, &doc, &changed, &ignored) == CONTROL_OK;
+            if (ok) {
+                settings = doc;
+                uint8_t encoded[512];
+                size_t n = control_encode(&control_site_map, &settings, encoded, sizeof(encoded));
+                settings_crc = n <= sizeof(encoded) ? crc32_le(0, encoded, n) : 0;
+            }
+        }
+        handled++;
+        rejected += !ok;
+        tracker.handled(ok, fleet_now_ms());
+    }
+    printf("tracker %s handled %u rejected %u table %08x settings %08x dropped %u heartbeats %u\n", id_str,
+           handled, rejected, table_crc, settings_crc, dropped, tracker.get_heartbeats());
+    fflush(stdout);
+    return 0;
+}
+
+/* coordinator */
+
+struct host_coordinator {
+    FleetCoordinator fleet;
+    int sock = -1;
+    uint32_t iface = 0;
+    int site = 1;
+    uint8_t datagram[FLEET_DATAGRAM_MAX];
+
+    bool open(const options &opt, int beacon_ms)
+    {
+        iface = opt.iface;
+        site = opt.site;
+        sock = fleet_socket(false, iface);
+        if (sock < 0) {
+            perror("fleet socket");
+            return false;
+        }
+        fleet.init(site, beacon_ms);
+        return true;
+    }
+
+    // trackers of the site, coordinators and other sites left out
+    int discover(int timeout_ms)
+    {
+        std::vector<mdns_instance> found;
+        mdns_browse(SERVICE, iface, timeout_ms, &found);
+        int count = 0;
+        for (const mdns_instance &m : found) {
+            uint8_t id[6];
+            const char *role = m.get("role"), *instance_site = m.get("site");
+            if (!parse_id(m.get("id"), id) || (role != NULL && strcmp(role, "tracker") != 0) ||
+                    (instance_site != NULL && atoi(instance_site) != site)) {
+                continue;
+            }
+            if (fleet.roster().discover(id, m.addr) != NULL) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    bool push(const std::vector<uint8_t> &table, const std::vector<uint8_t> &settings)
+    {
+        static uint32_t last_id = 0;
+        uint32_t id = time(NULL);
+        last_id = id > last_id ? id : last_id + 1;
+        FleetPush &push = fleet.push();
+        push.begin(last_id);
+        if (!table.empty()) {
+            push.add(FLEET_ITEM_EPHEMERIS, table.data(), table.size());
+        }
+        if (!settings.empty()) {
+            push.add(FLEET_ITEM_SETTINGS, settings.data(), settings.size());
+        }
+        if (!push.finish()) {
+            fprintf(stderr, "push of %u bytes, over %d chunks\n", (unsigned)push.size(), FLEET_MAX_CHUNKS);
+            return false;
+        }
+        fleet.start(fleet_now_ms());
+        return true;
+    }
+
+    // send and receive for ms
+    void run(int ms)
+    {
+        int64_t end = fleet_now_ms() + ms;
+        int64_t now;
+        while (!s_stop && (now = fleet_now_ms()) < end) {
+            size_t size;
+            while ((size = fleet.poll(datagram, now)) > 0) {
+                fleet_send(sock, datagram, size, 0, 0);
+            }
+            uint32_t addr;
+            uint16_t port;
+            int wait = end - now < 50 ? end - now : 50;
+            int len = fleet_receive(sock, datagram, sizeof(datagram), wait, &addr, &port);
+            if (len > 0) {
+                fleet.receive(datagram, len, addr, fleet_now_ms());
+            }
+        }
+    }
+
+    // every tracker discovered handled the push
+    bool converged(int *handled, int *rejected)
+    {
+        int online;
+        fleet.roster().count(fleet.push().id(), fleet_now_ms(), &online, handled, rejected);
+        return *handled == fleet.roster().size() && fleet.roster().size() > 0;
+    }
+
+    void list()
+    {
+        int64_t now = fleet_now_ms();
+        uint32_t push = fleet.push().id();
+        printf("%-12s  %-15s  %6s  %-6s  %-8s  %-8s  %5s\n", "tracker", "address", "online", "push", "chunks",
+               "table", "beats");
+        for (int i = 0; i < fleet.roster().size(); i++) {
+            const fleet_member_t &m = fleet.roster().at(i);
+            char id[13];
+            struct in_addr addr = {m.addr};
+            format_id(m.id, id);
+            const char *state = m.last.handled != push ? "-" : (m.last.flags & FLEET_HB_REJECTED) ? "reject" : "ok";
+            printf("%-12s  %-15s  %6s  %-6s  %08x  %08x  %5u\n", id, inet_ntoa(addr),
+                   FleetRoster::is_online(m, now) ? "yes" : "no", state, m.last.have, m.last.table_crc, m.heartbeats);
+        }
+        fleet_stats_t stats;
+        fleet.get_stats(&stats);
+        printf("push %u: %u bytes in %d chunks, %u repairs, %u chunks and %u beacons sent, %llu bytes, "
+               "%u heartbeats received\n", push, (unsigned)fleet.push().size(), fleet.push().count(), stats.repairs,
+               stats.chunks, stats.beacons, (unsigned long long)stats.bytes, stats.heartbeats);
+    }
+};
+
+static bool load_push(const options &opt, bool synthetic, std::vector<uint8_t> *table, std::vector<uint8_t> *settings)
+{
+    if (!opt.ephemeris.empty()) {
+        if (!read_file(opt.ephemeris.c_str(), table)) {
+            return false;
+        }
+        if (!fleet_check_ephemeris(table->data(), table->size())) {
+            fprintf(stderr, "%s: not an ephemeris table\n", opt.ephemeris.c_str());
+            return false;
+        }
+    } else if (synthetic) {
+        synthetic_table(table);
+    }
+    if (!opt.sets.empty()) {
+        uint8_t buf[512];
+        size_t size = encode_sets(opt.sets, buf, sizeof(buf));
+        if (size == 0) {
+            return false;
+        }
+        settings->assign(buf, buf + size);
+    }
+    if (table->empty() && settings->empty()) {
+        fprintf(stderr, "nothing to push, give --ephemeris or --set\n");
+        return false;
+    }
+    return true;
+}
+
+static int run_coordinator(const options &opt)
+{
+    std::vector<uint8_t> table, settings;
+    host_coordinator host;
+    if (!load_push(opt, false, &table, &settings) || !host.open(opt, FLEET_BEACON_MS)) {
+        return 1;
+    }
+    int found = host.discover(DISCOVER_MS);
+    printf("%d trackers found on site %d\n", found, opt.site);
+    if (!host.push(table, settings)) {
+        return 1;
+    }
+    int64_t end = opt.timeout_s > 0 ? fleet_now_ms() + opt.timeout_s * 1000LL : INT64_MAX;
+    int64_t discover_ms = fleet_now_ms() + 10 * DISCOVER_MS;
+    int handled = 0, rejected = 0;
+    bool done = false;
+    while (!s_stop && fleet_now_ms() < end) {
+        host.run(500);
+        done = host.converged(&handled, &rejected);
+        if (done && opt.once) {
+            break;
+        }
+        if (fleet_now_ms() >= discover_ms) {
+            host.discover(DISCOVER_MS);
+            discover_ms = fleet_now_ms() + 10 * DISCOVER_MS;
+        }
+    }
+    host.list();
+    printf("%d of %d trackers handled the push, %d rejected it\n", handled, host.fleet.roster().size(), rejected);
+    return done && rejected == 0 ? 0 : 1;
+}
+
+/* demo */
+
+struct child {
+    pid_t pid;
+    int out;                    // its stdout
+    std::string line;
+};
+
+static bool spawn_tracker(const options &opt, int n, int close_fd, child *c)
+{
+    int fds[2];
+    fflush(stdout);             // or the child prints it again
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        if (close_fd >= 0) {
+            close(close_fd);
+        }
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        options tracker = opt;
+        tracker.id = n;
+        _exit(run_tracker(tracker));
+    }
+    close(fds[1]);
+    c->pid = pid;
+    c->out = fds[0];
+    return true;
+}
+
+static bool check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    return ok;
+}
+
+static int run_demo(options opt)
+{
+    opt.iface = htonl(INADDR_LOOPBACK);
+    opt.loss = opt.loss < 0 ? 0.1 : opt.loss;
+    if (opt.sets.empty()) {
+        opt.sets = {"track.threshold=0.5", "weather.tau=900", "fine.enable=true", "sun.algo=1"};
+    }
+    std::vector<uint8_t> table, settings;
+    host_coordinator host;
+    if (!load_push(opt, true, &table, &settings) || !host.open(opt, DEMO_BEACON_MS)) {
+        return 1;
+    }
+    int total = opt.trackers + opt.late;
+    std::vector<child> children(total);
+    for (int i = 0; i < opt.trackers; i++) {
+        if (!spawn_tracker(opt, i + 1, host.sock, &children[i])) {
+            perror("fork");
+            return 1;
+        }
+    }
+    usleep(300 * 1000);
+
+    int found = 0;
+    for (int tries = 0; tries < 5 && found < opt.trackers; tries++) {
+        found = host.discover(DISCOVER_MS);
+    }
+    printf("%d of %d trackers found over mDNS\n", found, opt.trackers);
+    if (!host.push(table, settings)) {
+        return 1;
+    }
+    printf("push of %u bytes in %d chunks, loss %.0f%%\n", (unsigned)host.fleet.push().size(),
+           host.fleet.push().count(), opt.loss * 100);
+
+    int64_t start = fleet_now_ms(), end = start + DEMO_TIMEOUT_MS;
+    int handled = 0, rejected = 0;
+    while (!s_stop && fleet_now_ms() < end && !host.converged(&handled, &rejected)) {
+        host.run(100);
+    }
+    printf("%d trackers handled the push in %lld ms\n", handled, (long long)(fleet_now_ms() - start));
+
+    for (int i = opt.trackers; i < total; i++) {
+        if (!spawn_tracker(opt, i + 1, host.sock, &children[i])) {
+            perror("fork");
+            return 1;
+        }
+    }
+    if (opt.late > 0) {
+        usleep(300 * 1000);
+        found = host.discover(DISCOVER_MS);
+        int64_t late = fleet_now_ms();
+        while (!s_stop && fleet_now_ms() < end && (!host.converged(&handled, &rejected) || handled < total)) {
+            host.run(100);
+        }
+        printf("%d started late, %d trackers handled the push %lld ms later\n", opt.late, handled,
+               (long long)(fleet_now_ms() - late));
+    }
+
+    // the trackers tell what they got when they stop
+    for (child &c : children) {
+        kill(c.pid, SIGTERM);
+    }
+    for (child &c : children) {
+        char buf[256];
+        ssize_t n;
+        while ((n = read(c.out, buf, sizeof(buf))) > 0) {
+            c.line.append(buf, n);
+        }
+        close(c.out);
+        waitpid(c.pid, NULL, 0);
+    }
+    host.list();
+
+    uint32_t table_crc = table.empty() ? 0 : ((const ephemeris_table_header_t *)table.data())->crc;
+    uint32_t settings_crc = settings_digest(settings.data(), settings.size());
+    int same = 0;
+    for (const child &c : children) {
+        char id[13];
+        unsigned t_handled, t_rejected, t_table, t_settings, t_dropped, t_beats;
+        if (sscanf(c.line.c_str(), "tracker %12s handled %u rejected %u table %x settings %x dropped %u heartbeats %u",
+                   id, &t_handled, &t_rejected, &t_table, &t_settings, &t_dropped, &t_beats) == 7) {
+            printf("  %s handled %u, dropped %u datagrams, %u heartbeats\n", id, t_handled, t_dropped, t_beats);
+            same += t_rejected == 0 && t_table == table_crc && t_settings == settings_crc;
+        }
+    }
+
+    fleet_stats_t stats;
+    host.fleet.get_stats(&stats);
+    size_t chunk_bytes = 0;
+    uint8_t datagram[FLEET_DATAGRAM_MAX];
+    for (int i = 0; i < host.fleet.push().count(); i++) {
+        chunk_bytes += host.fleet.push().packet(i, opt.site, datagram);
+    }
+    uint32_t unicast = total * host.fleet.push().count();
+    printf("sent %u datagrams, %llu bytes; a unicast copy to each tracker would be %u datagrams, %llu bytes\n",
+           stats.chunks + stats.beacons, (unsigned long long)stats.bytes, unicast,
+           (unsigned long long)(total * chunk_bytes));
+
+    bool ok = check(found + opt.trackers >= total && host.fleet.roster().size() == total,
+                    "every tracker discovered");
+    ok &= check(handled == total && rejected == 0, "every tracker handled the push");
+    ok &= check(same == total, "every tracker has the table and settings pushed");
+    ok &= check(stats.chunks < unicast, "fewer chunks than unicast");
+    ok &= check(sizeof(fleet_header_t) + sizeof(fleet_heartbeat_t) == 52, "heartbeat of 52 bytes");
+    printf(ok ? "all checks passed\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    std::string command = argv[1];
+    options opt;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--once") {
+            opt.once = true;
+        } else if (!has_value) {
+            usage();
+            return 1;
+        } else if (arg == "--ephemeris") {
+            opt.ephemeris = argv[++i];
+        } else if (arg == "--set") {
+            opt.sets.push_back(argv[++i]);
+        } else if (arg == "--site") {
+            opt.site = atoi(argv[++i]);
+        } else if (arg == "--iface") {
+            opt.iface = inet_addr(argv[++i]);
+        } else if (arg == "--timeout") {
+            opt.timeout_s = atoi(argv[++i]);
+        } else if (arg == "--id") {
+            opt.id = atoi(argv[++i]);
+        } else if (arg == "--loss") {
+            opt.loss = atof(argv[++i]);
+        } else if (arg == "--trackers") {
+            opt.trackers = atoi(argv[++i]);
+        } else if (arg == "--late") {
+            opt.late = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    catch_signals();
+    if (command == "coordinator") {
+        return run_coordinator(opt);
+    }
+    if (command == "tracker" && opt.id >= 0) {
+        return run_tracker(opt);
+    }
+    if (command == "demo" && opt.trackers > 0 && opt.late >= 0 && opt.trackers + opt.late <= FLEET_MAX_TRACKERS) {
+        return run_demo(opt);
+    }
+    usage();
+    return 1;
+}
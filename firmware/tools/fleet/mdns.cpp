@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include "mdns.h"
+
+#define MDNS_GROUP      "224.0.0.251"
+#define MDNS_PORT       5353
+#define MDNS_TTL        10      // the most for a legacy unicast answer
+
+enum {
+    TYPE_A = 1,
+    TYPE_PTR = 12,
+    TYPE_TXT = 16,
+    TYPE_SRV = 33,
+    TYPE_ANY = 255,
+    CLASS_IN = 1,
+};
+
+const char *mdns_instance::get(const char *key) const
+{
+    for (const auto &item : txt) {
+        if (item.first == key) {
+            return item.second.c_str();
+        }
+    }
+    return nullptr;
+}
+
+static void put16(std::vector<uint8_t> &msg, uint16_t value)
+{
+    msg.push_back(value >> 8);
+    msg.push_back(value & 0xff);
+}
+
+static void put32(std::vector<uint8_t> &msg, uint32_t value)
+{
+    put16(msg, value >> 16);
+    put16(msg, value & 0xffff);
+}
+
+// dotted name as labels, without compression
+static void put_name(std::vector<uint8_t> &msg, const std::string &name)
+{
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t dot = name.find('.', start);
+        if (dot == std::string::npos) {
+            dot = name.size();
+        }
+        msg.push_back(dot - start);
+        msg.insert(msg.end(), name.begin() + start, name.begin() + dot);
+        start = dot + 1;
+    }
+    msg.push_back(0);
+}
+
+// a record with its rdata, which starts at the returned offset
+static size_t put_record(std::vector<uint8_t> &msg, const std::string &name, uint16_t type, bool unique)
+{
+    put_name(msg, name);
+    put16(msg, type);
+    put16(msg, CLASS_IN | (unique ? 0x8000 : 0));
+    put32(msg, MDNS_TTL);
+    put16(msg, 0);
+    return msg.size();
+}
+
+static void end_record(std::vector<uint8_t> &msg, size_t rdata)
+{
+    size_t size = msg.size() - rdata;
+    msg[rdata - 2] = size >> 8;
+    msg[rdata - 1] = size & 0xff;
+}
+
+struct reader {
+    const uint8_t *msg;
+    size_t len;
+    size_t pos = 0;
+    bool failed = false;
+
+    uint16_t u16()
+    {
+        if (pos + 2 > len) {
+            failed = true;
+            return 0;
+        }
+        pos += 2;
+        return msg[pos - 2] << 8 | msg[pos - 1];
+    }
+    uint32_t u32()
+    {
+        uint32_t high = u16();
+        return high << 16 | u16();
+    }
+    // a name at pos, following compression pointers
+    std::string name()
+    {
+        std::string out;
+        size_t at = pos;
+        bool jumped = false;
+        for (int hops = 0; hops < 16; hops++) {
+            if (at >= len) {
+                break;
+            }
+            uint8_t label = msg[at];
+            if (label == 0) {
+                if (!jumped) {
+                    pos = at + 1;
+                }
+                return out;
+            }
+            if ((label & 0xc0) == 0xc0) {
+                if (at + 1 >= len) {
+                    break;
+                }
+                if (!jumped) {
+                    pos = at + 2;
+                }
+                jumped = true;
+                at = (label & 0x3f) << 8 | msg[at + 1];
+                continue;
+            }
+            if (at + 1 + label > len) {
+                break;
+            }
+            if (!out.empty()) {
+                out += '.';
+            }
+            out.append((const char *)msg + at + 1, label);
+            at += 1 + label;
+        }
+        failed = true;
+        return out;
+    }
+};
+
+static bool same_name(const std::string &a, const std::string &b)
+{
+    return strcasecmp(a.c_str(), b.c_str()) == 0;
+}
+
+static int mdns_socket(uint32_t iface, bool responder)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(responder ? MDNS_PORT : 0);
+    struct in_addr local = {};
+    local.s_addr = iface;
+    uint8_t ttl = 255;
+    bool ok = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+              setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == 0 &&
+              setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == 0;
+    if (ok && responder) {
+        struct ip_mreq mreq = {};
+        mreq.imr_multiaddr.s_addr = inet_addr(MDNS_GROUP);
+        mreq.imr_interface.s_addr = iface;
+        ok = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+    }
+    if (!ok) {
+        perror("mdns socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static bool send_to(int sock, const std::vector<uint8_t> &msg, uint32_t addr, uint16_t port)
+{
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = addr;
+    to.sin_port = port;
+    return sendto(sock, msg.data(), msg.size(), 0, (struct sockaddr *)&to, sizeof(to)) == (ssize_t)msg.size();
+}
+
+// the records of one answer, merged into what came before
+static void parse_answer(const uint8_t *msg, size_t len, const std::string &service,
+                         std::vector<mdns_instance> *found, std::vector<std::pair<std::string, uint32_t>> *hosts)
+{
+    reader r = {msg, len};
+    r.u16();
+    uint16_t flags = r.u16();
+    int questions = r.u16();
+    int records = r.u16() + r.u16() + r.u16();
+    if (r.failed || !(flags & 0x8000)) {
+        return;
+    }
+    for (int i = 0; i < questions && !r.failed; i++) {
+        r.name();
+        r.u32();
+    }
+    auto instance = [&](const std::string & full) -> mdns_instance * {
+        size_t dot = full.find('.');
+        if (dot == std::string::npos || !same_name(full.substr(dot + 1), service))
+        {
+            return nullptr;
+        }
+        std::string name = full.substr(0, dot);
+        for (mdns_instance &m : *found)
+        {
+            if (m.name == name) {
+                return &m;
+            }
+        }
+        found->push_back(mdns_instance());
+        found->back().name = name;
+        return &found->back();
+    };
+    for (int i = 0; i < records && !r.failed; i++) {
+        std::string owner = r.name();
+        uint16_t type = r.u16();
+        r.u16();
+        r.u32();
+        size_t size = r.u16();
+        if (r.failed || r.pos + size > len) {
+            return;
+        }
+        size_t end = r.pos + size;
+        mdns_instance *m;
+        if (type == TYPE_PTR && same_name(owner, service)) {
+            instance(r.name());
+        } else if (type == TYPE_SRV && (m = instance(owner)) != nullptr) {
+            r.u16();
+            r.u16();
+            m->port = r.u16();
+            m->host = r.name();
+        } else if (type == TYPE_TXT && (m = instance(owner)) != nullptr) {
+            m->txt.clear();
+            while (r.pos < end) {
+                std::string item((const char *)msg + r.pos + 1, std::min<size_t>(msg[r.pos], end - r.pos - 1));
+                r.pos += 1 + msg[r.pos];
+                size_t eq = item.find('=');
+                if (eq != std::string::npos) {
+                    m->txt.emplace_back(item.substr(0, eq), item.substr(eq + 1));
+                }
+            }
+        } else if (type == TYPE_A && size == 4) {
+            uint32_t addr;
+            memcpy(&addr, msg + r.pos, 4);
+            hosts->emplace_back(owner, addr);
+        }
+        r.pos = end;
+    }
+}
+
+bool mdns_browse(const char *service, uint32_t iface, int timeout_ms, std::vector<mdns_instance> *found)
+{
+    std::string name = std::string(service) + ".local";
+    int sock = mdns_socket(iface, false);
+    if (sock < 0) {
+        return false;
+    }
+    std::vector<uint8_t> query;
+    put16(query, 0x4654);
+    put16(query, 0);
+    put16(query, 1);
+    put16(query, 0);
+    put16(query, 0);
+    put16(query, 0);
+    put_name(query, name);
+    put16(query, TYPE_PTR);
+    put16(query, CLASS_IN);
+    if (!send_to(sock, query, inet_addr(MDNS_GROUP), htons(MDNS_PORT))) {
+        perror("mdns query");
+        close(sock);
+        return false;
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> hosts;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    uint8_t buf[1500];
+    while (true) {
+        int left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            break;
+        }
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, left) <= 0) {
+            continue;
+        }
+        ssize_t len = recv(sock, buf, sizeof(buf), 0);
+        if (len > 0) {
+            parse_answer(buf, len, name, found, &hosts);
+        }
+    }
+    close(sock);
+    for (mdns_instance &m : *found) {
+        for (const auto &host : hosts) {
+            if (same_name(host.first, m.host)) {
+                m.addr = host.second;
+            }
+        }
+    }
+    return true;
+}
+
+MdnsResponder::~MdnsResponder()
+{
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+bool MdnsResponder::open(const char *service_type, const mdns_instance &instance, uint32_t iface)
+{
+    service = std::string(service_type) + ".local";
+    self = instance;
+    sock = mdns_socket(iface, true);
+    return sock >= 0;
+}
+
+void MdnsResponder::handle()
+{
+    uint8_t buf[1500];
+    struct sockaddr_in from = {};
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+    reader r = {buf, len > 0 ? (size_t)len : 0};
+    uint16_t id = r.u16();
+    uint16_t flags = r.u16();
+    int questions = r.u16();
+    if (r.failed || (flags & 0x8000)) {
+        return;
+    }
+    r.pos = 12;
+    bool asked = false;
+    for (int i = 0; i < questions && !r.failed; i++) {
+        std::string name = r.name();
+        uint16_t type = r.u16();
+        r.u16();
+        asked |= same_name(name, service) && (type == TYPE_PTR || type == TYPE_ANY);
+    }
+    if (r.failed || !asked) {
+        return;
+    }
+
+    bool legacy = ntohs(from.sin_port) != MDNS_PORT;
+    std::string full = self.name + "." + service;
+    std::vector<uint8_t> msg;
+    put16(msg, legacy ? id : 0);
+    put16(msg, 0x8400);
+    put16(msg, legacy ? 1 : 0);
+    put16(msg, 1);
+    put16(msg, 0);
+    put16(msg, 3);
+    if (legacy) {
+        put_name(msg, service);
+        put16(msg, TYPE_PTR);
+        put16(msg, CLASS_IN);
+    }
+    size_t rdata = put_record(msg, service, TYPE_PTR, false);
+    put_name(msg, full);
+    end_record(msg, rdata);
+    rdata = put_record(msg, full, TYPE_SRV, true);
+    put16(msg, 0);
+    put16(msg, 0);
+    put16(msg, self.port);
+    put_name(msg, self.host);
+    end_record(msg, rdata);
+    rdata = put_record(msg, full, TYPE_TXT, true);
+    for (const auto &item : self.txt) {
+        std::string text = item.first + "=" + item.second;
+        msg.push_back(text.size());
+        msg.insert(msg.end(), text.begin(), text.end());
+    }
+    end_record(msg, rdata);
+    rdata = put_record(msg, self.host, TYPE_A, true);
+    msg.insert(msg.end(), (const uint8_t *)&self.addr, (const uint8_t *)&self.addr + 4);
+    end_record(msg, rdata);
+
+    if (legacy) {
+        send_to(sock, msg, from.sin_addr.s_addr, from.sin_port);
+    } else {
+        send_to(sock, msg, inet_addr(MDNS_GROUP), htons(MDNS_PORT));
+    }
+}
@@ -0,0 +1,50 @@
+/*
+   The little of mDNS (RFC 6762, 6763) the fleet tool needs: a one-shot
+   query for the instances of a service, and a responder for a single
+   instance, so that simulated trackers are found the way the firmware's
+   are.
+
+   The query goes out from an ephemeral port, which makes it a legacy
+   unicast query: responders, the ESP-IDF mdns component as well, answer
+   it straight to the sender with all the records at once. No probing, no
+   caching, no known answer suppression.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct mdns_instance {
+    std::string name;           // first label of the instance, "tracker-0200000000a1"
+    std::string host;           // target of the SRV record
+    uint16_t port = 0;
+    uint32_t addr = 0;          // network order, 0 without an A record
+    std::vector<std::pair<std::string, std::string>> txt;
+
+    const char *get(const char *key) const;
+};
+
+/**
+ * @brief Ask who offers service, "_suntracker._udp", and collect the answers for timeout_ms
+ * @param iface address of the interface to ask on, network order, 0 for the default
+ */
+bool mdns_browse(const char *service, uint32_t iface, int timeout_ms, std::vector<mdns_instance> *found);
+
+class MdnsResponder {
+public:
+    ~MdnsResponder();
+    bool open(const char *service, const mdns_instance &self, uint32_t iface);
+    int fd() const
+    {
+        return sock;
+    }
+    // answer the query waiting on fd(), if it asks for the service
+    void handle();
+
+private:
+    int sock = -1;
+    std::string service;        // "_suntracker._udp.local"
+    mdns_instance self;
+};
@@ -0,0 +1,187 @@
+"""Load test of the realtime telemetry: polling against event streams.
+
+Opens N dashboards against a device, either polling /api/v1/temp/raw every
+interval as HomeView.vue used to, or holding /api/v1/events streams, and
+reports per client the updates per second, and for the device the CPU the
+telemetry took, from the counters in /api/v1/sysinfo. Those counters cover
+building the JSON and sending it, not the HTTP parsing of each poll, so the
+polling figures are a lower bound.
+
+A client count is sustained when every client gets at least 90% of the
+updates it asked for (streams only send what changed, on a device that is
+idle that can be less without anything being wrong).
+
+--slow opens that many event streams which never read, before the clients
+of each run. The device has to drop them once their socket buffers are
+full and keep the rate of the others; the streams count against the
+TELEMETRY_MAX_CLIENTS slots.
+
+    python3 telemetry_load.py --url http://192.168.4.1 --clients 1,2,3,4 --seconds 20
+    python3 telemetry_load.py --mode events --clients 1,2 --slow 1
+"""
+import argparse
+import http.client
+import json
+import socket
+import threading
+import time
+from urllib.parse import urlparse
+
+
+def sysinfo(host, port):
+    conn = http.client.HTTPConnection(host, port, timeout=5)
+    conn.request('GET', '/api/v1/sysinfo')
+    info = json.loads(conn.getresponse().read())
+    conn.close()
+    return info.get('telemetry', {})
+
+
+class Client(threading.Thread):
+    def __init__(self, host, port, mode, interval_ms, stop):
+        super().__init__(daemon=True)
+        self.host, self.port, self.mode = host, port, mode
+        self.interval = interval_ms / 1000.0
+        self.stop = stop
+        self.updates = 0
+        self.errors = 0
+        self.rejected = False
+        self.latency = []
+
+    def run(self):
+        try:
+            if self.mode == 'poll':
+                self.poll()
+            else:
+                self.stream()
+        except (OSError, http.client.HTTPException):
+            self.errors += 1
+
+    def poll(self):
+        conn = http.client.HTTPConnection(self.host, self.port, timeout=5)
+        due = time.monotonic()
+        while not self.stop.is_set():
+            start = time.monotonic()
+            try:
+                conn.request('GET', '/api/v1/temp/raw')
+                response = conn.getresponse()
+                response.read()
+                if response.status == 200:
+                    self.updates += 1
+                    self.latency.append(time.monotonic() - start)
+                else:
+                    self.errors += 1
+            except (OSError, http.client.HTTPException):
+                self.errors += 1
+                conn.close()
+                conn = http.client.HTTPConnection(self.host, self.port, timeout=5)
+            # setInterval: the next request is due one interval after the last one was
+            due += self.interval
+            self.stop.wait(max(0.0, due - time.monotonic()))
+        conn.close()
+
+    def stream(self):
+        conn = http.client.HTTPConnection(self.host, self.port, timeout=20)
+        conn.request('GET', '/api/v1/events?interval=%d' % (self.interval * 1000),
+                     headers={'Accept': 'text/event-stream'})
+        response = conn.getresponse()
+        if response.status != 200:
+            self.rejected = True
+            response.read()
+            conn.close()
+            return
+        while not self.stop.is_set():
+            line = response.fp.readline()
+            if not line:
+                self.errors += 1
+                break
+            if line.startswith(b'data:'):
+                self.updates += 1
+        conn.close()
+
+
+def stall(host, port, interval_ms):
+    """An event stream that is never read, its receive window closes after a few events."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1024)
+    sock.connect((host, port))
+    sock.sendall(b'GET /api/v1/events?interval=%d HTTP/1.1\r\nHost: %s\r\nAccept: text/event-stream\r\n\r\n'
+                 % (interval_ms, host.encode()))
+    return sock
+
+
+def run(host, port, mode, clients, seconds, interval_ms, slow=0):
+    before = sysinfo(host, port)
+    stalled = [stall(host, port, interval_ms) for _ in range(slow)]
+    stop = threading.Event()
+    threads = [Client(host, port, mode, interval_ms, stop) for _ in range(clients)]
+    start = time.monotonic()
+    for thread in threads:
+        thread.start()
+    time.sleep(seconds)
+    stop.set()
+    for thread in threads:
+        thread.join(timeout=25)
+    elapsed = time.monotonic() - start
+    after = sysinfo(host, port)
+    for sock in stalled:
+        sock.close()
+
+    def delta(key):
+        return after.get(key, 0) - before.get(key, 0)
+
+    device_s = (after.get('uptimeUs', 0) - before.get('uptimeUs', 0)) / 1e6 or elapsed
+    cpu = (delta('buildUs') + delta('sendUs')) / 1e6 / device_s
+    served = [t for t in threads if not t.rejected]
+    rates = [t.updates / elapsed for t in served]
+    latency = [x for t in threads for x in t.latency]
+    return {
+        'mode': mode,
+        'clients': clients,
+        'served': len(served),
+        'rate_min': min(rates) if rates else 0.0,
+        'rate_mean': sum(rates) / len(rates) if rates else 0.0,
+        'errors': sum(t.errors for t in threads),
+        'latency_ms': 1000 * sum(latency) / len(latency) if latency else float('nan'),
+        'cpu': cpu,
+        'builds': delta('builds') / device_s,
+        'unchanged': delta('unchanged'),
+        'dropped': delta('dropped'),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--url', default='http://192.168.4.1')
+    parser.add_argument('--mode', choices=['poll', 'events', 'both'], default='both')
+    parser.add_argument('--clients', default='1,2,3,4', help='comma separated client counts')
+    parser.add_argument('--seconds', type=float, default=20)
+    parser.add_argument('--interval', type=int, default=150, help='ms between updates a client asks for')
+    parser.add_argument('--slow', type=int, default=0, help='stalled event streams open during each run')
+    args = parser.parse_args()
+
+    url = urlparse(args.url)
+    host, port = url.hostname, url.port or 80
+    modes = ['poll', 'events'] if args.mode == 'both' else [args.mode]
+    wanted = 1000.0 / args.interval
+    sustained = {mode: 0 for mode in modes}
+
+    print('%-7s %7s %6s %9s %9s %6s %8s %8s %9s %8s %7s' % (
+        'mode', 'clients', 'served', 'upd/s min', 'upd/s avg', 'errors', 'lat ms', 'cpu %', 'cpu %/cl', 'builds/s',
+        'dropped'))
+    for mode in modes:
+        for clients in [int(c) for c in args.clients.split(',')]:
+            r = run(host, port, mode, clients, args.seconds, args.interval, args.slow)
+            print('%-7s %7d %6d %9.2f %9.2f %6d %8.1f %8.2f %9.2f %8.2f %7d' % (
+                r['mode'], r['clients'], r['served'], r['rate_min'], r['rate_mean'], r['errors'], r['latency_ms'],
+                100 * r['cpu'], 100 * r['cpu'] / max(r['served'], 1), r['builds'], r['dropped']))
+            if r['dropped'] < args.slow:
+                print('  %d of %d stalled streams not dropped' % (args.slow - r['dropped'], args.slow))
+            elif r['served'] == clients and r['errors'] == 0 and r['rate_min'] >= 0.9 * wanted:
+                sustained[mode] = max(sustained[mode], clients)
+            time.sleep(1)
+    for mode in modes:
+        print('%s: %d clients sustained at %.1f updates/s' % (mode, sustained[mode], wanted))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,597 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "field_planner.h"
+#include "ephemeris_year.h"
+
+static const double RAD = M_PI / 180.0;
+
+struct vec3 {
+    float x, y, z;
+};
+
+static vec3 operator+(vec3 a, vec3 b)
+{
+    return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+static vec3 operator-(vec3 a, vec3 b)
+{
+    return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+static vec3 operator*(vec3 a, float k)
+{
+    return {a.x * k, a.y * k, a.z * k};
+}
+
+static float dot(vec3 a, vec3 b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static vec3 unit(vec3 a)
+{
+    float n = sqrtf(dot(a, a));
+    return n > 0 ? a * (1 / n) : a;
+}
+
+// a mirror at one step: its frame and the direction of its ray to the receiver
+struct mirror_state {
+    vec3 n, u, v;               // normal, horizontal edge, the other edge
+    vec3 r;                     // to the aim point, unit
+    float reach;                // distance to the aim point
+    uint8_t choice;
+};
+
+// pivots binned into square cells, each cell a range of items
+class FieldGrid {
+public:
+    void build(const std::vector<field_mirror> &mirrors, float cell_m)
+    {
+        cell = cell_m;
+        min_x = min_y = 1e30f;
+        float max_x = -1e30f, max_y = -1e30f;
+        for (const field_mirror &m : mirrors) {
+            min_x = std::min(min_x, m.east);
+            min_y = std::min(min_y, m.north);
+            max_x = std::max(max_x, m.east);
+            max_y = std::max(max_y, m.north);
+        }
+        nx = (int)((max_x - min_x) / cell) + 1;
+        ny = (int)((max_y - min_y) / cell) + 1;
+        start.assign(nx * ny + 1, 0);
+        for (const field_mirror &m : mirrors) {
+            start[index(m.east, m.north) + 1]++;
+        }
+        for (int c = 0; c < nx * ny; c++) {
+            start[c + 1] += start[c];
+        }
+        items.resize(mirrors.size());
+        std::vector<int> fill(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < mirrors.size(); i++) {
+            items[fill[index(mirrors[i].east, mirrors[i].north)]++] = (int)i;
+        }
+    }
+
+    int cells() const
+    {
+        return nx * ny;
+    }
+
+    /**
+     * @brief Mirrors with a pivot within margin of the segment, each once
+     * @param stamp one int per cell, from the caller, *mark changes every query
+     */
+    void along(float x0, float y0, float x1, float y1, float margin, std::vector<int> &stamp, int *mark,
+               std::vector<int> *out) const
+    {
+        ++*mark;
+        out->clear();
+        float length = hypotf(x1 - x0, y1 - y0);
+        int points = (int)(length / (cell * 0.5f)) + 1;
+        int reach = (int)ceilf(margin / cell);
+        for (int p = 0; p <= points; p++) {
+            float x = x0 + (x1 - x0) * p / points, y = y0 + (y1 - y0) * p / points;
+            int cx = (int)floorf((x - min_x) / cell), cy = (int)floorf((y - min_y) / cell);
+            for (int j = std::max(cy - reach, 0); j <= std::min(cy + reach, ny - 1); j++) {
+                for (int i = std::max(cx - reach, 0); i <= std::min(cx + reach, nx - 1); i++) {
+                    int c = j * nx + i;
+                    if (stamp[c] == *mark) {
+                        continue;
+                    }
+                    stamp[c] = *mark;
+                    out->insert(out->end(), items.begin() + start[c], items.begin() + start[c + 1]);
+                }
+            }
+        }
+    }
+
+private:
+    int index(float x, float y) const
+    {
+        int i = std::min((int)((x - min_x) / cell), nx - 1), j = std::min((int)((y - min_y) / cell), ny - 1);
+        return j * nx + i;
+    }
+
+    float cell = 1, min_x = 0, min_y = 0;
+    int nx = 0, ny = 0;
+    std::vector<int> start, items;
+};
+
+std::vector<field_mirror> field_synthetic(int count, float width, float height, float spacing, double latitude)
+{
+    // rows get further apart away from the receiver, where the rays to it are lower,
+    // and pivots are never closer than the diagonal, where two mirrors could touch
+    float diagonal = hypotf(width, height) * 1.01f;
+    int columns = std::max(1, (int)ceil(sqrt((double)count)));
+    float dx = std::max(width * spacing, diagonal);
+    float north = latitude >= 0 ? 1 : -1;
+    float row = 4 * dx;
+    std::vector<field_mirror> mirrors;
+    for (int r = 0; (int)mirrors.size() < count; r++) {
+        float shift = (r % 2) * dx / 2;
+        for (int c = 0; c < columns && (int)mirrors.size() < count; c++) {
+            mirrors.push_back({(c - (columns - 1) / 2.0f) * dx + shift, north * row, 1.5f});
+        }
+        row += std::max(dx * (0.8f + 0.01f * r), sqrtf(std::max(diagonal * diagonal - dx * dx / 4, 0.0f)));
+    }
+    return mirrors;
+}
+
+int field_collisions(const std::vector<field_mirror> &mirrors, float width, float height)
+{
+    float diagonal = hypotf(width, height);
+    FieldGrid grid;
+    grid.build(mirrors, diagonal);
+    std::vector<int> stamp(grid.cells(), 0), near;
+    int mark = 0, pairs = 0;
+    for (size_t i = 0; i < mirrors.size(); i++) {
+        const field_mirror &m = mirrors[i];
+        grid.along(m.east, m.north, m.east, m.north, diagonal, stamp, &mark, &near);
+        for (int j : near) {
+            const field_mirror &o = mirrors[j];
+            float de = o.east - m.east, dn = o.north - m.north, du = o.up - m.up;
+            pairs += j > (int)i && de * de + dn * dn + du * du < diagonal * diagonal;
+        }
+    }
+    return pairs;
+}
+
+struct step_scratch {
+    std::vector<mirror_state> state, naive, before;
+    std::vector<float> own, inflicted;
+    std::vector<std::pair<int, int>> victims;   // (blocker, mirror) when the blocker alone takes a ray
+    std::vector<int> stamp, sun_near, ray_near;
+    int mark = 0;
+    int64_t tests = 0;
+};
+
+struct field_context {
+    const field_config &config;
+    const std::vector<field_mirror> &mirrors;
+    FieldGrid grid;
+    float half_diag;
+    float top;                  // highest point a mirror reaches
+    float extent;               // across the field
+};
+
+static vec3 pivot_of(const field_mirror &m)
+{
+    return {m.east, m.north, m.up};
+}
+
+static vec3 aim_point(const field_config &config, int offset)
+{
+    float k = config.offsets > 1 ? (float)offset / (config.offsets - 1) - 0.5f : 0;
+    return {config.receiver[0], config.receiver[1], config.receiver[2] + k * config.aperture};
+}
+
+static void orient(const field_context &ctx, int i, vec3 sun, uint8_t choice, mirror_state *m)
+{
+    vec3 p = pivot_of(ctx.mirrors[i]);
+    vec3 to = aim_point(ctx.config, choice == FIELD_STOW ? ctx.config.offsets / 2 : choice) - p;
+    m->reach = sqrtf(dot(to, to));
+    m->r = to * (1 / m->reach);
+    // stowed it reflects the sun to the zenith, the rays to the receiver do not matter
+    m->n = unit(sun + (choice == FIELD_STOW ? vec3{0, 0, 1} : m->r));
+    m->u = unit(vec3{-m->n.y, m->n.x, 0});
+    if (dot(m->u, m->u) < 0.5f) {
+        m->u = {1, 0, 0};
+    }
+    m->v = {m->n.y * m->u.z - m->n.z * m->u.y, m->n.z * m->u.x - m->n.x * m->u.z, m->n.x * m->u.y - m->n.y * m->u.x};
+    m->choice = choice;
+}
+
+// the mirrors a ray from the pivot of i along d may meet before it leaves the field or gets past far
+static void candidates(const field_context &ctx, int i, vec3 d, float far, step_scratch *s, std::vector<int> *out)
+{
+    if (ctx.config.brute) {
+        out->resize(ctx.mirrors.size());
+        for (size_t j = 0; j < ctx.mirrors.size(); j++) {
+            (*out)[j] = (int)j;
+        }
+        return;
+    }
+    const field_mirror &m = ctx.mirrors[i];
+    float horizontal = hypotf(d.x, d.y);
+    float reach = ctx.extent;
+    if (d.z > 1e-6f) {
+        reach = std::min(reach, (ctx.top - (m.up - ctx.half_diag)) / d.z * horizontal);
+    }
+    reach = std::min(reach, far * horizontal) + ctx.half_diag;
+    float hx = horizontal > 0 ? d.x / horizontal : 0, hy = horizontal > 0 ? d.y / horizontal : 0;
+    ctx.grid.along(m.east, m.north, m.east + hx * reach, m.north + hy * reach, 2 * ctx.half_diag, s->stamp, &s->mark,
+                   out);
+
+    // then only those whose sphere the rays from the mirror pass through
+    vec3 p = pivot_of(m);
+    float radius = 2 * ctx.half_diag;
+    size_t kept = 0;
+    for (int j : *out) {
+        vec3 w = pivot_of(ctx.mirrors[j]) - p;
+        float t = dot(w, d);
+        if (t > -radius && t < far + radius && dot(w, w) - t * t <= radius * radius) {
+            (*out)[kept++] = j;
+        }
+    }
+    out->resize(kept);
+}
+
+#define FIELD_MAX_HITS      8   // blockers of one ray a charge is split between
+#define FIELD_STOW_ROUNDS   2
+
+// the mirrors of near other than i the ray meets within far, the first FIELD_MAX_HITS into hits
+static int cast(const field_context &ctx, const std::vector<mirror_state> &state, const std::vector<int> &near, int i,
+                vec3 p, vec3 d, float far, step_scratch *s, int *hits, int count)
+{
+    const float hw = ctx.config.width / 2, hh = ctx.config.height / 2;
+    for (int j : near) {
+        if (j == i) {
+            continue;
+        }
+        s->tests++;
+        const mirror_state &m = state[j];
+        float denom = dot(d, m.n);
+        if (fabsf(denom) < 1e-9f) {
+            continue;
+        }
+        vec3 c = pivot_of(ctx.mirrors[j]);
+        float t = dot(c - p, m.n) / denom;
+        if (t <= 1e-3f || t >= far) {
+            continue;
+        }
+        vec3 h = p + d * t - c;
+        if (fabsf(dot(h, m.u)) <= hw && fabsf(dot(h, m.v)) <= hh && count < FIELD_MAX_HITS &&
+                std::find(hits, hits + count, j) == hits + count) {
+            hits[count++] = j;
+        }
+    }
+    return count;
+}
+
+/*
+ * The power mirror i delivers, with what it loses to shading and blocking.
+ * With charge, a lost ray is charged to the neighbours it meets, split
+ * evenly.
+ */
+static float evaluate(const field_context &ctx, const std::vector<mirror_state> &state, int i, vec3 sun, double dni,
+                      step_scratch *s, float *shaded, float *blocked, bool charge)
+{
+    const field_config &config = ctx.config;
+    const mirror_state &m = state[i];
+    *shaded = *blocked = 0;
+    if (m.choice == FIELD_STOW) {
+        return 0;
+    }
+    float cos_incidence = std::max(dot(sun, m.n), 0.0f);
+    float per_ray = dni * config.width * config.height * cos_incidence / (config.samples * config.samples);
+    vec3 pivot = pivot_of(ctx.mirrors[i]);
+    candidates(ctx, i, sun, ctx.extent, s, &s->sun_near);
+    candidates(ctx, i, m.r, m.reach, s, &s->ray_near);
+
+    float delivered = 0;
+    for (int a = 0; a < config.samples; a++) {
+        for (int b = 0; b < config.samples; b++) {
+            float ea = ((a + 0.5f) / config.samples - 0.5f) * config.width;
+            float eb = ((b + 0.5f) / config.samples - 0.5f) * config.height;
+            vec3 p = pivot + m.u * ea + m.v * eb;
+            int hits[FIELD_MAX_HITS];
+            int shade = cast(ctx, state, s->sun_near, i, p, sun, ctx.extent, s, hits, 0);
+            int count = cast(ctx, state, s->ray_near, i, p, m.r, m.reach, s, hits, shade);
+            if (shade > 0) {
+                *shaded += per_ray;
+            } else if (count > 0) {
+                *blocked += per_ray;
+            } else {
+                delivered += per_ray;
+            }
+            for (int h = 0; charge && h < count; h++) {
+                s->victims.push_back({hits[h], i});
+                s->inflicted[hits[h]] += per_ray / count;
+            }
+        }
+    }
+    return delivered;
+}
+
+static double evaluate_all(const field_context &ctx, const std::vector<mirror_state> &state, vec3 sun, double dni,
+                           step_scratch *s, field_step *step, bool charge)
+{
+    int n = (int)ctx.mirrors.size();
+    double total = 0;
+    step->shaded = step->blocked = 0;
+    if (charge) {
+        s->victims.clear();
+        s->inflicted.assign(n, 0);
+    }
+    for (int i = 0; i < n; i++) {
+        float shaded, blocked;
+        s->own[i] = evaluate(ctx, state, i, sun, dni, s, &shaded, &blocked, charge);
+        total += s->own[i];
+        step->shaded += shaded;
+        step->blocked += blocked;
+    }
+    return total;
+}
+
+/*
+ * Stow, the worst first, the mirrors charged with more than they deliver,
+ * each when the mirrors it was taking from gain more than it delivered.
+ * A stowed mirror is still in the way, only flatter.
+ */
+static bool stow_round(const field_context &ctx, vec3 sun, double dni, step_scratch *s)
+{
+    int n = (int)ctx.mirrors.size();
+    std::vector<int> order;
+    for (int j = 0; j < n; j++) {
+        if (s->state[j].choice != FIELD_STOW && s->inflicted[j] > s->own[j]) {
+            order.push_back(j);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return s->inflicted[a] - s->own[a] > s->inflicted[b] - s->own[b];
+    });
+    std::sort(s->victims.begin(), s->victims.end());
+    s->victims.erase(std::unique(s->victims.begin(), s->victims.end()), s->victims.end());
+    bool stowed = false;
+    for (int j : order) {
+        auto first = std::lower_bound(s->victims.begin(), s->victims.end(), std::make_pair(j, -1));
+        auto last = first;
+        double before = s->own[j], after = 0;
+        for (; last != s->victims.end() && last->first == j; ++last) {
+            before += s->own[last->second];
+        }
+        mirror_state keep = s->state[j];
+        orient(ctx, j, sun, FIELD_STOW, &s->state[j]);
+        std::vector<float> gained;
+        for (auto v = first; v != last; ++v) {
+            float shaded, blocked;
+            gained.push_back(evaluate(ctx, s->state, v->second, sun, dni, s, &shaded, &blocked, false));
+            after += gained.back();
+        }
+        if (after <= before * 1.0001) {
+            s->state[j] = keep;
+            continue;
+        }
+        stowed = true;
+        s->own[j] = 0;
+        for (auto v = first; v != last; ++v) {
+            s->own[v->second] = gained[v - first];
+        }
+    }
+    return stowed;
+}
+
+static void plan_step(const field_context &ctx, int k, step_scratch *s, field_plan *plan)
+{
+    const field_config &config = ctx.config;
+    int n = (int)ctx.mirrors.size();
+    field_step &step = plan->steps[k];
+    uint8_t *choice = &plan->choice[(size_t)k * n];
+    double zenith, azimuth;
+    sun_batch((double)(config.start + (int64_t)k * config.step_s), config.step_s, 1, config.latitude, config.longitude,
+              &zenith, &azimuth);
+    step = {};
+    step.zenith = zenith;
+    step.azimuth = azimuth;
+    if (zenith >= 90) {
+        memset(choice, FIELD_NIGHT, n);
+        return;
+    }
+    double dhi;
+    clear_sky(zenith, &step.dni, &dhi);
+    float sz = sin(zenith * RAD);
+    vec3 sun = {(float)(sz * sin(azimuth * RAD)), (float)(sz * cos(azimuth * RAD)), (float)cos(zenith * RAD)};
+    uint8_t centre = config.offsets / 2;
+
+    s->state.resize(n);
+    s->own.resize(n);
+    for (int i = 0; i < n; i++) {
+        orient(ctx, i, sun, centre, &s->state[i]);
+        step.ideal += step.dni * config.width * config.height * std::max(dot(sun, s->state[i].n), 0.0f);
+    }
+    step.naive = evaluate_all(ctx, s->state, sun, step.dni, s, &step, config.optimize);
+    step.delivered = step.naive;
+    double naive_shaded = step.shaded, naive_blocked = step.blocked;
+
+    if (config.optimize) {
+        s->naive = s->state;
+        double total = step.naive;
+        for (int round = 0; round < FIELD_STOW_ROUNDS; round++) {
+            if (round > 0) {
+                total = evaluate_all(ctx, s->state, sun, step.dni, s, &step, true);
+            }
+            s->before = s->state;
+            if (!stow_round(ctx, sun, step.dni, s)) {
+                break;
+            }
+            double stowed = evaluate_all(ctx, s->state, sun, step.dni, s, &step, false);
+            if (stowed <= total) {
+                s->state = s->before;
+                break;
+            }
+        }
+
+        // a blocked mirror tries the other aim points, neighbours as they are
+        for (int i = 0; i < n && config.offsets > 1; i++) {
+            float shaded, blocked;
+            if (s->state[i].choice == FIELD_STOW) {
+                continue;
+            }
+            float best = evaluate(ctx, s->state, i, sun, step.dni, s, &shaded, &blocked, false);
+            if (blocked <= 0) {
+                continue;
+            }
+            uint8_t current = s->state[i].choice;
+            for (int o = 0; o < config.offsets; o++) {
+                if (o == current) {
+                    continue;
+                }
+                mirror_state before = s->state[i];
+                orient(ctx, i, sun, o, &s->state[i]);
+                float power = evaluate(ctx, s->state, i, sun, step.dni, s, &shaded, &blocked, false);
+                if (power > best * 1.001f) {
+                    best = power;
+                } else {
+                    s->state[i] = before;
+                }
+            }
+        }
+        step.delivered = evaluate_all(ctx, s->state, sun, step.dni, s, &step, false);
+        if (step.delivered < step.naive) {
+            // the moves interact, keep the plain plan when they lost
+            s->state = s->naive;
+            step.delivered = step.naive;
+            step.shaded = naive_shaded;
+            step.blocked = naive_blocked;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        choice[i] = s->state[i].choice;
+        step.stowed += choice[i] == FIELD_STOW;
+        step.offset += choice[i] != FIELD_STOW && choice[i] != centre;
+    }
+    step.tests = s->tests;
+    s->tests = 0;
+}
+
+field_plan plan_field(const field_config &config, const std::vector<field_mirror> &mirrors)
+{
+    auto begin = std::chrono::steady_clock::now();
+    field_context ctx = {config, mirrors};
+    ctx.half_diag = hypotf(config.width, config.height) / 2;
+    ctx.top = -1e30f;
+    float min_x = 1e30f, max_x = -1e30f, min_y = 1e30f, max_y = -1e30f;
+    for (const field_mirror &m : mirrors) {
+        ctx.top = std::max(ctx.top, m.up + ctx.half_diag);
+        min_x = std::min(min_x, m.east);
+        max_x = std::max(max_x, m.east);
+        min_y = std::min(min_y, m.north);
+        max_y = std::max(max_y, m.north);
+    }
+    ctx.extent = hypotf(max_x - min_x, max_y - min_y) + 2 * ctx.half_diag;
+    ctx.grid.build(mirrors, std::max(config.width, config.height) * 2);
+
+    field_plan plan;
+    plan.mirrors = (int)mirrors.size();
+    plan.steps.resize(config.steps);
+    plan.choice.resize((size_t)config.steps * mirrors.size());
+    int threads = config.threads > 0 ? config.threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1, std::min(threads, config.steps));
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; w++) {
+        workers.emplace_back([&, w] {
+            step_scratch scratch;
+            scratch.stamp.assign(ctx.grid.cells(), 0);
+            // interleaved, the daylight steps are in the middle
+            for (int k = w; k < config.steps; k += threads) {
+                plan_step(ctx, k, &scratch, &plan);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    plan.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return plan;
+}
+
+std::vector<field_window> plan_windows(const field_plan &plan, int mirror, int max_windows)
+{
+    // runs of one choice, FIELD_STOW runs are the gaps between windows
+    std::vector<field_window> runs;
+    for (size_t k = 0; k < plan.steps.size(); k++) {
+        int c = plan.choice[k * plan.mirrors + mirror];
+        if (c == FIELD_NIGHT) {
+            continue;
+        }
+        if (!runs.empty() && runs.back().offset == c && runs.back().to_step == (int)k) {
+            runs.back().to_step++;
+        } else {
+            runs.push_back({c, (int)k, (int)k + 1});
+        }
+    }
+    auto windows = [&]() {
+        return std::count_if(runs.begin(), runs.end(), [](const field_window &w) {
+            return w.offset != FIELD_STOW;
+        });
+    };
+    while (windows() > max_windows) {
+        // the shortest window takes the choice of its longer neighbour
+        int shortest = -1;
+        for (int i = 0; i < (int)runs.size(); i++) {
+            if (runs[i].offset != FIELD_STOW &&
+                    (shortest < 0 || runs[i].to_step - runs[i].from_step < runs[shortest].to_step - runs[shortest].from_step)) {
+                shortest = i;
+            }
+        }
+        int before = shortest > 0 && runs[shortest - 1].to_step == runs[shortest].from_step ? shortest - 1 : -1;
+        int after = shortest + 1 < (int)runs.size() && runs[shortest + 1].from_step == runs[shortest].to_step ?
+                    shortest + 1 : -1;
+        int length_before = before >= 0 ? runs[before].to_step - runs[before].from_step : -1;
+        int length_after = after >= 0 ? runs[after].to_step - runs[after].from_step : -1;
+        runs[shortest].offset = before < 0 && after < 0 ? FIELD_STOW :
+                                runs[length_before >= length_after ? before : after].offset;
+        std::vector<field_window> merged;
+        for (const field_window &w : runs) {
+            if (!merged.empty() && merged.back().offset == w.offset && merged.back().to_step == w.from_step) {
+                merged.back().to_step = w.to_step;
+            } else {
+                merged.push_back(w);
+            }
+        }
+        runs.swap(merged);
+    }
+    runs.erase(std::remove_if(runs.begin(), runs.end(), [](const field_window &w) {
+        return w.offset == FIELD_STOW;
+    }), runs.end());
+    return runs;
+}
+
+heliostat_target plan_target(const field_config &config, const field_mirror &mirror, const field_window &window,
+                             int utc_offset_s)
+{
+    heliostat_target target = {};
+    vec3 aim = aim_point(config, window.offset);
+    float k = aim.z - config.receiver[2];
+    if (fabsf(k) < 0.005f) {
+        snprintf(target.name, sizeof(target.name), "rx");
+    } else {
+        snprintf(target.name, sizeof(target.name), "rx%+.2f", k);
+    }
+    target.east = aim.x - mirror.east;
+    target.north = aim.y - mirror.north;
+    target.up = aim.z - mirror.up;
+    auto minute = [&](int step) {
+        int64_t t = config.start + (int64_t)step * config.step_s + utc_offset_s;
+        return (uint16_t)(((t % 86400) + 86400) % 86400 / 60);
+    };
+    target.from_min = minute(window.from_step);
+    target.to_min = minute(window.to_step);
+    target.enable = 1;
+    return target;
+}
@@ -0,0 +1,108 @@
+/*
+   Field planner for heliostats sharing one receiver.
+
+   In MODE_REFLECT every unit aims on its own, and near sunrise and sunset
+   the mirrors of a dense field shade each other (a neighbour stands
+   between the mirror and the sun) and block each other (a neighbour
+   stands between the mirror and the receiver). The planner takes the
+   pivots of the field and the sun of tools/ephemeris, and for every step
+   of a day casts rays from a grid of points on each mirror towards the
+   sun and towards the receiver. A uniform grid over the ground finds the
+   few neighbours a ray can meet: its reach is bounded by the height of
+   the tallest mirror.
+
+   Two moves then raise the flux delivered at each step:
+     - stow: a mirror that takes more from its neighbours than it
+       delivers itself sends its light to the zenith instead, the
+       fallback of MODE_REFLECT with a target pitch of 0, which lays it
+       flatter. At low sun this staggers the rows.
+     - offset: a blocked mirror aims higher or lower on the receiver
+       aperture, which tilts its ray over the neighbour in front.
+
+   The pivots have to be a mirror diagonal apart, so that no two mirrors
+   can touch whatever they aim at: the planner checks the field rather
+   than the mirrors at every step. Steps are independent and spread over
+   threads. The plan of each mirror
+   is turned into at most HELIOSTAT_MAX_TARGETS heliostat targets with
+   their windows, outside of every window it stows.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "heliostat.h"
+
+#define FIELD_MAX_SAMPLES       4       // per side of a mirror, 16 rays at most
+#define FIELD_MAX_OFFSETS       9
+#define FIELD_STOW              0xfe    // reflecting to the zenith
+#define FIELD_NIGHT             0xff    // sun below the horizon
+
+struct field_mirror {
+    float east, north, up;      // pivot, metres from the foot of the receiver
+};
+
+struct field_config {
+    double latitude, longitude;
+    int64_t start;              // unix time of the first step
+    int step_s;
+    int steps;
+    float width, height;        // of a mirror, metres
+    float receiver[3];          // centre of the aperture, east north up
+    float aperture;             // height of the aperture, the offsets span it
+    int offsets;                // aim points over the aperture, odd, the middle one is the centre
+    int samples;                // rays per side of a mirror
+    bool optimize;              // false plans every mirror at the centre, as MODE_REFLECT does
+    bool brute;                 // test every mirror instead of the grid, to check the grid
+    int threads;                // 0 for one per core
+};
+
+struct field_step {
+    double zenith, azimuth;     // of the sun, degrees
+    double dni;                 // W/m2
+    double ideal;               // W without shading or blocking
+    double delivered;           // W onto the receiver
+    double naive;               // W delivered with every mirror at the centre
+    double shaded, blocked;     // W lost to each
+    int stowed;
+    int offset;                 // mirrors aiming off the centre
+    int64_t tests;              // ray against mirror tests
+};
+
+struct field_plan {
+    std::vector<field_step> steps;
+    int mirrors;
+    std::vector<uint8_t> choice;    // steps x mirrors: offset index, FIELD_STOW or FIELD_NIGHT
+    double seconds;
+};
+
+// a window of the day served at one aim point, the heliostat target of a unit
+struct field_window {
+    int offset;
+    int from_step, to_step;     // to_step excluded
+};
+
+/**
+ * @brief A square-ish field north of the receiver (south of it on the southern hemisphere)
+ * @param spacing east-west distance of the pivots in mirror widths, rows alternate by half of it;
+ *                pivots are kept a diagonal apart whatever it is
+ */
+std::vector<field_mirror> field_synthetic(int count, float width, float height, float spacing, double latitude);
+
+/**
+ * @brief Pairs of pivots closer than the diagonal of a mirror, which could touch
+ */
+int field_collisions(const std::vector<field_mirror> &mirrors, float width, float height);
+
+field_plan plan_field(const field_config &config, const std::vector<field_mirror> &mirrors);
+
+/**
+ * @brief The windows of one mirror, at most max_windows, short runs merged into their neighbours
+ */
+std::vector<field_window> plan_windows(const field_plan &plan, int mirror, int max_windows);
+
+/**
+ * @brief The heliostat target of a window, the aim point seen from the pivot
+ * @param utc_offset_s local time minus UTC, for the window in minutes of the day
+ */
+heliostat_target plan_target(const field_config &config, const field_mirror &mirror, const field_window &window,
+                             int utc_offset_s);
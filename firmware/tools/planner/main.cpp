@@ -0,0 +1,301 @@
+/*
+   Heliostat field planner: shading, blocking and the aim points of a day.
+
+   Build from firmware/tools/planner:
+     g++ -std=c++17 -O3 -march=native -pthread -I../ephemeris -I../../main/gimbal \
+         main.cpp field_planner.cpp ../ephemeris/ephemeris_year.cpp -o planner
+
+   planner [--field field.csv | --mirrors n] [--spacing 1.6] [--lat 28.183] [--lon 112.933]
+           [--date 2025-12-21] [--size 1x1] [--receiver east,north,up] [--aperture m] [--offsets 5]
+           [--samples 3] [--step s] [--threads n] [--utc-offset h] [--naive] [--out plan.csv]
+   planner --bench [--mirrors 10000] [--step 600] ...
+
+   field.csv has a pivot per line, east,north,up in metres from the foot of
+   the receiver; without it --mirrors lays out a synthetic field. The day
+   is planned every --step seconds, HELIOSTAT_STEP_S by default, and
+   compared hour by hour with every mirror aiming at the centre as
+   MODE_REFLECT does (--naive plans only that).
+
+   --out writes the heliostat targets of every mirror, in the JSON names
+   of /api/v1/setting, windows in local minutes (--utc-offset, by default
+   the longitude's). Outside its windows a mirror is meant to serve the
+   zenith, target pitch 0.
+
+   --bench plans synthetic fields of 10 mirrors up to --mirrors on one
+   thread and on all, times the shading and blocking alone (naive) with
+   the grid, and up to 1000 mirrors checks that testing every mirror
+   instead finds the same.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "field_planner.h"
+
+static void usage()
+{
+    fprintf(stderr, "usage: planner [--field file | --mirrors n] [--spacing k] [--lat deg] [--lon deg] [--date yyyy-mm-dd]\n"
+                    "               [--size wxh] [--receiver e,n,u] [--aperture m] [--offsets n] [--samples n] [--step s]\n"
+                    "               [--threads n] [--utc-offset h] [--naive] [--out file] [--bench]\n");
+}
+
+static bool read_field(const char *path, std::vector<field_mirror> *mirrors)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        field_mirror m;
+        if (sscanf(line, "%f,%f,%f", &m.east, &m.north, &m.up) == 3) {
+            mirrors->push_back(m);
+        }
+    }
+    fclose(f);
+    return !mirrors->empty();
+}
+
+// the receiver a quarter as high as the field is deep, unless given
+static void default_receiver(field_config *config, const std::vector<field_mirror> &mirrors)
+{
+    float far = 0;
+    for (const field_mirror &m : mirrors) {
+        far = std::max(far, hypotf(m.east, m.north));
+    }
+    config->receiver[0] = config->receiver[1] = 0;
+    config->receiver[2] = std::max(8.0f, far / 4);
+}
+
+static double total_kwh(const field_config &config, const field_plan &plan, double field_step::*member)
+{
+    double sum = 0;
+    for (const field_step &step : plan.steps) {
+        sum += step.*member;
+    }
+    return sum * config.step_s / 3600 / 1000;
+}
+
+static void report(const field_config &config, const field_plan &plan, int utc_offset_s)
+{
+    printf("%5s %6s %9s %9s %9s %7s %7s %7s %6s %6s\n", "local", "elev", "ideal kW", "naive kW", "plan kW", "gain",
+           "shaded", "blocked", "stowed", "offset");
+    int per_hour = std::max(1, 3600 / config.step_s);
+    for (size_t k = 0; k < plan.steps.size(); k += per_hour) {
+        const field_step &step = plan.steps[k];
+        if (step.zenith >= 90) {
+            continue;
+        }
+        int64_t t = config.start + (int64_t)k * config.step_s + utc_offset_s;
+        int minute = (int)(((t % 86400) + 86400) % 86400 / 60);
+        printf("%02d:%02d %6.1f %9.1f %9.1f %9.1f %6.1f%% %6.1f%% %6.1f%% %6d %6d\n", minute / 60, minute % 60,
+               90 - step.zenith, step.ideal / 1000, step.naive / 1000, step.delivered / 1000,
+               step.naive > 0 ? 100 * (step.delivered / step.naive - 1) : 0, 100 * step.shaded / step.ideal,
+               100 * step.blocked / step.ideal, step.stowed, step.offset);
+    }
+    double ideal = total_kwh(config, plan, &field_step::ideal), naive = total_kwh(config, plan, &field_step::naive);
+    double delivered = total_kwh(config, plan, &field_step::delivered);
+    printf("day: ideal %.1f kWh, every mirror at the centre %.1f kWh (%.1f%%), planned %.1f kWh (%.1f%%), %+.2f%%\n",
+           ideal, naive, 100 * naive / ideal, delivered, 100 * delivered / ideal, 100 * (delivered / naive - 1));
+}
+
+static bool write_plan(const char *path, const field_config &config, const std::vector<field_mirror> &mirrors,
+                       const field_plan &plan, int utc_offset_s)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "mirror,pivotEast,pivotNorth,pivotUp,target,name,east,north,up,from,to\n");
+    int targets = 0;
+    for (size_t i = 0; i < mirrors.size(); i++) {
+        std::vector<field_window> windows = plan_windows(plan, (int)i, HELIOSTAT_MAX_TARGETS);
+        for (size_t w = 0; w < windows.size(); w++) {
+            heliostat_target target = plan_target(config, mirrors[i], windows[w], utc_offset_s);
+            fprintf(f, "%zu,%.3f,%.3f,%.3f,%zu,%s,%.3f,%.3f,%.3f,%u,%u\n", i, mirrors[i].east, mirrors[i].north,
+                    mirrors[i].up, w, target.name, target.east, target.north, target.up, target.from_min,
+                    target.to_min);
+            targets++;
+        }
+    }
+    fclose(f);
+    printf("wrote %s, %d targets for %zu mirrors\n", path, targets, mirrors.size());
+    return true;
+}
+
+static int bench(field_config config, int max_mirrors, float spacing)
+{
+    int cores = (int)std::max(1u, std::thread::hardware_concurrency());
+    printf("%7s %6s %12s %9s %9s %7s %9s %11s %11s %5s\n", "mirrors", "steps", "tests/step", "1 thread", "threads",
+           "speedup", "us/mirror", "naive grid", "naive brute", "same");
+    bool ok = true;
+    for (int n = 10; n <= max_mirrors; n *= 10) {
+        std::vector<field_mirror> mirrors = field_synthetic(n, config.width, config.height, spacing, config.latitude);
+        field_config c = config;
+        default_receiver(&c, mirrors);
+        c.threads = 1;
+        field_plan one = plan_field(c, mirrors);
+        c.threads = cores;
+        field_plan all = plan_field(c, mirrors);
+        int64_t tests = 0;
+        int day = 0;
+        for (const field_step &step : all.steps) {
+            tests += step.tests;
+            day += step.zenith < 90;
+        }
+        bool same = one.choice == all.choice;
+        // the shading and blocking alone, then with every mirror tested instead of the grid
+        c.optimize = false;
+        field_plan grid = plan_field(c, mirrors);
+        double brute_s = NAN;
+        if (n <= 1000) {
+            c.brute = true;
+            field_plan brute = plan_field(c, mirrors);
+            brute_s = brute.seconds;
+            for (size_t k = 0; k < brute.steps.size(); k++) {
+                same = same && brute.steps[k].naive == grid.steps[k].naive;
+            }
+        }
+        ok = ok && same;
+        char brute_text[16] = "-";
+        if (!isnan(brute_s)) {
+            snprintf(brute_text, sizeof(brute_text), "%.3fs", brute_s);
+        }
+        printf("%7d %6d %12.0f %8.3fs %8.3fs %6.1fx %9.2f %10.3fs %11s %5s\n", n, day,
+               (double)tests / std::max(day, 1), one.seconds, all.seconds, one.seconds / all.seconds,
+               1e6 * one.seconds / ((double)n * std::max(day, 1)), grid.seconds, brute_text, same ? "yes" : "NO");
+    }
+    printf("%d threads, one per core\n", cores);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    field_config config = {};
+    config.latitude = 28.183;
+    config.longitude = 112.933;
+    config.step_s = HELIOSTAT_STEP_S;
+    config.width = config.height = 1;
+    config.aperture = 1;
+    config.offsets = 5;
+    config.samples = 3;
+    config.optimize = true;
+    const char *field = NULL, *out = NULL, *date = "2025-12-21";
+    int count = 400;
+    float spacing = 1.6f;
+    double utc_offset_h = NAN;
+    bool has_receiver = false, run_bench = false, has_count = false;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--naive") == 0) {
+            config.optimize = false;
+            continue;
+        }
+        if (strcmp(arg, "--bench") == 0) {
+            run_bench = true;
+            continue;
+        }
+        if (value == NULL) {
+            usage();
+            return 2;
+        }
+        i++;
+        if (strcmp(arg, "--field") == 0) {
+            field = value;
+        } else if (strcmp(arg, "--mirrors") == 0) {
+            count = atoi(value);
+            has_count = true;
+        } else if (strcmp(arg, "--spacing") == 0) {
+            spacing = atof(value);
+        } else if (strcmp(arg, "--lat") == 0) {
+            config.latitude = atof(value);
+        } else if (strcmp(arg, "--lon") == 0) {
+            config.longitude = atof(value);
+        } else if (strcmp(arg, "--date") == 0) {
+            date = value;
+        } else if (strcmp(arg, "--size") == 0) {
+            if (sscanf(value, "%fx%f", &config.width, &config.height) != 2) {
+                usage();
+                return 2;
+            }
+        } else if (strcmp(arg, "--receiver") == 0) {
+            has_receiver = sscanf(value, "%f,%f,%f", &config.receiver[0], &config.receiver[1], &config.receiver[2]) == 3;
+        } else if (strcmp(arg, "--aperture") == 0) {
+            config.aperture = atof(value);
+        } else if (strcmp(arg, "--offsets") == 0) {
+            config.offsets = atoi(value);
+        } else if (strcmp(arg, "--samples") == 0) {
+            config.samples = atoi(value);
+        } else if (strcmp(arg, "--step") == 0) {
+            config.step_s = atoi(value);
+        } else if (strcmp(arg, "--threads") == 0) {
+            config.threads = atoi(value);
+        } else if (strcmp(arg, "--utc-offset") == 0) {
+            utc_offset_h = atof(value);
+        } else if (strcmp(arg, "--out") == 0) {
+            out = value;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    struct tm day = {};
+    if (sscanf(date, "%d-%d-%d", &day.tm_year, &day.tm_mon, &day.tm_mday) != 3 ||
+            !(fabs(config.latitude) <= 90 && fabs(config.longitude) <= 180) || config.step_s <= 0 ||
+            config.offsets < 1 || config.offsets > FIELD_MAX_OFFSETS || config.offsets % 2 == 0 ||
+            config.samples < 1 || config.samples > FIELD_MAX_SAMPLES || !(config.width > 0 && config.height > 0)) {
+        usage();
+        return 2;
+    }
+    day.tm_year -= 1900;
+    day.tm_mon -= 1;
+    // local mean midnight, to the hour, as tools/ephemeris
+    config.start = (int64_t)timegm(&day) - (int64_t)lround(config.longitude / 15) * 3600;
+    config.steps = 86400 / config.step_s;
+    int utc_offset_s = isnan(utc_offset_h) ? (int)lround(config.longitude / 15) * 3600 : (int)lround(utc_offset_h * 3600);
+
+    if (run_bench) {
+        if (config.step_s == HELIOSTAT_STEP_S) {
+            config.step_s = 600;
+            config.steps = 86400 / config.step_s;
+        }
+        return bench(config, has_count ? count : 10000, spacing);
+    }
+
+    std::vector<field_mirror> mirrors;
+    if (field != NULL ? !read_field(field, &mirrors) : count <= 0) {
+        usage();
+        return 2;
+    }
+    if (field == NULL) {
+        mirrors = field_synthetic(count, config.width, config.height, spacing, config.latitude);
+    }
+    int collisions = field_collisions(mirrors, config.width, config.height);
+    if (collisions > 0) {
+        fprintf(stderr, "%d pairs of pivots closer than the diagonal of a mirror, they could touch\n", collisions);
+        return 1;
+    }
+    if (!has_receiver) {
+        default_receiver(&config, mirrors);
+    }
+    field_plan plan = plan_field(config, mirrors);
+    int64_t tests = 0;
+    for (const field_step &step : plan.steps) {
+        tests += step.tests;
+    }
+    printf("%zu mirrors of %.1fx%.1f m, receiver at %.1f,%.1f,%.1f, %s: %d steps of %d s in %.3f s, %.2e ray tests\n",
+           mirrors.size(), config.width, config.height, config.receiver[0], config.receiver[1], config.receiver[2],
+           date, config.steps, config.step_s, plan.seconds, (double)tests);
+    report(config, plan, utc_offset_s);
+    if (out != NULL && !write_plan(out, config, mirrors, plan, utc_offset_s)) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+/* the part of the BMI270 driver imu_bmi270.cpp uses */
+#pragma once
+
+#include <stdint.h>
+#include "i2c_bus.h"
+
+#define BMI2_OK                         0
+#define BMI2_ACCEL                      0
+#define BMI2_GYRO                       1
+#define BMI2_TEMP                       2
+#define BMI2_DRDY_ACC                   0x80
+#define BMI2_DRDY_GYR                   0x40
+#define BMI2_DRDY_INT                   1
+#define BMI2_INT1                       1
+#define BMI2_ACC_ODR_200HZ              9
+#define BMI2_ACC_RANGE_2G               0
+#define BMI2_ACC_NORMAL_AVG4            2
+#define BMI2_PERF_OPT_MODE              1
+#define BMI2_GYR_ODR_200HZ              9
+#define BMI2_GYR_RANGE_2000             0
+#define BMI2_GYR_NORMAL_MODE            2
+#define BMI2_POWER_OPT_MODE             0
+#define BMI2_GYRO_CROSS_SENS_ENABLE     0x01
+
+struct bmi2_dev {
+    uint8_t resolution;
+    uint8_t variant_feature;
+    int16_t gyr_cross_sens_zx;
+};
+
+struct bmi2_sens_config {
+    uint8_t type;
+    union {
+        struct {
+            uint8_t odr, range, bwp, filter_perf;
+        } acc;
+        struct {
+            uint8_t odr, range, bwp, noise_perf, filter_perf;
+        } gyr;
+    } cfg;
+};
+
+typedef struct bmi2_dev *bmi270_handle_t;
+
+typedef struct {
+    i2c_bus_handle_t i2c_handle;
+    uint8_t i2c_addr;
+} bmi270_i2c_config_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t bmi270_sensor_create(const bmi270_i2c_config_t *config, bmi270_handle_t *handle);
+int8_t bmi2_get_sensor_config(struct bmi2_sens_config *config, uint8_t n, struct bmi2_dev *dev);
+int8_t bmi2_set_sensor_config(struct bmi2_sens_config *config, uint8_t n, struct bmi2_dev *dev);
+int8_t bmi2_map_data_int(uint8_t data_int, uint8_t int_pin, struct bmi2_dev *dev);
+int8_t bmi2_sensor_enable(const uint8_t *list, uint8_t n, struct bmi2_dev *dev);
+int8_t bmi2_sensor_disable(const uint8_t *list, uint8_t n, struct bmi2_dev *dev);
+int8_t bmi2_get_temperature_data(uint16_t *temperature, struct bmi2_dev *dev);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void bmi2_error_codes_print_result(int8_t rslt);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+typedef enum { GPIO_INTR_DISABLE, GPIO_INTR_POSEDGE, GPIO_INTR_NEGEDGE, GPIO_INTR_ANYEDGE } gpio_int_type_t;
+typedef void (*gpio_isr_t)(void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t gpio_install_isr_service(int flags);
+esp_err_t gpio_set_intr_type(gpio_num_t gpio, gpio_int_type_t type);
+// the harness fires the handler of a pin on the edges it simulates
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio, gpio_isr_t handler, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
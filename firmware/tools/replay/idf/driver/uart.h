@@ -0,0 +1,25 @@
+#pragma once
+
+typedef int uart_port_t;
+
+typedef enum {
+    UART_DATA_5_BITS,
+    UART_DATA_6_BITS,
+    UART_DATA_7_BITS,
+    UART_DATA_8_BITS,
+} uart_word_length_t;
+
+typedef enum {
+    UART_PARITY_DISABLE,
+    UART_PARITY_EVEN = 2,
+    UART_PARITY_ODD,
+} uart_parity_t;
+
+typedef enum {
+    UART_STOP_BITS_1 = 1,
+    UART_STOP_BITS_1_5,
+    UART_STOP_BITS_2,
+} uart_stop_bits_t;
+
+#define UART_NUM_0  0
+#define UART_NUM_1  1
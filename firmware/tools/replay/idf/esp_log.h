@@ -0,0 +1,18 @@
+/* the firmware logs on stderr with --verbose only */
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void host_log(char level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#define ESP_LOGE(tag, fmt, ...) host_log('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) host_log('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) host_log('I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) host_log('D', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) host_log('V', tag, fmt, ##__VA_ARGS__)
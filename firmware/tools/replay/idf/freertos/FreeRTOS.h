@@ -0,0 +1,34 @@
+/*
+   FreeRTOS on the host: one thread, tasks are created but never run, the
+   caller drives them. Critical sections are no-ops.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE                 0
+#define pdTRUE                  1
+#define pdPASS                  1
+#define pdFAIL                  0
+#define portMAX_DELAY           0xffffffffu
+#define portTICK_PERIOD_MS      1
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(ms))
+#define configMAX_PRIORITIES    25
+
+typedef struct {
+    int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED    {0}
+#define portENTER_CRITICAL(mux)         ((void)(mux))
+#define portEXIT_CRITICAL(mux)          ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux)     ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux)      ((void)(mux))
+
+#define IRAM_ATTR
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef void *i2c_bus_handle_t;
+typedef void *i2c_bus_device_handle_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+i2c_bus_device_handle_t i2c_bus_device_create(i2c_bus_handle_t bus, uint8_t addr, uint32_t clk_speed);
+esp_err_t i2c_bus_read_bytes(i2c_bus_device_handle_t dev, uint8_t reg, size_t len, uint8_t *data);
+esp_err_t i2c_bus_write_bytes(i2c_bus_device_handle_t dev, uint8_t reg, size_t len, const uint8_t *data);
+
+#ifdef __cplusplus
+}
+#endif
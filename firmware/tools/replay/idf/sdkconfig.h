@@ -0,0 +1,4 @@
+/* the options of the firmware the host build needs */
+#pragma once
+
+#define CONFIG_EXAMPLE_WEB_MOUNT_POINT  "/www"
@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/ledc.h"
+#include "driver/gpio.h"
+#include "driver/pulse_cnt.h"
+#include "bmi270.h"
+#include "common/common.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "board.h"
+#include "helper.h"
+#include "led.h"
+#include "energy.h"
+#include "light_sensor.h"
+#include "ephemeris_table.h"
+#include "nmea_parser.h"
+#include "i2c_scheduler.h"
+#include "idf_host.h"
+
+int64_t host_clock_us = 0;
+bool host_verbose = false;
+adc_snapshot_t host_analog = {};
+float host_voltage = 12.0f;
+gimbal_position_t host_position = {};
+uint8_t host_i2c_regs[2][256];
+
+int64_t esp_timer_get_time(void)
+{
+    return host_clock_us;
+}
+
+void host_log(char level, const char *tag, const char *fmt, ...)
+{
+    if (!host_verbose) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%c %8.3f %s: ", level, host_clock_us / 1e6, tag);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+/* tasks */
+
+static uint32_t s_notified;
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle)
+{
+    static int tasks;
+    if (handle) {
+        *handle = (TaskHandle_t)(intptr_t)++tasks;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return (TaskHandle_t)&s_notified;
+}
+
+void xTaskNotifyGive(TaskHandle_t task)
+{
+    s_notified++;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    uint32_t count = s_notified;
+    if (count > 0) {
+        s_notified = clear ? 0 : count - 1;
+    }
+    return count;
+}
+
+uint32_t ulTaskNotifyValueClear(TaskHandle_t task, uint32_t bits)
+{
+    uint32_t count = s_notified;
+    s_notified &= ~bits;
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return (SemaphoreHandle_t)&s_notified;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return (SemaphoreHandle_t)&s_notified;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return pdTRUE;
+}
+
+/* drivers */
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty)
+{
+    return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t mode, ledc_channel_t channel)
+{
+    return ESP_OK;
+}
+
+static gpio_isr_t s_isr;
+static void *s_isr_arg;
+
+esp_err_t gpio_install_isr_service(int flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio, gpio_int_type_t type)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio, gpio_isr_t handler, void *arg)
+{
+    // both pins of the yaw encoder share the handler
+    if (gpio == BOARD_IO_MOTX_ENC_A) {
+        s_isr = handler;
+        s_isr_arg = arg;
+    }
+    return ESP_OK;
+}
+
+// the yaw encoder, the only counter; the hardware count wraps at the watch points
+static struct pcnt_unit_t {
+    int low, high;
+    int count;
+    int64_t total;
+    pcnt_watch_cb_t on_reach;
+    void *ctx;
+} s_pcnt;
+
+void host_encoder_move(int64_t count, int64_t edge_us)
+{
+    if (count == s_pcnt.total) {
+        return;
+    }
+    int64_t delta = count - s_pcnt.total;
+    s_pcnt.total = count;
+    while (delta != 0) {
+        int step = delta > 0 ? (int)fmin(delta, s_pcnt.high - s_pcnt.count) : (int)fmax(delta, s_pcnt.low - s_pcnt.count);
+        s_pcnt.count += step;
+        delta -= step;
+        if (s_pcnt.count == s_pcnt.high || s_pcnt.count == s_pcnt.low) {
+            pcnt_watch_event_data_t data = {s_pcnt.count};
+            s_pcnt.count = 0;
+            if (s_pcnt.on_reach) {
+                s_pcnt.on_reach(&s_pcnt, &data, s_pcnt.ctx);
+            }
+        }
+    }
+    if (s_isr) {
+        int64_t now = host_clock_us;
+        host_clock_us = edge_us;
+        s_isr(s_isr_arg);
+        host_clock_us = now;
+    }
+}
+
+esp_err_t pcnt_new_unit(const pcnt_unit_config_t *config, pcnt_unit_handle_t *unit)
+{
+    s_pcnt = {config->low_limit, config->high_limit, 0, 0, nullptr, nullptr};
+    *unit = &s_pcnt;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_set_glitch_filter(pcnt_unit_handle_t unit, const pcnt_glitch_filter_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t pcnt_new_channel(pcnt_unit_handle_t unit, const pcnt_chan_config_t *config, pcnt_channel_handle_t *chan)
+{
+    *chan = nullptr;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_channel_set_edge_action(pcnt_channel_handle_t chan, pcnt_channel_edge_action_t pos,
+                                       pcnt_channel_edge_action_t neg)
+{
+    return ESP_OK;
+}
+
+esp_err_t pcnt_channel_set_level_action(pcnt_channel_handle_t chan, pcnt_channel_level_action_t high,
+                                        pcnt_channel_level_action_t low)
+{
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_add_watch_point(pcnt_unit_handle_t unit, int value)
+{
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_register_event_callbacks(pcnt_unit_handle_t unit, const pcnt_event_callbacks_t *cbs, void *ctx)
+{
+    unit->on_reach = cbs->on_reach;
+    unit->ctx = ctx;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_enable(pcnt_unit_handle_t unit)
+{
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_clear_count(pcnt_unit_handle_t unit)
+{
+    unit->count = 0;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_start(pcnt_unit_handle_t unit)
+{
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_get_count(pcnt_unit_handle_t unit, int *value)
+{
+    *value = unit->count;
+    return ESP_OK;
+}
+
+/* I2C: the schedulers read host_i2c_regs, the blocking driver calls see no device */
+
+static int s_bus[2];
+
+i2c_bus_handle_t bsp_i2c_get_handle(int index)
+{
+    return &s_bus[index ? 1 : 0];
+}
+
+esp_err_t bsp_i2c_init(void)
+{
+    return ESP_OK;
+}
+
+i2c_bus_device_handle_t i2c_bus_device_create(i2c_bus_handle_t bus, uint8_t addr, uint32_t clk_speed)
+{
+    return bus;
+}
+
+esp_err_t i2c_bus_read_bytes(i2c_bus_device_handle_t dev, uint8_t reg, size_t len, uint8_t *data)
+{
+    return ESP_FAIL;
+}
+
+esp_err_t i2c_bus_write_bytes(i2c_bus_device_handle_t dev, uint8_t reg, size_t len, const uint8_t *data)
+{
+    return ESP_FAIL;
+}
+
+// one device per bus, the address does not matter
+class HostBus : public I2CBusIO {
+public:
+    explicit HostBus(int index): regs(host_i2c_regs[index]) {}
+
+    int read(uint8_t addr, uint8_t reg, uint8_t *buf, size_t len) override
+    {
+        memcpy(buf, regs + reg, reg + len <= 256 ? len : 256 - reg);
+        return 0;
+    }
+
+    int write(uint8_t addr, uint8_t reg, const uint8_t *buf, size_t len) override
+    {
+        return 0;
+    }
+
+    int64_t now_us() override
+    {
+        return host_clock_us;
+    }
+
+private:
+    uint8_t *regs;
+};
+
+I2CScheduler *i2c_scheduler_get(int index)
+{
+    static I2CScheduler *schedulers[2] = {nullptr, nullptr};
+    index = index ? 1 : 0;
+    if (schedulers[index] == nullptr) {
+        schedulers[index] = new I2CScheduler(new HostBus(index));
+    }
+    return schedulers[index];
+}
+
+int I2CScheduler::start(const char *name, int priority)
+{
+    return 0;
+}
+
+void I2CScheduler::kick()
+{
+    process();
+}
+
+static struct bmi2_dev s_bmi = {16, 0, 0};
+
+esp_err_t bmi270_sensor_create(const bmi270_i2c_config_t *config, bmi270_handle_t *handle)
+{
+    *handle = &s_bmi;
+    return ESP_OK;
+}
+
+int8_t bmi2_get_sensor_config(struct bmi2_sens_config *config, uint8_t n, struct bmi2_dev *dev)
+{
+    return BMI2_OK;
+}
+
+int8_t bmi2_set_sensor_config(struct bmi2_sens_config *config, uint8_t n, struct bmi2_dev *dev)
+{
+    return BMI2_OK;
+}
+
+int8_t bmi2_map_data_int(uint8_t data_int, uint8_t int_pin, struct bmi2_dev *dev)
+{
+    return BMI2_OK;
+}
+
+int8_t bmi2_sensor_enable(const uint8_t *list, uint8_t n, struct bmi2_dev *dev)
+{
+    return BMI2_OK;
+}
+
+int8_t bmi2_sensor_disable(const uint8_t *list, uint8_t n, struct bmi2_dev *dev)
+{
+    return BMI2_OK;
+}
+
+int8_t bmi2_get_temperature_data(uint16_t *temperature, struct bmi2_dev *dev)
+{
+    *temperature = 0;
+    return BMI2_OK;
+}
+
+void bmi2_error_codes_print_result(int8_t rslt)
+{
+}
+
+/* firmware modules outside of the control loop */
+
+void adc_get_snapshot(adc_snapshot_t *snapshot)
+{
+    *snapshot = host_analog;
+}
+
+float adc_read_voltage(void)
+{
+    return host_voltage;
+}
+
+bool adc_is_wired(adc_signal_t signal)
+{
+    return false;
+}
+
+void led_start_state(int led_id, led_state_t state)
+{
+}
+
+void led_stop_state(int led_id, led_state_t state)
+{
+}
+
+void energy_init(void)
+{
+}
+
+void energy_add(energy_axis_t axis, energy_mode_t mode, float power_w, float dt)
+{
+}
+
+void energy_set_daily_budget(float wh)
+{
+}
+
+void position_checkpoint_save(const gimbal_position_t *pos)
+{
+}
+
+bool position_checkpoint_restore(gimbal_position_t *pos)
+{
+    *pos = host_position;
+    return true;
+}
+
+void position_checkpoint_invalidate(void)
+{
+}
+
+esp_err_t position_travel_save(float yaw_min, float yaw_max)
+{
+    return ESP_OK;
+}
+
+esp_err_t position_travel_load(float *yaw_min, float *yaw_max)
+{
+    return ESP_FAIL;
+}
+
+float light_sensor_read(void)
+{
+    return NAN;
+}
+
+bool ephemeris_table_load(const char *path)
+{
+    return false;
+}
+
+bool ephemeris_table_day(time_t t, float latitude, float longitude, ephemeris_day_t *day, time_t *day_start)
+{
+    return false;
+}
+
+const ephemeris_table_header_t *ephemeris_table_header()
+{
+    return nullptr;
+}
+
+esp_err_t iot_param_save(const char *space_name, const char *key, void *param, uint16_t len)
+{
+    return ESP_OK;
+}
+
+esp_err_t iot_param_load(const char *space_name, const char *key, void *dest)
+{
+    return ESP_FAIL;
+}
+
+esp_err_t iot_param_load_size(const char *space_name, const char *key, void *dest, size_t *length)
+{
+    return ESP_FAIL;
+}
+
+void set_time(int year, int month, int day, int hour, int min, int sec, bool is_utc)
+{
+}
+
+ESP_EVENT_DEFINE_BASE(ESP_NMEA_EVENT);
+
+nmea_parser_handle_t nmea_parser_init(const nmea_parser_config_t *config)
+{
+    static int parser;
+    return &parser;
+}
+
+esp_err_t nmea_parser_add_handler(nmea_parser_handle_t nmea_hdl, esp_event_handler_t event_handler, void *handler_args)
+{
+    return ESP_OK;
+}
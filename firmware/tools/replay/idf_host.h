@@ -0,0 +1,21 @@
+/*
+   What the harness drives in the ESP-IDF of idf/ and the firmware modules
+   left out of the host build (idf_host.cpp).
+*/
+#pragma once
+
+#include <stdint.h>
+#include "adc.h"
+#include "position_store.h"
+
+extern int64_t host_clock_us;           // esp_timer_get_time()
+extern bool host_verbose;               // firmware logs on stderr
+extern adc_snapshot_t host_analog;      // adc_get_snapshot()
+extern float host_voltage;              // adc_read_voltage()
+extern gimbal_position_t host_position; // the checkpoint of a warm reset
+extern uint8_t host_i2c_regs[2][256];   // the registers of bus 0 (BMI270) and 1 (compass)
+
+/**
+ * @brief Move the yaw encoder to count, the last edge at edge_us
+ */
+void host_encoder_move(int64_t count, int64_t edge_us);
@@ -0,0 +1,270 @@
+/*
+   Replay of the control loop on the host, from a recording of the
+   firmware's flight recorder (recorder.h).
+
+   Build from firmware/tools/replay:
+     M=../../main; gcc -O2 -c -I$M/gimbal $M/gimbal/pid.c -o pid.o
+     g++ -std=gnu++17 -O2 -Iidf -I. -I$M -I$M/imu -I$M/imu/MahonyAHRS -I$M/gimbal \
+         -I$M/nmea0183 -DFINE_TRACKER_NO_MAIN -DMOUNT_MODEL_NO_MAIN -DTRACKING_POLICY_NO_MAIN \
+         -DHELIOSTAT_NO_MAIN -DSUN_ENGINE_NO_MAIN -DSTALL_DETECTOR_NO_MAIN -DVELOCITY_ESTIMATOR_NO_MAIN \
+         -DSUN_POS_NO_MAIN -DWEATHER_POLICY_NO_MAIN -DI2C_SCHEDULER_NO_MAIN \
+         main.cpp replay.cpp plant.cpp idf_host.cpp $M/recorder.cpp $M/setting.cpp $M/nmea0183/gps.cpp \
+         $M/imu/imu_bmi270.cpp $M/imu/qmc5883p.cpp $M/imu/i2c_scheduler.cpp $M/imu/app_datafusion.cpp \
+         $M/imu/MahonyAHRS/MahonyAHRS.cpp $M/gimbal/gimbal.cpp $M/gimbal/motor.cpp pid.o \
+         $M/gimbal/velocity_estimator.cpp $M/gimbal/stall_detector.cpp $M/gimbal/fine_tracker.cpp \
+         $M/gimbal/mount_model.cpp $M/gimbal/heliostat.cpp $M/gimbal/sun_engine.cpp $M/gimbal/sun_pos.cpp \
+         $M/gimbal/tracking_policy.cpp $M/gimbal/weather_policy.cpp -o replay
+
+   replay record.bin [--set section.field=value ...] [--warmup s] [--csv file] [--nmea file] [--verbose]
+   replay --synth out.bin [--seconds 12] [--ring-kb 64] [--hold s] [--fault s] [--seed n]
+   replay --test
+
+   record.bin is the download of GET /api/v1/record. The firmware compiled
+   here boots without homing, takes the oldest keyframe of the recording
+   and runs from there as fast as it can: every sensor read of the loop
+   returns the recorded bytes, the aim changes and NMEA lines come in
+   where they did on the tracker, and each tick's outputs are compared
+   with the recorded ones. The replay is open loop, the recorded positions
+   are inputs, so a change in the code shows in what the controller puts
+   out and how many ticks it takes to respond to a new target. Exit code 0
+   within tolerance, 1 diverged, 2 desync or a bad recording.
+
+   --set changes a PID (pos, vel, pitch_pos, pitch_vel: p, i, d, max_out,
+   integral_limit) or a stall model (yaw_stall, pitch_stall: k, tau,
+   deadband, drift, threshold) of the recorded settings, to see what a
+   tuning would have done. --warmup leaves the first seconds out of the
+   comparison. --csv writes recorded and replayed outputs of every tick,
+   --nmea the NMEA lines.
+
+   --synth runs the firmware against the simulated mount of plant.h and
+   writes what its recorder holds at the end, with a ring of --ring-kb;
+   --fault jams the yaw during a move at that second. --test checks that
+   a synthetic recording replays exactly, that a tuning change and a
+   dropped frame are caught, and that a fault freezes the ring with the
+   incident in it.
+
+   Floats on the ESP32-S3 and on the host are not bit identical, the
+   tolerances in replay.cpp cover that. Homing, settings changed while
+   recording and the fine tracker's reference are not replayed.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "setting.h"
+#include "idf_host.h"
+#include "replay.h"
+#include "plant.h"
+
+static void usage()
+{
+    fprintf(stderr, "usage: replay record.bin [--set section.field=value ...] [--warmup s] [--csv file] [--nmea file]\n"
+                    "              [--verbose]\n"
+                    "       replay --synth out.bin [--seconds s] [--ring-kb n] [--hold s] [--fault s] [--seed n]\n"
+                    "       replay --test\n");
+}
+
+static void report(const recording &rec, const replay_result &r, int code)
+{
+    const rec_header_t &h = rec.header;
+    printf("%u frames, %u overwritten, %u dropped%s\n", h.frames, h.overwritten, h.dropped,
+           h.trigger_us ? ", frozen by a fault" : "");
+    if (h.trigger_us) {
+        printf("fault at %.3f s, download at %.3f s\n", h.trigger_us / 1e6, h.now_us / 1e6);
+    }
+    printf("replayed %d ticks, %.3f to %.3f s, %d compared, %d targets, %d NMEA lines\n", r.ticks, r.start_s, r.end_s,
+           r.compared, r.targets, r.nmea_lines);
+    if (r.ticks > 0) {
+        printf("%.1f ms on the host, %.0fx real time, %.2f us per tick\n", r.host_s * 1e3,
+               (r.end_s - r.start_s) / r.host_s, r.host_s * 1e6 / r.ticks);
+    }
+    printf("%-16s %12s %12s %10s\n", "channel", "max error", "rms", "tolerance");
+    for (const auto &ch : r.channel) {
+        printf("%-16s %12.6g %12.6g %10g\n", ch.name, ch.max_error, ch.rms, ch.tolerance);
+    }
+    printf("response to %d targets: %.1f ticks recorded, replay differs by up to %d\n", r.lag_events,
+           r.lag_mean_recorded, r.lag_max_diff);
+    printf("motor faults: %d recorded, %d replayed\n", r.recorded_faults, r.replayed_faults);
+    if (r.diverged_ticks) {
+        printf("diverged on %d ticks (%d state mismatches), first at tick %d, %.3f s: %s\n", r.diverged_ticks,
+               r.state_mismatches, r.first_tick, r.first_s, r.first_what.c_str());
+    }
+    if (!r.error.empty()) {
+        printf("error: %s\n", r.error.c_str());
+    }
+    printf("%s\n", code == 0 ? "within tolerance" : code == 1 ? "diverged" : "stopped");
+}
+
+static bool write_file(const char *path, const std::vector<uint8_t> &blob)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fwrite(blob.data(), 1, blob.size(), f);
+    fclose(f);
+    return true;
+}
+
+static bool check(bool ok, const char *what)
+{
+    printf("%-56s %s\n", what, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static int run_tests()
+{
+    bool ok = true;
+    std::string error;
+    replay_options options;
+    replay_result r;
+
+    synth_options big;
+    big.ring_kb = 1024;
+    recording rec;
+    bool parsed = recording_parse(synth_run(big), &rec, &error);
+    ok &= check(parsed && rec.header.overwritten == 0, "synthetic run of 12 s fits a ring of 1 MB");
+    int code = replay_run(rec, options, &r);
+    ok &= check(code == 0 && r.diverged_ticks == 0 && r.ticks > 1000, "replays tick for tick");
+    double max_error = 0;
+    for (const auto &ch : r.channel) {
+        max_error = std::max(max_error, ch.max_error);
+    }
+    ok &= check(max_error == 0, "on the same host, bit for bit");
+    ok &= check(r.targets >= 3 && r.lag_events >= 3 && r.lag_max_diff == 0, "responds to the targets as recorded");
+    ok &= check(r.nmea_lines >= 10, "NMEA lines come along");
+
+    replay_options tuned;
+    tuned.set = {"vel.p=" + std::to_string(g_settings.vel_pid.p * 1.5f)};
+    code = replay_run(rec, tuned, &r);
+    ok &= check(code == 1 && r.first_tick >= 0, "a faster velocity loop diverges");
+
+    recording dropped = rec;
+    for (size_t i = dropped.frames.size() / 2; i < dropped.frames.size(); i++) {
+        if (dropped.frames[i].type == REC_ENCODER) {
+            dropped.frames.erase(dropped.frames.begin() + i);
+            break;
+        }
+    }
+    code = replay_run(dropped, options, &r);
+    ok &= check(code == 2 && r.error.find("desync") != std::string::npos, "a dropped frame is a desync");
+
+    synth_options small;
+    parsed = recording_parse(synth_run(small), &rec, &error);
+    ok &= check(parsed && rec.header.overwritten > 0, "the default ring overwrites the oldest frames");
+    code = replay_run(rec, options, &r);
+    ok &= check(code == 0 && r.start_s > 5, "and replays from its oldest keyframe");
+
+    synth_options fault;
+    fault.ring_kb = 1024;
+    fault.seconds = 10;
+    fault.fault_s = 6;
+    parsed = recording_parse(synth_run(fault), &rec, &error);
+    ok &= check(parsed && rec.header.trigger_us > 0 && rec.header.dropped > 0, "a jammed yaw freezes the ring");
+    bool kept = parsed && rec.header.trigger_us > 0 && !rec.frames.empty() &&
+                rec.frames.back().time_us >= rec.header.trigger_us &&
+                rec.frames.back().time_us <= rec.header.trigger_us + (int64_t)(fault.hold_s * 1e6f) + 20000;
+    ok &= check(kept, "holding the seconds after it");
+    code = replay_run(rec, options, &r);
+    ok &= check(code == 0 && r.recorded_faults > 0 && r.replayed_faults == r.recorded_faults,
+                "the replay stalls as the tracker did");
+
+    Recorder pauses;
+    uint8_t frame[8] = {};
+    rec_header_t header;
+    pauses.init(4096, 1000000);
+    pauses.pause(&header, 0);
+    pauses.pause(&header, 0);
+    pauses.resume();
+    pauses.write(REC_ENCODER, 0, frame, sizeof(frame));
+    pauses.pause(&header, 0);
+    bool still = header.frames == 0;
+    pauses.resume();
+    pauses.resume();
+    pauses.write(REC_ENCODER, 0, frame, sizeof(frame));
+    pauses.pause(&header, 0);
+    ok &= check(still && header.frames == 1, "recording resumes after the last of two downloads");
+
+    printf("%s\n", ok ? "all checks passed" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    replay_options options;
+    synth_options synth;
+    const char *path = NULL, *synth_out = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--test") == 0) {
+            return run_tests();
+        }
+        if (strcmp(arg, "--verbose") == 0) {
+            host_verbose = true;
+            continue;
+        }
+        if (arg[0] != '-') {
+            path = arg;
+            continue;
+        }
+        if (value == NULL) {
+            usage();
+            return 2;
+        }
+        i++;
+        if (strcmp(arg, "--set") == 0) {
+            options.set.push_back(value);
+        } else if (strcmp(arg, "--warmup") == 0) {
+            options.warmup_s = atof(value);
+        } else if (strcmp(arg, "--csv") == 0) {
+            options.csv = value;
+        } else if (strcmp(arg, "--nmea") == 0) {
+            options.nmea = value;
+        } else if (strcmp(arg, "--synth") == 0) {
+            synth_out = value;
+        } else if (strcmp(arg, "--seconds") == 0) {
+            synth.seconds = atof(value);
+        } else if (strcmp(arg, "--ring-kb") == 0) {
+            synth.ring_kb = atoi(value);
+        } else if (strcmp(arg, "--hold") == 0) {
+            synth.hold_s = atof(value);
+        } else if (strcmp(arg, "--fault") == 0) {
+            synth.fault_s = atof(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            synth.seed = strtoul(value, NULL, 0);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (synth_out != NULL) {
+        if (!(synth.seconds > 0 && synth.ring_kb > 0)) {
+            usage();
+            return 2;
+        }
+        std::vector<uint8_t> blob = synth_run(synth);
+        if (!write_file(synth_out, blob)) {
+            return 2;
+        }
+        printf("%zu bytes, %.1f s recorded\n", blob.size(), synth.seconds);
+        return 0;
+    }
+    if (path == NULL) {
+        usage();
+        return 2;
+    }
+    recording rec;
+    std::string error;
+    if (!recording_load(path, &rec, &error)) {
+        fprintf(stderr, "%s: %s\n", path, error.c_str());
+        return 2;
+    }
+    replay_result result;
+    int code = replay_run(rec, options, &result);
+    report(rec, result, code);
+    return code;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "setting.h"
+#include "app_datafusion.h"
+#include "idf_host.h"
+#include "replay.h"
+#include "plant.h"
+
+#define TICK_US         10000   // the BMI270 data rate, 100 Hz
+#define JITTER_US       300     // of the IMU task's wake up
+#define SUBSTEP_US      250
+#define YAW_CPR         (4 * 11)
+#define PITCH_MIN       -10.0f  // mechanical range of the pitch axis, degrees
+#define PITCH_MAX       100.0f
+#define FIELD_UT        40.0f   // horizontal geomagnetic field
+#define GRAVITY         9.80665f
+
+#define REG_STATUS      0x03
+#define REG_DATA_8      0x0C
+#define REG_TEMPERATURE 0x22
+#define REG_MAG_X       0x01
+#define REG_MAG_STATUS  0x09
+
+// deterministic noise, -1 to 1
+static float noise(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return (float)(*state >> 8) / (float)(1u << 23) - 1.0f;
+}
+
+static void put16(uint8_t *p, float value)
+{
+    int16_t v = (int16_t)fmaxf(-32768.0f, fminf(32767.0f, roundf(value)));
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)((uint16_t)v >> 8);
+}
+
+// one motor and its load, as StallDetector models it
+struct axis {
+    float speed;        // sensor units/s
+    float position;     // sensor units
+    bool jammed;
+
+    void step(const struct stall_param &model, float duty, float supply_v, float dt)
+    {
+        float effective = fabsf(duty) - model.deadband;
+        float target = effective > 0 ? copysignf(effective * model.k * supply_v, duty) : 0;
+        speed += (target - speed) * fminf(1.0f, dt / model.tau);
+        if (jammed) {
+            speed = 0;
+        }
+        position += speed * dt;
+    }
+};
+
+static void nmea_gga(int64_t t_us)
+{
+    int s = (int)(t_us / 1000000) % 86400;
+    char body[96], line[112];
+    snprintf(body, sizeof(body), "GPGGA,%02d%02d%02d.00,3114.2000,N,12128.6000,E,1,08,0.9,12.0,M,7.0,M,,",
+             s / 3600, s / 60 % 60, s % 60);
+    uint8_t sum = 0;
+    for (const char *c = body; *c; c++) {
+        sum ^= (uint8_t)*c;
+    }
+    int n = snprintf(line, sizeof(line), "$%s*%02X\r\n", body, sum);
+    recorder_tap(REC_NMEA, line, n);
+}
+
+std::vector<uint8_t> synth_run(const synth_options &options)
+{
+    uint32_t rng = options.seed;
+    // nothing in flash on the host, the defaults of a new tracker
+    g_settings.load();
+    const float identity[DATAFUSION_STATE_SIZE] = {1, 0, 0, 0, 0, 0, 0};
+    datafusion_set_state(identity);
+    memset(host_i2c_regs, 0, sizeof(host_i2c_regs));
+    for (auto &value : host_analog.value) {
+        value = NAN;
+    }
+    host_voltage = 12.0f;
+    host_clock_us = 1000000;
+
+    host_record(nullptr);
+    Gimbal *gimbal = host_boot({0, 0, 170.0f, -170.0f});
+    Recorder recorder;
+    recorder.init((size_t)options.ring_kb * 1024, (int64_t)(options.hold_s * 1e6f));
+    host_record(&recorder);
+
+    // the azimuth with the yaw axis in the middle of its travel
+    const float home = 180.0f - g_settings.yaw_offset;
+    static const struct {
+        float pitch, yaw;
+    } script[] = {{20, 2}, {35, -3}, {30, 1}, {45, 4}, {40, -2}, {25, 0}};
+    const int64_t step_us = 3000000;
+
+    axis yaw = {}, pitch = {};
+    int64_t start = host_clock_us;
+    int64_t end = start + (int64_t)(options.seconds * 1e6f);
+    int64_t fault_us = options.fault_s > 0 ? start + (int64_t)(options.fault_s * 1e6f) : INT64_MAX;
+    int64_t aim_us = start + 500000;
+    int aim = 0;
+    int64_t nmea_us = start;
+    int64_t t = start;
+    while (t < end) {
+        int64_t next = t + TICK_US + (int64_t)(noise(&rng) * JITTER_US);
+        for (int64_t sub = t + SUBSTEP_US; sub <= next; sub += SUBSTEP_US) {
+            host_clock_us = sub;
+            yaw.step(g_settings.yaw_stall, gimbal->yawMotor->get_duty(), host_voltage, SUBSTEP_US / 1e6f);
+            pitch.step(g_settings.pitch_stall, gimbal->pitchMotor->get_duty(), host_voltage, SUBSTEP_US / 1e6f);
+            if (pitch.position < PITCH_MIN || pitch.position > PITCH_MAX) {
+                pitch.position = fmaxf(PITCH_MIN, fminf(PITCH_MAX, pitch.position));
+                pitch.speed = 0;
+            }
+            host_encoder_move(llroundf(yaw.position * YAW_CPR), sub);
+        }
+        t = next;
+        host_clock_us = t;
+
+        // what the other tasks do in between
+        if (t >= fault_us && !yaw.jammed) {
+            // a long move into something in the way
+            yaw.jammed = true;
+            gimbal->setTarget(gimbal->getPitchTarget(), 0, home + 20);
+        }
+        if (t >= aim_us && !yaw.jammed) {
+            int i = aim++ % (int)(sizeof(script) / sizeof(script[0]));
+            gimbal->setTarget(script[i].pitch, 0, home + script[i].yaw);
+            aim_us += step_us;
+        }
+        if (t >= nmea_us) {
+            nmea_gga(t);
+            nmea_us += 1000000;
+        }
+
+        float theta = pitch.position * (float)M_PI / 180.0f;
+        uint8_t *bmi = host_i2c_regs[0];
+        bmi[REG_STATUS] = 0xC0;
+        const float acc_lsb = 32768.0f / (2 * GRAVITY), gyro_lsb = 32768.0f / 2000.0f;
+        put16(bmi + REG_DATA_8 + 0, -GRAVITY * sinf(theta) * acc_lsb + noise(&rng) * 3);
+        put16(bmi + REG_DATA_8 + 2, noise(&rng) * 3);
+        put16(bmi + REG_DATA_8 + 4, GRAVITY * cosf(theta) * acc_lsb + noise(&rng) * 3);
+        put16(bmi + REG_DATA_8 + 6, noise(&rng) * 2);
+        put16(bmi + REG_DATA_8 + 8, pitch.speed * gyro_lsb + noise(&rng) * 2);
+        put16(bmi + REG_DATA_8 + 10, noise(&rng) * 2);
+        put16(bmi + REG_TEMPERATURE, (31.5f - 23.0f) * 512);
+
+        // the compass turns with the yaw axis, 25 LSB/uT in the 12 G range
+        float heading = (home + yaw.position * 360.0f / 3029.0f) * (float)M_PI / 180.0f;
+        uint8_t *mag = host_i2c_regs[1];
+        put16(mag + REG_MAG_X + 0, FIELD_UT * cosf(heading) * 25 + noise(&rng) * 2);
+        put16(mag + REG_MAG_X + 2, FIELD_UT * sinf(heading) * 25 + noise(&rng) * 2);
+        put16(mag + REG_MAG_X + 4, -30.0f * 25 + noise(&rng) * 2);
+        mag[REG_MAG_STATUS] = 0x01;
+
+        gimbal->imu->readData();
+    }
+
+    // the download of GET /api/v1/record
+    rec_header_t header;
+    recorder.pause(&header, host_clock_us);
+    header.settings_size = sizeof(Setting);
+    std::vector<uint8_t> blob(sizeof(header) + sizeof(Setting) + header.bytes);
+    memcpy(blob.data(), &header, sizeof(header));
+    memcpy(blob.data() + sizeof(header), (const void *)&g_settings, sizeof(Setting));
+    recorder.read(0, blob.data() + sizeof(header) + sizeof(Setting), header.bytes);
+    host_record(nullptr);
+    return blob;
+}
@@ -0,0 +1,27 @@
+/*
+   A simulated mount for the firmware to run against on the host: the yaw
+   motor turns the encoder, the pitch motor tilts the BMI270, the compass
+   sees the yaw. The motors follow the first order model of their
+   stall_param, so the stall detector agrees with them until a fault is
+   injected. Recording a run gives a recording like one downloaded from a
+   tracker, without one.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "recorder.h"
+
+struct synth_options {
+    float seconds = 12;
+    int ring_kb = CONFIG_RECORDER_KB;
+    float hold_s = CONFIG_RECORDER_HOLD_S;
+    float fault_s = 0;          // the yaw jams from then on, 0 for never
+    uint32_t seed = 1;          // of the tick jitter and sensor noise
+};
+
+/**
+ * @brief Run the firmware against the plant and record it as a tracker does
+ * @return what GET /api/v1/record would download
+ */
+std::vector<uint8_t> synth_run(const synth_options &options);
@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <chrono>
+#include "setting.h"
+#include "idf_host.h"
+#include "replay.h"
+
+#define LAG_THRESHOLD   50      // output change which counts as the response to a new target
+#define LAG_WINDOW      100     // ticks, a response later than that is not timed
+#define LAG_TOLERANCE   2       // ticks the replayed response may differ by
+
+static_assert(offsetof(rec_output_t, motor_state) == REPLAY_CHANNELS * sizeof(float),
+              "the channels are the leading floats of rec_output_t");
+
+// the abort of a replay, no error at the end of the recording
+struct replay_stop {
+    std::string error;
+};
+
+bool recording_parse(const std::vector<uint8_t> &blob, recording *rec, std::string *error)
+{
+    if (blob.size() < sizeof(rec_header_t)) {
+        *error = "too short for a header";
+        return false;
+    }
+    memcpy(&rec->header, blob.data(), sizeof(rec_header_t));
+    const rec_header_t &h = rec->header;
+    if (h.magic != RECORDER_MAGIC || h.version != RECORDER_VERSION || h.frame_size != sizeof(rec_frame_t)) {
+        *error = "not a recording of this version";
+        return false;
+    }
+    if (h.settings_size != sizeof(Setting)) {
+        *error = "settings of " + std::to_string(h.settings_size) + " bytes, this build has " +
+                 std::to_string(sizeof(Setting));
+        return false;
+    }
+    size_t offset = sizeof(rec_header_t);
+    if (blob.size() < offset + h.settings_size + h.bytes) {
+        *error = "truncated";
+        return false;
+    }
+    rec->settings.assign(blob.begin() + offset, blob.begin() + offset + h.settings_size);
+    offset += h.settings_size;
+
+    size_t end = offset + h.bytes;
+    std::vector<uint32_t> times;
+    rec->frames.clear();
+    while (offset < end) {
+        rec_frame_t frame;
+        if (end - offset < sizeof(frame)) {
+            *error = "truncated frame";
+            return false;
+        }
+        memcpy(&frame, &blob[offset], sizeof(frame));
+        offset += sizeof(frame);
+        if (frame.type >= REC_TYPE_COUNT || end - offset < frame.size) {
+            *error = "bad frame at " + std::to_string(offset - sizeof(frame));
+            return false;
+        }
+        rec->frames.push_back({frame.type, 0, std::vector<uint8_t>(&blob[offset], &blob[offset] + frame.size)});
+        times.push_back(frame.time_us);
+        offset += frame.size;
+    }
+    if (rec->frames.size() != h.frames) {
+        *error = "frame count does not match the header";
+        return false;
+    }
+    // the frames hold the low 32 bits, back from the time of the download
+    int64_t next = h.now_us;
+    for (size_t i = rec->frames.size(); i-- > 0;) {
+        next -= (uint32_t)((uint32_t)next - times[i]);
+        rec->frames[i].time_us = next;
+    }
+    return true;
+}
+
+bool recording_load(const char *path, recording *rec, std::string *error)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        *error = std::string("cannot open ") + path;
+        return false;
+    }
+    std::vector<uint8_t> blob;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        blob.insert(blob.end(), buf, buf + n);
+    }
+    fclose(f);
+    return recording_parse(blob, rec, error);
+}
+
+bool replay_set(Setting *settings, const std::string &assignment)
+{
+    size_t dot = assignment.find('.');
+    size_t eq = assignment.find('=');
+    if (dot == std::string::npos || eq == std::string::npos || eq < dot) {
+        return false;
+    }
+    std::string section = assignment.substr(0, dot);
+    std::string field = assignment.substr(dot + 1, eq - dot - 1);
+    char *end;
+    float value = strtof(assignment.c_str() + eq + 1, &end);
+    if (*end != '\0' || end == assignment.c_str() + eq + 1) {
+        return false;
+    }
+
+    static const struct {
+        const char *name;
+        struct pid_param Setting::*param;
+    } pids[] = {
+        {"pos", &Setting::pos_pid},
+        {"vel", &Setting::vel_pid},
+        {"pitch_pos", &Setting::pitch_pos_pid},
+        {"pitch_vel", &Setting::pitch_vel_pid},
+    };
+    static const struct {
+        const char *name;
+        struct stall_param Setting::*param;
+    } stalls[] = {
+        {"yaw_stall", &Setting::yaw_stall},
+        {"pitch_stall", &Setting::pitch_stall},
+    };
+    float *f = nullptr;
+    for (const auto &pid : pids) {
+        if (section == pid.name) {
+            struct pid_param *p = &(settings->*pid.param);
+            f = field == "p" ? &p->p : field == "i" ? &p->i : field == "d" ? &p->d :
+                field == "max_out" ? &p->max_out : field == "integral_limit" ? &p->integral_limit : nullptr;
+        }
+    }
+    for (const auto &stall : stalls) {
+        if (section == stall.name) {
+            struct stall_param *p = &(settings->*stall.param);
+            f = field == "k" ? &p->k : field == "tau" ? &p->tau : field == "deadband" ? &p->deadband :
+                field == "drift" ? &p->drift : field == "threshold" ? &p->threshold : nullptr;
+        }
+    }
+    if (f) {
+        *f = value;
+    }
+    return f != nullptr;
+}
+
+Gimbal *host_boot(const gimbal_position_t &position)
+{
+    host_position = position;
+    // the search for the day's azimuth range prints to stdout
+    fflush(stdout);
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+    Gimbal *gimbal = new Gimbal();
+    gimbal->init();
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    return gimbal;
+}
+
+/*
+ * A replay in progress: the taps of the firmware land in tap(), the side
+ * frames which came from other tasks are applied where they were recorded.
+ */
+class Replay {
+public:
+    Replay(const recording &rec, const replay_options &options, replay_result *result, Gimbal *gimbal, size_t pos)
+        : rec(rec), options(options), result(result), gimbal(gimbal), pos(pos)
+    {
+        compare_from_us = rec.frames[pos - 1].time_us + (int64_t)(options.warmup_s * 1e6f);
+        if (options.csv) {
+            csv = fopen(options.csv, "w");
+        }
+        if (csv) {
+            fprintf(csv, "time_s");
+            for (const auto &ch : result->channel) {
+                fprintf(csv, ",%s,%s_replay", ch.name, ch.name);
+            }
+            fprintf(csv, ",state,state_replay\n");
+        }
+    }
+
+    ~Replay()
+    {
+        if (csv) {
+            fclose(csv);
+        }
+        if (options.nmea) {
+            FILE *f = fopen(options.nmea, "w");
+            if (f) {
+                fwrite(nmea.data(), 1, nmea.size(), f);
+                fclose(f);
+            }
+        }
+    }
+
+    void tap(int type, void *data, size_t size)
+    {
+        switch (type) {
+        case REC_KEYFRAME:
+        case REC_TARGET:
+        case REC_NMEA:
+            // replayed from the recording, not from where the code taps them
+            return;
+        case REC_OUTPUT: {
+            const rec_frame &frame = next(type, size);
+            output((const rec_output_t *)data, (const rec_output_t *)frame.data.data(), frame.time_us);
+            return;
+        }
+        default:
+            memcpy(data, next(type, size).data.data(), size);
+            return;
+        }
+    }
+
+private:
+    const rec_frame &next(int type, size_t size)
+    {
+        for (;;) {
+            if (pos >= rec.frames.size()) {
+                throw replay_stop{};
+            }
+            const rec_frame &frame = rec.frames[pos++];
+            host_clock_us = frame.time_us;
+            if (frame.type == REC_TARGET) {
+                rec_target_t aim;
+                memcpy(&aim, frame.data.data(), sizeof(aim));
+                gimbal->setTarget(aim.pitch, 0, aim.yaw);
+                result->targets++;
+            } else if (frame.type == REC_NMEA) {
+                nmea.append((const char *)frame.data.data(), frame.data.size());
+                for (uint8_t c : frame.data) {
+                    result->nmea_lines += c == '\n';
+                }
+            } else if (frame.type != REC_KEYFRAME) {
+                if (frame.type != type || frame.data.size() != size) {
+                    char error[160];
+                    snprintf(error, sizeof(error), "desync at %.3f s: recorded %s of %zu bytes, the code reads %s of %zu",
+                             frame.time_us / 1e6, recorder_type_name(frame.type), frame.data.size(),
+                             recorder_type_name(type), size);
+                    throw replay_stop{error};
+                }
+                return frame;
+            }
+        }
+    }
+
+    static bool within(float replayed, float recorded, float tolerance)
+    {
+        if (isnan(replayed) || isnan(recorded)) {
+            return isnan(replayed) && isnan(recorded);
+        }
+        return fabsf(replayed - recorded) <= tolerance;
+    }
+
+    void output(const rec_output_t *replayed, const rec_output_t *recorded, int64_t time_us)
+    {
+        float a[REPLAY_CHANNELS], b[REPLAY_CHANNELS];
+        memcpy(a, replayed, sizeof(a));
+        memcpy(b, recorded, sizeof(b));
+        int tick = result->ticks++;
+        if (tick == 0) {
+            result->start_s = time_us / 1e6;
+        }
+        result->end_s = time_us / 1e6;
+        for (int axis = 0; axis < 2; axis++) {
+            result->recorded_faults += entered_fault(recorded->motor_state[axis], last_recorded.motor_state[axis]);
+            result->replayed_faults += entered_fault(replayed->motor_state[axis], last_replayed.motor_state[axis]);
+        }
+        time_lag(tick, replayed, recorded);
+        last_recorded = *recorded;
+        last_replayed = *replayed;
+        if (csv) {
+            fprintf(csv, "%.6f", time_us / 1e6);
+            for (int i = 0; i < REPLAY_CHANNELS; i++) {
+                fprintf(csv, ",%.6g,%.6g", b[i], a[i]);
+            }
+            fprintf(csv, ",%u,%u\n", recorded->state, replayed->state);
+        }
+        if (time_us < compare_from_us) {
+            return;
+        }
+
+        result->compared++;
+        const char *what = nullptr;
+        char first[160] = "";
+        for (int i = 0; i < REPLAY_CHANNELS; i++) {
+            replay_channel &ch = result->channel[i];
+            double error = isnan(a[i]) && isnan(b[i]) ? 0 : fabs((double)a[i] - b[i]);
+            if (isnan(error)) {
+                error = INFINITY;
+            }
+            ch.max_error = fmax(ch.max_error, error);
+            ch.rms += isinf(error) ? 0 : error * error;
+            // speeds are noisy, so relative to their size as well
+            float tolerance = ch.tolerance + (strstr(ch.name, "velocity") ? 1e-4f * fabsf(b[i]) : 0);
+            if (!what && !within(a[i], b[i], tolerance)) {
+                what = ch.name;
+                snprintf(first, sizeof(first), "%s recorded %g replayed %g", ch.name, b[i], a[i]);
+            }
+        }
+        if (memcmp(replayed->motor_state, recorded->motor_state, sizeof(recorded->motor_state)) ||
+            replayed->state != recorded->state) {
+            result->state_mismatches++;
+            if (!what) {
+                what = "state";
+                snprintf(first, sizeof(first), "motor states recorded %u/%u replayed %u/%u, gimbal %u/%u",
+                         recorded->motor_state[0], recorded->motor_state[1], replayed->motor_state[0],
+                         replayed->motor_state[1], recorded->state, replayed->state);
+            }
+        }
+        if (what) {
+            if (result->diverged_ticks++ == 0) {
+                result->first_tick = tick;
+                result->first_s = time_us / 1e6;
+                result->first_what = first;
+            }
+        }
+    }
+
+    static int entered_fault(uint8_t state, uint8_t last)
+    {
+        return state >= MOT_STATE_WARNING && last < MOT_STATE_WARNING;
+    }
+
+    /*
+     * Ticks from a new target until the controller output leaves where it
+     * was by LAG_THRESHOLD, in the recording and in the replay.
+     */
+    void time_lag(int tick, const rec_output_t *replayed, const rec_output_t *recorded)
+    {
+        for (int axis = 0; axis < 2; axis++) {
+            pending_lag &lag = lags[axis];
+            if (tick > 0 && recorded->target[axis] != last_recorded.target[axis]) {
+                lag = {tick, last_recorded.output[axis], last_replayed.output[axis], -1, -1};
+            }
+            if (lag.start < 0) {
+                continue;
+            }
+            if (lag.recorded < 0 && fabsf(recorded->output[axis] - lag.recorded_base) > LAG_THRESHOLD) {
+                lag.recorded = tick - lag.start;
+            }
+            if (lag.replayed < 0 && fabsf(replayed->output[axis] - lag.replayed_base) > LAG_THRESHOLD) {
+                lag.replayed = tick - lag.start;
+            }
+            if (lag.recorded >= 0 && lag.replayed >= 0) {
+                lag_sum += lag.recorded;
+                result->lag_events++;
+                result->lag_max_diff = std::max(result->lag_max_diff, abs(lag.recorded - lag.replayed));
+                result->lag_mean_recorded = lag_sum / result->lag_events;
+                lag.start = -1;
+            } else if (tick - lag.start >= LAG_WINDOW) {
+                if (lag.recorded >= 0 || lag.replayed >= 0) {
+                    // one responded, the other did not within the window
+                    result->lag_events++;
+                    result->lag_max_diff = std::max(result->lag_max_diff, LAG_WINDOW);
+                }
+                lag.start = -1;
+            }
+        }
+    }
+
+    struct pending_lag {
+        int start;
+        float recorded_base, replayed_base;
+        int recorded, replayed;
+    };
+
+    const recording &rec;
+    const replay_options &options;
+    replay_result *result;
+    Gimbal *gimbal;
+    size_t pos;
+    int64_t compare_from_us;
+    FILE *csv = nullptr;
+    std::string nmea;
+    rec_output_t last_recorded = {};
+    rec_output_t last_replayed = {};
+    pending_lag lags[2] = {{-1, 0, 0, -1, -1}, {-1, 0, 0, -1, -1}};
+    double lag_sum = 0;
+};
+
+/* the taps of the firmware */
+
+static Recorder *s_recorder;
+static Replay *s_replay;
+
+void host_record(Recorder *recorder)
+{
+    s_recorder = recorder;
+}
+
+bool recorder_init(void)
+{
+    return false;
+}
+
+bool recorder_active(void)
+{
+    return s_replay || (s_recorder && s_recorder->is_recording());
+}
+
+void recorder_tap(rec_type_t type, void *data, size_t size)
+{
+    if (s_replay) {
+        s_replay->tap(type, data, size);
+    } else if (s_recorder) {
+        s_recorder->write(type, host_clock_us, data, size);
+    }
+}
+
+void recorder_trigger(void)
+{
+    if (!s_replay && s_recorder) {
+        s_recorder->trigger(host_clock_us);
+    }
+}
+
+void recorder_pause(rec_header_t *header)
+{
+    s_recorder->pause(header, host_clock_us);
+}
+
+size_t recorder_read(size_t offset, void *dst, size_t size)
+{
+    return s_recorder->read(offset, dst, size);
+}
+
+void recorder_resume(void)
+{
+    s_recorder->resume();
+}
+
+void recorder_clear(void)
+{
+    s_recorder->clear();
+}
+
+static const replay_channel CHANNELS[REPLAY_CHANNELS] = {
+    {"roll", 0.01f}, {"pitch", 0.01f}, {"azimuth", 0.01f},
+    {"yaw.position", 0.01f}, {"pitch.position", 0.01f},
+    {"yaw.target", 0.001f}, {"pitch.target", 0.001f},
+    {"yaw.velocity", 0.01f}, {"pitch.velocity", 0.01f},
+    {"yaw.output", 0.5f}, {"pitch.output", 0.5f},
+    {"yaw.power", 0.01f}, {"pitch.power", 0.01f},
+};
+
+int replay_run(const recording &rec, const replay_options &options, replay_result *result)
+{
+    *result = {};
+    memcpy(result->channel, CHANNELS, sizeof(CHANNELS));
+    result->first_tick = -1;
+
+    size_t start = 0;
+    while (start < rec.frames.size() && rec.frames[start].type != REC_KEYFRAME) {
+        start++;
+    }
+    if (start == rec.frames.size()) {
+        result->error = "no keyframe, the recording is shorter than one";
+        return 2;
+    }
+    if (rec.frames[start].data.size() != sizeof(gimbal_keyframe_t)) {
+        result->error = "keyframe of another build";
+        return 2;
+    }
+
+    memcpy((void *)&g_settings, rec.settings.data(), sizeof(Setting));
+    for (const auto &assignment : options.set) {
+        if (!replay_set(&g_settings, assignment)) {
+            result->error = "cannot set " + assignment;
+            return 2;
+        }
+    }
+    host_record(nullptr);
+    host_clock_us = rec.frames[start].time_us;
+    Gimbal *gimbal = host_boot({});
+    gimbal_keyframe_t key;
+    memcpy((void *)&key, rec.frames[start].data.data(), sizeof(key));
+    gimbal->setLoopState(key);
+
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        Replay replay(rec, options, result, gimbal, start + 1);
+        s_replay = &replay;
+        try {
+            for (;;) {
+                gimbal->imu->readData();
+            }
+        } catch (const replay_stop &stop) {
+            result->error = stop.error;
+        }
+        s_replay = nullptr;
+    }
+    result->host_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    for (auto &ch : result->channel) {
+        ch.rms = result->compared ? sqrt(ch.rms / result->compared) : 0;
+    }
+
+    if (!result->error.empty()) {
+        return 2;
+    }
+    return result->diverged_ticks || result->lag_max_diff > LAG_TOLERANCE ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+/*
+   Replay of a recording from GET /api/v1/record through the control loop
+   of the firmware, see recorder.h.
+
+   The taps of the firmware are implemented here: while recording they
+   append to a Recorder on the virtual clock, while replaying an input tap
+   overwrites the variable with the next recorded frame of its type and the
+   output tap compares with the recorded outputs. A recorded input of
+   another type than the one the code asks for is a desync, the code path
+   of the recording and of this build differ.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "recorder.h"
+#include "gimbal.h"
+#include "position_store.h"
+
+struct rec_frame {
+    uint16_t type;
+    int64_t time_us;            // unwrapped from the 32 bits recorded
+    std::vector<uint8_t> data;
+};
+
+struct recording {
+    rec_header_t header;
+    std::vector<uint8_t> settings;
+    std::vector<rec_frame> frames;
+};
+
+/**
+ * @brief Parse a download of /api/v1/record
+ * @return false with the reason in error
+ */
+bool recording_parse(const std::vector<uint8_t> &blob, recording *rec, std::string *error);
+bool recording_load(const char *path, recording *rec, std::string *error);
+
+#define REPLAY_CHANNELS     13  // the floats of rec_output_t
+
+struct replay_options {
+    std::vector<std::string> set;   // section.field=value applied to the recorded settings
+    float warmup_s = 0;             // after the keyframe, not compared
+    const char *csv = nullptr;      // recorded and replayed outputs of every tick
+    const char *nmea = nullptr;     // the NMEA lines recorded
+};
+
+struct replay_channel {
+    const char *name;
+    float tolerance;
+    double max_error;
+    double rms;                 // of the compared ticks
+};
+
+struct replay_result {
+    std::string error;              // desync or bad recording, the replay stopped
+    double start_s, end_s;          // of the ticks replayed, device time
+    int ticks;
+    int compared;
+    int targets;                    // aim changes applied
+    int nmea_lines;
+    replay_channel channel[REPLAY_CHANNELS];
+    int state_mismatches;
+    int diverged_ticks;
+    int first_tick;                 // first diverged tick, -1 for none
+    double first_s;
+    std::string first_what;
+    int lag_events;                 // target changes the response was timed for
+    int lag_max_diff;               // ticks, between recorded and replayed response
+    double lag_mean_recorded;       // ticks to the first response of the output
+    int recorded_faults;            // motors entering WARNING or FAULT
+    int replayed_faults;
+    double host_s;
+};
+
+/**
+ * @brief Run the firmware from the first keyframe to the end of the recording
+ * @return 0 within tolerance, 1 diverged, 2 error
+ */
+int replay_run(const recording &rec, const replay_options &options, replay_result *result);
+
+/**
+ * @brief Apply a section.field=value override to the settings, see replay_usage
+ */
+bool replay_set(Setting *settings, const std::string &assignment);
+
+/**
+ * @brief Boot the firmware's Gimbal as a warm reset does, without homing
+ */
+Gimbal *host_boot(const gimbal_position_t &position);
+
+/**
+ * @brief Route the taps to recorder, nullptr stops recording
+ */
+void host_record(Recorder *recorder);